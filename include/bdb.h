@@ -29,6 +29,7 @@
 
 #define BDB_PACK_DATASIZE   255     /* max packed data size */
 #define BDB_MAX_PREFIX_SIZE 255     /* max prefix size */
+#define BDB_LEAF_LATCHES    64      /* number of leaf latches(power of 2) */
 
 #define BDB_COND_EQ         0
 #define BDB_COND_GT         1
@@ -39,6 +40,10 @@
 #define BDB_SEEK_TOP        0
 #define BDB_SEEK_BOTTOM     1
 
+/* range scan flags */
+#define BDB_SCAN_END_INCLUDE    0x01    /* include end key */
+#define BDB_SCAN_KEYONLY        0x02    /* no values */
+
 /* leaf header flag */
 #define PREFIX_COMPRESS_NODE        0x01
 
@@ -57,13 +62,15 @@ struct bdb_value_t {
     int valsize;                    /* value size */
     int64 next_ptr;                 /* next of duplicate key */
     int64 prev_ptr;                 /* prev of duplicate key */
+    int codec;                      /* compression codec(NIO_COMP_*) */
+    int rawsize;                    /* uncompressed value size */
 };
 
 struct bdb_leaf_value_t {
     union {
         struct {
             int valsize;
-            uchar val[BDB_PACK_DATASIZE];
+            uchar* val;             /* points into key arena */
         } pp;
         struct {
             int64 v_ptr;
@@ -73,7 +80,7 @@ struct bdb_leaf_value_t {
 
 struct bdb_leaf_key_t {
     int keysize;
-    uchar key[NIO_MAX_KEYSIZE];
+    uchar* key;                     /* points into key arena */
     struct bdb_leaf_value_t value;
 };
 
@@ -95,19 +102,88 @@ struct bdb_slot_t {
 struct leaf_cache_t {
     struct bdb_leaf_t leaf;
     int alloc_keys;
-    struct bdb_leaf_key_t* keydata;
+    struct bdb_leaf_key_t* keydata; /* key array followed by key arena */
+    int arena_size;                 /* bytes of key arena */
+    int arena_used;                 /* used bytes of key arena */
     int update;
+    int ref;                        /* reference bit of clock */
+    int hnext;                      /* next frame index in hash chain */
+    int pin;                        /* number of shared readers */
+};
+
+/* branch level of bulk load */
+struct bdb_bulk_level_t {
+    char* cur;                      /* node being filled */
+    char* prev;                     /* filled node not written yet */
+    int prev_used;                  /* prev is valid */
+    int cur_sepsize;                /* key to parent of cur(-1 is leftmost) */
+    int prev_sepsize;               /* key to parent of prev(-1 is leftmost) */
+    uchar cur_sep[NIO_MAX_KEYSIZE];
+    uchar prev_sep[NIO_MAX_KEYSIZE];
+};
+
+/* range scan */
+struct bdb_scan_t {
+    char* buf;                      /* keys and values of batch */
+    int bufsize;                    /* allocated size of buf */
+    int used;                       /* used size of buf */
+    struct nio_batch_t* items;      /* records of batch */
+    int* offset;                    /* key and value offsets in buf */
+    int itemsize;                   /* allocated number of items */
+    int count;                      /* number of records in batch */
+    int64 ra_start;                 /* readahead window */
+    int64 ra_end;
+    int lastsize;                   /* last key size(-1 is not delivered) */
+    uchar lastkey[NIO_MAX_KEYSIZE]; /* last key of batch */
+};
+
+/* saved page of snapshot */
+struct bdb_snap_entry_t {
+    int64 ptr;                      /* position in the tree */
+    int64 copy_ptr;                 /* saved contents(zero is allocated later) */
+    int size;                       /* allocated size of copy */
+    int slot;                       /* slot in copy table(-1 is not recorded) */
+    int next;                       /* next entry in hash chain */
+};
+
+/* point-in-time view of the tree */
+struct bdb_snapshot_t {
+    int64 root_ptr;                 /* tree at the snapshot */
+    int64 leaf_top_ptr;
+    int64 leaf_bot_ptr;
+    int64 filesize;                 /* areas after this are not referenced */
+    int* hash;                      /* entry index by ptr */
+    int hash_mask;                  /* hash size - 1 */
+    struct bdb_snap_entry_t* entry;
+    int entry_count;
+    int entry_alloc;
+    struct bdb_snapshot_t* next;    /* next opened snapshot */
+};
+
+/* areas referenced by the tree(reclaimed at open) */
+struct bdb_used_t {
+    int count;
+    int alloc_count;
+    struct nio_extent_t* extent;
 };
 
 /* B+tree */
 struct bdb_t {
     CS_DEF(critical_section);
+    RWLOCK_DEF(tree_latch);             /* readers/writer latch of tree */
+    CS_DEF(pool_critical_section);      /* leaf_pool lock of shared readers and writers */
+    RWLOCK_DEF(leaf_latch[BDB_LEAF_LATCHES]);   /* leaf latches by leaf pointer(shared lock) */
+    int concurrent_read;                /* shared lock for readers(property) */
+    int shared_latch;                   /* tree_latch is used(while opened) */
+    uint tree_version;                  /* incremented by exclusive lock */
     struct nio_t* nio;                  /* (stuct nio_t*) */
     CMP_FUNCPTR cmp_func;               /* compare func */
+    int cmp_kind;                       /* built-in comparator(NIO_CMP_*, -1 is cmp_func) */
     int node_pgsize;                    /* node page size */
     size_t mmap_view_size;              /* mmap view size */
     int fd;                             /* fd */
     ushort fver;                        /* file version */
+    int header_size;                    /* header size(with extension) */
     ushort align_bytes;                 /* key data align bytes */
     int filling_rate;                   /* filling rate(%) */
     int64 root_ptr;                     /* root */
@@ -115,11 +191,25 @@ struct bdb_t {
     int64 leaf_bot_ptr;                 /* last of leaf */
     int dupkey_flag;                    /* enable duplicate key */
     int datapack_flag;                  /* packed data flag */
+    int count_flag;                     /* subtree key counts in branch node */
+    int node_ptrsize;                   /* child pointer size of branch node(with count) */
     char* node_buf;                     /* node I/O buffer(node_pgsize) */
     char* leaf_buf;                     /* leaf I/O buffer(node_pgsize) */
-    struct leaf_cache_t* leaf_cache;    /* leaf I/O cache */
+    struct leaf_cache_t* leaf_cache;    /* current leaf in leaf_pool */
+    struct leaf_cache_t* leaf_pool;     /* leaf cache frames */
+    int leaf_pool_size;                 /* number of leaf cache frames */
+    int leaf_clock;                     /* clock hand of leaf_pool */
+    int* leaf_hash;                     /* frame index by leaf pointer */
+    int leaf_hash_mask;                 /* hash size - 1 */
     int64 filesize;                     /* file size */
     int prefix_compress_flag;           /* enable prefix compress */
+    int cursor_num;                     /* number of opened cursors */
+    struct bdb_snapshot_t* snapshots;   /* opened snapshots */
+    int64* copy_page;                   /* pages of snapshot copy table */
+    int copy_page_num;                  /* number of copy table pages */
+    int copy_count;                     /* used slots of copy table */
+    int compact_keysize;                /* last key size of compaction(zero is top) */
+    uchar compact_key[NIO_MAX_KEYSIZE]; /* last key of compaction */
 };
 
 /* cursor struct */
@@ -128,6 +218,13 @@ struct dbcursor_t {
     int64 node_ptr;                     /* current leaf node pointer */
     int index;                          /* in bdb->leaf_cache->keydata */
     struct bdb_slot_t slot;
+    int prefetch;                       /* prefetch next leaf and values(1 or 0) */
+    int end_keysize;                    /* end key size of range */
+    uchar* end_key;                     /* end key of range(NULL is unbounded) */
+    struct bdb_snapshot_t* snap;        /* snapshot of read-only cursor */
+    struct leaf_cache_t snap_leaf;      /* current leaf of snapshot */
+    int shared;                         /* read under shared lock(1 or 0) */
+    struct leaf_cache_t* pin_leaf;      /* leaf pinned while shared cursor is locked */
 };
 
 /* prototypes */
@@ -147,12 +244,20 @@ int bdb_file(const char* fname);
 int bdb_find(struct bdb_t* bdb, const void* key, int keysize);
 int bdb_get(struct bdb_t* bdb, const void* key, int keysize, void* val, int valsize);
 void* bdb_aget(struct bdb_t* bdb, const void* key, int keysize, int* valsize);
+int bdb_get_view(struct bdb_t* bdb, const void* key, int keysize, struct nio_view_t* view);
 int bdb_put(struct bdb_t* bdb, const void* key, int keysize, const void* val, int valsize);
 int bdb_delete(struct bdb_t* bdb, const void* key, int keysize);
+int bdb_mget(struct bdb_t* bdb, struct nio_batch_t* items, int count);
+int bdb_mput(struct bdb_t* bdb, struct nio_batch_t* items, int count);
+int bdb_mdelete(struct bdb_t* bdb, struct nio_batch_t* items, int count);
+int bdb_bulk_load(struct bdb_t* bdb, BULK_READ_FUNCPTR func, void* arg);
+int bdb_compact(struct bdb_t* bdb, int nleaves);
+int bdb_sync(struct bdb_t* bdb);
 void bdb_free(const void* v);
 
 /* cursor I/O */
 struct dbcursor_t* bdb_cursor_open(struct bdb_t* bdb);
+struct dbcursor_t* bdb_cursor_snapshot(struct bdb_t* bdb);
 void bdb_cursor_close(struct dbcursor_t* cur);
 int bdb_cursor_next(struct dbcursor_t* cur);
 int bdb_cursor_nextkey(struct dbcursor_t* cur);
@@ -165,6 +270,10 @@ int bdb_cursor_key(struct dbcursor_t* cur, void* key, int keysize);
 int bdb_cursor_value(struct dbcursor_t* cur, void* val, int valsize);
 int bdb_cursor_update(struct dbcursor_t* cur, const void* val, int valsize);
 int bdb_cursor_delete(struct dbcursor_t* cur);
+int bdb_cursor_partition(struct bdb_t* bdb, int n, struct dbcursor_t** curs);
+int bdb_scan(struct bdb_t* bdb, const void* start, int startsize, const void* end, int endsize, int flags, SCAN_FUNCPTR func, void* arg);
+int64 bdb_count_range(struct bdb_t* bdb, const void* start, int startsize, const void* end, int endsize, int flags);
+int bdb_cursor_seek_rank(struct dbcursor_t* cur, int64 rank);
 
 #ifdef __cplusplus
 }
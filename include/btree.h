@@ -33,6 +33,9 @@
 
 #define MAX_KEYSIZE 1024
 
+#define BTCURSOR_END        1
+#define BTCURSOR_MAX_DEPTH  32
+
 struct btree_t {
     CS_DEF(critical_section);
     struct btkey_t* btkey;
@@ -53,14 +56,21 @@ struct btk_page_t {
 struct btk_cache_element_t {
     int rpn;                        /* page number */
     struct btk_page_t* page;
-    unsigned int refcnt;
+    int next;                       /* next index of hash chain or free list */
+    int pincnt;                     /* pinned count */
+    int refbit;                     /* referenced bit of CLOCK */
 };
 
 struct btk_cache_t {
     struct btkey_t* btkey;
     int capacity;
-    int count;
+    int count;                      /* number of used frames */
     struct btk_cache_element_t* cache_tbl;  /* [capacity] */
+    char* pagebuf;                  /* pages of cache_tbl(capacity * page_memsize) */
+    int* hash;                      /* page number -> index of cache_tbl */
+    unsigned int hash_mask;
+    int hand;                       /* clock hand */
+    int free_index;                 /* free list of deleted frames */
 };
 
 struct btkey_t {
@@ -75,6 +85,22 @@ struct btkey_t {
     struct btk_page_t* wkpage;
     char* pagebuf;                  /* read/write buffer(pagesize) */
     struct mmap_t* mmap;
+    unsigned int update_count;      /* incremented on page write or delete */
+};
+
+struct btcursor_stack_t {
+    int rpn;                        /* page number */
+    int index;                      /* key index(child index while descending) */
+    struct btk_page_t* page;        /* pinned page or copy */
+    struct btk_page_t* copy;        /* copy of page not in cache */
+};
+
+struct btcursor_t {
+    struct btree_t* bt;
+    int depth;                      /* number of stack entries(zero is not positioned) */
+    unsigned int update_count;      /* btkey->update_count at positioning */
+    char* key;                      /* current key(keysize) */
+    struct btcursor_stack_t stack[BTCURSOR_MAX_DEPTH];
 };
 
 /* prototypes */
@@ -91,6 +117,12 @@ APIEXPORT int btput(struct btree_t* bt, const void* key, int keysize, const void
 APIEXPORT int btsearch(struct btree_t* bt, const void* key, int keysize);
 APIEXPORT int btget(struct btree_t* bt, const void* key, int keysize, void* val, int valsize);
 APIEXPORT int btdelete(struct btree_t* bt, const void* key, int keysize);
+APIEXPORT struct btcursor_t* btcursor_open(struct btree_t* bt);
+APIEXPORT void btcursor_close(struct btcursor_t* cur);
+APIEXPORT int btcursor_seek(struct btcursor_t* cur, const void* key, int keysize);
+APIEXPORT int btcursor_next(struct btcursor_t* cur);
+APIEXPORT int btcursor_key(struct btcursor_t* cur, void* key, int keysize);
+APIEXPORT int btcursor_value(struct btcursor_t* cur, void* val, int valsize);
 
 /* btio.c */
 struct btkey_t* btk_open(const char* fname, int cache_size);
@@ -101,6 +133,9 @@ int btk_avail_page(struct btkey_t* btkey);
 int btk_read_page(struct btkey_t* btkey, int rpn, struct btk_page_t* keypage);
 int btk_write_page(struct btkey_t* btkey, int rpn, struct btk_page_t* keypage);
 int btk_delete_page(struct btkey_t* btkey, int rpn);
+struct btk_page_t* btk_pin_page(struct btkey_t* btkey, int rpn);
+void btk_unpin_page(struct btkey_t* btkey, struct btk_page_t* page);
+void btk_prefetch_page(struct btkey_t* btkey, int rpn);
 
 /* btcache.c */
 struct btk_page_t* btk_alloc_page(struct btkey_t* btkey);
@@ -111,6 +146,9 @@ struct btk_cache_t* btk_cache_alloc(struct btkey_t* btkey, int count);
 void btk_cache_free(struct btk_cache_t* c);
 void btk_cache_copy(struct btk_cache_t* c, struct btk_page_t* dst, struct btk_page_t* src);
 int btk_cache_get(struct btk_cache_t* c, int rpn, struct btk_page_t* page);
+struct btk_page_t* btk_cache_pin(struct btk_cache_t* c, int rpn);
+void btk_cache_unpin(struct btk_cache_t* c, struct btk_page_t* page);
+int btk_cache_find(struct btk_cache_t* c, int rpn);
 void btk_cache_set(struct btk_cache_t* c, int rpn, struct btk_page_t* page);
 void btk_cache_update(struct btk_cache_t* c, int rpn, struct btk_page_t* page);
 void btk_cache_delete(struct btk_cache_t* c, int rpn);
@@ -46,4 +46,38 @@
 #define CS_DELETE(x)    pthread_mutex_destroy(x)
 #endif
 
+/* reader/writer lock macros */
+#ifdef _WIN32
+#define RWLOCK_DEF(x)       SRWLOCK x
+#define RWLOCK_INIT(x)      InitializeSRWLock(x)
+#define RWLOCK_RDLOCK(x)    AcquireSRWLockShared(x)
+#define RWLOCK_WRLOCK(x)    AcquireSRWLockExclusive(x)
+#define RWLOCK_RDUNLOCK(x)  ReleaseSRWLockShared(x)
+#define RWLOCK_WRUNLOCK(x)  ReleaseSRWLockExclusive(x)
+#define RWLOCK_DELETE(x)
+#else
+#define RWLOCK_DEF(x)       pthread_rwlock_t x
+#define RWLOCK_INIT(x)      pthread_rwlock_init(x, NULL)
+#define RWLOCK_RDLOCK(x)    pthread_rwlock_rdlock(x)
+#define RWLOCK_WRLOCK(x)    pthread_rwlock_wrlock(x)
+#define RWLOCK_RDUNLOCK(x)  pthread_rwlock_unlock(x)
+#define RWLOCK_WRUNLOCK(x)  pthread_rwlock_unlock(x)
+#define RWLOCK_DELETE(x)    pthread_rwlock_destroy(x)
+#endif
+
+/* condition variable macros(waits with critical section) */
+#ifdef _WIN32
+#define COND_DEF(x)         CONDITION_VARIABLE x
+#define COND_INIT(x)        InitializeConditionVariable(x)
+#define COND_WAIT(x, cs)    SleepConditionVariableCS(x, cs, INFINITE)
+#define COND_BROADCAST(x)   WakeAllConditionVariable(x)
+#define COND_DELETE(x)
+#else
+#define COND_DEF(x)         pthread_cond_t x
+#define COND_INIT(x)        pthread_cond_init(x, NULL)
+#define COND_WAIT(x, cs)    pthread_cond_wait(x, cs)
+#define COND_BROADCAST(x)   pthread_cond_broadcast(x)
+#define COND_DELETE(x)      pthread_cond_destroy(x)
+#endif
+
 #endif  /* _INCLUDE_CSECT_ */
@@ -27,6 +27,15 @@
 
 #include "nestalib.h"
 
+#define HDB_MAX_SEGMENT     32      /* linear hashing segments */
+
+/* lock stripe */
+struct hdb_stripe_t {
+    RWLOCK_DEF(rwlock);
+    int64 record_num;               /* number of records (linear hashing) */
+    char pad[64];                   /* avoid false sharing */
+};
+
 /* hash database */
 struct hdb_t {
     CS_DEF(critical_section);
@@ -38,6 +47,18 @@ struct hdb_t {
     int fd;                         /* file pointer */
     ushort align_bytes;             /* key data align bytes */
     int filling_rate;               /* filling rate(%) */
+    int lock_stripes;               /* number of lock stripes(0 is single lock) */
+    struct hdb_stripe_t* stripe;    /* lock stripes */
+    int lh_load;                    /* linear hashing load factor(0 is fixed) */
+    int64 lh_state;                 /* linear hashing level(high) and split(low) */
+    int64 record_num;               /* number of records (linear hashing) */
+    int64 segment[HDB_MAX_SEGMENT]; /* bucket segment pointers */
+    int64 segdir_ptr;               /* segment directory pointer */
+    int64 reap_index;               /* next bucket index of expiry reaper */
+    int64 compact_index;            /* next bucket index of compaction */
+    int cursor_num;                 /* number of opened cursors */
+    CS_DEF(split_critical_section);
+    CS_DEF(cursor_critical_section);
 };
 
 /* The implemented function is as follows.
@@ -45,11 +66,15 @@ struct hdb_t {
     hdb_cursor_close()
     hdb_cursor_next()
     hdb_cursor_key()
+    hdb_cursor_partition()
  */
 struct hdbcursor_t {
     struct hdb_t* hdb;              /* hash datatbase object */
     int bucket_index;               /* bucket index (>=0) */
     int64 kvptr;                    /* struct hdb_keyvalue_t pointer */
+    int end_index;                  /* end of bucket range (-1 is last bucket) */
+    int prefetch;                   /* prefetch following buckets(1 or 0) */
+    int prefetch_index;             /* next bucket index to prefetch */
 };
 
 /* prototypes */
@@ -72,10 +97,17 @@ int hdb_get(struct hdb_t* hdb, const void* key, int keysize, void* val, int vals
 int hdb_gets(struct hdb_t* hdb, const void* key, int keysize, void* val, int valsize, int64* cas);
 void* hdb_aget(struct hdb_t* hdb, const void* key, int keysize, int* valsize);
 void* hdb_agets(struct hdb_t* hdb, const void* key, int keysize, int* valsize, int64* cas);
+int hdb_get_view(struct hdb_t* hdb, const void* key, int keysize, struct nio_view_t* view);
 int hdb_put(struct hdb_t* hdb, const void* key, int keysize, const void* val, int valsize);
 int hdb_puts(struct hdb_t* hdb, const void* key, int keysize, const void* val, int valsize, int64 cas);
+int hdb_put_ttl(struct hdb_t* hdb, const void* key, int keysize, const void* val, int valsize, int64 cas, int ttl);
 int hdb_bset(struct hdb_t* hdb, const void* key, int keysize, const void* val, int valsize, int64 cas);
 int hdb_delete(struct hdb_t* hdb, const void* key, int keysize);
+int hdb_mget(struct hdb_t* hdb, struct nio_batch_t* items, int count);
+int hdb_mput(struct hdb_t* hdb, struct nio_batch_t* items, int count);
+int hdb_mdelete(struct hdb_t* hdb, struct nio_batch_t* items, int count);
+int hdb_reap(struct hdb_t* hdb, int nbuckets);
+int hdb_compact(struct hdb_t* hdb, int nbuckets);
 void hdb_free(const void* v);
 
 /* cursor I/O */
@@ -83,6 +115,7 @@ struct hdbcursor_t* hdb_cursor_open(struct hdb_t* bdb);
 void hdb_cursor_close(struct hdbcursor_t* cur);
 int hdb_cursor_next(struct hdbcursor_t* cur);
 int hdb_cursor_key(struct hdbcursor_t* cur, void* key, int keysize);
+int hdb_cursor_partition(struct hdb_t* hdb, int n, struct hdbcursor_t** curs);
 
 #ifdef __cplusplus
 }
@@ -35,16 +35,92 @@
 
 #define MMAP_AUTO_SIZE  0
 
+/* I/O backend */
+#define MMAP_IO_MAP     0   /* memory mapped view(default) */
+#define MMAP_IO_FILE    1   /* pread/pwrite(or io_uring) with buffer pool */
+
+#define MMAP_POOL_PAGESIZE  4096    /* page size of buffer pool */
+
+/* access pattern hint */
+#define MMAP_ADVISE_NORMAL      0   /* default readahead */
+#define MMAP_ADVISE_RANDOM      1   /* random access, no readahead */
+#define MMAP_ADVISE_SEQUENTIAL  2   /* sequential access, aggressive readahead */
+#define MMAP_ADVISE_WILLNEED    3   /* read in advance */
+#define MMAP_ADVISE_HUGEPAGE    4   /* use huge pages if possible */
+
+/* write hook API */
+typedef int (*MMAP_WRITE_HOOK)(void* arg, int64 offset, const void* before, int bsize, const void* after, int size);
+typedef int (*MMAP_FLUSH_HOOK)(void* arg);
+
+struct mmap_retire_t {
+    void* ptr;                  /* pointer of old view */
+    int64 size;                 /* size of old view */
+#ifdef _WIN32
+    HANDLE hMap;
+#endif
+    struct mmap_retire_t* next; /* next retired view */
+};
+
+/* page frame of buffer pool */
+struct mmap_frame_t {
+    int64 offset;       /* file offset of page(-1 is unused) */
+    int next;           /* next frame in hash chain(-1 is end) */
+    uchar refbit;       /* referenced since last sweep of clock */
+    uchar dirty;        /* modified and not written yet */
+    uchar flushing;     /* being written by write-back */
+    uchar loading;      /* read is in flight(1 is pread, 2 is io_uring) */
+};
+
+struct mmap_uring_t;
+
+/* buffer pool of MMAP_IO_FILE */
+struct mmap_pool_t {
+    int count;                      /* number of frames */
+    char* data;                     /* page data of frames */
+    struct mmap_frame_t* frame;     /* frames */
+    int* hash;                      /* frame index by page(-1 is empty) */
+    int hash_mask;                  /* hash size - 1 */
+    int hand;                       /* clock hand */
+    int dirty_count;                /* number of dirty frames */
+    CS_DEF(critical_section);       /* lock for frames(not held during I/O) */
+    COND_DEF(frame_cond);           /* signaled when loading or flushing ends */
+    int reaping;                    /* a thread is waiting for io_uring completions */
+    CS_DEF(flush_critical_section); /* serializes write-back */
+    char* stage;                    /* copies of pages being written back */
+    int* stage_index;               /* frame index of stage */
+    struct mmap_uring_t* read_ring; /* batched reads(NULL is pread) */
+    struct mmap_uring_t* write_ring;/* write-back(NULL is pwrite) */
+    volatile int end_flag;          /* stop request of write-back thread */
+    int running;                    /* write-back thread is running(1 or 0) */
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+};
+
 struct mmap_t {
     int open_mode;      /* open mode */
     int fd;             /* fileno */
     int64 size;         /* map size */
     int64 real_size;    /* real file size */
     void* ptr;          /* pointer in view */
+    int64 reserve_size; /* reserved address space size, zero is not reserved */
+    int advice;         /* access pattern hint of whole view(MMAP_ADVISE_*) */
+    struct mmap_pool_t* pool;   /* buffer pool of MMAP_IO_FILE(NULL is mapped) */
     int64 offset;       /* current position in view */
     int64 view_offset;  /* view offset */
     int64 view_size;    /* map view size, zero is same map size */
     size_t pgsize;      /* page size for view offset */
+    int mt_safe;        /* multi-thread access(1 or 0) */
+    RWLOCK_DEF(map_lock); /* lock for remapping */
+    CS_DEF(pin_critical_section);   /* lock for pin count */
+    int pin_count;      /* number of pinned regions */
+    struct mmap_retire_t* retire;   /* old views kept alive while pinned */
+    MMAP_WRITE_HOOK write_hook;     /* called before writing */
+    void* hook_arg;     /* argument of write hook */
+    MMAP_FLUSH_HOOK flush_hook;     /* called before writing back pages of buffer pool */
+    void* flush_arg;    /* argument of flush hook */
 #ifdef _WIN32
     HANDLE hFile;
     HANDLE hMap;
@@ -57,6 +133,7 @@ extern "C" {
 #endif
 
 APIEXPORT struct mmap_t* mmap_open(int fd, int mode, int64 view_size);
+APIEXPORT struct mmap_t* mmap_open_pool(int fd, int mode, int64 pool_size);
 APIEXPORT void mmap_close(struct mmap_t* map);
 APIEXPORT char* mmap_map(struct mmap_t* map, int64 size);
 APIEXPORT char* mmap_mapping(struct mmap_t* map, int64 offset, int64 size);
@@ -64,6 +141,19 @@ APIEXPORT int64 mmap_seek(struct mmap_t* map, int64 offset);
 APIEXPORT size_t mmap_read(struct mmap_t* map, void* data, size_t size);
 APIEXPORT size_t mmap_write(struct mmap_t* map, const void* data, size_t size);
 APIEXPORT int mmap_resize(struct mmap_t* map, int64 size);
+APIEXPORT void mmap_mtsafe(struct mmap_t* map, int flag);
+APIEXPORT size_t mmap_pread(struct mmap_t* map, void* data, size_t size, int64 offset);
+APIEXPORT size_t mmap_pwrite(struct mmap_t* map, const void* data, size_t size, int64 offset);
+APIEXPORT int64 mmap_extend(struct mmap_t* map, int64 size);
+APIEXPORT char* mmap_pin(struct mmap_t* map, int64 offset, int64 size);
+APIEXPORT void mmap_unpin(struct mmap_t* map);
+APIEXPORT void mmap_prefetch(struct mmap_t* map, int64 offset, int64 size);
+APIEXPORT int mmap_advise(struct mmap_t* map, int64 offset, int64 size, int advice);
+APIEXPORT int mmap_lock(struct mmap_t* map, int64 offset, int64 size);
+APIEXPORT int mmap_unlock(struct mmap_t* map, int64 offset, int64 size);
+APIEXPORT void mmap_write_hook(struct mmap_t* map, MMAP_WRITE_HOOK func, void* arg);
+APIEXPORT void mmap_flush_hook(struct mmap_t* map, MMAP_FLUSH_HOOK func, void* arg);
+APIEXPORT int mmap_sync(struct mmap_t* map);
 
 #ifdef __cplusplus
 }
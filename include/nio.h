@@ -41,6 +41,38 @@
 #define NIO_DUPLICATE_KEY   6   /* duplicates key(1 or 0)(only B+tree) */
 #define NIO_DATAPACK        7   /* packed key & data(1 or 0)(only B+tree) */
 #define NIO_PREFIX_COMPRESS 8   /* prefix compress key(1 or 0)(only B+tree) */
+#define NIO_LOCK_STRIPES    9   /* number of lock stripes(only hash) */
+#define NIO_LINEAR_HASH     10  /* load factor of linear hashing(only hash) */
+#define NIO_WAL             11  /* write-ahead log(1 or 0) */
+#define NIO_WAL_COMMIT_WAIT 12  /* group commit wait(microseconds) */
+#define NIO_WAL_SYNC_INTERVAL 13 /* log sync interval(milliseconds), zero is every commit */
+#define NIO_REAP_INTERVAL   14  /* expiry reaper interval(milliseconds)(only hash) */
+#define NIO_REAP_BUCKETS    15  /* buckets per reaper interval(only hash) */
+#define NIO_LEAF_CACHE      16  /* number of cached leaves(only B+tree) */
+#define NIO_CONCURRENT_READ 17  /* readers and non-splitting writers run per leaf(1 or 0)(only B+tree) */
+#define NIO_ORDER_STAT      18  /* subtree key counts in branch nodes(1 or 0)(only B+tree) */
+#define NIO_KEY_COMPARE     19  /* built-in key comparator(NIO_CMP_*)(only B+tree) */
+#define NIO_COMPRESS        20  /* value compression codec(NIO_COMP_*) */
+#define NIO_COMPRESS_THRESHOLD 21 /* compress values of this size or more(bytes) */
+#define NIO_MMAP_ADVICE     22  /* access pattern hint of the file(MMAP_ADVISE_*) */
+#define NIO_MMAP_LOCK       23  /* lock hot metadata in memory(1 or 0) */
+#define NIO_IO_BACKEND      24  /* file access method(MMAP_IO_*) */
+#define NIO_IO_POOL_SIZE    25  /* buffer pool size of MMAP_IO_FILE(MB) */
+
+/* built-in key comparators */
+#define NIO_CMP_MEMCMP      0   /* bytes in ascending order(default) */
+#define NIO_CMP_UINT64BE    1   /* 8 bytes big-endian unsigned integer */
+#define NIO_CMP_INT64       2   /* 8 bytes native signed integer, other sizes are rejected */
+#define NIO_CMP_REVERSE     3   /* bytes in descending order */
+#define NIO_CMP_CASE        4   /* ASCII case-insensitive bytes */
+#define NIO_CMP_MAX         NIO_CMP_CASE
+
+/* value compression codec */
+#define NIO_COMP_NONE       0   /* not compressed(default) */
+#define NIO_COMP_ZLIB       1   /* zlib deflate */
+#define NIO_COMP_LZ         2   /* fast LZ */
+#define NIO_COMP_MAX        NIO_COMP_LZ
+#define NIO_COMP_THRESHOLD  256 /* default threshold(bytes) */
 
 #define NIO_MAX_KEYSIZE     1024
 
@@ -50,6 +82,7 @@
 #define NIO_FREEDATA_OFFSET         16
 
 #define NIO_FREEPAGE_ID             0xCCEE
+#define NIO_SIZE_CLASS              32
 
 #define NIO_FREEPAGE_NEXT_OFFSET    2
 #define NIO_FREEPAGE_COUNT_OFFSET   14
@@ -66,6 +99,26 @@ typedef int (*CMP_FUNCPTR)(const void * key1, int key1size, const void* key2, in
 /* hash function API */
 typedef unsigned int (*HASH_FUNCPTR)(const void * key, int len, unsigned int seed);
 
+struct nio_view_t {
+    const void* val;    /* pointer of value */
+    int valsize;        /* value size */
+    int pinned;         /* pinned on memory map(1) or allocated(0) */
+};
+
+struct nio_batch_t {
+    const void* key;    /* pointer of key */
+    int keysize;        /* key size */
+    void* val;          /* value buffer(get) or value(put) */
+    int valsize;        /* buffer size(get) or value size(put) */
+    int result;         /* result of each key */
+};
+
+/* bulk load input, returns 1(item is set), 0(end) or -1(error) */
+typedef int (*BULK_READ_FUNCPTR)(void* arg, struct nio_batch_t* item);
+
+/* range scan output, returns zero to continue */
+typedef int (*SCAN_FUNCPTR)(void* arg, struct nio_batch_t* items, int count);
+
 #include "bdb.h"
 #include "hdb.h"
 
@@ -81,11 +134,17 @@ typedef int (*GET_FUNCPTR)(void* db, const void* key, int keysize, void* val, in
 typedef int (*GETS_FUNCPTR)(void* db, const void* key, int keysize, void* val, int valsize, int64* cas);
 typedef void* (*AGET_FUNCPTR)(void* db, const void* key, int keysize, int* valsize);
 typedef void* (*AGETS_FUNCPTR)(void* db, const void* key, int keysize, int* valsize, int64* cas);
+typedef int (*GET_VIEW_FUNCPTR)(void* db, const void* key, int keysize, struct nio_view_t* view);
 typedef int (*PUT_FUNCPTR)(void* db, const void* key, int keysize, const void* val, int valsize);
 typedef int (*PUTS_FUNCPTR)(void* db, const void* key, int keysize, const void* val, int valsize, int64 cas);
 typedef int (*BSET_FUNCPTR)(void* db, const void* key, int keysize, const void* val, int valsize, int64 cas);
+typedef int (*PUT_TTL_FUNCPTR)(void* db, const void* key, int keysize, const void* val, int valsize, int64 cas, int ttl);
+typedef int (*REAP_FUNCPTR)(void* db, int nbuckets);
+typedef int (*COMPACT_FUNCPTR)(void* db, int nitems);
 typedef int (*DELETE_FUNCPTR)(void* db, const void* key, int keysize);
 typedef void (*FREE_FUNCPTR)(const void* v);
+typedef int (*SYNC_FUNCPTR)(void* db);
+typedef int (*BATCH_FUNCPTR)(void* db, struct nio_batch_t* items, int count);
 
 /* cursor function API */
 typedef void* (*CURSOR_OPEN_FUNCPTR)(void* db);
@@ -101,6 +160,7 @@ typedef int (*CURSOR_KEY_FUNCPTR)(void* cur, void* key, int keysize);
 typedef int (*CURSOR_VALUE_FUNCPTR)(void* cur, void* val, int valsize);
 typedef int (*CURSOR_UPDATE_FUNCPTR)(void* cur, const void* val, int valsize);
 typedef int (*CURSOR_DELETE_FUNCPTR)(void* cur);
+typedef int (*CURSOR_PARTITION_FUNCPTR)(void* db, int n, void** curs);
 
 struct nio_free_t {
     int64 offset;
@@ -110,10 +170,107 @@ struct nio_free_t {
     int64 next_ptr;
 };
 
+struct nio_free_entry_t {
+    int64 ptr;                      /* free area pointer */
+    int size;                       /* free area size */
+    int page;                       /* index of free page */
+    int slot;                       /* index in free page */
+    int prev;                       /* prev entry of size class(-1 is none) */
+    int next;                       /* next entry of size class(-1 is none) */
+};
+
+struct nio_free_page_t {
+    int64 offset;                   /* free page pointer */
+    int count;                      /* number of entries */
+    int prev;                       /* prev page of chain(-1 is head) */
+    int next;                       /* next page of chain(-1 is last) */
+    int entry[NIO_FREE_COUNT];      /* entry index of each slot */
+};
+
+struct nio_free_index_t {
+    int head;                       /* head page(-1 is none) */
+    unsigned int class_map;         /* bitmap of non-empty size classes */
+    int class_head[NIO_SIZE_CLASS]; /* entry list of each size class */
+    int entry_num;
+    int entry_free;                 /* released entry list */
+    struct nio_free_entry_t* entry;
+    int page_num;
+    int page_free;                  /* released page list */
+    struct nio_free_page_t* page;
+};
+
+struct nio_extent_t {
+    int64 ptr;                      /* area pointer */
+    int64 size;                     /* area size */
+    int entry;                      /* free index entry */
+};
+
+struct nio_compact_t {
+    int64 start_size;               /* file size at start */
+    int64 watermark;                /* records after this are relocated */
+    int count;                      /* number of free extents */
+    int alloc_count;
+    struct nio_extent_t* extent;    /* free extents(address order) */
+};
+
+struct nio_wal_tx_t {
+    struct nio_wal_tx_t* next;      /* next state of other thread */
+    int depth;                      /* nesting level of scoped transaction */
+    int writes;                     /* number of logged writes */
+    int64 txid;                     /* id of current transaction */
+    int64 outer_txid;               /* transaction suspended by free space update */
+    int64 lsn;                      /* end of last commit record */
+    int free_count;                 /* areas freed at commit */
+    int free_alloc;
+    struct nio_extent_t* free;
+};
+
+struct nio_wal_t {
+    int fd;                         /* log file descriptor */
+    CS_DEF(critical_section);       /* log append lock */
+    CS_DEF(sync_critical_section);  /* log sync lock */
+    RWLOCK_DEF(tx_rwlock);          /* shared by scoped transactions, exclusive by others */
+#ifdef _WIN32
+    DWORD tx_key;                   /* thread local transaction state */
+#else
+    pthread_key_t tx_key;
+#endif
+    struct nio_wal_tx_t* tx_list;   /* transaction states of all threads */
+    int64 txid;                     /* last transaction id */
+    int orphan_count;               /* areas allocated by uncommitted transactions */
+    struct nio_extent_t* orphan;
+    int64 write_pos;                /* end of log */
+    int64 sync_pos;                 /* synced position of log */
+    int64 sync_time;                /* last sync time(usec) */
+};
+
 struct nio_t {
     int dbtype;                     /* database type */
+    int wal_flag;                   /* write-ahead log(1 or 0) */
+    int wal_commit_wait;            /* group commit wait(usec) */
+    int wal_sync_interval;          /* log sync interval(msec) */
+    int wal_scoped;                 /* transactions are scoped by database locks(1 or 0) */
+    int comp_codec;                 /* value compression codec(NIO_COMP_*) */
+    int comp_threshold;             /* compress values of this size or more */
+    int mmap_advice;                /* access pattern hint of the file(MMAP_ADVISE_*) */
+    int mmap_lock_flag;             /* lock hot metadata in memory(1 or 0) */
+    int io_backend;                 /* file access method(MMAP_IO_*), -1 is default */
+    int io_pool_size;               /* buffer pool size(MB), zero is default */
+    struct nio_wal_t* wal;          /* write-ahead log */
+    int reap_interval;              /* expiry reaper interval(msec), zero is not running */
+    int reap_buckets;               /* buckets per reaper interval */
+    volatile int reap_end_flag;     /* stop request of reaper thread */
+    int reap_running;               /* reaper thread is running(1 or 0) */
+#ifdef _WIN32
+    HANDLE reap_thread;
+#else
+    pthread_t reap_thread;
+#endif
+    CS_DEF(free_critical_section);  /* free space manager lock */
     int64 free_ptr;                 /* free area pointer */
     struct nio_free_t* free_page;
+    struct nio_free_index_t* free_index; /* free space index(NULL is not loaded) */
+    struct nio_compact_t* compact;  /* compaction session(NULL is not running) */
     struct mmap_t* mmap;
     void* db;                       /* struct hdb_t*|struct bdb_t* */
 
@@ -129,11 +286,19 @@ struct nio_t {
     GETS_FUNCPTR gets_func;
     AGET_FUNCPTR aget_func;
     AGETS_FUNCPTR agets_func;
+    GET_VIEW_FUNCPTR get_view_func;
     PUT_FUNCPTR put_func;
     PUTS_FUNCPTR puts_func;
     BSET_FUNCPTR bset_func;
+    PUT_TTL_FUNCPTR put_ttl_func;
+    REAP_FUNCPTR reap_func;
+    COMPACT_FUNCPTR compact_func;
     DELETE_FUNCPTR delete_func;
     FREE_FUNCPTR free_func;
+    BATCH_FUNCPTR mget_func;
+    BATCH_FUNCPTR mput_func;
+    BATCH_FUNCPTR mdelete_func;
+    SYNC_FUNCPTR sync_func;
 
     /* cursor function pointer */
     CURSOR_OPEN_FUNCPTR cursor_open_func;
@@ -149,6 +314,7 @@ struct nio_t {
     CURSOR_VALUE_FUNCPTR cursor_value_func;
     CURSOR_UPDATE_FUNCPTR cursor_update_func;
     CURSOR_DELETE_FUNCPTR cursor_delete_func;
+    CURSOR_PARTITION_FUNCPTR cursor_partition_func;
 };
 
 struct nio_cursor_t {
@@ -170,6 +336,17 @@ int64 nio_filesize(struct nio_t* nio);
 int nio_create_free_page(struct nio_t* nio);
 int nio_add_free_list(struct nio_t* nio, int64 ptr, int size);
 int64 nio_avail_space(struct nio_t* nio, int size, int* areasize, int filling_rate);
+int64 nio_extend_space(struct nio_t* nio, int64 size);
+int64 nio_compact_space(struct nio_t* nio, int size, int* areasize, int filling_rate, int64 ptr);
+int64 nio_reclaim_space(struct nio_t* nio, int64 start, const struct nio_extent_t* used, int count);
+int nio_wal_recover(struct nio_t* nio, int fd);
+int nio_wal_checkpoint(struct nio_t* nio);
+void nio_tx_begin(struct nio_t* nio);
+void nio_tx_end(struct nio_t* nio);
+char* nio_value_compress(struct nio_t* nio, const void* val, int valsize, int* csize, int* codec);
+int nio_value_rawsize(const void* cval);
+int nio_value_uncompress(int codec, const void* cval, int csize, void* val, int valsize);
+struct mmap_t* nio_mmap_open(struct nio_t* nio, int fd, int64 view_size);
 
 struct nio_t* nio_initialize(int dbtype);
 void nio_finalize(struct nio_t* nio);
@@ -185,14 +362,26 @@ int nio_get(struct nio_t* nio, const void* key, int keysize, void* val, int vals
 int nio_gets(struct nio_t* nio, const void* key, int keysize, void* val, int valsize, int64* cas);
 void* nio_aget(struct nio_t* nio, const void* key, int keysize, int* valsize);
 void* nio_agets(struct nio_t* nio, const void* key, int keysize, int* valsize, int64* cas);
+int nio_get_view(struct nio_t* nio, const void* key, int keysize, struct nio_view_t* view);
+void nio_release_view(struct nio_t* nio, struct nio_view_t* view);
 int nio_put(struct nio_t* nio, const void* key, int keysize, const void* val, int valsize);
 int nio_puts(struct nio_t* nio, const void* key, int keysize, const void* val, int valsize, int64 cas);
+int nio_put_ttl(struct nio_t* nio, const void* key, int keysize, const void* val, int valsize, int64 cas, int ttl);
 int nio_bset(struct nio_t* nio, const void* key, int keysize, const void* val, int valsize, int64 cas);
 int nio_delete(struct nio_t* nio, const void* key, int keysize);
+int nio_mget(struct nio_t* nio, struct nio_batch_t* items, int count);
+int nio_mput(struct nio_t* nio, struct nio_batch_t* items, int count);
+int nio_mdelete(struct nio_t* nio, struct nio_batch_t* items, int count);
+int nio_bulk_load(struct nio_t* nio, BULK_READ_FUNCPTR func, void* arg);
+int nio_scan(struct nio_t* nio, const void* start, int startsize, const void* end, int endsize, int flags, SCAN_FUNCPTR func, void* arg);
+int64 nio_count_range(struct nio_t* nio, const void* start, int startsize, const void* end, int endsize, int flags);
+int nio_reap(struct nio_t* nio, int nbuckets);
+int nio_compact(struct nio_t* nio, int nitems, int64* reclaimed);
 void nio_free(struct nio_t* nio, const void* v);
 
 /* cursor I/O */
 struct nio_cursor_t* nio_cursor_open(struct nio_t* nio);
+struct nio_cursor_t* nio_cursor_snapshot(struct nio_t* nio);
 void nio_cursor_close(struct nio_cursor_t* cur);
 int nio_cursor_next(struct nio_cursor_t* cur);
 int nio_cursor_nextkey(struct nio_cursor_t* cur);
@@ -201,10 +390,12 @@ int nio_cursor_prevkey(struct nio_cursor_t* cur);
 int nio_cursor_duplicate_last(struct nio_cursor_t* cur);
 int nio_cursor_find(struct nio_cursor_t* cur, int cond, const void* key, int keysize);
 int nio_cursor_seek(struct nio_cursor_t* cur, int pos);
+int nio_cursor_seek_rank(struct nio_cursor_t* cur, int64 rank);
 int nio_cursor_key(struct nio_cursor_t* cur, void* key, int keysize);
 int nio_cursor_value(struct nio_cursor_t* cur, void* val, int valsize);
 int nio_cursor_update(struct nio_cursor_t* cur, const void* val, int valsize);
 int nio_cursor_delete(struct nio_cursor_t* cur);
+int nio_cursor_partition(struct nio_t* nio, int n, struct nio_cursor_t** curs);
 
 #ifdef __cplusplus
 }
@@ -35,6 +35,8 @@ extern "C" {
 APIEXPORT char* gz_comp(const char* src_buf, int src_size, int* comp_size);
 APIEXPORT char* gz_decomp(const char* comp_buf, int comp_size, int* size);
 APIEXPORT void gz_free(const char* ptr);
+APIEXPORT int lz_comp(const char* src_buf, int src_size, char* comp_buf, int comp_bufsize);
+APIEXPORT int lz_decomp(const char* comp_buf, int comp_size, char* buf, int bufsize);
 
 #ifdef __cplusplus
 }
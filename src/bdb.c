@@ -69,9 +69,9 @@
  *
  *-------------------------------------------------------------------
  * ブランチノード
- * +------+------+--------+----+---+-----+---+---+-----+---+---+
- * |0xBBEE|keynum|nodesize|(10)|ptr|ksize|key|ptr|ksize|key|ptr|...
- * +------+------+--------+----+---+-----+---+---+-----+---+---+
+ * +------+------+--------+----+----+---+-----+---+---+-----+---+---+
+ * |0xBBEE|keynum|nodesize|flag|(9)|ptr|ksize|key|ptr|ksize|key|ptr|...
+ * +------+------+--------+----+----+---+-----+---+---+-----+---+---+
  *
  * リーフ
  * +------+------+--------+----+----+----+---+-----+---+----+-----+---+----+
@@ -114,16 +114,112 @@
  *
  * 2013/11/15
  * BDB_FILE_VERSION を 10 から 11 に変更した。
+ *
+ * リーフキャッシュは複数のリーフを保持するバッファプールとした。
+ * bdb->leaf_cache は最後に参照したリーフのフレームを指す。
+ * フレームはリーフのポインタによるハッシュで検索され、CLOCK 方式で置換される。
+ * 更新されたリーフは置換時か bdb_sync() でポインタ順にまとめて書き出される。
+ * キャッシュを経由しないリーフの読み込みと更新は
+ * get_leaf(), update_leaf(), put_leaf_keybuf() でフレームと同期される。
+ * キャッシュするリーフ数はプロパティ(NIO_LEAF_CACHE)で指定する。
+ *
+ * プロパティ(NIO_CONCURRENT_READ)を指定してオープンした場合は
+ * クリティカルセクションの代わりに木全体のリーダー／ライターロック
+ * (bdb->tree_latch)で排他制御する。
+ * bdb_find(), bdb_get(), bdb_aget(), bdb_get_view(), bdb_mget() は
+ * 共有ロックで並行に処理され、更新とカーソルは排他ロックで処理される。
+ * スナップショットと分割(bdb_cursor_partition())のカーソルの参照も
+ * 共有ロックで処理される。
+ * 共有ロックの参照はファイルの現在位置を使用せずに位置を指定して読み込み、
+ * bdb->leaf_cache は変更しない。
+ * リーフはフレームを固定(pin)して参照し、フレームの検索と読み込みは
+ * bdb->pool_critical_section で排他する。更新されているフレームは
+ * 置換せずに、空きフレームがない場合は一時的なフレームに読み込む。
+ *
+ * bdb_put() はブランチノードを変更しない更新(キーの値の置換と
+ * 分割が不要なキーの追加)を木の共有ロックの中でリーフラッチを使用して
+ * 処理する(put_in_leaf())。リーフラッチはリーフのポインタで選択する
+ * BDB_LEAF_LATCHES 個のリーダー／ライターロック(bdb->leaf_latch)で、
+ * 参照はリーフを共有ラッチして値を読み終わるまでフレームを固定し、
+ * 更新はリーフを排他ラッチしてバッファプールのフレームを書き換える。
+ * 異なるリーフへの更新と参照は並行に処理される。
+ * 更新したフレームは遅延書き込みされ、値の領域は nio の空き領域の
+ * ロックで割り当てて位置を指定して書き出す。
+ * ロックは木、リーフラッチ、bdb->pool_critical_section(と nio の
+ * 空き領域のロック)の順に取得し、リーフラッチは同時にひとつだけ取得する。
+ * リーフの分割と削除、キー数を持つ木(NIO_ORDER_STAT)へのキーの追加、
+ * 重複キー、スナップショットがある間の更新、フレームに空きがない場合、
+ * バッチとカーソルの更新は木全体の排他ロックで処理される。
+ *
+ * bdb_bulk_load() はキー順に並んだ入力から空のデータベースを作成する。
+ * リーフを左から順に充填率の分を空けて書き出し、リーフの先頭キーを
+ * 区切りキーとしてブランチノードを下のレベルから順に作成する。
+ * 各レベルの最後の２つのノードはキーを再配分して過疎状態にしない。
+ *
+ * ファイルバージョン 12 からブランチノードの最後にスロットディレクトリを置く。
+ * スロットはキー順に並び、キーのオフセットとキーサイズとキーの先頭４バイトの
+ * フィンガープリント(ビッグエンディアンの整数)を持つ。
+ * ノードの検索はキーを解析せずにスロットで２分探索を行い、標準の比較関数の
+ * 場合はフィンガープリントが異なればキーを比較せずに大小を決定する。
+ * ディレクトリは write_node() で作成され、flag に SLOT_DIRECTORY_NODE が
+ * 立っているノードだけが使用する。キーとディレクトリがページに収まらない
+ * ノードはディレクトリなしで書き出される。
+ *
+ *                                               (node_pgsize - keynum * 8)
+ * +----------+---+-----+---+---+-- ... --+------+------+-----+------+------+-----+
+ * |header(16)|ptr|ksize|key|ptr|         |fp(4) |off(2)|ks(2)|fp(4) |off(2)|ks(2)|
+ * +----------+---+-----+---+---+-- ... --+------+------+-----+------+------+-----+
+ *
+ * プロパティ(NIO_ORDER_STAT)を指定して作成したファイルはブランチノードの
+ * 子孫ポインタの後に部分木のリーフにあるキー数(8バイト)を持つ
+ * (bdb->node_ptrsize が 16 になる)。キー数はポインタと一緒に移動するため
+ * ノードの分割、連結、再配分ではキー数が変わるノードの分だけ設定し直す。
+ * リーフへのキーの追加と削除はルートからの経路のキー数を増減する。
+ * bdb_cursor_seek_rank() と bdb_count_range() はキー数をたどって
+ * 順位からの位置づけと範囲のキー数を O(log n) で求める。
+ * 重複キーはひとつのキーとして数える。
+ *
+ * bdb_scan() は範囲のキーと値をリーフ単位で読み込んでまとめて関数に渡す。
+ * 関数の呼び出し中はロックを解放し、木が更新されていなければ(bdb->tree_version)
+ * 次のリーフから続け、更新されていれば最後に渡したキーから検索し直す。
+ *
+ * bdb_cursor_snapshot() は作成した時点の木を参照する読み込み専用のカーソルを返す。
+ * 更新はページをその場で書き換えるが、スナップショットが参照する領域を
+ * 最初に更新または解放する前に元の内容を新しい領域に複写する(copy-on-write)。
+ * スナップショットは元の位置から複写した位置へのハッシュ表(bdb_snapshot_t)を持ち、
+ * カーソルは位置を変換して共有ロックで読み込む。作成後に割り当てた領域は
+ * 複写しないように登録する。複写した領域はそれを参照する最後のスナップショットが
+ * クローズされたときに空きリストに戻される。
+ * 複写した領域はファイルの複写表に記録しておき、異常終了して複写表が残って
+ * いる場合はオープン時に記録されている領域を空きリストに戻す。
+ * 複写表は拡張ヘッダー(ファイルバージョン 13)から連結されたページで、
+ * 領域の解放時にエントリをクリアし、最後のスナップショットのクローズで
+ * ページも解放する。バージョン 12 以前のファイルはスナップショットがある間
+ * ヘッダーにフラグを設定しておき、フラグが残っている場合はオープン時に
+ * 木から参照されていない領域を回収する。
+ *
+ * 複写表のページ
+ * +------+----+-----+---+---+----+---+----+----
+ * |0xBBCC|next|count|(4)|ptr|size|ptr|size|...
+ * +------+----+-----+---+---+----+---+----+----
+ *  next(8): 次のページの位置、count(2): 使用したエントリ数
+ *  ptr(8): 複写した領域の位置(ゼロは解放済み)、size(4): 領域のサイズ
  *-------------------------------------------------------------------
  */
 
 /* ヘッダー・ブロック */
 #define BDB_HEADER_SIZE             64
+#define BDB_HEADER_EXT_SIZE         64  /* extended header(version 13) */
 #define BDB_FILEID                  "NBTK"
-#define BDB_FILE_VERSION            11
+#define BDB_FILE_VERSION            13
+#define BDB_SLOT_FILE_VERSION       12  /* slot directory of branch node */
+#define BDB_EXT_FILE_VERSION        13  /* extended header */
 #define BDB_TYPE_BTREE              0x02
 #define BDB_TYPE_BTREE_DUPKEY       0x10
 #define BDB_TYPE_BTREE_DATAPACK     0x20
+#define BDB_TYPE_BTREE_COUNT        0x40
+#define BDB_TYPE_CMP_MASK           0x0F00  /* built-in comparator */
+#define BDB_TYPE_CMP_SHIFT          8
 
 #define BDB_VERSION_OFFSET          4
 #define BDB_FILETYPE_OFFSET         6
@@ -135,6 +231,17 @@
 #define BDB_LEAFTOP_OFFSET          38
 #define BDB_LEAFBOT_OFFSET          46
 #define BDB_FILESIZE_OFFSET         54
+#define BDB_SNAPSHOT_OFFSET         62  /* 1: snapshot copies may remain(before version 13) */
+#define BDB_COPYTABLE_OFFSET        64  /* copy table of snapshots(version 13) */
+
+/* スナップショットの複写表：位置(8) + サイズ(4) */
+#define BDB_COPYPAGE_SIZE           4096
+#define BDB_COPYPAGE_ID             0xBBCC
+#define BDB_COPYPAGE_NEXT_OFFSET    2
+#define BDB_COPYPAGE_COUNT_OFFSET   10
+#define BDB_COPYPAGE_ARRAY_OFFSET   16
+#define BDB_COPY_ENTRY_SIZE         12
+#define BDB_COPY_COUNT              ((BDB_COPYPAGE_SIZE-BDB_COPYPAGE_ARRAY_OFFSET)/BDB_COPY_ENTRY_SIZE)
 
 /* ブランチノード */
 #define BDB_NODE_SIZE               16
@@ -142,9 +249,22 @@
 
 #define BDB_NODE_KEYNUM_OFFSET      2
 #define BDB_NODE_SIZE_OFFSET        4
-// aux: 10bytes
+#define BDB_NODE_FLAG_OFFSET        6
+// aux: 9bytes
 #define BDB_NODE_KEY_OFFSET         BDB_NODE_SIZE
 
+/* ブランチノードのフラグ */
+#define SLOT_DIRECTORY_NODE         0x01
+
+/* スロット：フィンガープリント(4) + オフセット(2) + キーサイズ(2) */
+#define BDB_NODE_SLOT_SIZE          8
+
+/* キー数を持つ子孫ポインタ：ポインタ(8) + 部分木のキー数(8) */
+#define BDB_NODE_CPTR_SIZE          16
+
+/* メモリに固定するブランチノードの最大数 */
+#define BDB_LOCK_NODES              1024
+
 /* リーフノード */
 #define BDB_LEAF_SIZE               32
 #define BDB_LEAF_ID                 0xAAEE
@@ -164,6 +284,8 @@
 #define BDB_VALUE_DSIZE_OFFSET      4
 #define BDB_VALUE_NEXT_OFFSET       8
 #define BDB_VALUE_PREV_OFFSET       16
+#define BDB_VALUE_CODEC_OFFSET      24  /* 圧縮方式(NIO_COMP_*) */
+#define BDB_VALUE_RSIZE_OFFSET      28  /* 圧縮前のデータサイズ */
 
 /* ノードページサイズ */
 #define DEFAULT_PAGE_SIZE           4096
@@ -171,7 +293,41 @@
 #define BDB_KEY_NOTFOUND            0
 #define BDB_KEY_FOUND               1
 
+/* bdb_cmpfunc() で設定された比較関数を使用します。*/
+#define BDB_CMP_FUNC                -1
+
+/* リーフキャッシュ */
+#define DEFAULT_LEAF_CACHE          16
+#define LEAF_HASH(bdb,ptr)          ((int)(((ptr) >> 4) ^ ((ptr) >> 20)) & (bdb)->leaf_hash_mask)
+
+/* リーフのポインタに対応するリーフラッチ */
+#define LEAF_LATCH(bdb,ptr)         (&(bdb)->leaf_latch[(int)((ptr) / (bdb)->node_pgsize) & (BDB_LEAF_LATCHES-1)])
+
+/* 範囲検索のバッチのレコード数とサイズ、先読みするリーフ数 */
+#define BDB_SCAN_BATCH_COUNT        1024
+#define BDB_SCAN_BATCH_SIZE         (1024*1024)
+#define BDB_SCAN_READAHEAD          8
+
+/* スナップショットの退避ページのハッシュ */
+#define BDB_SNAP_HASH_SIZE          256
+#define SNAP_HASH(snap,ptr)         ((int)(((ptr) >> 4) ^ ((ptr) >> 20)) & (snap)->hash_mask)
+
+/* 一括作成するブランチノードの最大レベル */
+#define BDB_BULK_MAX_LEVEL          32
+
+/* ロックモード */
+#define LOCK_READ                   0
+#define LOCK_WRITE                  1
+
 static int leaf_cache_flush(struct bdb_t* bdb);
+static int leaf_pool_create(struct bdb_t* bdb, int size);
+static void leaf_pool_free(struct bdb_t* bdb);
+static void leaf_pool_reset(struct bdb_t* bdb);
+static int snap_release(struct bdb_t* bdb, struct bdb_snapshot_t* snap);
+static int snap_reclaim(struct bdb_t* bdb);
+static void lock_branch(struct bdb_t* bdb);
+static int put_by_key(struct bdb_t* bdb, const void* key, int keysize, const void* val, int valsize);
+static int delete_by_key(struct bdb_t* bdb, const void* key, int keysize);
 
 static void set_default(struct bdb_t* bdb)
 {
@@ -181,7 +337,11 @@ static void set_default(struct bdb_t* bdb)
     bdb->filling_rate = 10;          /* 空き領域の充填率 */
     bdb->dupkey_flag = 0;            /* 重複索引なし */
     bdb->datapack_flag = 1;          /* データパックモード */
+    bdb->count_flag = 0;             /* 部分木のキー数なし */
+    bdb->cmp_kind = NIO_CMP_MEMCMP;  /* バイト列の昇順 */
+    bdb->node_ptrsize = sizeof(int64);
     bdb->prefix_compress_flag = 1;   /* リーフノードのプレフィックス圧縮 */
+    bdb->concurrent_read = 0;        /* 参照も排他制御 */
 
     bdb->root_ptr = 0;
     bdb->leaf_top_ptr = 0;
@@ -198,6 +358,7 @@ static void set_default(struct bdb_t* bdb)
 struct bdb_t* bdb_initialize(struct nio_t* nio)
 {
     struct bdb_t* bdb;
+    int i;
 
     bdb = (struct bdb_t*)calloc(1, sizeof(struct bdb_t));
     if (bdb == NULL) {
@@ -225,9 +386,7 @@ struct bdb_t* bdb_initialize(struct nio_t* nio)
         free(bdb);
         return NULL;
     }
-    bdb->leaf_cache = (struct leaf_cache_t*)calloc(sizeof(struct leaf_cache_t), 1);
-    if (bdb->leaf_cache == NULL) {
-        err_write("bdb: leaf cache no memory.");
+    if (leaf_pool_create(bdb, DEFAULT_LEAF_CACHE) < 0) {
         free(bdb->leaf_buf);
         free(bdb->node_buf);
         free(bdb);
@@ -236,6 +395,10 @@ struct bdb_t* bdb_initialize(struct nio_t* nio)
 
     /* クリティカルセクションの初期化 */
     CS_INIT(&bdb->critical_section);
+    RWLOCK_INIT(&bdb->tree_latch);
+    CS_INIT(&bdb->pool_critical_section);
+    for (i = 0; i < BDB_LEAF_LATCHES; i++)
+        RWLOCK_INIT(&bdb->leaf_latch[i]);
 
     return bdb;
 }
@@ -251,14 +414,16 @@ struct bdb_t* bdb_initialize(struct nio_t* nio)
  */
 void bdb_finalize(struct bdb_t* bdb)
 {
+    int i;
+
     /* クリティカルセクションの削除 */
     CS_DELETE(&bdb->critical_section);
+    RWLOCK_DELETE(&bdb->tree_latch);
+    CS_DELETE(&bdb->pool_critical_section);
+    for (i = 0; i < BDB_LEAF_LATCHES; i++)
+        RWLOCK_DELETE(&bdb->leaf_latch[i]);
 
-    if (bdb->leaf_cache) {
-        if (bdb->leaf_cache->keydata)
-            free(bdb->leaf_cache->keydata);
-        free(bdb->leaf_cache);
-    }
+    leaf_pool_free(bdb);
     free(bdb->node_buf);
     free(bdb->leaf_buf);
     free(bdb);
@@ -283,6 +448,7 @@ void bdb_finalize(struct bdb_t* bdb)
 void bdb_cmpfunc(struct bdb_t* bdb, CMP_FUNCPTR func)
 {
     bdb->cmp_func = func;
+    bdb->cmp_kind = (func == nio_cmpkey)? NIO_CMP_MEMCMP : BDB_CMP_FUNC;
 }
 
 /*
@@ -297,6 +463,27 @@ void bdb_cmpfunc(struct bdb_t* bdb, CMP_FUNCPTR func)
  *     NIO_DATAPACK         キーとデータをパックして格納(1 or 0)
  *                          キー重複を許可している場合はデータパック不可
  *     NIO_PREFIX_COMPRESS  プレフィックス圧縮フラグ(1 or 0)
+ *     NIO_LEAF_CACHE       キャッシュするリーフ数
+ *     NIO_CONCURRENT_READ  参照を共有ロックで並行に処理(1 or 0)
+ *                          更新は並行に処理されません
+ *     NIO_ORDER_STAT       ブランチノードに部分木のキー数を持つ(1 or 0)
+ *                          作成時に設定し、ファイルタイプに記録される
+ *     NIO_KEY_COMPARE      組み込みのキー比較(NIO_CMP_*)
+ *                          作成時に設定し、ファイルタイプに記録される
+ *
+ * NIO_KEY_COMPARE には以下を指定できます。
+ *     NIO_CMP_MEMCMP       バイト列の昇順(デフォルト)
+ *     NIO_CMP_UINT64BE     8バイトのビッグエンディアン符号なし整数
+ *     NIO_CMP_INT64        8バイトのネイティブ符号付き整数
+ *     NIO_CMP_REVERSE      バイト列の降順
+ *     NIO_CMP_CASE         ASCII の大文字小文字を区別しないバイト列
+ * NIO_CMP_INT64 を設定した場合は８バイト以外のキーを格納や検索に
+ * 指定するとエラーになります。
+ * NIO_CMP_UINT64BE は８バイト以外のキーをバイト列として比較します。
+ * ビッグエンディアンの整数はバイト列と同じ順序になります。
+ * 設定した場合は bdb_cmpfunc() で設定した関数は使用されません。
+ *
+ * NIO_CONCURRENT_READ はオープンする前に設定します。
  *
  * bdb: データベースオブジェクトのポインタ
  * kind: プロパティ種類
@@ -359,6 +546,30 @@ int bdb_property(struct bdb_t* bdb, int kind, int value)
         case NIO_PREFIX_COMPRESS:
             bdb->prefix_compress_flag = value;
             break;
+        case NIO_LEAF_CACHE:
+            if (value < 1) {
+                err_write("bdb_property: leaf cache is too small, more than 1.");
+                return -1;
+            }
+            /* 更新されているリーフを書き出してから作り直します。*/
+            if (leaf_cache_flush(bdb) < 0)
+                return -1;
+            result = leaf_pool_create(bdb, value);
+            break;
+        case NIO_CONCURRENT_READ:
+            bdb->concurrent_read = (value)? 1 : 0;
+            break;
+        case NIO_ORDER_STAT:
+            bdb->count_flag = (value)? 1 : 0;
+            break;
+        case NIO_KEY_COMPARE:
+            if (value < 0 || value > NIO_CMP_MAX) {
+                err_write("bdb_property: illegal key compare=%d.", value);
+                return -1;
+            }
+            bdb->cmp_kind = value;
+            bdb->cmp_func = nio_cmpkey;
+            break;
         default:
             result = -1;
             break;
@@ -366,12 +577,75 @@ int bdb_property(struct bdb_t* bdb, int kind, int value)
     return result;
 }
 
+/* 共有ロックの場合はクリティカルセクションを待ち合わせに使用して
+   更新を待っている間に新たな参照が入らないようにします。*/
+static void lock_tree(struct bdb_t* bdb, int mode)
+{
+    CS_START(&bdb->critical_section);
+    if (! bdb->shared_latch) {
+        if (mode == LOCK_WRITE)
+            bdb->tree_version++;
+        return;
+    }
+    if (mode == LOCK_WRITE) {
+        RWLOCK_WRLOCK(&bdb->tree_latch);
+        bdb->tree_version++;
+    } else {
+        RWLOCK_RDLOCK(&bdb->tree_latch);
+    }
+    CS_END(&bdb->critical_section);
+}
+
+static void unlock_tree(struct bdb_t* bdb, int mode)
+{
+    if (! bdb->shared_latch) {
+        CS_END(&bdb->critical_section);
+        return;
+    }
+    if (mode == LOCK_WRITE)
+        RWLOCK_WRUNLOCK(&bdb->tree_latch);
+    else
+        RWLOCK_RDUNLOCK(&bdb->tree_latch);
+}
+
+/* 木の共有ロックの中でリーフをラッチします。
+   木の排他ロックの場合は他のスレッドがいないためラッチは競合しません。*/
+static void latch_leaf(struct bdb_t* bdb, int64 leaf_ptr, int mode)
+{
+    if (! bdb->shared_latch)
+        return;
+    if (mode == LOCK_WRITE)
+        RWLOCK_WRLOCK(LEAF_LATCH(bdb, leaf_ptr));
+    else
+        RWLOCK_RDLOCK(LEAF_LATCH(bdb, leaf_ptr));
+}
+
+static void unlatch_leaf(struct bdb_t* bdb, int64 leaf_ptr, int mode)
+{
+    if (! bdb->shared_latch)
+        return;
+    if (mode == LOCK_WRITE)
+        RWLOCK_WRUNLOCK(LEAF_LATCH(bdb, leaf_ptr));
+    else
+        RWLOCK_RDUNLOCK(LEAF_LATCH(bdb, leaf_ptr));
+}
+
+/* オープンしたファイルのロック方式を設定します。*/
+static void latch_open(struct bdb_t* bdb)
+{
+    bdb->shared_latch = bdb->concurrent_read;
+    if (bdb->shared_latch) {
+        /* 複数のスレッドから位置を指定して読み込みます。*/
+        mmap_mtsafe(bdb->nio->mmap, 1);
+    }
+}
+
+/* 共有ロックで並行に読み込めるように位置を指定して読み込みます。*/
 static ushort recid(struct bdb_t* bdb, int64 ptr)
 {
     ushort rid;
 
-    mmap_seek(bdb->nio->mmap, ptr);
-    if (mmap_read(bdb->nio->mmap, &rid, sizeof(ushort)) != sizeof(ushort))
+    if (mmap_pread(bdb->nio->mmap, &rid, sizeof(ushort), ptr) != sizeof(ushort))
         return 0;
     return rid;
 }
@@ -435,11 +709,174 @@ static int put_leaf_bot(struct bdb_t* bdb, int64 ptr)
     return 0;
 }
 
+/* スナップショットの複写領域が残っている可能性をヘッダーに記録します。*/
+static int put_snapshot_flag(struct bdb_t* bdb, ushort flag)
+{
+    mmap_seek(bdb->nio->mmap, BDB_SNAPSHOT_OFFSET);
+    if (mmap_write(bdb->nio->mmap, &flag, sizeof(ushort)) != sizeof(ushort))
+        return -1;
+    return 0;
+}
+
+/* リーフラッチで並行に更新する場合は bdb->pool_critical_section の中で呼び出します。*/
 static void update_filesize(struct bdb_t* bdb)
 {
     bdb->filesize = nio_filesize(bdb->nio);
-    mmap_seek(bdb->nio->mmap, BDB_FILESIZE_OFFSET);
-    mmap_write(bdb->nio->mmap, &bdb->filesize, sizeof(bdb->filesize));
+    mmap_pwrite(bdb->nio->mmap, &bdb->filesize, sizeof(bdb->filesize), BDB_FILESIZE_OFFSET);
+}
+
+/* 複写表のページを追加して最後のページに連結します。*/
+static int copy_page_add(struct bdb_t* bdb)
+{
+    char buf[BDB_COPYPAGE_ARRAY_OFFSET];
+    ushort id = BDB_COPYPAGE_ID;
+    int64* pages;
+    int64 ptr;
+    int64 link;
+
+    pages = (int64*)realloc(bdb->copy_page, sizeof(int64) * (bdb->copy_page_num + 1));
+    if (pages == NULL) {
+        err_write("bdb: snapshot no memory.");
+        return -1;
+    }
+    bdb->copy_page = pages;
+
+    ptr = nio_avail_space(bdb->nio, BDB_COPYPAGE_SIZE, NULL, bdb->filling_rate);
+    if (ptr < 0)
+        return -1;
+    memset(buf, '\0', sizeof(buf));
+    memcpy(buf, &id, sizeof(ushort));
+    if (mmap_pwrite(bdb->nio->mmap, buf, sizeof(buf), ptr) != sizeof(buf))
+        return -1;
+
+    if (bdb->copy_page_num == 0)
+        link = BDB_COPYTABLE_OFFSET;
+    else
+        link = bdb->copy_page[bdb->copy_page_num-1] + BDB_COPYPAGE_NEXT_OFFSET;
+    if (mmap_pwrite(bdb->nio->mmap, &ptr, sizeof(int64), link) != sizeof(int64))
+        return -1;
+    bdb->copy_page[bdb->copy_page_num++] = ptr;
+    return 0;
+}
+
+/* 複写した領域を複写表に記録してスロット番号を slot に設定します。
+   複写表がないファイルの場合は -1 になります。*/
+static int copy_table_add(struct bdb_t* bdb, int64 copy_ptr, int size, int* slot)
+{
+    char entry[BDB_COPY_ENTRY_SIZE];
+    int64 page;
+    ushort n;
+
+    *slot = -1;
+    if (bdb->fver < BDB_EXT_FILE_VERSION)
+        return 0;
+    if (bdb->copy_count >= bdb->copy_page_num * BDB_COPY_COUNT) {
+        if (copy_page_add(bdb) < 0)
+            return -1;
+    }
+    page = bdb->copy_page[bdb->copy_count / BDB_COPY_COUNT];
+    n = (ushort)(bdb->copy_count % BDB_COPY_COUNT);
+
+    memcpy(entry, &copy_ptr, sizeof(int64));
+    memcpy(&entry[sizeof(int64)], &size, sizeof(int));
+    if (mmap_pwrite(bdb->nio->mmap, entry, BDB_COPY_ENTRY_SIZE,
+                    page + BDB_COPYPAGE_ARRAY_OFFSET + n * BDB_COPY_ENTRY_SIZE) != BDB_COPY_ENTRY_SIZE)
+        return -1;
+    n++;
+    if (mmap_pwrite(bdb->nio->mmap, &n, sizeof(ushort), page + BDB_COPYPAGE_COUNT_OFFSET) != sizeof(ushort))
+        return -1;
+    *slot = bdb->copy_count++;
+    return 0;
+}
+
+/* 空きリストに戻した領域を複写表から削除します。*/
+static int copy_table_clear(struct bdb_t* bdb, int slot)
+{
+    int64 page;
+    int64 zero = 0;
+
+    if (slot < 0)
+        return 0;
+    page = bdb->copy_page[slot / BDB_COPY_COUNT];
+    if (mmap_pwrite(bdb->nio->mmap, &zero, sizeof(int64),
+                    page + BDB_COPYPAGE_ARRAY_OFFSET + (slot % BDB_COPY_COUNT) * BDB_COPY_ENTRY_SIZE) != sizeof(int64))
+        return -1;
+    return 0;
+}
+
+/* 複写表をヘッダーから外してページを空きリストに戻します。*/
+static int copy_table_free(struct bdb_t* bdb)
+{
+    int64 zero = 0;
+    int result = 0;
+    int i;
+
+    if (bdb->copy_page_num == 0)
+        return 0;
+    if (mmap_pwrite(bdb->nio->mmap, &zero, sizeof(int64), BDB_COPYTABLE_OFFSET) != sizeof(int64))
+        return -1;
+    for (i = 0; i < bdb->copy_page_num; i++) {
+        if (nio_add_free_list(bdb->nio, bdb->copy_page[i], BDB_COPYPAGE_SIZE) < 0)
+            result = -1;
+    }
+    free(bdb->copy_page);
+    bdb->copy_page = NULL;
+    bdb->copy_page_num = 0;
+    bdb->copy_count = 0;
+    return result;
+}
+
+/* 異常終了して残っている複写表の領域とページを空きリストに戻します。
+   先にヘッダーから外すため、回収中に終了しても二重には解放されません。*/
+static int copy_table_reclaim(struct bdb_t* bdb, int64 ptr)
+{
+    char buf[BDB_COPYPAGE_SIZE];
+    int64 zero = 0;
+    int64 reclaimed = 0;
+    int result = 0;
+
+    if (mmap_pwrite(bdb->nio->mmap, &zero, sizeof(int64), BDB_COPYTABLE_OFFSET) != sizeof(int64))
+        return -1;
+    while (ptr > 0 && ptr < nio_filesize(bdb->nio)) {
+        ushort id;
+        ushort count;
+        int64 next;
+        int i;
+
+        if (mmap_pread(bdb->nio->mmap, buf, BDB_COPYPAGE_SIZE, ptr) != BDB_COPYPAGE_SIZE)
+            return -1;
+        memcpy(&id, buf, sizeof(ushort));
+        if (id != BDB_COPYPAGE_ID) {
+            err_write("bdb: invalid snapshot copy table page=%lld.", ptr);
+            return -1;
+        }
+        memcpy(&next, &buf[BDB_COPYPAGE_NEXT_OFFSET], sizeof(int64));
+        memcpy(&count, &buf[BDB_COPYPAGE_COUNT_OFFSET], sizeof(ushort));
+        if (count > BDB_COPY_COUNT)
+            count = BDB_COPY_COUNT;
+
+        for (i = 0; i < count; i++) {
+            char* p = &buf[BDB_COPYPAGE_ARRAY_OFFSET + i * BDB_COPY_ENTRY_SIZE];
+            int64 copy_ptr;
+            int size;
+
+            memcpy(&copy_ptr, p, sizeof(int64));
+            memcpy(&size, p + sizeof(int64), sizeof(int));
+            if (copy_ptr == 0)
+                continue;
+            if (nio_add_free_list(bdb->nio, copy_ptr, size) < 0)
+                result = -1;
+            else
+                reclaimed += size;
+        }
+        if (nio_add_free_list(bdb->nio, ptr, BDB_COPYPAGE_SIZE) < 0)
+            result = -1;
+        ptr = next;
+    }
+    update_filesize(bdb);
+    if (reclaimed > 0)
+        logout_write("bdb_open: reclaimed %lld bytes of snapshot.", reclaimed);
+    return result;
 }
 
 static void safe_check(struct bdb_t* bdb)
@@ -480,7 +917,7 @@ static void safe_check(struct bdb_t* bdb)
 int bdb_open(struct bdb_t* bdb, const char* fname)
 {
     int fd;
-    char buf[BDB_HEADER_SIZE];
+    char buf[BDB_HEADER_SIZE+BDB_HEADER_EXT_SIZE];
     char fid[4];
     ushort fver;
     ushort ftype;
@@ -492,6 +929,8 @@ int bdb_open(struct bdb_t* bdb, const char* fname)
     int64 leaftop;
     int64 leafbot;
     int64 filesize;
+    ushort snapflag;
+    int64 copyptr = 0;
 
     fd = FILE_OPEN(fname, O_RDWR|O_BINARY);
     if (fd < 0) {
@@ -500,6 +939,14 @@ int bdb_open(struct bdb_t* bdb, const char* fname)
     }
     bdb->fd = fd;
 
+    /* ログが残っている場合は回復します。*/
+    if (nio_wal_recover(bdb->nio, fd) < 0) {
+        err_write("bdb_open: can't recover: %s.", fname);
+        FILE_CLOSE(fd);
+        return -1;
+    }
+    FILE_SEEK(fd, 0, SEEK_SET);
+
     /* ヘッダー部の読み込み */
     if (FILE_READ(fd, buf, BDB_HEADER_SIZE) != BDB_HEADER_SIZE) {
         err_write("bdb_open: can't read header.");
@@ -516,10 +963,33 @@ int bdb_open(struct bdb_t* bdb, const char* fname)
     /* ファイルバージョン */
     memcpy(&fver, &buf[BDB_VERSION_OFFSET], sizeof(fver));
     bdb->fver = fver;
+    bdb->header_size = BDB_HEADER_SIZE;
+    if (fver >= BDB_EXT_FILE_VERSION) {
+        /* 拡張ヘッダー部の読み込み */
+        if (FILE_READ(fd, &buf[BDB_HEADER_SIZE], BDB_HEADER_EXT_SIZE) != BDB_HEADER_EXT_SIZE) {
+            err_write("bdb_open: can't read extended header.");
+            FILE_CLOSE(fd);
+            return -1;
+        }
+        bdb->header_size += BDB_HEADER_EXT_SIZE;
+    }
     /* ファイルタイプ */
     memcpy(&ftype, &buf[BDB_FILETYPE_OFFSET], sizeof(ftype));
     bdb->dupkey_flag = (ftype & BDB_TYPE_BTREE_DUPKEY)? 1 : 0;
     bdb->datapack_flag = (ftype & BDB_TYPE_BTREE_DATAPACK)? 1 : 0;
+    bdb->count_flag = (ftype & BDB_TYPE_BTREE_COUNT)? 1 : 0;
+    bdb->node_ptrsize = (bdb->count_flag)? BDB_NODE_CPTR_SIZE : sizeof(int64);
+    if (bdb->cmp_kind != BDB_CMP_FUNC) {
+        int cmp_kind;
+
+        cmp_kind = (ftype & BDB_TYPE_CMP_MASK) >> BDB_TYPE_CMP_SHIFT;
+        if (cmp_kind > NIO_CMP_MAX) {
+            err_write("bdb_open: unsupported key compare=%d.", cmp_kind);
+            FILE_CLOSE(fd);
+            return -1;
+        }
+        bdb->cmp_kind = cmp_kind;
+    }
     /* 作成日時 */
     memcpy(&ctime, &buf[BDB_TIMESTAMP_OFFSET], sizeof(ctime));
     /* 空き管理ページポインタ（8バイト）*/
@@ -543,21 +1013,40 @@ int bdb_open(struct bdb_t* bdb, const char* fname)
     /* ファイルサイズ（8バイト） */
     memcpy(&filesize, &buf[BDB_FILESIZE_OFFSET], sizeof(filesize));
     bdb->filesize = filesize;
+    /* スナップショットのフラグ（2バイト） */
+    memcpy(&snapflag, &buf[BDB_SNAPSHOT_OFFSET], sizeof(snapflag));
+    /* スナップショットの複写表（8バイト） */
+    if (fver >= BDB_EXT_FILE_VERSION)
+        memcpy(&copyptr, &buf[BDB_COPYTABLE_OFFSET], sizeof(copyptr));
     if (bdb->filesize != 0) {
         /* 2011/12/17 ファイルサイズの調整 */
         FILE_TRUNCATE(fd, bdb->filesize);
     }
 
     /* メモリマップドファイルのオープン */
-    bdb->nio->mmap = mmap_open(fd, MMAP_READWRITE, bdb->mmap_view_size);
+    bdb->nio->mmap = nio_mmap_open(bdb->nio, fd, bdb->mmap_view_size);
     if (bdb->nio->mmap == NULL) {
         err_write("bdb_open: can't open mmap.");
         FILE_CLOSE(fd);
         return -1;
     }
+    latch_open(bdb);
 
     /* ファイルの整合性をチェックします。*/
     safe_check(bdb);
+    lock_branch(bdb);
+
+    if (copyptr != 0) {
+        /* スナップショットを使用中に終了した場合は複写表の領域を回収します。*/
+        if (copy_table_reclaim(bdb, copyptr) < 0)
+            err_write("bdb_open: can't reclaim snapshot area.");
+    } else if (snapflag) {
+        /* 複写表がないファイルは木から参照されていない領域を回収します。*/
+        if (snap_reclaim(bdb) < 0)
+            err_write("bdb_open: can't reclaim snapshot area.");
+        else
+            put_snapshot_flag(bdb, 0);
+    }
     return 0;
 }
 
@@ -575,7 +1064,7 @@ int bdb_open(struct bdb_t* bdb, const char* fname)
 int bdb_create(struct bdb_t* bdb, const char* fname)
 {
     int fd;
-    char buf[BDB_HEADER_SIZE];
+    char buf[BDB_HEADER_SIZE+BDB_HEADER_EXT_SIZE];
     ushort fver = BDB_FILE_VERSION;
     ushort ftype = BDB_TYPE_BTREE;
     int64 ctime;
@@ -587,8 +1076,8 @@ int bdb_create(struct bdb_t* bdb, const char* fname)
     }
     FILE_TRUNCATE(fd, 0);
 
-    /* バッファのクリア */
-    memset(buf, '\0', BDB_HEADER_SIZE);
+    /* バッファのクリア(拡張ヘッダー部を含む) */
+    memset(buf, '\0', sizeof(buf));
 
     /* ファイル識別コード */
     memcpy(buf, BDB_FILEID, 4);
@@ -601,6 +1090,11 @@ int bdb_create(struct bdb_t* bdb, const char* fname)
         if (bdb->datapack_flag)
             ftype |= BDB_TYPE_BTREE_DATAPACK;
     }
+    if (bdb->count_flag)
+        ftype |= BDB_TYPE_BTREE_COUNT;
+    if (bdb->cmp_kind > 0)
+        ftype |= (ushort)(bdb->cmp_kind << BDB_TYPE_CMP_SHIFT);
+    bdb->node_ptrsize = (bdb->count_flag)? BDB_NODE_CPTR_SIZE : sizeof(int64);
     memcpy(&buf[BDB_FILETYPE_OFFSET], &ftype, sizeof(ftype));
     /* 作成日時（8バイト） */
     ctime = system_time();
@@ -611,21 +1105,24 @@ int bdb_create(struct bdb_t* bdb, const char* fname)
     memcpy(&buf[BDB_ALIGNMENT_OFFSET], &bdb->align_bytes, sizeof(bdb->align_bytes));
 
     /* ヘッダー部の書き出し */
-    if (FILE_WRITE(fd, buf, BDB_HEADER_SIZE) != BDB_HEADER_SIZE) {
+    if (FILE_WRITE(fd, buf, sizeof(buf)) != sizeof(buf)) {
         err_write("bdb_create: can't write header.");
         FILE_CLOSE(fd);
         return -1;
     }
 
     /* メモリマップドファイルのオープン */
-    bdb->nio->mmap = mmap_open(fd, MMAP_READWRITE, bdb->mmap_view_size);
+    bdb->nio->mmap = nio_mmap_open(bdb->nio, fd, bdb->mmap_view_size);
     if (bdb->nio->mmap == NULL) {
         err_write("bdb_create: can't open mmap.");
         FILE_TRUNCATE(fd, 0);
         FILE_CLOSE(fd);
         return -1;
     }
+    latch_open(bdb);
     bdb->fd = fd;
+    bdb->fver = fver;
+    bdb->header_size = sizeof(buf);
 
     bdb->root_ptr = 0;
     bdb->leaf_top_ptr = 0;
@@ -634,6 +1131,7 @@ int bdb_create(struct bdb_t* bdb, const char* fname)
     /* 空きデータ管理ページを書き出します。*/
     if (nio_create_free_page(bdb->nio) < 0)
         return -1;
+    lock_branch(bdb);
     return 0;
 }
 
@@ -647,11 +1145,23 @@ int bdb_create(struct bdb_t* bdb, const char* fname)
  */
 void bdb_close(struct bdb_t* bdb)
 {
-    if (bdb->leaf_cache->update)
-        leaf_cache_flush(bdb);
+    while (bdb->snapshots != NULL)
+        snap_release(bdb, bdb->snapshots);
+    /* 解放できなかった複写表は次のオープン時に回収されます。*/
+    if (bdb->copy_page != NULL) {
+        free(bdb->copy_page);
+        bdb->copy_page = NULL;
+    }
+    bdb->copy_page_num = 0;
+    bdb->copy_count = 0;
+    leaf_cache_flush(bdb);
+    leaf_pool_reset(bdb);
+    update_filesize(bdb);
 
+    nio_wal_checkpoint(bdb->nio);
     mmap_close(bdb->nio->mmap);
     FILE_CLOSE(bdb->fd);
+    bdb->shared_latch = 0;
 }
 
 /*
@@ -678,121 +1188,480 @@ int bdb_file(const char* fname)
     return 1;
 }
 
-static int write_value(struct bdb_t* bdb,
-                       int64 offset,
-                       struct bdb_value_t* v,
-                       const void* value)
+/* スナップショットで退避した領域を検索します。*/
+static struct bdb_snap_entry_t* snap_lookup(struct bdb_snapshot_t* snap, int64 ptr)
 {
-    char buf[BDB_VALUE_SIZE];
-
-    /* valueヘッダーを編集します。*/
-    mmap_seek(bdb->nio->mmap, offset);
-    memset(buf, '\0', BDB_VALUE_SIZE);
+    int i;
 
-    /* 領域サイズ */
-    memcpy(&buf[BDB_VALUE_ASIZE_OFFSET], &v->areasize, sizeof(int));
-    /* データサイズ */
-    memcpy(&buf[BDB_VALUE_DSIZE_OFFSET], &v->valsize, sizeof(int));
-    /* 次ポインタ */
-    memcpy(&buf[BDB_VALUE_NEXT_OFFSET], &v->next_ptr, sizeof(int64));
-    /* 前ポインタ */
-    memcpy(&buf[BDB_VALUE_PREV_OFFSET], &v->prev_ptr, sizeof(int64));
+    for (i = snap->hash[SNAP_HASH(snap, ptr)]; i >= 0; i = snap->entry[i].next) {
+        if (snap->entry[i].ptr == ptr)
+            return &snap->entry[i];
+    }
+    return NULL;
+}
 
-    /* valueヘッダーを書き出します。*/
-    if (mmap_write(bdb->nio->mmap, buf, BDB_VALUE_SIZE) != BDB_VALUE_SIZE)
-        return -1;
+/* スナップショットに領域を登録します。
+   copy_ptr がゼロの場合はスナップショットから参照されない領域になります。*/
+static int snap_add(struct bdb_snapshot_t* snap, int64 ptr, int64 copy_ptr, int size, int slot)
+{
+    struct bdb_snap_entry_t* e;
+    int h;
 
-    if (value && v->valsize > 0) {
-        int rbytes;
+    if (snap->entry_count >= snap->entry_alloc) {
+        int n = snap->entry_alloc * 2;
+        int* hash;
+        int i;
 
-        /* 値を書き出します。*/
-        if (mmap_write(bdb->nio->mmap, value, v->valsize) != v->valsize)
+        e = (struct bdb_snap_entry_t*)realloc(snap->entry, sizeof(struct bdb_snap_entry_t) * n);
+        if (e == NULL) {
+            err_write("bdb: snapshot no memory.");
+            return -1;
+        }
+        snap->entry = e;
+        hash = (int*)realloc(snap->hash, sizeof(int) * n);
+        if (hash == NULL) {
+            err_write("bdb: snapshot no memory.");
             return -1;
-        rbytes = v->areasize - (BDB_VALUE_SIZE + v->valsize);
-        if (rbytes > 0) {
-            void* abuf;
-
-            /* アライメント領域を書き出します。*/
-            abuf = alloca(rbytes);
-            memset(abuf, '\0', rbytes);
-            if (mmap_write(bdb->nio->mmap, abuf, rbytes) != rbytes)
-                return -1;
+        }
+        snap->hash = hash;
+        snap->entry_alloc = n;
+
+        /* ハッシュを作り直します。*/
+        snap->hash_mask = n - 1;
+        for (i = 0; i < n; i++)
+            snap->hash[i] = -1;
+        for (i = 0; i < snap->entry_count; i++) {
+            h = SNAP_HASH(snap, snap->entry[i].ptr);
+            snap->entry[i].next = snap->hash[h];
+            snap->hash[h] = i;
         }
     }
+
+    e = &snap->entry[snap->entry_count];
+    e->ptr = ptr;
+    e->copy_ptr = copy_ptr;
+    e->size = size;
+    e->slot = slot;
+    h = SNAP_HASH(snap, ptr);
+    e->next = snap->hash[h];
+    snap->hash[h] = snap->entry_count++;
     return 0;
 }
 
-static int read_value_header(struct bdb_t* bdb,
-                             int64 offset,
-                             struct bdb_value_t* v)
+/* スナップショットから見た領域の位置を返します。
+   退避されている場合は複写した領域の位置になります。
+   snap が NULL の場合は ptr をそのまま返します。*/
+static int64 snap_ptr(struct bdb_snapshot_t* snap, int64 ptr)
 {
-    char buf[BDB_VALUE_SIZE];
+    struct bdb_snap_entry_t* e;
 
-    /* valueヘッダーを読み込みます。*/
-    mmap_seek(bdb->nio->mmap, offset);
-    if (mmap_read(bdb->nio->mmap, buf, BDB_VALUE_SIZE) != BDB_VALUE_SIZE)
-        return -1;
+    if (snap == NULL)
+        return ptr;
+    e = snap_lookup(snap, ptr);
+    if (e != NULL && e->copy_ptr > 0)
+        return e->copy_ptr;
+    return ptr;
+}
 
-    /* 領域サイズ */
-    memcpy(&v->areasize, &buf[BDB_VALUE_ASIZE_OFFSET], sizeof(int));
-    /* データサイズ */
-    memcpy(&v->valsize, &buf[BDB_VALUE_DSIZE_OFFSET], sizeof(int));
-    /* 次ポインタ */
-    memcpy(&v->next_ptr, &buf[BDB_VALUE_NEXT_OFFSET], sizeof(int64));
-    /* 前ポインタ */
-    memcpy(&v->prev_ptr, &buf[BDB_VALUE_PREV_OFFSET], sizeof(int64));
+/* 領域を更新する前に退避が必要なスナップショットがあるか調べます。*/
+static int snap_need_save(struct bdb_t* bdb, int64 ptr)
+{
+    struct bdb_snapshot_t* snap;
+
+    for (snap = bdb->snapshots; snap != NULL; snap = snap->next) {
+        if (ptr < snap->filesize && snap_lookup(snap, ptr) == NULL)
+            return 1;
+    }
     return 0;
 }
 
-static int write_value_header(struct bdb_t* bdb,
-                              int64 offset,
-                              struct bdb_value_t* v)
+/* スナップショットから参照される領域を更新または解放する前に
+   元の内容を新しい領域に複写します(copy-on-write)。
+   同じ時点の内容を必要とするスナップショットは複写した領域を共有します。*/
+static int snap_preserve(struct bdb_t* bdb, int64 ptr, int size)
 {
-    char buf[BDB_VALUE_SIZE];
+    struct bdb_snapshot_t* snap;
+    char* buf;
+    int64 copy_ptr;
+    int areasize;
+    int slot;
 
-    memset(buf, '\0', sizeof(buf));
-    /* 領域サイズ */
-    memcpy(&buf[BDB_VALUE_ASIZE_OFFSET], &v->areasize, sizeof(int));
-    /* データサイズ */
-    memcpy(&buf[BDB_VALUE_DSIZE_OFFSET], &v->valsize, sizeof(int));
-    /* 次ポインタ */
-    memcpy(&buf[BDB_VALUE_NEXT_OFFSET], &v->next_ptr, sizeof(int64));
-    /* 前ポインタ */
-    memcpy(&buf[BDB_VALUE_PREV_OFFSET], &v->prev_ptr, sizeof(int64));
+    if (bdb->snapshots == NULL || ! snap_need_save(bdb, ptr))
+        return 0;
 
-    /* valueヘッダーを書き込みます。*/
-    mmap_seek(bdb->nio->mmap, offset);
-    if (mmap_write(bdb->nio->mmap, buf, BDB_VALUE_SIZE) != BDB_VALUE_SIZE)
+    buf = (char*)malloc(size);
+    if (buf == NULL) {
+        err_write("bdb: snapshot no memory.");
         return -1;
+    }
+    if (mmap_pread(bdb->nio->mmap, buf, size, ptr) != size) {
+        free(buf);
+        return -1;
+    }
+    copy_ptr = nio_avail_space(bdb->nio, size, &areasize, bdb->filling_rate);
+    if (copy_ptr < 0) {
+        free(buf);
+        return -1;
+    }
+    /* 異常終了した場合に回収できるように複写表に記録します。*/
+    if (copy_table_add(bdb, copy_ptr, areasize, &slot) < 0) {
+        free(buf);
+        return -1;
+    }
+    mmap_seek(bdb->nio->mmap, copy_ptr);
+    if (mmap_write(bdb->nio->mmap, buf, size) != size) {
+        free(buf);
+        return -1;
+    }
+    free(buf);
+
+    for (snap = bdb->snapshots; snap != NULL; snap = snap->next) {
+        if (ptr < snap->filesize && snap_lookup(snap, ptr) == NULL) {
+            if (snap_add(snap, ptr, copy_ptr, areasize, slot) < 0)
+                return -1;
+        }
+    }
     return 0;
 }
 
-static int64 add_value(struct bdb_t* bdb,
-                       const void* val,
-                       int valsize,
-                       int64 prev_ptr,
-                       int64 next_ptr)
+/* データ部を更新する前に退避します。サイズはデータ部のヘッダーから求めます。*/
+static int snap_preserve_value(struct bdb_t* bdb, int64 ptr)
 {
-    int rsize, areasize;
-    int64 ptr;
-    struct bdb_value_t v;
+    int areasize;
 
-    /* value を書き出す領域を取得します。*/
-    rsize = BDB_VALUE_SIZE + valsize;
-    if (bdb->align_bytes > 0) {
-        if (rsize % bdb->align_bytes)
-            rsize = (rsize / bdb->align_bytes + 1) * bdb->align_bytes;
-    }
-    ptr = nio_avail_space(bdb->nio, rsize, &areasize, bdb->filling_rate);
-    if (ptr < 0)
+    if (bdb->snapshots == NULL || ! snap_need_save(bdb, ptr))
+        return 0;
+    if (mmap_pread(bdb->nio->mmap, &areasize, sizeof(int), ptr+BDB_VALUE_ASIZE_OFFSET) != sizeof(int))
         return -1;
+    return snap_preserve(bdb, ptr, areasize);
+}
 
-    /* value を編集します。*/
-    memset(&v, '\0', sizeof(struct bdb_value_t));
+/* スナップショットの後に割り当てた領域は退避しないように登録します。*/
+static int snap_mark_new(struct bdb_t* bdb, int64 ptr)
+{
+    struct bdb_snapshot_t* snap;
+
+    for (snap = bdb->snapshots; snap != NULL; snap = snap->next) {
+        if (ptr < snap->filesize && snap_lookup(snap, ptr) == NULL) {
+            if (snap_add(snap, ptr, 0, 0, -1) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* スナップショットを作成します。
+   リーフキャッシュの更新は書き出してファイルの内容を現時点の木にします。*/
+static struct bdb_snapshot_t* snap_create(struct bdb_t* bdb)
+{
+    struct bdb_snapshot_t* snap;
+    int i;
+
+    if (leaf_cache_flush(bdb) < 0)
+        return NULL;
+    if (bdb->snapshots == NULL && bdb->fver < BDB_EXT_FILE_VERSION) {
+        if (put_snapshot_flag(bdb, 1) < 0)
+            return NULL;
+    }
+
+    snap = (struct bdb_snapshot_t*)calloc(1, sizeof(struct bdb_snapshot_t));
+    if (snap == NULL) {
+        err_write("bdb: snapshot no memory.");
+        return NULL;
+    }
+    snap->hash = (int*)malloc(sizeof(int) * BDB_SNAP_HASH_SIZE);
+    snap->entry = (struct bdb_snap_entry_t*)malloc(sizeof(struct bdb_snap_entry_t) * BDB_SNAP_HASH_SIZE);
+    if (snap->hash == NULL || snap->entry == NULL) {
+        err_write("bdb: snapshot no memory.");
+        if (snap->hash)
+            free(snap->hash);
+        if (snap->entry)
+            free(snap->entry);
+        free(snap);
+        return NULL;
+    }
+    for (i = 0; i < BDB_SNAP_HASH_SIZE; i++)
+        snap->hash[i] = -1;
+    snap->hash_mask = BDB_SNAP_HASH_SIZE - 1;
+    snap->entry_alloc = BDB_SNAP_HASH_SIZE;
+
+    snap->root_ptr = bdb->root_ptr;
+    snap->leaf_top_ptr = bdb->leaf_top_ptr;
+    snap->leaf_bot_ptr = bdb->leaf_bot_ptr;
+    snap->filesize = nio_filesize(bdb->nio);
+
+    snap->next = bdb->snapshots;
+    bdb->snapshots = snap;
+    return snap;
+}
+
+/* スナップショットを解放します。
+   他のスナップショットと共有していない複写領域は空きリストに戻します。*/
+static int snap_release(struct bdb_t* bdb, struct bdb_snapshot_t* snap)
+{
+    struct bdb_snapshot_t** pp;
+    int result = 0;
+    int i;
+
+    for (pp = &bdb->snapshots; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == snap) {
+            *pp = snap->next;
+            break;
+        }
+    }
+
+    for (i = 0; i < snap->entry_count; i++) {
+        struct bdb_snap_entry_t* e = &snap->entry[i];
+        struct bdb_snapshot_t* other;
+        int shared = 0;
+
+        if (e->copy_ptr == 0)
+            continue;
+        for (other = bdb->snapshots; other != NULL; other = other->next) {
+            struct bdb_snap_entry_t* oe = snap_lookup(other, e->ptr);
+
+            if (oe != NULL && oe->copy_ptr == e->copy_ptr) {
+                shared = 1;
+                break;
+            }
+        }
+        if (! shared) {
+            if (nio_add_free_list(bdb->nio, e->copy_ptr, e->size) < 0)
+                result = -1;
+            else if (copy_table_clear(bdb, e->slot) < 0)
+                result = -1;
+        }
+    }
+    free(snap->hash);
+    free(snap->entry);
+    free(snap);
+    if (bdb->snapshots == NULL && result == 0) {
+        if (bdb->fver < BDB_EXT_FILE_VERSION) {
+            if (put_snapshot_flag(bdb, 0) < 0)
+                result = -1;
+        } else {
+            if (copy_table_free(bdb) < 0)
+                result = -1;
+        }
+    }
+    /* 空きリストのページが追加された場合はファイルサイズが変わります。*/
+    update_filesize(bdb);
+    return result;
+}
+
+/* 領域を割り当てます。*/
+static int64 avail_space(struct bdb_t* bdb, int size, int* areasize)
+{
+    int64 ptr;
+
+    ptr = nio_avail_space(bdb->nio, size, areasize, bdb->filling_rate);
+    if (ptr < 0)
+        return -1;
+    if (bdb->snapshots != NULL) {
+        if (snap_mark_new(bdb, ptr) < 0)
+            return -1;
+    }
+    return ptr;
+}
+
+/* 領域を解放します。スナップショットから参照される場合は先に退避します。*/
+static int free_space(struct bdb_t* bdb, int64 ptr, int size)
+{
+    if (snap_preserve(bdb, ptr, size) < 0)
+        return -1;
+    return nio_add_free_list(bdb->nio, ptr, size);
+}
+
+static void set_value_codec(char* buf, struct bdb_value_t* v)
+{
+    ushort codec;
+
+    if (v->codec == NIO_COMP_NONE)
+        return;
+    codec = (ushort)v->codec;
+    memcpy(&buf[BDB_VALUE_CODEC_OFFSET], &codec, sizeof(ushort));
+    memcpy(&buf[BDB_VALUE_RSIZE_OFFSET], &v->rawsize, sizeof(int));
+}
+
+static int write_value(struct bdb_t* bdb,
+                       int64 offset,
+                       struct bdb_value_t* v,
+                       const void* value)
+{
+    char buf[BDB_VALUE_SIZE];
+
+    if (snap_preserve_value(bdb, offset) < 0)
+        return -1;
+
+    /* valueヘッダーを編集します。
+       リーフラッチで並行に更新されるため位置を指定して書き出します。*/
+    memset(buf, '\0', BDB_VALUE_SIZE);
+
+    /* 領域サイズ */
+    memcpy(&buf[BDB_VALUE_ASIZE_OFFSET], &v->areasize, sizeof(int));
+    /* データサイズ */
+    memcpy(&buf[BDB_VALUE_DSIZE_OFFSET], &v->valsize, sizeof(int));
+    /* 次ポインタ */
+    memcpy(&buf[BDB_VALUE_NEXT_OFFSET], &v->next_ptr, sizeof(int64));
+    /* 前ポインタ */
+    memcpy(&buf[BDB_VALUE_PREV_OFFSET], &v->prev_ptr, sizeof(int64));
+    /* 圧縮方式と圧縮前のデータサイズ */
+    set_value_codec(buf, v);
+
+    /* valueヘッダーを書き出します。*/
+    if (mmap_pwrite(bdb->nio->mmap, buf, BDB_VALUE_SIZE, offset) != BDB_VALUE_SIZE)
+        return -1;
+
+    if (value && v->valsize > 0) {
+        int rbytes;
+
+        /* 値を書き出します。*/
+        offset += BDB_VALUE_SIZE;
+        if (mmap_pwrite(bdb->nio->mmap, value, v->valsize, offset) != v->valsize)
+            return -1;
+        rbytes = v->areasize - (BDB_VALUE_SIZE + v->valsize);
+        if (rbytes > 0) {
+            void* abuf;
+
+            /* アライメント領域を書き出します。*/
+            abuf = alloca(rbytes);
+            memset(abuf, '\0', rbytes);
+            offset += v->valsize;
+            if (mmap_pwrite(bdb->nio->mmap, abuf, rbytes, offset) != rbytes)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static int read_value_header(struct bdb_t* bdb,
+                             int64 offset,
+                             struct bdb_value_t* v)
+{
+    char buf[BDB_VALUE_SIZE];
+    ushort codec;
+
+    /* valueヘッダーを読み込みます。*/
+    if (mmap_pread(bdb->nio->mmap, buf, BDB_VALUE_SIZE, offset) != BDB_VALUE_SIZE)
+        return -1;
+
+    /* 領域サイズ */
+    memcpy(&v->areasize, &buf[BDB_VALUE_ASIZE_OFFSET], sizeof(int));
+    /* データサイズ */
+    memcpy(&v->valsize, &buf[BDB_VALUE_DSIZE_OFFSET], sizeof(int));
+    /* 次ポインタ */
+    memcpy(&v->next_ptr, &buf[BDB_VALUE_NEXT_OFFSET], sizeof(int64));
+    /* 前ポインタ */
+    memcpy(&v->prev_ptr, &buf[BDB_VALUE_PREV_OFFSET], sizeof(int64));
+    /* 圧縮方式と圧縮前のデータサイズ */
+    codec = 0;
+    memcpy(&codec, &buf[BDB_VALUE_CODEC_OFFSET], sizeof(ushort));
+    v->codec = codec;
+    if (v->codec == NIO_COMP_NONE)
+        v->rawsize = v->valsize;
+    else
+        memcpy(&v->rawsize, &buf[BDB_VALUE_RSIZE_OFFSET], sizeof(int));
+    return 0;
+}
+
+/* データ部の値を読み込みます。圧縮されている場合は展開します。
+   offset はデータ部の位置です。値の領域が不足している場合は -2 を返します。*/
+static int read_value_data(struct bdb_t* bdb,
+                           int64 offset,
+                           struct bdb_value_t* v,
+                           void* val,
+                           int valsize)
+{
+    char* cval;
+    int dsize;
+
+    if (v->rawsize > valsize)
+        return -2;
+    offset += BDB_VALUE_SIZE;
+    if (v->codec == NIO_COMP_NONE) {
+        if (mmap_pread(bdb->nio->mmap, val, v->valsize, offset) != v->valsize)
+            return -1;
+        return v->valsize;
+    }
+
+    /* マップ上にある場合はコピーせずに展開します。*/
+    cval = mmap_pin(bdb->nio->mmap, offset, v->valsize);
+    if (cval) {
+        dsize = nio_value_uncompress(v->codec, cval, v->valsize, val, valsize);
+        mmap_unpin(bdb->nio->mmap);
+        return dsize;
+    }
+    cval = (char*)malloc(v->valsize);
+    if (cval == NULL) {
+        err_write("bdb: no memory %d bytes.", v->valsize);
+        return -1;
+    }
+    if (mmap_pread(bdb->nio->mmap, cval, v->valsize, offset) != v->valsize) {
+        free(cval);
+        return -1;
+    }
+    dsize = nio_value_uncompress(v->codec, cval, v->valsize, val, valsize);
+    free(cval);
+    return dsize;
+}
+
+static int write_value_header(struct bdb_t* bdb,
+                              int64 offset,
+                              struct bdb_value_t* v)
+{
+    char buf[BDB_VALUE_SIZE];
+
+    memset(buf, '\0', sizeof(buf));
+    /* 領域サイズ */
+    memcpy(&buf[BDB_VALUE_ASIZE_OFFSET], &v->areasize, sizeof(int));
+    /* データサイズ */
+    memcpy(&buf[BDB_VALUE_DSIZE_OFFSET], &v->valsize, sizeof(int));
+    /* 次ポインタ */
+    memcpy(&buf[BDB_VALUE_NEXT_OFFSET], &v->next_ptr, sizeof(int64));
+    /* 前ポインタ */
+    memcpy(&buf[BDB_VALUE_PREV_OFFSET], &v->prev_ptr, sizeof(int64));
+    /* 圧縮方式と圧縮前のデータサイズ */
+    set_value_codec(buf, v);
+
+    /* valueヘッダーを書き込みます。*/
+    if (snap_preserve_value(bdb, offset) < 0)
+        return -1;
+    if (mmap_pwrite(bdb->nio->mmap, buf, BDB_VALUE_SIZE, offset) != BDB_VALUE_SIZE)
+        return -1;
+    return 0;
+}
+
+/* 圧縮済みの値をそのまま書き出します。*/
+static int64 write_new_value(struct bdb_t* bdb,
+                             const void* val,
+                             int valsize,
+                             int codec,
+                             int rawsize,
+                             int64 prev_ptr,
+                             int64 next_ptr)
+{
+    int rsize, areasize;
+    int64 ptr;
+    struct bdb_value_t v;
+
+    /* value を書き出す領域を取得します。*/
+    rsize = BDB_VALUE_SIZE + valsize;
+    if (bdb->align_bytes > 0) {
+        if (rsize % bdb->align_bytes)
+            rsize = (rsize / bdb->align_bytes + 1) * bdb->align_bytes;
+    }
+    ptr = avail_space(bdb, rsize, &areasize);
+    if (ptr < 0)
+        return -1;
+
+    /* value を編集します。*/
+    memset(&v, '\0', sizeof(struct bdb_value_t));
     v.areasize = areasize;
     v.valsize = valsize;
     v.next_ptr = next_ptr;
     v.prev_ptr = prev_ptr;
+    v.codec = codec;
+    v.rawsize = rawsize;
 
     /* value を書き出します。*/
     if (write_value(bdb, ptr, &v, val) < 0) {
@@ -802,18 +1671,28 @@ static int64 add_value(struct bdb_t* bdb,
     return ptr;
 }
 
-static int read_node(struct bdb_t* bdb, int64 offset, void* buf)
+static int64 add_value(struct bdb_t* bdb,
+                       const void* val,
+                       int valsize,
+                       int64 prev_ptr,
+                       int64 next_ptr)
 {
-    mmap_seek(bdb->nio->mmap, offset);
-    if (mmap_read(bdb->nio->mmap, buf, bdb->node_pgsize) != bdb->node_pgsize)
-        return -1;
-    return 0;
+    int64 ptr;
+    char* cval;
+    int csize, codec = NIO_COMP_NONE;
+
+    /* 圧縮した値は圧縮後のサイズで領域を取得します。*/
+    cval = nio_value_compress(bdb->nio, val, valsize, &csize, &codec);
+    if (cval == NULL)
+        return write_new_value(bdb, val, valsize, codec, valsize, prev_ptr, next_ptr);
+    ptr = write_new_value(bdb, cval, csize, codec, valsize, prev_ptr, next_ptr);
+    free(cval);
+    return ptr;
 }
 
-static int write_node(struct bdb_t* bdb, int64 offset, const void* buf)
+static int read_node(struct bdb_t* bdb, int64 offset, void* buf)
 {
-    mmap_seek(bdb->nio->mmap, offset);
-    if (mmap_write(bdb->nio->mmap, buf, bdb->node_pgsize) != bdb->node_pgsize)
+    if (mmap_pread(bdb->nio->mmap, buf, bdb->node_pgsize, offset) != bdb->node_pgsize)
         return -1;
     return 0;
 }
@@ -834,6 +1713,77 @@ static int get_node_keynum(const char* buf)
     return keynum;
 }
 
+/* ヘッダーとルートから上位のブランチノードをメモリに固定します。
+   固定するノード数が BDB_LOCK_NODES を超える階層は固定しません。
+   固定できない場合でも処理は継続します。*/
+static void lock_branch(struct bdb_t* bdb)
+{
+    int64* area;
+    int64* level;
+    int64* next;
+    int64* tmp;
+    int num, next_num, total;
+    char* buf;
+    int i, j;
+
+    if (! bdb->nio->mmap_lock_flag)
+        return;
+    if (mmap_lock(bdb->nio->mmap, 0, bdb->header_size) < 0)
+        return;
+    if (bdb->root_ptr == 0)
+        return;
+
+    area = (int64*)malloc(BDB_LOCK_NODES * sizeof(int64) * 2);
+    if (area == NULL) {
+        err_write("bdb: no memory.");
+        return;
+    }
+    level = area;
+    next = area + BDB_LOCK_NODES;
+    buf = (char*)alloca(bdb->node_pgsize);
+
+    level[0] = bdb->root_ptr;
+    num = 1;
+    total = 0;
+    while (num > 0 && total + num <= BDB_LOCK_NODES) {
+        next_num = 0;
+        for (i = 0; i < num; i++) {
+            int keynum;
+            char* p;
+
+            if (mmap_lock(bdb->nio->mmap, level[i], bdb->node_pgsize) < 0)
+                goto final;
+            if (read_node(bdb, level[i], buf) < 0)
+                goto final;
+
+            /* 子孫のブランチノードを次の階層に追加します。*/
+            keynum = get_node_keynum(buf);
+            p = buf + BDB_NODE_KEY_OFFSET;
+            for (j = 0; j <= keynum; j++) {
+                int64 ptr;
+                ushort ksize;
+
+                memcpy(&ptr, p, sizeof(int64));
+                if (next_num < BDB_LOCK_NODES && is_node(bdb, ptr))
+                    next[next_num++] = ptr;
+                if (j < keynum) {
+                    p += bdb->node_ptrsize;
+                    memcpy(&ksize, p, sizeof(ushort));
+                    p += sizeof(ushort) + ksize;
+                }
+            }
+        }
+        total += num;
+        tmp = level;
+        level = next;
+        next = tmp;
+        num = next_num;
+    }
+
+final:
+    free(area);
+}
+
 static void set_node_id(char* buf)
 {
     ushort rid = BDB_NODE_ID;
@@ -857,50 +1807,241 @@ static void set_node_keynum(char* buf, int keynum)
     memcpy(buf+BDB_NODE_KEYNUM_OFFSET, &knum, sizeof(ushort));
 }
 
-static void set_leaf_id(char* buf)
+static int node_slots_size(struct bdb_t* bdb, int keynum)
 {
-    ushort rid = BDB_LEAF_ID;
+    if (bdb->fver < BDB_SLOT_FILE_VERSION)
+        return 0;
+    return keynum * BDB_NODE_SLOT_SIZE;
+}
 
-    memcpy(buf, &rid, sizeof(ushort));
+/***************
+ * Key compare *
+ ***************/
+
+/* 組み込みの比較は関数ポインタを経由せずに展開されるように
+   小さな static 関数で記述しています。*/
+
+static int cmp_bytes(const void* k1, int k1size, const void* k2, int k2size)
+{
+    int c;
+
+    c = memcmp(k1, k2, (k1size < k2size)? k1size : k2size);
+    if (c != 0)
+        return (c < 0)? -1 : 1;
+    return (k1size > k2size) - (k1size < k2size);
 }
 
-static void set_leaf_size(char* buf, int size)
+static uint64 load_be64(const uchar* p)
 {
-    ushort nsize;
+    return ((uint64)p[0] << 56) | ((uint64)p[1] << 48) |
+           ((uint64)p[2] << 40) | ((uint64)p[3] << 32) |
+           ((uint64)p[4] << 24) | ((uint64)p[5] << 16) |
+           ((uint64)p[6] << 8)  |  (uint64)p[7];
+}
 
-    nsize = (ushort)size;
-    memcpy(buf+BDB_LEAF_SIZE_OFFSET, &nsize, sizeof(ushort));
+static int cmp_uint64be(const void* k1, int k1size, const void* k2, int k2size)
+{
+    uint64 v1, v2;
+
+    if (k1size != sizeof(uint64) || k2size != sizeof(uint64))
+        return cmp_bytes(k1, k1size, k2, k2size);
+    v1 = load_be64((const uchar*)k1);
+    v2 = load_be64((const uchar*)k2);
+    return (v1 > v2) - (v1 < v2);
 }
 
-static void set_leaf_keynum(char* buf, int keynum)
+static int cmp_int64(const void* k1, int k1size, const void* k2, int k2size)
 {
-    ushort knum;
+    int64 v1, v2;
 
-    knum = (ushort)keynum;
-    memcpy(buf+BDB_LEAF_KEYNUM_OFFSET, &knum, sizeof(ushort));
+    if (k1size != sizeof(int64) || k2size != sizeof(int64))
+        return cmp_bytes(k1, k1size, k2, k2size);
+    memcpy(&v1, k1, sizeof(int64));
+    memcpy(&v2, k2, sizeof(int64));
+    return (v1 > v2) - (v1 < v2);
 }
 
-static void set_leaf_nextptr(char* buf, int64 ptr)
+static int ascii_lower(int c)
 {
-    memcpy(buf+BDB_LEAF_NEXT_OFFSET, &ptr, sizeof(int64));
+    return (c >= 'A' && c <= 'Z')? c + ('a' - 'A') : c;
 }
 
-static void set_leaf_prevptr(char* buf, int64 ptr)
+static int cmp_case(const void* k1, int k1size, const void* k2, int k2size)
 {
-    memcpy(buf+BDB_LEAF_PREV_OFFSET, &ptr, sizeof(int64));
+    const uchar* p1 = (const uchar*)k1;
+    const uchar* p2 = (const uchar*)k2;
+    int n;
+    int i;
+
+    n = (k1size < k2size)? k1size : k2size;
+    for (i = 0; i < n; i++) {
+        int c1, c2;
+
+        if (p1[i] == p2[i])
+            continue;
+        c1 = ascii_lower(p1[i]);
+        c2 = ascii_lower(p2[i]);
+        if (c1 != c2)
+            return (c1 < c2)? -1 : 1;
+    }
+    return (k1size > k2size) - (k1size < k2size);
 }
 
-static void set_leaf_flag(char* buf, uchar flag)
+/* キーを比較します。
+   key1 < key2 は負、等しい場合はゼロ、key1 > key2 は正の値を返します。*/
+static int key_cmp(struct bdb_t* bdb, const void* k1, int k1size, const void* k2, int k2size)
 {
-    memcpy(buf+BDB_LEAF_FLAG_OFFSET, &flag, sizeof(uchar));
+    switch (bdb->cmp_kind) {
+        case NIO_CMP_MEMCMP:
+            return cmp_bytes(k1, k1size, k2, k2size);
+        case NIO_CMP_UINT64BE:
+            return cmp_uint64be(k1, k1size, k2, k2size);
+        case NIO_CMP_INT64:
+            return cmp_int64(k1, k1size, k2, k2size);
+        case NIO_CMP_REVERSE:
+            return cmp_bytes(k2, k2size, k1, k1size);
+        case NIO_CMP_CASE:
+            return cmp_case(k1, k1size, k2, k2size);
+    }
+    return (bdb->cmp_func)(k1, k1size, k2, k2size);
 }
 
-#if 0
-static void debug_nodebuf_print(struct bdb_t* bdb, const char* buf)
+/* キーのサイズを調べます。
+   NIO_CMP_INT64 は８バイト以外のキーをバイト列と混ぜて比較すると
+   順序が推移的にならないため、８バイト以外のキーはエラーにします。
+   fname はエラーメッセージに出力する関数名です。*/
+static int check_keysize(struct bdb_t* bdb, int keysize, const char* fname)
 {
-    char* p;
-    char keybuf[NIO_MAX_KEYSIZE+1];
-    int keynum;
+    if (keysize > NIO_MAX_KEYSIZE) {
+        err_write("%s: keysize is too large, less than %d bytes.", fname, NIO_MAX_KEYSIZE);
+        return -1;
+    }
+    if (bdb->cmp_kind == NIO_CMP_INT64 && keysize != sizeof(int64)) {
+        err_write("%s: keysize must be %d bytes with NIO_CMP_INT64, keysize=%d.",
+                  fname, (int)sizeof(int64), keysize);
+        return -1;
+    }
+    return 0;
+}
+
+/* キーの先頭４バイトを大小関係が保存される整数に変換します。
+   整数のキーは上位４バイト、降順は反転した値になります。*/
+static uint bt_key_fingerprint(struct bdb_t* bdb, const void* key, int keysize)
+{
+    const uchar* k = (const uchar*)key;
+    uint fp = 0;
+    int i;
+
+    if (bdb->cmp_kind == NIO_CMP_INT64 && keysize == sizeof(int64)) {
+        int64 v;
+
+        memcpy(&v, key, sizeof(int64));
+        return (uint)(((uint64)v ^ ((uint64)1 << 63)) >> 32);
+    }
+    for (i = 0; i < 4; i++) {
+        fp <<= 8;
+        if (i < keysize)
+            fp |= (bdb->cmp_kind == NIO_CMP_CASE)? ascii_lower(k[i]) : k[i];
+    }
+    return (bdb->cmp_kind == NIO_CMP_REVERSE)? ~fp : fp;
+}
+
+/* ブランチノードのスロットディレクトリを作成します。*/
+static void bt_build_slots(struct bdb_t* bdb, char* buf)
+{
+    ushort rid;
+    int keynum;
+    char* p;
+    char* sp;
+    int i;
+
+    if (bdb->fver < BDB_SLOT_FILE_VERSION)
+        return;
+    memcpy(&rid, buf, sizeof(ushort));
+    if (rid != BDB_NODE_ID)
+        return;
+
+    keynum = get_node_keynum(buf);
+    if (get_node_size(buf) + node_slots_size(bdb, keynum) > bdb->node_pgsize) {
+        /* ディレクトリが収まらない */
+        buf[BDB_NODE_FLAG_OFFSET] &= ~SLOT_DIRECTORY_NODE;
+        return;
+    }
+
+    p = buf + BDB_NODE_KEY_OFFSET;
+    sp = buf + bdb->node_pgsize - node_slots_size(bdb, keynum);
+    for (i = 0; i < keynum; i++) {
+        ushort ksize;
+        ushort off;
+        uint fp;
+
+        off = (ushort)(p - (buf + BDB_NODE_KEY_OFFSET));
+        memcpy(&ksize, p + bdb->node_ptrsize, sizeof(ushort));
+        fp = bt_key_fingerprint(bdb, p + bdb->node_ptrsize + sizeof(ushort), ksize);
+        memcpy(sp, &fp, sizeof(uint));
+        memcpy(sp + sizeof(uint), &off, sizeof(ushort));
+        memcpy(sp + sizeof(uint) + sizeof(ushort), &ksize, sizeof(ushort));
+        sp += BDB_NODE_SLOT_SIZE;
+        p += bdb->node_ptrsize + sizeof(ushort) + ksize;
+    }
+    buf[BDB_NODE_FLAG_OFFSET] |= SLOT_DIRECTORY_NODE;
+}
+
+static int write_node(struct bdb_t* bdb, int64 offset, void* buf)
+{
+    if (snap_preserve(bdb, offset, bdb->node_pgsize) < 0)
+        return -1;
+    bt_build_slots(bdb, (char*)buf);
+    mmap_seek(bdb->nio->mmap, offset);
+    if (mmap_write(bdb->nio->mmap, buf, bdb->node_pgsize) != bdb->node_pgsize)
+        return -1;
+    return 0;
+}
+
+static void set_leaf_id(char* buf)
+{
+    ushort rid = BDB_LEAF_ID;
+
+    memcpy(buf, &rid, sizeof(ushort));
+}
+
+static void set_leaf_size(char* buf, int size)
+{
+    ushort nsize;
+
+    nsize = (ushort)size;
+    memcpy(buf+BDB_LEAF_SIZE_OFFSET, &nsize, sizeof(ushort));
+}
+
+static void set_leaf_keynum(char* buf, int keynum)
+{
+    ushort knum;
+
+    knum = (ushort)keynum;
+    memcpy(buf+BDB_LEAF_KEYNUM_OFFSET, &knum, sizeof(ushort));
+}
+
+static void set_leaf_nextptr(char* buf, int64 ptr)
+{
+    memcpy(buf+BDB_LEAF_NEXT_OFFSET, &ptr, sizeof(int64));
+}
+
+static void set_leaf_prevptr(char* buf, int64 ptr)
+{
+    memcpy(buf+BDB_LEAF_PREV_OFFSET, &ptr, sizeof(int64));
+}
+
+static void set_leaf_flag(char* buf, uchar flag)
+{
+    memcpy(buf+BDB_LEAF_FLAG_OFFSET, &flag, sizeof(uchar));
+}
+
+#if 0
+static void debug_nodebuf_print(struct bdb_t* bdb, const char* buf)
+{
+    char* p;
+    char keybuf[NIO_MAX_KEYSIZE+1];
+    int keynum;
     int nsize;
     int64 ptr;
     ushort ksize;
@@ -914,7 +2055,7 @@ static void debug_nodebuf_print(struct bdb_t* bdb, const char* buf)
     for (i = 0; i < keynum; i++) {
         memcpy(&ptr, p, sizeof(int64));
         printf("ptr=%lld|", ptr);
-        p += sizeof(int64);
+        p += bdb->node_ptrsize;
         memcpy(&ksize, p, sizeof(ushort));
         printf("ksize=%d|", ksize);
         p += sizeof(ushort);
@@ -950,7 +2091,7 @@ static void debug_node_print(struct bdb_t* bdb, int64 node_ptr)
     for (i = 0; i < keynum; i++) {
         memcpy(&ptr, p, sizeof(int64));
         printf("ptr=%lld|", ptr);
-        p += sizeof(int64);
+        p += bdb->node_ptrsize;
         memcpy(&ksize, p, sizeof(ushort));
         printf("ksize=%d|", ksize);
         p += sizeof(ushort);
@@ -1003,6 +2144,177 @@ static void debug_leaf_print(struct bdb_t* bdb, int64 leaf_ptr)
  * BTree I/O *
  *************/
 
+/* 子孫ポインタ p の部分木のキー数を返します。*/
+static int64 bt_get_count(struct bdb_t* bdb, const char* p)
+{
+    int64 count = 0;
+
+    if (bdb->count_flag && p)
+        memcpy(&count, p + sizeof(int64), sizeof(int64));
+    return count;
+}
+
+static void bt_put_count(struct bdb_t* bdb, char* p, int64 count)
+{
+    if (bdb->count_flag)
+        memcpy(p + sizeof(int64), &count, sizeof(int64));
+}
+
+/* ノードから target_ptr の子孫ポインタの位置を返します。
+   見つからない場合は NULL を返します。*/
+static char* bt_child_pos(struct bdb_t* bdb, const char* buf, int64 target_ptr)
+{
+    int keynum;
+    char* p;
+    int64 ptr;
+    int i;
+
+    keynum = get_node_keynum(buf);
+    p = (char*)buf + BDB_NODE_KEY_OFFSET;
+    for (i = 0; i < keynum; i++) {
+        ushort ksize;
+
+        memcpy(&ptr, p, sizeof(int64));
+        if (ptr == target_ptr)
+            return p;
+        p += bdb->node_ptrsize;
+        memcpy(&ksize, p, sizeof(ushort));
+        p += sizeof(ushort) + ksize;
+    }
+    memcpy(&ptr, p, sizeof(int64));
+    return (ptr == target_ptr)? p : NULL;
+}
+
+/* 子孫ポインタのキー数を設定します。*/
+static void bt_set_child_count(struct bdb_t* bdb, char* buf, int64 ptr, int64 count)
+{
+    char* p;
+
+    p = bt_child_pos(bdb, buf, ptr);
+    if (p != NULL)
+        bt_put_count(bdb, p, count);
+}
+
+/* 子孫ポインタのキー数に delta を加えます。*/
+static void bt_add_child_count(struct bdb_t* bdb, char* buf, int64 ptr, int64 delta)
+{
+    char* p;
+
+    p = bt_child_pos(bdb, buf, ptr);
+    if (p != NULL)
+        bt_put_count(bdb, p, bt_get_count(bdb, p) + delta);
+}
+
+/* ノードの部分木にあるキー数を返します。*/
+static int64 bt_node_count(struct bdb_t* bdb, const char* buf)
+{
+    int keynum;
+    const char* p;
+    int64 count;
+    int i;
+
+    if (! bdb->count_flag)
+        return 0;
+
+    keynum = get_node_keynum(buf);
+    p = buf + BDB_NODE_KEY_OFFSET;
+    count = 0;
+    for (i = 0; i < keynum; i++) {
+        ushort ksize;
+
+        count += bt_get_count(bdb, p);
+        p += bdb->node_ptrsize;
+        memcpy(&ksize, p, sizeof(ushort));
+        p += sizeof(ushort) + ksize;
+    }
+    count += bt_get_count(bdb, p);
+    return count;
+}
+
+/* ノードで target_ptr より左にある子孫のキー数の合計を返します。*/
+static int64 bt_count_before(struct bdb_t* bdb, const char* buf, int64 target_ptr)
+{
+    int keynum;
+    const char* p;
+    int64 ptr;
+    int64 count;
+    int i;
+
+    keynum = get_node_keynum(buf);
+    p = buf + BDB_NODE_KEY_OFFSET;
+    count = 0;
+    for (i = 0; i < keynum; i++) {
+        ushort ksize;
+
+        memcpy(&ptr, p, sizeof(int64));
+        if (ptr == target_ptr)
+            break;
+        count += bt_get_count(bdb, p);
+        p += bdb->node_ptrsize;
+        memcpy(&ksize, p, sizeof(ushort));
+        p += sizeof(ushort) + ksize;
+    }
+    return count;
+}
+
+/* ノードから rank 番目(ゼロ起点)のキーを含む子孫のポインタを返します。
+   rank は子孫の中での順位に更新されます。
+   範囲外の場合は -1 を返します。*/
+static int64 bt_rank_child(struct bdb_t* bdb, const char* buf, int64* rank)
+{
+    int keynum;
+    const char* p;
+    int64 ptr;
+    int64 count;
+    int i;
+
+    keynum = get_node_keynum(buf);
+    p = buf + BDB_NODE_KEY_OFFSET;
+    for (i = 0; i <= keynum; i++) {
+        ushort ksize;
+
+        memcpy(&ptr, p, sizeof(int64));
+        count = bt_get_count(bdb, p);
+        if (*rank < count)
+            return ptr;
+        *rank -= count;
+        if (i == keynum)
+            break;
+        p += bdb->node_ptrsize;
+        memcpy(&ksize, p, sizeof(ushort));
+        p += sizeof(ushort) + ksize;
+    }
+    return -1;
+}
+
+static int read_leaf(struct bdb_t* bdb, int64 ptr, struct bdb_leaf_t* leaf);
+static int get_leaf(struct bdb_t* bdb, int64 ptr, struct bdb_leaf_t* leaf);
+static struct leaf_cache_t* leaf_frame_find(struct bdb_t* bdb, int64 ptr);
+
+/* 子孫(ノードかリーフ)の部分木にあるキー数を返します。
+   キャッシュで更新されているリーフはフレームのキー数になります。*/
+static int64 bt_child_count(struct bdb_t* bdb, int64 ptr)
+{
+    if (is_leaf(bdb, ptr)) {
+        struct leaf_cache_t* lc;
+        struct bdb_leaf_t leaf;
+
+        lc = leaf_frame_find(bdb, ptr);
+        if (lc != NULL)
+            return lc->leaf.keynum;
+        if (read_leaf(bdb, ptr, &leaf) < 0)
+            return -1;
+        return leaf.keynum;
+    } else {
+        char* buf;
+
+        buf = (char*)alloca(bdb->node_pgsize);
+        if (read_node(bdb, ptr, buf) < 0)
+            return -1;
+        return bt_node_count(bdb, buf);
+    }
+}
+
 static int bt_create_root(struct bdb_t* bdb,
                           const void* key,
                           int keysize,
@@ -1017,7 +2329,7 @@ static int bt_create_root(struct bdb_t* bdb,
     char* p;
 
     /* ルートノードを書き出す領域を取得します。*/
-    ptr = nio_avail_space(bdb->nio, bdb->node_pgsize, NULL, bdb->filling_rate);
+    ptr = avail_space(bdb, bdb->node_pgsize, NULL);
     if (ptr < 0)
         return -1;
 
@@ -1028,7 +2340,7 @@ static int bt_create_root(struct bdb_t* bdb,
     /* ノードを編集します。*/
     set_node_id(buf);
     set_node_keynum(buf, knum);
-    nsize = BDB_NODE_KEY_OFFSET + sizeof(int64) + sizeof(ushort) + keysize + sizeof(int64);
+    nsize = BDB_NODE_KEY_OFFSET + bdb->node_ptrsize + sizeof(ushort) + keysize + bdb->node_ptrsize;
     set_node_size(buf, nsize);
 
     /* キー部を編集します。*/
@@ -1038,13 +2350,29 @@ static int bt_create_root(struct bdb_t* bdb,
      */
     p = buf + BDB_NODE_KEY_OFFSET;
     memcpy(p, &left_ptr, sizeof(int64));
-    p += sizeof(int64);
+    if (bdb->count_flag) {
+        int64 count;
+
+        count = bt_child_count(bdb, left_ptr);
+        if (count < 0)
+            return -1;
+        bt_put_count(bdb, p, count);
+    }
+    p += bdb->node_ptrsize;
     ksz = (ushort)keysize;
     memcpy(p, &ksz, sizeof(ushort));
     p += sizeof(ushort);
     memcpy(p, key, keysize);
     p += keysize;
     memcpy(p, &right_ptr, sizeof(int64));
+    if (bdb->count_flag) {
+        int64 count;
+
+        count = bt_child_count(bdb, right_ptr);
+        if (count < 0)
+            return -1;
+        bt_put_count(bdb, p, count);
+    }
 
     /* ルートノードを書き出します。*/
     if (write_node(bdb, ptr, buf) < 0)
@@ -1055,7 +2383,7 @@ static int bt_create_root(struct bdb_t* bdb,
 }
 
 /* キーのオフセット位置を off_array に設定します。*/
-static void bt_key_offset(const char* kbuf, int keynum, int* off_array)
+static void bt_key_offset(struct bdb_t* bdb, const char* kbuf, int keynum, int* off_array)
 {
     char* p;
     int offset = 0;
@@ -1067,10 +2395,10 @@ static void bt_key_offset(const char* kbuf, int keynum, int* off_array)
 
         *off_array++ = offset;
         memcpy(&left_ptr, p, sizeof(int64));
-        p += sizeof(int64);
+        p += bdb->node_ptrsize;
         memcpy(&ksize, p, sizeof(ushort));
         p += sizeof(ushort) + ksize;
-        offset += sizeof(int64) + sizeof(ushort) + ksize;
+        offset += bdb->node_ptrsize + sizeof(ushort) + ksize;
     }
 }
 
@@ -1088,10 +2416,10 @@ static int bt_key_cmp(struct bdb_t* bdb,
 
     p = (char*)kbuf + offset;
     memcpy(&left_ptr, p, sizeof(int64));
-    p += sizeof(int64);
+    p += bdb->node_ptrsize;
     memcpy(&ksize, p, sizeof(ushort));
     p += sizeof(ushort);
-    c = (bdb->cmp_func)(key, keysize, p, ksize);
+    c = key_cmp(bdb, key, keysize, p, ksize);
     if (c >= 0) {
         p += ksize;
         memcpy(child_ptr, p, sizeof(int64));
@@ -1109,6 +2437,76 @@ static int bt_key_cmp(struct bdb_t* bdb,
  *
  * BDB_KEY_FOUND か BDB_KEY_NOTFOUND を返します。
  */
+/* スロットディレクトリを使用してノードを検索します。
+   bt_search_node() と同じ値を返します。*/
+static int bt_search_slots(struct bdb_t* bdb,
+                           const char* buf,
+                           const void* key,
+                           int keysize,
+                           int64* child_ptr,
+                           int* offset)
+{
+    int keynum;
+    const char* p;
+    const char* slots;
+    uint fp;
+    int use_fp;
+    int lo;
+    int hi;
+    ushort off;
+    ushort ksize;
+
+    keynum = get_node_keynum(buf);
+    p = buf + BDB_NODE_KEY_OFFSET;
+    slots = buf + bdb->node_pgsize - node_slots_size(bdb, keynum);
+
+    /* 組み込みの比較の場合はフィンガープリントで大小を決定できます。*/
+    use_fp = (bdb->cmp_kind != BDB_CMP_FUNC);
+    fp = bt_key_fingerprint(bdb, key, keysize);
+
+    lo = 0;
+    hi = keynum;
+    while (lo < hi) {
+        const char* sp;
+        int mid;
+        int c;
+        uint sfp;
+
+        mid = (lo + hi) / 2;
+        sp = slots + mid * BDB_NODE_SLOT_SIZE;
+        memcpy(&sfp, sp, sizeof(uint));
+        if (use_fp && fp != sfp) {
+            c = (fp < sfp)? -1 : 1;
+        } else {
+            memcpy(&off, sp + sizeof(uint), sizeof(ushort));
+            memcpy(&ksize, sp + sizeof(uint) + sizeof(ushort), sizeof(ushort));
+            c = key_cmp(bdb, key, keysize, p + off + bdb->node_ptrsize + sizeof(ushort), ksize);
+        }
+        if (c == 0) {
+            /* 右側のポインタ */
+            memcpy(&off, sp + sizeof(uint), sizeof(ushort));
+            memcpy(&ksize, sp + sizeof(uint) + sizeof(ushort), sizeof(ushort));
+            memcpy(child_ptr, p + off + bdb->node_ptrsize + sizeof(ushort) + ksize, sizeof(int64));
+            if (offset)
+                *offset = off;
+            return BDB_KEY_FOUND;
+        }
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    /* lo 番目のキーの左側のポインタ(最後は右端のポインタ)です。*/
+    if (lo < keynum) {
+        memcpy(&off, slots + lo * BDB_NODE_SLOT_SIZE + sizeof(uint), sizeof(ushort));
+        memcpy(child_ptr, p + off, sizeof(int64));
+    } else {
+        memcpy(child_ptr, p + get_node_size(buf) - BDB_NODE_KEY_OFFSET - bdb->node_ptrsize, sizeof(int64));
+    }
+    return BDB_KEY_NOTFOUND;
+}
+
 static int bt_search_node(struct bdb_t* bdb,
                           const char* buf,
                           const void* key,
@@ -1123,12 +2521,15 @@ static int bt_search_node(struct bdb_t* bdb,
     int start;
     int end;
 
+    if (bdb->fver >= BDB_SLOT_FILE_VERSION && (buf[BDB_NODE_FLAG_OFFSET] & SLOT_DIRECTORY_NODE))
+        return bt_search_slots(bdb, buf, key, keysize, child_ptr, offset);
+
     keynum = get_node_keynum(buf);
     p = (char*)buf + BDB_NODE_KEY_OFFSET;
 
     /* キーのオフセット位置を求めます。*/
     off_array = (int*)alloca(keynum * sizeof(int));
-    bt_key_offset(p, keynum, off_array);
+    bt_key_offset(bdb, p, keynum, off_array);
 
     /* 左端を調べます。*/
     c = bt_key_cmp(bdb, key, keysize, p, off_array[0], child_ptr);
@@ -1189,10 +2590,40 @@ static int bt_search_node(struct bdb_t* bdb,
     }
 }
 
-static char* bt_set_key(char* buf,
+/* キーが格納されるリーフまでの経路のキー数に delta を加えます。
+   リーフにキーを追加または削除する前に呼び出されます。*/
+static int bt_count_key(struct bdb_t* bdb, const void* key, int keysize, int delta)
+{
+    int64 ptr;
+    char* buf;
+
+    if (! bdb->count_flag)
+        return 0;
+
+    buf = (char*)alloca(bdb->node_pgsize);
+    ptr = bdb->root_ptr;
+    while (ptr > 0) {
+        int64 child_ptr;
+
+        if (read_node(bdb, ptr, buf) < 0)
+            return -1;
+        bt_search_node(bdb, buf, key, keysize, &child_ptr, NULL);
+        bt_add_child_count(bdb, buf, child_ptr, delta);
+        if (write_node(bdb, ptr, buf) < 0)
+            return -1;
+        if (is_leaf(bdb, child_ptr))
+            break;
+        ptr = child_ptr;
+    }
+    return 0;
+}
+
+static char* bt_set_key(struct bdb_t* bdb,
+                        char* buf,
                         const void* key,
                         int keysize,
-                        int64 ptr)
+                        int64 ptr,
+                        int64 count)
 {
     ushort ksize;
 
@@ -1202,7 +2633,8 @@ static char* bt_set_key(char* buf,
     memcpy(buf, key, keysize);
     buf += keysize;
     memcpy(buf, &ptr, sizeof(int64));
-    buf += sizeof(int64);
+    bt_put_count(bdb, buf, count);
+    buf += bdb->node_ptrsize;
     return buf;
 }
 
@@ -1210,7 +2642,8 @@ static void bt_ins_node(struct bdb_t* bdb,
                         char* buf,
                         const void* key,
                         int keysize,
-                        int64 child_ptr)
+                        int64 child_ptr,
+                        int64 count)
 {
     int ins_size;
     int keynum;
@@ -1219,7 +2652,7 @@ static void bt_ins_node(struct bdb_t* bdb,
     int nkeynum;
     int nnsize;
 
-    ins_size = sizeof(ushort) + keysize + sizeof(int64);
+    ins_size = sizeof(ushort) + keysize + bdb->node_ptrsize;
     keynum = get_node_keynum(buf);
     p = buf + BDB_NODE_KEY_OFFSET;
     while (keynum--) {
@@ -1228,17 +2661,17 @@ static void bt_ins_node(struct bdb_t* bdb,
         int c;
 
         memcpy(&left_ptr, p, sizeof(int64));
-        p += sizeof(int64);
+        p += bdb->node_ptrsize;
         memcpy(&ksize, p, sizeof(ushort));
         p += sizeof(ushort);
-        c = (bdb->cmp_func)(key, keysize, p, ksize);
+        c = key_cmp(bdb, key, keysize, p, ksize);
         if (c <= 0) {
             size_t shift_n;
 
             p -= sizeof(ushort);  /* bugfix: 2011/4/2 */
             shift_n = (buf + get_node_size(buf)) - p;
             memmove(p+ins_size, p, shift_n);
-            bt_set_key(p, key, keysize, child_ptr);
+            bt_set_key(bdb, p, key, keysize, child_ptr, count);
             ins_done_flag = 1;
             break;
         }
@@ -1246,8 +2679,8 @@ static void bt_ins_node(struct bdb_t* bdb,
     }
     if (! ins_done_flag) {
         /* ノードの最後に追加します。*/
-        p += sizeof(int64);
-        bt_set_key(p, key, keysize, child_ptr);
+        p += bdb->node_ptrsize;
+        bt_set_key(bdb, p, key, keysize, child_ptr, count);
     }
 
     /* ヘッダーを更新します。*/
@@ -1261,6 +2694,7 @@ static int bt_split_page(struct bdb_t* bdb,
                          const void* key,
                          int keysize,
                          int64 child_ptr,
+                         int64 count,
                          char* buf,
                          void* promo_key,
                          int* promo_keysize,
@@ -1278,7 +2712,7 @@ static int bt_split_page(struct bdb_t* bdb,
     ushort nsize;
 
     /* 分割するノードを書き出す領域を取得します。*/
-    *promo_child_ptr = nio_avail_space(bdb->nio, bdb->node_pgsize, NULL, bdb->filling_rate);
+    *promo_child_ptr = avail_space(bdb, bdb->node_pgsize, NULL);
     if (*promo_child_ptr < 0)
         return -1;
 
@@ -1289,7 +2723,7 @@ static int bt_split_page(struct bdb_t* bdb,
     memcpy(wbuf, buf, bdb->node_pgsize);
 
     /* 作業領域にキーを挿入 */
-    bt_ins_node(bdb, wbuf, key, keysize, child_ptr);
+    bt_ins_node(bdb, wbuf, key, keysize, child_ptr, count);
     wknum = get_node_keynum(wbuf);
     wnsize = get_node_size(wbuf);
 
@@ -1307,8 +2741,8 @@ static int bt_split_page(struct bdb_t* bdb,
     while (src < midp) {
         int n;
 
-        memcpy(&ksize, src+sizeof(int64), sizeof(ushort));
-        n = sizeof(int64) + sizeof(ushort) + ksize;
+        memcpy(&ksize, src+bdb->node_ptrsize, sizeof(ushort));
+        n = bdb->node_ptrsize + sizeof(ushort) + ksize;
         memcpy(dst, src, n);
         src += n;
         dst += n;
@@ -1316,10 +2750,10 @@ static int bt_split_page(struct bdb_t* bdb,
         nsize += n;
     }
     /* 右側のポインタを移送 */
-    memcpy(dst, src, sizeof(int64));
-    src += sizeof(int64);
-    dst += sizeof(int64);
-    nsize += sizeof(int64);
+    memcpy(dst, src, bdb->node_ptrsize);
+    src += bdb->node_ptrsize;
+    dst += bdb->node_ptrsize;
+    nsize += bdb->node_ptrsize;
 
     /* ヘッダー情報を更新 */
     set_node_size(buf, nsize+BDB_NODE_SIZE);
@@ -1351,12 +2785,18 @@ static int bt_split_page(struct bdb_t* bdb,
     return 0;
 }
 
+/* node_ptr は search_ptr の下で分割された子孫の右側になるノードかリーフで、
+   count はそのキー数です。分割元の子孫のキー数から count を移します。
+   ins_ptr がゼロ以外の場合は最下位ではなく ins_ptr のノードに挿入します。*/
 static int bt_insert_key(struct bdb_t* bdb,
                          int64 search_ptr,
+                         int64 ins_ptr,
                          const void* key,
                          int keysize,
                          int64 node_ptr,
+                         int64 count,
                          int64* promo_child_ptr,
+                         int64* promo_count,
                          void* promo_key,
                          int* promo_keysize)
 {
@@ -1365,6 +2805,7 @@ static int bt_insert_key(struct bdb_t* bdb,
     int promoted;
     int64 child_ptr;
     int64 p_b_ptr;
+    int64 p_b_count;
     void* p_b_key;
     int p_b_keysize;
     int rsize;
@@ -1373,6 +2814,7 @@ static int bt_insert_key(struct bdb_t* bdb,
         memcpy(promo_key, key, keysize);
         *promo_keysize = keysize;
         *promo_child_ptr = node_ptr;
+        *promo_count = count;
         return 1;
     }
     /* ノードページを確保します。*/
@@ -1387,22 +2829,39 @@ static int bt_insert_key(struct bdb_t* bdb,
         return -1;
     }
     p_b_key = alloca(NIO_MAX_KEYSIZE);  /* 2011/12/12 keysize -> NIO_MAX_KEYSIZE */
-    promoted = bt_insert_key(bdb,
-                             child_ptr,
-                             key,
-                             keysize,
-                             node_ptr,
-                             &p_b_ptr,
-                             p_b_key,
-                             &p_b_keysize);
-    // add error check 2013/11/12
-    if (promoted < 0)
-        return -1;
+    if (search_ptr == ins_ptr) {
+        /* 子孫へは進まずにこのノードに挿入します。*/
+        memcpy(p_b_key, key, keysize);
+        p_b_keysize = keysize;
+        p_b_ptr = node_ptr;
+        p_b_count = count;
+        promoted = 1;
+    } else {
+        promoted = bt_insert_key(bdb,
+                                 child_ptr,
+                                 ins_ptr,
+                                 key,
+                                 keysize,
+                                 node_ptr,
+                                 count,
+                                 &p_b_ptr,
+                                 &p_b_count,
+                                 p_b_key,
+                                 &p_b_keysize);
+        // add error check 2013/11/12
+        if (promoted < 0)
+            return -1;
+    }
 
     if (! promoted)
         return 0;
 
-    rsize = sizeof(ushort) + keysize + sizeof(int64);
+    /* 分割された子孫から新しい子孫へキー数を移します。*/
+    bt_add_child_count(bdb, buf, child_ptr, -p_b_count);
+
+    /* 挿入するのは子孫から昇進したキーです。*/
+    rsize = sizeof(ushort) + p_b_keysize + bdb->node_ptrsize;
+    rsize += node_slots_size(bdb, get_node_keynum(buf) + 1);
     // 2013/11/14 削除時にキーの入れ替えが行われるので余裕を取っておく。
     if (get_node_size(buf) + rsize > (bdb->node_pgsize - 64)) {
         char* nbuf;
@@ -1413,11 +2872,13 @@ static int bt_insert_key(struct bdb_t* bdb,
                       p_b_key,
                       p_b_keysize,
                       p_b_ptr,
+                      p_b_count,
                       buf,
                       promo_key,
                       promo_keysize,
                       promo_child_ptr,
                       nbuf);
+        *promo_count = bt_node_count(bdb, nbuf);
         if (write_node(bdb, search_ptr, buf) < 0)
             return -1;
         if (write_node(bdb, *promo_child_ptr, nbuf) < 0)
@@ -1425,18 +2886,24 @@ static int bt_insert_key(struct bdb_t* bdb,
         return 1;   /* 昇進 */
     }
     /* ノード内に挿入 */
-    bt_ins_node(bdb, buf, p_b_key, p_b_keysize, p_b_ptr);
+    bt_ins_node(bdb, buf, p_b_key, p_b_keysize, p_b_ptr, p_b_count);
     if (write_node(bdb, search_ptr, buf) < 0)
         return -1;
     return 0;
 }
 
+/* キーと子孫のポインタ node_ptr を B木に挿入します。
+   ins_ptr がゼロの場合は最下位のノードに、ゼロ以外の場合は
+   ins_ptr のノードに挿入します。*/
 static int bt_insert(struct bdb_t* bdb,
+                     int64 ins_ptr,
                      const void* key,
                      int keysize,
-                     int64 node_ptr)
+                     int64 node_ptr,
+                     int64 count)
 {
     int64 promo_child_ptr;
+    int64 promo_count;
     void* promo_key;
     int promo_keysize;
     int promoted;
@@ -1444,10 +2911,13 @@ static int bt_insert(struct bdb_t* bdb,
     promo_key = alloca(NIO_MAX_KEYSIZE);
     promoted = bt_insert_key(bdb,
                              bdb->root_ptr,
+                             ins_ptr,
                              key,
                              keysize,
                              node_ptr,
+                             count,
                              &promo_child_ptr,
+                             &promo_count,
                              promo_key,
                              &promo_keysize);
 
@@ -1515,12 +2985,12 @@ static void bt_delete_in_node(struct bdb_t* bdb,
     kbuf = buf + BDB_NODE_SIZE;
     p = kbuf + keyoff;
     memcpy(&left_ptr, p, sizeof(int64));
-    p += sizeof(int64);
+    p += bdb->node_ptrsize;
     memcpy(&ksize, p, sizeof(ushort));
     p += sizeof(ushort) + ksize;
     memcpy(&child_ptr, p, sizeof(int64));
 
-    dksize = sizeof(int64) + sizeof(ushort) + ksize;
+    dksize = bdb->node_ptrsize + sizeof(ushort) + ksize;
     shift_s = nsize - BDB_NODE_SIZE - keyoff - dksize;
     if (shift_s > 0) {
         char* src;
@@ -1529,8 +2999,8 @@ static void bt_delete_in_node(struct bdb_t* bdb,
         /* shift */
         dst = kbuf + keyoff;
         if (! lptr_del_flag) {
-            dst += sizeof(int64);
-            shift_s -= sizeof(int64);
+            dst += bdb->node_ptrsize;
+            shift_s -= bdb->node_ptrsize;
         }
         if (shift_s > 0) {
             src = dst + dksize;
@@ -1554,7 +3024,7 @@ static char* bt_first_key(struct bdb_t* bdb,
 
     p = buf + BDB_NODE_SIZE;
     memcpy(lptr, p, sizeof(int64));
-    p += sizeof(int64);
+    p += bdb->node_ptrsize;
     memcpy(ksize, p, sizeof(ushort));
     p += sizeof(ushort);
     keyp = p;
@@ -1563,9 +3033,51 @@ static char* bt_first_key(struct bdb_t* bdb,
     return keyp;
 }
 
-/* 兄弟のポインタを返します。
-   見つからない場合は -1 を返します。*/
-static int64 bt_search_child(const char* node_buf,
+/* キーのないノードの親を探すために左端の子孫から先頭のキーを取得します。
+   キーは keybuf に複写され、キーサイズを返します。
+   エラーの場合は -1 を返します。*/
+static int bt_subtree_key(struct bdb_t* bdb, const char* buf, char* keybuf)
+{
+    char* nbuf;
+    int64 ptr;
+    ushort ksize;
+
+    nbuf = (char*)alloca(bdb->node_pgsize);
+    memcpy(&ptr, buf + BDB_NODE_SIZE, sizeof(int64));
+    while (ptr > 0) {
+        if (is_leaf(bdb, ptr)) {
+            struct bdb_leaf_t leaf;
+            int64 kptr;
+
+            /* リーフの先頭のキーは圧縮されていません。*/
+            if (get_leaf(bdb, ptr, &leaf) < 0 || leaf.keynum < 1)
+                return -1;
+            kptr = ptr + BDB_LEAF_KEY_OFFSET;
+            if (mmap_pread(bdb->nio->mmap, &ksize, sizeof(ushort), kptr) != sizeof(ushort))
+                return -1;
+            kptr += sizeof(ushort);
+            if (leaf.flag & PREFIX_COMPRESS_NODE)
+                kptr += sizeof(uchar);
+            if (mmap_pread(bdb->nio->mmap, keybuf, ksize, kptr) != ksize)
+                return -1;
+            return ksize;
+        }
+        if (read_node(bdb, ptr, nbuf) < 0)
+            return -1;
+        if (get_node_keynum(nbuf) > 0) {
+            memcpy(&ksize, nbuf + BDB_NODE_SIZE + bdb->node_ptrsize, sizeof(ushort));
+            memcpy(keybuf, nbuf + BDB_NODE_SIZE + bdb->node_ptrsize + sizeof(ushort), ksize);
+            return ksize;
+        }
+        memcpy(&ptr, nbuf + BDB_NODE_SIZE, sizeof(int64));
+    }
+    return -1;
+}
+
+/* 兄弟のポインタを返します。
+   見つからない場合は -1 を返します。*/
+static int64 bt_search_child(struct bdb_t* bdb,
+                             const char* node_buf,
                              int64 target_ptr,
                              int* keyoff,
                              int* right_node_flag)
@@ -1589,7 +3101,7 @@ static int64 bt_search_child(const char* node_buf,
 
         *keyoff = (int)(p - node_buf - BDB_NODE_SIZE);
         memcpy(&ptr, p, sizeof(int64));     /* left_ptr */
-        p += sizeof(int64);
+        p += bdb->node_ptrsize;
         memcpy(&ksize, p, sizeof(ushort));
         p += sizeof(ushort) + ksize;
         if (ptr == target_ptr) {
@@ -1608,6 +3120,38 @@ static int64 bt_search_child(const char* node_buf,
     return -1;
 }
 
+/* 子孫ポインタを置き換えます。*/
+static void bt_replace_child(struct bdb_t* bdb,
+                             char* node_buf,
+                             int64 old_ptr,
+                             int64 new_ptr)
+{
+    int keynum;
+    char* p;
+    int i;
+    int64 ptr;
+
+    keynum = get_node_keynum(node_buf);
+    p = node_buf + BDB_NODE_SIZE;
+    for (i = 0; i < keynum; i++) {
+        ushort ksize;
+
+        memcpy(&ptr, p, sizeof(int64));     /* left_ptr */
+        if (ptr == old_ptr) {
+            memcpy(p, &new_ptr, sizeof(int64));
+            return;
+        }
+        p += bdb->node_ptrsize;
+        memcpy(&ksize, p, sizeof(ushort));
+        p += sizeof(ushort) + ksize;
+    }
+
+    /* 右端 */
+    memcpy(&ptr, p, sizeof(int64));
+    if (ptr == old_ptr)
+        memcpy(p, &new_ptr, sizeof(int64));
+}
+
 /* 親ノードのポインタを返します。*/
 static int64 bt_search_parent_node(struct bdb_t* bdb,
                                    const void* key,
@@ -1634,7 +3178,7 @@ static int64 bt_search_parent_node(struct bdb_t* bdb,
         p_ptr = ptr;
 
         /* 子孫ポインタと一致するか？ */
-        *s_ptr = bt_search_child(buf, target_ptr, p_keyoff, right_node_flag);
+        *s_ptr = bt_search_child(bdb, buf, target_ptr, p_keyoff, right_node_flag);
         if (*s_ptr > 0) {
             /* 親が見つかった。*/
             break;
@@ -1691,25 +3235,21 @@ static void bt_cat_node(struct bdb_t* bdb,
                         int p_keyoff,
                         const char* s_buf)
 {
-    int keynum, p_keynum, s_keynum;
-    int nsize, s_nsize, p_nsize;
+    int keynum, s_keynum;
+    int nsize, s_nsize;
     char* p;
     char* pp;
     char* sp;
     ushort p_ksize;
-    char* p_key;
 
     keynum = get_node_keynum(node_buf);
-    p_keynum = get_node_keynum(p_buf);
     s_keynum = get_node_keynum(s_buf);
 
     nsize = get_node_size(node_buf);
-    p_nsize = get_node_size(p_buf);
     s_nsize = get_node_size(s_buf);
 
-    pp = p_buf + BDB_NODE_SIZE + p_keyoff + sizeof(int64);
+    pp = p_buf + BDB_NODE_SIZE + p_keyoff + bdb->node_ptrsize;
     memcpy(&p_ksize, pp, sizeof(ushort));
-    p_key = pp + sizeof(ushort);
 
     /* 親のキーを node_buf の最後に追加します。
        子孫ポインタはコピーしません。*/
@@ -1755,7 +3295,7 @@ static int bt_expand_keybuf(struct bdb_t* bdb,
         return -1;
     }
 */
-    m = BDB_NODE_SIZE + keyoff + sizeof(int64) + sizeof(ushort) + keysize;
+    m = BDB_NODE_SIZE + keyoff + bdb->node_ptrsize + sizeof(ushort) + keysize;
     src = buf + m;
     dst = src + extsize;
     shift_n = nsize - m;
@@ -1764,7 +3304,8 @@ static int bt_expand_keybuf(struct bdb_t* bdb,
     return 0;
 }
 
-static char* bt_center_key(const char* buf,
+static char* bt_center_key(struct bdb_t* bdb,
+                           const char* buf,
                            int bufsize,
                            int* lnum,
                            int* rnum)
@@ -1782,19 +3323,19 @@ static char* bt_center_key(const char* buf,
     p = (char*)buf + BDB_NODE_SIZE;
     midp = p;
     while (p < mp) {
-        p += sizeof(int64);
+        p += bdb->node_ptrsize;
         memcpy(&ksize, p, sizeof(ushort));
         p += sizeof(ushort) + ksize;
         (*lnum)++;
         midp = p;
     }
 
-    midp += sizeof(int64);
+    midp += bdb->node_ptrsize;
     memcpy(&ksize, midp, sizeof(ushort));
-    endp = (char*)buf + bufsize - sizeof(int64);
+    endp = (char*)buf + bufsize - bdb->node_ptrsize;
     p = midp + sizeof(ushort) + ksize;
     while (p < endp) {
-        p += sizeof(int64);
+        p += bdb->node_ptrsize;
         memcpy(&ksize, p, sizeof(ushort));
         p += sizeof(ushort) + ksize;
         (*rnum)++;
@@ -1802,7 +3343,57 @@ static char* bt_center_key(const char* buf,
     return midp;
 }
 
+/* 再配分で親へ移す中心のキーを選びます。
+   左右のノードと親がすべてページに収まるキーのうち
+   左右のサイズの差が最も小さいものを返します。
+   収まるキーがない場合は NULL を返します。*/
+static char* bt_redist_center_key(struct bdb_t* bdb,
+                                  const char* buf,
+                                  int bufsize,
+                                  int keynum,
+                                  int p_nsize,
+                                  int p_keynum,
+                                  int p_ksize,
+                                  int* lnum,
+                                  int* rnum)
+{
+    char* p;
+    char* endp;
+    char* midp;
+    int i;
+    int lsize;
+    int rsize;
+    int diff;
+    int min_diff;
+    ushort ksize;
+
+    midp = NULL;
+    min_diff = -1;
+    p = (char*)buf + BDB_NODE_SIZE;
+    endp = (char*)buf + bufsize;
+    for (i = 0; i < keynum; i++) {
+        p += bdb->node_ptrsize;
+        memcpy(&ksize, p, sizeof(ushort));
+        lsize = (int)(p - buf);
+        rsize = BDB_NODE_SIZE + (int)(endp - (p + sizeof(ushort) + ksize));
+        if (lsize + node_slots_size(bdb, i) <= bdb->node_pgsize &&
+            rsize + node_slots_size(bdb, keynum - i - 1) <= bdb->node_pgsize &&
+            p_nsize - p_ksize + ksize + node_slots_size(bdb, p_keynum) <= bdb->node_pgsize) {
+            diff = (lsize > rsize)? lsize - rsize : rsize - lsize;
+            if (min_diff < 0 || diff < min_diff) {
+                midp = p;
+                min_diff = diff;
+                *lnum = i;
+                *rnum = keynum - i - 1;
+            }
+        }
+        p += sizeof(ushort) + ksize;
+    }
+    return midp;
+}
+
 /* 過疎状態になっているページを再配分します。
+ * 長いキーで再配分するとページに収まらない場合は何もせずに 1 を返します。
  *
  *   w_buf                   midp                                  endp
  *   +----+-------+-----+----+-------+-----+----+-------+-----+----+
@@ -1810,11 +3401,11 @@ static char* bt_center_key(const char* buf,
  *   +----+-------+-----+----+-------+-----+----+-------+-----+----+
  *   |<----- left node ----->|<- parent -->|<------ right node --->|
  */
-static void bt_redist_node(struct bdb_t* bdb,
-                           char* node_buf,
-                           char* p_buf,
-                           int p_keyoff,
-                           char* s_buf)
+static int bt_redist_node(struct bdb_t* bdb,
+                          char* node_buf,
+                          char* p_buf,
+                          int p_keyoff,
+                          char* s_buf)
 {
     char* w_buf;
     int w_keynum;
@@ -1845,7 +3436,7 @@ static void bt_redist_node(struct bdb_t* bdb,
 
     /* 親のキーをワーク領域にコピーします。*/
     pp = p_buf + BDB_NODE_SIZE + p_keyoff;
-    pp += sizeof(int64);    /* left ptr */
+    pp += bdb->node_ptrsize;    /* left ptr */
     memcpy(&p_ksize, pp, sizeof(ushort));
     memcpy(wp, pp, sizeof(ushort) + p_ksize);
     wp += sizeof(ushort) + p_ksize;
@@ -1862,7 +3453,11 @@ static void bt_redist_node(struct bdb_t* bdb,
     endp = wp;
 
     /* 中心のキーを親へ移します。*/
-    midp = bt_center_key(w_buf, w_nsize, &lnum, &rnum);
+    midp = bt_redist_center_key(bdb, w_buf, w_nsize, w_keynum,
+                                get_node_size(p_buf), get_node_keynum(p_buf),
+                                p_ksize, &lnum, &rnum);
+    if (midp == NULL)
+        return 1;
     memcpy(&p_ksize2, midp, sizeof(ushort));
     /* 2011/12/01 キーサイズが変わったときの対処 */
     if (p_ksize2 != p_ksize) {
@@ -1870,7 +3465,7 @@ static void bt_redist_node(struct bdb_t* bdb,
 
         n = p_ksize2 - p_ksize;
         if (bt_expand_keybuf(bdb, p_buf, p_keyoff, p_ksize, n) < 0)
-            return;
+            return -1;
     }
     memcpy(pp, midp, sizeof(ushort) + p_ksize2);
 
@@ -1889,6 +3484,7 @@ static void bt_redist_node(struct bdb_t* bdb,
     memcpy(s_buf+BDB_NODE_SIZE, midp, s_nsize);
     set_node_size(s_buf, s_nsize+BDB_NODE_SIZE);
     set_node_keynum(s_buf, rnum);
+    return 0;
 }
 
 static int bt_adjust_node(struct bdb_t* bdb, int64 node_ptr, char* buf)
@@ -1921,7 +3517,7 @@ static int bt_adjust_node(struct bdb_t* bdb, int64 node_ptr, char* buf)
         keynum = get_node_keynum(buf);
         if (keynum < 1) {
             /* キーが存在しなくなった。*/
-            if (nio_add_free_list(bdb->nio, node_ptr, bdb->node_pgsize) < 0)
+            if (free_space(bdb, node_ptr, bdb->node_pgsize) < 0)
                 return -1;
             return put_root(bdb, 0);
         }
@@ -1929,7 +3525,18 @@ static int bt_adjust_node(struct bdb_t* bdb, int64 node_ptr, char* buf)
     }
 
     /* 親を取得します。*/
-    keyp = bt_first_key(bdb, buf, &ksize, &lptr, &rptr);
+    if (get_node_keynum(buf) > 0) {
+        keyp = bt_first_key(bdb, buf, &ksize, &lptr, &rptr);
+    } else {
+        int n;
+
+        /* 連結でキーがなくなったノードは子孫のキーで親を探します。*/
+        keyp = (char*)alloca(NIO_MAX_KEYSIZE);
+        n = bt_subtree_key(bdb, buf, keyp);
+        if (n < 0)
+            return -1;
+        ksize = (ushort)n;
+    }
     p_ptr = bt_search_parent_node(bdb,
                                   keyp,
                                   ksize,
@@ -1957,32 +3564,33 @@ static int bt_adjust_node(struct bdb_t* bdb, int64 node_ptr, char* buf)
     }
 
     /* 親のキーサイズを取得します。*/
-    pp = p_buf + BDB_NODE_SIZE + p_keyoff + sizeof(int64);
+    pp = p_buf + BDB_NODE_SIZE + p_keyoff + bdb->node_ptrsize;
     memcpy(&p_keysize, pp, sizeof(ushort));
 
     nsize = (get_node_size(buf) - BDB_NODE_SIZE) +
             (sizeof(ushort) + p_keysize) +
             (get_node_size(s_buf) - BDB_NODE_SIZE);
+    nsize += node_slots_size(bdb, get_node_keynum(buf) + 1 + get_node_keynum(s_buf));
     if (nsize <= (bdb->node_pgsize - BDB_NODE_SIZE)) {
         /* 親のキーもノードに追加されるため
            ノードサイズが pgsize以下の場合にノードを連結します。*/
         bt_cat_node(bdb, buf, p_buf, p_keyoff, s_buf);
+        bt_set_child_count(bdb, p_buf, node_ptr, bt_node_count(bdb, buf));
         if (write_node(bdb, node_ptr, buf) < 0)
             return -1;
         /* 兄弟(s_page)を削除します。*/
-        if (nio_add_free_list(bdb->nio, s_ptr, bdb->node_pgsize) < 0)
+        if (free_space(bdb, s_ptr, bdb->node_pgsize) < 0)
             return -1;
-        if (get_node_keynum(p_buf) < 1) {
-            /* 親も削除します。*/
-            if (nio_add_free_list(bdb->nio, p_ptr, bdb->node_pgsize) < 0)
+        if (get_node_keynum(p_buf) < 1 && p_ptr == bdb->root_ptr) {
+            /* ルートの親を削除してルートを更新します。*/
+            if (free_space(bdb, p_ptr, bdb->node_pgsize) < 0)
                 return -1;
-            if (p_ptr == bdb->root_ptr) {
-                /* ルートを更新します。*/
-                if (put_root(bdb, node_ptr) < 0)
-                    return -1;
-                p_ptr = 0;
-            }
+            if (put_root(bdb, node_ptr) < 0)
+                return -1;
+            p_ptr = 0;
         } else {
+            /* ルート以外の親はキーがなくなっても残して、
+               再帰で兄弟と連結します。*/
             if (write_node(bdb, p_ptr, p_buf) < 0)
                 return -1;
         }
@@ -1994,8 +3602,10 @@ static int bt_adjust_node(struct bdb_t* bdb, int64 node_ptr, char* buf)
         return 0;
     }
 
-    /* 再配分します。*/
+    /* 再配分します。収まらない場合は過疎状態のまま書き出します。*/
     bt_redist_node(bdb, buf, p_buf, p_keyoff, s_buf);
+    bt_set_child_count(bdb, p_buf, node_ptr, bt_node_count(bdb, buf));
+    bt_set_child_count(bdb, p_buf, s_ptr, bt_node_count(bdb, s_buf));
 
     /* 各ページを書き出します。*/
     if (write_node(bdb, p_ptr, p_buf) < 0)
@@ -2031,21 +3641,21 @@ static int64 bt_get_leaf(struct bdb_t* bdb,
 }
 
 /* ノードバッファから keyoff 位置のキー値とキー長を取得します。*/
-static void bt_get_key(const char* buf, int keyoff, char* key, ushort* ksize)
+static void bt_get_key(struct bdb_t* bdb, const char* buf, int keyoff, char* key, ushort* ksize)
 {
     char* p;
 
-    p = (char*)buf + BDB_NODE_SIZE + keyoff + sizeof(int64);
+    p = (char*)buf + BDB_NODE_SIZE + keyoff + bdb->node_ptrsize;
     memcpy(ksize, p, sizeof(ushort));
     p += sizeof(ushort);
     memcpy(key, p, *ksize);
 }
 
-static void bt_put_key(char* buf, int keyoff, char* key, ushort ksize)
+static void bt_put_key(struct bdb_t* bdb, char* buf, int keyoff, char* key, ushort ksize)
 {
     char* p;
 
-    p = buf + BDB_NODE_SIZE + keyoff + sizeof(int64);
+    p = buf + BDB_NODE_SIZE + keyoff + bdb->node_ptrsize;
     memcpy(p, &ksize, sizeof(ushort));
     p += sizeof(ushort);
     memcpy(p, key, ksize);
@@ -2067,8 +3677,8 @@ static int bt_swap_key(struct bdb_t* bdb,
     key1 = (char*)alloca(NIO_MAX_KEYSIZE);
     key2 = (char*)alloca(NIO_MAX_KEYSIZE);
 
-    bt_get_key(nbuf1, keyoff1, key1, &ksize1);
-    bt_get_key(nbuf2, keyoff2, key2, &ksize2);
+    bt_get_key(bdb, nbuf1, keyoff1, key1, &ksize1);
+    bt_get_key(bdb, nbuf2, keyoff2, key2, &ksize2);
 
     if (ksize1 != ksize2) {
         int n;
@@ -2088,8 +3698,8 @@ static int bt_swap_key(struct bdb_t* bdb,
                 return -1;
         }
     }
-    bt_put_key(nbuf1, keyoff1, key2, ksize2);
-    bt_put_key(nbuf2, keyoff2, key1, ksize1);
+    bt_put_key(bdb, nbuf1, keyoff1, key2, ksize2);
+    bt_put_key(bdb, nbuf2, keyoff2, key1, ksize1);
     return 0;
 }
 
@@ -2145,13 +3755,29 @@ static int bt_delete_key(struct bdb_t* bdb,
         if (bt_swap_key(bdb, work_buf, keyoff, bt_leaf_buf, 0) < 0)
             return -1;
         wnsize = get_node_size(work_buf);
+        wnsize += node_slots_size(bdb, get_node_keynum(work_buf));
         if (wnsize > bdb->node_pgsize) {
-            err_write("bt_delete_key: node buffer size over! %d bytes.", wnsize);
-            return -1;
+            char* key2;
+            ushort ksize2;
+            int64 count;
+
+            /* 長いキーと入れ替えるとノードがオーバーするため
+               キーを削除してから bt_insert() で挿入します。*/
+            key2 = (char*)alloca(NIO_MAX_KEYSIZE);
+            bt_get_key(bdb, work_buf, keyoff, key2, &ksize2);
+            count = bt_get_count(bdb, bt_child_pos(bdb, bdb->node_buf, child_ptr));
+            bt_delete_in_node(bdb, bdb->node_buf, keyoff, 0);
+            bt_put_count(bdb, bdb->node_buf + BDB_NODE_SIZE + keyoff,
+                         bt_get_count(bdb, bdb->node_buf + BDB_NODE_SIZE + keyoff) + count);
+            if (write_node(bdb, node_ptr, bdb->node_buf) < 0)
+                return -1;
+            if (bt_insert(bdb, node_ptr, key2, ksize2, child_ptr, count) < 0)
+                return -1;
+        } else {
+            memcpy(bdb->node_buf, work_buf, bdb->node_pgsize);
+            if (write_node(bdb, node_ptr, bdb->node_buf) < 0)
+                return -1;
         }
-        memcpy(bdb->node_buf, work_buf, bdb->node_pgsize);
-        if (write_node(bdb, node_ptr, bdb->node_buf) < 0)
-            return -1;
         // 入れ替えたB木リーフのキーを削除します。
         lptr_del_flag = 1;  // 2011/12/12
         bt_delete_in_node(bdb, bt_leaf_buf, 0, lptr_del_flag);
@@ -2170,6 +3796,7 @@ static int bt_update_key(struct bdb_t* bdb,
     int64 node_ptr;
     int keyoff;
     int64 child_ptr;
+    int64 count;
 
     node_ptr = bt_search_key(bdb,
                              key,
@@ -2181,19 +3808,24 @@ static int bt_update_key(struct bdb_t* bdb,
         return -1; /* not found */
 
     /* ノードからキーを削除 */
+    count = bt_get_count(bdb, bt_child_pos(bdb, bdb->node_buf, child_ptr));
     bt_delete_in_node(bdb, bdb->node_buf, keyoff, 0);
 
     /* キーを挿入 */
-    int inssize = sizeof(ushort) + new_keysize + sizeof(int64);
+    int inssize = sizeof(ushort) + new_keysize + bdb->node_ptrsize;
+    inssize += node_slots_size(bdb, get_node_keynum(bdb->node_buf) + 1);
     if (get_node_size(bdb->node_buf) + inssize > bdb->node_pgsize) {
         // 2013/11/14 ノードがオーバーするため bt_insert() で挿入する。
+        /* キー数は左隣の子孫に戻してから bt_insert() で移します。*/
+        bt_put_count(bdb, bdb->node_buf + BDB_NODE_SIZE + keyoff,
+                     bt_get_count(bdb, bdb->node_buf + BDB_NODE_SIZE + keyoff) + count);
         if (write_node(bdb, node_ptr, bdb->node_buf) < 0)
             return -1;
-        if (bt_insert(bdb, new_key, new_keysize, child_ptr) < 0)
+        if (bt_insert(bdb, node_ptr, new_key, new_keysize, child_ptr, count) < 0)
             return -1;
     } else {
         /* ノードに挿入 */
-        bt_ins_node(bdb, bdb->node_buf, new_key, new_keysize, child_ptr);
+        bt_ins_node(bdb, bdb->node_buf, new_key, new_keysize, child_ptr, count);
         if (write_node(bdb, node_ptr, bdb->node_buf) < 0)
             return -1;
     }
@@ -2211,7 +3843,7 @@ static int bt_add_leaf_key(struct bdb_t* bdb,
     }
 
     /* B木にキーを追加します。*/
-    return bt_insert(bdb, key, keysize, leaf->node_ptr);
+    return bt_insert(bdb, 0, key, keysize, leaf->node_ptr, leaf->keynum);
 }
 
 /*****************
@@ -2251,7 +3883,7 @@ static int leaf_compress_size(struct bdb_t* bdb,
 
     for (i = start; i < keynum; i++) {
         // キー長
-        size += kp->keysize;
+        size += sizeof(ushort);
         if (kprev == NULL) {
             // 圧縮なし
             size += sizeof(uchar);  // prefix size
@@ -2423,18 +4055,22 @@ static int leaf_serialize_keydata(struct bdb_t* bdb,
 }
 
 // 2013/09
-/* キー圧縮されたシリアライズデータからkeydata(キーの配列)を作成します。*/
-static void leaf_decompress_keybuf(struct bdb_t* bdb,
-                                   int keynum,
-                                   struct bdb_leaf_key_t* keydata,
-                                   const char* keybuf)
+/* キー圧縮されたシリアライズデータからkeydata(キーの配列)を作成します。
+   キーと値は arena に復元されます。arena の使用サイズを返します。*/
+static int leaf_decompress_keybuf(struct bdb_t* bdb,
+                                  int keynum,
+                                  struct bdb_leaf_key_t* keydata,
+                                  const char* keybuf,
+                                  uchar* arena)
 {
     struct bdb_leaf_key_t* kp;
     struct bdb_leaf_key_t* kprev;
     char* p;
+    uchar* ap;
     int i;
 
     kp = keydata;
+    ap = arena;
     p = (char*)keybuf;
     kprev = NULL;
 
@@ -2450,6 +4086,8 @@ static void leaf_decompress_keybuf(struct bdb_t* bdb,
         p += sizeof(uchar);
 
         cksize = ksize - pfksize;
+        kp->key = ap;
+        ap += ksize;
         if (pfksize == 0) {
             // prefix圧縮なし
             memcpy(kp->key, p, ksize);
@@ -2467,7 +4105,9 @@ static void leaf_decompress_keybuf(struct bdb_t* bdb,
             memcpy(&dsize, p, sizeof(uchar));
             kp->value.u.pp.valsize = dsize;
             p += sizeof(uchar);
-            memcpy(kp->value.u.pp.val, p, dsize);
+            kp->value.u.pp.val = ap;
+            memcpy(ap, p, dsize);
+            ap += dsize;
             p += dsize;
         } else {
             // data ptr
@@ -2477,20 +4117,25 @@ static void leaf_decompress_keybuf(struct bdb_t* bdb,
         kprev = kp;
         kp++;
     }
+    return (int)(ap - arena);
 }
 
 // 2013/09
-/* キー圧縮なしのシリアライズデータからkeydata(キーの配列)を作成します。*/
-static void leaf_restore_keybuf(struct bdb_t* bdb,
-                                int keynum,
-                                struct bdb_leaf_key_t* keydata,
-                                const char* keybuf)
+/* キー圧縮なしのシリアライズデータからkeydata(キーの配列)を作成します。
+   キーと値は arena に復元されます。arena の使用サイズを返します。*/
+static int leaf_restore_keybuf(struct bdb_t* bdb,
+                               int keynum,
+                               struct bdb_leaf_key_t* keydata,
+                               const char* keybuf,
+                               uchar* arena)
 {
     struct bdb_leaf_key_t* kp;
     char* p;
+    uchar* ap;
     int i;
 
     kp = keydata;
+    ap = arena;
     p = (char*)keybuf;
     for (i = 0; i < keynum; i++) {
         ushort ksize;
@@ -2498,7 +4143,9 @@ static void leaf_restore_keybuf(struct bdb_t* bdb,
         memcpy(&ksize, p, sizeof(ushort));
         kp->keysize = ksize;
         p += sizeof(ushort);
-        memcpy(kp->key, p, kp->keysize);
+        kp->key = ap;
+        memcpy(ap, p, kp->keysize);
+        ap += kp->keysize;
         p += kp->keysize;
         if (bdb->datapack_flag) {
             // packed data value
@@ -2507,7 +4154,9 @@ static void leaf_restore_keybuf(struct bdb_t* bdb,
             memcpy(&dsize, p, sizeof(uchar));
             kp->value.u.pp.valsize = dsize;
             p += sizeof(uchar);
-            memcpy(kp->value.u.pp.val, p, dsize);
+            kp->value.u.pp.val = ap;
+            memcpy(ap, p, dsize);
+            ap += dsize;
             p += dsize;
         } else {
             // data ptr
@@ -2516,11 +4165,66 @@ static void leaf_restore_keybuf(struct bdb_t* bdb,
         }
         kp++;
     }
+    return (int)(ap - arena);
+}
+
+/* シリアライズデータ(keybuf)から復元するキーと値のサイズを返します。*/
+static int leaf_keybuf_datasize(struct bdb_t* bdb,
+                                struct bdb_leaf_t* leaf,
+                                const char* keybuf)
+{
+    const char* p;
+    int size;
+    int i;
+
+    if (! (leaf->flag & PREFIX_COMPRESS_NODE)) {
+        /* 圧縮なしの場合はキーと値のサイズはシリアライズデータを超えません。*/
+        return leaf->nodesize - BDB_LEAF_SIZE;
+    }
+
+    size = 0;
+    p = keybuf;
+    for (i = 0; i < leaf->keynum; i++) {
+        ushort ksize;
+        uchar pfksize;
+
+        memcpy(&ksize, p, sizeof(ushort));
+        p += sizeof(ushort);
+        memcpy(&pfksize, p, sizeof(uchar));
+        p += sizeof(uchar);
+        p += ksize - pfksize;
+        size += ksize;
+
+        if (bdb->datapack_flag) {
+            uchar dsize;
+
+            memcpy(&dsize, p, sizeof(uchar));
+            p += sizeof(uchar) + dsize;
+            size += dsize;
+        } else {
+            p += sizeof(int64);
+        }
+    }
+    return size;
+}
+
+/* シリアライズデータ(keybuf)を keydata と arena に復元します。
+   arena の使用サイズを返します。*/
+static int leaf_decode_keybuf(struct bdb_t* bdb,
+                              struct bdb_leaf_t* leaf,
+                              struct bdb_leaf_key_t* keydata,
+                              const char* keybuf,
+                              uchar* arena)
+{
+    if (leaf->flag & PREFIX_COMPRESS_NODE)
+        return leaf_decompress_keybuf(bdb, leaf->keynum, keydata, keybuf, arena);
+    return leaf_restore_keybuf(bdb, leaf->keynum, keydata, keybuf, arena);
 }
 
 // 2013/09
 /* シリアライズデータ(keybuf)からkeydata(キー配列)を作成します。
    挿入用に leaf->keynum より大きいキー数を指定できるようにしてあります。
+   キーと値はキー配列の後ろに続くアリーナに格納されます。
    keydataは動的にメモリ確保されるので使用後に解放する必要があります。
 */
 static struct bdb_leaf_key_t* leaf_get_keydata(struct bdb_t* bdb,
@@ -2529,17 +4233,16 @@ static struct bdb_leaf_key_t* leaf_get_keydata(struct bdb_t* bdb,
                                                int keynum)
 {
     struct bdb_leaf_key_t* keydata;
+    int datasize;
 
     if (keynum < leaf->keynum)
         return NULL;
-    keydata = (struct bdb_leaf_key_t*)malloc(sizeof(struct bdb_leaf_key_t) * keynum);
+    datasize = leaf_keybuf_datasize(bdb, leaf, keybuf);
+    keydata = (struct bdb_leaf_key_t*)malloc(sizeof(struct bdb_leaf_key_t) * keynum + datasize);
     if (! keydata)
         return NULL;
 
-    if (leaf->flag & PREFIX_COMPRESS_NODE)
-        leaf_decompress_keybuf(bdb, leaf->keynum, keydata, keybuf);
-    else
-        leaf_restore_keybuf(bdb, leaf->keynum, keydata, keybuf);
+    leaf_decode_keybuf(bdb, leaf, keydata, keybuf, (uchar*)(keydata + keynum));
     return keydata;
 }
 
@@ -2589,7 +4292,7 @@ static int64 create_leaf(struct bdb_t* bdb,
     int size;
 
     /* リーフノードを書き出す領域を取得します。*/
-    ptr = nio_avail_space(bdb->nio, bdb->node_pgsize, NULL, bdb->filling_rate);
+    ptr = avail_space(bdb, bdb->node_pgsize, NULL);
     if (ptr < 0)
         return -1;
 
@@ -2639,10 +4342,10 @@ static int new_leaf(struct bdb_t* bdb,
 
     /* キーを編集します。*/
     leafkey.keysize = keysize;
-    memcpy(leafkey.key, key, keysize);
+    leafkey.key = (uchar*)key;
     if (bdb->datapack_flag) {
         leafkey.value.u.pp.valsize = valsize;
-        memcpy(leafkey.value.u.pp.val, val, valsize);
+        leafkey.value.u.pp.val = (uchar*)val;
     } else {
         leafkey.value.u.dp.v_ptr = vptr;
     }
@@ -2659,16 +4362,67 @@ static int new_leaf(struct bdb_t* bdb,
     return 0;
 }
 
-static int get_leaf(struct bdb_t* bdb,
-                    int64 ptr,
-                    struct bdb_leaf_t* leaf)
+static struct leaf_cache_t* leaf_frame_find(struct bdb_t* bdb, int64 ptr)
+{
+    int i;
+
+    if (ptr <= 0)
+        return NULL;
+    for (i = bdb->leaf_hash[LEAF_HASH(bdb, ptr)]; i >= 0; i = bdb->leaf_pool[i].hnext) {
+        if (bdb->leaf_pool[i].leaf.node_ptr == ptr)
+            return &bdb->leaf_pool[i];
+    }
+    return NULL;
+}
+
+static void leaf_frame_link(struct bdb_t* bdb, struct leaf_cache_t* lc)
+{
+    int h;
+
+    h = LEAF_HASH(bdb, lc->leaf.node_ptr);
+    lc->hnext = bdb->leaf_hash[h];
+    bdb->leaf_hash[h] = (int)(lc - bdb->leaf_pool);
+}
+
+static void leaf_frame_unlink(struct bdb_t* bdb, struct leaf_cache_t* lc)
+{
+    int* p;
+    int n;
+
+    if (lc->leaf.node_ptr <= 0)
+        return;
+    n = (int)(lc - bdb->leaf_pool);
+    p = &bdb->leaf_hash[LEAF_HASH(bdb, lc->leaf.node_ptr)];
+    while (*p >= 0) {
+        if (*p == n) {
+            *p = lc->hnext;
+            return;
+        }
+        p = &bdb->leaf_pool[*p].hnext;
+    }
+}
+
+/* フレームを無効にします。リーフの内容は残ります。*/
+static void leaf_frame_discard(struct bdb_t* bdb, struct leaf_cache_t* lc)
+{
+    leaf_frame_unlink(bdb, lc);
+    lc->leaf.node_ptr = 0;
+    lc->update = 0;
+    lc->ref = 0;
+}
+
+static int leaf_frame_flush(struct bdb_t* bdb, struct leaf_cache_t* lc);
+
+/* ファイルからリーフのヘッダーを読み込みます。*/
+static int read_leaf(struct bdb_t* bdb,
+                     int64 ptr,
+                     struct bdb_leaf_t* leaf)
 {
     char buf[BDB_LEAF_SIZE];
     ushort knum;
     ushort nsize;
 
-    mmap_seek(bdb->nio->mmap, ptr);
-    if (mmap_read(bdb->nio->mmap, buf, BDB_LEAF_SIZE) != BDB_LEAF_SIZE)
+    if (mmap_pread(bdb->nio->mmap, buf, BDB_LEAF_SIZE, ptr) != BDB_LEAF_SIZE)
         return -1;
 
     leaf->node_ptr = ptr;
@@ -2682,11 +4436,34 @@ static int get_leaf(struct bdb_t* bdb,
     return 0;
 }
 
+static int get_leaf(struct bdb_t* bdb,
+                    int64 ptr,
+                    struct bdb_leaf_t* leaf)
+{
+    struct leaf_cache_t* lc;
+
+    /* キャッシュで更新されているリーフは先に書き出します。*/
+    lc = leaf_frame_find(bdb, ptr);
+    if (lc != NULL && &lc->leaf != leaf) {
+        if (leaf_frame_flush(bdb, lc) < 0)
+            return -1;
+    }
+    return read_leaf(bdb, ptr, leaf);
+}
+
 static int update_leaf(struct bdb_t* bdb,
                        int64 ptr,
                        struct bdb_leaf_t* leaf)
 {
     char buf[BDB_LEAF_SIZE];
+    struct leaf_cache_t* lc;
+
+    /* キャッシュされているリーフのリンクを合わせます。*/
+    lc = leaf_frame_find(bdb, ptr);
+    if (lc != NULL && &lc->leaf != leaf) {
+        lc->leaf.next_ptr = leaf->next_ptr;
+        lc->leaf.prev_ptr = leaf->prev_ptr;
+    }
 
     memset(buf, '\0', BDB_LEAF_SIZE);
 
@@ -2697,6 +4474,8 @@ static int update_leaf(struct bdb_t* bdb,
     set_leaf_prevptr(buf, leaf->prev_ptr);
     set_leaf_flag(buf, leaf->flag);
 
+    if (snap_preserve(bdb, leaf->node_ptr, bdb->node_pgsize) < 0)
+        return -1;
     mmap_seek(bdb->nio->mmap, leaf->node_ptr);
     if (mmap_write(bdb->nio->mmap, buf, BDB_LEAF_SIZE) != BDB_LEAF_SIZE)
         return -1;
@@ -2712,8 +4491,7 @@ static int get_leaf_keybuf(struct bdb_t* bdb,
 
     ptr = leaf->node_ptr + BDB_LEAF_SIZE;
     size = leaf->nodesize - BDB_LEAF_SIZE;
-    mmap_seek(bdb->nio->mmap, ptr);
-    if (mmap_read(bdb->nio->mmap, keybuf, size) != size)
+    if (mmap_pread(bdb->nio->mmap, keybuf, size, ptr) != size)
         return -1;
     return 0;
 }
@@ -2724,7 +4502,15 @@ static int put_leaf_keybuf(struct bdb_t* bdb,
 {
     int64 ptr;
     int size;
+    struct leaf_cache_t* lc;
+
+    /* キャッシュを経由せずに書き換えられるリーフは無効にします。*/
+    lc = leaf_frame_find(bdb, leaf->node_ptr);
+    if (lc != NULL && &lc->leaf != leaf)
+        leaf_frame_discard(bdb, lc);
 
+    if (snap_preserve(bdb, leaf->node_ptr, bdb->node_pgsize) < 0)
+        return -1;
     ptr = leaf->node_ptr + BDB_LEAF_SIZE;
     size = leaf->nodesize - BDB_LEAF_SIZE;
     mmap_seek(bdb->nio->mmap, ptr);
@@ -2740,23 +4526,23 @@ static int leaf_key_cmp(struct bdb_t* bdb,
 {
     int c;
 
-    c = (bdb->cmp_func)(key, keysize, keydata->key, keydata->keysize);
+    c = key_cmp(bdb, key, keysize, keydata->key, keydata->keysize);
     return c;
 }
 
-static int leaf_cache_flush(struct bdb_t* bdb)
+static int leaf_frame_flush(struct bdb_t* bdb, struct leaf_cache_t* lc)
 {
-    struct leaf_cache_t* lc;
+    char* buf;
     int nodesize;
-    
-    lc = bdb->leaf_cache;
+
     if (! lc->update)
         return 0;
 
-    nodesize = leaf_put_keydata(bdb, &lc->leaf, lc->keydata, bdb->leaf_buf);
+    buf = (char*)alloca(bdb->node_pgsize);
+    nodesize = leaf_put_keydata(bdb, &lc->leaf, lc->keydata, buf);
     lc->leaf.nodesize = BDB_LEAF_SIZE + nodesize;
-    
-    if (put_leaf_keybuf(bdb, &lc->leaf, bdb->leaf_buf) < 0)
+
+    if (put_leaf_keybuf(bdb, &lc->leaf, buf) < 0)
         return -1;
     if (update_leaf(bdb, lc->leaf.node_ptr, &lc->leaf) < 0)
         return -1;
@@ -2764,93 +4550,411 @@ static int leaf_cache_flush(struct bdb_t* bdb)
     return 0;
 }
 
-static int leaf_cache_get_by_insert(struct bdb_t* bdb, int64 leaf_ptr)
+static int leaf_frame_cmp(const void* p1, const void* p2)
 {
-    struct leaf_cache_t* lc;
-    
-    lc = bdb->leaf_cache;
-    if (lc->leaf.node_ptr == leaf_ptr) {
-        if (lc->leaf.keynum+1 > lc->alloc_keys) {
-            int keynum = lc->leaf.keynum + 10;
-            lc->keydata = (struct bdb_leaf_key_t*)realloc(lc->keydata, sizeof(struct bdb_leaf_key_t) * keynum);
-            if (! lc->keydata)
-                return -1;
-            lc->alloc_keys = keynum;
-        }
-    } else {
-        if (leaf_cache_flush(bdb) < 0)
-            return -1;
+    int64 ptr1, ptr2;
 
-        if (get_leaf(bdb, leaf_ptr, &lc->leaf) < 0)
-            return -1;
-        if (get_leaf_keybuf(bdb, &lc->leaf, bdb->leaf_buf) < 0)
-            return -1;
-        /* keydata(キー配列)を作成します。*/
-        if (lc->keydata)
-            free(lc->keydata);
-        /* 挿入するため要素数を +1 する。*/
-        lc->keydata = leaf_get_keydata(bdb, &lc->leaf, bdb->leaf_buf, lc->leaf.keynum+1);
-        if (! lc->keydata)
+    ptr1 = (*(struct leaf_cache_t**)p1)->leaf.node_ptr;
+    ptr2 = (*(struct leaf_cache_t**)p2)->leaf.node_ptr;
+    if (ptr1 < ptr2)
+        return -1;
+    return (ptr1 > ptr2)? 1 : 0;
+}
+
+/* 更新されているリーフをポインタ順にすべて書き出します。*/
+static int leaf_cache_flush(struct bdb_t* bdb)
+{
+    struct leaf_cache_t** dirty;
+    int count = 0;
+    int i;
+
+    dirty = (struct leaf_cache_t**)alloca(bdb->leaf_pool_size * sizeof(struct leaf_cache_t*));
+    for (i = 0; i < bdb->leaf_pool_size; i++) {
+        if (bdb->leaf_pool[i].update)
+            dirty[count++] = &bdb->leaf_pool[i];
+    }
+    if (count > 1)
+        qsort(dirty, count, sizeof(struct leaf_cache_t*), leaf_frame_cmp);
+    for (i = 0; i < count; i++) {
+        if (leaf_frame_flush(bdb, dirty[i]) < 0)
             return -1;
-        lc->alloc_keys = lc->leaf.keynum + 1;
     }
     return 0;
 }
 
-static int leaf_cache_get(struct bdb_t* bdb, int64 leaf_ptr)
+/* 置換するフレームを CLOCK 方式で選択します。
+   固定されているフレームと共有ロックの場合は更新されているフレームを除きます。
+   置換できるフレームがない場合は NULL を返します。*/
+static struct leaf_cache_t* leaf_frame_victim(struct bdb_t* bdb, int mode)
 {
     struct leaf_cache_t* lc;
-    
-    lc = bdb->leaf_cache;
-    if (lc->leaf.node_ptr != leaf_ptr) {
+    int n;
+
+    for (n = 0; n <= bdb->leaf_pool_size * 2; n++) {
+        lc = &bdb->leaf_pool[bdb->leaf_clock];
+        bdb->leaf_clock = (bdb->leaf_clock + 1) % bdb->leaf_pool_size;
+        if (lc->pin > 0 || (mode == LOCK_READ && lc->update))
+            continue;
+        if (lc->leaf.node_ptr <= 0)
+            return lc;  /* 空きフレーム */
+        if (! lc->ref)
+            goto found;
+        lc->ref = 0;
+    }
+    return NULL;
+
+found:
+    if (lc->update) {
+        /* 更新されているリーフはまとめて書き出します。*/
         if (leaf_cache_flush(bdb) < 0)
-            return -1;
+            return NULL;
+    }
+    leaf_frame_discard(bdb, lc);
+    return lc;
+}
 
-        if (get_leaf(bdb, leaf_ptr, &lc->leaf) < 0)
-            return -1;
-        if (get_leaf_keybuf(bdb, &lc->leaf, bdb->leaf_buf) < 0)
-            return -1;
-        /* keydata(キー配列)を作成します。*/
+/* フレームのキーと値を格納するアリーナの先頭を返します。
+   アリーナはキー配列(alloc_keys 個)の直後に続きます。*/
+static uchar* leaf_frame_arena(struct leaf_cache_t* lc)
+{
+    return (uchar*)(lc->keydata + lc->alloc_keys);
+}
+
+/* 読み込んだリーフの keybuf からフレームの keydata(キー配列)を作成します。
+   挿入用に extra 個のキーを追加できる領域を確保します。
+   フレームの領域が足りる場合はそのまま再利用します。*/
+static int leaf_frame_decode(struct bdb_t* bdb, struct leaf_cache_t* lc, const char* keybuf, int extra)
+{
+    int keynum;
+    int datasize;
+
+    keynum = lc->leaf.keynum + extra;
+    datasize = leaf_keybuf_datasize(bdb, &lc->leaf, keybuf);
+    if (lc->keydata == NULL || lc->alloc_keys < keynum || lc->arena_size < datasize) {
         if (lc->keydata)
             free(lc->keydata);
-        lc->alloc_keys = lc->leaf.keynum;
-        lc->keydata = leaf_get_keydata(bdb, &lc->leaf, bdb->leaf_buf, lc->leaf.keynum);
-        if (! lc->keydata)
+        lc->keydata = (struct bdb_leaf_key_t*)malloc(sizeof(struct bdb_leaf_key_t) * keynum + datasize);
+        if (! lc->keydata) {
+            err_write("bdb: leaf cache no memory.");
+            lc->alloc_keys = 0;
+            lc->arena_size = 0;
             return -1;
+        }
+        lc->alloc_keys = keynum;
+        lc->arena_size = datasize;
     }
+    lc->arena_used = leaf_decode_keybuf(bdb, &lc->leaf, lc->keydata, keybuf,
+                                        leaf_frame_arena(lc));
     return 0;
 }
 
-static void leaf_cache_clear(struct bdb_t* bdb)
+/* リーフをフレームに読み込みます。*/
+static int leaf_frame_read(struct bdb_t* bdb, struct leaf_cache_t* lc, int64 leaf_ptr, int extra)
 {
-    bdb->leaf_cache->leaf.node_ptr = 0;
-    bdb->leaf_cache->update = 0;
+    if (get_leaf(bdb, leaf_ptr, &lc->leaf) < 0)
+        goto error;
+    if (get_leaf_keybuf(bdb, &lc->leaf, bdb->leaf_buf) < 0)
+        goto error;
+    if (leaf_frame_decode(bdb, lc, bdb->leaf_buf, extra) < 0)
+        goto error;
+    return 0;
+
+error:
+    lc->leaf.node_ptr = 0;
+    return -1;
 }
 
-static void make_slot(struct bdb_t* bdb,
-                      int index,
-                      int valsize,
-                      const void* val,
-                      int64 vptr,
-                      struct bdb_slot_t* slot)
+/* リーフを読み込んでフレームに登録します。*/
+static struct leaf_cache_t* leaf_frame_load(struct bdb_t* bdb, int64 leaf_ptr, int extra, int mode)
 {
-    slot->index = index;
-    if (bdb->datapack_flag) {
-        slot->u.pp.valsize = (uchar)valsize;
-        if (val)
-            memcpy(slot->u.pp.val, val, valsize);
-        else
-            memset(slot->u.pp.val, '\0', BDB_PACK_DATASIZE);
+    struct leaf_cache_t* lc;
+
+    lc = leaf_frame_victim(bdb, mode);
+    if (lc == NULL)
+        return NULL;
+    if (leaf_frame_read(bdb, lc, leaf_ptr, extra) < 0)
+        return NULL;
+    leaf_frame_link(bdb, lc);
+    return lc;
+}
+
+/* 共有ロックで使用するリーフのフレームを固定します。
+   フレームに空きがない場合は temp が指定されていれば一時的なフレームに
+   読み込み、指定されていなければ NULL を返します。
+   フレームの内容はリーフラッチで保護されます。*/
+static struct leaf_cache_t* leaf_frame_fix(struct bdb_t* bdb, int64 leaf_ptr, int temp)
+{
+    struct leaf_cache_t* lc;
+
+    CS_START(&bdb->pool_critical_section);
+    lc = leaf_frame_find(bdb, leaf_ptr);
+    if (lc == NULL)
+        lc = leaf_frame_load(bdb, leaf_ptr, 0, LOCK_READ);
+    if (lc != NULL) {
+        lc->ref = 1;
+        lc->pin++;
+    } else if (temp) {
+        lc = (struct leaf_cache_t*)calloc(1, sizeof(struct leaf_cache_t));
+        if (lc == NULL) {
+            err_write("bdb: leaf cache no memory.");
+        } else if (leaf_frame_read(bdb, lc, leaf_ptr, 0) < 0) {
+            free(lc);
+            lc = NULL;
+        }
+    }
+    CS_END(&bdb->pool_critical_section);
+    return lc;
+}
+
+static int is_pool_frame(struct bdb_t* bdb, struct leaf_cache_t* lc)
+{
+    return (lc >= bdb->leaf_pool && lc < bdb->leaf_pool + bdb->leaf_pool_size);
+}
+
+static void leaf_frame_release(struct bdb_t* bdb, struct leaf_cache_t* lc)
+{
+    if (is_pool_frame(bdb, lc)) {
+        CS_START(&bdb->pool_critical_section);
+        lc->pin--;
+        CS_END(&bdb->pool_critical_section);
     } else {
-        slot->u.dp.v_ptr = vptr;
+        /* 一時的なフレーム */
+        if (lc->keydata)
+            free(lc->keydata);
+        free(lc);
     }
 }
 
-/* リーフノード内からキーを検索します。
- *
- * 見つかった場合はスロットの位置を設定して BDB_KEY_FOUND を返します。
- * 見つからなかった場合は挿入位置のスロットを設定して
- * BDB_KEY_NOTFOUND を返します。
+/* 共有ロックで参照するリーフをラッチしてフレームを固定します。
+   値を読み終わるまで固定しておくことで、同じリーフを更新するスレッドが
+   値の領域を解放しないようにします。*/
+static struct leaf_cache_t* leaf_frame_pin(struct bdb_t* bdb, int64 leaf_ptr)
+{
+    struct leaf_cache_t* lc;
+
+    latch_leaf(bdb, leaf_ptr, LOCK_READ);
+    lc = leaf_frame_fix(bdb, leaf_ptr, 1);
+    if (lc == NULL)
+        unlatch_leaf(bdb, leaf_ptr, LOCK_READ);
+    return lc;
+}
+
+static void leaf_frame_unpin(struct bdb_t* bdb, struct leaf_cache_t* lc)
+{
+    int64 leaf_ptr;
+
+    leaf_ptr = lc->leaf.node_ptr;
+    leaf_frame_release(bdb, lc);
+    unlatch_leaf(bdb, leaf_ptr, LOCK_READ);
+}
+
+static int leaf_cache_get(struct bdb_t* bdb, int64 leaf_ptr)
+{
+    struct leaf_cache_t* lc;
+
+    lc = bdb->leaf_cache;
+    if (lc->leaf.node_ptr != leaf_ptr) {
+        lc = leaf_frame_find(bdb, leaf_ptr);
+        if (lc == NULL) {
+            lc = leaf_frame_load(bdb, leaf_ptr, 0, LOCK_WRITE);
+            if (lc == NULL)
+                return -1;
+        }
+        bdb->leaf_cache = lc;
+    }
+    lc->ref = 1;
+    return 0;
+}
+
+/* フレームに keynum 個のキー配列と size バイトのアリーナの空きを確保します。
+   足りない場合は新しい領域を確保して有効なキーと値だけを詰めて移します。
+   削除や値の更新で使われなくなったアリーナの領域はこのときに回収されます。*/
+static int leaf_frame_reserve(struct bdb_t* bdb, struct leaf_cache_t* lc, int keynum, int size)
+{
+    struct bdb_leaf_key_t* kd;
+    uchar* ap;
+    int alloc_keys;
+    int arena_size;
+    int i;
+
+    if (keynum <= lc->alloc_keys && lc->arena_used + size <= lc->arena_size)
+        return 0;
+
+    alloc_keys = lc->alloc_keys;
+    if (keynum > alloc_keys)
+        alloc_keys = keynum + 10;
+    arena_size = size;
+    for (i = 0; i < lc->leaf.keynum; i++) {
+        arena_size += lc->keydata[i].keysize;
+        if (bdb->datapack_flag)
+            arena_size += lc->keydata[i].value.u.pp.valsize;
+    }
+    arena_size += arena_size / 4;
+    if (arena_size < bdb->node_pgsize)
+        arena_size = bdb->node_pgsize;
+
+    kd = (struct bdb_leaf_key_t*)malloc(sizeof(struct bdb_leaf_key_t) * alloc_keys + arena_size);
+    if (! kd) {
+        err_write("bdb: leaf cache no memory.");
+        return -1;
+    }
+    ap = (uchar*)(kd + alloc_keys);
+    for (i = 0; i < lc->leaf.keynum; i++) {
+        struct bdb_leaf_key_t* kp = &lc->keydata[i];
+
+        kd[i] = *kp;
+        kd[i].key = ap;
+        memcpy(ap, kp->key, kp->keysize);
+        ap += kp->keysize;
+        if (bdb->datapack_flag) {
+            kd[i].value.u.pp.val = ap;
+            memcpy(ap, kp->value.u.pp.val, kp->value.u.pp.valsize);
+            ap += kp->value.u.pp.valsize;
+        }
+    }
+    if (lc->keydata)
+        free(lc->keydata);
+    lc->keydata = kd;
+    lc->alloc_keys = alloc_keys;
+    lc->arena_size = arena_size;
+    lc->arena_used = (int)(ap - (uchar*)(kd + alloc_keys));
+    return 0;
+}
+
+/* フレームのアリーナから size バイトの領域を割り当てます。
+   キー配列は keynum 個まで確保されます。
+   アリーナが移動することがあるため以前のキーのポインタは無効になります。*/
+static uchar* leaf_frame_alloc(struct bdb_t* bdb, struct leaf_cache_t* lc, int keynum, int size)
+{
+    uchar* p;
+
+    if (leaf_frame_reserve(bdb, lc, keynum, size) < 0)
+        return NULL;
+    p = leaf_frame_arena(lc) + lc->arena_used;
+    lc->arena_used += size;
+    return p;
+}
+
+/* 挿入するキーと値をフレームのアリーナに複写して kp をアリーナに向けます。
+   キー配列には挿入する1個分の空きが確保されます。*/
+static int leaf_frame_store_key(struct bdb_t* bdb, struct leaf_cache_t* lc, struct bdb_leaf_key_t* kp)
+{
+    uchar* p;
+    int size;
+
+    size = kp->keysize;
+    if (bdb->datapack_flag)
+        size += kp->value.u.pp.valsize;
+    p = leaf_frame_alloc(bdb, lc, lc->leaf.keynum+1, size);
+    if (p == NULL)
+        return -1;
+
+    memcpy(p, kp->key, kp->keysize);
+    kp->key = p;
+    if (bdb->datapack_flag) {
+        p += kp->keysize;
+        memcpy(p, kp->value.u.pp.val, kp->value.u.pp.valsize);
+        kp->value.u.pp.val = p;
+    }
+    return 0;
+}
+
+static void leaf_cache_clear(struct bdb_t* bdb)
+{
+    leaf_frame_discard(bdb, bdb->leaf_cache);
+}
+
+/* フレームをすべて無効にします。*/
+static void leaf_pool_reset(struct bdb_t* bdb)
+{
+    int i;
+
+    for (i = 0; i < bdb->leaf_pool_size; i++) {
+        bdb->leaf_pool[i].leaf.node_ptr = 0;
+        bdb->leaf_pool[i].update = 0;
+        bdb->leaf_pool[i].ref = 0;
+        bdb->leaf_pool[i].hnext = -1;
+        bdb->leaf_pool[i].pin = 0;
+    }
+    for (i = 0; i <= bdb->leaf_hash_mask; i++)
+        bdb->leaf_hash[i] = -1;
+    bdb->leaf_cache = &bdb->leaf_pool[0];
+    bdb->leaf_clock = 0;
+}
+
+static void leaf_pool_free(struct bdb_t* bdb)
+{
+    int i;
+
+    if (bdb->leaf_pool) {
+        for (i = 0; i < bdb->leaf_pool_size; i++) {
+            if (bdb->leaf_pool[i].keydata)
+                free(bdb->leaf_pool[i].keydata);
+        }
+        free(bdb->leaf_pool);
+        bdb->leaf_pool = NULL;
+    }
+    if (bdb->leaf_hash) {
+        free(bdb->leaf_hash);
+        bdb->leaf_hash = NULL;
+    }
+    bdb->leaf_cache = NULL;
+    bdb->leaf_pool_size = 0;
+}
+
+static int leaf_pool_create(struct bdb_t* bdb, int size)
+{
+    struct leaf_cache_t* pool;
+    int* hash;
+    int hsize = 2;
+
+    while (hsize < size * 2)
+        hsize <<= 1;
+
+    pool = (struct leaf_cache_t*)calloc(size, sizeof(struct leaf_cache_t));
+    hash = (int*)malloc(hsize * sizeof(int));
+    if (pool == NULL || hash == NULL) {
+        err_write("bdb: leaf cache no memory.");
+        if (pool)
+            free(pool);
+        if (hash)
+            free(hash);
+        return -1;
+    }
+
+    leaf_pool_free(bdb);
+    bdb->leaf_pool = pool;
+    bdb->leaf_pool_size = size;
+    bdb->leaf_hash = hash;
+    bdb->leaf_hash_mask = hsize - 1;
+    leaf_pool_reset(bdb);
+    return 0;
+}
+
+static void make_slot(struct bdb_t* bdb,
+                      int index,
+                      int valsize,
+                      const void* val,
+                      int64 vptr,
+                      struct bdb_slot_t* slot)
+{
+    slot->index = index;
+    if (bdb->datapack_flag) {
+        slot->u.pp.valsize = (uchar)valsize;
+        if (val)
+            memcpy(slot->u.pp.val, val, valsize);
+        else
+            memset(slot->u.pp.val, '\0', BDB_PACK_DATASIZE);
+    } else {
+        slot->u.dp.v_ptr = vptr;
+    }
+}
+
+/* リーフノード内からキーを検索します。
+ *
+ * 見つかった場合はスロットの位置を設定して BDB_KEY_FOUND を返します。
+ * 見つからなかった場合は挿入位置のスロットを設定して
+ * BDB_KEY_NOTFOUND を返します。
  *
  * エラーの場合は -1 を返します。
  */
@@ -2967,16 +5071,12 @@ static int64 split_new_leaf(struct bdb_t* bdb,
                             int move_to)
 {
     int nkeynum;
-    struct bdb_leaf_key_t* nkeydata;
     int64 nptr;
 
     nkeynum = baseleaf->keynum - move_to;
-    nkeydata = (struct bdb_leaf_key_t*)malloc(sizeof(struct bdb_leaf_key_t) * nkeynum);
-    memcpy(nkeydata, &keydata[move_to], sizeof(struct bdb_leaf_key_t) * nkeynum);
 
     /* 新たなリーフを作成してチェーンにつなぎます。*/
-    nptr = create_leaf(bdb, baseleaf, nkeynum, nkeydata);
-    free(nkeydata);
+    nptr = create_leaf(bdb, baseleaf, nkeynum, &keydata[move_to]);
     if (nptr < 0)
         return -1;
     return nptr;
@@ -2996,6 +5096,8 @@ static int split_leaf_index(struct bdb_t* bdb,
     mid = leaf->keynum / 2;
     kbufsize = leaf_sizeof_keybuf(bdb, leaf, mid, keydata, 0);
     start = (kbufsize > split_size)? 0 : mid;
+    /* 最初の位置で分割する場合も元のリーフのサイズを設定しておきます。*/
+    *base_leafsize = (start > 0)? kbufsize : 0;
 
     for (i = start; i < leaf->keynum; i++) {
         kbufsize = leaf_sizeof_keybuf(bdb, leaf, i+1, keydata, 0);
@@ -3067,6 +5169,8 @@ final:
     return result;
 }
 
+/* キーと値を参照するリーフキーを編集します。
+   キーと値は複写されないので kp を使用する間は有効である必要があります。*/
 static void make_leaf_key(struct bdb_t* bdb,
                          const void* key,
                          int keysize,
@@ -3076,11 +5180,11 @@ static void make_leaf_key(struct bdb_t* bdb,
                          struct bdb_leaf_key_t* kp)
 {
     kp->keysize = keysize;
-    memcpy(kp->key, key, keysize);
+    kp->key = (uchar*)key;
 
     if (bdb->datapack_flag) {
         kp->value.u.pp.valsize = (uchar)valsize;
-        memcpy(kp->value.u.pp.val, val, valsize);
+        kp->value.u.pp.val = (uchar*)val;
     } else {
         kp->value.u.dp.v_ptr = vptr;
     }
@@ -3097,6 +5201,10 @@ static int add_leaf_slot(struct bdb_t* bdb,
     int64 vptr = 0;
     int nodesize;
     struct bdb_leaf_key_t inskey;
+
+    /* リーフまでの経路のキー数を更新します。*/
+    if (bt_count_key(bdb, key, keysize, 1) < 0)
+        return -1;
     
     /* 挿入するサイズを取得します(圧縮は考慮しない)。
        キーサイズ(2) + プレフィックスサイズ(1) + キーサイズ
@@ -3128,7 +5236,7 @@ static int add_leaf_slot(struct bdb_t* bdb,
         void* btkey;
         ushort btksize;
 
-        if (leaf_cache_flush(bdb) < 0)
+        if (leaf_frame_flush(bdb, bdb->leaf_cache) < 0)
             return -1;
 
         /* リーフを分割します。*/
@@ -3149,6 +5257,10 @@ static int add_leaf_slot(struct bdb_t* bdb,
 
         if (slot->index < bdb->leaf_cache->leaf.keynum) {
             /* 元のリーフに挿入 */
+            if (leaf_frame_store_key(bdb, bdb->leaf_cache, &inskey) < 0) {
+                free(n_keydata);
+                return -1;
+            }
             if (insert_leaf_slot(bdb, &bdb->leaf_cache->leaf, bdb->leaf_cache->keydata, slot, &inskey) < 0)
                 return -1;
         } else {
@@ -3185,6 +5297,8 @@ static int add_leaf_slot(struct bdb_t* bdb,
         }
     } else {
         /* insert into leaf */
+        if (leaf_frame_store_key(bdb, bdb->leaf_cache, &inskey) < 0)
+            return -1;
         if (insert_leaf_slot(bdb, &bdb->leaf_cache->leaf, bdb->leaf_cache->keydata, slot, &inskey) < 0)
             return -1;
     }
@@ -3197,36 +5311,58 @@ static int add_leaf_slot(struct bdb_t* bdb,
  * BDB_KEY_NOTFOUND か BDB_KEY_FOUND を返します。
  * エラーの場合は -1 を返します。
  */
-static int search_key(struct bdb_t* bdb,
-                      const void* key,
-                      int keysize,
-                      struct bdb_slot_t* slot)
+/* キーが格納されるリーフのポインタを返します。
+   snap が指定された場合はスナップショット時点のB木を検索します。*/
+static int64 find_snap_leaf(struct bdb_t* bdb,
+                            struct bdb_snapshot_t* snap,
+                            const void* key,
+                            int keysize)
 {
-    int64 leaf_ptr = 0;
+    int64 ptr;
+    int64 root_ptr;
+    char* buf;
 
-    if (bdb->root_ptr == 0) {
+    root_ptr = (snap)? snap->root_ptr : bdb->root_ptr;
+    if (root_ptr == 0) {
         /* B木は作成されておらず、リーフのみ存在の場合 */
-        leaf_ptr = bdb->leaf_top_ptr;
-    } else {
-        int64 ptr;
+        return (snap)? snap->leaf_top_ptr : bdb->leaf_top_ptr;
+    }
 
-        ptr = bdb->root_ptr;
-        while (ptr > 0) {
-            int64 child_ptr;
+    /* 共有ロックで呼ばれるため bdb->node_buf は使用しません。*/
+    buf = (char*)alloca(bdb->node_pgsize);
+    ptr = root_ptr;
+    while (ptr > 0) {
+        int64 child_ptr;
 
-            if (read_node(bdb, ptr, bdb->node_buf) < 0)
-                return -1;   /* error */
+        if (read_node(bdb, snap_ptr(snap, ptr), buf) < 0)
+            return -1;   /* error */
 
-            bt_search_node(bdb, bdb->node_buf, key, keysize, &child_ptr, NULL);
+        bt_search_node(bdb, buf, key, keysize, &child_ptr, NULL);
 
-            if (is_leaf(bdb, child_ptr)) {
-                ptr = child_ptr;
-                break;
-            }
-            ptr = child_ptr;
-        }
-        leaf_ptr = ptr;
+        ptr = child_ptr;
+        if (is_leaf(bdb, snap_ptr(snap, child_ptr)))
+            break;
     }
+    return ptr;
+}
+
+static int64 find_leaf(struct bdb_t* bdb,
+                       const void* key,
+                       int keysize)
+{
+    return find_snap_leaf(bdb, NULL, key, keysize);
+}
+
+static int search_key(struct bdb_t* bdb,
+                      const void* key,
+                      int keysize,
+                      struct bdb_slot_t* slot)
+{
+    int64 leaf_ptr;
+
+    leaf_ptr = find_leaf(bdb, key, keysize);
+    if (leaf_ptr < 0)
+        return -1;
     if (leaf_ptr == 0)
         return BDB_KEY_NOTFOUND;
 
@@ -3240,6 +5376,42 @@ static int search_key(struct bdb_t* bdb,
                        slot);
 }
 
+/* 参照のためにキーを検索します。
+   共有ロックの場合は bdb->leaf_cache を変更せずにフレームを固定して検索します。
+   固定したフレームは *pin に設定されるので、値を読み込んだ後に
+   search_key_done() で固定を解除します。*/
+static int search_key_read(struct bdb_t* bdb,
+                           const void* key,
+                           int keysize,
+                           struct bdb_slot_t* slot,
+                           struct leaf_cache_t** pin)
+{
+    int64 leaf_ptr;
+    struct leaf_cache_t* lc;
+
+    *pin = NULL;
+    if (! bdb->shared_latch)
+        return search_key(bdb, key, keysize, slot);
+
+    leaf_ptr = find_leaf(bdb, key, keysize);
+    if (leaf_ptr < 0)
+        return -1;
+    if (leaf_ptr == 0)
+        return BDB_KEY_NOTFOUND;
+
+    lc = leaf_frame_pin(bdb, leaf_ptr);
+    if (lc == NULL)
+        return -1;
+    *pin = lc;
+    return search_leaf(bdb, &lc->leaf, lc->keydata, key, keysize, slot);
+}
+
+static void search_key_done(struct bdb_t* bdb, struct leaf_cache_t* pin)
+{
+    if (pin)
+        leaf_frame_unpin(bdb, pin);
+}
+
 /* 重複ありの場合のみ */
 static int link_key_value(struct bdb_t* bdb,
                           const void* val,
@@ -3279,26 +5451,42 @@ static int64 update_key_value(struct bdb_t* bdb,
                               struct bdb_slot_t* slot)
 {
     int64 ptr;
+    char* cval;
+    int csize, codec = NIO_COMP_NONE;
+    int rawsize = valsize;
 
     ptr = slot->u.dp.v_ptr;
     if (read_value_header(bdb, slot->u.dp.v_ptr, &slot->u.dp.v) < 0)
         return -1;
 
-    if (valsize > slot->u.dp.v.areasize) {
+    cval = nio_value_compress(bdb->nio, val, valsize, &csize, &codec);
+    if (cval) {
+        val = cval;
+        valsize = csize;
+    }
+
+    if (BDB_VALUE_SIZE + valsize > slot->u.dp.v.areasize) {
         /* 元の領域に収まらないので別の領域に書き出します。*/
 
         /* 元の領域を開放します。*/
-        if (nio_add_free_list(bdb->nio, slot->u.dp.v_ptr, slot->u.dp.v.areasize) < 0)
-            return -1;
+        if (free_space(bdb, slot->u.dp.v_ptr, slot->u.dp.v.areasize) < 0) {
+            ptr = -1;
+            goto final;
+        }
         /* 新たな領域に書き出します。*/
-        ptr = add_value(bdb, val, valsize, slot->u.dp.v.prev_ptr, slot->u.dp.v.next_ptr);
-        if (ptr < 0)
-            return -1;
+        ptr = write_new_value(bdb, val, valsize, codec, rawsize,
+                              slot->u.dp.v.prev_ptr, slot->u.dp.v.next_ptr);
     } else {
         slot->u.dp.v.valsize = valsize;
+        slot->u.dp.v.codec = codec;
+        slot->u.dp.v.rawsize = rawsize;
         if (write_value(bdb, slot->u.dp.v_ptr, &slot->u.dp.v, val) < 0)
-            return -1;
+            ptr = -1;
     }
+
+final:
+    if (cval)
+        free(cval);
     return ptr;
 }
 
@@ -3310,7 +5498,7 @@ static int delete_value(struct bdb_t* bdb, int64 ptr)
 
         if (read_value_header(bdb, ptr, &v) < 0)
             return -1;
-        if (nio_add_free_list(bdb->nio, ptr, v.areasize) < 0)
+        if (free_space(bdb, ptr, v.areasize) < 0)
             return -1;
         ptr = v.next_ptr;
     }
@@ -3338,7 +5526,7 @@ static int delete_leaf(struct bdb_t* bdb, struct bdb_leaf_t* leaf)
     }
 
     /* リーフ領域を開放します。*/
-    if (nio_add_free_list(bdb->nio, leaf->node_ptr, bdb->node_pgsize) < 0)
+    if (free_space(bdb, leaf->node_ptr, bdb->node_pgsize) < 0)
         return -1;
 
     if (bdb->leaf_top_ptr == leaf->node_ptr) {
@@ -3352,6 +5540,20 @@ static int delete_leaf(struct bdb_t* bdb, struct bdb_leaf_t* leaf)
     return 0;
 }
 
+static void remove_leaf_slot(struct bdb_leaf_t* leaf,
+                             struct bdb_leaf_key_t* keydata,
+                             int index)
+{
+    if (index < leaf->keynum-1) {
+        int shift_n;
+
+        shift_n = leaf->keynum - index - 1;
+        memmove(&keydata[index], &keydata[index+1],
+                sizeof(struct bdb_leaf_key_t) * shift_n);
+    }
+    leaf->keynum--;
+}
+
 static int delete_leaf_slot(struct bdb_t* bdb,
                             struct bdb_slot_t* slot)
 {
@@ -3364,17 +5566,8 @@ static int delete_leaf_slot(struct bdb_t* bdb,
             return -1;
     }
 
-    if (slot->index < bdb->leaf_cache->leaf.keynum-1) {
-        int shift_n;
-
-        shift_n = bdb->leaf_cache->leaf.keynum - slot->index - 1;
-        memmove(&bdb->leaf_cache->keydata[slot->index],
-                &bdb->leaf_cache->keydata[slot->index+1],
-                sizeof(struct bdb_leaf_key_t) * shift_n);
-    }
-
     /* update leaf */
-    bdb->leaf_cache->leaf.keynum--;
+    remove_leaf_slot(&bdb->leaf_cache->leaf, bdb->leaf_cache->keydata, slot->index);
 
     if (bdb->leaf_cache->leaf.keynum == 0) {
         /* delete leaf */
@@ -3398,31 +5591,71 @@ static int delete_leaf_slot(struct bdb_t* bdb,
     return 0;
 }
 
+/* データパックの値を valsize に更新してもリーフがページに収まるか調べます。
+   収まる場合は 1、収まらない場合はゼロを返します。*/
+static int pack_value_fits(struct bdb_t* bdb,
+                           struct leaf_cache_t* lc,
+                           struct bdb_slot_t* slot,
+                           int valsize)
+{
+    int nodesize;
+
+    nodesize = BDB_LEAF_SIZE + leaf_sizeof_keybuf(bdb,
+                                                  &lc->leaf,
+                                                  lc->leaf.keynum,
+                                                  lc->keydata,
+                                                  0);
+    nodesize += valsize - lc->keydata[slot->index].value.u.pp.valsize;
+    return (nodesize <= bdb->node_pgsize);
+}
+
+/* フレームのキー配列のデータパックの値を更新します。*/
+static int leaf_frame_set_pack(struct bdb_t* bdb,
+                               struct leaf_cache_t* lc,
+                               int index,
+                               const void* val,
+                               int valsize)
+{
+    struct bdb_leaf_key_t* kp;
+
+    if (valsize > lc->keydata[index].value.u.pp.valsize) {
+        /* 元の領域に収まらない場合はアリーナから割り当てます。*/
+        uchar* p;
+
+        p = leaf_frame_alloc(bdb, lc, lc->leaf.keynum, valsize);
+        if (p == NULL)
+            return -1;
+        lc->keydata[index].value.u.pp.val = p;
+    }
+    kp = &lc->keydata[index];
+    kp->value.u.pp.valsize = valsize;
+    memcpy(kp->value.u.pp.val, val, valsize);
+    return 0;
+}
+
 static int update_key_value_pack(struct bdb_t* bdb,
-                                 struct bdb_leaf_t* leaf,
+                                 struct leaf_cache_t* lc,
                                  struct bdb_slot_t* slot,
                                  char* keybuf,
-                                 struct bdb_leaf_key_t* keydata,
                                  const void* val,
                                  int valsize)
 {
-    struct bdb_leaf_key_t* kp;
+    struct bdb_leaf_t* leaf = &lc->leaf;
     int nodesize;
 
     if (slot->index >= leaf->keynum)
         return -1;
 
     /* update value */
-    kp = &keydata[slot->index];
-    kp->value.u.pp.valsize = valsize;
-    memcpy(kp->value.u.pp.val, val, valsize);
+    if (leaf_frame_set_pack(bdb, lc, slot->index, val, valsize) < 0)
+        return -1;
 
     /* update slot */
     slot->u.pp.valsize = valsize;
     memcpy(slot->u.pp.val, val, valsize);
 
     /* update leaf & keybuf */
-    nodesize = leaf_put_keydata(bdb, leaf, keydata, keybuf);
+    nodesize = leaf_put_keydata(bdb, leaf, lc->keydata, keybuf);
     leaf->nodesize = BDB_LEAF_SIZE + nodesize;
 
     if (put_leaf_keybuf(bdb, leaf, keybuf) < 0)
@@ -3432,17 +5665,20 @@ static int update_key_value_pack(struct bdb_t* bdb,
     return 0;
 }
 
-static int get_first_leaf_key(struct bdb_t* bdb, int64 leaf_ptr, struct bdb_leaf_key_t* kp)
+/* リーフの先頭キーを key に複写してキーサイズを返します。*/
+static int get_first_leaf_key(struct bdb_t* bdb, int64 leaf_ptr, void* key)
 {
+    struct bdb_leaf_key_t* kp;
+
     if (leaf_cache_get(bdb, leaf_ptr) < 0)
         return -1;
 
     if (bdb->leaf_cache->leaf.keynum < 1)
         return -1;
 
-
-    memcpy(kp, &bdb->leaf_cache->keydata[0], sizeof(struct bdb_leaf_key_t));
-    return 0;
+    kp = &bdb->leaf_cache->keydata[0];
+    memcpy(key, kp->key, kp->keysize);
+    return kp->keysize;
 }
 
 static int update_leaf_by_slot(struct bdb_t* bdb,
@@ -3457,6 +5693,13 @@ static int update_leaf_by_slot(struct bdb_t* bdb,
     if (slot->index >= leaf->keynum)
         return -1;
 
+    if (leaf == &bdb->leaf_cache->leaf) {
+        /* キャッシュのキー配列を更新して書き出しは遅延します。*/
+        bdb->leaf_cache->keydata[slot->index].value.u.dp.v_ptr = slot->u.dp.v_ptr;
+        bdb->leaf_cache->update = 1;
+        return 0;
+    }
+
     kbuf = (char*)alloca(bdb->node_pgsize);
     if (get_leaf_keybuf(bdb, leaf, kbuf) < 0)
         return -1;
@@ -3498,15 +5741,14 @@ int bdb_find(struct bdb_t* bdb, const void* key, int keysize)
     int dsize = -1;
     int result;
     struct bdb_slot_t slot;
+    struct leaf_cache_t* pin;
 
-    if (keysize > NIO_MAX_KEYSIZE) {
-        err_write("bdb_find: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
+    if (check_keysize(bdb, keysize, "bdb_find") < 0)
         return -1;
-    }
 
-    CS_START(&bdb->critical_section);
+    lock_tree(bdb, LOCK_READ);
 
-    result = search_key(bdb, key, keysize, &slot);
+    result = search_key_read(bdb, key, keysize, &slot, &pin);
     if (result == BDB_KEY_FOUND) {
         if (bdb->datapack_flag) {
             dsize = slot.u.pp.valsize;
@@ -3514,43 +5756,26 @@ int bdb_find(struct bdb_t* bdb, const void* key, int keysize)
             struct bdb_value_t v;
 
             if (read_value_header(bdb, slot.u.dp.v_ptr, &v) == 0)
-                dsize = v.valsize;
+                dsize = v.rawsize;
         }
     }
+    search_key_done(bdb, pin);
 
-    CS_END(&bdb->critical_section);
+    unlock_tree(bdb, LOCK_READ);
     return dsize;
 }
 
-/*
- * データベースからキーを検索して値をポインタに設定します。
- * 重複キーが許可されている場合は最初のキーの値を取得します。
- *
- * bdb: データベース構造体のポインタ
- * key: キーのポインタ
- * keysize: キーのサイズ
- * val: 値のポインタ
- * valsize: 値の領域サイズ
- *
- * キー値を取得できた場合は値のサイズを返します。
- * キーが存在しない場合は -1 を返します。
- * 値の領域が不足している場合は -2 を返します。
- * その他のエラーの場合は負の値を返します。
- */
-int bdb_get(struct bdb_t* bdb, const void* key, int keysize, void* val, int valsize)
+static int get_by_key(struct bdb_t* bdb, const void* key, int keysize, void* val, int valsize)
 {
     int dsize = -1;
     int status;
     struct bdb_slot_t slot;
+    struct leaf_cache_t* pin;
 
-    if (keysize > NIO_MAX_KEYSIZE) {
-        err_write("bdb_get: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
+    if (check_keysize(bdb, keysize, "bdb_get") < 0)
         return -1;
-    }
-
-    CS_START(&bdb->critical_section);
 
-    status = search_key(bdb, key, keysize, &slot);
+    status = search_key_read(bdb, key, keysize, &slot, &pin);
     if (status == BDB_KEY_FOUND) {
         if (bdb->datapack_flag) {
             if (valsize < slot.u.pp.valsize)
@@ -3563,33 +5788,54 @@ int bdb_get(struct bdb_t* bdb, const void* key, int keysize, void* val, int vals
             struct bdb_value_t v;
 
             if (read_value_header(bdb, slot.u.dp.v_ptr, &v) == 0) {
-                if (valsize < v.valsize)
-                    dsize = -2;
-                else {
-                    if (mmap_read(bdb->nio->mmap, val, v.valsize) == v.valsize)
-                        dsize = v.valsize;
-                }
+                dsize = read_value_data(bdb, slot.u.dp.v_ptr, &v, val, valsize);
+                if (dsize == -1)
+                    err_write("bdb_get: can't read value.");
             }
         }
     }
-
-    CS_END(&bdb->critical_section);
+    search_key_done(bdb, pin);
     return dsize;
 }
 
 /*
- * データベースからキーを検索して値のポインタを返します。
- * 値の領域は関数内で確保されます。
- * 値のポインタは使用後に bdb_free() で解放する必要があります。
+ * データベースからキーを検索して値をポインタに設定します。
  * 重複キーが許可されている場合は最初のキーの値を取得します。
  *
  * bdb: データベース構造体のポインタ
  * key: キーのポインタ
  * keysize: キーのサイズ
- * valsize: 値の領域サイズが設定されるポインタ
+ * val: 値のポインタ
+ * valsize: 値の領域サイズ
  *
- * キー値を取得できた場合は値のサイズを設定して領域のポインタを返します。
- * キーが存在しない場合は valsize に -1 が設定されて NULL を返します。
+ * キー値を取得できた場合は値のサイズを返します。
+ * キーが存在しない場合は -1 を返します。
+ * 値の領域が不足している場合は -2 を返します。
+ * その他のエラーの場合は負の値を返します。
+ */
+int bdb_get(struct bdb_t* bdb, const void* key, int keysize, void* val, int valsize)
+{
+    int dsize;
+
+    lock_tree(bdb, LOCK_READ);
+    dsize = get_by_key(bdb, key, keysize, val, valsize);
+    unlock_tree(bdb, LOCK_READ);
+    return dsize;
+}
+
+/*
+ * データベースからキーを検索して値のポインタを返します。
+ * 値の領域は関数内で確保されます。
+ * 値のポインタは使用後に bdb_free() で解放する必要があります。
+ * 重複キーが許可されている場合は最初のキーの値を取得します。
+ *
+ * bdb: データベース構造体のポインタ
+ * key: キーのポインタ
+ * keysize: キーのサイズ
+ * valsize: 値の領域サイズが設定されるポインタ
+ *
+ * キー値を取得できた場合は値のサイズを設定して領域のポインタを返します。
+ * キーが存在しない場合は valsize に -1 が設定されて NULL を返します。
  * その他のエラーの場合は valsize に -2 が設定されて NULL を返します。
  */
 void* bdb_aget(struct bdb_t* bdb, const void* key, int keysize, int* valsize)
@@ -3597,16 +5843,15 @@ void* bdb_aget(struct bdb_t* bdb, const void* key, int keysize, int* valsize)
     void* val = NULL;
     int status;
     struct bdb_slot_t slot;
+    struct leaf_cache_t* pin;
 
     *valsize = -2;
-    if (keysize > NIO_MAX_KEYSIZE) {
-        err_write("bdb_aget: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
+    if (check_keysize(bdb, keysize, "bdb_aget") < 0)
         return NULL;
-    }
 
-    CS_START(&bdb->critical_section);
+    lock_tree(bdb, LOCK_READ);
 
-    status = search_key(bdb, key, keysize, &slot);
+    status = search_key_read(bdb, key, keysize, &slot, &pin);
     if (status == BDB_KEY_FOUND) {
         if (bdb->datapack_flag) {
             val = malloc(slot.u.pp.valsize);
@@ -3620,18 +5865,18 @@ void* bdb_aget(struct bdb_t* bdb, const void* key, int keysize, int* valsize)
             struct bdb_value_t v;
 
             if (read_value_header(bdb, slot.u.dp.v_ptr, &v) == 0) {
-                val = malloc(v.valsize);
+                val = malloc(v.rawsize);
                 if (val == NULL) {
-                    err_write("bdb_aget: no memory %d bytes.", v.valsize);
+                    err_write("bdb_aget: no memory %d bytes.", v.rawsize);
                     goto final;
                 }
-                if (mmap_read(bdb->nio->mmap, val, v.valsize) != v.valsize) {
-                    err_write("bdb_aget: can't mmap_read.");
+                if (read_value_data(bdb, slot.u.dp.v_ptr, &v, val, v.rawsize) != v.rawsize) {
+                    err_write("bdb_aget: can't read value.");
                     free(val);
                     val = NULL;
                     goto final;
                 }
-                *valsize = v.valsize;
+                *valsize = v.rawsize;
             }
         }
     } else {
@@ -3640,35 +5885,118 @@ void* bdb_aget(struct bdb_t* bdb, const void* key, int keysize, int* valsize)
     }
 
 final:
-    CS_END(&bdb->critical_section);
+    search_key_done(bdb, pin);
+    unlock_tree(bdb, LOCK_READ);
     return val;
 }
 
 /*
- * データベースにキーと値を設定します。
- *
- * 重複キーが許可されていない場合でキーがすでに存在している場合は
- * 値が置換されます。
+ * データベースからキーを検索して値を参照するビューを設定します。
+ * 値がメモリマップ上にある場合はコピーせずにマップ上の領域を固定します。
+ * キーと値がパックされている場合は値がコピーされます。
+ * ビューは使用後に nio_release_view() で解放する必要があります。
+ * 重複キーが許可されている場合は最初のキーの値を取得します。
  *
  * bdb: データベース構造体のポインタ
  * key: キーのポインタ
  * keysize: キーのサイズ
- * val: 値のポインタ
- * valsize: 値のサイズ
+ * view: ビュー構造体のポインタ
  *
- * 成功した場合はゼロを返します。
- * エラーの場合は -1 を返します。
+ * キー値を取得できた場合は値のサイズを返します。
+ * キーが存在しない場合は -1 を返します。
+ * その他のエラーの場合は -2 を返します。
  */
-int bdb_put(struct bdb_t* bdb, const void* key, int keysize, const void* val, int valsize)
+int bdb_get_view(struct bdb_t* bdb, const void* key, int keysize, struct nio_view_t* view)
+{
+    int result = -2;
+    int status;
+    struct bdb_slot_t slot;
+    struct leaf_cache_t* pin;
+    void* val = NULL;
+
+    view->val = NULL;
+    view->valsize = 0;
+    view->pinned = 0;
+    if (check_keysize(bdb, keysize, "bdb_get_view") < 0)
+        return -2;
+
+    lock_tree(bdb, LOCK_READ);
+
+    status = search_key_read(bdb, key, keysize, &slot, &pin);
+    if (status != BDB_KEY_FOUND) {
+        /* not found */
+        if (status >= 0)
+            result = -1;
+        goto final;
+    }
+
+    if (bdb->datapack_flag) {
+        /* 値はリーフページのキャッシュ上にあるためコピーします。*/
+        val = malloc(slot.u.pp.valsize);
+        if (val == NULL) {
+            err_write("bdb_get_view: no memory %d bytes.", slot.u.pp.valsize);
+            goto final;
+        }
+        memcpy(val, slot.u.pp.val, slot.u.pp.valsize);
+        view->valsize = slot.u.pp.valsize;
+    } else {
+        struct bdb_value_t v;
+        int64 vptr;
+
+        if (read_value_header(bdb, slot.u.dp.v_ptr, &v) < 0)
+            goto final;
+        if (v.codec != NIO_COMP_NONE) {
+            /* 圧縮されている値は展開した領域を参照します。*/
+            val = malloc(v.rawsize);
+            if (val == NULL) {
+                err_write("bdb_get_view: no memory %d bytes.", v.rawsize);
+                goto final;
+            }
+            if (read_value_data(bdb, slot.u.dp.v_ptr, &v, val, v.rawsize) != v.rawsize) {
+                err_write("bdb_get_view: can't read value.");
+                free(val);
+                val = NULL;
+                goto final;
+            }
+        } else {
+            vptr = slot.u.dp.v_ptr + BDB_VALUE_SIZE;
+            val = mmap_pin(bdb->nio->mmap, vptr, v.valsize);
+            if (val) {
+                view->pinned = 1;
+            } else {
+                /* メモリマップ外のため領域を確保して読み込みます。*/
+                val = malloc(v.valsize);
+                if (val == NULL) {
+                    err_write("bdb_get_view: no memory %d bytes.", v.valsize);
+                    goto final;
+                }
+                if (mmap_pread(bdb->nio->mmap, val, v.valsize, vptr) != v.valsize) {
+                    err_write("bdb_get_view: can't mmap_read.");
+                    free(val);
+                    val = NULL;
+                    goto final;
+                }
+            }
+        }
+        view->valsize = v.rawsize;
+    }
+    view->val = val;
+    result = view->valsize;
+
+final:
+    search_key_done(bdb, pin);
+    unlock_tree(bdb, LOCK_READ);
+    return result;
+}
+
+static int put_by_key(struct bdb_t* bdb, const void* key, int keysize, const void* val, int valsize)
 {
     int result = 0;
     int status;
     struct bdb_slot_t slot;
 
-    if (keysize > NIO_MAX_KEYSIZE) {
-        err_write("bdb_put: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
+    if (check_keysize(bdb, keysize, "bdb_put") < 0)
         return -1;
-    }
     if (bdb->datapack_flag) {
         if (valsize > BDB_PACK_DATASIZE) {
             err_write("bdb_put: valsize is too large, less than %d bytes.", BDB_PACK_DATASIZE);
@@ -3676,8 +6004,6 @@ int bdb_put(struct bdb_t* bdb, const void* key, int keysize, const void* val, in
         }
     }
 
-    CS_START(&bdb->critical_section);
-
     /* キーを検索します。*/
     status = search_key(bdb, key, keysize, &slot);
 
@@ -3692,8 +6018,17 @@ int bdb_put(struct bdb_t* bdb, const void* key, int keysize, const void* val, in
             result = link_key_value(bdb, val, valsize, &slot);
         } else {
             if (bdb->datapack_flag) {
-                if (update_key_value_pack(bdb, &bdb->leaf_cache->leaf, &slot, bdb->leaf_buf,
-                                          bdb->leaf_cache->keydata, val, valsize) < 0) {
+                if (! pack_value_fits(bdb, bdb->leaf_cache, &slot, valsize)) {
+                    /* リーフに収まらない場合は削除してから挿入してリーフを分割します。*/
+                    if (delete_by_key(bdb, key, keysize) < 0) {
+                        result = -1;
+                        goto final;
+                    }
+                    result = put_by_key(bdb, key, keysize, val, valsize);
+                    goto final;
+                }
+                if (update_key_value_pack(bdb, bdb->leaf_cache, &slot, bdb->leaf_buf,
+                                          val, valsize) < 0) {
                     err_write("bdb_put: update_key_value_pack() is fail.");
                     result = -1;
                     goto final;
@@ -3728,7 +6063,7 @@ int bdb_put(struct bdb_t* bdb, const void* key, int keysize, const void* val, in
                 }
             } else {
                 /* リーフを取得（リーフノードは１個しかない） */
-                if (leaf_cache_get_by_insert(bdb, bdb->leaf_top_ptr) < 0) {
+                if (leaf_cache_get(bdb, bdb->leaf_top_ptr) < 0) {
                     result = -1;
                     goto final;
                 }
@@ -3746,7 +6081,7 @@ int bdb_put(struct bdb_t* bdb, const void* key, int keysize, const void* val, in
                 bdb->leaf_cache->update = 1;
             }
         } else {
-            if (leaf_cache_get_by_insert(bdb, bdb->leaf_cache->leaf.node_ptr) < 0) {
+            if (leaf_cache_get(bdb, bdb->leaf_cache->leaf.node_ptr) < 0) {
                 result = -1;
                 goto final;
             }
@@ -3761,36 +6096,178 @@ int bdb_put(struct bdb_t* bdb, const void* key, int keysize, const void* val, in
 
 final:
     update_filesize(bdb);
-    CS_END(&bdb->critical_section);
+    return result;
+}
+
+/* リーフのフレームにキーを挿入します。
+   挿入後のリーフがページに収まらず分割が必要な場合は挿入を取り消して
+   ゼロを返します。プレフィックス圧縮されたリーフも挿入後のキー配列で
+   サイズを求めるため、共通のプレフィックスが変わる場合も判定できます。*/
+static int insert_in_frame(struct bdb_t* bdb,
+                           struct leaf_cache_t* lc,
+                           struct bdb_slot_t* slot,
+                           const void* key,
+                           int keysize,
+                           const void* val,
+                           int valsize)
+{
+    int nodesize;
+    int64 vptr;
+    struct bdb_leaf_key_t inskey;
+
+    make_leaf_key(bdb, key, keysize, 0, val, valsize, &inskey);
+    if (leaf_frame_store_key(bdb, lc, &inskey) < 0)
+        return -1;
+    if (insert_leaf_slot(bdb, &lc->leaf, lc->keydata, slot, &inskey) < 0)
+        return -1;
+
+    nodesize = BDB_LEAF_SIZE + leaf_sizeof_keybuf(bdb,
+                                                  &lc->leaf,
+                                                  lc->leaf.keynum,
+                                                  lc->keydata,
+                                                  0);
+    if (nodesize > bdb->node_pgsize) {
+        /* アリーナに複写したキーは次に領域を確保するときに回収されます。*/
+        remove_leaf_slot(&lc->leaf, lc->keydata, slot->index);
+        return 0;
+    }
+
+    if (! bdb->datapack_flag) {
+        /* value を書き出します。*/
+        vptr = add_value(bdb, val, valsize, 0, 0);
+        if (vptr < 0) {
+            remove_leaf_slot(&lc->leaf, lc->keydata, slot->index);
+            return -1;
+        }
+        lc->keydata[slot->index].value.u.dp.v_ptr = vptr;
+    }
+    return 1;
+}
+
+/* 木の共有ロックの中でリーフを排他ラッチしてキーと値を設定します。
+   ブランチノードを変更しない更新だけを処理するため、
+   異なるリーフへの更新は並行に処理されます。
+   更新したリーフはフレームに残して遅延書き込みします。
+   処理した場合は 1、木の排他ロックで処理する必要がある場合はゼロを返します。
+   エラーの場合は -1 を返します。*/
+static int put_in_leaf(struct bdb_t* bdb, const void* key, int keysize, const void* val, int valsize)
+{
+    int64 leaf_ptr;
+    struct leaf_cache_t* lc;
+    struct bdb_slot_t slot;
+    int status;
+    int result = 0;
+    int update = 0;
+
+    /* スナップショットの複写と重複キーのリンクは排他ロックで処理します。*/
+    if (bdb->snapshots != NULL || bdb->dupkey_flag)
+        return 0;
+    if (bdb->datapack_flag && valsize > BDB_PACK_DATASIZE)
+        return 0;
+
+    leaf_ptr = find_leaf(bdb, key, keysize);
+    if (leaf_ptr <= 0)
+        return (leaf_ptr < 0)? -1 : 0;
+
+    latch_leaf(bdb, leaf_ptr, LOCK_WRITE);
+    /* 更新したリーフを遅延書き込みするためバッファプールのフレームを使用します。*/
+    lc = leaf_frame_fix(bdb, leaf_ptr, 0);
+    if (lc == NULL) {
+        unlatch_leaf(bdb, leaf_ptr, LOCK_WRITE);
+        return 0;
+    }
+
+    status = search_leaf(bdb, &lc->leaf, lc->keydata, key, keysize, &slot);
+    if (status == BDB_KEY_FOUND) {
+        if (bdb->datapack_flag) {
+            if (pack_value_fits(bdb, lc, &slot, valsize)) {
+                result = (leaf_frame_set_pack(bdb, lc, slot.index, val, valsize) < 0)? -1 : 1;
+                update = (result > 0);
+            }
+        } else {
+            int64 ptr;
+
+            /* 値を置換します。*/
+            ptr = update_key_value(bdb, val, valsize, &slot);
+            if (ptr < 0) {
+                result = -1;
+            } else {
+                if (ptr != slot.u.dp.v_ptr) {
+                    lc->keydata[slot.index].value.u.dp.v_ptr = ptr;
+                    update = 1;
+                }
+                result = 1;
+            }
+        }
+    } else if (status == BDB_KEY_NOTFOUND) {
+        /* キー数を持つ木は経路のキー数を更新するため排他ロックで処理します。*/
+        if (! bdb->count_flag) {
+            result = insert_in_frame(bdb, lc, &slot, key, keysize, val, valsize);
+            update = (result > 0);
+        }
+    } else {
+        result = -1;
+    }
+
+    CS_START(&bdb->pool_critical_section);
+    if (update)
+        lc->update = 1;
+    if (result > 0)
+        update_filesize(bdb);
+    CS_END(&bdb->pool_critical_section);
+
+    leaf_frame_release(bdb, lc);
+    unlatch_leaf(bdb, leaf_ptr, LOCK_WRITE);
     return result;
 }
 
 /*
- * データベースからキーを削除します。
- * 重複キーが許可されている場合はすべて削除されます。
- * 削除された領域は再利用されます。
+ * データベースにキーと値を設定します。
+ *
+ * 重複キーが許可されていない場合でキーがすでに存在している場合は
+ * 値が置換されます。
+ * プロパティ(NIO_CONCURRENT_READ)を指定してオープンした場合は、
+ * リーフを分割しない更新は木の共有ロックとリーフラッチで並行に処理されます。
  *
  * bdb: データベース構造体のポインタ
  * key: キーのポインタ
  * keysize: キーのサイズ
+ * val: 値のポインタ
+ * valsize: 値のサイズ
  *
  * 成功した場合はゼロを返します。
  * エラーの場合は -1 を返します。
  */
-int bdb_delete(struct bdb_t* bdb, const void* key, int keysize)
+int bdb_put(struct bdb_t* bdb, const void* key, int keysize, const void* val, int valsize)
+{
+    int result;
+
+    if (check_keysize(bdb, keysize, "bdb_put") < 0)
+        return -1;
+    if (bdb->shared_latch) {
+        lock_tree(bdb, LOCK_READ);
+        result = put_in_leaf(bdb, key, keysize, val, valsize);
+        unlock_tree(bdb, LOCK_READ);
+        if (result != 0)
+            return (result > 0)? 0 : -1;
+    }
+
+    lock_tree(bdb, LOCK_WRITE);
+    result = put_by_key(bdb, key, keysize, val, valsize);
+    unlock_tree(bdb, LOCK_WRITE);
+    return result;
+}
+
+static int delete_by_key(struct bdb_t* bdb, const void* key, int keysize)
 {
     int result = 0;
     int status;
     struct bdb_slot_t slot;
     int top_leaf_flag;
 
-    if (keysize > NIO_MAX_KEYSIZE) {
-        err_write("bdb_delete: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
+    if (check_keysize(bdb, keysize, "bdb_delete") < 0)
         return -1;
-    }
 
-    CS_START(&bdb->critical_section);
-    
     /* キーを検索します。*/
     status = search_key(bdb, key, keysize, &slot);
     if (status < 0) {
@@ -3807,6 +6284,12 @@ int bdb_delete(struct bdb_t* bdb, const void* key, int keysize)
     /* 削除対象のキーが先頭リーフか調べておきます。*/
     top_leaf_flag = (bdb->leaf_top_ptr == bdb->leaf_cache->leaf.node_ptr);
 
+    /* リーフまでの経路のキー数を更新します。*/
+    if (bt_count_key(bdb, key, keysize, -1) < 0) {
+        result = -1;
+        goto final;
+    }
+
     /* リーフからデータとキーを削除します。*/
     if (delete_leaf_slot(bdb, &slot) < 0) {
         err_write("bdb_delete: delete_leaf_slot() is fail.");
@@ -3832,13 +6315,15 @@ int bdb_delete(struct bdb_t* bdb, const void* key, int keysize)
         if (top_leaf_flag) {
             /* type1 */
             if (bdb->leaf_cache->leaf.next_ptr > 0) {
-                struct bdb_leaf_key_t kp;
+                uchar fkey[NIO_MAX_KEYSIZE];
+                int fksize;
 
-                if (get_first_leaf_key(bdb, bdb->leaf_cache->leaf.next_ptr, &kp) < 0) {
+                fksize = get_first_leaf_key(bdb, bdb->leaf_cache->leaf.next_ptr, fkey);
+                if (fksize < 0) {
                     result = -1;
                     goto final;
                 }
-                if (bt_delete_key(bdb, (const char*)kp.key, kp.keysize) < 0) {
+                if (bt_delete_key(bdb, (const char*)fkey, fksize) < 0) {
                     result = -1;
                     goto final;
                 }
@@ -3853,13 +6338,15 @@ int bdb_delete(struct bdb_t* bdb, const void* key, int keysize)
     } else {
         if (slot.index == 0 && (! top_leaf_flag)) {
             /* type3 */
-            struct bdb_leaf_key_t kp;
+            uchar fkey[NIO_MAX_KEYSIZE];
+            int fksize;
 
-            if (get_first_leaf_key(bdb, bdb->leaf_cache->leaf.node_ptr, &kp) < 0) {
+            fksize = get_first_leaf_key(bdb, bdb->leaf_cache->leaf.node_ptr, fkey);
+            if (fksize < 0) {
                 result = -1;
                 goto final;
             }
-            if (bt_update_key(bdb, key, keysize, kp.key, kp.keysize) < 0) {
+            if (bt_update_key(bdb, key, keysize, fkey, fksize) < 0) {
                 result = -1;
                 goto final;
             }
@@ -3868,195 +6355,2365 @@ int bdb_delete(struct bdb_t* bdb, const void* key, int keysize)
 
 final:
     update_filesize(bdb);
-    CS_END(&bdb->critical_section);
     return result;
 }
 
 /*
- * 関数内で確保された領域を開放します。
+ * データベースからキーを削除します。
+ * 重複キーが許可されている場合はすべて削除されます。
+ * 削除された領域は再利用されます。
+ *
+ * bdb: データベース構造体のポインタ
+ * key: キーのポインタ
+ * keysize: キーのサイズ
+ *
+ * 成功した場合はゼロを返します。
+ * エラーの場合は -1 を返します。
  */
-void bdb_free(const void* v)
+int bdb_delete(struct bdb_t* bdb, const void* key, int keysize)
 {
-    if (v) {
-        free((void*)v);
-    }
+    int result;
+
+    lock_tree(bdb, LOCK_WRITE);
+    result = delete_by_key(bdb, key, keysize);
+    unlock_tree(bdb, LOCK_WRITE);
+    return result;
 }
 
+/* batch operation */
+#define BATCH_GET       0
+#define BATCH_PUT       1
+#define BATCH_DELETE    2
 
-static int cursor_get_slot(struct dbcursor_t* cur, int index)
+static int batch_cmp(struct bdb_t* bdb, struct nio_batch_t* items, int n1, int n2)
 {
-    struct bdb_t* bdb;
-    struct bdb_leaf_key_t* kp;
+    int c;
 
-    bdb = cur->bdb;
-    cur->index = index;
-    cur->slot.index = cur->index;
-    if (cur->index >= bdb->leaf_cache->leaf.keynum)
+    c = key_cmp(bdb, items[n1].key, items[n1].keysize, items[n2].key, items[n2].keysize);
+    if (c == 0)
+        c = n1 - n2;    /* 同じキーは指定された順序で処理します。*/
+    return c;
+}
+
+static void batch_sort(struct bdb_t* bdb, struct nio_batch_t* items, int* order, int n)
+{
+    int gap, i, j;
+
+    /* 比較関数を使用するため shell sort で並べます。*/
+    for (gap = n / 2; gap > 0; gap /= 2) {
+        for (i = gap; i < n; i++) {
+            int t = order[i];
+
+            for (j = i; j >= gap && batch_cmp(bdb, items, order[j-gap], t) > 0; j -= gap)
+                order[j] = order[j-gap];
+            order[j] = t;
+        }
+    }
+}
+
+static int batch_exec(struct bdb_t* bdb, struct nio_batch_t* items, int count, int op)
+{
+    int* order;
+    int i;
+    int done = 0;
+    int mode;
+
+    if (count < 1)
         return 0;
 
-    kp = &bdb->leaf_cache->keydata[index];
+    order = (int*)malloc(sizeof(int) * count);
+    if (order == NULL) {
+        err_write("bdb: batch no memory.");
+        return -1;
+    }
+    for (i = 0; i < count; i++)
+        order[i] = i;
 
-    if (cur->bdb->datapack_flag) {
-        cur->slot.u.pp.valsize = kp->value.u.pp.valsize;
-        memcpy(cur->slot.u.pp.val, kp->value.u.pp.val, kp->value.u.pp.valsize);
-    } else {
-        cur->slot.u.dp.v_ptr = kp->value.u.dp.v_ptr;
-        if (read_value_header(cur->bdb, cur->slot.u.dp.v_ptr, &cur->slot.u.dp.v) < 0)
-            return -1;
+    /* キー順に並べて同じリーフのキーが連続してアクセスされるようにします。*/
+    batch_sort(bdb, items, order, count);
+
+    mode = (op == BATCH_GET)? LOCK_READ : LOCK_WRITE;
+    lock_tree(bdb, mode);
+    for (i = 0; i < count; i++) {
+        struct nio_batch_t* item;
+
+        item = &items[order[i]];
+        switch (op) {
+            case BATCH_GET:
+                item->result = get_by_key(bdb, item->key, item->keysize, item->val, item->valsize);
+                break;
+            case BATCH_PUT:
+                item->result = put_by_key(bdb, item->key, item->keysize, item->val, item->valsize);
+                break;
+            default:
+                item->result = delete_by_key(bdb, item->key, item->keysize);
+                break;
+        }
+        if (item->result >= 0)
+            done++;
+    }
+    unlock_tree(bdb, mode);
+
+    free(order);
+    return done;
+}
+
+/*
+ * データベースから複数のキーを検索して値を設定します。
+ * キーはキー順に並べられてロックを一度だけ取得して処理されます。
+ *
+ * 各要素の val と valsize には値の領域とそのサイズを設定しておきます。
+ * 各要素の result には bdb_get() と同じ値が設定されます。
+ *
+ * bdb: データベース構造体のポインタ
+ * items: バッチ要素の配列
+ * count: 要素数
+ *
+ * 値を取得できたキーの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int bdb_mget(struct bdb_t* bdb, struct nio_batch_t* items, int count)
+{
+    return batch_exec(bdb, items, count, BATCH_GET);
+}
+
+/*
+ * データベースに複数のキーと値を設定します。
+ * 同じキーが複数指定された場合は指定された順序で設定されます。
+ *
+ * 各要素の result には bdb_put() と同じ値が設定されます。
+ *
+ * bdb: データベース構造体のポインタ
+ * items: バッチ要素の配列
+ * count: 要素数
+ *
+ * 設定できたキーの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int bdb_mput(struct bdb_t* bdb, struct nio_batch_t* items, int count)
+{
+    return batch_exec(bdb, items, count, BATCH_PUT);
+}
+
+/*
+ * データベースから複数のキーを削除します。
+ *
+ * 各要素の result には bdb_delete() と同じ値が設定されます。
+ *
+ * bdb: データベース構造体のポインタ
+ * items: バッチ要素の配列
+ * count: 要素数
+ *
+ * 削除できたキーの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int bdb_mdelete(struct bdb_t* bdb, struct nio_batch_t* items, int count)
+{
+    return batch_exec(bdb, items, count, BATCH_DELETE);
+}
+
+/*
+ * キャッシュされているリーフの更新をファイルに書き出します。
+ *
+ * bdb: データベース構造体のポインタ
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+static int move_value(struct bdb_t* bdb,
+                      int64 ptr,
+                      int64 new_ptr,
+                      int areasize,
+                      struct bdb_value_t* v)
+{
+    struct bdb_value_t nv;
+    char* buf = NULL;
+
+    if (v->valsize > 0) {
+        buf = (char*)malloc(v->valsize);
+        if (buf == NULL) {
+            err_write("bdb_compact: no memory.");
+            return -1;
+        }
+        mmap_seek(bdb->nio->mmap, ptr+BDB_VALUE_SIZE);
+        if (mmap_read(bdb->nio->mmap, buf, v->valsize) != v->valsize) {
+            err_write("bdb_compact: can't read value, ptr=%lld", ptr);
+            free(buf);
+            return -1;
+        }
+    }
+
+    /* 新しい領域に書き出します。*/
+    nv = *v;
+    nv.areasize = areasize;
+    if (write_value(bdb, new_ptr, &nv, buf) < 0) {
+        err_write("bdb_compact: can't write value, ptr=%lld", new_ptr);
+        if (buf)
+            free(buf);
+        return -1;
+    }
+    if (buf)
+        free(buf);
+    return 0;
+}
+
+static int set_value_link(struct bdb_t* bdb, int64 ptr, int64 next_ptr, int64 prev_ptr)
+{
+    struct bdb_value_t v;
+
+    if (read_value_header(bdb, ptr, &v) < 0)
+        return -1;
+    if (next_ptr >= 0)
+        v.next_ptr = next_ptr;
+    if (prev_ptr >= 0)
+        v.prev_ptr = prev_ptr;
+    return write_value_header(bdb, ptr, &v);
+}
+
+/* データパック以外で使用
+   先頭の値を移動した場合は元の領域を開放せずに old_ptr と old_size に設定します。
+   元の領域はリーフに新しい位置を書き出してから開放します。*/
+static int compact_value(struct bdb_t* bdb, int64* v_ptr, int64* old_ptr, int* old_size)
+{
+    int64 ptr, prev = 0;
+
+    *old_ptr = 0;
+    ptr = *v_ptr;
+    while (ptr > 0) {
+        struct bdb_value_t v;
+        int rsize, areasize;
+        int64 new_ptr;
+
+        if (read_value_header(bdb, ptr, &v) < 0)
+            return -1;
+        rsize = BDB_VALUE_SIZE + v.valsize;
+        if (bdb->align_bytes > 0) {
+            if (rsize % bdb->align_bytes)
+                rsize = (rsize / bdb->align_bytes + 1) * bdb->align_bytes;
+        }
+
+        /* 境界より後ろにある値は前の空き領域に移動します。*/
+        new_ptr = nio_compact_space(bdb->nio, rsize, &areasize, bdb->filling_rate, ptr);
+        if (new_ptr > 0) {
+            if (move_value(bdb, ptr, new_ptr, areasize, &v) < 0)
+                return -1;
+            /* 重複キーのリンクをつなぎ変えます。*/
+            if (prev == 0) {
+                *v_ptr = new_ptr;
+            } else {
+                if (set_value_link(bdb, prev, new_ptr, -1) < 0)
+                    return -1;
+            }
+            if (v.next_ptr > 0) {
+                if (set_value_link(bdb, v.next_ptr, -1, new_ptr) < 0)
+                    return -1;
+            }
+            if (prev == 0) {
+                *old_ptr = ptr;
+                *old_size = v.areasize;
+            } else {
+                if (free_space(bdb, ptr, v.areasize) < 0)
+                    return -1;
+            }
+            prev = new_ptr;
+        } else {
+            prev = ptr;
+        }
+        ptr = v.next_ptr;
+    }
+    return 0;
+}
+
+/* リーフキャッシュのキーの値を移動します。
+   移動した値の元の領域はリーフを書き出してから開放します。*/
+static int compact_leaf_values(struct bdb_t* bdb)
+{
+    struct leaf_cache_t* lc;
+    int64* old_ptr;
+    int* old_size;
+    int k;
+    int result = -1;
+
+    lc = bdb->leaf_cache;
+    if (lc->leaf.keynum < 1)
+        return 0;
+    old_ptr = (int64*)malloc(sizeof(int64) * lc->leaf.keynum);
+    old_size = (int*)malloc(sizeof(int) * lc->leaf.keynum);
+    if (old_ptr == NULL || old_size == NULL) {
+        err_write("bdb_compact: no memory.");
+        goto final;
+    }
+
+    for (k = 0; k < lc->leaf.keynum; k++) {
+        if (compact_value(bdb, &lc->keydata[k].value.u.dp.v_ptr, &old_ptr[k], &old_size[k]) < 0)
+            goto final;
+        if (old_ptr[k] > 0)
+            lc->update = 1;
+    }
+
+    /* 新しい位置を書き出してから元の領域を開放します。*/
+    if (leaf_frame_flush(bdb, lc) < 0)
+        goto final;
+    for (k = 0; k < lc->leaf.keynum; k++) {
+        if (old_ptr[k] > 0) {
+            if (free_space(bdb, old_ptr[k], old_size[k]) < 0)
+                goto final;
+        }
+    }
+    result = 0;
+
+final:
+    if (old_ptr)
+        free(old_ptr);
+    if (old_size)
+        free(old_size);
+    return result;
+}
+
+/* リーフキャッシュのリーフに次のリーフのキーを連結します。
+   連結したリーフが充填率の空きを残して収まる場合だけ連結して
+   次のリーフを削除します。ブランチのキーは削除(type2)と同様に更新されます。
+   連結した場合は 1 を返します。
+   連結しない場合はゼロを返します。エラーの場合は -1 を返します。*/
+static int merge_leaf(struct bdb_t* bdb)
+{
+    struct leaf_cache_t* lc;
+    struct leaf_cache_t* rc;
+    struct bdb_leaf_t r_leaf;
+    struct bdb_leaf_key_t* r_keydata;
+    uchar rkey[NIO_MAX_KEYSIZE];
+    uchar lkey[NIO_MAX_KEYSIZE];
+    int rksize, lksize;
+    int keynum, limit, i;
+    int result = -1;
+
+    /* 重複キーは同じキーが複数のリーフにまたがるため連結しません。*/
+    if (bdb->dupkey_flag)
+        return 0;
+    lc = bdb->leaf_cache;
+    if (leaf_frame_flush(bdb, lc) < 0)
+        return -1;
+    if (lc->leaf.keynum < 1 || lc->leaf.next_ptr <= 0)
+        return 0;
+    if (get_leaf(bdb, lc->leaf.next_ptr, &r_leaf) < 0)
+        return -1;
+    if (r_leaf.keynum < 1 || r_leaf.flag != lc->leaf.flag)
+        return 0;
+
+    limit = bdb->node_pgsize - bdb->node_pgsize * bdb->filling_rate / 100;
+    if (lc->leaf.nodesize + r_leaf.nodesize - BDB_LEAF_SIZE > limit)
+        return 0;
+
+    if (get_leaf_keybuf(bdb, &r_leaf, bdb->leaf_buf) < 0)
+        return -1;
+    r_keydata = leaf_get_keydata(bdb, &r_leaf, bdb->leaf_buf, r_leaf.keynum);
+    if (r_keydata == NULL) {
+        err_write("bdb_compact: no memory.");
+        return -1;
+    }
+
+    /* 次のリーフのキーを最後に追加します。*/
+    keynum = lc->leaf.keynum;
+    for (i = 0; i < r_leaf.keynum; i++) {
+        struct bdb_leaf_key_t kd;
+
+        kd = r_keydata[i];
+        if (leaf_frame_store_key(bdb, lc, &kd) < 0) {
+            lc->leaf.keynum = keynum;
+            goto final;
+        }
+        lc->keydata[lc->leaf.keynum++] = kd;
+    }
+    if (BDB_LEAF_SIZE + leaf_sizeof_keybuf(bdb, &lc->leaf, lc->leaf.keynum, lc->keydata, 0) > limit) {
+        /* プレフィックス圧縮で収まらない場合は元に戻します。*/
+        lc->leaf.keynum = keynum;
+        result = 0;
+        goto final;
+    }
+
+    rksize = r_keydata[0].keysize;
+    memcpy(rkey, r_keydata[0].key, rksize);
+    lksize = lc->keydata[0].keysize;
+    memcpy(lkey, lc->keydata[0].key, lksize);
+
+    /* 次のリーフまでの経路のキー数を減らします。*/
+    if (bt_count_key(bdb, rkey, rksize, -r_leaf.keynum) < 0)
+        goto final;
+
+    /* 連結したリーフを書き出してから次のリーフを削除します。*/
+    lc->update = 1;
+    if (leaf_frame_flush(bdb, lc) < 0)
+        goto final;
+    rc = leaf_frame_find(bdb, r_leaf.node_ptr);
+    if (rc != NULL)
+        leaf_frame_discard(bdb, rc);
+    if (delete_leaf(bdb, &r_leaf) < 0)
+        goto final;
+    if (bt_delete_key(bdb, (const char*)rkey, rksize) < 0)
+        goto final;
+
+    /* 移したキー数をこのリーフまでの経路に加えます。*/
+    if (bt_count_key(bdb, lkey, lksize, r_leaf.keynum) < 0)
+        goto final;
+    result = 1;
+
+final:
+    free(r_keydata);
+    return result;
+}
+
+/* リーフの親ノードを返します。見つからない場合はゼロを返します。*/
+static int64 find_leaf_parent(struct bdb_t* bdb,
+                              const void* key,
+                              int keysize,
+                              int64 leaf_ptr,
+                              char* buf)
+{
+    int64 ptr;
+
+    ptr = bdb->root_ptr;
+    while (ptr > 0) {
+        int64 child_ptr;
+        int keyoff, right_flag;
+
+        if (read_node(bdb, ptr, buf) < 0)
+            return -1;   /* error */
+        if (bt_search_child(bdb, buf, leaf_ptr, &keyoff, &right_flag) > 0)
+            return ptr;
+
+        bt_search_node(bdb, buf, key, keysize, &child_ptr, NULL);
+        if (is_leaf(bdb, child_ptr))
+            break;
+        ptr = child_ptr;
+    }
+    return 0;
+}
+
+/* リーフキャッシュのリーフを移動します。*/
+static int compact_leaf(struct bdb_t* bdb)
+{
+    struct leaf_cache_t* lc;
+    struct bdb_leaf_t s_leaf;
+    int64 ptr, p_ptr = 0;
+    int64 new_ptr;
+    char* buf;
+    char* pbuf;
+
+    lc = bdb->leaf_cache;
+    if (leaf_frame_flush(bdb, lc) < 0)
+        return -1;
+    if (lc->leaf.keynum < 1)
+        return 0;
+    ptr = lc->leaf.node_ptr;
+
+    pbuf = (char*)alloca(bdb->node_pgsize);
+    if (bdb->root_ptr != 0) {
+        /* 重複キーで親ノードが見つからないリーフは移動しません。*/
+        p_ptr = find_leaf_parent(bdb, lc->keydata[0].key, lc->keydata[0].keysize, ptr, pbuf);
+        if (p_ptr <= 0)
+            return (int)p_ptr;
+    }
+
+    new_ptr = nio_compact_space(bdb->nio, bdb->node_pgsize, NULL, bdb->filling_rate, ptr);
+    if (new_ptr < 0)
+        return 0;
+
+    /* リーフを新しい領域に複写します。*/
+    buf = (char*)alloca(bdb->node_pgsize);
+    if (read_node(bdb, ptr, buf) < 0)
+        return -1;
+    if (write_node(bdb, new_ptr, buf) < 0)
+        return -1;
+
+    /* 親ノードのポインタを書き換えます。*/
+    if (p_ptr > 0) {
+        bt_replace_child(bdb, pbuf, ptr, new_ptr);
+        if (write_node(bdb, p_ptr, pbuf) < 0)
+            return -1;
+    }
+
+    /* リーフをつなぎ変えます。*/
+    if (lc->leaf.prev_ptr > 0) {
+        if (get_leaf(bdb, lc->leaf.prev_ptr, &s_leaf) < 0)
+            return -1;
+        s_leaf.next_ptr = new_ptr;
+        if (update_leaf(bdb, s_leaf.node_ptr, &s_leaf) < 0)
+            return -1;
+    }
+    if (lc->leaf.next_ptr > 0) {
+        if (get_leaf(bdb, lc->leaf.next_ptr, &s_leaf) < 0)
+            return -1;
+        s_leaf.prev_ptr = new_ptr;
+        if (update_leaf(bdb, s_leaf.node_ptr, &s_leaf) < 0)
+            return -1;
+    }
+    if (bdb->leaf_top_ptr == ptr) {
+        if (put_leaf_top(bdb, new_ptr) < 0)
+            return -1;
+    }
+    if (bdb->leaf_bot_ptr == ptr) {
+        if (put_leaf_bot(bdb, new_ptr) < 0)
+            return -1;
+    }
+
+    /* 元のリーフ領域を開放します。*/
+    if (free_space(bdb, ptr, bdb->node_pgsize) < 0)
+        return -1;
+    leaf_frame_unlink(bdb, lc);
+    lc->leaf.node_ptr = new_ptr;
+    leaf_frame_link(bdb, lc);
+    return 0;
+}
+
+/*
+ * データベースファイルを圧縮します。
+ * 前回の続きのリーフから nleaves 個のリーフとデータを
+ * ファイルの先頭に近い空き領域に移動します。
+ * 連結しても充填率の空きが残るリーフは次のリーフと連結されます。
+ * 移動したデータの元の領域は新しい位置を書き出してから開放されます。
+ * nleaves がゼロ以下の場合は最後のリーフまで処理します。
+ *
+ * カーソルはリーフの位置を保持しているため、
+ * カーソルがオープンされている間は何も処理されません。
+ * ブランチノードは移動されません。
+ *
+ * nio_compact() から呼び出されます。
+ *
+ * bdb: B+木データベース構造体のポインタ
+ * nleaves: 処理するリーフ数
+ *
+ * 残りのリーフがある場合は 1 を返します。
+ * 最後のリーフまで処理した場合はゼロを返します。
+ * エラーの場合は -1 を返します。
+ */
+int bdb_compact(struct bdb_t* bdb, int nleaves)
+{
+    struct leaf_cache_t* lc;
+    int64 ptr;
+    int i, n;
+    int result = 1;
+
+    lock_tree(bdb, LOCK_WRITE);
+    if (bdb->cursor_num > 0)
+        goto final;
+
+    if (bdb->compact_keysize == 0) {
+        ptr = bdb->leaf_top_ptr;
+    } else {
+        /* 前回の最後のキーを含むリーフから再開します。*/
+        ptr = find_leaf(bdb, bdb->compact_key, bdb->compact_keysize);
+        if (ptr > 0) {
+            if (leaf_cache_get(bdb, ptr) < 0) {
+                result = -1;
+                goto final;
+            }
+            lc = bdb->leaf_cache;
+            /* 処理済みのリーフは読み飛ばします。*/
+            if (lc->leaf.keynum < 1 ||
+                leaf_key_cmp(bdb, (char*)bdb->compact_key, bdb->compact_keysize,
+                             &lc->keydata[lc->leaf.keynum-1]) >= 0)
+                ptr = lc->leaf.next_ptr;
+        }
+    }
+
+    for (i = 0; ptr > 0 && (nleaves <= 0 || i < nleaves); i++) {
+        if (leaf_cache_get(bdb, ptr) < 0) {
+            result = -1;
+            goto final;
+        }
+        lc = bdb->leaf_cache;
+
+        /* 充填率の低いリーフは次のリーフと連結します。*/
+        while ((n = merge_leaf(bdb)) > 0)
+            ;
+        if (n < 0) {
+            result = -1;
+            goto final;
+        }
+
+        if (! bdb->datapack_flag) {
+            if (compact_leaf_values(bdb) < 0) {
+                result = -1;
+                goto final;
+            }
+        }
+
+        /* 次はこのリーフの最後のキーの続きから処理します。*/
+        if (lc->leaf.keynum > 0) {
+            bdb->compact_keysize = lc->keydata[lc->leaf.keynum-1].keysize;
+            memcpy(bdb->compact_key, lc->keydata[lc->leaf.keynum-1].key, bdb->compact_keysize);
+        }
+
+        if (compact_leaf(bdb) < 0) {
+            result = -1;
+            goto final;
+        }
+        ptr = lc->leaf.next_ptr;
+    }
+    if (ptr == 0) {
+        bdb->compact_keysize = 0;
+        result = 0;
+    }
+
+final:
+    unlock_tree(bdb, LOCK_WRITE);
+    return result;
+}
+
+/* 一括作成でノードに詰めるサイズを返します。
+   充填率の分は後から挿入されるキーのために空けておきます。*/
+static int bulk_fill_limit(struct bdb_t* bdb)
+{
+    int limit;
+
+    limit = bdb->node_pgsize - bdb->node_pgsize * bdb->filling_rate / 100;
+    if (limit > bdb->node_pgsize - 64)
+        limit = bdb->node_pgsize - 64;
+    return limit;
+}
+
+/* ブランチノードに詰めるサイズを返します。
+   削除時の連結と再配分のために半分以上は詰めておきます。*/
+static int bulk_branch_limit(struct bdb_t* bdb)
+{
+    int limit;
+
+    limit = bulk_fill_limit(bdb);
+    if (limit <= bdb->node_pgsize / 2)
+        limit = bdb->node_pgsize / 2 + 1;
+    return limit;
+}
+
+/* 子のポインタをひとつだけ持つノードを編集します。*/
+static void bulk_node_init(struct bdb_t* bdb, char* buf, int64 ptr, int64 count)
+{
+    memset(buf, '\0', bdb->node_pgsize);
+    set_node_id(buf);
+    set_node_keynum(buf, 0);
+    set_node_size(buf, BDB_NODE_KEY_OFFSET + bdb->node_ptrsize);
+    memcpy(buf + BDB_NODE_KEY_OFFSET, &ptr, sizeof(int64));
+    bt_put_count(bdb, buf + BDB_NODE_KEY_OFFSET, count);
+}
+
+static int bulk_level_push(struct bdb_t* bdb,
+                           struct bdb_bulk_level_t* levels,
+                           int lv,
+                           const void* key,
+                           int keysize,
+                           int64 ptr,
+                           int64 count);
+
+/* ノードを書き出して上のレベルに追加します。*/
+static int bulk_node_write(struct bdb_t* bdb,
+                           struct bdb_bulk_level_t* levels,
+                           int lv,
+                           char* buf,
+                           const void* sep,
+                           int sepsize)
+{
+    int64 ptr;
+
+    ptr = avail_space(bdb, bdb->node_pgsize, NULL);
+    if (ptr < 0)
+        return -1;
+    if (write_node(bdb, ptr, buf) < 0)
+        return -1;
+    return bulk_level_push(bdb, levels, lv+1, sep, sepsize, ptr, bt_node_count(bdb, buf));
+}
+
+/* レベル lv のノードに子のポインタを追加します。
+   keysize が -1 の場合はレベルの最も左の子になります。
+   ノードが一杯になった場合は前のノードを書き出して新しいノードを始めます。
+   最後のノードの調整のために一杯になったノードはひとつ遅れて書き出されます。*/
+static int bulk_level_push(struct bdb_t* bdb,
+                           struct bdb_bulk_level_t* levels,
+                           int lv,
+                           const void* key,
+                           int keysize,
+                           int64 ptr,
+                           int64 count)
+{
+    struct bdb_bulk_level_t* lp;
+    int nsize;
+    int n;
+    int used;
+    char* p;
+
+    if (lv >= BDB_BULK_MAX_LEVEL) {
+        err_write("bdb_bulk_load: tree is too high.");
+        return -1;
+    }
+
+    lp = &levels[lv];
+    if (lp->cur == NULL) {
+        lp->cur = (char*)malloc(bdb->node_pgsize);
+        lp->prev = (char*)malloc(bdb->node_pgsize);
+        if (lp->cur == NULL || lp->prev == NULL) {
+            err_write("bdb_bulk_load: no memory.");
+            return -1;
+        }
+        bulk_node_init(bdb, lp->cur, ptr, count);
+        lp->cur_sepsize = keysize;
+        if (keysize > 0)
+            memcpy(lp->cur_sep, key, keysize);
+        return 0;
+    }
+
+    nsize = get_node_size(lp->cur);
+    n = sizeof(ushort) + keysize + bdb->node_ptrsize;
+    used = nsize + n + node_slots_size(bdb, get_node_keynum(lp->cur) + 1);
+    if ((get_node_keynum(lp->cur) == 0 && used <= bdb->node_pgsize) ||
+        used <= bulk_branch_limit(bdb)) {
+        bt_set_key(bdb, lp->cur + nsize, key, keysize, ptr, count);
+        set_node_size(lp->cur, nsize + n);
+        set_node_keynum(lp->cur, get_node_keynum(lp->cur) + 1);
+        return 0;
+    }
+
+    if (lp->prev_used) {
+        if (bulk_node_write(bdb, levels, lv, lp->prev, lp->prev_sep, lp->prev_sepsize) < 0)
+            return -1;
+    }
+    p = lp->prev;
+    lp->prev = lp->cur;
+    lp->cur = p;
+    lp->prev_sepsize = lp->cur_sepsize;
+    if (lp->cur_sepsize > 0)
+        memcpy(lp->prev_sep, lp->cur_sep, lp->cur_sepsize);
+    lp->prev_used = 1;
+
+    bulk_node_init(bdb, lp->cur, ptr, count);
+    lp->cur_sepsize = keysize;
+    memcpy(lp->cur_sep, key, keysize);
+    return 0;
+}
+
+/* レベルの最後の２つのノードのキーを均等に再配分します。
+   ひとつのノードに収まる場合は前のノードに統合してゼロを返します。*/
+static int bulk_node_balance(struct bdb_t* bdb, struct bdb_bulk_level_t* lp)
+{
+    char* w_buf;
+    char* wp;
+    char* midp;
+    int w_nsize;
+    int nsize;
+    int lnum;
+    int rnum;
+    ushort ksize;
+
+    /* 前のノード、最後のノードの区切りキー、最後のノードの順に連結します。*/
+    w_buf = (char*)alloca(bdb->node_pgsize * 2);
+    nsize = get_node_size(lp->prev);
+    memcpy(w_buf, lp->prev, nsize);
+    wp = w_buf + nsize;
+    ksize = (ushort)lp->cur_sepsize;
+    memcpy(wp, &ksize, sizeof(ushort));
+    wp += sizeof(ushort);
+    memcpy(wp, lp->cur_sep, ksize);
+    wp += ksize;
+    nsize = get_node_size(lp->cur) - BDB_NODE_SIZE;
+    memcpy(wp, lp->cur + BDB_NODE_SIZE, nsize);
+    wp += nsize;
+    w_nsize = (int)(wp - w_buf);
+
+    midp = bt_center_key(bdb, w_buf, w_nsize, &lnum, &rnum);
+    if (rnum < 1) {
+        if (w_nsize > bdb->node_pgsize) {
+            err_write("bdb_bulk_load: key is too large for pagesize.");
+            return -1;
+        }
+        memcpy(lp->prev, w_buf, w_nsize);
+        set_node_size(lp->prev, w_nsize);
+        set_node_keynum(lp->prev, lnum + 1);
+        return 0;
+    }
+
+    /* 前半を前のノードへ移します。*/
+    nsize = (int)(midp - (w_buf + BDB_NODE_SIZE));
+    memset(lp->prev + BDB_NODE_SIZE, '\0', bdb->node_pgsize - BDB_NODE_SIZE);
+    memcpy(lp->prev + BDB_NODE_SIZE, w_buf + BDB_NODE_SIZE, nsize);
+    set_node_size(lp->prev, BDB_NODE_SIZE + nsize);
+    set_node_keynum(lp->prev, lnum);
+
+    /* 中心のキーを最後のノードの区切りキーにします。*/
+    memcpy(&ksize, midp, sizeof(ushort));
+    midp += sizeof(ushort);
+    memcpy(lp->cur_sep, midp, ksize);
+    lp->cur_sepsize = ksize;
+    midp += ksize;
+
+    /* 後半を最後のノードへ移します。*/
+    nsize = (int)(wp - midp);
+    memset(lp->cur + BDB_NODE_SIZE, '\0', bdb->node_pgsize - BDB_NODE_SIZE);
+    memcpy(lp->cur + BDB_NODE_SIZE, midp, nsize);
+    set_node_size(lp->cur, BDB_NODE_SIZE + nsize);
+    set_node_keynum(lp->cur, rnum);
+    return 1;
+}
+
+/* 残っているノードを下のレベルから書き出してルートのポインタを返します。
+   リーフだけの場合はゼロを返します。*/
+static int64 bulk_level_flush(struct bdb_t* bdb, struct bdb_bulk_level_t* levels)
+{
+    int lv;
+
+    for (lv = 0; lv < BDB_BULK_MAX_LEVEL && levels[lv].cur != NULL; lv++) {
+        struct bdb_bulk_level_t* lp;
+        int status = 1;
+
+        lp = &levels[lv];
+        if (get_node_keynum(lp->cur) == 0 && ! lp->prev_used) {
+            int64 ptr;
+
+            /* 子がひとつだけのレベルはその子がルートになります。*/
+            memcpy(&ptr, lp->cur + BDB_NODE_KEY_OFFSET, sizeof(int64));
+            return (lv == 0)? 0 : ptr;
+        }
+        if (lp->prev_used && get_node_size(lp->cur) < bdb->node_pgsize / 2) {
+            /* 最後のノードが過疎状態にならないようにします。*/
+            status = bulk_node_balance(bdb, lp);
+            if (status < 0)
+                return -1;
+        }
+        if (lp->prev_used) {
+            if (bulk_node_write(bdb, levels, lv, lp->prev, lp->prev_sep, lp->prev_sepsize) < 0)
+                return -1;
+            lp->prev_used = 0;
+        }
+        if (status) {
+            if (bulk_node_write(bdb, levels, lv, lp->cur, lp->cur_sep, lp->cur_sepsize) < 0)
+                return -1;
+        }
+    }
+    err_write("bdb_bulk_load: tree is too high.");
+    return -1;
+}
+
+static int bulk_leaf_write(struct bdb_t* bdb,
+                           struct bdb_leaf_t* leaf,
+                           struct bdb_leaf_key_t* keydata,
+                           int64 ptr,
+                           int64 prev_ptr,
+                           int64 next_ptr)
+{
+    char* buf;
+    int size;
+
+    buf = (char*)alloca(bdb->node_pgsize);
+    memset(buf, '\0', bdb->node_pgsize);
+
+    set_leaf_id(buf);
+    set_leaf_keynum(buf, leaf->keynum);
+    set_leaf_flag(buf, leaf->flag);
+    set_leaf_nextptr(buf, next_ptr);
+    set_leaf_prevptr(buf, prev_ptr);
+
+    size = leaf_put_keydata(bdb, leaf, keydata, buf+BDB_LEAF_SIZE);
+    set_leaf_size(buf, BDB_LEAF_SIZE+size);
+    return write_node(bdb, ptr, buf);
+}
+
+/*
+ * キー順に並んだキーと値から空のデータベースを一括で作成します。
+ * リーフにはキーを充填率(NIO_FILLING_RATE)の分を空けて詰め込み、
+ * ブランチノードはリーフから上のレベルへ順に作成します。
+ * ノードとデータはファイルの先頭から順に書き出されます。
+ * 作成されたデータベースは通常のデータベースとして更新できます。
+ *
+ * キーと値は func を呼び出して取得します。func は item の key, keysize,
+ * val, valsize を設定して 1 を、終わりの場合はゼロを、エラーの場合は
+ * -1 を返します。設定された領域は次に func が呼び出されるまで参照されます。
+ * func の中からこのデータベースの関数を呼び出すことはできません。
+ *
+ * キーは昇順に並んでいる必要があります。重複キーが許可されている場合は
+ * 同じキーの値は順にリンクされます。
+ * エラーになった場合のデータベースは作成し直す必要があります。
+ *
+ * bdb: データベースオブジェクトのポインタ
+ * func: キーと値を取得する関数のポインタ
+ * arg: 関数に渡される引数
+ *
+ * 格納したキーと値の数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int bdb_bulk_load(struct bdb_t* bdb, BULK_READ_FUNCPTR func, void* arg)
+{
+    struct bdb_bulk_level_t* levels = NULL;
+    struct leaf_cache_t lc;
+    struct bdb_leaf_t* leaf = &lc.leaf;
+    struct nio_batch_t item;
+    int leafsize = BDB_LEAF_SIZE;
+    int limit;
+    int64 top_ptr = 0;
+    int64 leaf_ptr = 0;
+    int64 prev_ptr = 0;
+    int64 last_vptr = 0;
+    int64 root_ptr;
+    int count = 0;
+    int result = -1;
+    int status;
+    int i;
+
+    memset(&lc, '\0', sizeof(struct leaf_cache_t));
+    lock_tree(bdb, LOCK_WRITE);
+
+    if (bdb->root_ptr != 0 || bdb->leaf_top_ptr != 0) {
+        err_write("bdb_bulk_load: database is not empty.");
+        goto final;
+    }
+    levels = (struct bdb_bulk_level_t*)calloc(BDB_BULK_MAX_LEVEL, sizeof(struct bdb_bulk_level_t));
+    if (levels == NULL) {
+        err_write("bdb_bulk_load: no memory.");
+        goto final;
+    }
+
+    if (bdb->prefix_compress_flag)
+        leaf->flag = PREFIX_COMPRESS_NODE;
+    limit = bulk_fill_limit(bdb);
+
+    while ((status = (*func)(arg, &item)) > 0) {
+        struct bdb_leaf_key_t* kp;
+        struct bdb_leaf_key_t inskey;
+        int64 vptr = 0;
+        int ksize;
+
+        if (item.keysize < 1 || item.keysize > NIO_MAX_KEYSIZE) {
+            err_write("bdb_bulk_load: keysize is invalid, less than %d bytes.", NIO_MAX_KEYSIZE);
+            goto final;
+        }
+        if (check_keysize(bdb, item.keysize, "bdb_bulk_load") < 0)
+            goto final;
+        if (bdb->datapack_flag && item.valsize > BDB_PACK_DATASIZE) {
+            err_write("bdb_bulk_load: valsize is too large, less than %d bytes.", BDB_PACK_DATASIZE);
+            goto final;
+        }
+
+        if (leaf->keynum > 0) {
+            int c;
+
+            kp = &lc.keydata[leaf->keynum-1];
+            c = leaf_key_cmp(bdb, item.key, item.keysize, kp);
+            if (c < 0 || (c == 0 && ! bdb->dupkey_flag)) {
+                err_write("bdb_bulk_load: keys are not in ascending order.");
+                goto final;
+            }
+            if (c == 0) {
+                /* 重複キーの値は前の値にリンクします。*/
+                vptr = add_value(bdb, item.val, item.valsize, last_vptr, 0);
+                if (vptr < 0)
+                    goto final;
+                if (set_value_link(bdb, last_vptr, vptr, -1) < 0)
+                    goto final;
+                last_vptr = vptr;
+                count++;
+                continue;
+            }
+        }
+
+        if (! bdb->datapack_flag) {
+            /* value を書き出します。*/
+            vptr = add_value(bdb, item.val, item.valsize, 0, 0);
+            if (vptr < 0)
+                goto final;
+            last_vptr = vptr;
+        }
+
+        /* キーと値は次に func を呼び出すまでにアリーナへ複写します。*/
+        make_leaf_key(bdb, item.key, item.keysize, vptr, item.val, item.valsize, &inskey);
+        if (leaf_frame_store_key(bdb, &lc, &inskey) < 0)
+            goto final;
+        kp = &lc.keydata[leaf->keynum];
+        *kp = inskey;
+        ksize = leaf_sizeof_keybuf(bdb, leaf, leaf->keynum+1, lc.keydata, leaf->keynum);
+
+        if (leaf->keynum > 0 && leafsize + ksize > limit) {
+            int64 next_ptr;
+
+            /* リーフを書き出してキーを次のリーフに移します。*/
+            next_ptr = avail_space(bdb, bdb->node_pgsize, NULL);
+            if (next_ptr < 0)
+                goto final;
+            if (bulk_leaf_write(bdb, leaf, lc.keydata, leaf_ptr, prev_ptr, next_ptr) < 0)
+                goto final;
+            if (prev_ptr == 0)
+                status = bulk_level_push(bdb, levels, 0, NULL, -1, leaf_ptr, leaf->keynum);
+            else
+                status = bulk_level_push(bdb, levels, 0, lc.keydata[0].key, lc.keydata[0].keysize, leaf_ptr, leaf->keynum);
+            if (status < 0)
+                goto final;
+
+            lc.keydata[0] = *kp;
+            leaf->keynum = 0;
+            leafsize = BDB_LEAF_SIZE;
+            ksize = leaf_sizeof_keybuf(bdb, leaf, 1, lc.keydata, 0);
+            prev_ptr = leaf_ptr;
+            leaf_ptr = next_ptr;
+        }
+        if (leaf_ptr == 0) {
+            /* 最初のリーフ */
+            leaf_ptr = avail_space(bdb, bdb->node_pgsize, NULL);
+            if (leaf_ptr < 0)
+                goto final;
+            top_ptr = leaf_ptr;
+        }
+        leaf->keynum++;
+        leafsize += ksize;
+        count++;
+    }
+    if (status < 0)
+        goto final;
+
+    if (leaf->keynum > 0) {
+        /* 最後のリーフを書き出してブランチノードを完成させます。*/
+        if (bulk_leaf_write(bdb, leaf, lc.keydata, leaf_ptr, prev_ptr, 0) < 0)
+            goto final;
+        if (prev_ptr == 0)
+            status = bulk_level_push(bdb, levels, 0, NULL, -1, leaf_ptr, leaf->keynum);
+        else
+            status = bulk_level_push(bdb, levels, 0, lc.keydata[0].key, lc.keydata[0].keysize, leaf_ptr, leaf->keynum);
+        if (status < 0)
+            goto final;
+        root_ptr = bulk_level_flush(bdb, levels);
+        if (root_ptr < 0)
+            goto final;
+
+        if (put_leaf_top(bdb, top_ptr) < 0)
+            goto final;
+        if (put_leaf_bot(bdb, leaf_ptr) < 0)
+            goto final;
+        if (root_ptr > 0) {
+            if (put_root(bdb, root_ptr) < 0)
+                goto final;
+        }
+    }
+    if (bdb->filesize != nio_filesize(bdb->nio))
+        update_filesize(bdb);
+    result = count;
+
+final:
+    if (levels) {
+        for (i = 0; i < BDB_BULK_MAX_LEVEL; i++) {
+            if (levels[i].cur)
+                free(levels[i].cur);
+            if (levels[i].prev)
+                free(levels[i].prev);
+        }
+        free(levels);
+    }
+    if (lc.keydata)
+        free(lc.keydata);
+    unlock_tree(bdb, LOCK_WRITE);
+    return result;
+}
+
+int bdb_sync(struct bdb_t* bdb)
+{
+    int result = 0;
+
+    lock_tree(bdb, LOCK_WRITE);
+    result = leaf_cache_flush(bdb);
+    /* 圧縮で変更されたファイルサイズを書き出します。*/
+    if (bdb->filesize != nio_filesize(bdb->nio))
+        update_filesize(bdb);
+    unlock_tree(bdb, LOCK_WRITE);
+    return result;
+}
+
+/*
+ * 関数内で確保された領域を開放します。
+ */
+void bdb_free(const void* v)
+{
+    if (v) {
+        free((void*)v);
+    }
+}
+
+
+/* スナップショットのリーフをフレームに読み込みます。
+   リーフキャッシュは使用せずにスナップショット時点の内容を読み込みます。*/
+static struct leaf_cache_t* snap_leaf_get(struct bdb_t* bdb,
+                                          struct bdb_snapshot_t* snap,
+                                          struct leaf_cache_t* lc,
+                                          int64 ptr)
+{
+    char* keybuf;
+
+    if (lc->leaf.node_ptr == ptr)
+        return lc;
+
+    keybuf = (char*)alloca(bdb->node_pgsize);
+    if (read_leaf(bdb, snap_ptr(snap, ptr), &lc->leaf) < 0)
+        goto error;
+    if (get_leaf_keybuf(bdb, &lc->leaf, keybuf) < 0)
+        goto error;
+    if (leaf_frame_decode(bdb, lc, keybuf, 0) < 0)
+        goto error;
+    lc->leaf.node_ptr = ptr;
+    return lc;
+
+error:
+    lc->leaf.node_ptr = 0;
+    return NULL;
+}
+
+/* カーソルが参照するリーフを返します。
+   スナップショットのカーソルはカーソルのフレームに読み込みます。
+   共有ロックのカーソルはリーフのフレームを固定して、
+   cursor_unlock() で固定を解除します。*/
+static struct leaf_cache_t* cursor_leaf(struct dbcursor_t* cur, int64 ptr)
+{
+    if (cur->snap)
+        return snap_leaf_get(cur->bdb, cur->snap, &cur->snap_leaf, ptr);
+    if (cur->shared) {
+        if (cur->pin_leaf) {
+            if (cur->pin_leaf->leaf.node_ptr == ptr)
+                return cur->pin_leaf;
+            leaf_frame_unpin(cur->bdb, cur->pin_leaf);
+        }
+        cur->pin_leaf = leaf_frame_pin(cur->bdb, ptr);
+        return cur->pin_leaf;
+    }
+    if (leaf_cache_get(cur->bdb, ptr) < 0)
+        return NULL;
+    return cur->bdb->leaf_cache;
+}
+
+/* カーソルから見たデータ部のヘッダーを読み込みます。*/
+static int cursor_value_header(struct dbcursor_t* cur, int64 ptr, struct bdb_value_t* v)
+{
+    if (cur->snap)
+        ptr = snap_ptr(cur->snap, ptr);
+    return read_value_header(cur->bdb, ptr, v);
+}
+
+/* スナップショットと分割のカーソルは共有ロックで参照します。*/
+static int cursor_lock_mode(struct dbcursor_t* cur)
+{
+    return (cur->snap || cur->shared)? LOCK_READ : LOCK_WRITE;
+}
+
+static void cursor_lock(struct dbcursor_t* cur)
+{
+    lock_tree(cur->bdb, cursor_lock_mode(cur));
+}
+
+/* 固定したリーフは共有ロックの間だけ参照します。*/
+static void cursor_unpin(struct dbcursor_t* cur)
+{
+    if (cur->pin_leaf) {
+        leaf_frame_unpin(cur->bdb, cur->pin_leaf);
+        cur->pin_leaf = NULL;
+    }
+}
+
+static void cursor_unlock(struct dbcursor_t* cur)
+{
+    cursor_unpin(cur);
+    unlock_tree(cur->bdb, cursor_lock_mode(cur));
+}
+
+static int cursor_get_slot(struct dbcursor_t* cur, struct leaf_cache_t* lc, int index)
+{
+    struct bdb_leaf_key_t* kp;
+
+    cur->index = index;
+    cur->slot.index = cur->index;
+    if (cur->index >= lc->leaf.keynum)
+        return 0;
+
+    kp = &lc->keydata[index];
+
+    if (cur->bdb->datapack_flag) {
+        cur->slot.u.pp.valsize = kp->value.u.pp.valsize;
+        memcpy(cur->slot.u.pp.val, kp->value.u.pp.val, kp->value.u.pp.valsize);
+    } else {
+        cur->slot.u.dp.v_ptr = kp->value.u.dp.v_ptr;
+        if (cursor_value_header(cur, cur->slot.u.dp.v_ptr, &cur->slot.u.dp.v) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* リーフのキーが参照するデータ部を index から先読みします。*/
+static void leaf_prefetch_values(struct bdb_t* bdb, struct leaf_cache_t* lc, int index)
+{
+    int64 last_page = -1;
+    int i;
+
+    if (bdb->datapack_flag)
+        return;
+
+    for (i = index; i < lc->leaf.keynum; i++) {
+        int64 v_ptr, page;
+
+        v_ptr = lc->keydata[i].value.u.dp.v_ptr;
+        page = v_ptr / (int64)bdb->nio->mmap->pgsize;
+        if (page != last_page) {
+            mmap_prefetch(bdb->nio->mmap, v_ptr, BDB_VALUE_SIZE);
+            last_page = page;
+        }
+    }
+}
+
+static void cursor_prefetch(struct dbcursor_t* cur, struct leaf_cache_t* lc)
+{
+    struct bdb_t* bdb;
+
+    bdb = cur->bdb;
+
+    /* 次のリーフを先読みします。*/
+    if (lc->leaf.next_ptr != 0)
+        mmap_prefetch(bdb->nio->mmap, lc->leaf.next_ptr, bdb->node_pgsize);
+
+    leaf_prefetch_values(bdb, lc, 0);
+}
+
+static int cursor_leaf_top(struct dbcursor_t* cur, int64 ptr)
+{
+    struct leaf_cache_t* lc;
+
+    lc = cursor_leaf(cur, ptr);
+    if (lc == NULL)
+        return -1;
+    if (cur->prefetch)
+        cursor_prefetch(cur, lc);
+    if (cursor_get_slot(cur, lc, 0) < 0)
+        return -1;
+    cur->node_ptr = ptr;
+    return 0;
+}
+
+static int cursor_leaf_bot(struct dbcursor_t* cur, int64 ptr)
+{
+    struct leaf_cache_t* lc;
+
+    lc = cursor_leaf(cur, ptr);
+    if (lc == NULL)
+        return -1;
+    if (cursor_get_slot(cur, lc, lc->leaf.keynum-1) < 0)
+        return -1;
+    cur->node_ptr = ptr;
+    return 0;
+}
+
+static void cursor_slot_clear_ptr(struct bdb_value_t* v)
+{
+    v->next_ptr = 0;
+    v->prev_ptr = 0;
+}
+
+/* 範囲の終わりに達した場合は NIO_CURSOR_END を返します。*/
+static int cursor_check_end(struct dbcursor_t* cur)
+{
+    struct leaf_cache_t* lc;
+    struct bdb_leaf_key_t* kp;
+
+    if (cur->end_key == NULL)
+        return 0;
+
+    lc = cursor_leaf(cur, cur->node_ptr);
+    if (lc == NULL)
+        return -1;
+    kp = &lc->keydata[cur->index];
+    if (key_cmp(cur->bdb, kp->key, kp->keysize, cur->end_key, cur->end_keysize) < 0)
+        return 0;
+
+    /* 現在位置はなくなります。*/
+    cur->index = -1;
+    return NIO_CURSOR_END;
+}
+
+static int cursor_next_key(struct dbcursor_t* cur)
+{
+    struct leaf_cache_t* lc;
+
+    /* slotのポインタをクリアします。(2011/12/08) */
+    if (! cur->bdb->datapack_flag)
+        cursor_slot_clear_ptr(&cur->slot.u.dp.v);
+
+    lc = cursor_leaf(cur, cur->node_ptr);
+    if (lc == NULL)
+        return -1;
+
+    /* 次のキーに進めます。*/
+    if (cur->index+1 < lc->leaf.keynum) {
+        if (cursor_get_slot(cur, lc, cur->index+1) < 0)
+            return -1;
+        return cursor_check_end(cur);
+    }
+
+    /* 次のリーフ */
+    if (lc->leaf.next_ptr == 0) {
+        /* end of cursor */
+        return NIO_CURSOR_END;
+    }
+    if (cursor_leaf_top(cur, lc->leaf.next_ptr) < 0)
+        return -1;
+    return cursor_check_end(cur);
+}
+
+static int cursor_prev_key(struct dbcursor_t* cur)
+{
+    struct leaf_cache_t* lc;
+
+    /* slotのポインタをクリアします。(2011/12/08) */
+    if (! cur->bdb->datapack_flag)
+        cursor_slot_clear_ptr(&cur->slot.u.dp.v);
+    
+    lc = cursor_leaf(cur, cur->node_ptr);
+    if (lc == NULL)
+        return -1;
+
+    /* 前のキーに進めます。*/
+    if (cur->index-1 >= 0) {
+        if (cursor_get_slot(cur, lc, cur->index-1) < 0)
+            return -1;
+        return 0;
+    }
+
+    /* 前のリーフ */
+    if (lc->leaf.prev_ptr == 0) {
+        /* end of cursor */
+        return NIO_CURSOR_END;
+    }
+    return cursor_leaf_bot(cur, lc->leaf.prev_ptr);
+}
+
+/* 最終リーフの終わりに位置している場合は NIO_CURSOR_END を返します。*/
+static int cursor_check_bottom(struct dbcursor_t* cur)
+{
+    struct leaf_cache_t* lc;
+    int64 bot_ptr;
+
+    lc = cursor_leaf(cur, cur->node_ptr);
+    if (lc == NULL)
+        return -1;
+
+    bot_ptr = (cur->snap)? cur->snap->leaf_bot_ptr : cur->bdb->leaf_bot_ptr;
+    if (lc->leaf.node_ptr == bot_ptr && cur->index >= lc->leaf.keynum)
+        return NIO_CURSOR_END;
+    return 0;
+}
+
+/* カーソルから見たB木でキーを検索してリーフに位置づけます。
+   キーが存在しない場合は cur->node_ptr が 0 になることがあります。*/
+static int cursor_search_key(struct dbcursor_t* cur, const void* key, int keysize)
+{
+    int64 leaf_ptr;
+    struct leaf_cache_t* lc;
+
+    leaf_ptr = find_snap_leaf(cur->bdb, cur->snap, key, keysize);
+    if (leaf_ptr < 0)
+        return -1;
+    cur->node_ptr = leaf_ptr;
+    if (leaf_ptr == 0)
+        return BDB_KEY_NOTFOUND;
+
+    lc = cursor_leaf(cur, leaf_ptr);
+    if (lc == NULL)
+        return -1;
+    return search_leaf(cur->bdb,
+                       &lc->leaf,
+                       lc->keydata,
+                       key,
+                       keysize,
+                       &cur->slot);
+}
+
+/* 重複索引の場合のみ呼ばれる */
+static int cursor_update_value_ptr(struct dbcursor_t* cur, int64 new_ptr)
+{
+    struct bdb_leaf_key_t* kp;
+    int nodesize;
+
+    kp = &cur->bdb->leaf_cache->keydata[cur->index];
+    kp->value.u.dp.v_ptr = new_ptr;
+
+    /* update leaf & keybuf */
+    nodesize = leaf_put_keydata(cur->bdb,
+                                &cur->bdb->leaf_cache->leaf,
+                                cur->bdb->leaf_cache->keydata,
+                                cur->bdb->leaf_buf);
+    cur->bdb->leaf_cache->leaf.nodesize = BDB_LEAF_SIZE + nodesize;
+
+    if (put_leaf_keybuf(cur->bdb, &cur->bdb->leaf_cache->leaf, cur->bdb->leaf_buf) < 0)
+        return -1;
+    if (update_leaf(cur->bdb, cur->bdb->leaf_cache->leaf.node_ptr, &cur->bdb->leaf_cache->leaf) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * オープンされているデータベースファイルからキー順アクセスするための
+ * カーソルを作成します。
+ * キー位置は先頭に位置づけられます。
+ *
+ * bdb: データベース構造体のポインタ
+ *
+ * 成功した場合はカーソル構造体のポインタを返します。
+ * エラーの場合は NULL を返します。
+ */
+struct dbcursor_t* bdb_cursor_open(struct bdb_t* bdb)
+{
+    struct dbcursor_t* cur;
+
+    cur = (struct dbcursor_t*)calloc(1, sizeof(struct dbcursor_t));
+    if (cur == NULL) {
+        err_write("bdb: bdb_cursor_open() no memory.");
+        return NULL;
+    }
+
+    lock_tree(bdb, LOCK_WRITE);
+
+    cur->bdb = bdb;
+    cur->node_ptr = 0;
+    cur->index = -1;
+
+    if (bdb->leaf_top_ptr != 0) {
+        if (cursor_leaf_top(cur, bdb->leaf_top_ptr) < 0) {
+            free(cur);
+            cur = NULL;
+            goto final;
+        }
+    }
+    bdb->cursor_num++;
+
+final:
+    unlock_tree(bdb, LOCK_WRITE);
+    return cur;
+}
+
+/*
+ * カーソルをクローズします。
+ * カーソル領域は解放されます。
+ *
+ * cur: カーソル構造体のポインタ
+ *
+ * 戻り値 なし
+ */
+void bdb_cursor_close(struct dbcursor_t * cur)
+{
+    if (cur != NULL) {
+        lock_tree(cur->bdb, LOCK_WRITE);
+        if (cur->snap)
+            snap_release(cur->bdb, cur->snap);
+        else
+            leaf_cache_flush(cur->bdb);
+        cur->bdb->cursor_num--;
+        unlock_tree(cur->bdb, LOCK_WRITE);
+        if (cur->snap_leaf.keydata)
+            free(cur->snap_leaf.keydata);
+        if (cur->end_key)
+            free(cur->end_key);
+        free(cur);
+    }
+}
+
+static int used_add(struct bdb_used_t* used, int64 ptr, int64 size)
+{
+    if (used->count >= used->alloc_count) {
+        struct nio_extent_t* ep;
+        int n;
+
+        n = (used->alloc_count == 0)? 1024 : used->alloc_count * 2;
+        ep = (struct nio_extent_t*)realloc(used->extent, sizeof(struct nio_extent_t) * n);
+        if (ep == NULL) {
+            err_write("bdb: reclaim no memory.");
+            return -1;
+        }
+        used->extent = ep;
+        used->alloc_count = n;
+    }
+    used->extent[used->count].ptr = ptr;
+    used->extent[used->count].size = size;
+    used->extent[used->count].entry = -1;
+    used->count++;
+    return 0;
+}
+
+/* リーフとリーフから参照されるデータ部の領域を追加します。*/
+static int used_leaf(struct bdb_t* bdb, struct bdb_used_t* used, int64 ptr)
+{
+    int i;
+
+    if (used_add(used, ptr, bdb->node_pgsize) < 0)
+        return -1;
+    if (bdb->datapack_flag)
+        return 0;
+    if (leaf_cache_get(bdb, ptr) < 0)
+        return -1;
+    for (i = 0; i < bdb->leaf_cache->leaf.keynum; i++) {
+        int64 v_ptr;
+
+        /* 重複キーのデータ部はリンクをたどります。*/
+        v_ptr = bdb->leaf_cache->keydata[i].value.u.dp.v_ptr;
+        while (v_ptr > 0) {
+            struct bdb_value_t v;
+
+            if (read_value_header(bdb, v_ptr, &v) < 0)
+                return -1;
+            if (used_add(used, v_ptr, v.areasize) < 0)
+                return -1;
+            v_ptr = v.next_ptr;
+        }
+    }
+    return 0;
+}
+
+/* ブランチノードと子孫の領域を追加します。
+   リーフはリーフのリンクからも追加するため重複します。*/
+static int used_node(struct bdb_t* bdb, struct bdb_used_t* used, int64 ptr)
+{
+    char* buf;
+    char* p;
+    int keynum;
+    int i;
+
+    buf = (char*)alloca(bdb->node_pgsize);
+    if (read_node(bdb, ptr, buf) < 0)
+        return -1;
+    if (used_add(used, ptr, bdb->node_pgsize) < 0)
+        return -1;
+
+    keynum = get_node_keynum(buf);
+    p = buf + BDB_NODE_KEY_OFFSET;
+    for (i = 0; i <= keynum; i++) {
+        int64 child_ptr;
+        ushort ksize;
+
+        memcpy(&child_ptr, p, sizeof(int64));
+        if (child_ptr > 0 && ! is_eof(bdb, child_ptr)) {
+            if (is_leaf(bdb, child_ptr)) {
+                if (used_leaf(bdb, used, child_ptr) < 0)
+                    return -1;
+            } else if (is_node(bdb, child_ptr)) {
+                if (used_node(bdb, used, child_ptr) < 0)
+                    return -1;
+            }
+        }
+        if (i < keynum) {
+            p += bdb->node_ptrsize;
+            memcpy(&ksize, p, sizeof(ushort));
+            p += sizeof(ushort) + ksize;
+        }
+    }
+    return 0;
+}
+
+/* スナップショットを使用中に異常終了した場合に複写した領域を回収します。
+   複写した領域はスナップショットの表からしか参照されないため、
+   木から参照される領域を集めて、それ以外を空きリストに戻します。*/
+static int snap_reclaim(struct bdb_t* bdb)
+{
+    struct bdb_used_t used;
+    int64 ptr;
+    int64 n;
+    int64 reclaimed = -1;
+
+    memset(&used, '\0', sizeof(used));
+    if (bdb->root_ptr != 0) {
+        if (used_node(bdb, &used, bdb->root_ptr) < 0)
+            goto final;
+    }
+    /* リンクが循環している場合に終わるようにリーフの数を制限します。*/
+    n = nio_filesize(bdb->nio) / bdb->node_pgsize;
+    for (ptr = bdb->leaf_top_ptr; ptr > 0 && n > 0 && ! is_eof(bdb, ptr) && is_leaf(bdb, ptr); n--) {
+        struct bdb_leaf_t leaf;
+
+        if (read_leaf(bdb, ptr, &leaf) < 0)
+            goto final;
+        if (used_leaf(bdb, &used, ptr) < 0)
+            goto final;
+        ptr = leaf.next_ptr;
+    }
+    reclaimed = nio_reclaim_space(bdb->nio, bdb->header_size, used.extent, used.count);
+    if (reclaimed >= 0) {
+        update_filesize(bdb);
+        logout_write("bdb_open: reclaimed %lld bytes of snapshot.", reclaimed);
+    }
+
+final:
+    if (used.extent)
+        free(used.extent);
+    return (reclaimed < 0)? -1 : 0;
+}
+
+/*
+ * オープンされているデータベースファイルから現時点の内容をキー順に
+ * 参照するためのスナップショットのカーソルを作成します。
+ * カーソルをクローズするまで他のスレッドの更新は参照されません。
+ * キー位置は先頭に位置づけられます。
+ *
+ * カーソルは参照専用で bdb_cursor_update() と bdb_cursor_delete() は
+ * エラーになります。参照は共有ロックで行われるため
+ * NIO_CONCURRENT_READ でオープンした場合は更新と並行に処理されます。
+ *
+ * bdb: データベース構造体のポインタ
+ *
+ * 成功した場合はカーソル構造体のポインタを返します。
+ * エラーの場合は NULL を返します。
+ */
+struct dbcursor_t* bdb_cursor_snapshot(struct bdb_t* bdb)
+{
+    struct dbcursor_t* cur;
+
+    cur = (struct dbcursor_t*)calloc(1, sizeof(struct dbcursor_t));
+    if (cur == NULL) {
+        err_write("bdb: bdb_cursor_snapshot() no memory.");
+        return NULL;
+    }
+
+    lock_tree(bdb, LOCK_WRITE);
+
+    cur->bdb = bdb;
+    cur->node_ptr = 0;
+    cur->index = -1;
+
+    cur->snap = snap_create(bdb);
+    if (cur->snap == NULL)
+        goto error;
+
+    if (cur->snap->leaf_top_ptr != 0) {
+        if (cursor_leaf_top(cur, cur->snap->leaf_top_ptr) < 0)
+            goto error;
+    }
+    bdb->cursor_num++;
+    unlock_tree(bdb, LOCK_WRITE);
+    return cur;
+
+error:
+    if (cur->snap)
+        snap_release(bdb, cur->snap);
+    unlock_tree(bdb, LOCK_WRITE);
+    if (cur->snap_leaf.keydata)
+        free(cur->snap_leaf.keydata);
+    free(cur);
+    return NULL;
+}
+
+/* 分割の境界になるキーをブランチノードから取得します。
+   n-1 個以上のキーを持つ階層かリーフの直上の階層のキーを
+   (ksize, key) の形式でキー順に keybuf に設定します。*/
+static int bt_partition_keys(struct bdb_t* bdb, int n, char** keybuf, int* keynum)
+{
+    int64* nodes;
+    int nnodes;
+    char* kbuf = NULL;
+    int knum = 0;
+    char* buf;
+
+    /* 共有ロックで呼び出されるため bdb->node_buf は使用しません。*/
+    buf = (char*)alloca(bdb->node_pgsize);
+    nodes = (int64*)malloc(sizeof(int64));
+    if (nodes == NULL)
+        goto nomem;
+    nodes[0] = bdb->root_ptr;
+    nnodes = 1;
+
+    while (1) {
+        int64* child;
+        int nchild = 0;
+        char* kp;
+        int i;
+
+        if (kbuf)
+            free(kbuf);
+        knum = 0;
+        kbuf = (char*)malloc(nnodes * bdb->node_pgsize);
+        if (kbuf == NULL)
+            goto nomem;
+        child = (int64*)malloc(nnodes * (bdb->node_pgsize / (sizeof(int64)+sizeof(ushort)) + 1) * sizeof(int64));
+        if (child == NULL)
+            goto nomem;
+
+        kp = kbuf;
+        for (i = 0; i < nnodes; i++) {
+            char* p;
+            int keynum;
+            int k;
+
+            if (read_node(bdb, nodes[i], buf) < 0) {
+                free(child);
+                goto error;
+            }
+            keynum = get_node_keynum(buf);
+            p = buf + BDB_NODE_KEY_OFFSET;
+            for (k = 0; k < keynum; k++) {
+                ushort ksize;
+
+                memcpy(&child[nchild++], p, sizeof(int64));
+                p += bdb->node_ptrsize;
+                memcpy(&ksize, p, sizeof(ushort));
+                memcpy(kp, p, sizeof(ushort) + ksize);
+                kp += sizeof(ushort) + ksize;
+                p += sizeof(ushort) + ksize;
+            }
+            memcpy(&child[nchild++], p, sizeof(int64));
+            knum += keynum;
+        }
+        free(nodes);
+        nodes = child;
+        nnodes = nchild;
+
+        /* 境界のキーがそろったか子孫がリーフの場合は終了します。*/
+        if (knum >= n-1 || is_leaf(bdb, nodes[0]))
+            break;
+    }
+    free(nodes);
+    *keybuf = kbuf;
+    *keynum = knum;
+    return 0;
+
+nomem:
+    err_write("bdb_cursor_partition: no memory.");
+error:
+    if (nodes)
+        free(nodes);
+    if (kbuf)
+        free(kbuf);
+    return -1;
+}
+
+/* 範囲 [lo, hi) のカーソルを作成します。
+   lo が NULL の場合は先頭から、hi が NULL の場合は最後までになります。
+   NIO_CONCURRENT_READ の場合は共有ロックで参照するため
+   bdb->leaf_cache は使用せずにフレームを固定します。*/
+static struct dbcursor_t* cursor_open_range(struct bdb_t* bdb,
+                                            const char* lo,
+                                            int losize,
+                                            const char* hi,
+                                            int hisize)
+{
+    struct dbcursor_t* cur;
+    int result = 0;
+
+    cur = (struct dbcursor_t*)calloc(1, sizeof(struct dbcursor_t));
+    if (cur == NULL) {
+        err_write("bdb: bdb_cursor_partition() no memory.");
+        return NULL;
+    }
+    cur->bdb = bdb;
+    cur->node_ptr = 0;
+    cur->index = -1;
+    cur->prefetch = 1;
+    cur->shared = bdb->shared_latch;
+
+    if (hi) {
+        cur->end_key = (uchar*)malloc(hisize);
+        if (cur->end_key == NULL) {
+            err_write("bdb: bdb_cursor_partition() no memory.");
+            free(cur);
+            return NULL;
+        }
+        memcpy(cur->end_key, hi, hisize);
+        cur->end_keysize = hisize;
+    }
+
+    if (bdb->leaf_top_ptr != 0) {
+        struct leaf_cache_t* lc = NULL;
+
+        if (lo == NULL) {
+            result = cursor_leaf_top(cur, bdb->leaf_top_ptr);
+            if (result == 0) {
+                lc = cursor_leaf(cur, cur->node_ptr);
+                if (lc == NULL)
+                    result = -1;
+                else if (cur->index < lc->leaf.keynum)
+                    result = cursor_check_end(cur);
+            }
+        } else {
+            /* 範囲の先頭のキーに位置づけます。*/
+            result = cursor_search_key(cur, lo, losize);
+            if (result >= 0) {
+                lc = cursor_leaf(cur, cur->node_ptr);
+                if (lc == NULL)
+                    result = -1;
+            }
+            if (result >= 0) {
+                cursor_prefetch(cur, lc);
+                result = cursor_get_slot(cur, lc, cur->slot.index);
+            }
+            if (result >= 0) {
+                if (cur->index >= lc->leaf.keynum)
+                    result = cursor_next_key(cur);
+                else
+                    result = cursor_check_end(cur);
+            }
+        }
+        cursor_unpin(cur);
+        if (result < 0) {
+            if (cur->end_key)
+                free(cur->end_key);
+            free(cur);
+            return NULL;
+        }
+        if (result == NIO_CURSOR_END)
+            cur->index = -1;    /* empty range */
+    }
+    return cur;
+}
+
+/*
+ * キーを n 個の重ならない範囲に分割してカーソルを作成します。
+ * 作成されたカーソルは curs に設定されます。
+ *
+ * 範囲の境界はブランチノードのキーから求められるため、
+ * 各範囲のリーフ数はおおよそ均等になります。
+ * 各カーソルは範囲の先頭のキーに位置づけられ、bdb_cursor_next() と
+ * bdb_cursor_nextkey() は範囲の終わりで NIO_CURSOR_END を返します。
+ * 各カーソルは次のリーフとデータ部を先読みしながら進みます。
+ *
+ * カーソルはそれぞれ別のスレッドから使用できます。
+ * 参照はスナップショットのカーソルと同様に共有ロックで行われ、
+ * リーフはバッファプールのフレームを固定して読み込まれるため、
+ * NIO_CONCURRENT_READ でオープンした場合は各カーソルが並行に進みます。
+ * bdb_cursor_update() と bdb_cursor_delete() は排他ロックで処理されます。
+ * 使用後は bdb_cursor_close() でクローズします。
+ *
+ * bdb: データベース構造体のポインタ
+ * n: 分割数
+ * curs: カーソルのポインタが設定される配列(n 個以上)
+ *
+ * 作成したカーソルの数を返します。ブランチノードのキー数が少ない場合は
+ * n より少ない数のカーソルが作成されます。
+ * エラーの場合は -1 を返します。
+ */
+int bdb_cursor_partition(struct bdb_t* bdb, int n, struct dbcursor_t** curs)
+{
+    char* kbuf = NULL;
+    int* koff = NULL;
+    int knum = 0;
+    int m;
+    int i;
+
+    if (n < 1) {
+        err_write("bdb_cursor_partition: illegal partition number=%d", n);
+        return -1;
+    }
+
+    lock_tree(bdb, LOCK_READ);
+
+    if (n > 1 && bdb->root_ptr != 0) {
+        char* p;
+
+        if (bt_partition_keys(bdb, n, &kbuf, &knum) < 0)
+            goto error;
+
+        /* キーの位置を求めます。*/
+        koff = (int*)malloc((knum + 1) * sizeof(int));
+        if (koff == NULL) {
+            err_write("bdb_cursor_partition: no memory.");
+            goto error;
+        }
+        p = kbuf;
+        for (i = 0; i < knum; i++) {
+            ushort ksize;
+
+            koff[i] = (int)(p - kbuf);
+            memcpy(&ksize, p, sizeof(ushort));
+            p += sizeof(ushort) + ksize;
+        }
+    }
+
+    /* 境界のキーを均等に選択します。*/
+    m = (knum + 1 < n)? knum + 1 : n;
+    for (i = 0; i < m; i++) {
+        char* lo = NULL;
+        char* hi = NULL;
+        ushort losize = 0;
+        ushort hisize = 0;
+
+        if (i > 0) {
+            lo = kbuf + koff[i * (knum+1) / m - 1];
+            memcpy(&losize, lo, sizeof(ushort));
+            lo += sizeof(ushort);
+        }
+        if (i < m-1) {
+            hi = kbuf + koff[(i+1) * (knum+1) / m - 1];
+            memcpy(&hisize, hi, sizeof(ushort));
+            hi += sizeof(ushort);
+        }
+        curs[i] = cursor_open_range(bdb, lo, losize, hi, hisize);
+        if (curs[i] == NULL) {
+            while (i-- > 0) {
+                if (curs[i]->end_key)
+                    free(curs[i]->end_key);
+                free(curs[i]);
+            }
+            goto error;
+        }
+    }
+    /* 共有ロックで作成するためカーソル数はプールの排他で更新します。*/
+    CS_START(&bdb->pool_critical_section);
+    bdb->cursor_num += m;
+    CS_END(&bdb->pool_critical_section);
+
+    unlock_tree(bdb, LOCK_READ);
+    if (kbuf)
+        free(kbuf);
+    if (koff)
+        free(koff);
+    return m;
+
+error:
+    unlock_tree(bdb, LOCK_READ);
+    if (kbuf)
+        free(kbuf);
+    if (koff)
+        free(koff);
+    return -1;
+}
+
+/* 範囲検索でリーフを参照します。
+   共有ロックの場合はフレームを固定します。*/
+static struct leaf_cache_t* scan_leaf_pin(struct bdb_t* bdb, int64 leaf_ptr)
+{
+    if (bdb->shared_latch)
+        return leaf_frame_pin(bdb, leaf_ptr);
+    if (leaf_cache_get(bdb, leaf_ptr) < 0)
+        return NULL;
+    return bdb->leaf_cache;
+}
+
+static void scan_leaf_unpin(struct bdb_t* bdb, struct leaf_cache_t* lc)
+{
+    if (bdb->shared_latch)
+        leaf_frame_unpin(bdb, lc);
+}
+
+/* 次のリーフから BDB_SCAN_READAHEAD 個分を先読みします。
+   リーフがファイルの後方に続いている場合は先読みの範囲を広げます。*/
+static void scan_readahead(struct bdb_t* bdb, struct bdb_scan_t* sc, struct leaf_cache_t* lc)
+{
+    int64 next_ptr;
+    int64 size;
+
+    next_ptr = lc->leaf.next_ptr;
+    if (next_ptr == 0)
+        return;
+    if (next_ptr >= sc->ra_start && next_ptr + bdb->node_pgsize <= sc->ra_end)
+        return;     /* 先読み済み */
+
+    size = bdb->node_pgsize;
+    if (next_ptr > lc->leaf.node_ptr)
+        size *= BDB_SCAN_READAHEAD;
+    mmap_prefetch(bdb->nio->mmap, next_ptr, size);
+    sc->ra_start = next_ptr;
+    sc->ra_end = next_ptr + size;
+}
+
+/* バッチにレコードを追加してキーと値を書き込む領域を返します。*/
+static char* scan_add(struct bdb_scan_t* sc, int keysize, int valsize)
+{
+    int n;
+
+    if (sc->count >= sc->itemsize) {
+        struct nio_batch_t* items;
+        int* offset;
+        int size;
+
+        size = sc->itemsize + BDB_SCAN_BATCH_COUNT;
+        items = (struct nio_batch_t*)realloc(sc->items, sizeof(struct nio_batch_t) * size);
+        if (items == NULL)
+            goto nomem;
+        sc->items = items;
+        offset = (int*)realloc(sc->offset, sizeof(int) * 2 * size);
+        if (offset == NULL)
+            goto nomem;
+        sc->offset = offset;
+        sc->itemsize = size;
+    }
+
+    n = keysize + valsize;
+    if (sc->used + n > sc->bufsize) {
+        char* buf;
+        int size;
+
+        size = sc->bufsize + BDB_SCAN_BATCH_SIZE;
+        if (size < sc->used + n)
+            size = sc->used + n;
+        buf = (char*)realloc(sc->buf, size);
+        if (buf == NULL)
+            goto nomem;
+        sc->buf = buf;
+        sc->bufsize = size;
+    }
+
+    sc->items[sc->count].keysize = keysize;
+    sc->items[sc->count].valsize = valsize;
+    sc->items[sc->count].result = 0;
+    sc->offset[sc->count*2] = sc->used;
+    sc->offset[sc->count*2+1] = sc->used + keysize;
+    sc->count++;
+    sc->used += n;
+    return sc->buf + sc->used - n;
+
+nomem:
+    err_write("bdb_scan: no memory.");
+    return NULL;
+}
+
+/* リーフの index からのキーと値をバッチに追加します。
+   範囲の終わりに達した場合は 1 を返します。*/
+static int scan_leaf(struct bdb_t* bdb,
+                     struct bdb_scan_t* sc,
+                     struct leaf_cache_t* lc,
+                     int index,
+                     const void* end,
+                     int endsize,
+                     int flags)
+{
+    int i;
+
+    if (! (flags & BDB_SCAN_KEYONLY))
+        leaf_prefetch_values(bdb, lc, index);
+
+    for (i = index; i < lc->leaf.keynum; i++) {
+        struct bdb_leaf_key_t* kp;
+        char* p;
+
+        kp = &lc->keydata[i];
+        if (end) {
+            int c;
+
+            c = key_cmp(bdb, kp->key, kp->keysize, end, endsize);
+            if (c > 0 || (c == 0 && ! (flags & BDB_SCAN_END_INCLUDE)))
+                return 1;
+        }
+
+        if (bdb->datapack_flag) {
+            int valsize;
+
+            valsize = (flags & BDB_SCAN_KEYONLY)? 0 : kp->value.u.pp.valsize;
+            p = scan_add(sc, kp->keysize, valsize);
+            if (p == NULL)
+                return -1;
+            memcpy(p, kp->key, kp->keysize);
+            memcpy(p + kp->keysize, kp->value.u.pp.val, valsize);
+        } else {
+            int64 v_ptr;
+
+            /* 重複キーの場合は値ごとにレコードを追加します。*/
+            v_ptr = kp->value.u.dp.v_ptr;
+            while (v_ptr != 0) {
+                struct bdb_value_t v;
+                int valsize;
+
+                if (read_value_header(bdb, v_ptr, &v) < 0)
+                    return -1;
+                valsize = (flags & BDB_SCAN_KEYONLY)? 0 : v.rawsize;
+                p = scan_add(sc, kp->keysize, valsize);
+                if (p == NULL)
+                    return -1;
+                memcpy(p, kp->key, kp->keysize);
+                if (valsize > 0) {
+                    if (read_value_data(bdb, v_ptr, &v, p + kp->keysize, valsize) != valsize)
+                        return -1;
+                }
+                v_ptr = (bdb->dupkey_flag)? v.next_ptr : 0;
+            }
+        }
+        sc->lastsize = kp->keysize;
+        memcpy(sc->lastkey, kp->key, kp->keysize);
     }
     return 0;
 }
 
-static int cursor_leaf_top(struct dbcursor_t* cur, int64 ptr)
+/* 範囲の先頭か前回のバッチの最後のキーの次に位置づけます。
+   リーフのポインタを返して index に位置を設定します。*/
+static int64 scan_position(struct bdb_t* bdb,
+                           struct bdb_scan_t* sc,
+                           const void* start,
+                           int startsize,
+                           int* index)
 {
-    if (leaf_cache_get(cur->bdb, ptr) < 0)
-        return -1;
-    if (cursor_get_slot(cur, 0) < 0)
+    struct leaf_cache_t* lc;
+    struct bdb_slot_t slot;
+    int64 leaf_ptr;
+    int status;
+
+    *index = 0;
+    if (sc->lastsize >= 0) {
+        start = sc->lastkey;
+        startsize = sc->lastsize;
+    }
+    if (start == NULL)
+        return bdb->leaf_top_ptr;
+
+    leaf_ptr = find_leaf(bdb, start, startsize);
+    if (leaf_ptr <= 0)
+        return leaf_ptr;
+
+    lc = scan_leaf_pin(bdb, leaf_ptr);
+    if (lc == NULL)
         return -1;
-    cur->node_ptr = ptr;
-    return 0;
+    status = search_leaf(bdb, &lc->leaf, lc->keydata, start, startsize, &slot);
+    *index = slot.index;
+    if (status == BDB_KEY_FOUND && sc->lastsize >= 0)
+        (*index)++;     /* 前回の最後のキーの次 */
+    scan_leaf_unpin(bdb, lc);
+    return (status < 0)? -1 : leaf_ptr;
 }
 
-static int cursor_leaf_bot(struct dbcursor_t* cur, int64 ptr)
-{
-    if (leaf_cache_get(cur->bdb, ptr) < 0)
+/*
+ * キーの範囲 [start, end) のキーと値をキー順にまとめて関数に渡します。
+ * start が NULL の場合は先頭から、end が NULL の場合は最後までになります。
+ * flags に BDB_SCAN_END_INCLUDE を指定すると end のキーも含みます。
+ * BDB_SCAN_KEYONLY を指定すると値は読み込まれません(valsize はゼロ)。
+ *
+ * リーフ単位でキーと値を読み込み、BDB_SCAN_BATCH_COUNT 個以上になるか
+ * 領域が BDB_SCAN_BATCH_SIZE を超えた時点でロックを解放して func を
+ * 呼び出します。func は items の key, keysize, val, valsize を参照して、
+ * 続ける場合はゼロを返します。items の領域は func から戻るまで有効です。
+ * ロックは解放されているため func からデータベースを更新できます。
+ * 次のバッチは渡した最後のキーの次から読み込まれます。
+ * 読み込み中は next_ptr を辿って次のリーフとデータ部を先読みします。
+ *
+ * 重複キーの場合は値ごとにレコードが渡されます。
+ *
+ * bdb: データベース構造体のポインタ
+ * start: 範囲の先頭のキー
+ * startsize: 範囲の先頭のキーサイズ
+ * end: 範囲の終わりのキー
+ * endsize: 範囲の終わりのキーサイズ
+ * flags: BDB_SCAN_END_INCLUDE | BDB_SCAN_KEYONLY
+ * func: レコードを受け取る関数のポインタ
+ * arg: 関数に渡される引数
+ *
+ * 関数に渡したレコードの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int bdb_scan(struct bdb_t* bdb,
+             const void* start,
+             int startsize,
+             const void* end,
+             int endsize,
+             int flags,
+             SCAN_FUNCPTR func,
+             void* arg)
+{
+    struct bdb_scan_t sc;
+    int64 leaf_ptr = 0;
+    int index = 0;
+    uint version = 0;
+    int done = 0;
+    int total = 0;
+    int i;
+
+    if (start && check_keysize(bdb, startsize, "bdb_scan") < 0)
         return -1;
-    if (cursor_get_slot(cur, cur->bdb->leaf_cache->leaf.keynum-1) < 0)
+    if (end && check_keysize(bdb, endsize, "bdb_scan") < 0)
         return -1;
-    cur->node_ptr = ptr;
-    return 0;
-}
 
-static void cursor_slot_clear_ptr(struct bdb_value_t* v)
-{
-    v->next_ptr = 0;
-    v->prev_ptr = 0;
-}
+    memset(&sc, '\0', sizeof(struct bdb_scan_t));
+    sc.lastsize = -1;
 
-static int cursor_next_key(struct dbcursor_t* cur)
-{
-    /* slotのポインタをクリアします。(2011/12/08) */
-    if (! cur->bdb->datapack_flag)
-        cursor_slot_clear_ptr(&cur->slot.u.dp.v);
+    while (! done) {
+        int status = 0;
 
-    if (leaf_cache_get(cur->bdb, cur->node_ptr) < 0)
-        return -1;
+        lock_tree(bdb, LOCK_READ);
 
-    /* 次のキーに進めます。*/
-    if (cur->index+1 < cur->bdb->leaf_cache->leaf.keynum) {
-        if (cursor_get_slot(cur, cur->index+1) < 0)
-            return -1;
-        return 0;
-    }
+        if (leaf_ptr == 0 || version != bdb->tree_version) {
+            /* 最初か木が更新された場合はキーから位置づけます。*/
+            leaf_ptr = scan_position(bdb, &sc, start, startsize, &index);
+            if (leaf_ptr < 0) {
+                unlock_tree(bdb, LOCK_READ);
+                goto error;
+            }
+        }
 
-    /* 次のリーフ */
-    if (cur->bdb->leaf_cache->leaf.next_ptr == 0) {
-        /* end of cursor */
-        return NIO_CURSOR_END;
+        while (leaf_ptr != 0) {
+            struct leaf_cache_t* lc;
+
+            lc = scan_leaf_pin(bdb, leaf_ptr);
+            if (lc == NULL) {
+                status = -1;
+                break;
+            }
+            scan_readahead(bdb, &sc, lc);
+            status = scan_leaf(bdb, &sc, lc, index, end, endsize, flags);
+            leaf_ptr = lc->leaf.next_ptr;
+            index = 0;
+            scan_leaf_unpin(bdb, lc);
+            if (status != 0)
+                break;
+            if (sc.count >= BDB_SCAN_BATCH_COUNT || sc.used >= BDB_SCAN_BATCH_SIZE)
+                break;
+        }
+        version = bdb->tree_version;
+        unlock_tree(bdb, LOCK_READ);
+
+        if (status < 0)
+            goto error;
+        if (status > 0 || leaf_ptr == 0)
+            done = 1;
+
+        if (sc.count > 0) {
+            for (i = 0; i < sc.count; i++) {
+                sc.items[i].key = sc.buf + sc.offset[i*2];
+                sc.items[i].val = sc.buf + sc.offset[i*2+1];
+            }
+            total += sc.count;
+            if ((*func)(arg, sc.items, sc.count) != 0)
+                done = 1;
+            sc.count = 0;
+            sc.used = 0;
+        }
     }
-    return cursor_leaf_top(cur, cur->bdb->leaf_cache->leaf.next_ptr);
+
+    if (sc.buf)
+        free(sc.buf);
+    if (sc.items)
+        free(sc.items);
+    if (sc.offset)
+        free(sc.offset);
+    return total;
+
+error:
+    if (sc.buf)
+        free(sc.buf);
+    if (sc.items)
+        free(sc.items);
+    if (sc.offset)
+        free(sc.offset);
+    return -1;
 }
 
-static int cursor_prev_key(struct dbcursor_t* cur)
+/* key より小さいキーの数を返します。
+   キーが存在する場合は found に 1 が設定されます。*/
+static int64 count_rank(struct bdb_t* bdb, const void* key, int keysize, int* found)
 {
-    /* slotのポインタをクリアします。(2011/12/08) */
-    if (! cur->bdb->datapack_flag)
-        cursor_slot_clear_ptr(&cur->slot.u.dp.v);
-    
-    if (leaf_cache_get(cur->bdb, cur->node_ptr) < 0)
-        return -1;
+    int64 ptr;
+    int64 rank = 0;
+    struct leaf_cache_t* lc;
+    struct bdb_slot_t slot;
+    int status;
 
-    /* 前のキーに進めます。*/
-    if (cur->index-1 >= 0) {
-        if (cursor_get_slot(cur, cur->index-1) < 0)
-            return -1;
-        return 0;
-    }
+    *found = 0;
+    ptr = bdb->root_ptr;
+    if (ptr == 0) {
+        ptr = bdb->leaf_top_ptr;
+    } else {
+        char* buf;
 
-    /* 前のリーフ */
-    if (cur->bdb->leaf_cache->leaf.prev_ptr == 0) {
-        /* end of cursor */
-        return NIO_CURSOR_END;
+        buf = (char*)alloca(bdb->node_pgsize);
+        while (1) {
+            int64 child_ptr;
+
+            if (read_node(bdb, ptr, buf) < 0)
+                return -1;
+            bt_search_node(bdb, buf, key, keysize, &child_ptr, NULL);
+            rank += bt_count_before(bdb, buf, child_ptr);
+            ptr = child_ptr;
+            if (is_leaf(bdb, child_ptr))
+                break;
+        }
     }
-    return cursor_leaf_bot(cur, cur->bdb->leaf_cache->leaf.prev_ptr);
+    if (ptr == 0)
+        return 0;
+
+    lc = scan_leaf_pin(bdb, ptr);
+    if (lc == NULL)
+        return -1;
+    status = search_leaf(bdb, &lc->leaf, lc->keydata, key, keysize, &slot);
+    scan_leaf_unpin(bdb, lc);
+    if (status < 0)
+        return -1;
+    *found = (status == BDB_KEY_FOUND);
+    return rank + slot.index;
 }
 
-/* 重複索引の場合のみ呼ばれる */
-static int cursor_update_value_ptr(struct dbcursor_t* cur, int64 new_ptr)
+/* データベースのキー数を返します。*/
+static int64 count_total(struct bdb_t* bdb)
 {
-    struct bdb_leaf_key_t* kp;
-    int nodesize;
-
-    kp = &cur->bdb->leaf_cache->keydata[cur->index];
-    kp->value.u.dp.v_ptr = new_ptr;
+    struct leaf_cache_t* lc;
+    int64 count;
 
-    /* update leaf & keybuf */
-    nodesize = leaf_put_keydata(cur->bdb,
-                                &cur->bdb->leaf_cache->leaf,
-                                cur->bdb->leaf_cache->keydata,
-                                cur->bdb->leaf_buf);
-    cur->bdb->leaf_cache->leaf.nodesize = BDB_LEAF_SIZE + nodesize;
+    if (bdb->root_ptr != 0) {
+        char* buf;
 
-    if (put_leaf_keybuf(cur->bdb, &cur->bdb->leaf_cache->leaf, cur->bdb->leaf_buf) < 0)
-        return -1;
-    if (update_leaf(cur->bdb, cur->bdb->leaf_cache->leaf.node_ptr, &cur->bdb->leaf_cache->leaf) < 0)
+        buf = (char*)alloca(bdb->node_pgsize);
+        if (read_node(bdb, bdb->root_ptr, buf) < 0)
+            return -1;
+        return bt_node_count(bdb, buf);
+    }
+    if (bdb->leaf_top_ptr == 0)
+        return 0;
+    lc = scan_leaf_pin(bdb, bdb->leaf_top_ptr);
+    if (lc == NULL)
         return -1;
-    return 0;
+    count = lc->leaf.keynum;
+    scan_leaf_unpin(bdb, lc);
+    return count;
 }
 
 /*
- * オープンされているデータベースファイルからキー順アクセスするための
- * カーソルを作成します。
- * キー位置は先頭に位置づけられます。
+ * キーの範囲 [start, end) にあるキーの数を返します。
+ * start が NULL の場合は先頭から、end が NULL の場合は最後までになります。
+ * flags に BDB_SCAN_END_INCLUDE を指定すると end のキーも含みます。
+ *
+ * ブランチノードの部分木のキー数を使用するため、リーフを辿らずに
+ * 木の高さに比例した読み込みで求めます。
+ * NIO_ORDER_STAT を指定して作成されたデータベースのみ使用できます。
+ * 重複キーは値の数にかかわらずひとつとして数えます。
  *
  * bdb: データベース構造体のポインタ
+ * start: 範囲の先頭のキー
+ * startsize: 範囲の先頭のキーサイズ
+ * end: 範囲の終わりのキー
+ * endsize: 範囲の終わりのキーサイズ
+ * flags: BDB_SCAN_END_INCLUDE
  *
- * 成功した場合はカーソル構造体のポインタを返します。
- * エラーの場合は NULL を返します。
+ * キーの数を返します。
+ * エラーの場合は -1 を返します。
  */
-struct dbcursor_t* bdb_cursor_open(struct bdb_t* bdb)
-{
-    struct dbcursor_t* cur;
+int64 bdb_count_range(struct bdb_t* bdb,
+                      const void* start,
+                      int startsize,
+                      const void* end,
+                      int endsize,
+                      int flags)
+{
+    int64 lo = 0;
+    int64 hi;
+    int found;
 
-    cur = (struct dbcursor_t*)calloc(1, sizeof(struct dbcursor_t));
-    if (cur == NULL) {
-        err_write("bdb: bdb_cursor_open() no memory.");
-        return NULL;
+    if (! bdb->count_flag) {
+        err_write("bdb_count_range: database is not created with NIO_ORDER_STAT.");
+        return -1;
     }
+    if (start && check_keysize(bdb, startsize, "bdb_count_range") < 0)
+        return -1;
+    if (end && check_keysize(bdb, endsize, "bdb_count_range") < 0)
+        return -1;
 
-    CS_START(&bdb->critical_section);
-
-    cur->bdb = bdb;
-    cur->node_ptr = 0;
-    cur->index = -1;
+    lock_tree(bdb, LOCK_READ);
 
-    if (bdb->leaf_top_ptr != 0) {
-        if (cursor_leaf_top(cur, bdb->leaf_top_ptr) < 0) {
-            free(cur);
-            cur = NULL;
-            goto final;
-        }
+    if (start) {
+        lo = count_rank(bdb, start, startsize, &found);
+        if (lo < 0)
+            goto error;
+    }
+    if (end) {
+        hi = count_rank(bdb, end, endsize, &found);
+        if (hi < 0)
+            goto error;
+        if (found && (flags & BDB_SCAN_END_INCLUDE))
+            hi++;
+    } else {
+        hi = count_total(bdb);
+        if (hi < 0)
+            goto error;
     }
 
-final:
-    CS_END(&bdb->critical_section);
-    return cur;
-}
+    unlock_tree(bdb, LOCK_READ);
+    return (hi > lo)? hi - lo : 0;
 
-/*
- * カーソルをクローズします。
- * カーソル領域は解放されます。
- *
- * cur: カーソル構造体のポインタ
- *
- * 戻り値 なし
- */
-void bdb_cursor_close(struct dbcursor_t * cur)
-{
-    if (cur != NULL) {
-        leaf_cache_flush(cur->bdb);
-        free(cur);
-    }
+error:
+    unlock_tree(bdb, LOCK_READ);
+    return -1;
 }
 
 /*
@@ -4076,15 +8733,15 @@ int bdb_cursor_next(struct dbcursor_t* cur)
     if (cur->index < 0)
         return NIO_CURSOR_END;
 
-    CS_START(&cur->bdb->critical_section);
+    cursor_lock(cur);
 
     if (cur->bdb->dupkey_flag) {
         /* 重複キーの場合は次のデータに位置づけます。*/
         if (cur->slot.u.dp.v.next_ptr != 0) {
             cur->slot.u.dp.v_ptr = cur->slot.u.dp.v.next_ptr;
-            result = read_value_header(cur->bdb,
-                                       cur->slot.u.dp.v_ptr,
-                                       &cur->slot.u.dp.v);
+            result = cursor_value_header(cur,
+                                         cur->slot.u.dp.v_ptr,
+                                         &cur->slot.u.dp.v);
             goto final;
         }
     }
@@ -4092,7 +8749,7 @@ int bdb_cursor_next(struct dbcursor_t* cur)
     result = cursor_next_key(cur);
 
 final:
-    CS_END(&cur->bdb->critical_section);
+    cursor_unlock(cur);
     return result;
 }
 
@@ -4113,12 +8770,12 @@ int bdb_cursor_nextkey(struct dbcursor_t* cur)
     if (cur->index < 0)
         return NIO_CURSOR_END;
     
-    CS_START(&cur->bdb->critical_section);
+    cursor_lock(cur);
 
     /* 次のキーに進めます。 */
     result = cursor_next_key(cur);
     
-    CS_END(&cur->bdb->critical_section);
+    cursor_unlock(cur);
     return result;
 }
 
@@ -4139,22 +8796,19 @@ int bdb_cursor_prev(struct dbcursor_t* cur)
     if (cur->index < 0)
         return NIO_CURSOR_END;
     
-    if (leaf_cache_get(cur->bdb, cur->node_ptr) < 0)
-        return -1;
-
-    if (cur->bdb->leaf_cache->leaf.node_ptr == cur->bdb->leaf_bot_ptr &&
-        cur->index >= cur->bdb->leaf_cache->leaf.keynum)
-        return NIO_CURSOR_END;
+    cursor_lock(cur);
 
-    CS_START(&cur->bdb->critical_section);
+    result = cursor_check_bottom(cur);
+    if (result != 0)
+        goto final;
 
     if (cur->bdb->dupkey_flag) {
         /* 重複キーの場合は前のデータに位置づけます。*/
         if (cur->slot.u.dp.v.prev_ptr != 0) {
             cur->slot.u.dp.v_ptr = cur->slot.u.dp.v.prev_ptr;
-            result = read_value_header(cur->bdb,
-                                       cur->slot.u.dp.v_ptr,
-                                       &cur->slot.u.dp.v);
+            result = cursor_value_header(cur,
+                                         cur->slot.u.dp.v_ptr,
+                                         &cur->slot.u.dp.v);
             goto final;
         }
     }
@@ -4165,13 +8819,13 @@ int bdb_cursor_prev(struct dbcursor_t* cur)
         /* 2012/11/09 重複索引の最後に位置づけます。*/
         while (cur->slot.u.dp.v.next_ptr != 0) {
             cur->slot.u.dp.v_ptr = cur->slot.u.dp.v.next_ptr;
-            read_value_header(cur->bdb,
-                              cur->slot.u.dp.v_ptr,
-                              &cur->slot.u.dp.v);
+            cursor_value_header(cur,
+                                cur->slot.u.dp.v_ptr,
+                                &cur->slot.u.dp.v);
         }
     }
 final:
-    CS_END(&cur->bdb->critical_section);
+    cursor_unlock(cur);
     return result;
 }
 
@@ -4192,19 +8846,15 @@ int bdb_cursor_prevkey(struct dbcursor_t* cur)
     if (cur->index < 0)
         return NIO_CURSOR_END;
     
-    if (leaf_cache_get(cur->bdb, cur->node_ptr) < 0)
-        return -1;
-
-    if (cur->bdb->leaf_cache->leaf.node_ptr == cur->bdb->leaf_bot_ptr &&
-        cur->index >= cur->bdb->leaf_cache->leaf.keynum)
-        return NIO_CURSOR_END;
-    
-    CS_START(&cur->bdb->critical_section);
+    cursor_lock(cur);
 
-    /* 前のキーに進めます。*/
-    result = cursor_prev_key(cur);
+    result = cursor_check_bottom(cur);
+    if (result == 0) {
+        /* 前のキーに進めます。*/
+        result = cursor_prev_key(cur);
+    }
     
-    CS_END(&cur->bdb->critical_section);
+    cursor_unlock(cur);
     return result;
 }
 
@@ -4215,9 +8865,9 @@ static int seek_duplicate_last(struct dbcursor_t* cur)
         /* 重複キーの場合は次のデータに位置づけます。*/
         while (cur->slot.u.dp.v.next_ptr != 0) {
             cur->slot.u.dp.v_ptr = cur->slot.u.dp.v.next_ptr;
-            result = read_value_header(cur->bdb,
-                                       cur->slot.u.dp.v_ptr,
-                                       &cur->slot.u.dp.v);
+            result = cursor_value_header(cur,
+                                         cur->slot.u.dp.v_ptr,
+                                         &cur->slot.u.dp.v);
             if (result < 0)
                 break;
         }
@@ -4241,9 +8891,9 @@ int bdb_cursor_duplicate_last(struct dbcursor_t* cur)
     if (cur->index < 0)
         return NIO_CURSOR_END;
     
-    CS_START(&cur->bdb->critical_section);
+    cursor_lock(cur);
     result = seek_duplicate_last(cur);
-    CS_END(&cur->bdb->critical_section);
+    cursor_unlock(cur);
     return result;
 }
 
@@ -4269,6 +8919,7 @@ int bdb_cursor_find(struct dbcursor_t* cur, int cond, const void* key, int keysi
 {
     int result = 0;
     int status;
+    struct leaf_cache_t* lc;
 
     switch (cond) {
         case BDB_COND_EQ:
@@ -4281,25 +8932,28 @@ int bdb_cursor_find(struct dbcursor_t* cur, int cond, const void* key, int keysi
             err_write("bdb: bdb_cursor_find() cond error=%d", cond);
             return -1;
     }
+    if (check_keysize(cur->bdb, keysize, "bdb_cursor_find") < 0)
+        return -1;
 
-    CS_START(&cur->bdb->critical_section);
+    cursor_lock(cur);
 
-    status = search_key(cur->bdb, key, keysize, &cur->slot);
+    status = cursor_search_key(cur, key, keysize);
     if (status < 0) {
         result = -1;
         goto final;
     }
 
-    if (status == BDB_KEY_NOTFOUND && cur->bdb->leaf_top_ptr == 0) {
+    if (status == BDB_KEY_NOTFOUND && cur->node_ptr == 0) {
         /* NO DATA */
         result = -1;
         goto final;
     }
     
-    cur->node_ptr = cur->bdb->leaf_cache->leaf.node_ptr;
-
-    if (cursor_get_slot(cur, cur->slot.index) < 0)
-        return -1;
+    lc = cursor_leaf(cur, cur->node_ptr);
+    if (lc == NULL || cursor_get_slot(cur, lc, cur->slot.index) < 0) {
+        result = -1;
+        goto final;
+    }
 
     if (status == BDB_KEY_FOUND) {
         if (cond == BDB_COND_GT) {
@@ -4328,7 +8982,7 @@ int bdb_cursor_find(struct dbcursor_t* cur, int cond, const void* key, int keysi
             seek_duplicate_last(cur);
         } else if (cond == BDB_COND_GT || cond == BDB_COND_GE) {
             /* 2011/10/18 - add at end check */
-            if (cur->index >= cur->bdb->leaf_cache->leaf.keynum) {
+            if (cur->index >= lc->leaf.keynum) {
                 /* 2011/11/03 - next leaf */
                 if (cursor_next_key(cur) != 0)
                     result = -1;
@@ -4339,7 +8993,7 @@ int bdb_cursor_find(struct dbcursor_t* cur, int cond, const void* key, int keysi
     }
 
 final:
-    CS_END(&cur->bdb->critical_section);
+    cursor_unlock(cur);
     return result;
 }
 
@@ -4356,19 +9010,28 @@ final:
 int bdb_cursor_seek(struct dbcursor_t* cur, int pos)
 {
     int result = 0;
+    int64 top_ptr, bot_ptr;
+
+    cursor_lock(cur);
 
-    CS_START(&cur->bdb->critical_section);
+    if (cur->snap) {
+        top_ptr = cur->snap->leaf_top_ptr;
+        bot_ptr = cur->snap->leaf_bot_ptr;
+    } else {
+        top_ptr = cur->bdb->leaf_top_ptr;
+        bot_ptr = cur->bdb->leaf_bot_ptr;
+    }
 
     if (pos == BDB_SEEK_TOP) {
-        if (cur->bdb->leaf_top_ptr != 0) {
-            if (cursor_leaf_top(cur, cur->bdb->leaf_top_ptr) < 0)
+        if (top_ptr != 0) {
+            if (cursor_leaf_top(cur, top_ptr) < 0)
                 result = -1;
         } else {
             result = -1;
         }
     } else if (pos == BDB_SEEK_BOTTOM) {
-        if (cur->bdb->leaf_bot_ptr != 0) {
-            if (cursor_leaf_bot(cur, cur->bdb->leaf_bot_ptr) < 0)
+        if (bot_ptr != 0) {
+            if (cursor_leaf_bot(cur, bot_ptr) < 0)
                 result = -1;
         } else {
             result = -1;
@@ -4378,7 +9041,80 @@ int bdb_cursor_seek(struct dbcursor_t* cur, int pos)
         result = -1;
     }
 
-    CS_END(&cur->bdb->critical_section);
+    cursor_unlock(cur);
+    return result;
+}
+
+/*
+ * カーソルの現在位置を rank 番目(ゼロ起点)のキーに移動します。
+ * ブランチノードの部分木のキー数を辿って位置づけます。
+ * NIO_ORDER_STAT を指定して作成されたデータベースのみ使用できます。
+ * 重複キーの場合は最初の値に位置づけられます。
+ *
+ * cur: カーソル構造体のポインタ
+ * rank: キーの順位
+ *
+ * 正常に処理された場合はゼロを返します。
+ * rank が範囲外かエラーの場合は -1 を返します。
+ */
+int bdb_cursor_seek_rank(struct dbcursor_t* cur, int64 rank)
+{
+    struct bdb_t* bdb;
+    int result = 0;
+    int64 ptr;
+    struct leaf_cache_t* lc;
+
+    bdb = cur->bdb;
+    if (! bdb->count_flag) {
+        err_write("bdb_cursor_seek_rank: database is not created with NIO_ORDER_STAT.");
+        return -1;
+    }
+    if (rank < 0)
+        return -1;
+
+    cursor_lock(cur);
+
+    ptr = (cur->snap)? cur->snap->root_ptr : bdb->root_ptr;
+    if (ptr == 0) {
+        ptr = (cur->snap)? cur->snap->leaf_top_ptr : bdb->leaf_top_ptr;
+    } else {
+        char* buf;
+
+        buf = (char*)alloca(bdb->node_pgsize);
+        while (1) {
+            if (read_node(bdb, snap_ptr(cur->snap, ptr), buf) < 0) {
+                result = -1;
+                goto final;
+            }
+            ptr = bt_rank_child(bdb, buf, &rank);
+            if (ptr < 0) {
+                /* 範囲外 */
+                result = -1;
+                goto final;
+            }
+            if (is_leaf(bdb, snap_ptr(cur->snap, ptr)))
+                break;
+        }
+    }
+    if (ptr == 0) {
+        /* NO DATA */
+        result = -1;
+        goto final;
+    }
+
+    lc = cursor_leaf(cur, ptr);
+    if (lc == NULL || rank >= lc->leaf.keynum) {
+        result = -1;
+        goto final;
+    }
+    if (cursor_get_slot(cur, lc, (int)rank) < 0) {
+        result = -1;
+        goto final;
+    }
+    cur->node_ptr = ptr;
+
+final:
+    cursor_unlock(cur);
     return result;
 }
 
@@ -4396,6 +9132,7 @@ int bdb_cursor_seek(struct dbcursor_t* cur, int pos)
 int bdb_cursor_key(struct dbcursor_t* cur, void* key, int keysize)
 {
     int ksize = -1;
+    struct leaf_cache_t* lc;
     struct bdb_leaf_key_t* kp;
 
     if (cur->index < 0) {
@@ -4403,19 +9140,20 @@ int bdb_cursor_key(struct dbcursor_t* cur, void* key, int keysize)
         return -1;
     }
 
-    CS_START(&cur->bdb->critical_section);
+    cursor_lock(cur);
     
-    if (leaf_cache_get(cur->bdb, cur->node_ptr) < 0)
-        return -1;
+    lc = cursor_leaf(cur, cur->node_ptr);
+    if (lc == NULL)
+        goto final;
 
-    kp = &cur->bdb->leaf_cache->keydata[cur->index];
+    kp = &lc->keydata[cur->index];
     if (keysize < kp->keysize)
         goto final;
     ksize = kp->keysize;
     memcpy(key, kp->key, kp->keysize);
 
 final:
-    CS_END(&cur->bdb->critical_section);
+    cursor_unlock(cur);
     return ksize;
 }
 
@@ -4442,15 +9180,21 @@ int bdb_cursor_value(struct dbcursor_t* cur, void* val, int valsize)
         if (valsize < cur->slot.u.pp.valsize)
             return -1;
     } else {
-        if (valsize < cur->slot.u.dp.v.valsize)
+        if (valsize < cur->slot.u.dp.v.rawsize)
             return -1;
     }
 
-    CS_START(&cur->bdb->critical_section);
+    cursor_lock(cur);
 
     if (cur->bdb->datapack_flag) {
         memcpy(val, cur->slot.u.pp.val, cur->slot.u.pp.valsize);
         vsize = cur->slot.u.pp.valsize;
+    } else if (cur->snap || cur->shared || cur->slot.u.dp.v.codec != NIO_COMP_NONE) {
+        /* 共有ロックのため位置を指定して読み込みます。*/
+        vsize = read_value_data(cur->bdb, (cur->snap)? snap_ptr(cur->snap, cur->slot.u.dp.v_ptr) : cur->slot.u.dp.v_ptr,
+                                &cur->slot.u.dp.v, val, valsize);
+        if (vsize < 0)
+            vsize = -1;
     } else {
         mmap_seek(cur->bdb->nio->mmap, cur->slot.u.dp.v_ptr+BDB_VALUE_SIZE);
         if (mmap_read(cur->bdb->nio->mmap, val, cur->slot.u.dp.v.valsize) != cur->slot.u.dp.v.valsize)
@@ -4459,7 +9203,7 @@ int bdb_cursor_value(struct dbcursor_t* cur, void* val, int valsize)
     }
 
 final:
-    CS_END(&cur->bdb->critical_section);
+    cursor_unlock(cur);
     return vsize;
 }
 
@@ -4477,6 +9221,10 @@ int bdb_cursor_update(struct dbcursor_t* cur, const void* val, int valsize)
 {
     int result = 0;
 
+    if (cur->snap) {
+        err_write("bdb_cursor_update: snapshot cursor is read only.");
+        return -1;
+    }
     if (cur->bdb->datapack_flag) {
         if (valsize > BDB_PACK_DATASIZE) {
             err_write("bdb_cursor_update: valsize is too large, less than %d bytes.", BDB_PACK_DATASIZE);
@@ -4488,17 +9236,42 @@ int bdb_cursor_update(struct dbcursor_t* cur, const void* val, int valsize)
         return -1;
     }
 
-    CS_START(&cur->bdb->critical_section);
+    lock_tree(cur->bdb, LOCK_WRITE);
     
     if (leaf_cache_get(cur->bdb, cur->node_ptr) < 0)
         return -1;
 
     if (cur->bdb->datapack_flag) {
+        if (! pack_value_fits(cur->bdb, cur->bdb->leaf_cache, &cur->slot, valsize)) {
+            struct leaf_cache_t* lc;
+            struct bdb_leaf_key_t* kp;
+            uchar key[NIO_MAX_KEYSIZE];
+            int keysize;
+
+            /* リーフに収まらない場合は削除してから挿入し、
+               挿入したキーにカーソルを位置づけます。*/
+            kp = &cur->bdb->leaf_cache->keydata[cur->slot.index];
+            keysize = kp->keysize;
+            memcpy(key, kp->key, keysize);
+            if (delete_by_key(cur->bdb, key, keysize) < 0 ||
+                put_by_key(cur->bdb, key, keysize, val, valsize) < 0) {
+                result = -1;
+                goto final;
+            }
+            if (cursor_search_key(cur, key, keysize) != BDB_KEY_FOUND) {
+                cur->index = -1;
+                result = -1;
+                goto final;
+            }
+            lc = cursor_leaf(cur, cur->node_ptr);
+            if (lc == NULL || cursor_get_slot(cur, lc, cur->slot.index) < 0)
+                result = -1;
+            goto final;
+        }
         if (update_key_value_pack(cur->bdb,
-                                  &cur->bdb->leaf_cache->leaf,
+                                  cur->bdb->leaf_cache,
                                   &cur->slot,
                                   cur->bdb->leaf_buf,
-                                  cur->bdb->leaf_cache->keydata,
                                   val,
                                   valsize) < 0) {
             result = -1;
@@ -4544,7 +9317,8 @@ int bdb_cursor_update(struct dbcursor_t* cur, const void* val, int valsize)
 
 final:
     update_filesize(cur->bdb);
-    CS_END(&cur->bdb->critical_section);
+    cursor_unpin(cur);
+    unlock_tree(cur->bdb, LOCK_WRITE);
     return result;
 }
 
@@ -4563,6 +9337,10 @@ int bdb_cursor_delete(struct dbcursor_t* cur)
 {
     int result = 0;
 
+    if (cur->snap) {
+        err_write("bdb_cursor_delete: snapshot cursor is read only.");
+        return -1;
+    }
     if (cur->index < 0) {
         err_write("bdb_cursor_delete: current position undefined.");
         return -1;
@@ -4596,12 +9374,12 @@ int bdb_cursor_delete(struct dbcursor_t* cur)
     }
 
     /* 値だけを削除 */
-    CS_START(&cur->bdb->critical_section);
+    lock_tree(cur->bdb, LOCK_WRITE);
 
     /* 領域を解放します。*/
-    if (nio_add_free_list(cur->bdb->nio,
-                          cur->slot.u.dp.v_ptr,
-                          cur->slot.u.dp.v.areasize) < 0) {
+    if (free_space(cur->bdb,
+                   cur->slot.u.dp.v_ptr,
+                   cur->slot.u.dp.v.areasize) < 0) {
         result = -1;
         goto final;
     }
@@ -4646,13 +9424,13 @@ int bdb_cursor_delete(struct dbcursor_t* cur)
     }
 
     /* slotを最新にする。*/
-    if (cursor_get_slot(cur, cur->index) < 0) {
+    if (cursor_get_slot(cur, cur->bdb->leaf_cache, cur->index) < 0) {
         result = 1;
         goto final;
     }
 
 final:
     update_filesize(cur->bdb);
-    CS_END(&cur->bdb->critical_section);
+    unlock_tree(cur->bdb, LOCK_WRITE);
     return result;
 }
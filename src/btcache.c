@@ -29,20 +29,11 @@
 #define API_INTERNAL
 #include "nestalib.h"
 
-struct btk_page_t* btk_alloc_page(struct btkey_t* btkey)
+static void init_page(struct btkey_t* btkey, struct btk_page_t* page)
 {
-    struct btk_page_t* page;
     char* p;
     int i;
 
-    /* insert_key() のために order + 1 で確保する。
-       最後の要素は insert_key() 用の一時領域とする。*/
-    page = (struct btk_page_t*)calloc(1, btkey->page_memsize);
-    if (page == NULL) {
-        err_write("btk_alloc_page: no memory.");
-        return NULL;
-    }
-
     page->keytbl = (struct btk_element_t*)(page+1);
     p = (char*)page->keytbl + (btkey->order+1) * sizeof(struct btk_element_t);
 
@@ -52,6 +43,20 @@ struct btk_page_t* btk_alloc_page(struct btkey_t* btkey)
     }
 
     page->child = (int*)p;
+}
+
+struct btk_page_t* btk_alloc_page(struct btkey_t* btkey)
+{
+    struct btk_page_t* page;
+
+    /* insert_key() のために order + 1 で確保する。
+       最後の要素は insert_key() 用の一時領域とする。*/
+    page = (struct btk_page_t*)calloc(1, btkey->page_memsize);
+    if (page == NULL) {
+        err_write("btk_alloc_page: no memory.");
+        return NULL;
+    }
+    init_page(btkey, page);
     return page;
 }
 
@@ -84,9 +89,19 @@ void btk_free_page(struct btk_page_t* page)
         free(page);
 }
 
+/*
+ * ページキャッシュはページ番号のハッシュ表から枠を引きます。
+ * 参照中のページは固定(pin)されて追い出されません。
+ * 追い出しは CLOCK 方式で参照ビットが落ちている枠を選びます。
+ */
+#define CACHE_NIL   -1
+
+#define CACHE_HASH(c,rpn)   ((unsigned int)(rpn) & (c)->hash_mask)
+
 struct btk_cache_t* btk_cache_alloc(struct btkey_t* btkey, int count)
 {
     struct btk_cache_t* c;
+    int hsize;
     int i;
 
     c = (struct btk_cache_t*)calloc(1, sizeof(struct btk_cache_t));
@@ -103,14 +118,31 @@ struct btk_cache_t* btk_cache_alloc(struct btkey_t* btkey, int count)
 
     c->btkey = btkey;
     c->capacity = count;
+    c->free_index = CACHE_NIL;
+
+    /* ハッシュ表の大きさは枠数以上の２のべき乗にします。*/
+    for (hsize = 16; hsize < count; hsize <<= 1)
+        ;
+    c->hash = (int*)malloc(hsize * sizeof(int));
+    if (c->hash == NULL) {
+        err_write("cache_alloc: no memory count=%d.", count);
+        btk_cache_free(c);
+        return NULL;
+    }
+    for (i = 0; i < hsize; i++)
+        c->hash[i] = CACHE_NIL;
+    c->hash_mask = hsize - 1;
 
+    /* ページ領域は連続して確保してページのポインタから枠を求めます。*/
+    c->pagebuf = (char*)calloc(count, btkey->page_memsize);
+    if (c->pagebuf == NULL) {
+        err_write("cache_alloc: no memory count=%d.", count);
+        btk_cache_free(c);
+        return NULL;
+    }
     for (i = 0; i < count; i++) {
-        c->cache_tbl[i].page = btk_alloc_page(btkey);
-        if (c->cache_tbl[i].page == NULL) {
-            err_write("cache_alloc: no memory count=%d.", count);
-            btk_cache_free(c);
-            return NULL;
-        }
+        c->cache_tbl[i].page = (struct btk_page_t*)(c->pagebuf + (size_t)i * btkey->page_memsize);
+        init_page(btkey, c->cache_tbl[i].page);
     }
     return c;
 }
@@ -118,15 +150,12 @@ struct btk_cache_t* btk_cache_alloc(struct btkey_t* btkey, int count)
 void btk_cache_free(struct btk_cache_t* c)
 {
     if (c != NULL) {
-        if (c->cache_tbl != NULL) {
-            int i;
-
-            for (i = 0; i < c->capacity; i++) {
-                if (c->cache_tbl[i].page != NULL)
-                    btk_free_page(c->cache_tbl[i].page);
-            }
+        if (c->cache_tbl != NULL)
             free(c->cache_tbl);
-        }
+        if (c->pagebuf != NULL)
+            free(c->pagebuf);
+        if (c->hash != NULL)
+            free(c->hash);
         free(c);
     }
 }
@@ -136,37 +165,143 @@ void btk_cache_copy(struct btk_cache_t* c, struct btk_page_t* dst, struct btk_pa
     btk_page_copy(c->btkey, dst, src);
 }
 
+/* ページのポインタからキャッシュの枠を求めます。*/
+static int cache_frame(struct btk_cache_t* c, struct btk_page_t* page)
+{
+    size_t offset;
+
+    if ((char*)page < c->pagebuf)
+        return CACHE_NIL;
+    offset = (char*)page - c->pagebuf;
+    if (offset >= (size_t)c->capacity * c->btkey->page_memsize)
+        return CACHE_NIL;
+    return (int)(offset / c->btkey->page_memsize);
+}
+
+static void cache_free_frame(struct btk_cache_t* c, int index)
+{
+    c->cache_tbl[index].refbit = 0;
+    c->cache_tbl[index].next = c->free_index;
+    c->free_index = index;
+}
+
+static int cache_lookup(struct btk_cache_t* c, int rpn)
+{
+    int index;
+
+    index = c->hash[CACHE_HASH(c, rpn)];
+    while (index != CACHE_NIL) {
+        if (c->cache_tbl[index].rpn == rpn)
+            return index;   /* found */
+        index = c->cache_tbl[index].next;
+    }
+    return CACHE_NIL;   /* notfound */
+}
+
+static void cache_unlink(struct btk_cache_t* c, int index)
+{
+    int* p;
+
+    p = &c->hash[CACHE_HASH(c, c->cache_tbl[index].rpn)];
+    while (*p != CACHE_NIL) {
+        if (*p == index) {
+            *p = c->cache_tbl[index].next;
+            break;
+        }
+        p = &c->cache_tbl[*p].next;
+    }
+    c->cache_tbl[index].rpn = 0;
+    c->cache_tbl[index].next = CACHE_NIL;
+}
+
 int btk_cache_get(struct btk_cache_t* c, int rpn, struct btk_page_t* page)
 {
     if (c != NULL) {
-        int i;
-
-        for (i = 0; i < c->count; i++) {
-            if (c->cache_tbl[i].rpn == rpn) {
-                /* found */
-                btk_cache_copy(c, page, c->cache_tbl[i].page);
-                c->cache_tbl[i].refcnt++;
-                return 1;
-            }
+        int index;
+
+        index = cache_lookup(c, rpn);
+        if (index != CACHE_NIL) {
+            /* found */
+            btk_cache_copy(c, page, c->cache_tbl[index].page);
+            c->cache_tbl[index].refbit = 1;
+            return 1;
         }
     }
     return 0;   /* not found in cache */
 }
 
+/*
+ * キャッシュ上のページを固定してポインタを返します。
+ * ページはコピーされないため内容を変更してはいけません。
+ * 使用後は btk_cache_unpin() で固定を解除します。
+ *
+ * 戻り値
+ *  ページのポインタを返します。
+ *  キャッシュにない場合は NULL を返します。
+ */
+struct btk_page_t* btk_cache_pin(struct btk_cache_t* c, int rpn)
+{
+    if (c != NULL) {
+        int index;
+
+        index = cache_lookup(c, rpn);
+        if (index != CACHE_NIL) {
+            c->cache_tbl[index].pincnt++;
+            c->cache_tbl[index].refbit = 1;
+            return c->cache_tbl[index].page;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * btk_cache_pin() で固定したページの固定を解除します。
+ * 固定中に削除されたページは最後の解除で空き枠になります。
+ */
+void btk_cache_unpin(struct btk_cache_t* c, struct btk_page_t* page)
+{
+    if (c != NULL) {
+        int index;
+
+        index = cache_frame(c, page);
+        if (index != CACHE_NIL && c->cache_tbl[index].pincnt > 0) {
+            if (--c->cache_tbl[index].pincnt == 0 && c->cache_tbl[index].rpn == 0)
+                cache_free_frame(c, index);
+        }
+    }
+}
+
+/* ページがキャッシュにあるか調べます。*/
+int btk_cache_find(struct btk_cache_t* c, int rpn)
+{
+    if (c == NULL)
+        return 0;
+    return (cache_lookup(c, rpn) != CACHE_NIL);
+}
+
 static int cache_out(struct btk_cache_t* c)
 {
-    int i;
-    int index = -1;
-    unsigned int minref = 0xffffffff;
-
-    /* 参照カウントの少ないページをキャッシュアウトの対象とします。*/
-    for (i = 0; i < c->count; i++) {
-        if (c->cache_tbl[i].refcnt < minref) {
-            minref = c->cache_tbl[i].refcnt;
-            index = i;
+    int n;
+
+    /* 参照ビットが落ちている枠をキャッシュアウトの対象とします。
+       参照ビットは針が通過するときに落とします。*/
+    for (n = 0; n < c->capacity * 2; n++) {
+        struct btk_cache_element_t* e;
+        int index;
+
+        index = c->hand;
+        c->hand = (c->hand + 1) % c->capacity;
+        e = &c->cache_tbl[index];
+        if (e->pincnt > 0)
+            continue;
+        if (e->refbit) {
+            e->refbit = 0;
+            continue;
         }
+        cache_unlink(c, index);
+        return index;
     }
-    return index;
+    return CACHE_NIL;   /* すべて固定中 */
 }
 
 void btk_cache_set(struct btk_cache_t* c, int rpn, struct btk_page_t* page)
@@ -174,7 +309,17 @@ void btk_cache_set(struct btk_cache_t* c, int rpn, struct btk_page_t* page)
     if (c != NULL) {
         int index;
 
-        if (c->count < c->capacity) {
+        index = cache_lookup(c, rpn);
+        if (index != CACHE_NIL) {
+            btk_cache_copy(c, c->cache_tbl[index].page, page);
+            return;
+        }
+
+        if (c->free_index != CACHE_NIL) {
+            /* 削除された枠を再利用します。*/
+            index = c->free_index;
+            c->free_index = c->cache_tbl[index].next;
+        } else if (c->count < c->capacity) {
             /* キャッシュに空きがあるので追加 */
             index = c->count++;
         } else {
@@ -182,32 +327,29 @@ void btk_cache_set(struct btk_cache_t* c, int rpn, struct btk_page_t* page)
             index = cache_out(c);
         }
 
-        if (index >= 0) {
-            c->cache_tbl[index].rpn = rpn;
-            btk_cache_copy(c, c->cache_tbl[index].page, page);
-            c->cache_tbl[index].refcnt = 0;
+        if (index != CACHE_NIL) {
+            struct btk_cache_element_t* e;
+            unsigned int h;
+
+            e = &c->cache_tbl[index];
+            e->rpn = rpn;
+            btk_cache_copy(c, e->page, page);
+            e->refbit = 0;
+            e->pincnt = 0;
+            h = CACHE_HASH(c, rpn);
+            e->next = c->hash[h];
+            c->hash[h] = index;
         }
     }
 }
 
-static int is_cachein(struct btk_cache_t* c, int rpn)
-{
-    int i;
-
-    for (i = 0; i < c->count; i++) {
-        if (c->cache_tbl[i].rpn == rpn)
-            return i;   /* found */
-    }
-    return -1;  /* notfound */
-}
-
 void btk_cache_update(struct btk_cache_t* c, int rpn, struct btk_page_t* page)
 {
     if (c != NULL) {
         int index;
 
-        index = is_cachein(c, rpn);
-        if (index >= 0)
+        index = cache_lookup(c, rpn);
+        if (index != CACHE_NIL)
             btk_cache_copy(c, c->cache_tbl[index].page, page);
     }
 }
@@ -217,19 +359,12 @@ void btk_cache_delete(struct btk_cache_t* c, int rpn)
     if (c != NULL) {
         int index;
 
-        index = is_cachein(c, rpn);
-        if (index >= 0) {
-            c->count--;
-            if (index < c->count) {
-                int i;
-
-                for (i = index; i < c->count; i++) {
-                    c->cache_tbl[i].rpn = c->cache_tbl[i+1].rpn;
-                    btk_cache_copy(c, c->cache_tbl[i].page, c->cache_tbl[i+1].page);
-                    c->cache_tbl[i].refcnt = c->cache_tbl[i+1].refcnt;
-                }
-            }
-            btk_clear_page(c->btkey, c->cache_tbl[c->count].page);
+        index = cache_lookup(c, rpn);
+        if (index != CACHE_NIL) {
+            cache_unlink(c, index);
+            /* 固定中の枠は解除されたときに空き枠のリストにつなぎます。*/
+            if (c->cache_tbl[index].pincnt == 0)
+                cache_free_frame(c, index);
         }
     }
 }
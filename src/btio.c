@@ -249,6 +249,7 @@ int btk_put_root(struct btkey_t* btkey, int rpn)
         return -1;
     }
     btkey->root = rpn;
+    btkey->update_count++;
     return 0;
 }
 
@@ -408,6 +409,7 @@ int btk_write_page(struct btkey_t* btkey, int rpn, struct btk_page_t* keypage)
 
     /* キャッシュにあれば内容を更新します。*/
     btk_cache_update(btkey->page_cache, rpn, keypage);
+    btkey->update_count++;
     return 0;
 }
 
@@ -419,6 +421,7 @@ int btk_delete_page(struct btkey_t* btkey, int rpn)
 
     /* キャッシュにあれば削除します。*/
     btk_cache_delete(btkey->page_cache, rpn);
+    btkey->update_count++;
 
     ptr = KEY_PAGE_OFFSET(rpn, btkey->pagesize);
 
@@ -442,3 +445,48 @@ int btk_delete_page(struct btkey_t* btkey, int rpn)
     }
     return btk_put_free(btkey, rpn);
 }
+
+/*
+ * ページを参照用に固定してポインタを返します。
+ * キャッシュにあるページはコピーせずにキャッシュ上の領域を返します。
+ * 返されたページの内容は変更できません。
+ * 使用後は btk_unpin_page() で固定を解除します。
+ *
+ * 戻り値
+ *  ページのポインタを返します。
+ *  エラーの場合は NULL を返します。
+ */
+struct btk_page_t* btk_pin_page(struct btkey_t* btkey, int rpn)
+{
+    struct btk_page_t* page;
+
+    page = btk_cache_pin(btkey->page_cache, rpn);
+    if (page)
+        return page;
+
+    /* 読み込んでキャッシュに設定されたページを固定します。*/
+    if (btk_read_page(btkey, rpn, btkey->wkpage) != 0)
+        return NULL;
+    page = btk_cache_pin(btkey->page_cache, rpn);
+    if (page)
+        return page;
+    /* キャッシュがない場合は作業用ページを返します。*/
+    return btkey->wkpage;
+}
+
+void btk_unpin_page(struct btkey_t* btkey, struct btk_page_t* page)
+{
+    if (page != btkey->wkpage)
+        btk_cache_unpin(btkey->page_cache, page);
+}
+
+/*
+ * これから参照するページの先読みを要求します。
+ * キャッシュにあるページは何もしません。
+ */
+void btk_prefetch_page(struct btkey_t* btkey, int rpn)
+{
+    if (rpn < 1 || btk_cache_find(btkey->page_cache, rpn))
+        return;
+    mmap_prefetch(btkey->mmap, KEY_PAGE_OFFSET(rpn, btkey->pagesize), btkey->pagesize);
+}
@@ -387,19 +387,25 @@ static long find_key(struct btkey_t* btkey,
 
     rpn = btkey->root;
     while (rpn != 0) {
-        int index;
+        struct btk_page_t* page;
+        int index, next;
 
-        if (btk_read_page(btkey, rpn, btkey->wkpage) != 0)
+        /* 参照のみなのでキャッシュ上のページをコピーせずに使用します。*/
+        page = btk_pin_page(btkey, rpn);
+        if (page == NULL)
             break;  /* error */
-        if (search_node(btkey->wkpage, key, btkey->keysize, &index)) {
-            dataptr = btkey->wkpage->keytbl[index].dataptr;
+        if (search_node(page, key, btkey->keysize, &index)) {
+            dataptr = page->keytbl[index].dataptr;
             if (node_rpn != NULL)
                 *node_rpn = rpn;
             if (node_index != NULL)
                 *node_index = index;
+            btk_unpin_page(btkey, page);
             break;  /* found */
         }
-        rpn = btkey->wkpage->child[index];
+        next = page->child[index];
+        btk_unpin_page(btkey, page);
+        rpn = next;
     }
     return dataptr;
 }
@@ -1310,3 +1316,344 @@ APIEXPORT int btdelete(struct btree_t* bt, const void* key, int keysize)
     CS_END(&bt->critical_section);
     return result;
 }
+
+/* カーソルのスタックにページを積みます。
+   キャッシュ上のページは固定して参照します。*/
+static int cursor_push(struct btcursor_t* cur, int rpn, int index)
+{
+    struct btkey_t* btkey = cur->bt->btkey;
+    struct btcursor_stack_t* sp;
+    struct btk_page_t* page;
+
+    if (cur->depth >= BTCURSOR_MAX_DEPTH) {
+        err_write("btcursor: tree is too deep.");
+        return -1;
+    }
+    page = btk_pin_page(btkey, rpn);
+    if (page == NULL)
+        return -1;
+
+    sp = &cur->stack[cur->depth];
+    if (page == btkey->wkpage) {
+        /* キャッシュにない場合は作業用ページを複写して保持します。*/
+        if (sp->copy == NULL) {
+            sp->copy = btk_alloc_page(btkey);
+            if (sp->copy == NULL)
+                return -1;
+        }
+        btk_page_copy(btkey, sp->copy, page);
+        page = sp->copy;
+    }
+    sp->rpn = rpn;
+    sp->index = index;
+    sp->page = page;
+    cur->depth++;
+    return 0;
+}
+
+static void cursor_pop(struct btcursor_t* cur)
+{
+    struct btcursor_stack_t* sp;
+
+    sp = &cur->stack[--cur->depth];
+    btk_unpin_page(cur->bt->btkey, sp->page);
+    sp->page = NULL;
+}
+
+static void cursor_release(struct btcursor_t* cur)
+{
+    while (cur->depth > 0)
+        cursor_pop(cur);
+}
+
+/* 子孫ページを左端のキーまで降ります。
+   次に参照する兄弟ページは先読みしておきます。*/
+static int cursor_descend(struct btcursor_t* cur, int rpn)
+{
+    while (rpn != 0) {
+        struct btk_page_t* page;
+
+        if (cursor_push(cur, rpn, 0) < 0)
+            return -1;
+        page = cur->stack[cur->depth-1].page;
+        if (page->keycount > 0)
+            btk_prefetch_page(cur->bt->btkey, page->child[1]);
+        rpn = page->child[0];
+    }
+    return 0;
+}
+
+/* 子孫ページをたどり終えた場合は親ページの次のキーに位置づけます。
+   位置づけた場合はゼロを返します。キーがない場合は BTCURSOR_END を返します。*/
+static int cursor_ascend(struct btcursor_t* cur)
+{
+    while (cur->depth > 0) {
+        struct btcursor_stack_t* sp;
+
+        sp = &cur->stack[cur->depth-1];
+        if (sp->index < sp->page->keycount)
+            return 0;
+        cursor_pop(cur);
+    }
+    return BTCURSOR_END;
+}
+
+static int cursor_advance(struct btcursor_t* cur);
+
+/* キー値以上(after が真の場合はキー値より大きい)の最初のキーに位置づけます。*/
+static int cursor_locate(struct btcursor_t* cur, const void* key, int after)
+{
+    struct btkey_t* btkey = cur->bt->btkey;
+    int rpn;
+
+    cursor_release(cur);
+    cur->update_count = btkey->update_count;
+
+    rpn = btkey->root;
+    if (key == NULL) {
+        if (cursor_descend(cur, rpn) < 0)
+            return -1;
+        return cursor_ascend(cur);
+    }
+
+    while (rpn != 0) {
+        struct btcursor_stack_t* sp;
+        int index = 0;
+
+        if (cursor_push(cur, rpn, 0) < 0)
+            return -1;
+        sp = &cur->stack[cur->depth-1];
+        if (sp->page->keycount > 0 && search_node(sp->page, key, btkey->keysize, &index)) {
+            sp->index = index;
+            if (after)
+                return cursor_advance(cur);
+            return 0;
+        }
+        sp->index = index;
+        if (index < sp->page->keycount)
+            btk_prefetch_page(btkey, sp->page->child[index+1]);
+        rpn = sp->page->child[index];
+    }
+    return cursor_ascend(cur);
+}
+
+static int cursor_advance(struct btcursor_t* cur)
+{
+    struct btcursor_stack_t* sp;
+    int child;
+
+    if (cur->depth == 0)
+        return BTCURSOR_END;
+
+    /* 更新された場合は現在のキーの次に位置づけ直します。*/
+    if (cur->update_count != cur->bt->btkey->update_count)
+        return cursor_locate(cur, cur->key, 1);
+
+    sp = &cur->stack[cur->depth-1];
+    sp->index++;
+    child = sp->page->child[sp->index];
+    if (child != 0) {
+        /* 右側の子孫ページの左端のキーに進みます。*/
+        if (sp->index < sp->page->keycount)
+            btk_prefetch_page(cur->bt->btkey, sp->page->child[sp->index+1]);
+        if (cursor_descend(cur, child) < 0)
+            return -1;
+    }
+    return cursor_ascend(cur);
+}
+
+/* 位置づけたキーを保存します。*/
+static int cursor_result(struct btcursor_t* cur, int result)
+{
+    if (result == 0) {
+        struct btcursor_stack_t* sp;
+
+        sp = &cur->stack[cur->depth-1];
+        memcpy(cur->key, sp->page->keytbl[sp->index].key, cur->bt->btkey->keysize);
+    } else {
+        cursor_release(cur);
+    }
+    return result;
+}
+
+/*
+ * B-Treeファイルのキーを順に参照するカーソルをオープンします。
+ * カーソルは btcursor_seek() で位置づけてから使用します。
+ * カーソルは参照中のページをキャッシュ上に固定するため
+ * 使用後は btcursor_close() でクローズします。
+ *
+ * bt: B-Treeの構造体のポインタ
+ *
+ * 戻り値
+ *  カーソルの構造体のポインタを返します。
+ *  エラーの場合は NULL を返します。
+ */
+APIEXPORT struct btcursor_t* btcursor_open(struct btree_t* bt)
+{
+    struct btcursor_t* cur;
+
+    cur = (struct btcursor_t*)calloc(1, sizeof(struct btcursor_t));
+    if (cur == NULL) {
+        err_write("btcursor_open: no memory.");
+        return NULL;
+    }
+    cur->key = (char*)calloc(1, bt->btkey->keysize);
+    if (cur->key == NULL) {
+        err_write("btcursor_open: no memory.");
+        free(cur);
+        return NULL;
+    }
+    cur->bt = bt;
+    return cur;
+}
+
+/*
+ * カーソルをクローズします。
+ *
+ * cur: カーソルの構造体のポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+APIEXPORT void btcursor_close(struct btcursor_t* cur)
+{
+    int i;
+
+    CS_START(&cur->bt->critical_section);
+    cursor_release(cur);
+    CS_END(&cur->bt->critical_section);
+
+    for (i = 0; i < BTCURSOR_MAX_DEPTH; i++)
+        btk_free_page(cur->stack[i].copy);
+    free(cur->key);
+    free(cur);
+}
+
+/*
+ * カーソルをキー値以上の最初のキーに位置づけます。
+ * キー値が NULL の場合は先頭のキーに位置づけます。
+ *
+ * cur: カーソルの構造体のポインタ
+ * key: キー値のポインタ
+ * keysize: キー値のサイズ（バイト数）
+ *
+ * 戻り値
+ *  位置づけた場合はゼロを返します。
+ *  該当するキーがない場合は BTCURSOR_END を返します。
+ *  エラーの場合は -1 を返します。
+ */
+APIEXPORT int btcursor_seek(struct btcursor_t* cur, const void* key, int keysize)
+{
+    int result;
+    void* akey = NULL;
+
+    if (key != NULL) {
+        if (keysize > cur->bt->btkey->keysize) {
+            err_write("btcursor_seek: keysize is too long.");
+            return -1;
+        }
+        /* キーサイズを調整します。*/
+        akey = alloca(cur->bt->btkey->keysize);
+        adjust_key(cur->bt->btkey, key, keysize, akey);
+    }
+
+    CS_START(&cur->bt->critical_section);
+    result = cursor_result(cur, cursor_locate(cur, akey, 0));
+    CS_END(&cur->bt->critical_section);
+    return result;
+}
+
+/*
+ * カーソルを次のキーに進めます。
+ * カーソルの位置づけ後にキーが更新された場合は
+ * 直前のキーより大きい最初のキーに進みます。
+ *
+ * cur: カーソルの構造体のポインタ
+ *
+ * 戻り値
+ *  進めた場合はゼロを返します。
+ *  最後のキーを過ぎた場合は BTCURSOR_END を返します。
+ *  エラーの場合は -1 を返します。
+ */
+APIEXPORT int btcursor_next(struct btcursor_t* cur)
+{
+    int result;
+
+    CS_START(&cur->bt->critical_section);
+    result = cursor_result(cur, cursor_advance(cur));
+    CS_END(&cur->bt->critical_section);
+    return result;
+}
+
+/*
+ * カーソルの現在位置のキー値を取得します。
+ * キー値は作成時に指定したキー長で設定されます。
+ *
+ * cur: カーソルの構造体のポインタ
+ * key: キー値が設定される領域のポインタ
+ * keysize: キー値の領域サイズ（バイト数）
+ *
+ * 戻り値
+ *  正常に処理された場合はキー値のバイト数を返します。
+ *  位置づけられていない場合は -1 を返します。
+ *  キー値の領域が足らない場合は -2 を返します。
+ */
+APIEXPORT int btcursor_key(struct btcursor_t* cur, void* key, int keysize)
+{
+    int ksize;
+
+    if (cur->depth == 0)
+        return -1;
+    ksize = cur->bt->btkey->keysize;
+    if (keysize < ksize)
+        return -2;
+    memcpy(key, cur->key, ksize);
+    return ksize;
+}
+
+/*
+ * カーソルの現在位置のデータ値を取得します。
+ * データ値が設定される領域 val は呼び出し側で確保しておきます。
+ *
+ * cur: カーソルの構造体のポインタ
+ * val: データ値のポインタ
+ * valsize: データ値のサイズ（バイト数）
+ *
+ * 戻り値
+ *  正常に処理された場合はデータ値のバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ *  データ値のサイズが足らない場合は -2 を返します。
+ */
+APIEXPORT int btcursor_value(struct btcursor_t* cur, void* val, int valsize)
+{
+    int dsize = -1;
+    long dataptr;
+
+    CS_START(&cur->bt->critical_section);
+
+    /* 更新された場合は同じキーで検索し直します。*/
+    if (cur->depth > 0 && cur->update_count != cur->bt->btkey->update_count)
+        dataptr = find_key(cur->bt->btkey, cur->key, NULL, NULL);
+    else if (cur->depth > 0)
+        dataptr = cur->stack[cur->depth-1].page->keytbl[cur->stack[cur->depth-1].index].dataptr;
+    else
+        dataptr = -1;
+
+    if (dataptr > 0) {
+        dsize = dio_data_size(cur->bt->btdat, dataptr);
+        if (dsize > 0) {
+            if (valsize >= dsize) {
+                if (dio_read(cur->bt->btdat, dataptr, val, dsize) != 0)
+                    dsize = -1;
+            } else {
+                /* 領域不足 */
+                dsize = -2;
+            }
+        }
+    } else if (dataptr == 0) {
+        /* データなし */
+        dsize = 0;
+    }
+    CS_END(&cur->bt->critical_section);
+    return dsize;
+}
@@ -43,6 +43,31 @@
  * データベースファイルの拡張子は .hdb になります。
  * エラーが発生した場合はエラーログに出力されます。
  *
+ * NIO_LOCK_STRIPES プロパティを指定した場合はバケットをストライプ数で
+ * 分割したリーダー／ライターロックで排他制御されます。
+ * 異なるストライプのバケットは複数のスレッドから同時に更新できます。
+ * 空き領域の管理は nio の排他制御で保護されます。
+ *
+ * NIO_LINEAR_HASH プロパティを指定して作成した場合はリニアハッシュ法で
+ * バケット数が拡張されます。キー数が負荷率を超えると hdb_put() の
+ * 延長でバケットをひとつずつ分割するため、全体の再構築は行われません。
+ * 追加されたバケットはセグメント単位(倍々)でファイルの最後に確保されます。
+ *
+ * key-value ヘッダーにはキーのハッシュ値が格納されます(バージョン 12)。
+ * チェインの検索ではハッシュ値が異なるキーは読み込まずに読み飛ばします。
+ * ハッシュ値がゼロのキー(バージョン 11 以前)は従来どおり比較されます。
+ *
+ * hdb_put_ttl() で有効期間(秒)を指定したキーは key-value ヘッダーの直後に
+ * 有効期限が格納されます(バージョン 13)。期限切れのキーは参照時には
+ * 存在しないものとして扱われ、更新時に置換されます。
+ * 期限切れの領域は hdb_reap() でバケット単位にロックしながら回収されます。
+ *
+ * hdb_compact() はバケット単位にロックしながらキーをファイルの先頭に近い
+ * 空き領域に移動してチェインのポインタを書き換えます(nio_compact)。
+ *
+ * hdb_cursor_partition() はバケットを重ならない範囲に分割したカーソルを
+ * 作成します。各カーソルは別々のスレッドから同時に使用できます。
+ *
  * 参考文献：bit別冊「ファイル構造」(1997)共立出版
  */
 
@@ -51,8 +76,9 @@
 /* ヘッダー・ブロック */
 #define HDB_HEADER_SIZE             64
 #define HDB_FILEID                  "NHSK"
-#define HDB_FILE_VERSION            10
+#define HDB_FILE_VERSION            13
 #define HDB_TYPE_HASH               0x01
+#define HDB_TYPE_LINEAR             0x02
 
 #define HDB_VERSION_OFFSET          4
 #define HDB_FILETYPE_OFFSET         6
@@ -60,11 +86,21 @@
 #define HDB_FREEPAGE_OFFSET         16
 #define HDB_BUCKETNUM_OFFSET        24
 #define HDB_ALIGNMENT_OFFSET        28
+#define HDB_LH_SPLIT_OFFSET         32
+#define HDB_LH_LEVEL_OFFSET         36
+#define HDB_LH_RECORDNUM_OFFSET     40
+#define HDB_LH_SEGDIR_OFFSET        48
+#define HDB_LH_LOAD_OFFSET          56
 
 /* バケット管理ブロック */
 #define HDB_BUCKET_SIZE             16      /* +バケット数ｘ8 */
 #define HDB_BUCKET_ID               0xBBEE
 
+/* バケットセグメント管理ブロック（リニアハッシュ） */
+#define HDB_SEGDIR_SIZE             16      /* +HDB_MAX_SEGMENTｘ8 */
+#define HDB_SEGDIR_ID               0xBBED
+#define HDB_MAX_BUCKET              0x7FFFFFFF
+
 /* キーデータ・ブロック */
 #define HDB_KEYVALUE_SIZE           32      /* +キーサイズ+値サイズ */
 
@@ -73,14 +109,50 @@
 #define HDB_KEYVALUE_DSIZE_OFFSET       6
 #define HDB_KEYVALUE_NEXT_OFFSET        10
 #define HDB_KEYVALUE_TIMESTAMP_OFFSET   18
+#define HDB_KEYVALUE_HASH_OFFSET        26
+#define HDB_KEYVALUE_FLAGS_OFFSET       30
+
+/* key-value フラグ */
+#define HDB_KEYVALUE_EXPIRE             0x0001  /* 有効期限あり */
+#define HDB_KEYVALUE_CODEC              0x0006  /* 値の圧縮方式(NIO_COMP_*) */
+#define HDB_KEYVALUE_CODEC_SHIFT        1
+#define HDB_EXPIRE_SIZE                 4       /* 有効期限(秒) */
+
+/* キーと値の位置（有効期限はヘッダーの直後に格納されます）*/
+#define KV_EXT_SIZE(kv)     (((kv)->flags & HDB_KEYVALUE_EXPIRE)? HDB_EXPIRE_SIZE : 0)
+#define KV_KEY_OFFSET(kv)   (HDB_KEYVALUE_SIZE + KV_EXT_SIZE(kv))
+#define KV_VALUE_OFFSET(kv) (KV_KEY_OFFSET(kv) + (kv)->keysize)
+#define KV_EXPIRED(kv,now)  (((kv)->flags & HDB_KEYVALUE_EXPIRE) && (kv)->expire <= (now))
+#define KV_CODEC(kv)        (((kv)->flags & HDB_KEYVALUE_CODEC) >> HDB_KEYVALUE_CODEC_SHIFT)
+#define KV_CODEC_FLAGS(c)   ((ushort)((c) << HDB_KEYVALUE_CODEC_SHIFT))
+
+/* 現在時刻(秒) */
+#define EXPIRE_NOW()        ((unsigned int)(system_time() / 1000000))
 
 /* ハッシュ関数用 */
 #define HASH_SEED                   1487
-#define HASH_FUNC(hdb,k,sz)  ((hdb->hash_func)(k,sz,HASH_SEED) % hdb->bucket_num)
+#define HASH_VALUE(hdb,k,sz) ((hdb->hash_func)(k,sz,HASH_SEED))
+
+/* リニアハッシュの状態(レベルと分割位置) */
+#define LH_LEVEL(st)        ((int)((st) >> 32))
+#define LH_SPLIT(st)        ((int)((st) & 0xFFFFFFFF))
+#define LH_STATE(lv,sp)     (((int64)(lv) << 32) | (int64)(sp))
 
 #define DEFAULT_HASH_FUNC           MurmurHash2A
 #define DEFAULT_BUCKET_SIZE         1000000
 
+/* ロックモード */
+#define LOCK_READ                   0
+#define LOCK_WRITE                  1
+
+/* 分割カーソルが先読みするバケット数 */
+#define CURSOR_PREFETCH_COUNT       16
+
+/* batch operation */
+#define BATCH_GET                   0
+#define BATCH_PUT                   1
+#define BATCH_DELETE                2
+
 /* key-value構造体 */
 struct hdb_keyvalue_t {
     int areasize;                   /* 領域サイズ */
@@ -88,6 +160,9 @@ struct hdb_keyvalue_t {
     int valsize;                    /* 値サイズ */
     int64 nextptr;                  /* 次ポインタ（ゼロは終端） */
     int64 timestamp;                /* タイムスタンプ */
+    unsigned int hashval;           /* キーのハッシュ値（ゼロは未設定） */
+    ushort flags;                   /* フラグ */
+    unsigned int expire;            /* 有効期限（秒） */
 };
 
 static void set_default(struct hdb_t* hdb)
@@ -96,6 +171,214 @@ static void set_default(struct hdb_t* hdb)
     hdb->mmap_view_size = MMAP_AUTO_SIZE;
     hdb->align_bytes = 16;      /* キーデータのアラインメント */
     hdb->filling_rate = 10;     /* 空き領域の充填率 */
+    hdb->lock_stripes = 0;      /* 単一ロック */
+    hdb->lh_load = 0;           /* バケット数固定 */
+}
+
+static int stripe_open(struct hdb_t* hdb)
+{
+    int i;
+
+    if (hdb->lock_stripes < 1)
+        return 0;
+
+    hdb->stripe = (struct hdb_stripe_t*)calloc(hdb->lock_stripes, sizeof(struct hdb_stripe_t));
+    if (hdb->stripe == NULL) {
+        err_write("hdb: no memory.");
+        return -1;
+    }
+    for (i = 0; i < hdb->lock_stripes; i++) {
+        RWLOCK_INIT(&hdb->stripe[i].rwlock);
+        hdb->stripe[i].record_num = hdb->record_num / hdb->lock_stripes;
+    }
+    /* 端数はストライプ 0 に加えて合計を保存されている件数と一致させます。*/
+    hdb->stripe[0].record_num += hdb->record_num % hdb->lock_stripes;
+
+    /* 複数のスレッドから位置を指定して読み書きします。*/
+    mmap_mtsafe(hdb->nio->mmap, 1);
+    return 0;
+}
+
+/* ヘッダーとバケット配列(セグメントを含む)をメモリに固定します。
+   固定できない場合でも処理は継続します。*/
+static void lock_buckets(struct hdb_t* hdb)
+{
+    int64 n;
+    int i;
+
+    if (! hdb->nio->mmap_lock_flag)
+        return;
+    if (mmap_lock(hdb->nio->mmap, 0, HDB_HEADER_SIZE + HDB_BUCKET_SIZE + (int64)hdb->bucket_num * sizeof(int64)) < 0)
+        return;
+    n = hdb->bucket_num;
+    for (i = 1; i < HDB_MAX_SEGMENT && hdb->segment[i] != 0; i++) {
+        mmap_lock(hdb->nio->mmap, hdb->segment[i], n * sizeof(int64));
+        n *= 2;
+    }
+}
+
+static void stripe_close(struct hdb_t* hdb)
+{
+    int i;
+
+    if (hdb->stripe == NULL)
+        return;
+    for (i = 0; i < hdb->lock_stripes; i++)
+        RWLOCK_DELETE(&hdb->stripe[i].rwlock);
+    free(hdb->stripe);
+    hdb->stripe = NULL;
+}
+
+static void lock_bucket(struct hdb_t* hdb, int index, int mode)
+{
+    struct hdb_stripe_t* st;
+
+    if (hdb->stripe == NULL) {
+        CS_START(&hdb->critical_section);
+        return;
+    }
+    st = &hdb->stripe[index % hdb->lock_stripes];
+    if (mode == LOCK_WRITE)
+        RWLOCK_WRLOCK(&st->rwlock);
+    else
+        RWLOCK_RDLOCK(&st->rwlock);
+}
+
+static void unlock_bucket(struct hdb_t* hdb, int index, int mode)
+{
+    struct hdb_stripe_t* st;
+
+    if (hdb->stripe == NULL) {
+        CS_END(&hdb->critical_section);
+        return;
+    }
+    st = &hdb->stripe[index % hdb->lock_stripes];
+    if (mode == LOCK_WRITE)
+        RWLOCK_WRUNLOCK(&st->rwlock);
+    else
+        RWLOCK_RDUNLOCK(&st->rwlock);
+}
+
+static int64 bucket_count(struct hdb_t* hdb)
+{
+    int64 st;
+
+    if (hdb->lh_load == 0)
+        return hdb->bucket_num;
+    st = hdb->lh_state;
+    return ((int64)hdb->bucket_num << LH_LEVEL(st)) + LH_SPLIT(st);
+}
+
+static int bucket_index(struct hdb_t* hdb, unsigned int hv)
+{
+    int64 st, n, index;
+
+    if (hdb->lh_load == 0)
+        return hv % hdb->bucket_num;
+
+    /* 分割済みのバケットは次のレベルで求めます。*/
+    st = hdb->lh_state;
+    n = (int64)hdb->bucket_num << LH_LEVEL(st);
+    index = hv % n;
+    if (index < LH_SPLIT(st))
+        index = hv % (n * 2);
+    return (int)index;
+}
+
+static int lock_key(struct hdb_t* hdb, const void* key, int keysize, int mode)
+{
+    unsigned int hv;
+    int index;
+
+    /* キーのハッシュ値を求めます。*/
+    hv = HASH_VALUE(hdb, key, keysize);
+
+    while (1) {
+        index = bucket_index(hdb, hv);
+        lock_bucket(hdb, index, mode);
+        if (hdb->lh_load == 0)
+            break;
+        /* ロックするまでにバケットが分割された場合はやり直します。*/
+        if (bucket_index(hdb, hv) == index)
+            break;
+        unlock_bucket(hdb, index, mode);
+    }
+    return index;
+}
+
+static void count_record(struct hdb_t* hdb, int index, int n)
+{
+    if (hdb->lh_load == 0)
+        return;
+    /* 書き込みロック中に呼び出されます。*/
+    if (hdb->stripe == NULL)
+        hdb->record_num += n;
+    else
+        hdb->stripe[index % hdb->lock_stripes].record_num += n;
+}
+
+static int64 total_records(struct hdb_t* hdb)
+{
+    int64 n;
+    int i;
+
+    if (hdb->stripe == NULL)
+        return hdb->record_num;
+    n = 0;
+    for (i = 0; i < hdb->lock_stripes; i++)
+        n += hdb->stripe[i].record_num;
+    return n;
+}
+
+static int write_lh_header(struct hdb_t* hdb)
+{
+    char buf[HDB_HEADER_SIZE - HDB_LH_SPLIT_OFFSET];
+    int split, level;
+    int64 recnum;
+    int64 st;
+
+    st = hdb->lh_state;
+    split = LH_SPLIT(st);
+    level = LH_LEVEL(st);
+    recnum = total_records(hdb);
+
+    memcpy(&buf[HDB_LH_SPLIT_OFFSET - HDB_LH_SPLIT_OFFSET], &split, sizeof(split));
+    memcpy(&buf[HDB_LH_LEVEL_OFFSET - HDB_LH_SPLIT_OFFSET], &level, sizeof(level));
+    memcpy(&buf[HDB_LH_RECORDNUM_OFFSET - HDB_LH_SPLIT_OFFSET], &recnum, sizeof(recnum));
+    if (mmap_pwrite(hdb->nio->mmap, buf, HDB_LH_SEGDIR_OFFSET - HDB_LH_SPLIT_OFFSET, HDB_LH_SPLIT_OFFSET) != HDB_LH_SEGDIR_OFFSET - HDB_LH_SPLIT_OFFSET) {
+        err_write("hdb: can't write linear hashing header.");
+        return -1;
+    }
+    return 0;
+}
+
+static int read_lh_header(struct hdb_t* hdb, const char* buf)
+{
+    int split, level;
+    ushort load;
+    char dbuf[HDB_SEGDIR_SIZE + HDB_MAX_SEGMENT * sizeof(int64)];
+    ushort sid;
+
+    memcpy(&split, &buf[HDB_LH_SPLIT_OFFSET], sizeof(split));
+    memcpy(&level, &buf[HDB_LH_LEVEL_OFFSET], sizeof(level));
+    memcpy(&hdb->record_num, &buf[HDB_LH_RECORDNUM_OFFSET], sizeof(int64));
+    memcpy(&hdb->segdir_ptr, &buf[HDB_LH_SEGDIR_OFFSET], sizeof(int64));
+    memcpy(&load, &buf[HDB_LH_LOAD_OFFSET], sizeof(load));
+    hdb->lh_state = LH_STATE(level, split);
+    hdb->lh_load = load;
+
+    /* セグメント管理ブロックの読み込み */
+    if (mmap_pread(hdb->nio->mmap, dbuf, sizeof(dbuf), hdb->segdir_ptr) != sizeof(dbuf)) {
+        err_write("hdb_open: can't read segment directory.");
+        return -1;
+    }
+    memcpy(&sid, dbuf, sizeof(sid));
+    if (sid != HDB_SEGDIR_ID) {
+        err_write("hdb_open: illegal segment-id.");
+        return -1;
+    }
+    memcpy(hdb->segment, &dbuf[HDB_SEGDIR_SIZE], HDB_MAX_SEGMENT * sizeof(int64));
+    return 0;
 }
 
 /*
@@ -127,6 +410,8 @@ struct hdb_t* hdb_initialize(struct nio_t* nio)
 
     /* クリティカルセクションの初期化 */
     CS_INIT(&hdb->critical_section);
+    CS_INIT(&hdb->split_critical_section);
+    CS_INIT(&hdb->cursor_critical_section);
 
     return hdb;
 }
@@ -144,6 +429,8 @@ void hdb_finalize(struct hdb_t* hdb)
 {
     /* クリティカルセクションの削除 */
     CS_DELETE(&hdb->critical_section);
+    CS_DELETE(&hdb->split_critical_section);
+    CS_DELETE(&hdb->cursor_critical_section);
 
     free(hdb);
 }
@@ -196,6 +483,13 @@ void hdb_hashfunc(struct hdb_t* hdb, HASH_FUNCPTR func)
  *     NIO_MAP_VIEWSIZE  マップサイズ
  *     NIO_ALIGN_BYTES   キーデータ境界サイズ
  *     NIO_FILLING_RATE  データ充填率
+ *     NIO_LOCK_STRIPES  ロックストライプ数(ゼロは単一ロック)
+ *     NIO_LINEAR_HASH   リニアハッシュの負荷率(ゼロはバケット数固定)
+ *
+ * NIO_LOCK_STRIPES はオープンする前に設定します。
+ * NIO_LINEAR_HASH は作成時に設定します。既存のファイルは作成時の
+ * 設定でオープンされます。
+ * リニアハッシュの場合 NIO_BUCKET_NUM は初期バケット数になります。
  *
  * hdb: データベースオブジェクトのポインタ
  * kind: プロパティ種類
@@ -221,6 +515,20 @@ int hdb_property(struct hdb_t* hdb, int kind, int value)
         case NIO_FILLING_RATE:
             hdb->filling_rate = value;
             break;
+        case NIO_LOCK_STRIPES:
+            if (value < 0 || hdb->stripe != NULL) {
+                result = -1;
+                break;
+            }
+            hdb->lock_stripes = value;
+            break;
+        case NIO_LINEAR_HASH:
+            if (value < 0 || value > 0xFFFF) {
+                result = -1;
+                break;
+            }
+            hdb->lh_load = value;
+            break;
         default:
             result = -1;
             break;
@@ -246,6 +554,8 @@ int hdb_open(struct hdb_t* hdb, const char* fname)
     int fd;
     char buf[HDB_HEADER_SIZE];
     char fid[4];
+    ushort fver;
+    ushort ftype;
     int64 ctime;
     int64 freeptr;
     int bucket_num;
@@ -268,8 +578,15 @@ int hdb_open(struct hdb_t* hdb, const char* fname)
     }
     hdb->fd = fd;
 
+    /* ログが残っている場合は回復します。*/
+    if (nio_wal_recover(hdb->nio, fd) < 0) {
+        err_write("hdb_open: can't recover: %s.", fname);
+        FILE_CLOSE(fd);
+        return -1;
+    }
+
     /* メモリマップドファイルのオープン */
-    hdb->nio->mmap = mmap_open(fd, MMAP_READWRITE, hdb->mmap_view_size);
+    hdb->nio->mmap = nio_mmap_open(hdb->nio, fd, hdb->mmap_view_size);
     if (hdb->nio->mmap == NULL) {
         err_write("hdb_open: can't open mmap.");
         FILE_CLOSE(fd);
@@ -290,6 +607,16 @@ int hdb_open(struct hdb_t* hdb, const char* fname)
         FILE_CLOSE(fd);
         return -1;
     }
+    /* ファイルバージョン */
+    memcpy(&fver, &buf[HDB_VERSION_OFFSET], sizeof(fver));
+    if (fver > HDB_FILE_VERSION) {
+        err_write("hdb_open: unsupported file version=%d.", fver);
+        mmap_close(hdb->nio->mmap);
+        FILE_CLOSE(fd);
+        return -1;
+    }
+    /* ファイルタイプ */
+    memcpy(&ftype, &buf[HDB_FILETYPE_OFFSET], sizeof(ftype));
 
     /* 作成日時 */
     memcpy(&ctime, &buf[HDB_TIMESTAMP_OFFSET], sizeof(ctime));
@@ -316,6 +643,25 @@ int hdb_open(struct hdb_t* hdb, const char* fname)
         FILE_CLOSE(fd);
         return -1;
     }
+    /* リニアハッシュの状態 */
+    hdb->lh_load = 0;
+    hdb->lh_state = 0;
+    hdb->record_num = 0;
+    memset(hdb->segment, '\0', sizeof(hdb->segment));
+    if (ftype & HDB_TYPE_LINEAR) {
+        if (read_lh_header(hdb, buf) < 0) {
+            mmap_close(hdb->nio->mmap);
+            FILE_CLOSE(fd);
+            return -1;
+        }
+    }
+    /* ロックストライプの作成 */
+    if (stripe_open(hdb) < 0) {
+        mmap_close(hdb->nio->mmap);
+        FILE_CLOSE(fd);
+        return -1;
+    }
+    lock_buckets(hdb);
     return 0;
 }
 
@@ -344,6 +690,7 @@ int hdb_create(struct hdb_t* hdb, const char* fname)
     ushort bid;
     int64* bucket_array;
     int bucket_size;
+    char dbuf[HDB_SEGDIR_SIZE + HDB_MAX_SEGMENT * sizeof(int64)];
 
     if (strlen(fname)+4 > MAX_PATH) {
         err_write("hdb_create: filename is too long.");
@@ -377,6 +724,22 @@ int hdb_create(struct hdb_t* hdb, const char* fname)
     /* アラインメント（2バイト） */
     memcpy(&buf[HDB_ALIGNMENT_OFFSET], &hdb->align_bytes, sizeof(hdb->align_bytes));
 
+    /* リニアハッシュ */
+    hdb->lh_state = 0;
+    hdb->record_num = 0;
+    hdb->segdir_ptr = 0;
+    memset(hdb->segment, '\0', sizeof(hdb->segment));
+    if (hdb->lh_load > 0) {
+        ushort load = (ushort)hdb->lh_load;
+
+        ftype |= HDB_TYPE_LINEAR;
+        memcpy(&buf[HDB_FILETYPE_OFFSET], &ftype, sizeof(ftype));
+        /* セグメント管理ブロックはバケット配列の後に配置します。*/
+        hdb->segdir_ptr = HDB_HEADER_SIZE + HDB_BUCKET_SIZE + (int64)hdb->bucket_num * sizeof(int64);
+        memcpy(&buf[HDB_LH_SEGDIR_OFFSET], &hdb->segdir_ptr, sizeof(int64));
+        memcpy(&buf[HDB_LH_LOAD_OFFSET], &load, sizeof(load));
+    }
+
     /* ヘッダー部の書き出し */
     if (FILE_WRITE(fd, buf, HDB_HEADER_SIZE) != HDB_HEADER_SIZE) {
         err_write("hdb_create: can't write header.");
@@ -412,8 +775,21 @@ int hdb_create(struct hdb_t* hdb, const char* fname)
     }
     free(bucket_array);
 
+    if (hdb->lh_load > 0) {
+        /* セグメント管理部の書き出し */
+        memset(dbuf, '\0', sizeof(dbuf));
+        bid = HDB_SEGDIR_ID;
+        memcpy(dbuf, &bid, sizeof(bid));
+        if (FILE_WRITE(fd, dbuf, sizeof(dbuf)) != sizeof(dbuf)) {
+            err_write("hdb_create: can't write segment directory.");
+            FILE_TRUNCATE(fd, 0);
+            FILE_CLOSE(fd);
+            return -1;
+        }
+    }
+
     /* メモリマップドファイルのオープン */
-    hdb->nio->mmap = mmap_open(fd, MMAP_READWRITE, hdb->mmap_view_size);
+    hdb->nio->mmap = nio_mmap_open(hdb->nio, fd, hdb->mmap_view_size);
     if (hdb->nio->mmap == NULL) {
         err_write("hdb_create: can't open mmap.");
         FILE_TRUNCATE(fd, 0);
@@ -421,6 +797,14 @@ int hdb_create(struct hdb_t* hdb, const char* fname)
         return -1;
     }
     hdb->fd = fd;
+
+    /* ロックストライプの作成 */
+    if (stripe_open(hdb) < 0) {
+        mmap_close(hdb->nio->mmap);
+        FILE_CLOSE(fd);
+        return -1;
+    }
+    lock_buckets(hdb);
     return 0;
 }
 
@@ -434,8 +818,12 @@ int hdb_create(struct hdb_t* hdb, const char* fname)
  */
 void hdb_close(struct hdb_t* hdb)
 {
+    if (hdb->lh_load > 0)
+        write_lh_header(hdb);
+    nio_wal_checkpoint(hdb->nio);
     mmap_close(hdb->nio->mmap);
     FILE_CLOSE(hdb->fd);
+    stripe_close(hdb);
 }
 
 /*
@@ -480,7 +868,6 @@ static int write_keyvalue(struct hdb_t* hdb,
     char buf[HDB_KEYVALUE_SIZE];
 
     /* key-valueヘッダーを編集します。*/
-    mmap_seek(hdb->nio->mmap, offset);
     memset(buf, '\0', HDB_KEYVALUE_SIZE);
 
     /* 領域サイズ */
@@ -493,30 +880,45 @@ static int write_keyvalue(struct hdb_t* hdb,
     memcpy(&buf[HDB_KEYVALUE_NEXT_OFFSET], &kv->nextptr, sizeof(int64));
     /* タイムスタンプ */
     memcpy(&buf[HDB_KEYVALUE_TIMESTAMP_OFFSET], &kv->timestamp, sizeof(int64));
+    /* ハッシュ値 */
+    memcpy(&buf[HDB_KEYVALUE_HASH_OFFSET], &kv->hashval, sizeof(int));
+    /* フラグ */
+    memcpy(&buf[HDB_KEYVALUE_FLAGS_OFFSET], &kv->flags, sizeof(ushort));
 
     /* key-valueヘッダーを書き出します。*/
-    if (mmap_write(hdb->nio->mmap, buf, HDB_KEYVALUE_SIZE) != HDB_KEYVALUE_SIZE)
+    if (mmap_pwrite(hdb->nio->mmap, buf, HDB_KEYVALUE_SIZE, offset) != HDB_KEYVALUE_SIZE)
         return -1;
+    offset += HDB_KEYVALUE_SIZE;
+
+    if (kv->flags & HDB_KEYVALUE_EXPIRE) {
+        /* 有効期限を書き出します。*/
+        if (mmap_pwrite(hdb->nio->mmap, &kv->expire, HDB_EXPIRE_SIZE, offset) != HDB_EXPIRE_SIZE)
+            return -1;
+        offset += HDB_EXPIRE_SIZE;
+    }
 
     if (key && kv->keysize > 0) {
         /* キー値を書き出します。*/
-        if (mmap_write(hdb->nio->mmap, key, kv->keysize) != kv->keysize)
+        if (mmap_pwrite(hdb->nio->mmap, key, kv->keysize, offset) != kv->keysize)
             return -1;
     }
+    offset += kv->keysize;
+
     if (value && kv->valsize > 0) {
         int rbytes;
 
         /* 値を書き出します。*/
-        if (mmap_write(hdb->nio->mmap, value, kv->valsize) != kv->valsize)
+        if (mmap_pwrite(hdb->nio->mmap, value, kv->valsize, offset) != kv->valsize)
             return -1;
-        rbytes = kv->areasize - (HDB_KEYVALUE_SIZE + kv->keysize + kv->valsize);
+        offset += kv->valsize;
+        rbytes = kv->areasize - (KV_VALUE_OFFSET(kv) + kv->valsize);
         if (rbytes > 0) {
             void* abuf;
 
             /* アライメント領域を書き出します。*/
             abuf = alloca(rbytes);
             memset(abuf, '\0', rbytes);
-            if (mmap_write(hdb->nio->mmap, abuf, rbytes) != rbytes)
+            if (mmap_pwrite(hdb->nio->mmap, abuf, rbytes, offset) != rbytes)
                 return -1;
         }
     }
@@ -530,8 +932,7 @@ static int read_keyvalue_header(struct hdb_t* hdb,
     char buf[HDB_KEYVALUE_SIZE];
 
     /* key-valueヘッダーを読み込みます。*/
-    mmap_seek(hdb->nio->mmap, offset);
-    if (mmap_read(hdb->nio->mmap, buf, HDB_KEYVALUE_SIZE) != HDB_KEYVALUE_SIZE)
+    if (mmap_pread(hdb->nio->mmap, buf, HDB_KEYVALUE_SIZE, offset) != HDB_KEYVALUE_SIZE)
         return -1;
 
     /* 領域サイズ */
@@ -544,16 +945,45 @@ static int read_keyvalue_header(struct hdb_t* hdb,
     memcpy(&kv->nextptr, &buf[HDB_KEYVALUE_NEXT_OFFSET], sizeof(int64));
     /* タイムスタンプ */
     memcpy(&kv->timestamp, &buf[HDB_KEYVALUE_TIMESTAMP_OFFSET], sizeof(int64));
+    /* ハッシュ値 */
+    memcpy(&kv->hashval, &buf[HDB_KEYVALUE_HASH_OFFSET], sizeof(int));
+    /* フラグ */
+    memcpy(&kv->flags, &buf[HDB_KEYVALUE_FLAGS_OFFSET], sizeof(ushort));
+
+    kv->expire = 0;
+    if (kv->flags & HDB_KEYVALUE_EXPIRE) {
+        /* 有効期限 */
+        if (mmap_pread(hdb->nio->mmap, &kv->expire, HDB_EXPIRE_SIZE, offset+HDB_KEYVALUE_SIZE) != HDB_EXPIRE_SIZE)
+            return -1;
+    }
     return 0;
 }
 
+static int64 bucket_offset(struct hdb_t* hdb, int index)
+{
+    int64 base;
+    int seg;
+
+    if (index < hdb->bucket_num)
+        return HDB_HEADER_SIZE + HDB_BUCKET_SIZE + (int64)index * sizeof(int64);
+
+    /* 追加されたバケットはセグメントに格納されています。
+       セグメント n には bucket_num * 2^(n-1) 個のバケットがあります。*/
+    seg = 1;
+    base = hdb->bucket_num;
+    while (index >= base * 2) {
+        base *= 2;
+        seg++;
+    }
+    return hdb->segment[seg] + (index - base) * sizeof(int64);
+}
+
 static int update_bucket(struct hdb_t* hdb, int index, int64 dptr)
 {
     int64 offset;
 
-    offset = HDB_HEADER_SIZE + HDB_BUCKET_SIZE + index * sizeof(int64);
-    mmap_seek(hdb->nio->mmap, offset);
-    if (mmap_write(hdb->nio->mmap, &dptr, sizeof(int64)) != sizeof(int64))
+    offset = bucket_offset(hdb, index);
+    if (mmap_pwrite(hdb->nio->mmap, &dptr, sizeof(int64), offset) != sizeof(int64))
         return -1;
     return 0;
 }
@@ -563,9 +993,8 @@ static int64 get_bucket(struct hdb_t* hdb, int index)
     int64 offset;
     int64 dptr;
 
-    offset = HDB_HEADER_SIZE + HDB_BUCKET_SIZE + index * sizeof(int64);
-    mmap_seek(hdb->nio->mmap, offset);
-    if (mmap_read(hdb->nio->mmap, &dptr, sizeof(int64)) != sizeof(int64))
+    offset = bucket_offset(hdb, index);
+    if (mmap_pread(hdb->nio->mmap, &dptr, sizeof(int64), offset) != sizeof(int64))
         return -1;
     return dptr;
 }
@@ -576,14 +1005,16 @@ static int add_keyvalue(struct hdb_t* hdb,
                         int keysize,
                         const void* val,
                         int valsize,
-                        int64 cas)
+                        int64 cas,
+                        unsigned int expire,
+                        int codec)
 {
     int rsize, areasize;
     int64 bptr, ptr;
     struct hdb_keyvalue_t kv;
 
     /* key-value を書き出す領域を取得します。*/
-    rsize = HDB_KEYVALUE_SIZE + keysize + valsize;
+    rsize = HDB_KEYVALUE_SIZE + ((expire)? HDB_EXPIRE_SIZE : 0) + keysize + valsize;
     if (hdb->align_bytes > 0) {
         if (rsize % hdb->align_bytes)
             rsize = (rsize / hdb->align_bytes + 1) * hdb->align_bytes;
@@ -599,6 +1030,12 @@ static int add_keyvalue(struct hdb_t* hdb,
     kv.valsize = valsize;
     kv.nextptr = 0;
     kv.timestamp = (cas == 0)? system_time() : cas;
+    kv.hashval = HASH_VALUE(hdb, key, keysize);
+    if (expire) {
+        kv.flags = HDB_KEYVALUE_EXPIRE;
+        kv.expire = expire;
+    }
+    kv.flags |= KV_CODEC_FLAGS(codec);
 
     bptr = get_bucket(hdb, index);
     if (bptr != 0) {
@@ -626,21 +1063,24 @@ static int64 find_key(struct hdb_t* hdb,
                       struct hdb_keyvalue_t* kv)
 {
     char* tkey;
+    unsigned int hv;
 
     if (ptr == 0) {
         /* not found */
         return 0;
     }
 
-    /* 線形リストを順次検索します。*/
+    /* 線形リストを順次検索します。
+       ハッシュ値が異なるキーはキーを読み込まずに読み飛ばします。*/
+    hv = HASH_VALUE(hdb, key, keysize);
     tkey = (char*)alloca(keysize);
     while (ptr != 0) {
         if (read_keyvalue_header(hdb, ptr, kv) < 0) {
             err_write("find_key: can't read key-value, ptr=%ld", ptr);
             return -1;
         }
-        if (kv->keysize == keysize) {
-            if (mmap_read(hdb->nio->mmap, tkey, keysize) != keysize) {
+        if (kv->keysize == keysize && (kv->hashval == 0 || kv->hashval == hv)) {
+            if (mmap_pread(hdb->nio->mmap, tkey, keysize, ptr+KV_KEY_OFFSET(kv)) != keysize) {
                 err_write("find_key: can't mmap_read");
                 return -1;
             }
@@ -654,6 +1094,21 @@ static int64 find_key(struct hdb_t* hdb,
     return 0;  /* not found */
 }
 
+static int64 find_live_key(struct hdb_t* hdb,
+                           int64 ptr,
+                           const void* key,
+                           int keysize,
+                           struct hdb_keyvalue_t* kv)
+{
+    int64 dptr;
+
+    /* 期限切れのキーは存在しないものとして扱います。*/
+    dptr = find_key(hdb, ptr, key, keysize, kv);
+    if (dptr > 0 && KV_EXPIRED(kv, EXPIRE_NOW()))
+        return 0;
+    return dptr;
+}
+
 static int remove_chain_keyvalue(struct hdb_t* hdb,
                                  int index,
                                  int64 del_ptr,
@@ -691,139 +1146,522 @@ static int remove_chain_keyvalue(struct hdb_t* hdb,
     return -1;  /* notfound */
 }
 
-/*
- * データベースからキーを検索して値のサイズを取得します。
- *
- * hdb: ハッシュデータベース構造体のポインタ
- * key: キーのポインタ
- * keysize: キーのサイズ
- *
- * キー値を存在していた場合は値のサイズを返します。
- * キーが存在しない場合は -1 を返します。
- */
-int hdb_find(struct hdb_t* hdb, const void* key, int keysize)
+static void lock_bucket2(struct hdb_t* hdb, int index1, int index2, int mode)
 {
-    int dsize = 0;
-    int hindex;
-    struct hdb_keyvalue_t kv;
-    int64 bptr, dptr;
-
-    if (keysize > NIO_MAX_KEYSIZE) {
-        err_write("hdb_find: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
-        return -1;
-    }
-
-    CS_START(&hdb->critical_section);
-
-    /* キーのハッシュ値を求めます。*/
-    hindex = HASH_FUNC(hdb, key, keysize);
+    int s1, s2;
 
-    /* バケット値を取得します。*/
-    bptr = get_bucket(hdb, hindex);
-    if (bptr == 0) {
-        /* not found */
-        dsize = -1;
-        goto final;
+    if (hdb->stripe == NULL) {
+        lock_bucket(hdb, index1, mode);
+        return;
     }
-
-    dptr = find_key(hdb, bptr, key, keysize, &kv);
-    if (dptr <= 0) {
-        dsize = -1;
-        goto final;
+    s1 = index1 % hdb->lock_stripes;
+    s2 = index2 % hdb->lock_stripes;
+    if (s1 == s2) {
+        lock_bucket(hdb, index1, mode);
+    } else if (s1 < s2) {
+        lock_bucket(hdb, index1, mode);
+        lock_bucket(hdb, index2, mode);
+    } else {
+        lock_bucket(hdb, index2, mode);
+        lock_bucket(hdb, index1, mode);
     }
-    dsize = kv.valsize;
-
-final:
-    CS_END(&hdb->critical_section);
-    return dsize;
 }
 
-/*
- * データベースからキーを検索して値をポインタに設定します。
- *
- * hdb: ハッシュデータベース構造体のポインタ
- * key: キーのポインタ
- * keysize: キーのサイズ
- * val: 値のポインタ
- * valsize: 値の領域サイズ
- *
- * キー値を取得できた場合は値のサイズを返します。
- * キーが存在しない場合は -1 を返します。
- * 値の領域が不足している場合は -2 を返します。
- * その他のエラーの場合は負の値を返します。
- */
-int hdb_get(struct hdb_t* hdb, const void* key, int keysize, void* val, int valsize)
+static void unlock_bucket2(struct hdb_t* hdb, int index1, int index2, int mode)
 {
-    return hdb_gets(hdb, key, keysize, val, valsize, NULL);
+    unlock_bucket(hdb, index1, mode);
+    if (hdb->stripe != NULL) {
+        if (index1 % hdb->lock_stripes != index2 % hdb->lock_stripes)
+            unlock_bucket(hdb, index2, mode);
+    }
 }
 
-/*
- * データベースからキーを検索して値をポインタに設定します。
- * 楽観的排他制御を実現するためのユニークな値を取得します。
- *
- * hdb: ハッシュデータベース構造体のポインタ
- * key: キーのポインタ
- * keysize: キーのサイズ
- * val: 値のポインタ
- * valsize: 値の領域サイズ
- * cas: 楽観的排他制御のための値のポインタ
- *
- * キー値を取得できた場合は値のサイズを返します。
- * キーが存在しない場合は -1 を返します。
- * 値の領域が不足している場合は -2 を返します。
- * その他のエラーの場合は負の値を返します。
- */
-int hdb_gets(struct hdb_t* hdb, const void* key, int keysize, void* val, int valsize, int64* cas)
+static int set_nextptr(struct hdb_t* hdb, int64 ptr, int64 nextptr)
 {
-    int dsize = 0;
-    int hindex;
-    struct hdb_keyvalue_t kv;
-    int64 bptr, dptr;
-
-    if (keysize > NIO_MAX_KEYSIZE) {
-        err_write("hdb_gets: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
+    if (mmap_pwrite(hdb->nio->mmap, &nextptr, sizeof(int64), ptr+HDB_KEYVALUE_NEXT_OFFSET) != sizeof(int64)) {
+        err_write("set_nextptr: can't write next pointer, ptr=%lld", ptr);
         return -1;
     }
+    return 0;
+}
 
-    CS_START(&hdb->critical_section);
+static int split_chain(struct hdb_t* hdb, int index, int new_index, int64 n)
+{
+    int64 ptr;
+    int64 head[2], tail[2], tail_next[2];
+    char keybuf[NIO_MAX_KEYSIZE];
+    int i;
 
-    /* キーのハッシュ値を求めます。*/
-    hindex = HASH_FUNC(hdb, key, keysize);
+    for (i = 0; i < 2; i++) {
+        head[i] = 0;
+        tail[i] = 0;
+        tail_next[i] = 0;
+    }
 
-    /* バケット値を取得します。*/
-    bptr = get_bucket(hdb, hindex);
+    /* チェインのキーを次のレベルのハッシュ値で２つのチェインに振り分けます。
+       キーの順序は保存されます。*/
+    ptr = get_bucket(hdb, index);
+    while (ptr > 0) {
+        struct hdb_keyvalue_t kv;
+        unsigned int hv;
 
-    if (bptr == 0) {
-        /* not found */
-        dsize = -1;
-        goto final;
-    }
+        if (read_keyvalue_header(hdb, ptr, &kv) < 0) {
+            err_write("split_chain: can't read key-value, ptr=%lld", ptr);
+            return -1;
+        }
+        hv = kv.hashval;
+        if (hv == 0) {
+            /* ハッシュ値が格納されていない場合はキーから求めます。*/
+            if (mmap_pread(hdb->nio->mmap, keybuf, kv.keysize, ptr+KV_KEY_OFFSET(&kv)) != kv.keysize) {
+                err_write("split_chain: can't mmap_read");
+                return -1;
+            }
+            hv = HASH_VALUE(hdb, keybuf, kv.keysize);
+        }
+        i = (hv % (n * 2) == (unsigned int)index)? 0 : 1;
 
-    dptr = find_key(hdb, bptr, key, keysize, &kv);
-    if (dptr < 0) {
-        dsize = -3;
-        goto final;
-    } else if (dptr == 0) {
-        dsize = -1;
-        goto final;
+        if (tail[i] == 0)
+            head[i] = ptr;
+        else if (tail_next[i] != ptr) {
+            if (set_nextptr(hdb, tail[i], ptr) < 0)
+                return -1;
+        }
+        tail[i] = ptr;
+        tail_next[i] = kv.nextptr;
+        ptr = kv.nextptr;
     }
 
-    if (kv.valsize > valsize) {
-        /* 領域不足 */
-        dsize = -2;
-    } else {
-        if (mmap_read(hdb->nio->mmap, val, kv.valsize) != kv.valsize) {
-            err_write("hdb_get: can't mmap_read.");
-            return -1;
+    for (i = 0; i < 2; i++) {
+        if (tail[i] != 0 && tail_next[i] != 0) {
+            if (set_nextptr(hdb, tail[i], 0) < 0)
+                return -1;
         }
-        dsize = kv.valsize;
-        if (cas != NULL)
-            *cas = kv.timestamp;
     }
+    if (update_bucket(hdb, index, head[0]) < 0)
+        return -1;
+    if (update_bucket(hdb, new_index, head[1]) < 0)
+        return -1;
+    return 0;
+}
 
-final:
-    CS_END(&hdb->critical_section);
-    return dsize;
+static int need_split(struct hdb_t* hdb, int index)
+{
+    int64 n;
+
+    if (hdb->lh_load == 0)
+        return 0;
+    if (hdb->stripe == NULL)
+        n = hdb->record_num;
+    else
+        n = hdb->stripe[index % hdb->lock_stripes].record_num * hdb->lock_stripes;
+    return (n > bucket_count(hdb) * hdb->lh_load);
+}
+
+static int split_bucket(struct hdb_t* hdb, int index)
+{
+    int result = 0;
+    int64 st, n;
+    int level, split, new_index;
+
+    CS_START(&hdb->split_critical_section);
+
+    /* 他のスレッドで分割されている場合があるので再度判定します。*/
+    if (! need_split(hdb, index))
+        goto final;
+
+    st = hdb->lh_state;
+    level = LH_LEVEL(st);
+    split = LH_SPLIT(st);
+    n = (int64)hdb->bucket_num << level;
+    if (n * 2 > HDB_MAX_BUCKET || level+1 >= HDB_MAX_SEGMENT)
+        goto final;     /* これ以上は拡張しません */
+    new_index = (int)(n + split);
+
+    /* セグメントの確保から分割位置の書き出しまでを
+       二つのバケットのロックの中で一つのトランザクションとして行います。*/
+    lock_bucket2(hdb, split, new_index, LOCK_WRITE);
+    nio_tx_begin(hdb->nio);
+    if (hdb->segment[level+1] == 0) {
+        int64 segptr;
+
+        /* 新しいセグメントをファイルの最後に確保します。
+           バケットは分割時に設定されるため初期化は不要です。*/
+        segptr = nio_extend_space(hdb->nio, n * sizeof(int64));
+        if (mmap_pwrite(hdb->nio->mmap, &segptr, sizeof(int64),
+                        hdb->segdir_ptr + HDB_SEGDIR_SIZE + (level+1) * sizeof(int64)) != sizeof(int64)) {
+            err_write("split_bucket: can't write segment directory.");
+            result = -1;
+        } else {
+            hdb->segment[level+1] = segptr;
+            if (hdb->nio->mmap_lock_flag)
+                mmap_lock(hdb->nio->mmap, segptr, n * sizeof(int64));
+        }
+    }
+    if (result == 0)
+        result = split_chain(hdb, split, new_index, n);
+    if (result == 0) {
+        /* 分割位置を進めます。*/
+        if (split+1 >= n)
+            hdb->lh_state = LH_STATE(level+1, 0);
+        else
+            hdb->lh_state = LH_STATE(level, split+1);
+        result = write_lh_header(hdb);
+    }
+    nio_tx_end(hdb->nio);
+    unlock_bucket2(hdb, split, new_index, LOCK_WRITE);
+
+final:
+    CS_END(&hdb->split_critical_section);
+    return result;
+}
+
+/* 値のサイズを返します。圧縮されている場合は元の値のサイズです。*/
+static int value_size(struct hdb_t* hdb, int64 dptr, struct hdb_keyvalue_t* kv)
+{
+    int size;
+
+    if (KV_CODEC(kv) == NIO_COMP_NONE)
+        return kv->valsize;
+    if (mmap_pread(hdb->nio->mmap, &size, sizeof(int), dptr+KV_VALUE_OFFSET(kv)) != sizeof(int)) {
+        err_write("hdb: can't mmap_read.");
+        return -1;
+    }
+    return size;
+}
+
+/* 圧縮された値を読み込んで展開します。
+   マップ上にある場合はコピーせずに展開します。
+   値の領域が不足している場合は -2 を返します。*/
+static int read_value(struct hdb_t* hdb, int64 dptr, struct hdb_keyvalue_t* kv, void* val, int valsize)
+{
+    char* cval;
+    int64 vptr;
+    int dsize;
+
+    vptr = dptr + KV_VALUE_OFFSET(kv);
+    cval = mmap_pin(hdb->nio->mmap, vptr, kv->valsize);
+    if (cval) {
+        dsize = nio_value_uncompress(KV_CODEC(kv), cval, kv->valsize, val, valsize);
+        mmap_unpin(hdb->nio->mmap);
+        return dsize;
+    }
+
+    cval = (char*)malloc(kv->valsize);
+    if (cval == NULL) {
+        err_write("hdb: no memory %d bytes.", kv->valsize);
+        return -1;
+    }
+    if (mmap_pread(hdb->nio->mmap, cval, kv->valsize, vptr) != kv->valsize) {
+        err_write("hdb: can't mmap_read.");
+        free(cval);
+        return -1;
+    }
+    dsize = nio_value_uncompress(KV_CODEC(kv), cval, kv->valsize, val, valsize);
+    free(cval);
+    return dsize;
+}
+
+/* 値の領域を確保して読み込みます。*/
+static void* alloc_value(struct hdb_t* hdb, int64 dptr, struct hdb_keyvalue_t* kv, int* valsize)
+{
+    void* val;
+    int size;
+
+    size = value_size(hdb, dptr, kv);
+    if (size < 0)
+        return NULL;
+    val = malloc(size);
+    if (val == NULL) {
+        err_write("hdb: no memory %d bytes.", size);
+        return NULL;
+    }
+    if (KV_CODEC(kv) == NIO_COMP_NONE) {
+        if (mmap_pread(hdb->nio->mmap, val, size, dptr+KV_VALUE_OFFSET(kv)) != size) {
+            err_write("hdb: can't mmap_read.");
+            free(val);
+            return NULL;
+        }
+    } else if (read_value(hdb, dptr, kv, val, size) != size) {
+        free(val);
+        return NULL;
+    }
+    *valsize = size;
+    return val;
+}
+
+static int get_value(struct hdb_t* hdb,
+                     int hindex,
+                     const void* key,
+                     int keysize,
+                     void* val,
+                     int valsize,
+                     int64* cas)
+{
+    struct hdb_keyvalue_t kv;
+    int64 bptr, dptr;
+
+    /* バケット値を取得します。*/
+    bptr = get_bucket(hdb, hindex);
+    if (bptr == 0)
+        return -1;      /* not found */
+
+    dptr = find_live_key(hdb, bptr, key, keysize, &kv);
+    if (dptr < 0)
+        return -3;
+    else if (dptr == 0)
+        return -1;
+
+    if (KV_CODEC(&kv) != NIO_COMP_NONE) {
+        int dsize;
+
+        dsize = read_value(hdb, dptr, &kv, val, valsize);
+        if (dsize < 0)
+            return dsize;
+        if (cas != NULL)
+            *cas = kv.timestamp;
+        return dsize;
+    }
+
+    if (kv.valsize > valsize)
+        return -2;      /* 領域不足 */
+
+    if (mmap_pread(hdb->nio->mmap, val, kv.valsize, dptr+KV_VALUE_OFFSET(&kv)) != kv.valsize) {
+        err_write("hdb_get: can't mmap_read.");
+        return -1;
+    }
+    if (cas != NULL)
+        *cas = kv.timestamp;
+    return kv.valsize;
+}
+
+static int replace_value(struct hdb_t* hdb,
+                         int hindex,
+                         int64 dptr,
+                         struct hdb_keyvalue_t* kv,
+                         const void* key,
+                         int keysize,
+                         const void* val,
+                         int valsize,
+                         int64 cas,
+                         unsigned int expire,
+                         int codec)
+{
+    ushort flags;
+
+    flags = (expire)? HDB_KEYVALUE_EXPIRE : 0;
+
+    /* 既存の領域に書き出せるか調べます。*/
+    if (kv->areasize >= HDB_KEYVALUE_SIZE + ((expire)? HDB_EXPIRE_SIZE : 0) + kv->keysize + valsize) {
+        int rewrite;
+
+        /* 有効期限の有無が変わる場合はキーの位置が変わるので全体を書き出します。*/
+        rewrite = ((kv->flags & HDB_KEYVALUE_EXPIRE) != flags);
+        kv->flags = (kv->flags & ~(HDB_KEYVALUE_EXPIRE|HDB_KEYVALUE_CODEC)) | flags | KV_CODEC_FLAGS(codec);
+        kv->expire = expire;
+        kv->valsize = valsize;
+        /* timestampを更新します。*/
+        kv->timestamp = (cas == 0)? system_time() : cas;
+
+        if (rewrite)
+            return write_keyvalue(hdb, dptr, kv, key, val);
+
+        /* 値を更新します。*/
+        if (mmap_pwrite(hdb->nio->mmap, val, valsize, dptr+KV_VALUE_OFFSET(kv)) != valsize) {
+            err_write("hdb_put: can't mmap_write.");
+            return -1;
+        }
+        /* key-valueヘッダーを更新します。*/
+        if (write_keyvalue(hdb, dptr, kv, NULL, NULL) < 0) {
+            err_write("hdb_put: can't write key-value header.");
+            return -1;
+        }
+        return 0;
+    }
+
+    /* 収まらないので新たな領域に書き出します。*/
+    /* 元の領域のリンクを切ります。*/
+    if (remove_chain_keyvalue(hdb, hindex, dptr, kv) < 0)
+        return -1;
+    /* 元の領域をフリーリストに登録します。*/
+    nio_add_free_list(hdb->nio, dptr, kv->areasize);
+    /* ファイルの最後に追加します。*/
+    return add_keyvalue(hdb, hindex, key, keysize, val, valsize, cas, expire, codec);
+}
+
+static int put_value(struct hdb_t* hdb,
+                     int hindex,
+                     const void* key,
+                     int keysize,
+                     const void* val,
+                     int valsize,
+                     int64 cas,
+                     unsigned int expire,
+                     int codec,
+                     int* added)
+{
+    int result = 0;
+    struct hdb_keyvalue_t kv;
+    int64 bptr, dptr;
+
+    /* バケット値を取得します。*/
+    bptr = get_bucket(hdb, hindex);
+
+    /* キー値が存在するか調べます。*/
+    dptr = find_key(hdb, bptr, key, keysize, &kv);
+    if (dptr < 0) {
+        result = -1;
+        goto final;
+    }
+
+    if (dptr == 0) {
+        /* 新規に追加します。*/
+        if (add_keyvalue(hdb, hindex, key, keysize, val, valsize, 0, expire, codec) < 0)
+            result = -1;
+        else {
+            count_record(hdb, hindex, 1);
+            *added += 1;
+        }
+    } else {
+        if (cas != 0) {
+            /* 期限切れのキーは一致しないものとして扱います。*/
+            if (kv.timestamp != cas || KV_EXPIRED(&kv, EXPIRE_NOW())) {
+                err_write("hdb_puts: cas(compare and swap) error.");
+                result = -2;
+                goto final;
+            }
+        }
+        result = replace_value(hdb, hindex, dptr, &kv, key, keysize, val, valsize, 0, expire, codec);
+    }
+
+final:
+    return result;
+}
+
+static int delete_value(struct hdb_t* hdb, int hindex, const void* key, int keysize)
+{
+    int result = 0;
+    struct hdb_keyvalue_t kv;
+    int64 bptr, dptr;
+
+    /* バケット値を取得します。*/
+    bptr = get_bucket(hdb, hindex);
+
+    /* キー値が存在するか調べます。*/
+    dptr = find_key(hdb, bptr, key, keysize, &kv);
+    if (dptr > 0) {
+        /* 領域のリストを切ります。*/
+        if (remove_chain_keyvalue(hdb, hindex, dptr, &kv) == 0) {
+            /* 領域をフリーリストに登録します。*/
+            nio_add_free_list(hdb->nio, dptr, kv.areasize);
+            count_record(hdb, hindex, -1);
+            /* 期限切れのキーは領域を回収して存在しないものとします。*/
+            if (KV_EXPIRED(&kv, EXPIRE_NOW()))
+                result = -1;
+        } else {
+            result = -1;
+        }
+    } else {
+        result = -1;
+    }
+
+    return result;
+}
+
+/*
+ * データベースからキーを検索して値のサイズを取得します。
+ *
+ * hdb: ハッシュデータベース構造体のポインタ
+ * key: キーのポインタ
+ * keysize: キーのサイズ
+ *
+ * キー値を存在していた場合は値のサイズを返します。
+ * キーが存在しない場合は -1 を返します。
+ */
+int hdb_find(struct hdb_t* hdb, const void* key, int keysize)
+{
+    int dsize = 0;
+    int hindex;
+    struct hdb_keyvalue_t kv;
+    int64 bptr, dptr;
+
+    if (keysize > NIO_MAX_KEYSIZE) {
+        err_write("hdb_find: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
+        return -1;
+    }
+
+    /* キーのハッシュ値を求めてバケットをロックします。*/
+    hindex = lock_key(hdb, key, keysize, LOCK_READ);
+
+    /* バケット値を取得します。*/
+    bptr = get_bucket(hdb, hindex);
+    if (bptr == 0) {
+        /* not found */
+        dsize = -1;
+        goto final;
+    }
+
+    dptr = find_live_key(hdb, bptr, key, keysize, &kv);
+    if (dptr <= 0) {
+        dsize = -1;
+        goto final;
+    }
+    dsize = value_size(hdb, dptr, &kv);
+
+final:
+    unlock_bucket(hdb, hindex, LOCK_READ);
+    return dsize;
+}
+
+/*
+ * データベースからキーを検索して値をポインタに設定します。
+ *
+ * hdb: ハッシュデータベース構造体のポインタ
+ * key: キーのポインタ
+ * keysize: キーのサイズ
+ * val: 値のポインタ
+ * valsize: 値の領域サイズ
+ *
+ * キー値を取得できた場合は値のサイズを返します。
+ * キーが存在しない場合は -1 を返します。
+ * 値の領域が不足している場合は -2 を返します。
+ * その他のエラーの場合は負の値を返します。
+ */
+int hdb_get(struct hdb_t* hdb, const void* key, int keysize, void* val, int valsize)
+{
+    return hdb_gets(hdb, key, keysize, val, valsize, NULL);
+}
+
+/*
+ * データベースからキーを検索して値をポインタに設定します。
+ * 楽観的排他制御を実現するためのユニークな値を取得します。
+ *
+ * hdb: ハッシュデータベース構造体のポインタ
+ * key: キーのポインタ
+ * keysize: キーのサイズ
+ * val: 値のポインタ
+ * valsize: 値の領域サイズ
+ * cas: 楽観的排他制御のための値のポインタ
+ *
+ * キー値を取得できた場合は値のサイズを返します。
+ * キーが存在しない場合は -1 を返します。
+ * 値の領域が不足している場合は -2 を返します。
+ * その他のエラーの場合は負の値を返します。
+ */
+int hdb_gets(struct hdb_t* hdb, const void* key, int keysize, void* val, int valsize, int64* cas)
+{
+    int dsize;
+    int hindex;
+
+    if (keysize > NIO_MAX_KEYSIZE) {
+        err_write("hdb_gets: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
+        return -1;
+    }
+
+    /* キーのハッシュ値を求めてバケットをロックします。*/
+    hindex = lock_key(hdb, key, keysize, LOCK_READ);
+    dsize = get_value(hdb, hindex, key, keysize, val, valsize, cas);
+    unlock_bucket(hdb, hindex, LOCK_READ);
+    return dsize;
 }
 
 /*
@@ -874,10 +1712,8 @@ void* hdb_agets(struct hdb_t* hdb, const void* key, int keysize, int* valsize, i
         return NULL;
     }
 
-    CS_START(&hdb->critical_section);
-
-    /* キーのハッシュ値を求めます。*/
-    hindex = HASH_FUNC(hdb, key, keysize);
+    /* キーのハッシュ値を求めてバケットをロックします。*/
+    hindex = lock_key(hdb, key, keysize, LOCK_READ);
 
     /* バケット値を取得します。*/
     bptr = get_bucket(hdb, hindex);
@@ -886,7 +1722,7 @@ void* hdb_agets(struct hdb_t* hdb, const void* key, int keysize, int* valsize, i
         *valsize = -1;
         goto final;     /* not found */
     }
-    dptr = find_key(hdb, bptr, key, keysize, &kv);
+    dptr = find_live_key(hdb, bptr, key, keysize, &kv);
     if (dptr < 0) {
         goto final;
     } else if (dptr == 0) {
@@ -894,26 +1730,97 @@ void* hdb_agets(struct hdb_t* hdb, const void* key, int keysize, int* valsize, i
         goto final;
     }
 
-    val = malloc(kv.valsize);
-    if (val == NULL) {
-        err_write("hdb_agets: no memory %d bytes.", kv.valsize);
+    val = alloc_value(hdb, dptr, &kv, valsize);
+    if (val == NULL)
         goto final;
+
+    if (cas != NULL)
+        *cas = kv.timestamp;
+
+final:
+    unlock_bucket(hdb, hindex, LOCK_READ);
+    return val;
+}
+
+/*
+ * データベースからキーを検索して値を参照するビューを設定します。
+ * 値がメモリマップ上にある場合はコピーせずにマップ上の領域を固定します。
+ * ビューは使用後に nio_release_view() で解放する必要があります。
+ *
+ * hdb: ハッシュデータベース構造体のポインタ
+ * key: キーのポインタ
+ * keysize: キーのサイズ
+ * view: ビュー構造体のポインタ
+ *
+ * キー値を取得できた場合は値のサイズを返します。
+ * キーが存在しない場合は -1 を返します。
+ * その他のエラーの場合は -2 を返します。
+ */
+int hdb_get_view(struct hdb_t* hdb, const void* key, int keysize, struct nio_view_t* view)
+{
+    int result = -2;
+    int hindex;
+    struct hdb_keyvalue_t kv;
+    int64 bptr, dptr, vptr;
+    void* val;
+
+    view->val = NULL;
+    view->valsize = 0;
+    view->pinned = 0;
+    if (keysize > NIO_MAX_KEYSIZE) {
+        err_write("hdb_get_view: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
+        return -2;
     }
 
-    if (mmap_read(hdb->nio->mmap, val, kv.valsize) != kv.valsize) {
-        err_write("hdb_agets: can't mmap_read.");
-        free(val);
-        val = NULL;
+    /* キーのハッシュ値を求めてバケットをロックします。*/
+    hindex = lock_key(hdb, key, keysize, LOCK_READ);
+
+    /* バケット値を取得します。*/
+    bptr = get_bucket(hdb, hindex);
+
+    if (bptr == 0) {
+        result = -1;
+        goto final;     /* not found */
+    }
+    dptr = find_live_key(hdb, bptr, key, keysize, &kv);
+    if (dptr < 0) {
+        goto final;
+    } else if (dptr == 0) {
+        result = -1;
         goto final;
     }
-    *valsize = kv.valsize;
 
-    if (cas != NULL)
-        *cas = kv.timestamp;
+    if (KV_CODEC(&kv) != NIO_COMP_NONE) {
+        /* 圧縮されている値は展開した領域を参照します。*/
+        val = alloc_value(hdb, dptr, &kv, &view->valsize);
+        if (val == NULL)
+            goto final;
+    } else {
+        vptr = dptr + KV_VALUE_OFFSET(&kv);
+        val = mmap_pin(hdb->nio->mmap, vptr, kv.valsize);
+        if (val) {
+            view->pinned = 1;
+        } else {
+            /* メモリマップ外のため領域を確保して読み込みます。*/
+            val = malloc(kv.valsize);
+            if (val == NULL) {
+                err_write("hdb_get_view: no memory %d bytes.", kv.valsize);
+                goto final;
+            }
+            if (mmap_pread(hdb->nio->mmap, val, kv.valsize, vptr) != kv.valsize) {
+                err_write("hdb_get_view: can't mmap_read.");
+                free(val);
+                goto final;
+            }
+        }
+        view->valsize = kv.valsize;
+    }
+    view->val = val;
+    result = view->valsize;
 
 final:
-    CS_END(&hdb->critical_section);
-    return val;
+    unlock_bucket(hdb, hindex, LOCK_READ);
+    return result;
 }
 
 /*
@@ -952,76 +1859,64 @@ int hdb_put(struct hdb_t* hdb, const void* key, int keysize, const void* val, in
  */
 int hdb_puts(struct hdb_t* hdb, const void* key, int keysize, const void* val, int valsize, int64 cas)
 {
-    int result = 0;
+    return hdb_put_ttl(hdb, key, keysize, val, valsize, cas, 0);
+}
+
+/*
+ * データベースに有効期間を指定してキーと値を設定します。
+ * キーがすでに存在している場合は置換されます。
+ * cas がゼロ以外の場合は楽観的排他制御のチェックが行われます。
+ *
+ * 有効期間を過ぎたキーは存在しないものとして扱われます。
+ * 期限切れの領域は hdb_reap() で回収されます。
+ *
+ * hdb: ハッシュデータベース構造体のポインタ
+ * key: キーのポインタ
+ * keysize: キーのサイズ
+ * val: 値のポインタ
+ * valsize: 値のサイズ
+ * cas: 楽観的排他制御のための値(ゼロはチェックしない)
+ * ttl: 有効期間(秒)、ゼロ以下は無期限
+ *
+ * 成功した場合はゼロを返します。
+ * エラーの場合は -1 を返します。
+ * 他のユーザーがすでに更新していた場合は -2 を返します。
+ */
+int hdb_put_ttl(struct hdb_t* hdb, const void* key, int keysize, const void* val, int valsize, int64 cas, int ttl)
+{
+    int result;
     int hindex;
-    struct hdb_keyvalue_t kv;
-    int64 bptr, dptr;
+    int added = 0;
+    unsigned int expire = 0;
+    char* cval;
+    int csize, codec = NIO_COMP_NONE;
 
     if (keysize > NIO_MAX_KEYSIZE) {
-        err_write("hdb_puts: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
+        err_write("hdb_put_ttl: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
         return -1;
     }
+    if (ttl > 0)
+        expire = EXPIRE_NOW() + ttl;
+
+    /* 値の圧縮はロックの外で行ないます。*/
+    cval = nio_value_compress(hdb->nio, val, valsize, &csize, &codec);
+    if (cval) {
+        val = cval;
+        valsize = csize;
+    }
 
-    CS_START(&hdb->critical_section);
-
-    /* キーのハッシュ値を求めます。*/
-    hindex = HASH_FUNC(hdb, key, keysize);
-
-    /* バケット値を取得します。*/
-    bptr = get_bucket(hdb, hindex);
-
-    /* キー値が存在するか調べます。*/
-    dptr = find_key(hdb, bptr, key, keysize, &kv);
-    if (dptr < 0) {
-        result = -1;
-        goto final;
-    }
-
-    if (dptr == 0) {
-        /* 新規に追加します。*/
-        if (add_keyvalue(hdb, hindex, key, keysize, val, valsize, 0) < 0)
-            result = -1;
-    } else {
-        if (cas != 0) {
-            if (kv.timestamp != cas) {
-                err_write("hdb_puts: cas(compare and swap) error.");
-                result = -2;
-                goto final;
-            }
-        }
-        /* 既存の領域に書き出せるか調べます。*/
-        if (kv.areasize >= HDB_KEYVALUE_SIZE + kv.keysize + valsize) {
-            /* 値を更新します。*/
-            if (mmap_write(hdb->nio->mmap, val, valsize) != valsize) {
-                err_write("hdb_put: can't mmap_write.");
-                result = -1;
-                goto final;
-            }
-            /* key-valueヘッダーを更新します。*/
-            if (kv.valsize != valsize)
-                kv.valsize = valsize;
-            /* timestampを更新します。*/
-            kv.timestamp = system_time();
-            if (write_keyvalue(hdb, dptr, &kv, NULL, NULL) < 0) {
-                err_write("hdb_put: can't write key-value header.");
-                result = -1;
-            }
-        } else {
-            /* 収まらないので新たな領域に書き出します。*/
-            /* 元の領域のリンクを切ります。*/
-            if (remove_chain_keyvalue(hdb, hindex, dptr, &kv) < 0) {
-                result = -1;
-                goto final;
-            }
-            /* 元の領域をフリーリストに登録します。*/
-            nio_add_free_list(hdb->nio, dptr, kv.areasize);
-            /* ファイルの最後に追加します。*/
-            result = add_keyvalue(hdb, hindex, key, keysize, val, valsize, 0);
-        }
-    }
-
-final:
-    CS_END(&hdb->critical_section);
+    /* キーのハッシュ値を求めてバケットをロックします。*/
+    hindex = lock_key(hdb, key, keysize, LOCK_WRITE);
+    nio_tx_begin(hdb->nio);
+    result = put_value(hdb, hindex, key, keysize, val, valsize, cas, expire, codec, &added);
+    nio_tx_end(hdb->nio);
+    unlock_bucket(hdb, hindex, LOCK_WRITE);
+    if (cval)
+        free(cval);
+
+    /* レコード数が負荷率を超えた場合はバケットを分割します。*/
+    if (added && need_split(hdb, hindex))
+        split_bucket(hdb, hindex);
     return result;
 }
 
@@ -1045,19 +1940,27 @@ final:
 int hdb_bset(struct hdb_t* hdb, const void* key, int keysize, const void* val, int valsize, int64 cas)
 {
     int result = 0;
+    int added = 0;
     int hindex;
     struct hdb_keyvalue_t kv;
     int64 bptr, dptr;
+    char* cval;
+    int csize, codec = NIO_COMP_NONE;
 
     if (keysize > NIO_MAX_KEYSIZE) {
         err_write("hdb_bset: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
         return -1;
     }
 
-    CS_START(&hdb->critical_section);
+    cval = nio_value_compress(hdb->nio, val, valsize, &csize, &codec);
+    if (cval) {
+        val = cval;
+        valsize = csize;
+    }
 
-    /* キーのハッシュ値を求めます。*/
-    hindex = HASH_FUNC(hdb, key, keysize);
+    /* キーのハッシュ値を求めてバケットをロックします。*/
+    hindex = lock_key(hdb, key, keysize, LOCK_WRITE);
+    nio_tx_begin(hdb->nio);
 
     /* バケット値を取得します。*/
     bptr = get_bucket(hdb, hindex);
@@ -1071,42 +1974,25 @@ int hdb_bset(struct hdb_t* hdb, const void* key, int keysize, const void* val, i
 
     if (dptr == 0) {
         /* 新規に追加します。*/
-        if (add_keyvalue(hdb, hindex, key, keysize, val, valsize, cas) < 0)
+        if (add_keyvalue(hdb, hindex, key, keysize, val, valsize, cas, 0, codec) < 0)
             result = -1;
-    } else {
-        /* 既存の領域に書き出せるか調べます。*/
-        if (kv.areasize >= HDB_KEYVALUE_SIZE + kv.keysize + valsize) {
-            /* 値を更新します。*/
-            if (mmap_write(hdb->nio->mmap, val, valsize) != valsize) {
-                err_write("hdb_bset: can't mmap_write.");
-                result = -1;
-                goto final;
-            }
-            /* key-valueヘッダーを更新します。*/
-            if (kv.valsize != valsize)
-                kv.valsize = valsize;
-            /* timestampを更新します。*/
-            kv.timestamp = cas;
-            if (write_keyvalue(hdb, dptr, &kv, NULL, NULL) < 0) {
-                err_write("hdb_put: can't write key-value header.");
-                result = -1;
-            }
-        } else {
-            /* 収まらないので新たな領域に書き出します。*/
-            /* 元の領域のリンクを切ります。*/
-            if (remove_chain_keyvalue(hdb, hindex, dptr, &kv) < 0) {
-                result = -1;
-                goto final;
-            }
-            /* 元の領域をフリーリストに登録します。*/
-            nio_add_free_list(hdb->nio, dptr, kv.areasize);
-            /* ファイルの最後に追加します。*/
-            result = add_keyvalue(hdb, hindex, key, keysize, val, valsize, cas);
+        else {
+            count_record(hdb, hindex, 1);
+            added = 1;
         }
+    } else {
+        result = replace_value(hdb, hindex, dptr, &kv, key, keysize, val, valsize, cas, 0, codec);
     }
 
 final:
-    CS_END(&hdb->critical_section);
+    nio_tx_end(hdb->nio);
+    unlock_bucket(hdb, hindex, LOCK_WRITE);
+    if (cval)
+        free(cval);
+
+    /* レコード数が負荷率を超えた場合はバケットを分割します。*/
+    if (added && need_split(hdb, hindex))
+        split_bucket(hdb, hindex);
     return result;
 }
 
@@ -1123,39 +2009,467 @@ final:
  */
 int hdb_delete(struct hdb_t* hdb, const void* key, int keysize)
 {
-    int result = 0;
+    int result;
     int hindex;
-    struct hdb_keyvalue_t kv;
-    int64 bptr, dptr;
 
     if (keysize > NIO_MAX_KEYSIZE) {
         err_write("hdb_delete: keysize is too large, less than %d bytes.", NIO_MAX_KEYSIZE);
         return -1;
     }
 
-    CS_START(&hdb->critical_section);
+    /* キーのハッシュ値を求めてバケットをロックします。*/
+    hindex = lock_key(hdb, key, keysize, LOCK_WRITE);
+    nio_tx_begin(hdb->nio);
+    result = delete_value(hdb, hindex, key, keysize);
+    nio_tx_end(hdb->nio);
+    unlock_bucket(hdb, hindex, LOCK_WRITE);
+    return result;
+}
 
-    /* キーのハッシュ値を求めます。*/
-    hindex = HASH_FUNC(hdb, key, keysize);
+struct batch_order_t {
+    int lock_no;        /* lock number */
+    int index;          /* bucket index */
+    int n;              /* item number */
+    char* cval;         /* compressed value(NULL is not compressed) */
+    int csize;          /* compressed size */
+    int codec;          /* compression codec */
+};
 
-    /* バケット値を取得します。*/
-    bptr = get_bucket(hdb, hindex);
+static int batch_order_cmp(const void* p1, const void* p2)
+{
+    const struct batch_order_t* o1 = (const struct batch_order_t*)p1;
+    const struct batch_order_t* o2 = (const struct batch_order_t*)p2;
+
+    if (o1->lock_no != o2->lock_no)
+        return (o1->lock_no < o2->lock_no)? -1 : 1;
+    if (o1->index != o2->index)
+        return (o1->index < o2->index)? -1 : 1;
+    return o1->n - o2->n;
+}
 
-    /* キー値が存在するか調べます。*/
-    dptr = find_key(hdb, bptr, key, keysize, &kv);
-    if (dptr > 0) {
-        /* 領域のリストを切ります。*/
-        if (remove_chain_keyvalue(hdb, hindex, dptr, &kv) == 0) {
-            /* 領域をフリーリストに登録します。*/
-            nio_add_free_list(hdb->nio, dptr, kv.areasize);
+static int lock_no(struct hdb_t* hdb, int index)
+{
+    if (hdb->stripe == NULL)
+        return 0;
+    return index % hdb->lock_stripes;
+}
+
+/* 値はロックの前に圧縮されています。*/
+static int batch_put(struct hdb_t* hdb, int index, struct nio_batch_t* item,
+                     const struct batch_order_t* order, int* added)
+{
+    if (order->cval)
+        return put_value(hdb, index, item->key, item->keysize, order->cval, order->csize, 0, 0, order->codec, added);
+    return put_value(hdb, index, item->key, item->keysize, item->val, item->valsize, 0, 0, NIO_COMP_NONE, added);
+}
+
+static int batch_item(struct hdb_t* hdb, int index, struct nio_batch_t* item,
+                      const struct batch_order_t* order, int op, int* added)
+{
+    switch (op) {
+        case BATCH_GET:
+            item->result = get_value(hdb, index, item->key, item->keysize, item->val, item->valsize, NULL);
+            break;
+        case BATCH_PUT:
+            item->result = batch_put(hdb, index, item, order, added);
+            break;
+        default:
+            item->result = delete_value(hdb, index, item->key, item->keysize);
+            break;
+    }
+    return (item->result >= 0);
+}
+
+static int batch_single(struct hdb_t* hdb, struct nio_batch_t* item, int op)
+{
+    switch (op) {
+        case BATCH_GET:
+            item->result = hdb_gets(hdb, item->key, item->keysize, item->val, item->valsize, NULL);
+            break;
+        case BATCH_PUT:
+            item->result = hdb_puts(hdb, item->key, item->keysize, item->val, item->valsize, 0);
+            break;
+        default:
+            item->result = hdb_delete(hdb, item->key, item->keysize);
+            break;
+    }
+    return (item->result >= 0);
+}
+
+static int batch_exec(struct hdb_t* hdb, struct nio_batch_t* items, int count, int op)
+{
+    struct batch_order_t* order;
+    int mode;
+    int i, j, n;
+    int done = 0;
+
+    if (count < 1)
+        return 0;
+
+    order = (struct batch_order_t*)malloc(sizeof(struct batch_order_t) * count);
+    if (order == NULL) {
+        err_write("hdb: batch no memory.");
+        return -1;
+    }
+
+    /* キーのバケットを求めてロック単位とバケット順に並べます。*/
+    n = 0;
+    for (i = 0; i < count; i++) {
+        if (items[i].keysize > NIO_MAX_KEYSIZE) {
+            /* エラーは個別に処理されます。*/
+            done += batch_single(hdb, &items[i], op);
+            continue;
+        }
+        order[n].index = bucket_index(hdb, HASH_VALUE(hdb, items[i].key, items[i].keysize));
+        order[n].lock_no = lock_no(hdb, order[n].index);
+        order[n].n = i;
+        order[n].cval = NULL;
+        order[n].codec = NIO_COMP_NONE;
+        if (op == BATCH_PUT) {
+            /* 値の圧縮はロックの外で行ないます。*/
+            order[n].cval = nio_value_compress(hdb->nio, items[i].val, items[i].valsize,
+                                               &order[n].csize, &order[n].codec);
+        }
+        n++;
+    }
+    qsort(order, n, sizeof(struct batch_order_t), batch_order_cmp);
+
+    mode = (op == BATCH_GET)? LOCK_READ : LOCK_WRITE;
+    i = 0;
+    while (i < n) {
+        int lock_index;
+        int added = 0;
+
+        /* 同じロックで保護されているキーはロックを一度だけ取得して処理します。*/
+        lock_index = order[i].index;
+        lock_bucket(hdb, lock_index, mode);
+        if (mode == LOCK_WRITE)
+            nio_tx_begin(hdb->nio);
+        for (j = i; j < n && order[j].lock_no == order[i].lock_no; j++) {
+            struct nio_batch_t* item;
+            int index;
+
+            item = &items[order[j].n];
+            index = order[j].index;
+            if (hdb->lh_load > 0) {
+                /* バケットが分割されている場合は再計算します。*/
+                index = bucket_index(hdb, HASH_VALUE(hdb, item->key, item->keysize));
+                if (lock_no(hdb, index) != order[j].lock_no) {
+                    order[j].index = -1;
+                    continue;
+                }
+            }
+            done += batch_item(hdb, index, item, &order[j], op, &added);
+        }
+        if (mode == LOCK_WRITE)
+            nio_tx_end(hdb->nio);
+        unlock_bucket(hdb, lock_index, mode);
+
+        /* レコード数が負荷率を超えた場合はバケットを分割します。*/
+        while (added-- > 0 && need_split(hdb, lock_index)) {
+            if (split_bucket(hdb, lock_index) < 0)
+                break;
+        }
+
+        /* 他のロックに移動したキーは個別に処理します。*/
+        for (; i < j; i++) {
+            if (order[i].index < 0)
+                done += batch_single(hdb, &items[order[i].n], op);
+            if (order[i].cval)
+                free(order[i].cval);
+        }
+    }
+    free(order);
+    return done;
+}
+
+/*
+ * データベースから複数のキーを検索して値を設定します。
+ * キーはバケット順に並べられて同じロックで保護されている
+ * キーはロックを一度だけ取得して処理されます。
+ *
+ * 各要素の val と valsize には値の領域とそのサイズを設定しておきます。
+ * 各要素の result には hdb_get() と同じ値が設定されます。
+ *
+ * hdb: ハッシュデータベース構造体のポインタ
+ * items: バッチ要素の配列
+ * count: 要素数
+ *
+ * 値を取得できたキーの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int hdb_mget(struct hdb_t* hdb, struct nio_batch_t* items, int count)
+{
+    return batch_exec(hdb, items, count, BATCH_GET);
+}
+
+/*
+ * データベースに複数のキーと値を設定します。
+ * キーがすでに存在している場合は置換されます。
+ *
+ * 各要素の result には hdb_put() と同じ値が設定されます。
+ *
+ * hdb: ハッシュデータベース構造体のポインタ
+ * items: バッチ要素の配列
+ * count: 要素数
+ *
+ * 設定できたキーの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int hdb_mput(struct hdb_t* hdb, struct nio_batch_t* items, int count)
+{
+    return batch_exec(hdb, items, count, BATCH_PUT);
+}
+
+/*
+ * データベースから複数のキーを削除します。
+ *
+ * 各要素の result には hdb_delete() と同じ値が設定されます。
+ *
+ * hdb: ハッシュデータベース構造体のポインタ
+ * items: バッチ要素の配列
+ * count: 要素数
+ *
+ * 削除できたキーの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int hdb_mdelete(struct hdb_t* hdb, struct nio_batch_t* items, int count)
+{
+    return batch_exec(hdb, items, count, BATCH_DELETE);
+}
+
+static int reap_bucket(struct hdb_t* hdb, int index, unsigned int now)
+{
+    int64 ptr, prev = 0;
+    int count = 0;
+
+    /* バケットの書き込みロック中に呼び出されます。*/
+    ptr = get_bucket(hdb, index);
+    while (ptr > 0) {
+        struct hdb_keyvalue_t kv;
+
+        if (read_keyvalue_header(hdb, ptr, &kv) < 0) {
+            err_write("hdb_reap: can't read key-value, ptr=%lld", ptr);
+            return -1;
+        }
+        if (KV_EXPIRED(&kv, now)) {
+            /* 期限切れの領域をチェインから外してフリーリストに登録します。*/
+            if (prev == 0) {
+                if (update_bucket(hdb, index, kv.nextptr) < 0)
+                    return -1;
+            } else {
+                if (set_nextptr(hdb, prev, kv.nextptr) < 0)
+                    return -1;
+            }
+            nio_add_free_list(hdb->nio, ptr, kv.areasize);
+            count_record(hdb, index, -1);
+            count++;
         } else {
-            result = -1;
+            prev = ptr;
         }
-    } else {
-        result = -1;
+        ptr = kv.nextptr;
+    }
+    return count;
+}
+
+/*
+ * 期限切れのキーの領域を回収します。
+ * 前回の続きのバケットから nbuckets 個のバケットを調べます。
+ * ロックはバケット単位で取得されるため他のスレッドの更新を
+ * 長時間妨げることはありません。
+ * 最後のバケットまで調べた場合は先頭のバケットに戻ります。
+ *
+ * hdb: ハッシュデータベース構造体のポインタ
+ * nbuckets: 調べるバケット数
+ *
+ * 回収したキーの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int hdb_reap(struct hdb_t* hdb, int nbuckets)
+{
+    unsigned int now;
+    int64 start, count;
+    int i, n;
+    int total = 0;
+
+    /* 調べるバケットの範囲を確保します。*/
+    CS_START(&hdb->split_critical_section);
+    count = bucket_count(hdb);
+    if (nbuckets > count)
+        nbuckets = (int)count;
+    if (hdb->reap_index >= count)
+        hdb->reap_index = 0;
+    start = hdb->reap_index;
+    hdb->reap_index = (start + nbuckets) % count;
+    CS_END(&hdb->split_critical_section);
+
+    now = EXPIRE_NOW();
+    for (i = 0; i < nbuckets; i++) {
+        int index;
+
+        index = (int)((start + i) % count);
+        lock_bucket(hdb, index, LOCK_WRITE);
+        nio_tx_begin(hdb->nio);
+        n = reap_bucket(hdb, index, now);
+        nio_tx_end(hdb->nio);
+        unlock_bucket(hdb, index, LOCK_WRITE);
+        if (n < 0)
+            return -1;
+        total += n;
+    }
+    return total;
+}
+
+static int move_keyvalue(struct hdb_t* hdb,
+                         int64 ptr,
+                         int64 new_ptr,
+                         int areasize,
+                         struct hdb_keyvalue_t* kv)
+{
+    char* buf;
+    int size;
+
+    /* ヘッダーからデータまでを新しい領域に複写します。*/
+    size = KV_VALUE_OFFSET(kv) + kv->valsize;
+    buf = (char*)malloc(size);
+    if (buf == NULL) {
+        err_write("hdb_compact: no memory.");
+        return -1;
+    }
+    if (mmap_pread(hdb->nio->mmap, buf, size, ptr) != size) {
+        err_write("hdb_compact: can't read key-value, ptr=%lld", ptr);
+        free(buf);
+        return -1;
+    }
+    memcpy(&buf[HDB_KEYVALUE_ASIZE_OFFSET], &areasize, sizeof(int));
+    if (mmap_pwrite(hdb->nio->mmap, buf, size, new_ptr) != size) {
+        err_write("hdb_compact: can't write key-value, ptr=%lld", new_ptr);
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    return 0;
+}
+
+static int compact_bucket(struct hdb_t* hdb, int index)
+{
+    int64 ptr, prev = 0;
+
+    /* バケットの書き込みロック中に呼び出されます。
+       期限切れのキーは移動せずに回収します。*/
+    if (reap_bucket(hdb, index, EXPIRE_NOW()) < 0)
+        return -1;
+
+    ptr = get_bucket(hdb, index);
+    while (ptr > 0) {
+        struct hdb_keyvalue_t kv;
+        int rsize, areasize;
+        int64 new_ptr;
+
+        if (read_keyvalue_header(hdb, ptr, &kv) < 0) {
+            err_write("hdb_compact: can't read key-value, ptr=%lld", ptr);
+            return -1;
+        }
+        rsize = KV_VALUE_OFFSET(&kv) + kv.valsize;
+        if (hdb->align_bytes > 0) {
+            if (rsize % hdb->align_bytes)
+                rsize = (rsize / hdb->align_bytes + 1) * hdb->align_bytes;
+        }
+
+        /* 境界より後ろにあるキーは前の空き領域に移動します。*/
+        new_ptr = nio_compact_space(hdb->nio, rsize, &areasize, hdb->filling_rate, ptr);
+        if (new_ptr > 0) {
+            if (move_keyvalue(hdb, ptr, new_ptr, areasize, &kv) < 0)
+                return -1;
+            if (prev == 0) {
+                if (update_bucket(hdb, index, new_ptr) < 0)
+                    return -1;
+            } else {
+                if (set_nextptr(hdb, prev, new_ptr) < 0)
+                    return -1;
+            }
+            nio_add_free_list(hdb->nio, ptr, kv.areasize);
+            prev = new_ptr;
+        } else {
+            prev = ptr;
+        }
+        ptr = kv.nextptr;
     }
+    return 0;
+}
+
+/* オープンされているカーソルの数を返します。*/
+static int cursor_count(struct hdb_t* hdb)
+{
+    int n;
+
+    CS_START(&hdb->cursor_critical_section);
+    n = hdb->cursor_num;
+    CS_END(&hdb->cursor_critical_section);
+    return n;
+}
 
-    CS_END(&hdb->critical_section);
+/*
+ * データベースファイルを圧縮します。
+ * 前回の続きのバケットから nbuckets 個のバケットのキーを
+ * ファイルの先頭に近い空き領域に移動します。
+ * ロックはバケット単位で取得されるため他のスレッドの更新を
+ * 長時間妨げることはありません。
+ * カーソルはキーの位置を保持しているため、カーソルがオープンされている
+ * 間はキーを移動せずに 1 を返します。
+ *
+ * nio_compact() から呼び出されます。
+ *
+ * hdb: ハッシュデータベース構造体のポインタ
+ * nbuckets: 処理するバケット数
+ *
+ * 残りのバケットがある場合は 1 を返します。
+ * 最後のバケットまで処理した場合はゼロを返します。
+ * エラーの場合は -1 を返します。
+ */
+int hdb_compact(struct hdb_t* hdb, int nbuckets)
+{
+    int64 start, count;
+    int i;
+    int result = 1;
+
+    if (cursor_count(hdb) > 0)
+        return 1;
+
+    /* 処理するバケットの範囲を確保します。*/
+    CS_START(&hdb->split_critical_section);
+    count = bucket_count(hdb);
+    start = hdb->compact_index;
+    if (nbuckets <= 0 || start + nbuckets >= count) {
+        nbuckets = (int)(count - start);
+        hdb->compact_index = 0;
+        result = 0;
+    } else {
+        hdb->compact_index = start + nbuckets;
+    }
+    CS_END(&hdb->split_critical_section);
+
+    for (i = 0; i < nbuckets; i++) {
+        int index;
+        int n;
+
+        index = (int)(start + i);
+        lock_bucket(hdb, index, LOCK_WRITE);
+        if (cursor_count(hdb) > 0) {
+            /* 途中でオープンされたカーソルがあれば残りは次に処理します。*/
+            unlock_bucket(hdb, index, LOCK_WRITE);
+            CS_START(&hdb->split_critical_section);
+            hdb->compact_index = index;
+            CS_END(&hdb->split_critical_section);
+            return 1;
+        }
+        nio_tx_begin(hdb->nio);
+        n = compact_bucket(hdb, index);
+        nio_tx_end(hdb->nio);
+        unlock_bucket(hdb, index, LOCK_WRITE);
+        if (n < 0)
+            return -1;
+    }
     return result;
 }
 
@@ -1168,23 +2482,94 @@ void hdb_free(const void* v)
         free((void*)v);
 }
 
+static int64 cursor_end_index(struct hdbcursor_t* cur)
+{
+    int64 count;
+
+    count = bucket_count(cur->hdb);
+    if (cur->end_index >= 0 && cur->end_index < count)
+        return cur->end_index;
+    return count;
+}
+
+static void cursor_prefetch(struct hdbcursor_t* cur, int64 end)
+{
+    int64 last;
+    int i;
+
+    /* 後続のバケットのチェインの先頭を先読みします。*/
+    if (cur->prefetch_index <= cur->bucket_index)
+        cur->prefetch_index = cur->bucket_index + 1;
+    last = cur->bucket_index + 1 + CURSOR_PREFETCH_COUNT;
+    if (last > end)
+        last = end;
+    for (i = cur->prefetch_index; i < last; i++) {
+        int64 bptr;
+
+        lock_bucket(cur->hdb, i, LOCK_READ);
+        bptr = get_bucket(cur->hdb, i);
+        unlock_bucket(cur->hdb, i, LOCK_READ);
+        if (bptr > 0)
+            mmap_prefetch(cur->hdb->nio->mmap, bptr, HDB_KEYVALUE_SIZE);
+    }
+    if (i > cur->prefetch_index)
+        cur->prefetch_index = i;
+}
+
 static int64 cursor_next_bucket(struct hdbcursor_t* cur)
 {
+    int64 end;
     int i;
 
-    for (i = cur->bucket_index+1; i < cur->hdb->bucket_num; i++) {
+    end = cursor_end_index(cur);
+    for (i = cur->bucket_index+1; i < end; i++) {
         int64 bptr;
 
+        lock_bucket(cur->hdb, i, LOCK_READ);
         bptr = get_bucket(cur->hdb, i);
+        unlock_bucket(cur->hdb, i, LOCK_READ);
         if (bptr > 0) {
             cur->bucket_index = i;
             cur->kvptr = bptr;
+            if (cur->prefetch)
+                cursor_prefetch(cur, end);
             return bptr;
         }
     }
     return 0;
 }
 
+static int cursor_skip_expired(struct hdbcursor_t* cur)
+{
+    unsigned int now;
+
+    /* 期限切れのキーは読み飛ばします。*/
+    now = EXPIRE_NOW();
+    while (cur->kvptr != 0) {
+        struct hdb_keyvalue_t kv;
+        int result;
+
+        lock_bucket(cur->hdb, cur->bucket_index, LOCK_READ);
+        result = read_keyvalue_header(cur->hdb, cur->kvptr, &kv);
+        unlock_bucket(cur->hdb, cur->bucket_index, LOCK_READ);
+        if (result < 0) {
+            err_write("hdb_cursor: can't read key-value, ptr=%ld", cur->kvptr);
+            return -1;
+        }
+        if (! KV_EXPIRED(&kv, now))
+            return 0;
+        if (kv.nextptr == 0) {
+            if (cursor_next_bucket(cur) == 0) {
+                cur->kvptr = 0;
+                return NIO_CURSOR_END;
+            }
+        } else {
+            cur->kvptr = kv.nextptr;
+        }
+    }
+    return NIO_CURSOR_END;
+}
+
 static int cursor_get_current(struct hdbcursor_t* cur, void* keybuf)
 {
     struct hdb_keyvalue_t kv;
@@ -1194,13 +2579,39 @@ static int cursor_get_current(struct hdbcursor_t* cur, void* keybuf)
         return -1;
     }
 
-    if (mmap_read(cur->hdb->nio->mmap, keybuf, kv.keysize) != kv.keysize) {
+    if (mmap_pread(cur->hdb->nio->mmap, keybuf, kv.keysize, cur->kvptr+KV_KEY_OFFSET(&kv)) != kv.keysize) {
         err_write("cursor_get_current: can't mmap_read");
         return -1;
     }
     return kv.keysize;
 }
 
+static struct hdbcursor_t* cursor_open(struct hdb_t* hdb, int start, int end, int prefetch)
+{
+    struct hdbcursor_t* cur;
+
+    cur = (struct hdbcursor_t*)calloc(1, sizeof(struct hdbcursor_t));
+    if (cur == NULL) {
+        err_write("hdb: hdb_cursor_open() no memory.");
+        return NULL;
+    }
+
+    cur->hdb = hdb;
+    cur->bucket_index = start - 1;
+    cur->end_index = end;
+    cur->kvptr = 0;
+    cur->prefetch = prefetch;
+
+    /* 圧縮でキーが移動しないようにバケットを参照する前に数えます。*/
+    CS_START(&hdb->cursor_critical_section);
+    hdb->cursor_num++;
+    CS_END(&hdb->cursor_critical_section);
+
+    if (cursor_next_bucket(cur) > 0)
+        cursor_skip_expired(cur);
+    return cur;
+}
+
 /*
  * オープンされているデータベースファイルから順次アクセスするための
  * カーソルを作成します。
@@ -1216,24 +2627,56 @@ static int cursor_get_current(struct hdbcursor_t* cur, void* keybuf)
  */
 struct hdbcursor_t* hdb_cursor_open(struct hdb_t* hdb)
 {
-    struct hdbcursor_t* cur;
+    return cursor_open(hdb, 0, -1, 0);
+}
 
-    cur = (struct hdbcursor_t*)calloc(1, sizeof(struct hdbcursor_t));
-    if (cur == NULL) {
-        err_write("hdb: hdb_cursor_open() no memory.");
-        return NULL;
-    }
+/*
+ * バケットを n 個の重ならない範囲に分割してカーソルを作成します。
+ * 作成されたカーソルは curs に設定されます。
+ *
+ * 各カーソルは担当する範囲のバケットだけを hdb_cursor_next() で
+ * 順に返します。範囲の境界は作成時のバケット数で決まり、
+ * 作成後に分割で追加されたバケットは最後のカーソルが担当します。
+ * 各カーソルは後続のバケットのキーを先読みしながら進みます。
+ *
+ * カーソルはそれぞれ別のスレッドから同時に使用できます。
+ * 使用後は hdb_cursor_close() でクローズします。
+ *
+ * hdb: データベース構造体のポインタ
+ * n: 分割数
+ * curs: カーソルのポインタが設定される配列(n 個以上)
+ *
+ * 作成したカーソルの数を返します。バケット数が n より少ない場合は
+ * バケット数のカーソルが作成されます。
+ * エラーの場合は -1 を返します。
+ */
+int hdb_cursor_partition(struct hdb_t* hdb, int n, struct hdbcursor_t** curs)
+{
+    int64 count;
+    int i;
 
-    CS_START(&hdb->critical_section);
+    if (n < 1) {
+        err_write("hdb_cursor_partition: illegal partition number=%d", n);
+        return -1;
+    }
 
-    cur->hdb = hdb;
-    cur->bucket_index = -1;
-    cur->kvptr = 0;
+    count = bucket_count(hdb);
+    if (n > count)
+        n = (int)count;
 
-    cursor_next_bucket(cur);
+    for (i = 0; i < n; i++) {
+        int start, end;
 
-    CS_END(&hdb->critical_section);
-    return cur;
+        start = (int)(count * i / n);
+        end = (i == n-1)? -1 : (int)(count * (i+1) / n);
+        curs[i] = cursor_open(hdb, start, end, 1);
+        if (curs[i] == NULL) {
+            while (i-- > 0)
+                hdb_cursor_close(curs[i]);
+            return -1;
+        }
+    }
+    return n;
 }
 
 /*
@@ -1246,8 +2689,12 @@ struct hdbcursor_t* hdb_cursor_open(struct hdb_t* hdb)
  */
 void hdb_cursor_close(struct hdbcursor_t * cur)
 {
-    if (cur != NULL)
+    if (cur != NULL) {
+        CS_START(&cur->hdb->cursor_critical_section);
+        cur->hdb->cursor_num--;
+        CS_END(&cur->hdb->cursor_critical_section);
         free(cur);
+    }
 }
 
 /*
@@ -1268,27 +2715,22 @@ int hdb_cursor_next(struct hdbcursor_t* cur)
     if (cur->kvptr == 0)
         return NIO_CURSOR_END;
 
-    CS_START(&cur->hdb->critical_section);
-
     /* 次のキーに進めます。 */
-    if (read_keyvalue_header(cur->hdb, cur->kvptr, &kv) < 0) {
+    lock_bucket(cur->hdb, cur->bucket_index, LOCK_READ);
+    result = read_keyvalue_header(cur->hdb, cur->kvptr, &kv);
+    unlock_bucket(cur->hdb, cur->bucket_index, LOCK_READ);
+    if (result < 0) {
         err_write("hdb_cursor_next: can't read key-value, ptr=%ld", cur->kvptr);
-        result = -1;
-        goto final;
+        return -1;
     }
     if (kv.nextptr == 0) {
         /* 次のバケット */
-        if (cursor_next_bucket(cur) == 0) {
-            result = NIO_CURSOR_END;
-            goto final;
-        }
+        if (cursor_next_bucket(cur) == 0)
+            return NIO_CURSOR_END;
     } else {
         cur->kvptr = kv.nextptr;
     }
-
-final:
-    CS_END(&cur->hdb->critical_section);
-    return result;
+    return cursor_skip_expired(cur);
 }
 
 /*
@@ -1307,15 +2749,16 @@ int hdb_cursor_key(struct hdbcursor_t* cur, void* key, int keysize)
     int ksize;
     char keybuf[NIO_MAX_KEYSIZE];
 
-    CS_START(&cur->hdb->critical_section);
+    if (cur->kvptr == 0)
+        return -1;
+
+    lock_bucket(cur->hdb, cur->bucket_index, LOCK_READ);
     ksize = cursor_get_current(cur, keybuf);
+    unlock_bucket(cur->hdb, cur->bucket_index, LOCK_READ);
     if (ksize < 0)
-        goto final;
+        return ksize;
     if (keysize < ksize)
-        goto final;
+        return ksize;
     memcpy(key, keybuf, ksize);
-
-final:
-    CS_END(&cur->hdb->critical_section);
     return ksize;
 }
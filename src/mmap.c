@@ -28,6 +28,14 @@
 
 #ifndef _WIN32
 #include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#define MMAP_URING
+#endif
 #endif
 
 #define API_INTERNAL
@@ -39,6 +47,32 @@
 #endif
 
 #define AUTO_EXTEND_SIZE    (8*1024*1024)    /* 8MB */
+#define AUTO_EXTEND_MAX     (1024*1024*1024) /* 1GB */
+#define MMAP_RESERVE_SIZE   ((int64)1024*1024*1024) /* 1GB */
+#define MMAP_RESERVE_ALIGN  (2*1024*1024)    /* 2MB */
+
+#define POOL_MIN_FRAMES     16          /* minimum frames of buffer pool */
+#define POOL_FLUSH_PAGES    64          /* pages per write-back */
+#define POOL_PREFETCH_PAGES 32          /* pages per prefetch */
+#define POOL_DIRTY_RATIO    25          /* write-back starts at this ratio(%) */
+#define WRITEBACK_WAIT_MSEC 10          /* polling interval of write-back thread */
+#define WRITEBACK_INTERVAL_MSEC 1000    /* dirty pages are written within this */
+#define URING_ENTRIES       64          /* queue depth of reads */
+
+#define FRAME_PREAD         1           /* frame is being read by pread() */
+#define FRAME_URING         2           /* frame is being read by io_uring */
+
+#ifndef _WIN32
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#ifdef MAP_ANONYMOUS
+#define MMAP_RESERVE
+#endif
+#endif
 
 /*
  * メモリマップドファイルをラップした関数群です。
@@ -52,6 +86,17 @@
  * MMAP_AUTO_SIZE の場合でマップできない大きさのファイルを
  * オープンした場合はマップされるサイズが調整されます。
  * この場合は自動拡張(MMAP_AUTO_SIZE)がオフになります。
+ *
+ * MMAP_AUTO_SIZE の場合はファイルサイズより大きなアドレス空間を
+ * あらかじめ予約して、その先頭にファイルをマップします。
+ * 自動拡張は予約した範囲内で追加部分だけをマップするため、
+ * ビューのポインタは変わりません。予約した範囲を超えた場合は
+ * より大きな範囲を予約し直してマップを再作成します。
+ *
+ * mmap_open_pool() でオープンした場合はファイルをマップせずに
+ * バッファプールを介して pread/pwrite(Linux では io_uring)で
+ * 読み書きします。変更されたページはバックグラウンドのスレッドで
+ * 書き出されるため、書き込みがディスクの待ちで止まりません。
  * 
  */
 
@@ -63,6 +108,120 @@ static int64 mmap_size(struct mmap_t* map)
     return map->view_size;
 }
 
+static int map_advise(struct mmap_t* map, int64 offset, int64 size, int advice)
+{
+#ifndef _WIN32
+    int64 start, last;
+    int flag;
+
+    switch (advice) {
+        case MMAP_ADVISE_NORMAL:
+            flag = MADV_NORMAL;
+            break;
+        case MMAP_ADVISE_RANDOM:
+            flag = MADV_RANDOM;
+            break;
+        case MMAP_ADVISE_SEQUENTIAL:
+            flag = MADV_SEQUENTIAL;
+            break;
+        case MMAP_ADVISE_WILLNEED:
+            flag = MADV_WILLNEED;
+            break;
+#ifdef MADV_HUGEPAGE
+        case MMAP_ADVISE_HUGEPAGE:
+            flag = MADV_HUGEPAGE;
+            break;
+#endif
+        default:
+            err_write("mmap_advise: unsupported advice=%d", advice);
+            return -1;
+    }
+
+    if (map->ptr == NULL || offset < 0 || offset >= map->size)
+        return 0;
+    /* サイズがゼロの場合はビューの最後までです。*/
+    last = (size > 0 && offset + size < map->size)? offset + size : map->size;
+    /* 開始位置をページ境界にそろえます。*/
+    start = offset - offset % map->pgsize;
+    if (madvise((char*)map->ptr + start, (size_t)(last - start), flag) < 0) {
+        err_write("mmap_advise: advice=%d failed, %s", advice, strerror(errno));
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+#ifdef MMAP_RESERVE
+static void* reserve_view(struct mmap_t* map, int prot)
+{
+    int64 rsize;
+    size_t head;
+    void* p;
+
+    /* 32ビット環境ではアドレス空間が不足するため予約しません。*/
+    if (sizeof(void*) < 8)
+        return NULL;
+
+    rsize = map->size * 2;
+    if (rsize < MMAP_RESERVE_SIZE)
+        rsize = MMAP_RESERVE_SIZE;
+    rsize = (rsize + MMAP_RESERVE_ALIGN - 1) / MMAP_RESERVE_ALIGN * MMAP_RESERVE_ALIGN;
+
+    /* アクセスできないアドレス空間を予約します。
+       ページフォルトを大きな単位で処理できるように
+       先頭を MMAP_RESERVE_ALIGN の境界にそろえます。*/
+    p = mmap(0, (size_t)(rsize + MMAP_RESERVE_ALIGN), PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    head = (size_t)(MMAP_RESERVE_ALIGN - (size_t)p % MMAP_RESERVE_ALIGN) % MMAP_RESERVE_ALIGN;
+    if (head > 0)
+        munmap(p, head);
+    munmap((char*)p + head + rsize, MMAP_RESERVE_ALIGN - head);
+    p = (char*)p + head;
+
+    /* 予約した範囲の先頭にファイルをマップします。*/
+    if (map->size > 0) {
+        if (mmap(p, (size_t)map->size, prot, MAP_SHARED | MAP_FIXED, map->fd, 0) == MAP_FAILED) {
+            munmap(p, (size_t)rsize);
+            return NULL;
+        }
+    }
+    map->reserve_size = rsize;
+    return p;
+}
+
+static int extend_view(struct mmap_t* map, int64 size)
+{
+    int64 start;
+    int prot;
+
+    if (FILE_TRUNCATE(map->fd, size) < 0) {
+        err_write("mmap_resize: file truncate error");
+        return -1;
+    }
+
+    /* 現在マップされているページの次から予約領域に重ねてマップします。
+       既存のマップは変更しないため、ビューのポインタはそのまま有効です。*/
+    start = (map->size + map->pgsize - 1) / map->pgsize * map->pgsize;
+    if (size > start) {
+        prot = (map->open_mode == MMAP_READONLY)? PROT_READ : PROT_READ | PROT_WRITE;
+        if (mmap((char*)map->ptr + start, (size_t)(size - start), prot,
+                 MAP_SHARED | MAP_FIXED, map->fd, (off_t)start) == MAP_FAILED) {
+            err_write("mmap_resize: can't extend view, new size=%lld, %s", size, strerror(errno));
+            FILE_TRUNCATE(map->fd, map->size);
+            return -1;
+        }
+    }
+    map->size = size;
+    map->real_size = size;
+    /* 拡張した範囲にもビュー全体の指定を適用します。*/
+    if (map->advice != MMAP_ADVISE_NORMAL && size > start)
+        map_advise(map, start, size - start, map->advice);
+    return 0;
+}
+#endif
+
 static int mmap_open_aux(struct mmap_t* map, int fd, int mode, int64 offset)
 {
 #ifdef _WIN32
@@ -134,9 +293,22 @@ static int mmap_open_aux(struct mmap_t* map, int fd, int mode, int64 offset)
     if (map->size > map->real_size)
         FILE_TRUNCATE(map->fd, map->size);
 
-    map->ptr = mmap(0, map->size, prot, MAP_SHARED, fd, (off_t)offset);
-    if (map->ptr == MAP_FAILED)
-        return -1;
+    map->ptr = NULL;
+    map->reserve_size = 0;
+#ifdef MMAP_RESERVE
+    if (map->view_size == MMAP_AUTO_SIZE && offset == 0)
+        map->ptr = reserve_view(map, prot);
+#endif
+    if (map->ptr == NULL) {
+        map->ptr = mmap(0, map->size, prot, MAP_SHARED, fd, (off_t)offset);
+        if (map->ptr == MAP_FAILED) {
+            map->ptr = NULL;
+            return -1;
+        }
+    }
+    /* マップを再作成した場合はビュー全体の指定を再度適用します。*/
+    if (map->advice != MMAP_ADVISE_NORMAL)
+        map_advise(map, 0, 0, map->advice);
 #endif
     map->view_offset = offset;
     return 0;
@@ -154,9 +326,60 @@ static void mmap_unmap(struct mmap_t* map)
     map->hMap = NULL;
 #else
     if (map->ptr)
-        munmap(map->ptr, (size_t)map->size);
+        munmap(map->ptr, (size_t)((map->reserve_size > 0)? map->reserve_size : map->size));
     map->ptr = NULL;
+    map->reserve_size = 0;
+#endif
+}
+
+static void release_retired(struct mmap_retire_t* r)
+{
+    while (r) {
+        struct mmap_retire_t* next;
+
+        next = r->next;
+#ifdef _WIN32
+        UnmapViewOfFile(r->ptr);
+        CloseHandle(r->hMap);
+#else
+        munmap(r->ptr, (size_t)r->size);
+#endif
+        free(r);
+        r = next;
+    }
+}
+
+static int map_retire(struct mmap_t* map)
+{
+    struct mmap_retire_t* r;
+
+    CS_START(&map->pin_critical_section);
+    if (map->pin_count < 1) {
+        CS_END(&map->pin_critical_section);
+        mmap_unmap(map);
+        return 0;
+    }
+
+    /* 固定されている領域があるため、現在のビューは
+       固定が解除されるまでアンマップしません。*/
+    r = (struct mmap_retire_t*)malloc(sizeof(struct mmap_retire_t));
+    if (r == NULL) {
+        CS_END(&map->pin_critical_section);
+        err_write("mmap: no memory");
+        return -1;
+    }
+    r->ptr = map->ptr;
+    r->size = (map->reserve_size > 0)? map->reserve_size : map->size;
+#ifdef _WIN32
+    r->hMap = map->hMap;
+    map->hMap = NULL;
 #endif
+    r->next = map->retire;
+    map->retire = r;
+    map->ptr = NULL;
+    map->reserve_size = 0;
+    CS_END(&map->pin_critical_section);
+    return 0;
 }
 
 #if 0
@@ -173,311 +396,1940 @@ static int mmap_remap(struct mmap_t* map, int64 offset)
 }
 #endif
 
+static int map_resize(struct mmap_t* map, int64 size);
+
 static int mmap_auto_resize(struct mmap_t* map, int64 newsize)
 {
     if (newsize > map->real_size) {
         if (newsize > map->size) {
+            int64 ext;
+
+            /* 拡張の回数を減らすため、現在のサイズに応じて
+               拡張幅を大きくします。*/
+            ext = map->size / 2;
+            if (ext < AUTO_EXTEND_SIZE)
+                ext = AUTO_EXTEND_SIZE;
+            else if (ext > AUTO_EXTEND_MAX)
+                ext = AUTO_EXTEND_MAX;
             /* extend mmap */
-            if (mmap_resize(map, newsize+AUTO_EXTEND_SIZE))
-                return -1;
+            if (map_resize(map, newsize+ext)) {
+                /* 必要なサイズだけで再度拡張します。*/
+                if (map_resize(map, newsize))
+                    return -1;
+            }
         }
         map->real_size = newsize;
     }
     return 0;
 }
 
-static int mf_write(struct mmap_t* map, const void* data, size_t size, int64 start, int64 last)
+static int file_read_at(int fd, void* data, size_t size, int64 offset)
 {
-    if (last <= map->size) {
-        memcpy((char*)map->ptr + map->offset, data, size);
-    } else {
-        if (start >= map->size) {
-            FILE_SEEK(map->fd, start, SEEK_SET);
-            if (FILE_WRITE(map->fd, data, (int)size) != size)
-                return -1;
-        } else {
-            size_t m, f;
+#ifdef _WIN32
+    FILE_SEEK(fd, offset, SEEK_SET);
+    if (FILE_READ(fd, data, (int)size) != size)
+        return -1;
+#else
+    char* p = (char*)data;
+    size_t n = 0;
 
-            /* write on mmap */
-            m = (size_t)(map->size - start);
-            memcpy((char*)map->ptr + map->offset, data, m);
-            /* write on file */
-            f = (size_t)(last - map->size);
-            FILE_SEEK(map->fd, map->view_offset + map->size, SEEK_SET);
-            if (FILE_WRITE(map->fd, (char*)data+m, (int)f) != f)
-                return -1;
-        }
+    /* ファイル位置を共有しないように pread() を使用します。*/
+    while (n < size) {
+        ssize_t rb;
+
+        SAFE_SYSCALL(rb, pread(fd, p+n, size-n, (off_t)(offset+n)));
+        if (rb <= 0)
+            return -1;
+        n += rb;
     }
-    if (last > map->real_size)
-        map->real_size = last;
+#endif
     return 0;
 }
 
-static int mmap_auto_resize_open(struct mmap_t* map, int64 offset)
+static int file_write_at(int fd, const void* data, size_t size, int64 offset)
 {
-    int64 cur_size;
-    int64 map_size = 0;
+#ifdef _WIN32
+    FILE_SEEK(fd, offset, SEEK_SET);
+    if (FILE_WRITE(fd, data, (int)size) != size)
+        return -1;
+#else
+    const char* p = (const char*)data;
+    size_t n = 0;
 
-    cur_size = map->real_size / 2;
-    while (cur_size >= AUTO_EXTEND_SIZE) {
-        map->view_size = cur_size / map->pgsize * map->pgsize;
-        if (mmap_open_aux(map, map->fd, map->open_mode, offset) == 0) {
-            map_size = map->view_size;
-            break;
+    /* ファイル位置を共有しないように pwrite() を使用します。*/
+    while (n < size) {
+        ssize_t wb;
+
+        SAFE_SYSCALL(wb, pwrite(fd, p+n, size-n, (off_t)(offset+n)));
+        if (wb < 0) {
+            err_write("mmap: write failed, %s", strerror(errno));
+            return -1;
         }
-        cur_size /= 2;
+        n += wb;
     }
+#endif
+    return 0;
+}
 
-    if (map_size < 1)
+static void sleep_msec(int msec)
+{
+#ifdef _WIN32
+    Sleep(msec);
+#else
+    usleep(msec * 1000);
+#endif
+}
+
+#ifdef MMAP_URING
+/* io_uring のリング */
+struct mmap_uring_t {
+    int fd;
+    unsigned entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    int inflight;       /* submitted and not completed */
+};
+
+static void uring_close(struct mmap_uring_t* ring)
+{
+    if (ring == NULL)
+        return;
+    if (ring->sqes)
+        munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+    free(ring);
+}
+
+/* io_uring を作成します。
+   カーネルが対応していない場合は NULL を返します。*/
+static struct mmap_uring_t* uring_open(unsigned entries)
+{
+    struct mmap_uring_t* ring;
+    struct io_uring_params p;
+    char* sq;
+    char* cq;
+    void* ptr;
+
+    ring = (struct mmap_uring_t*)calloc(1, sizeof(struct mmap_uring_t));
+    if (ring == NULL)
+        return NULL;
+    memset(&p, '\0', sizeof(p));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    ring->entries = p.sq_entries;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ptr = mmap(0, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               ring->fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED)
+        goto error;
+    ring->sq_ptr = ptr;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ptr = mmap(0, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring->fd, IORING_OFF_CQ_RING);
+        if (ptr == MAP_FAILED)
+            goto error;
+        ring->cq_ptr = ptr;
+    }
+    ptr = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED)
+        goto error;
+    ring->sqes = (struct io_uring_sqe*)ptr;
+
+    sq = (char*)ring->sq_ptr;
+    cq = (char*)ring->cq_ptr;
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return ring;
+
+error:
+    uring_close(ring);
+    return NULL;
+}
+
+/* 要求をキューに追加します。キューが一杯の場合は -1 を返します。*/
+static int uring_prep(struct mmap_uring_t* ring, int opcode, int fd,
+                      void* buf, int len, int64 offset, int user_data)
+{
+    unsigned tail, index;
+    struct io_uring_sqe* sqe;
+
+    if (ring->inflight >= (int)ring->entries)
+        return -1;
+    tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries)
         return -1;
 
-    cur_size = map_size;
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, '\0', sizeof(struct io_uring_sqe));
+    sqe->opcode = (uchar)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64)(size_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->off = (uint64)offset;
+    sqe->user_data = (uint64)user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->inflight++;
+    return 0;
+}
+
+/* キューの要求を発行して wait 個の完了を待ちます。*/
+static int uring_enter(struct mmap_uring_t* ring, int wait)
+{
+    unsigned submit;
+    int n;
+
     while (1) {
-        mmap_unmap(map);
-        cur_size += AUTO_EXTEND_SIZE;
-        map->view_size = cur_size / map->pgsize * map->pgsize;
-        if (mmap_open_aux(map, map->fd, map->open_mode, offset) != 0)
+        submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        n = (int)syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                         (wait > 0)? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0)
+            return 0;
+        if (errno != EINTR)
             break;
-        map_size = map->view_size;
     }
-    map->view_size = map_size;
-    return mmap_open_aux(map, map->fd, map->open_mode, offset);
+    err_write("mmap: io_uring_enter failed, %s", strerror(errno));
+    return -1;
 }
 
-/*
- * メモリマップドファイルを作成します。
- *
- * map_size に MMAP_AUTO_SIZE が指定されてファイルサイズが
- * 大きくてファイル全体がマップできない場合はマップできるサイズで
- * 作成されます。この場合は自動拡張は無効になります。
- *
- * fd: オープン済みのファイルディスクリプタ
- * map_mode: マップモード(MMAP_READONLY, MMAP_READWRITE)
- * map_size: マップサイズ（MMAP_AUTO_SIZEの場合はファイル全体）
- *
- * 戻り値
- *  メモリマップ構造体のポインタ
- */
-APIEXPORT struct mmap_t* mmap_open(int fd, int map_mode, int64 map_size)
+/* 完了した要求を一つ取り出します。完了がない場合はゼロを返します。*/
+static int uring_complete(struct mmap_uring_t* ring, int* user_data, int* res)
 {
-    struct mmap_t* map;
-    int result;
-#ifdef _WIN32
-    SYSTEM_INFO si;
-#endif
+    unsigned head;
+    struct io_uring_cqe* cqe;
 
-    map = (struct mmap_t*)calloc(1, sizeof(struct mmap_t));
-    if (map == NULL) {
-        err_write("mmap_open: no memory");
-        return NULL;
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = (int)cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    ring->inflight--;
+    return 1;
+}
+
+/* 発行済みの要求が一つ以上完了するまで待ちます。*/
+static int uring_wait(struct mmap_uring_t* ring)
+{
+    int n;
+
+    while (1) {
+        n = (int)syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0)
+            return 0;
+        if (errno != EINTR)
+            break;
     }
+    err_write("mmap: io_uring_enter failed, %s", strerror(errno));
+    return -1;
+}
+#endif
 
+/* ページを読み込みます。ファイルの最後を超える部分はゼロになります。*/
+static int page_read_at(int fd, char* buf, int64 offset)
+{
+    size_t n = 0;
 #ifdef _WIN32
-    GetSystemInfo(&si);
-    map->pgsize = si.dwAllocationGranularity;
-#else
-    map->pgsize = getpagesize();
-#endif
+    int rb;
 
-    map->open_mode = map_mode;
-    map->fd = fd;
-    if (map_size == MMAP_AUTO_SIZE)
-        map->view_size = MMAP_AUTO_SIZE;
-    else
-        map->view_size = map_size / map->pgsize * map->pgsize;
+    FILE_SEEK(fd, offset, SEEK_SET);
+    rb = FILE_READ(fd, buf, MMAP_POOL_PAGESIZE);
+    if (rb < 0)
+        return -1;
+    n = rb;
+#else
+    while (n < MMAP_POOL_PAGESIZE) {
+        ssize_t rb;
 
-    result = mmap_open_aux(map, fd, map_mode, 0);
-    if (result != 0) {
-        if (map_size == MMAP_AUTO_SIZE)
-            result = mmap_auto_resize_open(map, 0);
-        if (result == 0) {
-            logout_write("mmap_open: mmap resize=%lld to %lld", map->real_size, map->view_size);
-        } else {
-            free(map);
-            err_write("mmap_open: can't allocate memory map, size=%lld", map->real_size);
-            return NULL;
+        SAFE_SYSCALL(rb, pread(fd, buf+n, MMAP_POOL_PAGESIZE-n, (off_t)(offset+n)));
+        if (rb < 0) {
+            err_write("mmap: read failed, %s", strerror(errno));
+            return -1;
         }
+        if (rb == 0)
+            break;
+        n += rb;
     }
-    return map;
+#endif
+    if (n < MMAP_POOL_PAGESIZE)
+        memset(buf+n, '\0', MMAP_POOL_PAGESIZE-n);
+    return 0;
 }
 
-/*
- * メモリマップドファイルをクローズします。
- *
- * map: メモリマップ構造体のポインタ
- *
- * 戻り値
- *  なし
- */
-APIEXPORT void mmap_close(struct mmap_t* map)
+static char* frame_data(struct mmap_pool_t* pool, int index)
 {
-    if (map) {
-        mmap_unmap(map);
-        if (map->size != map->real_size)
-            FILE_TRUNCATE(map->fd, map->real_size);
-        free(map);
+    return pool->data + (size_t)index * MMAP_POOL_PAGESIZE;
+}
+
+static int pool_hash(struct mmap_pool_t* pool, int64 pgoff)
+{
+    return (int)((pgoff / MMAP_POOL_PAGESIZE) & pool->hash_mask);
+}
+
+static int pool_lookup(struct mmap_pool_t* pool, int64 pgoff)
+{
+    int index;
+
+    index = pool->hash[pool_hash(pool, pgoff)];
+    while (index >= 0) {
+        if (pool->frame[index].offset == pgoff)
+            return index;
+        index = pool->frame[index].next;
     }
+    return -1;
 }
 
-/*
- * メモリマップの現在位置からサイズ分のメモリ領域のポインタを返します。
- * 返されたポインタからサイズ分の領域にメモリ操作が行えます。
- *
- * マップのビューサイズが指定されている場合はビューの位置が調整されます。
- *
- * map: メモリマップ構造体のポインタ
+static void pool_link(struct mmap_pool_t* pool, int index, int64 pgoff)
+{
+    struct mmap_frame_t* fr;
+    int h;
+
+    h = pool_hash(pool, pgoff);
+    fr = &pool->frame[index];
+    fr->offset = pgoff;
+    fr->next = pool->hash[h];
+    fr->refbit = 1;
+    fr->dirty = 0;
+    fr->flushing = 0;
+    fr->loading = 0;
+    pool->hash[h] = index;
+}
+
+static void pool_unlink(struct mmap_pool_t* pool, int index)
+{
+    struct mmap_frame_t* fr;
+    int* p;
+
+    fr = &pool->frame[index];
+    if (fr->offset < 0)
+        return;
+    p = &pool->hash[pool_hash(pool, fr->offset)];
+    while (*p >= 0) {
+        if (*p == index) {
+            *p = fr->next;
+            break;
+        }
+        p = &pool->frame[*p].next;
+    }
+    fr->offset = -1;
+    fr->next = -1;
+}
+
+/* ページの書き出す長さを返します。ファイルサイズを超える部分は書き出しません。*/
+static int page_length(struct mmap_t* map, int64 pgoff)
+{
+    int64 len;
+
+    len = map->real_size - pgoff;
+    if (len > MMAP_POOL_PAGESIZE)
+        return MMAP_POOL_PAGESIZE;
+    return (len > 0)? (int)len : 0;
+}
+
+/* ページをファイルに書き出す前に書き出しフックを呼び出します。*/
+static int call_flush_hook(struct mmap_t* map)
+{
+    if (map->flush_hook == NULL)
+        return 0;
+    return (*map->flush_hook)(map->flush_arg);
+}
+
+static int pool_flush(struct mmap_t* map);
+
+/* 置き換えるフレームを CLOCK で選びます。
+   変更されたフレームは書き出しが必要なため選びません。
+   選べない場合は -1 を返します。*/
+static int pool_victim(struct mmap_pool_t* pool)
+{
+    int n;
+
+    for (n = 0; n < pool->count * 2; n++) {
+        struct mmap_frame_t* fr;
+        int index;
+
+        index = pool->hand;
+        pool->hand = (index + 1 < pool->count)? index + 1 : 0;
+        fr = &pool->frame[index];
+        if (fr->offset < 0)
+            return index;
+        if (fr->loading || fr->flushing)
+            continue;
+        if (fr->refbit) {
+            fr->refbit = 0;
+            continue;
+        }
+        if (fr->dirty)
+            continue;
+        pool_unlink(pool, index);
+        return index;
+    }
+    return -1;
+}
+
+#ifdef MMAP_URING
+/* 完了した読み込みを処理します。
+   他のスレッドが完了を待っている場合は何もしません。*/
+static void pool_reap(struct mmap_t* map)
+{
+    struct mmap_pool_t* pool;
+    int index, res;
+    int count = 0;
+
+    pool = map->pool;
+    if (pool->reaping)
+        return;
+    while (uring_complete(pool->read_ring, &index, &res)) {
+        struct mmap_frame_t* fr;
+
+        fr = &pool->frame[index];
+        fr->loading = 0;
+        if (res < 0) {
+            /* 読み込めなかったページは破棄します。*/
+            pool_unlink(pool, index);
+        } else if (res < MMAP_POOL_PAGESIZE) {
+            memset(frame_data(pool, index) + res, '\0', MMAP_POOL_PAGESIZE - res);
+        }
+        count++;
+    }
+    if (count > 0)
+        COND_BROADCAST(&pool->frame_cond);
+}
+
+/* 範囲内のキャッシュされていないページの読み込みを最大 POOL_PREFETCH_PAGES
+   ページ、io_uring でまとめて発行します。完了は pool_reap() で処理されます。
+   発行したページ数を返します。*/
+static int pool_submit(struct mmap_t* map, int64 pgoff, int64 last)
+{
+    struct mmap_pool_t* pool;
+    int n = 0;
+
+    pool = map->pool;
+    for (; pgoff < last && n < POOL_PREFETCH_PAGES; pgoff += MMAP_POOL_PAGESIZE) {
+        int index;
+
+        if (pool_lookup(pool, pgoff) >= 0)
+            continue;
+        index = pool_victim(pool);
+        if (index < 0)
+            break;
+        if (uring_prep(pool->read_ring, IORING_OP_READ, map->fd,
+                       frame_data(pool, index), MMAP_POOL_PAGESIZE, pgoff, index) < 0)
+            break;
+        pool_link(pool, index, pgoff);
+        pool->frame[index].loading = FRAME_URING;
+        n++;
+    }
+    if (n > 0)
+        uring_enter(pool->read_ring, 0);
+    return n;
+}
+#endif
+
+/* 読み込み中または書き出し中のフレームの状態が変わるまで待ちます。
+   critical_section を保持して呼び出し、待っている間は解除されます。
+   io_uring の完了は一つのスレッドだけが待ち、他のスレッドは
+   条件変数で待ちます。*/
+static int pool_wait(struct mmap_t* map)
+{
+    struct mmap_pool_t* pool;
+
+    pool = map->pool;
+#ifdef MMAP_URING
+    if (pool->read_ring && pool->read_ring->inflight > 0 && ! pool->reaping) {
+        int result;
+
+        pool->reaping = 1;
+        CS_END(&pool->critical_section);
+        result = uring_wait(pool->read_ring);
+        CS_START(&pool->critical_section);
+        pool->reaping = 0;
+        pool_reap(map);
+        /* 完了を待つスレッドを交代できるように起こします。*/
+        COND_BROADCAST(&pool->frame_cond);
+        return result;
+    }
+#endif
+    COND_WAIT(&pool->frame_cond, &pool->critical_section);
+    return 0;
+}
+
+/* 連続するページを一回の読み込みでフレームに読み込みます。
+   ファイルの最後を超える部分はゼロになります。*/
+static int pages_read_at(struct mmap_t* map, const int* index, int count, int64 offset)
+{
+    struct mmap_pool_t* pool;
+    int i;
+
+    pool = map->pool;
+#ifdef _WIN32
+    for (i = 0; i < count; i++) {
+        if (page_read_at(map->fd, frame_data(pool, index[i]),
+                         offset + (int64)i * MMAP_POOL_PAGESIZE) < 0)
+            return -1;
+    }
+#else
+    {
+        struct iovec iov[POOL_PREFETCH_PAGES];
+        size_t total, n = 0;
+
+        for (i = 0; i < count; i++) {
+            iov[i].iov_base = frame_data(pool, index[i]);
+            iov[i].iov_len = MMAP_POOL_PAGESIZE;
+        }
+        total = (size_t)count * MMAP_POOL_PAGESIZE;
+        while (n < total) {
+            ssize_t rb;
+            size_t skip;
+
+            /* 途中まで読み込めた場合は残りから読み込みます。*/
+            i = (int)(n / MMAP_POOL_PAGESIZE);
+            skip = n % MMAP_POOL_PAGESIZE;
+            iov[i].iov_base = frame_data(pool, index[i]) + skip;
+            iov[i].iov_len = MMAP_POOL_PAGESIZE - skip;
+            SAFE_SYSCALL(rb, preadv(map->fd, &iov[i], count - i, (off_t)(offset + n)));
+            if (rb < 0) {
+                err_write("mmap: read failed, %s", strerror(errno));
+                return -1;
+            }
+            if (rb == 0)
+                break;
+            n += rb;
+        }
+        for (i = 0; i < count; i++) {
+            size_t done = 0;
+
+            if (n > (size_t)i * MMAP_POOL_PAGESIZE)
+                done = n - (size_t)i * MMAP_POOL_PAGESIZE;
+            if (done < MMAP_POOL_PAGESIZE)
+                memset(frame_data(pool, index[i]) + done, '\0', MMAP_POOL_PAGESIZE - done);
+        }
+    }
+#endif
+    return 0;
+}
+
+/* pgoff から始まる範囲のキャッシュされていないページを最大 POOL_PREFETCH_PAGES
+   ページまとめて読み込みます。
+   io_uring が使用できる場合はまとめて発行して完了は pool_fetch() で待ちます。
+   使用できない場合はキャッシュされているページの手前までを一回の読み込みで
+   読み込みます。空いているフレームが足りない場合は確保できた分だけ読み込みます。*/
+static void pool_load(struct mmap_t* map, int64 pgoff, int64 last)
+{
+    struct mmap_pool_t* pool;
+    int index[POOL_PREFETCH_PAGES];
+    int64 start;
+    int count = 0;
+    int i, result;
+
+    pool = map->pool;
+#ifdef MMAP_URING
+    if (pool->read_ring) {
+        pool_submit(map, pgoff, last);
+        return;
+    }
+#endif
+    start = pgoff;
+    for (; pgoff < last && count < POOL_PREFETCH_PAGES; pgoff += MMAP_POOL_PAGESIZE) {
+        int n;
+
+        if (pool_lookup(pool, pgoff) >= 0)
+            break;
+        n = pool_victim(pool);
+        if (n < 0)
+            break;
+        pool_link(pool, n, pgoff);
+        pool->frame[n].loading = FRAME_PREAD;
+        index[count++] = n;
+    }
+    if (count < 1)
+        return;
+
+    CS_END(&pool->critical_section);
+    result = pages_read_at(map, index, count, start);
+    CS_START(&pool->critical_section);
+    for (i = 0; i < count; i++) {
+        pool->frame[index[i]].loading = 0;
+        if (result < 0)
+            pool_unlink(pool, index[i]);
+    }
+    COND_BROADCAST(&pool->frame_cond);
+}
+
+/* ページのフレームを返します。
+   load が 1 の場合はキャッシュされていないページをファイルから読み込みます。
+   critical_section を保持して呼び出します。読み込みと変更されたページの
+   書き出しは critical_section を解除して行い、同じページを参照する
+   他のスレッドは読み込みの終了を待ちます。
+   エラーの場合は -1 を返します。*/
+static int pool_fetch(struct mmap_t* map, int64 pgoff, int load)
+{
+    struct mmap_pool_t* pool;
+    int index, result;
+
+    pool = map->pool;
+    while ((index = pool_lookup(pool, pgoff)) < 0 || pool->frame[index].loading) {
+        if (index >= 0) {
+            /* 読み込めなかった場合は破棄されているため探し直します。*/
+            if (pool_wait(map) < 0)
+                return -1;
+            continue;
+        }
+        index = pool_victim(pool);
+        if (index >= 0) {
+            pool_link(pool, index, pgoff);
+            if (! load)
+                return index;
+            pool->frame[index].loading = FRAME_PREAD;
+            CS_END(&pool->critical_section);
+            result = page_read_at(map->fd, frame_data(pool, index), pgoff);
+            CS_START(&pool->critical_section);
+            pool->frame[index].loading = 0;
+            if (result < 0)
+                pool_unlink(pool, index);
+            COND_BROADCAST(&pool->frame_cond);
+            return (result < 0)? -1 : index;
+        }
+        /* 置き換えられるフレームがない場合は変更されたページを書き出すか、
+           読み込みと書き出しの終了を待ちます。*/
+        if (pool->dirty_count > 0) {
+            CS_END(&pool->critical_section);
+            result = pool_flush(map);
+            CS_START(&pool->critical_section);
+            if (result < 0)
+                return -1;
+        } else if (pool_wait(map) < 0) {
+            return -1;
+        }
+    }
+    pool->frame[index].refbit = 1;
+    return index;
+}
+
+static size_t pool_read(struct mmap_t* map, void* data, size_t size, int64 offset)
+{
+    struct mmap_pool_t* pool;
+    char* p = (char*)data;
+    size_t n = 0;
+
+    pool = map->pool;
+    CS_START(&pool->critical_section);
+#ifdef MMAP_URING
+    if (pool->read_ring && pool->read_ring->inflight > 0)
+        pool_reap(map);
+#endif
+    while (n < size) {
+        int64 pos, pgoff;
+        size_t off, len;
+        int index;
+
+        pos = offset + n;
+        pgoff = pos - pos % MMAP_POOL_PAGESIZE;
+        off = (size_t)(pos - pgoff);
+        len = MMAP_POOL_PAGESIZE - off;
+        if (len > size - n)
+            len = size - n;
+
+        /* 複数のページにまたがる場合はまとめて読み込みます。*/
+        if (len < size - n && pool_lookup(pool, pgoff) < 0)
+            pool_load(map, pgoff, offset + size);
+        index = pool_fetch(map, pgoff, 1);
+        if (index < 0) {
+            CS_END(&pool->critical_section);
+            return -1;
+        }
+        memcpy(p+n, frame_data(pool, index) + off, len);
+        n += len;
+    }
+    CS_END(&pool->critical_section);
+    return size;
+}
+
+static size_t pool_write(struct mmap_t* map, const void* data, size_t size, int64 offset)
+{
+    struct mmap_pool_t* pool;
+    const char* p = (const char*)data;
+    size_t n = 0;
+
+    pool = map->pool;
+    CS_START(&pool->critical_section);
+#ifdef MMAP_URING
+    if (pool->read_ring && pool->read_ring->inflight > 0)
+        pool_reap(map);
+#endif
+    /* 書き出されるページが切り詰められないように先にファイルサイズを更新します。*/
+    if (offset + (int64)size > map->real_size)
+        map->real_size = offset + size;
+
+    while (n < size) {
+        int64 pos, pgoff;
+        size_t off, len;
+        int index;
+        struct mmap_frame_t* fr;
+
+        pos = offset + n;
+        pgoff = pos - pos % MMAP_POOL_PAGESIZE;
+        off = (size_t)(pos - pgoff);
+        len = MMAP_POOL_PAGESIZE - off;
+        if (len > size - n)
+            len = size - n;
+
+        /* ページ全体を書き換える場合は読み込みません。*/
+        index = pool_fetch(map, pgoff, (len < MMAP_POOL_PAGESIZE));
+        if (index < 0) {
+            CS_END(&pool->critical_section);
+            return -1;
+        }
+        memcpy(frame_data(pool, index) + off, p+n, len);
+        fr = &pool->frame[index];
+        if (! fr->dirty) {
+            fr->dirty = 1;
+            pool->dirty_count++;
+        }
+        n += len;
+    }
+    CS_END(&pool->critical_section);
+    return size;
+}
+
+static int stage_write(struct mmap_t* map, int count, const int64* offs, const int* lens)
+{
+    struct mmap_pool_t* pool;
+    int i;
+
+    pool = map->pool;
+#ifdef MMAP_URING
+    if (pool->write_ring) {
+        struct mmap_uring_t* ring;
+        int submitted = 0;
+        int error = 0;
+        int index, res;
+
+        /* まとめて発行して完了を待ちます。*/
+        ring = pool->write_ring;
+        for (i = 0; i < count; i++) {
+            if (lens[i] < 1)
+                continue;
+            if (uring_prep(ring, IORING_OP_WRITE, map->fd,
+                           pool->stage + (size_t)i * MMAP_POOL_PAGESIZE,
+                           lens[i], offs[i], i) < 0)
+                break;
+            submitted++;
+        }
+        if (submitted > 0 && uring_enter(ring, submitted) < 0)
+            return -1;
+        while (ring->inflight > 0) {
+            if (! uring_complete(ring, &index, &res)) {
+                if (uring_enter(ring, 1) < 0)
+                    return -1;
+                continue;
+            }
+            if (res == lens[index])
+                continue;
+            /* 書き込めなかった部分は pwrite() で書き込みます。*/
+            if (res < 0)
+                res = 0;
+            if (file_write_at(map->fd, pool->stage + (size_t)index * MMAP_POOL_PAGESIZE + res,
+                              lens[index] - res, offs[index] + res) < 0)
+                error = 1;
+        }
+        /* キューに入らなかった残りは pwrite() で書き込みます。*/
+        for (; i < count; i++) {
+            if (lens[i] < 1)
+                continue;
+            if (file_write_at(map->fd, pool->stage + (size_t)i * MMAP_POOL_PAGESIZE, lens[i], offs[i]) < 0)
+                error = 1;
+        }
+        return (error)? -1 : 0;
+    }
+#endif
+    for (i = 0; i < count; i++) {
+        if (lens[i] < 1)
+            continue;
+        if (file_write_at(map->fd, pool->stage + (size_t)i * MMAP_POOL_PAGESIZE, lens[i], offs[i]) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* 変更されたページを最大 POOL_FLUSH_PAGES ページ、位置の順に書き出します。
+   書き出し中のページは置き換えられませんが、変更することはできます。
+   書き出したページ数を返します。エラーの場合は -1 を返します。*/
+static int pool_flush(struct mmap_t* map)
+{
+    struct mmap_pool_t* pool;
+    int64 offs[POOL_FLUSH_PAGES];
+    int lens[POOL_FLUSH_PAGES];
+    int count = 0;
+    int result = 0;
+    int i, j;
+
+    pool = map->pool;
+    CS_START(&pool->flush_critical_section);
+    CS_START(&pool->critical_section);
+    for (i = 0; i < pool->count && count < POOL_FLUSH_PAGES && pool->dirty_count > count; i++) {
+        if (! pool->frame[i].dirty)
+            continue;
+        for (j = count; j > 0; j--) {
+            if (pool->frame[pool->stage_index[j-1]].offset < pool->frame[i].offset)
+                break;
+            pool->stage_index[j] = pool->stage_index[j-1];
+        }
+        pool->stage_index[j] = i;
+        count++;
+    }
+    for (i = 0; i < count; i++) {
+        struct mmap_frame_t* fr;
+
+        fr = &pool->frame[pool->stage_index[i]];
+        memcpy(pool->stage + (size_t)i * MMAP_POOL_PAGESIZE,
+               frame_data(pool, pool->stage_index[i]), MMAP_POOL_PAGESIZE);
+        offs[i] = fr->offset;
+        lens[i] = page_length(map, fr->offset);
+        fr->dirty = 0;
+        fr->flushing = 1;
+        pool->dirty_count--;
+    }
+    CS_END(&pool->critical_section);
+
+    if (count > 0) {
+        result = call_flush_hook(map);
+        if (result == 0)
+            result = stage_write(map, count, offs, lens);
+    }
+
+    CS_START(&pool->critical_section);
+    for (i = 0; i < count; i++) {
+        struct mmap_frame_t* fr;
+
+        fr = &pool->frame[pool->stage_index[i]];
+        fr->flushing = 0;
+        if (result < 0 && ! fr->dirty) {
+            /* 書き出せなかったページは再度書き出します。*/
+            fr->dirty = 1;
+            pool->dirty_count++;
+        }
+    }
+    if (count > 0)
+        COND_BROADCAST(&pool->frame_cond);
+    CS_END(&pool->critical_section);
+    CS_END(&pool->flush_critical_section);
+    return (result < 0)? -1 : count;
+}
+
+static int pool_flush_all(struct mmap_t* map)
+{
+    int n;
+
+    while ((n = pool_flush(map)) > 0)
+        ;
+    return n;
+}
+
+/* ファイルサイズを縮める場合に切り詰められる位置以降のキャッシュを破棄します。
+   書き出し中と読み込み中のページがなくなるまで待ちます。*/
+static void pool_truncate(struct mmap_t* map, int64 size)
+{
+    struct mmap_pool_t* pool;
+    int i;
+
+    pool = map->pool;
+    CS_START(&pool->flush_critical_section);
+    CS_START(&pool->critical_section);
+    for (i = 0; i < pool->count; i++) {
+        if (pool->frame[i].loading) {
+            if (pool_wait(map) < 0)
+                break;
+            i = -1;     /* 最初から確認し直します。*/
+        }
+    }
+    for (i = 0; i < pool->count; i++) {
+        struct mmap_frame_t* fr;
+
+        fr = &pool->frame[i];
+        if (fr->offset < 0 || fr->offset + MMAP_POOL_PAGESIZE <= size)
+            continue;
+        if (fr->offset < size) {
+            memset(frame_data(pool, i) + (size - fr->offset), '\0',
+                   (size_t)(fr->offset + MMAP_POOL_PAGESIZE - size));
+            continue;
+        }
+        if (fr->dirty) {
+            fr->dirty = 0;
+            pool->dirty_count--;
+        }
+        fr->loading = 0;
+        pool_unlink(pool, i);
+    }
+    CS_END(&pool->critical_section);
+    CS_END(&pool->flush_critical_section);
+}
+
+/* 指定された範囲を先読みします。
+   io_uring が使用できる場合は空いているフレームにまとめて読み込みを発行し、
+   完了は読み込み時に処理されます。*/
+static void pool_prefetch(struct mmap_t* map, int64 offset, int64 size)
+{
+    int64 last;
+
+    if (offset < 0 || size <= 0)
+        return;
+    last = offset + size;
+    if (last > map->real_size)
+        last = map->real_size;
+    if (last <= offset)
+        return;
+
+#ifdef MMAP_URING
+    if (map->pool->read_ring) {
+        struct mmap_pool_t* pool;
+
+        pool = map->pool;
+        CS_START(&pool->critical_section);
+        pool_reap(map);
+        pool_submit(map, offset - offset % MMAP_POOL_PAGESIZE, last);
+        CS_END(&pool->critical_section);
+        return;
+    }
+#endif
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(map->fd, (off_t)offset, (off_t)(last - offset), POSIX_FADV_WILLNEED);
+#endif
+}
+
+#ifdef _WIN32
+static unsigned __stdcall writeback_thread(void* argv)
+#else
+static void* writeback_thread(void* argv)
+#endif
+{
+    struct mmap_t* map;
+    struct mmap_pool_t* pool;
+    int elapsed = 0;
+
+    map = (struct mmap_t*)argv;
+    pool = map->pool;
+    while (! pool->end_flag) {
+        sleep_msec(WRITEBACK_WAIT_MSEC);
+        elapsed += WRITEBACK_WAIT_MSEC;
+        if (pool->dirty_count < 1)
+            continue;
+        /* 変更されたページが一定の割合を超えたか、
+           一定の時間が経過した場合に書き出します。*/
+        if (pool->dirty_count * 100 < pool->count * POOL_DIRTY_RATIO &&
+            elapsed < WRITEBACK_INTERVAL_MSEC)
+            continue;
+        elapsed = 0;
+        while (! pool->end_flag && pool->dirty_count > 0) {
+            if (pool_flush(map) <= 0)
+                break;
+        }
+    }
+    return 0;
+}
+
+static void pool_free(struct mmap_t* map)
+{
+    struct mmap_pool_t* pool;
+
+    pool = map->pool;
+    if (pool == NULL)
+        return;
+
+    if (pool->running) {
+        /* スレッドの終了を待ちます。*/
+        pool->end_flag = 1;
+#ifdef _WIN32
+        WaitForSingleObject(pool->thread, INFINITE);
+        CloseHandle(pool->thread);
+#else
+        pthread_join(pool->thread, NULL);
+#endif
+        pool->running = 0;
+    }
+    if (pool->dirty_count > 0) {
+        if (pool_flush_all(map) < 0)
+            err_write("mmap_close: can't write back pages.");
+    }
+#ifdef MMAP_URING
+    if (pool->read_ring) {
+        /* 発行済みの読み込みの完了を待ってからバッファを解放します。*/
+        while (pool->read_ring->inflight > 0) {
+            int index, res;
+
+            if (! uring_complete(pool->read_ring, &index, &res)) {
+                if (uring_enter(pool->read_ring, 1) < 0)
+                    break;
+            }
+        }
+        uring_close(pool->read_ring);
+    }
+    uring_close(pool->write_ring);
+#endif
+    CS_DELETE(&pool->critical_section);
+    CS_DELETE(&pool->flush_critical_section);
+    COND_DELETE(&pool->frame_cond);
+    if (pool->frame)
+        free(pool->frame);
+    if (pool->hash)
+        free(pool->hash);
+    if (pool->data)
+        free(pool->data);
+    if (pool->stage)
+        free(pool->stage);
+    if (pool->stage_index)
+        free(pool->stage_index);
+    free(pool);
+    map->pool = NULL;
+}
+
+static int pool_create(struct mmap_t* map, int64 pool_size)
+{
+    struct mmap_pool_t* pool;
+    int64 count;
+    int hsize;
+    int i;
+
+    pool = (struct mmap_pool_t*)calloc(1, sizeof(struct mmap_pool_t));
+    if (pool == NULL) {
+        err_write("mmap_open_pool: no memory");
+        return -1;
+    }
+    CS_INIT(&pool->critical_section);
+    CS_INIT(&pool->flush_critical_section);
+    COND_INIT(&pool->frame_cond);
+    map->pool = pool;
+
+    count = pool_size / MMAP_POOL_PAGESIZE;
+    if (count < POOL_MIN_FRAMES)
+        count = POOL_MIN_FRAMES;
+    if (count > 0x7FFFFFFF / 2)
+        count = 0x7FFFFFFF / 2;
+    pool->count = (int)count;
+    hsize = 1;
+    while (hsize < pool->count)
+        hsize <<= 1;
+    pool->hash_mask = hsize - 1;
+
+    pool->frame = (struct mmap_frame_t*)calloc(pool->count, sizeof(struct mmap_frame_t));
+    pool->hash = (int*)malloc(hsize * sizeof(int));
+    pool->data = (char*)malloc((size_t)pool->count * MMAP_POOL_PAGESIZE);
+    pool->stage = (char*)malloc(POOL_FLUSH_PAGES * MMAP_POOL_PAGESIZE);
+    pool->stage_index = (int*)malloc(POOL_FLUSH_PAGES * sizeof(int));
+    if (pool->frame == NULL || pool->hash == NULL || pool->data == NULL ||
+        pool->stage == NULL || pool->stage_index == NULL) {
+        err_write("mmap_open_pool: no memory, pool size=%lld", pool_size);
+        pool_free(map);
+        return -1;
+    }
+    for (i = 0; i < pool->count; i++) {
+        pool->frame[i].offset = -1;
+        pool->frame[i].next = -1;
+    }
+    for (i = 0; i < hsize; i++)
+        pool->hash[i] = -1;
+
+#ifdef MMAP_URING
+    /* io_uring が使用できない場合は pread/pwrite を使用します。*/
+    pool->read_ring = uring_open(URING_ENTRIES);
+    pool->write_ring = uring_open(POOL_FLUSH_PAGES);
+#endif
+
+    if (map->open_mode == MMAP_READWRITE) {
+#ifdef _WIN32
+        pool->thread = (HANDLE)_beginthreadex(NULL, 0, writeback_thread, map, 0, NULL);
+        if (pool->thread == 0) {
+#else
+        if (pthread_create(&pool->thread, NULL, writeback_thread, map) != 0) {
+#endif
+            err_write("mmap_open_pool: can't create write-back thread.");
+            pool_free(map);
+            return -1;
+        }
+        pool->running = 1;
+    }
+    return 0;
+}
+
+static int mf_write(struct mmap_t* map, const void* data, size_t size, int64 offset)
+{
+    int64 start, last;
+
+    start = map->view_offset + offset;
+    last = start + size;
+    if (last <= map->size) {
+        memcpy((char*)map->ptr + offset, data, size);
+    } else {
+        if (start >= map->size) {
+            if (file_write_at(map->fd, data, size, start) < 0)
+                return -1;
+        } else {
+            size_t m, f;
+
+            /* write on mmap */
+            m = (size_t)(map->size - start);
+            memcpy((char*)map->ptr + offset, data, m);
+            /* write on file */
+            f = (size_t)(last - map->size);
+            if (file_write_at(map->fd, (char*)data+m, f, map->view_offset + map->size) < 0)
+                return -1;
+        }
+    }
+    if (last > map->real_size)
+        map->real_size = last;
+    return 0;
+}
+
+static size_t map_read(struct mmap_t* map, void* data, size_t size, int64 offset)
+{
+    int64 start, last;
+
+    start = map->view_offset + offset;
+    last = start + size;
+    if (last > map->real_size) {
+        /* end of file */
+        err_write("mmap_read: over the file size");
+        return -1;
+    }
+    if (map->pool)
+        return pool_read(map, data, size, start);
+
+    if (last <= map->size) {
+        memcpy(data, (char*)map->ptr + offset, size);
+    } else {
+        if (start >= map->size) {
+            if (file_read_at(map->fd, data, size, start) < 0)
+                return -1;
+        } else {
+            size_t m, f;
+
+            /* read on mmap */
+            m = (size_t)(map->size - start);
+            memcpy(data, (char*)map->ptr + offset, m);
+            /* read on file */
+            f = (size_t)(last - map->size);
+            if (file_read_at(map->fd, (char*)data+m, f, map->view_offset + map->size) < 0)
+                return -1;
+        }
+    }
+    return size;
+}
+
+static int call_write_hook(struct mmap_t* map, const void* data, size_t size, int64 offset)
+{
+    int64 start;
+    int bsize = 0;
+    void* before = NULL;
+    int result;
+
+    /* 書き込み前の内容(ファイルサイズ内)を取得します。*/
+    start = map->view_offset + offset;
+    if (start < map->real_size) {
+        bsize = (int)((start + (int64)size <= map->real_size)? size : map->real_size - start);
+        before = malloc(bsize);
+        if (before == NULL) {
+            err_write("mmap: no memory");
+            return -1;
+        }
+        if (map_read(map, before, bsize, offset) != bsize) {
+            free(before);
+            return -1;
+        }
+    }
+    result = (*map->write_hook)(map->hook_arg, start, before, bsize, data, (int)size);
+    if (before)
+        free(before);
+    return result;
+}
+
+static size_t map_write(struct mmap_t* map, const void* data, size_t size, int64 offset)
+{
+    int64 last;
+
+    if (map->write_hook) {
+        if (call_write_hook(map, data, size, offset) < 0)
+            return -1;
+    }
+    if (map->pool)
+        return pool_write(map, data, size, map->view_offset + offset);
+
+    last = map->view_offset + offset + size;
+    if (map->view_size == MMAP_AUTO_SIZE) {
+        if (mmap_auto_resize(map, last) < 0) {
+            /* サイズ拡張できないため、
+               現在のサイズで固定してファイルに書き出します。*/
+            map->view_size = map->size;
+            if (mf_write(map, data, size, offset) < 0)
+                return -1;
+        } else {
+            memcpy((char*)map->ptr + offset, data, size);
+        }
+    } else {
+        if (mf_write(map, data, size, offset) < 0)
+            return -1;
+    }
+    return size;
+}
+
+static int mmap_auto_resize_open(struct mmap_t* map, int64 offset)
+{
+    int64 cur_size;
+    int64 map_size = 0;
+
+    cur_size = map->real_size / 2;
+    while (cur_size >= AUTO_EXTEND_SIZE) {
+        map->view_size = cur_size / map->pgsize * map->pgsize;
+        if (mmap_open_aux(map, map->fd, map->open_mode, offset) == 0) {
+            map_size = map->view_size;
+            break;
+        }
+        cur_size /= 2;
+    }
+
+    if (map_size < 1)
+        return -1;
+
+    cur_size = map_size;
+    while (1) {
+        mmap_unmap(map);
+        cur_size += AUTO_EXTEND_SIZE;
+        map->view_size = cur_size / map->pgsize * map->pgsize;
+        if (mmap_open_aux(map, map->fd, map->open_mode, offset) != 0)
+            break;
+        map_size = map->view_size;
+    }
+    map->view_size = map_size;
+    return mmap_open_aux(map, map->fd, map->open_mode, offset);
+}
+
+/*
+ * メモリマップドファイルを作成します。
+ *
+ * map_size に MMAP_AUTO_SIZE が指定されてファイルサイズが
+ * 大きくてファイル全体がマップできない場合はマップできるサイズで
+ * 作成されます。この場合は自動拡張は無効になります。
+ *
+ * fd: オープン済みのファイルディスクリプタ
+ * map_mode: マップモード(MMAP_READONLY, MMAP_READWRITE)
+ * map_size: マップサイズ（MMAP_AUTO_SIZEの場合はファイル全体）
+ *
+ * 戻り値
+ *  メモリマップ構造体のポインタ
+ */
+APIEXPORT struct mmap_t* mmap_open(int fd, int map_mode, int64 map_size)
+{
+    struct mmap_t* map;
+    int result;
+#ifdef _WIN32
+    SYSTEM_INFO si;
+#endif
+
+    map = (struct mmap_t*)calloc(1, sizeof(struct mmap_t));
+    if (map == NULL) {
+        err_write("mmap_open: no memory");
+        return NULL;
+    }
+
+#ifdef _WIN32
+    GetSystemInfo(&si);
+    map->pgsize = si.dwAllocationGranularity;
+#else
+    map->pgsize = getpagesize();
+#endif
+
+    map->open_mode = map_mode;
+    map->fd = fd;
+    RWLOCK_INIT(&map->map_lock);
+    CS_INIT(&map->pin_critical_section);
+    if (map_size == MMAP_AUTO_SIZE)
+        map->view_size = MMAP_AUTO_SIZE;
+    else
+        map->view_size = map_size / map->pgsize * map->pgsize;
+
+    result = mmap_open_aux(map, fd, map_mode, 0);
+    if (result != 0) {
+        if (map_size == MMAP_AUTO_SIZE)
+            result = mmap_auto_resize_open(map, 0);
+        if (result == 0) {
+            logout_write("mmap_open: mmap resize=%lld to %lld", map->real_size, map->view_size);
+        } else {
+            RWLOCK_DELETE(&map->map_lock);
+            CS_DELETE(&map->pin_critical_section);
+            free(map);
+            err_write("mmap_open: can't allocate memory map, size=%lld", map->real_size);
+            return NULL;
+        }
+    }
+    return map;
+}
+
+/*
+ * ファイルをマップせずにバッファプールを介して読み書きする
+ * メモリマップ構造体を作成します(MMAP_IO_FILE)。
+ *
+ * 読み込みはプールのページ単位で行われ、複数のページにまたがる読み込みと
+ * mmap_prefetch() で指定された範囲は io_uring でまとめて読み込まれます。
+ * 変更されたページはバックグラウンドのスレッドで位置の順に
+ * まとめて書き出されます。io_uring が使用できない環境では
+ * preadv/pwrite で読み書きします。
+ * ファイルの読み書きはプールのロックを解除して行うため、
+ * 複数のスレッドの読み込みは並行して実行されます。
+ * 置き換えには変更されていないページを選び、空きがない場合は
+ * 変更されたページを書き出してから置き換えます。
+ *
+ * mmap_map(), mmap_pin() は常に NULL を返すため、呼び出し側は
+ * mmap_pread(), mmap_pwrite() で操作します。
+ *
+ * fd: オープン済みのファイルディスクリプタ
+ * map_mode: モード(MMAP_READONLY, MMAP_READWRITE)
+ * pool_size: バッファプールのバイト数
+ *
+ * 戻り値
+ *  メモリマップ構造体のポインタ
+ */
+APIEXPORT struct mmap_t* mmap_open_pool(int fd, int map_mode, int64 pool_size)
+{
+    struct mmap_t* map;
+#ifndef _WIN32
+    struct stat stat_buf;
+#endif
+
+    map = (struct mmap_t*)calloc(1, sizeof(struct mmap_t));
+    if (map == NULL) {
+        err_write("mmap_open_pool: no memory");
+        return NULL;
+    }
+#ifdef _WIN32
+    map->hFile = (HANDLE)_get_osfhandle(fd);
+    map->real_size = _filelengthi64(fd);
+#else
+    if (fstat(fd, &stat_buf) != 0) {
+        err_write("mmap_open_pool: can't stat file, %s", strerror(errno));
+        free(map);
+        return NULL;
+    }
+    map->real_size = stat_buf.st_size;
+#endif
+    map->pgsize = MMAP_POOL_PAGESIZE;
+    map->open_mode = map_mode;
+    map->fd = fd;
+    RWLOCK_INIT(&map->map_lock);
+    CS_INIT(&map->pin_critical_section);
+
+    if (pool_create(map, pool_size) < 0) {
+        RWLOCK_DELETE(&map->map_lock);
+        CS_DELETE(&map->pin_critical_section);
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+/*
+ * メモリマップドファイルをクローズします。
+ *
+ * map: メモリマップ構造体のポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+APIEXPORT void mmap_close(struct mmap_t* map)
+{
+    if (map) {
+        pool_free(map);
+        mmap_unmap(map);
+        release_retired(map->retire);
+        if (map->size != map->real_size)
+            FILE_TRUNCATE(map->fd, map->real_size);
+        RWLOCK_DELETE(&map->map_lock);
+        CS_DELETE(&map->pin_critical_section);
+        free(map);
+    }
+}
+
+/*
+ * メモリマップの現在位置からサイズ分のメモリ領域のポインタを返します。
+ * 返されたポインタからサイズ分の領域にメモリ操作が行えます。
+ *
+ * マップのビューサイズが指定されている場合はビューの位置が調整されます。
+ *
+ * map: メモリマップ構造体のポインタ
+ * size: バイト数
+ *
+ * 戻り値
+ *  offset のポインタを返します。
+ *  NULL の場合はメモリマップドの範囲から外れているので
+ *  mmap_read() か mmap_write() を使用して操作します。
+ */
+APIEXPORT char* mmap_map(struct mmap_t* map, int64 size)
+{
+    int64 last;
+
+    if (map->pool)
+        return NULL;
+
+    last = map->view_offset + map->offset + size;
+    if (map->view_size == MMAP_AUTO_SIZE) {
+        if (mmap_auto_resize(map, last) < 0)
+            return NULL;
+        return (char*)map->ptr + map->offset;
+    }
+
+    if (map->offset < map->view_offset ||
+        last > map->view_offset + map->size) {
+        /* 現在のマップ範囲外です。*/
+        return NULL;
+    }
+    return (char*)map->ptr + map->offset;
+}
+
+/*
+ * 任意のメモリマップの位置からサイズ分のメモリ領域のポインタを返します。
+ * 返されたポインタからサイズ分の領域にメモリ操作が行えます。
+ *
+ * NULL が返された場合でもオフセット位置は更新されます。
+ *
+ * map: メモリマップ構造体のポインタ
+ * offset: 先頭からのバイト数
+ * size: バイト数
+ *
+ * 戻り値
+ *  offset のポインタを返します。
+ *  NULL の場合はメモリマップドの範囲から外れているので
+ *  mmap_read() か mmap_write() を使用して操作します。
+ */
+APIEXPORT char* mmap_mapping(struct mmap_t* map, int64 offset, int64 size)
+{
+    map->offset = offset;
+    return mmap_map(map, size);
+}
+
+/*
+ * メモリマップの現在位置を移動します。
+ *
+ * map: メモリマップ構造体のポインタ
+ * offset: 先頭からのバイト数
+ *
+ * 戻り値
+ *  現在位置を返します。
+ */
+APIEXPORT int64 mmap_seek(struct mmap_t* map, int64 offset)
+{
+    map->offset = offset;
+    return offset;
+}
+
+/*
+ * メモリマップの現在位置からデータを取得します。
+ * 現在位置は取得したサイズ分進みます。
+ *
+ * 読み込む位置がメモリマップ外の場合はファイルから読み込みます。
+ *
+ * map: メモリマップ構造体のポインタ
+ * data: バッファのポインタ
+ * size: 取得するバイト数
+ *
+ * 戻り値
+ *  取得したバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+APIEXPORT size_t mmap_read(struct mmap_t* map, void* data, size_t size)
+{
+    size_t n;
+
+    n = mmap_pread(map, data, size, map->offset);
+    if (n == size)
+        map->offset += size;
+    return n;
+}
+
+/*
+ * メモリマップの現在位置にデータを設定します。
+ *
+ * メモリマップが自動拡張の場合はメモリマップのサイズを超えてデータを
+ * 設定した場合は、メモリマップの大きさが自動的に拡張されます。
+ * 自動拡張であってもメモリマップが拡張できない場合はファイル上に
+ * データが出力されます。
+ * 自動拡張でない場合はファイル上にデータが出力されます。
+ * 現在位置は設定したサイズ分進みます。
+ *
+ * map: メモリマップ構造体のポインタ
+ * data: バッファのポインタ
+ * size: 設定するバイト数
+ *
+ * 戻り値
+ *  設定したバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+APIEXPORT size_t mmap_write(struct mmap_t* map, const void* data, size_t size)
+{
+    size_t n;
+
+    n = mmap_pwrite(map, data, size, map->offset);
+    if (n == size)
+        map->offset += size;
+    return n;
+}
+
+/*
+ * メモリマップの指定位置からデータを取得します。
+ * mmap_read() と異なり現在位置は変更されません。
+ *
+ * マルチスレッドモードの場合は他のスレッドによるマップの
+ * 再作成と排他されます。
+ *
+ * map: メモリマップ構造体のポインタ
+ * data: バッファのポインタ
+ * size: 取得するバイト数
+ * offset: 先頭からのバイト数
+ *
+ * 戻り値
+ *  取得したバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+APIEXPORT size_t mmap_pread(struct mmap_t* map, void* data, size_t size, int64 offset)
+{
+    size_t n;
+
+    if (! map->mt_safe)
+        return map_read(map, data, size, offset);
+
+    RWLOCK_RDLOCK(&map->map_lock);
+    n = map_read(map, data, size, offset);
+    RWLOCK_RDUNLOCK(&map->map_lock);
+    return n;
+}
+
+/*
+ * メモリマップの指定位置にデータを設定します。
+ * mmap_write() と異なり現在位置は変更されません。
+ *
+ * マルチスレッドモードの場合でファイルサイズが変わらない書き込みは
+ * 共有ロックで行われます。ファイルサイズが拡張される場合は
+ * 排他ロックでマップを再作成します。
+ *
+ * map: メモリマップ構造体のポインタ
+ * data: バッファのポインタ
+ * size: 設定するバイト数
+ * offset: 先頭からのバイト数
+ *
+ * 戻り値
+ *  設定したバイト数を返します。
+ *  エラーの場合は -1 を返します。
+ */
+APIEXPORT size_t mmap_pwrite(struct mmap_t* map, const void* data, size_t size, int64 offset)
+{
+    size_t n;
+
+    if (! map->mt_safe)
+        return map_write(map, data, size, offset);
+
+    RWLOCK_RDLOCK(&map->map_lock);
+    if (map->view_offset + offset + (int64)size <= map->real_size) {
+        n = map_write(map, data, size, offset);
+        RWLOCK_RDUNLOCK(&map->map_lock);
+        return n;
+    }
+    RWLOCK_RDUNLOCK(&map->map_lock);
+
+    RWLOCK_WRLOCK(&map->map_lock);
+    n = map_write(map, data, size, offset);
+    RWLOCK_WRUNLOCK(&map->map_lock);
+    return n;
+}
+
+/*
+ * ファイルの最後にサイズ分の領域を確保します。
+ * 確保された領域の内容は不定です。
+ *
+ * 複数のスレッドから同時に呼び出されても
+ * 重ならない領域が返されます。
+ *
+ * map: メモリマップ構造体のポインタ
+ * size: 確保するバイト数
+ *
+ * 戻り値
+ *  確保した領域の先頭位置を返します。
+ */
+APIEXPORT int64 mmap_extend(struct mmap_t* map, int64 size)
+{
+    int64 offset;
+
+    if (map->mt_safe)
+        RWLOCK_WRLOCK(&map->map_lock);
+
+    offset = map->real_size;
+    if (map->pool) {
+        /* 書き込まれた時点でファイルが拡張されます。*/
+        map->real_size = offset + size;
+    } else if (map->view_size == MMAP_AUTO_SIZE) {
+        if (mmap_auto_resize(map, offset+size) < 0) {
+            /* サイズ拡張できないため、現在のサイズで固定します。*/
+            map->view_size = map->size;
+            map->real_size = offset + size;
+        }
+    } else {
+        map->real_size = offset + size;
+    }
+
+    if (map->mt_safe)
+        RWLOCK_WRUNLOCK(&map->map_lock);
+    return offset - map->view_offset;
+}
+
+/*
+ * メモリマップ上の領域を固定してポインタを返します。
+ * 返されたポインタは mmap_unpin() を呼び出すまで有効です。
+ *
+ * 固定中にマップが再作成された場合でも古いビューは
+ * すべての固定が解除されるまでアンマップされません。
+ *
+ * map: メモリマップ構造体のポインタ
+ * offset: 先頭からのバイト数
  * size: バイト数
  *
  * 戻り値
- *  offset のポインタを返します。
+ *  領域のポインタを返します。
  *  NULL の場合はメモリマップドの範囲から外れているので
- *  mmap_read() か mmap_write() を使用して操作します。
+ *  mmap_pread() を使用して取得します。
  */
-APIEXPORT char* mmap_map(struct mmap_t* map, int64 size)
+APIEXPORT char* mmap_pin(struct mmap_t* map, int64 offset, int64 size)
 {
-    int64 last;
+    char* p = NULL;
 
-    last = map->view_offset + map->offset + size;
-    if (map->view_size == MMAP_AUTO_SIZE) {
-        if (mmap_auto_resize(map, last) < 0)
-            return NULL;
-        return (char*)map->ptr + map->offset;
+    if (map->mt_safe)
+        RWLOCK_RDLOCK(&map->map_lock);
+
+    if (offset >= 0 && map->ptr != NULL &&
+        offset + size <= map->size &&
+        map->view_offset + offset + size <= map->real_size) {
+        CS_START(&map->pin_critical_section);
+        map->pin_count++;
+        CS_END(&map->pin_critical_section);
+        p = (char*)map->ptr + offset;
     }
 
-    if (map->offset < map->view_offset ||
-        last > map->view_offset + map->size) {
-        /* 現在のマップ範囲外です。*/
-        return NULL;
+    if (map->mt_safe)
+        RWLOCK_RDUNLOCK(&map->map_lock);
+    return p;
+}
+
+/*
+ * mmap_pin() で固定した領域を解除します。
+ * すべての固定が解除された時点で古いビューがアンマップされます。
+ *
+ * map: メモリマップ構造体のポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+APIEXPORT void mmap_unpin(struct mmap_t* map)
+{
+    struct mmap_retire_t* r = NULL;
+
+    CS_START(&map->pin_critical_section);
+    if (map->pin_count > 0) {
+        map->pin_count--;
+        if (map->pin_count == 0) {
+            r = map->retire;
+            map->retire = NULL;
+        }
     }
-    return (char*)map->ptr + map->offset;
+    CS_END(&map->pin_critical_section);
+    release_retired(r);
 }
 
 /*
- * 任意のメモリマップの位置からサイズ分のメモリ領域のポインタを返します。
- * 返されたポインタからサイズ分の領域にメモリ操作が行えます。
+ * 指定された範囲をあらかじめ読み込むようにシステムに通知します。
+ * 読み込みは非同期に行われるため呼び出し側は待たされません。
  *
- * NULL が返された場合でもオフセット位置は更新されます。
+ * マップされていない範囲はファイルの先読みとして通知されます。
+ * 通知は目安のため、エラーは返されません。
  *
  * map: メモリマップ構造体のポインタ
  * offset: 先頭からのバイト数
  * size: バイト数
  *
  * 戻り値
- *  offset のポインタを返します。
- *  NULL の場合はメモリマップドの範囲から外れているので
- *  mmap_read() か mmap_write() を使用して操作します。
+ *  なし
  */
-APIEXPORT char* mmap_mapping(struct mmap_t* map, int64 offset, int64 size)
+APIEXPORT void mmap_prefetch(struct mmap_t* map, int64 offset, int64 size)
 {
-    map->offset = offset;
-    return mmap_map(map, size);
+#ifndef _WIN32
+    int64 start, last;
+#endif
+
+    if (map->pool) {
+        pool_prefetch(map, offset, size);
+        return;
+    }
+#ifndef _WIN32
+
+    if (offset < 0 || size <= 0)
+        return;
+
+    if (map->mt_safe)
+        RWLOCK_RDLOCK(&map->map_lock);
+
+    last = offset + size;
+    if (map->view_offset + last > map->real_size)
+        last = map->real_size - map->view_offset;
+    if (map->ptr != NULL && offset < map->size) {
+        int64 end;
+
+        /* マップされている範囲はページ境界にそろえて通知します。*/
+        start = offset - offset % map->pgsize;
+        end = (last < map->size)? last : map->size;
+        if (end > start)
+            madvise((char*)map->ptr + start, (size_t)(end - start), MADV_WILLNEED);
+        offset = end;
+    }
+#ifdef POSIX_FADV_WILLNEED
+    if (last > offset)
+        posix_fadvise(map->fd, (off_t)(map->view_offset + offset),
+                      (off_t)(last - offset), POSIX_FADV_WILLNEED);
+#endif
+
+    if (map->mt_safe)
+        RWLOCK_RDUNLOCK(&map->map_lock);
+#endif
 }
 
 /*
- * メモリマップの現在位置を移動します。
+ * 指定された範囲のアクセスパターンをシステムに通知します。
+ *
+ * offset と size がともにゼロの場合はビュー全体が対象になり、
+ * 指定はマップの拡張や再作成の後にも適用されます。
+ * 範囲を指定した場合はマップが再作成されると指定が失われます。
+ * Windows では何も行われません。
  *
  * map: メモリマップ構造体のポインタ
  * offset: 先頭からのバイト数
+ * size: バイト数(ゼロはビューの最後まで)
+ * advice: アクセスパターン(MMAP_ADVISE_*)
  *
  * 戻り値
- *  現在位置を返します。
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
  */
-APIEXPORT int64 mmap_seek(struct mmap_t* map, int64 offset)
+APIEXPORT int mmap_advise(struct mmap_t* map, int64 offset, int64 size, int advice)
 {
-    map->offset = offset;
-    return offset;
+    int result;
+
+    if (map->mt_safe)
+        RWLOCK_WRLOCK(&map->map_lock);
+
+    result = map_advise(map, offset, size, advice);
+    if (result == 0 && offset == 0 && size == 0)
+        map->advice = advice;
+
+    if (map->mt_safe)
+        RWLOCK_WRUNLOCK(&map->map_lock);
+    return result;
 }
 
 /*
- * メモリマップの現在位置からデータを取得します。
- * 現在位置は取得したサイズ分進みます。
+ * 指定された範囲をメモリ上に固定してページアウトされないようにします。
+ * 範囲はマップされている範囲内である必要があります。
  *
- * 読み込む位置がメモリマップ外の場合はファイルから読み込みます。
+ * 固定できるサイズはシステムの制限(RLIMIT_MEMLOCK)を受けます。
+ * マップが再作成された場合は固定が解除されます。
  *
  * map: メモリマップ構造体のポインタ
- * data: バッファのポインタ
- * size: 取得するバイト数
+ * offset: 先頭からのバイト数
+ * size: バイト数
  *
  * 戻り値
- *  取得したバイト数を返します。
+ *  成功した場合はゼロを返します。
  *  エラーの場合は -1 を返します。
  */
-APIEXPORT size_t mmap_read(struct mmap_t* map, void* data, size_t size)
+APIEXPORT int mmap_lock(struct mmap_t* map, int64 offset, int64 size)
 {
-    int64 start, last;
+    int result = -1;
 
-    start = map->view_offset + map->offset;
-    last = start + size;
-    if (last > map->real_size) {
-        /* end of file */
-        err_write("mmap_read: over the file size");
-        return -1;
+    if (map->mt_safe)
+        RWLOCK_RDLOCK(&map->map_lock);
+
+    if (offset >= 0 && size > 0 && map->ptr != NULL && offset + size <= map->size) {
+#ifdef _WIN32
+        result = VirtualLock((char*)map->ptr + offset, (SIZE_T)size)? 0 : -1;
+#else
+        result = mlock((char*)map->ptr + offset, (size_t)size);
+#endif
+        if (result < 0)
+            err_write("mmap_lock: can't lock, offset=%lld size=%lld", offset, size);
     }
 
-    if (last <= map->size) {
-        memcpy(data, (char*)map->ptr + map->offset, size);
-    } else {
-        if (start >= map->size) {
-            FILE_SEEK(map->fd, start, SEEK_SET);
-            if (FILE_READ(map->fd, data, size) != size)
-                return -1;
-        } else {
-            size_t m, f;
+    if (map->mt_safe)
+        RWLOCK_RDUNLOCK(&map->map_lock);
+    return result;
+}
 
-            /* read on mmap */
-            m = (size_t)(map->size - start);
-            memcpy(data, (char*)map->ptr + map->offset, m);
-            /* read on file */
-            f = (size_t)(last - map->size);
-            FILE_SEEK(map->fd, map->view_offset + map->size, SEEK_SET);
-            if (FILE_READ(map->fd, (char*)data+m, f) != f)
-                return -1;
-        }
+/*
+ * mmap_lock() で固定した範囲を解除します。
+ *
+ * map: メモリマップ構造体のポインタ
+ * offset: 先頭からのバイト数
+ * size: バイト数
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+APIEXPORT int mmap_unlock(struct mmap_t* map, int64 offset, int64 size)
+{
+    int result = -1;
+
+    if (map->mt_safe)
+        RWLOCK_RDLOCK(&map->map_lock);
+
+    if (offset >= 0 && size > 0 && map->ptr != NULL && offset + size <= map->size) {
+#ifdef _WIN32
+        result = VirtualUnlock((char*)map->ptr + offset, (SIZE_T)size)? 0 : -1;
+#else
+        result = munlock((char*)map->ptr + offset, (size_t)size);
+#endif
     }
-    map->offset += size;
-    return size;
+
+    if (map->mt_safe)
+        RWLOCK_RDUNLOCK(&map->map_lock);
+    return result;
 }
 
 /*
- * メモリマップの現在位置にデータを設定します。
+ * メモリマップへの書き込み前に呼び出される関数を設定します。
+ * 関数には書き込み位置(ファイル先頭からのバイト数)、書き込み前の内容、
+ * 書き込む内容が渡されます。書き込み前の内容はファイルサイズ内の
+ * 部分だけが渡されます。
+ * 関数が負の値を返した場合は書き込みはエラーになります。
  *
- * メモリマップが自動拡張の場合はメモリマップのサイズを超えてデータを
- * 設定した場合は、メモリマップの大きさが自動的に拡張されます。
- * 自動拡張であってもメモリマップが拡張できない場合はファイル上に
- * データが出力されます。
- * 自動拡張でない場合はファイル上にデータが出力されます。
- * 現在位置は設定したサイズ分進みます。
+ * map: メモリマップ構造体のポインタ
+ * func: 関数のポインタ(NULL は解除)
+ * arg: 関数に渡される引数
+ *
+ * 戻り値
+ *  なし
+ */
+APIEXPORT void mmap_write_hook(struct mmap_t* map, MMAP_WRITE_HOOK func, void* arg)
+{
+    map->write_hook = func;
+    map->hook_arg = arg;
+}
+
+/*
+ * バッファプール(MMAP_IO_FILE)のページをファイルに書き出す前に
+ * 呼び出される関数を設定します。
+ * 書き込み前フックで記録した内容を永続化してからページが
+ * 書き出されるようにするために使用します。
+ * 関数が負の値を返した場合は書き出しはエラーになります。
  *
  * map: メモリマップ構造体のポインタ
- * data: バッファのポインタ
- * size: 設定するバイト数
+ * func: 関数のポインタ(NULL は解除)
+ * arg: 関数に渡される引数
  *
  * 戻り値
- *  設定したバイト数を返します。
+ *  なし
+ */
+APIEXPORT void mmap_flush_hook(struct mmap_t* map, MMAP_FLUSH_HOOK func, void* arg)
+{
+    map->flush_hook = func;
+    map->flush_arg = arg;
+}
+
+/*
+ * メモリマップとファイルの内容をディスクに書き出します。
+ *
+ * map: メモリマップ構造体のポインタ
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
  *  エラーの場合は -1 を返します。
  */
-APIEXPORT size_t mmap_write(struct mmap_t* map, const void* data, size_t size)
+APIEXPORT int mmap_sync(struct mmap_t* map)
 {
-    int64 start, last;
+    int result = 0;
 
-    start = map->view_offset + map->offset;
-    last = start + size;
-    if (map->view_size == MMAP_AUTO_SIZE) {
-        if (mmap_auto_resize(map, last) < 0) {
-            /* サイズ拡張できないため、
-               現在のサイズで固定してファイルに書き出します。*/
-            map->view_size = map->size;
-            if (mf_write(map, data, size, start, last) < 0)
-                return -1;
-        } else {
-            memcpy((char*)map->ptr + map->offset, data, size);
-        }
-    } else {
-        if (mf_write(map, data, size, start, last) < 0)
-            return -1;
+    if (map->mt_safe)
+        RWLOCK_RDLOCK(&map->map_lock);
+    if (map->pool) {
+        if (pool_flush_all(map) < 0)
+            result = -1;
     }
-    map->offset += size;
-    return size;
+#ifdef _WIN32
+    if (map->ptr) {
+        if (! FlushViewOfFile(map->ptr, 0))
+            result = -1;
+    }
+    if (! FlushFileBuffers(map->hFile))
+        result = -1;
+#else
+    if (map->ptr) {
+        if (msync(map->ptr, (size_t)map->size, MS_SYNC) < 0)
+            result = -1;
+    }
+    if (fsync(map->fd) < 0)
+        result = -1;
+#endif
+    if (map->mt_safe)
+        RWLOCK_RDUNLOCK(&map->map_lock);
+
+    if (result < 0)
+        err_write("mmap_sync: sync error.");
+    return result;
+}
+
+/*
+ * マルチスレッドモードを設定します。
+ *
+ * マルチスレッドモードでは mmap_pread() と mmap_pwrite() を
+ * 複数のスレッドから同時に呼び出すことができます。
+ * 現在位置を使用する関数(mmap_seek, mmap_read, mmap_write)は
+ * 呼び出し側で排他制御する必要があります。
+ *
+ * map: メモリマップ構造体のポインタ
+ * flag: 1 はマルチスレッドモード、0 は解除
+ *
+ * 戻り値
+ *  なし
+ */
+APIEXPORT void mmap_mtsafe(struct mmap_t* map, int flag)
+{
+    map->mt_safe = flag;
 }
 
 /*
@@ -492,13 +2344,43 @@ APIEXPORT size_t mmap_write(struct mmap_t* map, const void* data, size_t size)
  */
 APIEXPORT int mmap_resize(struct mmap_t* map, int64 size)
 {
+    int result;
+
+    if (! map->mt_safe)
+        return map_resize(map, size);
+
+    RWLOCK_WRLOCK(&map->map_lock);
+    result = map_resize(map, size);
+    RWLOCK_WRUNLOCK(&map->map_lock);
+    return result;
+}
+
+static int map_resize(struct mmap_t* map, int64 size)
+{
+    if (map->pool) {
+        if (size < map->real_size)
+            pool_truncate(map, size);
+        if (FILE_TRUNCATE(map->fd, size) < 0) {
+            err_write("mmap_resize: file truncate error");
+            return -1;
+        }
+        map->real_size = size;
+        return 0;
+    }
     if (map->size != size) {
         int64 cur_size;
 
+#ifdef MMAP_RESERVE
+        /* 予約した範囲内であればマップを再作成せずに拡張します。*/
+        if (map->reserve_size > 0 && map->ptr != NULL &&
+            size > map->size && size <= map->reserve_size)
+            return extend_view(map, size);
+#endif
         /* save current map size */
         cur_size = map->real_size;
         /* unmap */
-        mmap_unmap(map);
+        if (map_retire(map) < 0)
+            return -1;
         /* resize */
         if (FILE_TRUNCATE(map->fd, size) < 0) {
             err_write("mmap_resize: file truncate error");
@@ -80,6 +80,14 @@ char* nio_make_filename(char* fpath, const char* basename, const char* extname)
     return fpath;
 }
 
+static int64 compact_alloc(struct nio_t* nio, int size, int* areasize, int filling_rate, int64 limit);
+static int compact_free(struct nio_t* nio, int64 ptr, int size);
+static struct nio_wal_tx_t* free_lock(struct nio_t* nio);
+static void free_unlock(struct nio_t* nio, struct nio_wal_tx_t* tx);
+static struct nio_wal_tx_t* wal_tx(struct nio_wal_t* wal);
+static int wal_defer_free(struct nio_wal_tx_t* tx, int64 ptr, int size);
+static void wal_alloc(struct nio_t* nio, struct nio_wal_tx_t* tx, int64 ptr, int64 size);
+
 int64 nio_filesize(struct nio_t* nio)
 {
     return nio->mmap->real_size;
@@ -87,8 +95,7 @@ int64 nio_filesize(struct nio_t* nio)
 
 static int put_free_ptr(struct nio_t* nio, int64 ptr)
 {
-    mmap_seek(nio->mmap, NIO_FREEDATA_OFFSET);
-    if (mmap_write(nio->mmap, &ptr, sizeof(int64)) != sizeof(int64)) {
+    if (mmap_pwrite(nio->mmap, &ptr, sizeof(int64), NIO_FREEDATA_OFFSET) != sizeof(int64)) {
         err_write("put_free_ptr: write error.");
         return -1;
     }
@@ -130,8 +137,7 @@ static int read_free_page(struct nio_t* nio, int64 ptr, struct nio_free_t* fpg)
     char* p;
 
     /* 空き管理ページの読み込み */
-    mmap_seek(nio->mmap, ptr);
-    if (mmap_read(nio->mmap, buf, NIO_FREEPAGE_SIZE) != NIO_FREEPAGE_SIZE) {
+    if (mmap_pread(nio->mmap, buf, NIO_FREEPAGE_SIZE, ptr) != NIO_FREEPAGE_SIZE) {
         err_write("read_free_page: can't read free page.");
         return -1;
     }
@@ -157,281 +163,2437 @@ static int read_free_page(struct nio_t* nio, int64 ptr, struct nio_free_t* fpg)
         int32 size;
         int64 lptr;
 
-        memcpy(&size, p, sizeof(size));
-        p += sizeof(size);
-        fpg->page_size[i] = size;
+        memcpy(&size, p, sizeof(size));
+        p += sizeof(size);
+        fpg->page_size[i] = size;
+
+        memcpy(&lptr, p, sizeof(lptr));
+        p += sizeof(lptr);
+        fpg->data_ptr[i] = lptr;
+    }
+    return 0;
+}
+
+static int write_free_page(struct nio_t* nio, struct nio_free_t* fpg)
+{
+    char buf[NIO_FREEPAGE_SIZE];
+    ushort rid;
+    int64 nextptr;
+    ushort count;
+    int i;
+    char* p;
+
+    memset(buf, '\0', NIO_FREEPAGE_SIZE);
+
+    /* データ識別コード */
+    rid = NIO_FREEPAGE_ID;
+    memcpy(buf, &rid, sizeof(rid));
+
+    /* 次空きデータ管理ページポインタ */
+    nextptr = fpg->next_ptr;
+    memcpy(&buf[NIO_FREEPAGE_NEXT_OFFSET], &nextptr, sizeof(int64));
+
+    /* 領域数 */
+    count = (ushort)fpg->count;
+    memcpy(&buf[NIO_FREEPAGE_COUNT_OFFSET], &count, sizeof(ushort));
+
+    p = &buf[NIO_FREEPAGE_ARRAY_OFFSET];
+    for (i = 0; i < fpg->count; i++) {
+        int32 size;
+        int64 lptr;
+
+        size = fpg->page_size[i];
+        memcpy(p, &size, sizeof(size));
+        p += sizeof(size);
+
+        lptr = fpg->data_ptr[i];
+        memcpy(p, &lptr, sizeof(lptr));
+        p += sizeof(lptr);
+    }
+
+    /* 空き管理ページの書き出し */
+    if (mmap_pwrite(nio->mmap, buf, NIO_FREEPAGE_SIZE, fpg->offset) != NIO_FREEPAGE_SIZE) {
+        err_write("write_free_page: can't write free page.");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 空き領域のインデックス
+ *
+ * 空き領域管理ページの内容は最初に領域を確保または解放するときに
+ * メモリに読み込まれてサイズクラス(2のべき乗)ごとのリストに登録されます。
+ * 領域の検索は要求サイズのクラスを一定数だけ調べてから、
+ * ビットマップで空でない上位のクラスを探すため
+ * 空き領域の数に依存せずに行われます。
+ *
+ * 各エントリは空き領域管理ページの位置とスロット番号を保持しているため、
+ * 削除はページの最後のスロットを移動するだけで行われ、
+ * ファイルには変更されたスロットと領域数のみが書き出されます。
+ * 空き領域管理ページの形式は変わりません。
+ */
+#define FREE_SLOT_SIZE          (sizeof(int32)+sizeof(int64))
+#define FREE_ALLOC_COUNT        1024
+#define FREE_SCAN_LIMIT         16
+
+static int size_class(int size)
+{
+    int c = 0;
+
+    while (size > 1 && c < NIO_SIZE_CLASS-1) {
+        size >>= 1;
+        c++;
+    }
+    return c;
+}
+
+static int lowest_class(unsigned int map)
+{
+    int c = 0;
+
+    while ((map & 1) == 0) {
+        map >>= 1;
+        c++;
+    }
+    return c;
+}
+
+static void class_link(struct nio_free_index_t* fx, int e)
+{
+    struct nio_free_entry_t* ep;
+    int c;
+
+    ep = &fx->entry[e];
+    c = size_class(ep->size);
+    ep->prev = -1;
+    ep->next = fx->class_head[c];
+    if (ep->next >= 0)
+        fx->entry[ep->next].prev = e;
+    fx->class_head[c] = e;
+    fx->class_map |= (1u << c);
+}
+
+static void class_unlink(struct nio_free_index_t* fx, int e)
+{
+    struct nio_free_entry_t* ep;
+    int c;
+
+    ep = &fx->entry[e];
+    c = size_class(ep->size);
+    if (ep->prev >= 0)
+        fx->entry[ep->prev].next = ep->next;
+    else
+        fx->class_head[c] = ep->next;
+    if (ep->next >= 0)
+        fx->entry[ep->next].prev = ep->prev;
+    if (fx->class_head[c] < 0)
+        fx->class_map &= ~(1u << c);
+}
+
+static int entry_new(struct nio_free_index_t* fx)
+{
+    int e;
+
+    if (fx->entry_free >= 0) {
+        e = fx->entry_free;
+        fx->entry_free = fx->entry[e].next;
+        return e;
+    }
+    if (fx->entry_num % FREE_ALLOC_COUNT == 0) {
+        struct nio_free_entry_t* ep;
+
+        ep = (struct nio_free_entry_t*)realloc(fx->entry,
+                sizeof(struct nio_free_entry_t) * (fx->entry_num + FREE_ALLOC_COUNT));
+        if (ep == NULL) {
+            err_write("nio: free index no memory.");
+            return -1;
+        }
+        fx->entry = ep;
+    }
+    return fx->entry_num++;
+}
+
+static void entry_release(struct nio_free_index_t* fx, int e)
+{
+    fx->entry[e].next = fx->entry_free;
+    fx->entry_free = e;
+}
+
+static int page_new(struct nio_free_index_t* fx)
+{
+    int p;
+
+    if (fx->page_free >= 0) {
+        p = fx->page_free;
+        fx->page_free = fx->page[p].next;
+        return p;
+    }
+    if (fx->page_num % 16 == 0) {
+        struct nio_free_page_t* pp;
+
+        pp = (struct nio_free_page_t*)realloc(fx->page,
+                sizeof(struct nio_free_page_t) * (fx->page_num + 16));
+        if (pp == NULL) {
+            err_write("nio: free index no memory.");
+            return -1;
+        }
+        fx->page = pp;
+    }
+    return fx->page_num++;
+}
+
+static void page_release(struct nio_free_index_t* fx, int p)
+{
+    fx->page[p].next = fx->page_free;
+    fx->page_free = p;
+}
+
+static void free_index_close(struct nio_t* nio)
+{
+    struct nio_free_index_t* fx;
+
+    fx = nio->free_index;
+    if (fx == NULL)
+        return;
+    if (fx->entry)
+        free(fx->entry);
+    if (fx->page)
+        free(fx->page);
+    free(fx);
+    nio->free_index = NULL;
+}
+
+static int free_index_open(struct nio_t* nio)
+{
+    struct nio_free_index_t* fx;
+    struct nio_free_t* fpg;
+    int64 fptr;
+    int tail = -1;
+    int i;
+
+    if (nio->free_index)
+        return 0;
+
+    fx = (struct nio_free_index_t*)calloc(1, sizeof(struct nio_free_index_t));
+    if (fx == NULL) {
+        err_write("nio: free index no memory.");
+        return -1;
+    }
+    fx->head = -1;
+    fx->entry_free = -1;
+    fx->page_free = -1;
+    for (i = 0; i < NIO_SIZE_CLASS; i++)
+        fx->class_head[i] = -1;
+    nio->free_index = fx;
+
+    /* 空き領域管理ページをすべて読み込みます。*/
+    fpg = nio->free_page;
+    fptr = nio->free_ptr;
+    while (fptr != 0) {
+        struct nio_free_page_t* pg;
+        int p;
+
+        if (read_free_page(nio, fptr, fpg) < 0)
+            goto error;
+        if ((p = page_new(fx)) < 0)
+            goto error;
+        pg = &fx->page[p];
+        pg->offset = fptr;
+        pg->count = 0;
+        pg->prev = tail;
+        pg->next = -1;
+        if (tail >= 0)
+            fx->page[tail].next = p;
+        else
+            fx->head = p;
+
+        for (i = 0; i < fpg->count; i++) {
+            int e;
+
+            if ((e = entry_new(fx)) < 0)
+                goto error;
+            fx->entry[e].ptr = fpg->data_ptr[i];
+            fx->entry[e].size = fpg->page_size[i];
+            fx->entry[e].page = p;
+            fx->entry[e].slot = i;
+            fx->page[p].entry[i] = e;
+            fx->page[p].count++;
+            class_link(fx, e);
+        }
+        tail = p;
+        fptr = fpg->next_ptr;
+    }
+    return 0;
+
+error:
+    free_index_close(nio);
+    return -1;
+}
+
+static int write_free_slot(struct nio_t* nio, int64 offset, int slot, int size, int64 ptr)
+{
+    char buf[FREE_SLOT_SIZE];
+    int32 sz = size;
+
+    memcpy(buf, &sz, sizeof(sz));
+    memcpy(buf+sizeof(sz), &ptr, sizeof(ptr));
+    if (mmap_pwrite(nio->mmap, buf, FREE_SLOT_SIZE,
+                    offset + NIO_FREEPAGE_ARRAY_OFFSET + slot * FREE_SLOT_SIZE) != FREE_SLOT_SIZE) {
+        err_write("write_free_slot: can't write free page.");
+        return -1;
+    }
+    return 0;
+}
+
+static int write_free_count(struct nio_t* nio, int64 offset, int count)
+{
+    ushort n = (ushort)count;
+
+    if (mmap_pwrite(nio->mmap, &n, sizeof(n), offset + NIO_FREEPAGE_COUNT_OFFSET) != sizeof(n)) {
+        err_write("write_free_count: can't write free page.");
+        return -1;
+    }
+    return 0;
+}
+
+static int write_free_next(struct nio_t* nio, int64 offset, int64 next_ptr)
+{
+    if (mmap_pwrite(nio->mmap, &next_ptr, sizeof(next_ptr), offset + NIO_FREEPAGE_NEXT_OFFSET) != sizeof(next_ptr)) {
+        err_write("write_free_next: can't write free page.");
+        return -1;
+    }
+    return 0;
+}
+
+static int new_free_page(struct nio_t* nio, int size, int64 ptr)
+{
+    struct nio_free_index_t* fx;
+    struct nio_free_t* fpg;
+    int p;
+
+    fx = nio->free_index;
+    if ((p = page_new(fx)) < 0)
+        return -1;
+
+    /* ファイルの最後に割り当てます。
+       reuse_space() を呼ぶと再帰呼び出しになる可能性があるため。*/
+    fpg = nio->free_page;
+    fpg->offset = mmap_extend(nio->mmap, NIO_FREEPAGE_SIZE);
+    fpg->count = 1;
+    fpg->page_size[0] = size;
+    fpg->data_ptr[0] = ptr;
+    fpg->next_ptr = nio->free_ptr;
+    if (write_free_page(nio, fpg) < 0)
+        return -1;
+
+    /* ヘッダーの空きポインタを更新します。*/
+    if (put_free_ptr(nio, fpg->offset) < 0)
+        return -1;
+
+    /* チェインの先頭に追加します。*/
+    fx->page[p].offset = fpg->offset;
+    fx->page[p].count = 0;
+    fx->page[p].prev = -1;
+    fx->page[p].next = fx->head;
+    if (fx->head >= 0)
+        fx->page[fx->head].prev = p;
+    fx->head = p;
+    return p;
+}
+
+static int add_free_list(struct nio_t* nio, int64 ptr, int size, int* entry)
+{
+    ushort rid = NIO_FREEDATA_ID;
+    struct nio_free_index_t* fx;
+    int p, e, slot;
+
+    if (entry != NULL)
+        *entry = -1;
+    /* ファイルの最後を削除する場合はファイルサイズを小さくします。*/
+    if (nio->mmap->real_size == ptr+size) {
+        /* ファイルサイズを調整します。*/
+        nio->mmap->real_size = ptr;
+        return 0;
+    }
+
+    /* 解放する領域を空きデータとして更新します。
+       圧縮の開始と終了はデータベースの排他の外で呼び出されるため、
+       現在位置を変更しない関数で書き出します。*/
+    if (mmap_pwrite(nio->mmap, &rid, sizeof(rid), ptr) != sizeof(rid)) {
+        err_write("nio_add_free_list: can't mmap_write rid.");
+        return -1;
+    }
+    if (mmap_pwrite(nio->mmap, &size, sizeof(int), ptr+sizeof(rid)) != sizeof(int)) {
+        err_write("nio_add_free_list: can't mmap_write size.");
+        return -1;
+    }
+
+    /* 空きデータ管理部の更新 */
+    fx = nio->free_index;
+    p = fx->head;
+    if (p >= 0 && fx->page[p].count < NIO_FREE_COUNT) {
+        /* 先頭ページの最後のスロットに追加します。*/
+        slot = fx->page[p].count;
+        if (write_free_slot(nio, fx->page[p].offset, slot, size, ptr) < 0)
+            return -1;
+        if (write_free_count(nio, fx->page[p].offset, slot+1) < 0)
+            return -1;
+    } else {
+        /* 新しいページに追加します。*/
+        if ((p = new_free_page(nio, size, ptr)) < 0)
+            return -1;
+        slot = 0;
+    }
+
+    if ((e = entry_new(fx)) < 0)
+        return -1;
+    fx->entry[e].ptr = ptr;
+    fx->entry[e].size = size;
+    fx->entry[e].page = p;
+    fx->entry[e].slot = slot;
+    fx->page[p].entry[slot] = e;
+    fx->page[p].count++;
+    class_link(fx, e);
+    if (entry != NULL)
+        *entry = e;
+    return 0;
+}
+
+/* 空き領域のロック中に呼び出されます。*/
+static int free_space(struct nio_t* nio, int64 ptr, int size)
+{
+    int result;
+
+    if (nio->compact)
+        result = compact_free(nio, ptr, size);
+    else if ((result = free_index_open(nio)) == 0)
+        result = add_free_list(nio, ptr, size, NULL);
+    return result;
+}
+
+/*
+ * 領域を空きリストに登録します。
+ *
+ * 空き領域の管理は排他制御されているため、
+ * 複数のスレッドから同時に呼び出すことができます。
+ * nio_tx_begin() で開始したトランザクションの中で呼び出した場合は
+ * コミットまで登録が保留されます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * ptr: 領域の位置
+ * size: 領域のサイズ
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。エラーの場合は -1 を返します。
+ */
+int nio_add_free_list(struct nio_t* nio, int64 ptr, int size)
+{
+    struct nio_wal_tx_t* tx;
+    int result;
+
+    if (nio->wal && nio->wal_scoped) {
+        tx = wal_tx(nio->wal);
+        if (tx && tx->depth > 0)
+            return wal_defer_free(tx, ptr, size);
+    }
+    tx = free_lock(nio);
+    result = free_space(nio, ptr, size);
+    free_unlock(nio, tx);
+    return result;
+}
+
+static int is_divide_space(int freesize, int size, int filling_rate)
+{
+    int remain;
+    int rate;
+
+    remain = freesize - size;
+    if (remain <= 64)
+        return 0;  /* 残りが64バイト以下は分割利用しません */
+    rate = (freesize - size) * 100 / size;
+    return (rate > filling_rate);
+}
+
+static int release_free_page(struct nio_t* nio, int p)
+{
+    struct nio_free_index_t* fx;
+    struct nio_free_page_t* pg;
+    int64 offset, next_ptr;
+
+    fx = nio->free_index;
+    pg = &fx->page[p];
+    offset = pg->offset;
+    next_ptr = (pg->next >= 0)? fx->page[pg->next].offset : 0;
+
+    /* フリーリストのリンクをつなぎ変えます。*/
+    if (pg->prev < 0) {
+        if (put_free_ptr(nio, next_ptr) < 0)
+            return -1;
+        fx->head = pg->next;
+    } else {
+        if (write_free_next(nio, fx->page[pg->prev].offset, next_ptr) < 0)
+            return -1;
+        fx->page[pg->prev].next = pg->next;
+    }
+    if (pg->next >= 0)
+        fx->page[pg->next].prev = pg->prev;
+    page_release(fx, p);
+
+    if (nio->mmap->real_size == offset+NIO_FREEPAGE_SIZE) {
+        /* ファイルサイズを調整します。*/
+        nio->mmap->real_size = offset;
+        return 0;
+    }
+    /* 領域を開放します。*/
+    return add_free_list(nio, offset, NIO_FREEPAGE_SIZE, NULL);
+}
+
+static int remove_free_entry(struct nio_t* nio, int e)
+{
+    struct nio_free_index_t* fx;
+    struct nio_free_page_t* pg;
+    int p, slot, last;
+
+    fx = nio->free_index;
+    p = fx->entry[e].page;
+    slot = fx->entry[e].slot;
+    pg = &fx->page[p];
+    last = pg->count - 1;
+
+    class_unlink(fx, e);
+    if (slot != last) {
+        int m;
+
+        /* ページの最後のスロットを空いたスロットに移動します。*/
+        m = pg->entry[last];
+        if (write_free_slot(nio, pg->offset, slot, fx->entry[m].size, fx->entry[m].ptr) < 0)
+            return -1;
+        fx->entry[m].slot = slot;
+        pg->entry[slot] = m;
+    }
+    pg->count--;
+    if (write_free_count(nio, pg->offset, pg->count) < 0)
+        return -1;
+    entry_release(fx, e);
+
+    /* 空になったページは先頭ページ以外は解放します。
+       圧縮中は空き領域が増えるため圧縮の終了時に解放します。*/
+    if (pg->count == 0 && p != fx->head && nio->compact == NULL)
+        return release_free_page(nio, p);
+    return 0;
+}
+
+static int find_free_entry(struct nio_free_index_t* fx, int size)
+{
+    int c, e, n;
+    unsigned int map;
+
+    /* 同じサイズクラスを一定数だけ調べます。*/
+    c = size_class(size);
+    e = fx->class_head[c];
+    for (n = 0; e >= 0 && n < FREE_SCAN_LIMIT; n++) {
+        if (fx->entry[e].size >= size)
+            return e;
+        e = fx->entry[e].next;
+    }
+
+    /* 上位のサイズクラスの領域はすべて格納可能です。*/
+    map = fx->class_map & ~((2u << c) - 1);
+    if (map)
+        return fx->class_head[lowest_class(map)];
+
+    /* 同じサイズクラスの残りを調べます。*/
+    while (e >= 0) {
+        if (fx->entry[e].size >= size)
+            return e;
+        e = fx->entry[e].next;
+    }
+    return -1;  /* not found */
+}
+
+static int64 reuse_space(struct nio_t* nio, int size, int* areasize, int filling_rate)
+{
+    struct nio_free_index_t* fx;
+    struct nio_free_entry_t* ep;
+    int64 ptr;
+    int e;
+
+    fx = nio->free_index;
+    e = find_free_entry(fx, size);
+    if (e < 0)
+        return -1;  /* not found */
+
+    /* 格納可能な空き領域が見つかった */
+    ep = &fx->entry[e];
+    /* 空き領域を分割するか判定します。*/
+    if (is_divide_space(ep->size, size, filling_rate)) {
+        int rest_size;
+
+        /* 空き領域を分割する場合は後半を再利用します。*/
+        rest_size = ep->size - size;
+        ptr = ep->ptr + rest_size;
+        if (areasize != NULL)
+            *areasize = size;
+        /* ファイルへの書き込みが成功してからメモリ上の管理データを
+           更新します。失敗した場合は元の空き領域がそのまま残ります。*/
+        if (write_free_slot(nio, fx->page[ep->page].offset, ep->slot, rest_size, ep->ptr) < 0)
+            return -1;
+        /* 空きデータの領域サイズを更新します。*/
+        if (mmap_pwrite(nio->mmap, &rest_size, sizeof(int), ep->ptr+sizeof(ushort)) != sizeof(int)) {
+            write_free_slot(nio, fx->page[ep->page].offset, ep->slot, ep->size, ep->ptr);
+            err_write("reuse_space: can't mmap write.");
+            return -1;
+        }
+        class_unlink(fx, e);
+        ep->size = rest_size;
+        class_link(fx, e);
+    } else {
+        ptr = ep->ptr;
+        if (areasize != NULL)
+            *areasize = ep->size;
+        if (remove_free_entry(nio, e) < 0)
+            return -1;
+    }
+    return ptr; /* found space */
+}
+
+/*
+ * サイズ分の領域を取得します。
+ * 空きリストに再利用できる領域がない場合はファイルの最後に確保されます。
+ *
+ * 空き領域の管理は排他制御されているため、
+ * 複数のスレッドから同時に呼び出すことができます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * size: 必要なサイズ
+ * areasize: 確保された領域サイズが設定されるポインタ
+ * filling_rate: 空き領域を分割する充填率(%)
+ *
+ * 戻り値
+ *  領域の位置を返します。
+ */
+int64 nio_avail_space(struct nio_t* nio, int size, int* areasize, int filling_rate)
+{
+    int64 offset = -1;
+    struct nio_wal_tx_t* tx;
+
+    tx = free_lock(nio);
+    if (nio->compact) {
+        /* 圧縮中はファイルの先頭に近い空き領域から割り当てます。*/
+        offset = compact_alloc(nio, size, areasize, filling_rate, -1);
+    } else if (free_index_open(nio) == 0) {
+        /* 空き領域のインデックスから再利用できる領域を検索します。*/
+        offset = reuse_space(nio, size, areasize, filling_rate);
+    }
+
+    if (offset < 0) {
+        /* 空き領域はないため、ファイルの最後に追加します。
+           他のスレッドと重ならないようにファイルサイズを先に拡張します。*/
+        offset = mmap_extend(nio->mmap, size);
+        if (areasize != NULL)
+            *areasize = size;
+    }
+    mmap_seek(nio->mmap, offset);
+    wal_alloc(nio, tx, offset, (areasize != NULL)? *areasize : size);
+    free_unlock(nio, tx);
+    return offset;
+}
+
+/*
+ * ファイルの最後にサイズ分の領域を確保します。
+ * 空きリストは検索されません。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * size: 必要なサイズ
+ *
+ * 戻り値
+ *  領域の位置を返します。
+ */
+int64 nio_extend_space(struct nio_t* nio, int64 size)
+{
+    int64 offset;
+    struct nio_wal_tx_t* tx;
+
+    tx = free_lock(nio);
+    offset = mmap_extend(nio->mmap, size);
+    wal_alloc(nio, tx, offset, size);
+    free_unlock(nio, tx);
+    return offset;
+}
+
+/*
+ * オンライン圧縮
+ *
+ * nio_compact() を呼び出すと空き領域管理ページの内容がすべて読み込まれて、
+ * 隣接する空き領域を結合した新しい管理ページがファイルの先頭に近い
+ * 空き領域に書き出されます。ヘッダーの空き領域ポインタを切り替えた後は
+ * 古い管理ページの領域も空き領域として扱われます。
+ * メモリ上のアドレス順の空き領域リストの各領域は管理ページのスロットに
+ * 対応しており、領域の割り当て、解放、結合はスロットを書き換えてから
+ * リストに反映されます。
+ *
+ * ファイルサイズから空き領域の合計を引いた位置を境界として、
+ * 境界より後ろにあるデータはデータベースの各関数が nio_compact_space() で
+ * 境界より前の空き領域を取得して移動し、ポインタを書き換えます。
+ * 境界より前に格納できる領域がない場合は現在の位置より前の領域に移動します。
+ * 境界より前にあるデータは移動されません。
+ *
+ * 圧縮中は通常の更新で必要な領域もファイルの先頭に近い空き領域から
+ * 割り当てられます。解放された領域は隣接する空き領域と結合され、
+ * ファイルの最後に達した場合はファイルサイズが小さくなります。
+ * ファイルの最後にある管理ページは各回の開始時に先頭に近い領域に移動され、
+ * 空になった管理ページは圧縮の終了時に解放されます。
+ *
+ * 空き領域管理ページは圧縮中も有効な状態に保たれるため、
+ * 圧縮の途中で異常終了した場合もその時点の空き領域は失われません。
+ * 再オープン後に nio_compact() を呼び出すと圧縮が最初からやり直されます。
+ */
+#define COMPACT_ALLOC_COUNT     1024
+#define COMPACT_MAX_AREASIZE    0x40000000  /* 1GB */
+
+static int extent_insert(struct nio_compact_t* cp, int index, int64 ptr, int64 size, int entry)
+{
+    if (cp->count >= cp->alloc_count) {
+        struct nio_extent_t* ep;
+        int n;
+
+        n = (cp->alloc_count == 0)? COMPACT_ALLOC_COUNT : cp->alloc_count * 2;
+        ep = (struct nio_extent_t*)realloc(cp->extent, sizeof(struct nio_extent_t) * n);
+        if (ep == NULL) {
+            err_write("nio_compact: no memory.");
+            return -1;
+        }
+        cp->extent = ep;
+        cp->alloc_count = n;
+    }
+    if (index < cp->count)
+        memmove(&cp->extent[index+1], &cp->extent[index], (cp->count - index) * sizeof(struct nio_extent_t));
+    cp->extent[index].ptr = ptr;
+    cp->extent[index].size = size;
+    cp->extent[index].entry = entry;
+    cp->count++;
+    return 0;
+}
+
+static void extent_remove(struct nio_compact_t* cp, int index)
+{
+    cp->count--;
+    if (index < cp->count)
+        memmove(&cp->extent[index], &cp->extent[index+1], (cp->count - index) * sizeof(struct nio_extent_t));
+}
+
+static int extent_cmp(const void* p1, const void* p2)
+{
+    int64 ptr1, ptr2;
+
+    ptr1 = ((struct nio_extent_t*)p1)->ptr;
+    ptr2 = ((struct nio_extent_t*)p2)->ptr;
+    if (ptr1 < ptr2)
+        return -1;
+    return (ptr1 > ptr2)? 1 : 0;
+}
+
+static int extent_search(struct nio_compact_t* cp, int64 ptr)
+{
+    int lo, hi;
+
+    /* 挿入位置を二分探索します。*/
+    lo = 0;
+    hi = cp->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (cp->extent[mid].ptr < ptr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int extent_resize(struct nio_t* nio, struct nio_extent_t* ep, int64 ptr, int64 size)
+{
+    ushort rid = NIO_FREEDATA_ID;
+    struct nio_free_index_t* fx;
+    struct nio_free_entry_t* fe;
+    int sz = (int)size;
+
+    /* 空き領域管理ページのスロットを先に書き換えます。*/
+    fx = nio->free_index;
+    fe = &fx->entry[ep->entry];
+    if (write_free_slot(nio, fx->page[fe->page].offset, fe->slot, sz, ptr) < 0)
+        return -1;
+    /* 空きデータの識別コードと領域サイズを更新します。*/
+    if (mmap_pwrite(nio->mmap, &rid, sizeof(rid), ptr) != sizeof(rid) ||
+        mmap_pwrite(nio->mmap, &sz, sizeof(int), ptr+sizeof(ushort)) != sizeof(int)) {
+        err_write("nio_compact: can't mmap write.");
+        return -1;
+    }
+    class_unlink(fx, ep->entry);
+    fe->ptr = ptr;
+    fe->size = sz;
+    class_link(fx, ep->entry);
+    ep->ptr = ptr;
+    ep->size = size;
+    return 0;
+}
+
+static int extent_take(struct nio_t* nio, int index)
+{
+    struct nio_compact_t* cp;
+
+    cp = nio->compact;
+    if (remove_free_entry(nio, cp->extent[index].entry) < 0)
+        return -1;
+    extent_remove(cp, index);
+    return 0;
+}
+
+static void extent_coalesce(struct nio_compact_t* cp)
+{
+    int i, n = 0;
+
+    /* アドレス順に並べて隣接する空き領域を結合します。*/
+    qsort(cp->extent, cp->count, sizeof(struct nio_extent_t), extent_cmp);
+    for (i = 0; i < cp->count; i++) {
+        if (cp->extent[i].size <= 0)
+            continue;
+        if (n > 0 && cp->extent[n-1].ptr + cp->extent[n-1].size == cp->extent[i].ptr &&
+            cp->extent[n-1].size + cp->extent[i].size <= COMPACT_MAX_AREASIZE)
+            cp->extent[n-1].size += cp->extent[i].size;
+        else
+            cp->extent[n++] = cp->extent[i];
+    }
+    cp->count = n;
+}
+
+static int64 extent_carve(struct nio_compact_t* cp, int size)
+{
+    int i;
+
+    /* ファイルの先頭に近い空き領域の前半を使用します。*/
+    for (i = 0; i < cp->count; i++) {
+        struct nio_extent_t* ep;
+        int64 ptr;
+
+        ep = &cp->extent[i];
+        if (ep->size < size)
+            continue;
+        ptr = ep->ptr;
+        ep->ptr += size;
+        ep->size -= size;
+        if (ep->size == 0)
+            extent_remove(cp, i);
+        return ptr;
+    }
+    return -1;  /* not found */
+}
+
+static int rewrite_free_pages(struct nio_t* nio, struct nio_compact_t* cp)
+{
+    ushort rid = NIO_FREEDATA_ID;
+    struct nio_free_t* fpg;
+    int64* opage = NULL;
+    int64* npage = NULL;
+    int64 fptr;
+    int nopage = 0;
+    int npages, i, k;
+    int result = -1;
+
+    /* 空き領域管理ページの内容をすべて読み込みます。*/
+    fpg = nio->free_page;
+    fptr = nio->free_ptr;
+    while (fptr != 0) {
+        if (read_free_page(nio, fptr, fpg) < 0)
+            goto final;
+        for (i = 0; i < fpg->count; i++) {
+            if (extent_insert(cp, cp->count, fpg->data_ptr[i], fpg->page_size[i], -1) < 0)
+                goto final;
+        }
+        if (nopage % COMPACT_ALLOC_COUNT == 0) {
+            int64* pp;
+
+            pp = (int64*)realloc(opage, sizeof(int64) * (nopage + COMPACT_ALLOC_COUNT));
+            if (pp == NULL) {
+                err_write("nio_compact: no memory.");
+                goto final;
+            }
+            opage = pp;
+        }
+        opage[nopage++] = fptr;
+        fptr = fpg->next_ptr;
+    }
+    extent_coalesce(cp);
+
+    /* 新しい空き領域管理ページをファイルの先頭に近い空き領域に確保します。
+       古いページの領域を加えても空き領域の数は読み込んだ領域数と
+       ページ数の合計を超えないため、ここで必要なページ数が決まります。*/
+    npages = (cp->count + nopage + NIO_FREE_COUNT - 1) / NIO_FREE_COUNT;
+    if (npages == 0)
+        npages = 1;
+    npage = (int64*)malloc(sizeof(int64) * npages);
+    if (npage == NULL) {
+        err_write("nio_compact: no memory.");
+        goto final;
+    }
+    for (i = 0; i < npages; i++) {
+        if ((npage[i] = extent_carve(cp, NIO_FREEPAGE_SIZE)) < 0)
+            npage[i] = mmap_extend(nio->mmap, NIO_FREEPAGE_SIZE);
+    }
+
+    /* 古いページの領域はヘッダーを切り替えた後に空き領域になります。*/
+    for (i = 0; i < nopage; i++) {
+        if (extent_insert(cp, cp->count, opage[i], NIO_FREEPAGE_SIZE, -1) < 0)
+            goto final;
+    }
+    extent_coalesce(cp);
+
+    /* 新しいページを書き出してからヘッダーの空き領域ポインタを切り替えます。
+       切り替える前に異常終了した場合は古いページがそのまま使用されます。*/
+    k = 0;
+    for (i = 0; i < npages; i++) {
+        fpg->offset = npage[i];
+        fpg->count = 0;
+        while (k < cp->count && fpg->count < NIO_FREE_COUNT) {
+            fpg->page_size[fpg->count] = (int)cp->extent[k].size;
+            fpg->data_ptr[fpg->count] = cp->extent[k].ptr;
+            fpg->count++;
+            k++;
+        }
+        fpg->next_ptr = (i+1 < npages)? npage[i+1] : 0;
+        if (write_free_page(nio, fpg) < 0)
+            goto final;
+    }
+    if (put_free_ptr(nio, npage[0]) < 0)
+        goto final;
+
+    /* 空きデータの識別コードと領域サイズを更新します。*/
+    for (i = 0; i < cp->count; i++) {
+        int sz = (int)cp->extent[i].size;
+
+        if (mmap_pwrite(nio->mmap, &rid, sizeof(rid), cp->extent[i].ptr) != sizeof(rid) ||
+            mmap_pwrite(nio->mmap, &sz, sizeof(int), cp->extent[i].ptr+sizeof(ushort)) != sizeof(int)) {
+            err_write("nio_compact: can't mmap write.");
+            goto final;
+        }
+    }
+    result = 0;
+
+final:
+    if (opage)
+        free(opage);
+    if (npage)
+        free(npage);
+    return result;
+}
+
+static int relocate_free_page(struct nio_t* nio, int p, int64 ptr)
+{
+    char buf[NIO_FREEPAGE_SIZE];
+    struct nio_free_index_t* fx;
+    struct nio_free_page_t* pg;
+
+    /* 新しい位置にページを複写してからリンクを切り替えます。*/
+    fx = nio->free_index;
+    pg = &fx->page[p];
+    if (mmap_pread(nio->mmap, buf, NIO_FREEPAGE_SIZE, pg->offset) != NIO_FREEPAGE_SIZE ||
+        mmap_pwrite(nio->mmap, buf, NIO_FREEPAGE_SIZE, ptr) != NIO_FREEPAGE_SIZE) {
+        err_write("nio_compact: can't copy free page.");
+        return -1;
+    }
+    if (pg->prev < 0) {
+        if (put_free_ptr(nio, ptr) < 0)
+            return -1;
+    } else {
+        if (write_free_next(nio, fx->page[pg->prev].offset, ptr) < 0)
+            return -1;
+    }
+    pg->offset = ptr;
+    return 0;
+}
+
+static int extent_truncate(struct nio_t* nio)
+{
+    struct nio_compact_t* cp;
+
+    /* ファイルの最後にある空き領域を切り詰めます。*/
+    cp = nio->compact;
+    while (cp->count > 0) {
+        struct nio_extent_t* ep;
+        int64 ptr;
+
+        ep = &cp->extent[cp->count-1];
+        if (ep->ptr + ep->size != nio->mmap->real_size)
+            break;
+        ptr = ep->ptr;
+        if (extent_take(nio, cp->count-1) < 0)
+            return -1;
+        nio->mmap->real_size = ptr;
+    }
+    return 0;
+}
+
+/* ファイルの最後にある空き領域管理ページをファイルの先頭に近い空き領域に
+   移動してファイルを切り詰めます。
+   B+木は解放したリーフの識別コードで削除を判定するため、
+   データベースの処理の途中ではなく圧縮の各回の開始時と終了時に呼び出します。*/
+static int compact_move_pages(struct nio_t* nio)
+{
+    struct nio_free_index_t* fx;
+
+    fx = nio->free_index;
+    for (;;) {
+        int64 ptr, last;
+        int p;
+
+        if (extent_truncate(nio) < 0)
+            return -1;
+        last = nio->mmap->real_size;
+        for (p = fx->head; p >= 0; p = fx->page[p].next) {
+            if (fx->page[p].offset + NIO_FREEPAGE_SIZE == last)
+                break;
+        }
+        if (p < 0)
+            break;
+        if (fx->page[p].count == 0 && p != fx->head) {
+            /* 空のページは解放するとファイルが切り詰められます。*/
+            if (release_free_page(nio, p) < 0)
+                return -1;
+            continue;
+        }
+        ptr = compact_alloc(nio, NIO_FREEPAGE_SIZE, NULL, 0, fx->page[p].offset);
+        if (ptr < 0)
+            break;
+        if (relocate_free_page(nio, p, ptr) < 0)
+            return -1;
+        nio->mmap->real_size = last - NIO_FREEPAGE_SIZE;
+        nio->compact->watermark -= NIO_FREEPAGE_SIZE;
+    }
+    return 0;
+}
+
+static int64 compact_alloc(struct nio_t* nio, int size, int* areasize, int filling_rate, int64 limit)
+{
+    struct nio_compact_t* cp;
+    int i;
+
+    cp = nio->compact;
+    for (i = 0; i < cp->count; i++) {
+        struct nio_extent_t* ep;
+        int64 ptr, remain;
+
+        ep = &cp->extent[i];
+        if (limit >= 0 && ep->ptr >= limit)
+            break;  /* limit より後ろの領域は使用しません */
+        if (ep->size < size)
+            continue;
+
+        ptr = ep->ptr;
+        remain = ep->size - size;
+        if (remain == 0) {
+            if (extent_take(nio, i) < 0)
+                return -1;
+            if (areasize != NULL)
+                *areasize = size;
+        } else if (remain > 64 && remain * 100 / size > filling_rate) {
+            /* 空き領域の前半を使用します。*/
+            if (extent_resize(nio, ep, ep->ptr + size, remain) < 0)
+                return -1;
+            if (areasize != NULL)
+                *areasize = size;
+        } else if (areasize != NULL) {
+            if (extent_take(nio, i) < 0)
+                return -1;
+            *areasize = (int)(remain + size);
+            size = *areasize;
+        } else {
+            /* 領域サイズを返せないので余りの出る領域は使用しません。*/
+            continue;
+        }
+        /* 境界は空き領域の合計が変わった分だけ移動します。*/
+        cp->watermark += size;
+        return ptr;
+    }
+    return -1;  /* not found */
+}
+
+static int extent_merge(struct nio_t* nio, int64 ptr, int size)
+{
+    struct nio_compact_t* cp;
+    struct nio_extent_t* prev = NULL;
+    struct nio_extent_t* next = NULL;
+    int lo, e;
+
+    cp = nio->compact;
+    lo = extent_search(cp, ptr);
+    if (lo > 0 && cp->extent[lo-1].ptr + cp->extent[lo-1].size == ptr &&
+        cp->extent[lo-1].size + size <= COMPACT_MAX_AREASIZE)
+        prev = &cp->extent[lo-1];
+    if (lo < cp->count && ptr + size == cp->extent[lo].ptr)
+        next = &cp->extent[lo];
+
+    /* 隣接する空き領域と結合します。*/
+    if (prev != NULL) {
+        int64 newsize;
+
+        newsize = prev->size + size;
+        if (next != NULL && newsize + next->size <= COMPACT_MAX_AREASIZE) {
+            newsize += next->size;
+            if (extent_take(nio, lo) < 0)
+                return -1;
+        }
+        return extent_resize(nio, prev, prev->ptr, newsize);
+    }
+    if (next != NULL && next->size + size <= COMPACT_MAX_AREASIZE)
+        return extent_resize(nio, next, ptr, next->size + size);
+
+    /* 新しい空き領域として登録します。
+       管理ページの追加で空き領域が使用される場合があるため挿入位置を探し直します。*/
+    if (add_free_list(nio, ptr, size, &e) < 0)
+        return -1;
+    return extent_insert(cp, extent_search(cp, ptr), ptr, size, e);
+}
+
+static int compact_free(struct nio_t* nio, int64 ptr, int size)
+{
+    ushort rid = NIO_FREEDATA_ID;
+
+    /* ファイルの最後を削除する場合はファイルサイズを小さくします。*/
+    if (nio->mmap->real_size == ptr+size) {
+        nio->mmap->real_size = ptr;
+        return extent_truncate(nio);
+    }
+
+    /* 解放する領域を空きデータとして更新します。
+       B+木は削除したリーフの判定に使用します。*/
+    if (mmap_pwrite(nio->mmap, &rid, sizeof(rid), ptr) != sizeof(rid)) {
+        err_write("nio_add_free_list: can't mmap_write rid.");
+        return -1;
+    }
+
+    /* 圧縮中に削除や連結で解放された分だけ境界を前に移動します。*/
+    nio->compact->watermark -= size;
+    return extent_merge(nio, ptr, size);
+}
+
+
+static void compact_release(struct nio_compact_t* cp)
+{
+    if (cp->extent)
+        free(cp->extent);
+    free(cp);
+}
+
+static int compact_begin(struct nio_t* nio)
+{
+    struct nio_compact_t* cp;
+    struct nio_free_index_t* fx;
+    int p, i;
+
+    cp = (struct nio_compact_t*)calloc(1, sizeof(struct nio_compact_t));
+    if (cp == NULL) {
+        err_write("nio_compact: no memory.");
+        return -1;
+    }
+    cp->start_size = nio->mmap->real_size;
+
+    /* 空き領域を結合した管理ページを作成してインデックスを読み直します。*/
+    if (rewrite_free_pages(nio, cp) < 0)
+        goto error;
+    free_index_close(nio);
+    if (free_index_open(nio) < 0)
+        goto error;
+
+    /* インデックスのエントリとアドレス順のリストを対応付けます。*/
+    fx = nio->free_index;
+    cp->count = 0;
+    for (p = fx->head; p >= 0; p = fx->page[p].next) {
+        for (i = 0; i < fx->page[p].count; i++) {
+            int e;
+
+            e = fx->page[p].entry[i];
+            if (extent_insert(cp, cp->count, fx->entry[e].ptr, fx->entry[e].size, e) < 0)
+                goto error;
+        }
+    }
+    qsort(cp->extent, cp->count, sizeof(struct nio_extent_t), extent_cmp);
+    nio->compact = cp;
+    if (compact_move_pages(nio) < 0)
+        goto error;
+
+    /* 有効なデータをすべて格納できる境界を求めます。*/
+    cp->watermark = nio->mmap->real_size;
+    for (i = 0; i < cp->count; i++)
+        cp->watermark -= cp->extent[i].size;
+    return 0;
+
+error:
+    nio->compact = NULL;
+    compact_release(cp);
+    return -1;
+}
+
+static int compact_end(struct nio_t* nio, int64* reclaimed)
+{
+    struct nio_compact_t* cp;
+    struct nio_free_index_t* fx;
+    int p, result = 0;
+
+    if (compact_move_pages(nio) < 0)
+        result = -1;
+    cp = nio->compact;
+    nio->compact = NULL;
+
+    /* 圧縮中に空になった空き領域管理ページを解放します。*/
+    fx = nio->free_index;
+    p = fx->head;
+    while (p >= 0) {
+        int next;
+
+        next = fx->page[p].next;
+        if (fx->page[p].count == 0 && p != fx->head) {
+            if (release_free_page(nio, p) < 0) {
+                result = -1;
+                break;
+            }
+        }
+        p = next;
+    }
+
+    /* 圧縮中の追加でファイルが大きくなった場合はゼロとします。*/
+    if (reclaimed)
+        *reclaimed = (cp->start_size > nio->mmap->real_size)? cp->start_size - nio->mmap->real_size : 0;
+    compact_release(cp);
+    return result;
+}
+
+/*
+ * 圧縮中に ptr の位置にあるデータの移動先の領域を取得します。
+ * データが境界より後ろにある場合にファイルの先頭に近い空き領域が
+ * 検索されます。
+ * データベースの圧縮関数からデータを移動するために呼び出されます。
+ *
+ * 空き領域の管理は排他制御されているため、
+ * 複数のスレッドから同時に呼び出すことができます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * size: 必要なサイズ
+ * areasize: 確保された領域サイズが設定されるポインタ
+ *           NULL の場合は余りの出る領域は使用されません。
+ * filling_rate: 空き領域を分割する充填率(%)
+ * ptr: データの現在の位置
+ *
+ * 戻り値
+ *  領域の位置を返します。
+ *  移動の必要がない場合や領域がない場合は -1 を返します。
+ */
+int64 nio_compact_space(struct nio_t* nio, int size, int* areasize, int filling_rate, int64 ptr)
+{
+    int64 offset = -1;
+    struct nio_wal_tx_t* tx;
+
+    tx = free_lock(nio);
+    if (nio->compact && ptr >= nio->compact->watermark) {
+        offset = compact_alloc(nio, size, areasize, filling_rate, nio->compact->watermark);
+        if (offset < 0) {
+            /* 境界より前に領域がない場合は現在の位置より前に移動します。*/
+            offset = compact_alloc(nio, size, areasize, filling_rate, ptr);
+        }
+    }
+    wal_alloc(nio, tx, offset, (areasize != NULL)? *areasize : size);
+    free_unlock(nio, tx);
+    return offset;
+}
+
+/*
+ * 使用中の領域と空きリスト以外の領域を空きリストに戻します。
+ * 異常終了でどこからも参照されなくなった領域を回収するために
+ * データベースのオープン時に呼び出されます。
+ * 空き領域管理ページとそこに登録されている空き領域は使用中として扱われます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * start: 回収する範囲の先頭位置（ヘッダーの直後）
+ * used: データベースが参照している領域の配列（順不同で重複可）
+ * count: 領域の数
+ *
+ * 戻り値
+ *  回収したバイト数を返します。エラーの場合は -1 を返します。
+ */
+int64 nio_reclaim_space(struct nio_t* nio, int64 start, const struct nio_extent_t* used, int count)
+{
+    struct nio_free_index_t* fx;
+    struct nio_extent_t* ext;
+    int64 pos;
+    int64 end;
+    int64 total = 0;
+    int n, p, i;
+
+    CS_START(&nio->free_critical_section);
+    if (free_index_open(nio) < 0) {
+        CS_END(&nio->free_critical_section);
+        return -1;
+    }
+    fx = nio->free_index;
+    n = count;
+    for (p = fx->head; p >= 0; p = fx->page[p].next)
+        n += 1 + fx->page[p].count;
+
+    ext = (struct nio_extent_t*)malloc(sizeof(struct nio_extent_t) * (n + 1));
+    if (ext == NULL) {
+        CS_END(&nio->free_critical_section);
+        err_write("nio_reclaim_space: no memory.");
+        return -1;
+    }
+    memcpy(ext, used, sizeof(struct nio_extent_t) * count);
+    n = count;
+    for (p = fx->head; p >= 0; p = fx->page[p].next) {
+        ext[n].ptr = fx->page[p].offset;
+        ext[n++].size = NIO_FREEPAGE_SIZE;
+        for (i = 0; i < fx->page[p].count; i++) {
+            ext[n].ptr = fx->entry[fx->page[p].entry[i]].ptr;
+            ext[n++].size = fx->entry[fx->page[p].entry[i]].size;
+        }
+    }
+    qsort(ext, n, sizeof(struct nio_extent_t), extent_cmp);
+
+    /* 最後の領域より後ろはファイルサイズを小さくします。
+       空きリストに追加すると管理ページがファイルの最後に割り当てられるため先に行います。*/
+    end = start;
+    for (i = 0; i < n; i++) {
+        if (ext[i].ptr + ext[i].size > end)
+            end = ext[i].ptr + ext[i].size;
+    }
+    if (end < nio->mmap->real_size) {
+        total += nio->mmap->real_size - end;
+        nio->mmap->real_size = end;
+    } else {
+        end = nio->mmap->real_size;
+    }
+
+    /* アドレス順に並べた領域の隙間を空きリストに追加します。
+       空きデータの識別コードとサイズが書けない隙間はそのままにします。*/
+    pos = start;
+    for (i = 0; i < n && pos < end; i++) {
+        int64 next;
+
+        next = (ext[i].ptr < end)? ext[i].ptr : end;
+        while (next - pos >= (int64)(sizeof(ushort) + sizeof(int))) {
+            int size;
+
+            size = (next - pos > COMPACT_MAX_AREASIZE)? COMPACT_MAX_AREASIZE : (int)(next - pos);
+            if (add_free_list(nio, pos, size, NULL) < 0) {
+                CS_END(&nio->free_critical_section);
+                free(ext);
+                return -1;
+            }
+            pos += size;
+            total += size;
+        }
+        if (ext[i].ptr + ext[i].size > pos)
+            pos = ext[i].ptr + ext[i].size;
+    }
+    CS_END(&nio->free_critical_section);
+    free(ext);
+    return total;
+}
+
+/* write-ahead log */
+#define WAL_FILE_EXT            ".wal"
+#define WAL_RECORD_SIZE         32
+#define WAL_RECORD_ID           0xEEAA
+#define WAL_TYPE_WRITE          1
+#define WAL_TYPE_COMMIT         2
+#define WAL_TYPE_ALLOC          3
+#define WAL_CHECKPOINT_SIZE     (64*1024*1024)    /* 64MB */
+#define WAL_FREE_ALLOC_COUNT    16
+
+#define WAL_ID_OFFSET           0
+#define WAL_TYPE_OFFSET         2
+#define WAL_SIZE_OFFSET         4
+#define WAL_BSIZE_OFFSET        8
+#define WAL_CHECKSUM_OFFSET     12
+#define WAL_TXID_OFFSET         16
+#define WAL_POSITION_OFFSET     24
+
+#ifdef _WIN32
+#define WAL_FSYNC(fd)           _commit(fd)
+#else
+#define WAL_FSYNC(fd)           fsync(fd)
+#endif
+
+struct wal_record_t {
+    int type;
+    int size;
+    int bsize;
+    int64 txid;
+    int64 offset;
+    const char* before;
+    const char* after;
+    int committed;
+};
+
+/*
+ * 先行書き込みログ(WAL)
+ *
+ * データベースファイルへの書き込みは書き込み前の内容と書き込む内容が
+ * ログファイル(拡張子 .wal)に追記されてから行われます。
+ * 更新関数(nio_put など)の終わりにコミットレコードが追記されて
+ * ログファイルが同期されます。
+ *
+ * トランザクションは通し番号で識別され、書き込みレコードには
+ * 書き込んだスレッドで実行中のトランザクションの番号が記録されます。
+ *
+ * B+木DBのトランザクションは更新関数の呼び出し単位で、開始から
+ * コミットレコードの追記までは排他で実行されます。このため
+ * データベースでキャッシュされている更新はすべて実行中の
+ * トランザクションのものになります。
+ *
+ * ハッシュDBのトランザクションはバケットの書き込みロックの単位で、
+ * ロックを解除する前にコミットレコードが追記されます(nio_tx_begin,
+ * nio_tx_end)。異なるロックのトランザクションは並行して実行されます。
+ * 他のトランザクションと共有する空き領域の管理は次のように扱います。
+ * ・空き領域の更新は空き領域のロックの中でコミットする
+ *   別のトランザクションとして記録します。
+ * ・トランザクションで確保した領域は確保レコードとして記録し、
+ *   コミットされなかった場合は回復後に空きリストに戻します。
+ * ・トランザクションで解放した領域はコミットレコードの追記と
+ *   同じ空き領域のロックの中で空きリストに追加します。
+ *   このためコミットされるまで他のトランザクションで再利用されません。
+ *
+ * ログの同期は排他を解除してから行うため、複数のスレッドのコミットは
+ * まとめて一回の同期で行われます。
+ *
+ * データベースファイルは通常バッファプール(MMAP_IO_FILE)を介して読み書きされ、
+ * プールのページはログを同期してから書き出されます。
+ * このためログより先に更新がディスクに書き込まれることはありません。
+ * NIO_IO_BACKEND に MMAP_IO_MAP を明示的に指定した場合は
+ * マップしたページを OS がいつでも書き出せるため、
+ * 書き込み順序はプロセスの異常終了に対してのみ保証されます。
+ *
+ * オープン時にログが残っている場合はすべての更新を再実行してから
+ * コミットされていない更新を逆順に取り消します。
+ * ログがチェックポイントのサイズを超えた場合とクローズ時には
+ * すべてのトランザクションの終了を待って
+ * データベースファイルを同期してログを切り詰めます。
+ */
+static int64 wal_append(struct nio_t* nio,
+                        int type,
+                        int64 txid,
+                        int64 offset,
+                        const void* before,
+                        int bsize,
+                        const void* after,
+                        int size)
+{
+    struct nio_wal_t* wal;
+    char* buf;
+    int rsize;
+    ushort rid = WAL_RECORD_ID;
+    ushort rtype = (ushort)type;
+    unsigned int checksum;
+    int64 pos;
+
+    wal = nio->wal;
+    rsize = WAL_RECORD_SIZE + bsize + size;
+    buf = (char*)malloc(rsize);
+    if (buf == NULL) {
+        err_write("nio_wal: no memory.");
+        return -1;
+    }
+
+    memset(buf, '\0', WAL_RECORD_SIZE);
+    memcpy(&buf[WAL_ID_OFFSET], &rid, sizeof(rid));
+    memcpy(&buf[WAL_TYPE_OFFSET], &rtype, sizeof(rtype));
+    memcpy(&buf[WAL_SIZE_OFFSET], &size, sizeof(size));
+    memcpy(&buf[WAL_BSIZE_OFFSET], &bsize, sizeof(bsize));
+    memcpy(&buf[WAL_TXID_OFFSET], &txid, sizeof(txid));
+    memcpy(&buf[WAL_POSITION_OFFSET], &offset, sizeof(offset));
+    if (bsize > 0)
+        memcpy(&buf[WAL_RECORD_SIZE], before, bsize);
+    if (size > 0)
+        memcpy(&buf[WAL_RECORD_SIZE+bsize], after, size);
+
+    /* チェックサムはチェックサム領域をゼロにして計算します。*/
+    checksum = MurmurHash2A(buf, rsize, 0);
+    memcpy(&buf[WAL_CHECKSUM_OFFSET], &checksum, sizeof(checksum));
+
+    /* ログの途中に未書き込みの領域ができないように追記は排他で行います。*/
+    CS_START(&wal->critical_section);
+    FILE_SEEK(wal->fd, wal->write_pos, SEEK_SET);
+    if (FILE_WRITE(wal->fd, buf, rsize) != rsize) {
+        CS_END(&wal->critical_section);
+        err_write("nio_wal: can't write log.");
+        free(buf);
+        return -1;
+    }
+    wal->write_pos += rsize;
+    pos = wal->write_pos;
+    CS_END(&wal->critical_section);
+
+    free(buf);
+    return pos;
+}
+
+static int64 wal_next_txid(struct nio_wal_t* wal)
+{
+    int64 txid;
+
+    CS_START(&wal->critical_section);
+    txid = ++wal->txid;
+    CS_END(&wal->critical_section);
+    return txid;
+}
+
+/* 呼び出したスレッドのトランザクションの状態を返します。
+   最初に呼び出されたときに作成されます。*/
+static struct nio_wal_tx_t* wal_tx(struct nio_wal_t* wal)
+{
+    struct nio_wal_tx_t* tx;
+
+#ifdef _WIN32
+    tx = (struct nio_wal_tx_t*)TlsGetValue(wal->tx_key);
+#else
+    tx = (struct nio_wal_tx_t*)pthread_getspecific(wal->tx_key);
+#endif
+    if (tx)
+        return tx;
+
+    tx = (struct nio_wal_tx_t*)calloc(1, sizeof(struct nio_wal_tx_t));
+    if (tx == NULL) {
+        err_write("nio_wal: no memory.");
+        return NULL;
+    }
+#ifdef _WIN32
+    TlsSetValue(wal->tx_key, tx);
+#else
+    pthread_setspecific(wal->tx_key, tx);
+#endif
+    /* ログのクローズ時に解放するためリストに登録します。*/
+    CS_START(&wal->critical_section);
+    tx->next = wal->tx_list;
+    wal->tx_list = tx;
+    CS_END(&wal->critical_section);
+    return tx;
+}
+
+static int wal_write_hook(void* arg, int64 offset, const void* before, int bsize, const void* after, int size)
+{
+    struct nio_t* nio;
+    struct nio_wal_tx_t* tx;
+
+    nio = (struct nio_t*)arg;
+    tx = wal_tx(nio->wal);
+    if (tx == NULL)
+        return -1;
+    if (wal_append(nio, WAL_TYPE_WRITE, tx->txid, offset, before, bsize, after, size) < 0)
+        return -1;
+    tx->writes++;
+    return 0;
+}
+
+static void wait_usec(int usec)
+{
+#ifdef _WIN32
+    Sleep((usec + 999) / 1000);
+#else
+    usleep(usec);
+#endif
+}
+
+/* ログを lsn の位置まで同期します。
+   同期までに追記されたログもまとめて同期されます。*/
+static int wal_flush(struct nio_wal_t* wal, int64 lsn)
+{
+    int64 target;
+    int result = 0;
+
+    CS_START(&wal->sync_critical_section);
+    CS_START(&wal->critical_section);
+    target = wal->write_pos;
+    lsn = (wal->sync_pos >= lsn)? 0 : lsn;
+    CS_END(&wal->critical_section);
+
+    if (lsn > 0) {
+        if (WAL_FSYNC(wal->fd) < 0) {
+            err_write("nio_wal: can't sync log.");
+            result = -1;
+        } else {
+            CS_START(&wal->critical_section);
+            if (target > wal->sync_pos)
+                wal->sync_pos = target;
+            CS_END(&wal->critical_section);
+            wal->sync_time = system_time();
+        }
+    }
+    CS_END(&wal->sync_critical_section);
+    return result;
+}
+
+static int wal_sync(struct nio_t* nio, int64 lsn)
+{
+    struct nio_wal_t* wal;
+    int64 target;
+
+    wal = nio->wal;
+    if (nio->wal_sync_interval > 0) {
+        /* 同期間隔内のコミットは同期を待ちません。*/
+        if (system_time() - wal->sync_time < (int64)nio->wal_sync_interval * 1000)
+            return 0;
+    }
+
+    CS_START(&wal->critical_section);
+    target = wal->sync_pos;
+    CS_END(&wal->critical_section);
+    if (target >= lsn)
+        return 0;   /* 他のスレッドで同期済み */
+
+    /* 他のスレッドのコミットを待ってまとめて同期します。*/
+    if (nio->wal_commit_wait > 0)
+        wait_usec(nio->wal_commit_wait);
+    return wal_flush(wal, lsn);
+}
+
+/* バッファプールのページを書き出す前に追記済みのログを同期します。
+   同期間隔の設定にかかわらず同期されます。*/
+static int wal_flush_hook(void* arg)
+{
+    struct nio_wal_t* wal;
+    int64 lsn;
+
+    wal = ((struct nio_t*)arg)->wal;
+    CS_START(&wal->critical_section);
+    lsn = wal->write_pos;
+    CS_END(&wal->critical_section);
+    return wal_flush(wal, lsn);
+}
+
+/* 実行中のトランザクションがない状態で呼び出されます。*/
+static int wal_checkpoint(struct nio_t* nio)
+{
+    struct nio_wal_t* wal;
+
+    wal = nio->wal;
+    /* データベースファイルを同期してからログを切り詰めます。*/
+    if (mmap_sync(nio->mmap) < 0)
+        return -1;
+
+    CS_START(&wal->critical_section);
+    FILE_TRUNCATE(wal->fd, 0);
+    WAL_FSYNC(wal->fd);
+    wal->write_pos = 0;
+    wal->sync_pos = 0;
+    CS_END(&wal->critical_section);
+    wal->sync_time = system_time();
+    return 0;
+}
+
+/* 更新関数の開始で呼び出されます。
+   ハッシュDBのトランザクションはデータベースのロックで開始されます。*/
+static void wal_begin(struct nio_t* nio)
+{
+    struct nio_wal_tx_t* tx;
+
+    if (nio->wal == NULL || nio->wal_scoped)
+        return;
+    RWLOCK_WRLOCK(&nio->wal->tx_rwlock);
+    tx = wal_tx(nio->wal);
+    if (tx)
+        tx->txid = wal_next_txid(nio->wal);
+}
+
+/* 更新関数の終わりで呼び出されます。*/
+static void wal_commit(struct nio_t* nio)
+{
+    struct nio_wal_t* wal;
+    struct nio_wal_tx_t* tx;
+    int64 lsn = 0;
+
+    wal = nio->wal;
+    if (wal == NULL)
+        return;
+    tx = wal_tx(wal);
+
+    if (nio->wal_scoped) {
+        /* コミット済みのトランザクションのログを同期します。*/
+        if (tx) {
+            lsn = tx->lsn;
+            tx->lsn = 0;
+        }
+        if (wal->write_pos > WAL_CHECKPOINT_SIZE) {
+            /* 実行中のトランザクションの終了を待ちます。*/
+            RWLOCK_WRLOCK(&wal->tx_rwlock);
+            if (wal->write_pos > WAL_CHECKPOINT_SIZE && wal_checkpoint(nio) == 0)
+                lsn = 0;
+            RWLOCK_WRUNLOCK(&wal->tx_rwlock);
+        }
+    } else {
+        /* データベースでキャッシュされている更新を排他の中で書き出します。*/
+        if (nio->sync_func)
+            (*nio->sync_func)(nio->db);
+
+        if (tx)
+            lsn = wal_append(nio, WAL_TYPE_COMMIT, tx->txid, 0, NULL, 0, NULL, 0);
+        if (wal->write_pos > WAL_CHECKPOINT_SIZE) {
+            /* チェックポイントでデータベースファイルが同期されます。*/
+            if (wal_checkpoint(nio) == 0)
+                lsn = 0;
+        }
+        RWLOCK_WRUNLOCK(&wal->tx_rwlock);
+    }
+    if (lsn > 0)
+        wal_sync(nio, lsn);
+}
+
+/* 解放する領域をコミットまで保留します。*/
+static int wal_defer_free(struct nio_wal_tx_t* tx, int64 ptr, int size)
+{
+    if (tx->free_count >= tx->free_alloc) {
+        struct nio_extent_t* ext;
+        int n;
+
+        n = tx->free_alloc + WAL_FREE_ALLOC_COUNT;
+        ext = (struct nio_extent_t*)realloc(tx->free, sizeof(struct nio_extent_t) * n);
+        if (ext == NULL) {
+            err_write("nio_wal: no memory.");
+            return -1;
+        }
+        tx->free = ext;
+        tx->free_alloc = n;
+    }
+    tx->free[tx->free_count].ptr = ptr;
+    tx->free[tx->free_count].size = size;
+    tx->free_count++;
+    return 0;
+}
+
+/* トランザクションで確保した領域を記録します。*/
+static void wal_alloc(struct nio_t* nio, struct nio_wal_tx_t* tx, int64 ptr, int64 size)
+{
+    if (tx == NULL || tx->depth == 0 || ptr < 0)
+        return;
+    wal_append(nio, WAL_TYPE_ALLOC, tx->outer_txid, ptr, NULL, 0, &size, sizeof(size));
+}
+
+/*
+ * 空き領域の管理をロックします。
+ * トランザクションをデータベースのロックで区切る場合は、空き領域の更新を
+ * 実行中のトランザクションとは別のトランザクションとして
+ * ロックの中でコミットします(free_unlock)。
+ */
+static struct nio_wal_tx_t* free_lock(struct nio_t* nio)
+{
+    struct nio_wal_tx_t* tx = NULL;
+
+    if (nio->wal && nio->wal_scoped) {
+        tx = wal_tx(nio->wal);
+        if (tx && tx->depth == 0)
+            RWLOCK_RDLOCK(&nio->wal->tx_rwlock);
+    }
+    CS_START(&nio->free_critical_section);
+    if (tx) {
+        tx->outer_txid = tx->txid;
+        tx->txid = wal_next_txid(nio->wal);
+    }
+    return tx;
+}
+
+static void free_unlock(struct nio_t* nio, struct nio_wal_tx_t* tx)
+{
+    if (tx) {
+        int64 lsn;
+
+        lsn = wal_append(nio, WAL_TYPE_COMMIT, tx->txid, 0, NULL, 0, NULL, 0);
+        if (lsn > 0)
+            tx->lsn = lsn;
+        tx->txid = tx->outer_txid;
+    }
+    CS_END(&nio->free_critical_section);
+    if (tx && tx->depth == 0)
+        RWLOCK_RDUNLOCK(&nio->wal->tx_rwlock);
+}
+
+/*
+ * 呼び出したスレッドでデータベースのロックを単位とするトランザクションを
+ * 開始します。ハッシュDBの書き込みロックを取得した後に呼び出されます。
+ * 入れ子で呼び出した場合は外側のトランザクションに含まれます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+void nio_tx_begin(struct nio_t* nio)
+{
+    struct nio_wal_tx_t* tx;
+
+    if (nio->wal == NULL || ! nio->wal_scoped)
+        return;
+    tx = wal_tx(nio->wal);
+    if (tx == NULL || tx->depth++ > 0)
+        return;
+    /* チェックポイントとは排他になります。*/
+    RWLOCK_RDLOCK(&nio->wal->tx_rwlock);
+    tx->txid = wal_next_txid(nio->wal);
+    tx->writes = 0;
+}
+
+/*
+ * nio_tx_begin() で開始したトランザクションのコミットレコードを追記します。
+ * 書き込みロックを解除する前に呼び出されます。
+ * 保留していた領域はここで空きリストに追加されます。
+ * ログの同期は更新関数の終わりで行われます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ *
+ * 戻り値
+ *  なし
+ */
+void nio_tx_end(struct nio_t* nio)
+{
+    struct nio_wal_tx_t* tx;
+    int64 lsn;
+    int i;
+
+    if (nio->wal == NULL || ! nio->wal_scoped)
+        return;
+    tx = wal_tx(nio->wal);
+    if (tx == NULL || tx->depth == 0 || --tx->depth > 0)
+        return;
+
+    if (tx->free_count > 0) {
+        /* コミットされるまで他のトランザクションで再利用されないように
+           空き領域のロックの中でコミットレコードを追記します。*/
+        CS_START(&nio->free_critical_section);
+        for (i = 0; i < tx->free_count; i++)
+            free_space(nio, tx->free[i].ptr, (int)tx->free[i].size);
+        lsn = wal_append(nio, WAL_TYPE_COMMIT, tx->txid, 0, NULL, 0, NULL, 0);
+        CS_END(&nio->free_critical_section);
+        tx->free_count = 0;
+    } else if (tx->writes > 0) {
+        lsn = wal_append(nio, WAL_TYPE_COMMIT, tx->txid, 0, NULL, 0, NULL, 0);
+    } else {
+        lsn = 0;    /* 書き込みのないトランザクション */
+    }
+    if (lsn > 0)
+        tx->lsn = lsn;
+    RWLOCK_RDUNLOCK(&nio->wal->tx_rwlock);
+}
+
+static void wal_tx_free(void* arg)
+{
+    /* スレッドの終了では解放せず、ログのクローズで解放します。*/
+    (void)arg;
+}
+
+static int wal_open(struct nio_t* nio, const char* fname, int create)
+{
+    char fpath[MAX_PATH+1];
+    struct nio_wal_t* wal;
+    int fd;
+
+    if (strlen(fname)+4 > MAX_PATH) {
+        err_write("nio_wal: filename is too long.");
+        return -1;
+    }
+    nio_make_filename(fpath, fname, WAL_FILE_EXT);
+
+    fd = FILE_OPEN(fpath, O_RDWR|O_CREAT|O_BINARY, CREATE_MODE);
+    if (fd < 0) {
+        err_write("nio_wal: file can't open: %s.", fpath);
+        return -1;
+    }
+    if (create)
+        FILE_TRUNCATE(fd, 0);
+
+    wal = (struct nio_wal_t*)calloc(1, sizeof(struct nio_wal_t));
+    if (wal == NULL) {
+        err_write("nio_wal: no memory.");
+        FILE_CLOSE(fd);
+        return -1;
+    }
+#ifdef _WIN32
+    wal->tx_key = TlsAlloc();
+    if (wal->tx_key == TLS_OUT_OF_INDEXES) {
+#else
+    if (pthread_key_create(&wal->tx_key, wal_tx_free) != 0) {
+#endif
+        err_write("nio_wal: can't create thread local key.");
+        free(wal);
+        FILE_CLOSE(fd);
+        return -1;
+    }
+    wal->fd = fd;
+    CS_INIT(&wal->critical_section);
+    CS_INIT(&wal->sync_critical_section);
+    RWLOCK_INIT(&wal->tx_rwlock);
+    wal->write_pos = FILE_SEEK(fd, 0, SEEK_END);
+    wal->sync_pos = wal->write_pos;
+    wal->sync_time = system_time();
+    nio->wal = wal;
+    return 0;
+}
+
+static void wal_close(struct nio_t* nio)
+{
+    struct nio_wal_t* wal;
+    struct nio_wal_tx_t* tx;
+
+    wal = nio->wal;
+    if (wal == NULL)
+        return;
+    FILE_CLOSE(wal->fd);
+#ifdef _WIN32
+    TlsFree(wal->tx_key);
+#else
+    pthread_key_delete(wal->tx_key);
+#endif
+    tx = wal->tx_list;
+    while (tx) {
+        struct nio_wal_tx_t* next;
+
+        next = tx->next;
+        if (tx->free)
+            free(tx->free);
+        free(tx);
+        tx = next;
+    }
+    if (wal->orphan)
+        free(wal->orphan);
+    CS_DELETE(&wal->critical_section);
+    CS_DELETE(&wal->sync_critical_section);
+    RWLOCK_DELETE(&wal->tx_rwlock);
+    free(wal);
+    nio->wal = NULL;
+}
+
+/* 回復でコミットされていなかったトランザクションが確保した領域を
+   空きリストに戻してからチェックポイントを行います。*/
+static void wal_release_orphans(struct nio_t* nio)
+{
+    struct nio_wal_t* wal;
+    int i, n = 0;
+
+    wal = nio->wal;
+    if (wal->orphan_count == 0)
+        return;
+    for (i = 0; i < wal->orphan_count; i++) {
+        struct nio_extent_t* e;
+
+        e = &wal->orphan[i];
+        if (e->ptr + e->size > nio->mmap->real_size || e->size > COMPACT_MAX_AREASIZE)
+            continue;   /* 回復でファイルに書き出されなかった領域 */
+        if (nio_add_free_list(nio, e->ptr, (int)e->size) == 0)
+            n++;
+    }
+    free(wal->orphan);
+    wal->orphan = NULL;
+    wal->orphan_count = 0;
+    wal_checkpoint(nio);
+    logout_write("nio_wal: released %d areas of uncommitted transactions.", n);
+}
+
+static void wal_start(struct nio_t* nio)
+{
+    if (nio->wal) {
+        mmap_write_hook(nio->mmap, wal_write_hook, nio);
+        mmap_flush_hook(nio->mmap, wal_flush_hook, nio);
+        wal_release_orphans(nio);
+    }
+}
+
+static int write_at(int fd, const void* data, int size, int64 offset)
+{
+    FILE_SEEK(fd, offset, SEEK_SET);
+    if (FILE_WRITE(fd, data, size) != size)
+        return -1;
+    return 0;
+}
+
+static int read_log(int fd, char* buf, int64 size)
+{
+    int64 n = 0;
+
+    FILE_SEEK(fd, 0, SEEK_SET);
+    while (n < size) {
+        int len, rb;
 
-        memcpy(&lptr, p, sizeof(lptr));
-        p += sizeof(lptr);
-        fpg->data_ptr[i] = lptr;
+        len = (size - n > 0x40000000)? 0x40000000 : (int)(size - n);
+        rb = FILE_READ(fd, buf+n, len);
+        if (rb <= 0)
+            return -1;
+        n += rb;
     }
     return 0;
 }
 
-static int write_free_page(struct nio_t* nio, struct nio_free_t* fpg)
+static int parse_log(char* log, int64 lsize, struct wal_record_t* rec)
 {
-    char buf[NIO_FREEPAGE_SIZE];
-    ushort rid;
-    int64 nextptr;
-    ushort count;
-    int i;
-    char* p;
-
-    memset(buf, '\0', NIO_FREEPAGE_SIZE);
-
-    /* データ識別コード */
-    rid = NIO_FREEPAGE_ID;
-    memcpy(buf, &rid, sizeof(rid));
+    int64 pos = 0;
+    int n = 0;
+
+    while (pos + WAL_RECORD_SIZE <= lsize) {
+        char* p = log + pos;
+        ushort rid, rtype;
+        unsigned int checksum, zero = 0;
+        struct wal_record_t* r;
+
+        r = &rec[n];
+        memcpy(&rid, &p[WAL_ID_OFFSET], sizeof(rid));
+        if (rid != WAL_RECORD_ID)
+            break;
+        memcpy(&rtype, &p[WAL_TYPE_OFFSET], sizeof(rtype));
+        memcpy(&r->size, &p[WAL_SIZE_OFFSET], sizeof(int));
+        memcpy(&r->bsize, &p[WAL_BSIZE_OFFSET], sizeof(int));
+        if (r->size < 0 || r->bsize < 0 || r->bsize > r->size)
+            break;
+        if (pos + WAL_RECORD_SIZE + r->bsize + r->size > lsize)
+            break;  /* 書き込み途中のレコード */
 
-    /* 次空きデータ管理ページポインタ */
-    nextptr = fpg->next_ptr;
-    memcpy(&buf[NIO_FREEPAGE_NEXT_OFFSET], &nextptr, sizeof(int64));
+        memcpy(&checksum, &p[WAL_CHECKSUM_OFFSET], sizeof(checksum));
+        memcpy(&p[WAL_CHECKSUM_OFFSET], &zero, sizeof(zero));
+        if (MurmurHash2A(p, WAL_RECORD_SIZE + r->bsize + r->size, 0) != checksum)
+            break;
 
-    /* 領域数 */
-    count = (ushort)fpg->count;
-    memcpy(&buf[NIO_FREEPAGE_COUNT_OFFSET], &count, sizeof(ushort));
+        r->type = rtype;
+        memcpy(&r->txid, &p[WAL_TXID_OFFSET], sizeof(int64));
+        memcpy(&r->offset, &p[WAL_POSITION_OFFSET], sizeof(int64));
+        r->before = p + WAL_RECORD_SIZE;
+        r->after = p + WAL_RECORD_SIZE + r->bsize;
+        r->committed = 0;
+        n++;
+        pos += WAL_RECORD_SIZE + r->bsize + r->size;
+    }
+    return n;
+}
 
-    p = &buf[NIO_FREEPAGE_ARRAY_OFFSET];
-    for (i = 0; i < fpg->count; i++) {
-        int32 size;
-        int64 lptr;
+static void mark_committed(struct wal_record_t* rec, int n)
+{
+    int64* txids;
+    int txnum = 0;
+    int i, j;
 
-        size = fpg->page_size[i];
-        memcpy(p, &size, sizeof(size));
-        p += sizeof(size);
+    txids = (int64*)malloc(sizeof(int64) * (n + 1));
+    if (txids == NULL)
+        return;
 
-        lptr = fpg->data_ptr[i];
-        memcpy(p, &lptr, sizeof(lptr));
-        p += sizeof(lptr);
+    /* 後ろから走査して、コミットレコードより前の更新をコミット済みにします。*/
+    for (i = n-1; i >= 0; i--) {
+        for (j = 0; j < txnum; j++) {
+            if (txids[j] == rec[i].txid)
+                break;
+        }
+        if (rec[i].type == WAL_TYPE_COMMIT) {
+            if (j == txnum)
+                txids[txnum++] = rec[i].txid;
+        } else {
+            rec[i].committed = (j < txnum);
+        }
     }
+    free(txids);
+}
 
-    /* 空き管理ページの書き出し */
-    mmap_seek(nio->mmap, fpg->offset);
-    if (mmap_write(nio->mmap, buf, NIO_FREEPAGE_SIZE) != NIO_FREEPAGE_SIZE) {
-        err_write("write_free_page: can't write free page.");
-        return -1;
+static int overlap_committed(struct wal_record_t* rec, int n, int index)
+{
+    int i;
+    int64 start, last;
+
+    start = rec[index].offset;
+    last = start + rec[index].bsize;
+    for (i = index+1; i < n; i++) {
+        if (rec[i].type == WAL_TYPE_WRITE && rec[i].committed) {
+            if (rec[i].offset < last && start < rec[i].offset + rec[i].size)
+                return 1;
+        }
     }
     return 0;
 }
 
-static int new_free_page(struct nio_t* nio,
-                         struct nio_free_t* fpg,
-                         int size,
-                         int64 ptr)
+/*
+ * ログからデータベースファイルを回復します。
+ * データベースファイルをオープンした直後に呼び出されます。
+ *
+ * ログに残っているすべての更新を再実行してから、コミットされていない
+ * 更新を逆順に取り消します。ただし、後からコミットされた更新と重なる
+ * 領域は取り消しません。
+ * 回復後はデータベースファイルを同期してログを切り詰めます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * fd: データベースファイルのディスクリプタ
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int nio_wal_recover(struct nio_t* nio, int fd)
 {
-    int64 fptr;
+    struct nio_wal_t* wal;
+    int64 lsize;
+    char* log;
+    struct wal_record_t* rec;
+    int n, i;
+    int redo = 0, undo = 0;
+    int result = 0;
 
-    /* ファイルの最後に割り当てます。
-       reuse_space() を呼ぶと再帰呼び出しになる可能性があるため。*/
-    fptr = nio->mmap->real_size;
+    wal = nio->wal;
+    if (wal == NULL)
+        return 0;
 
-    fpg->offset = fptr;
-    fpg->count = 1;
-    fpg->page_size[0] = size;
-    fpg->data_ptr[0] = ptr;
-    fpg->next_ptr = nio->free_ptr;
+    lsize = FILE_SEEK(wal->fd, 0, SEEK_END);
+    if (lsize < WAL_RECORD_SIZE)
+        goto final;
 
-    /* ヘッダーの空きポインタを更新します。*/
-    return put_free_ptr(nio, fptr);
-}
+    log = (char*)malloc((size_t)lsize);
+    if (log == NULL) {
+        err_write("nio_wal: no memory, log size=%lld.", lsize);
+        return -1;
+    }
+    rec = (struct wal_record_t*)malloc(sizeof(struct wal_record_t) * (size_t)(lsize / WAL_RECORD_SIZE));
+    if (rec == NULL) {
+        err_write("nio_wal: no memory.");
+        free(log);
+        return -1;
+    }
+    if (read_log(wal->fd, log, lsize) < 0) {
+        err_write("nio_wal: can't read log.");
+        free(rec);
+        free(log);
+        return -1;
+    }
 
-int nio_add_free_list(struct nio_t* nio, int64 ptr, int size)
-{
-    int result = 0;
-    ushort rid = NIO_FREEDATA_ID;
-    struct nio_free_t* fpg;
+    n = parse_log(log, lsize, rec);
+    mark_committed(rec, n);
 
-    /* ファイルの最後を削除する場合はファイルサイズを小さくします。*/
-    if (nio->mmap->real_size == ptr+size) {
-        /* ファイルサイズを調整します。*/
-        nio->mmap->real_size = ptr;
-        return 0;
+    /* すべての更新を再実行します。*/
+    for (i = 0; i < n; i++) {
+        if (rec[i].type == WAL_TYPE_WRITE) {
+            if (write_at(fd, rec[i].after, rec[i].size, rec[i].offset) < 0) {
+                result = -1;
+                break;
+            }
+            redo++;
+        }
+    }
+    /* コミットされていない更新を逆順に取り消します。*/
+    for (i = n-1; result == 0 && i >= 0; i--) {
+        if (rec[i].type == WAL_TYPE_WRITE && ! rec[i].committed && rec[i].bsize > 0) {
+            if (overlap_committed(rec, n, i))
+                continue;
+            if (write_at(fd, rec[i].before, rec[i].bsize, rec[i].offset) < 0) {
+                result = -1;
+                break;
+            }
+            undo++;
+        }
+    }
+    /* コミットされなかったトランザクションが確保した領域は
+       オープン後に空きリストに戻します。*/
+    for (i = 0; result == 0 && i < n; i++) {
+        if (rec[i].type == WAL_TYPE_ALLOC && ! rec[i].committed && rec[i].size == sizeof(int64)) {
+            if (wal->orphan_count % WAL_FREE_ALLOC_COUNT == 0) {
+                struct nio_extent_t* ext;
+
+                ext = (struct nio_extent_t*)realloc(wal->orphan,
+                        sizeof(struct nio_extent_t) * (wal->orphan_count + WAL_FREE_ALLOC_COUNT));
+                if (ext == NULL) {
+                    err_write("nio_wal: no memory.");
+                    break;
+                }
+                wal->orphan = ext;
+            }
+            wal->orphan[wal->orphan_count].ptr = rec[i].offset;
+            memcpy(&wal->orphan[wal->orphan_count].size, rec[i].after, sizeof(int64));
+            wal->orphan_count++;
+        }
     }
+    free(rec);
+    free(log);
 
-    /* 解放する領域を空きデータとして更新します。*/
-    mmap_seek(nio->mmap, ptr);
-    if (mmap_write(nio->mmap, &rid, sizeof(rid)) != sizeof(rid)) {
-        err_write("nio_add_free_list: can't mmap_write rid.");
+    if (result < 0) {
+        err_write("nio_wal: can't write database file.");
         return -1;
     }
-    if (mmap_write(nio->mmap, &size, sizeof(int)) != sizeof(int)) {
-        err_write("nio_add_free_list: can't mmap_write size.");
+    if (WAL_FSYNC(fd) < 0) {
+        err_write("nio_wal: can't sync database file.");
         return -1;
     }
+    logout_write("nio_wal: recovered, redo=%d undo=%d orphan=%d", redo, undo, wal->orphan_count);
 
-    /* 空きデータ管理部の更新 */
-    fpg = nio->free_page;
-    if (nio->free_ptr == 0) {
-        /* 新しいページに追加します。*/
-        result = new_free_page(nio, fpg, size, ptr);
+final:
+    if (lsize > 0) {
+        FILE_TRUNCATE(wal->fd, 0);
+        WAL_FSYNC(wal->fd);
+    }
+    wal->write_pos = 0;
+    wal->sync_pos = 0;
+    return 0;
+}
+
+/*
+ * データベースファイルを同期してログを切り詰めます。
+ * データベースファイルのクローズ直前に呼び出されます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ *
+ * 戻り値
+ *  成功した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int nio_wal_checkpoint(struct nio_t* nio)
+{
+    if (nio->wal == NULL)
+        return 0;
+    return wal_checkpoint(nio);
+}
+
+/*
+ * 値を圧縮します。
+ * 圧縮方式が設定されていて値のサイズが閾値以上の場合に圧縮します。
+ * 圧縮した値の先頭には元の値のサイズ(int)が設定されます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * val: 値のポインタ
+ * valsize: 値のサイズ
+ * csize: 圧縮した値のサイズが設定されるポインタ
+ * codec: 圧縮方式(NIO_COMP_*)が設定されるポインタ
+ *
+ * 戻り値
+ *  圧縮した値の領域のポインタを返します。領域は使用後に free() で解放します。
+ *  圧縮しない場合やサイズが小さくならない場合は NULL を返します。
+ */
+char* nio_value_compress(struct nio_t* nio, const void* val, int valsize, int* csize, int* codec)
+{
+    char* buf;
+    int size;
+
+    if (nio->comp_codec == NIO_COMP_NONE || valsize < nio->comp_threshold)
+        return NULL;
+    /* 元のサイズより小さくならない場合は圧縮しません。*/
+    if (valsize <= (int)sizeof(int) + 1)
+        return NULL;
+
+    buf = (char*)malloc(valsize);
+    if (buf == NULL)
+        return NULL;
+    if (nio->comp_codec == NIO_COMP_ZLIB) {
+        char* zbuf;
+
+        zbuf = gz_comp((const char*)val, valsize, &size);
+        if (zbuf == NULL) {
+            free(buf);
+            return NULL;
+        }
+        if (size >= valsize - (int)sizeof(int)) {
+            gz_free(zbuf);
+            free(buf);
+            return NULL;
+        }
+        memcpy(buf + sizeof(int), zbuf, size);
+        gz_free(zbuf);
     } else {
-        /* 空き領域管理ページの読み込み */
-        /* すべてのページを探すと遅いので最初のページのみチェックします。*/
-        result = read_free_page(nio, nio->free_ptr, fpg);
-        if (result == 0) {
-            if (fpg->count < NIO_FREE_COUNT) {
-                fpg->page_size[fpg->count] = size;
-                fpg->data_ptr[fpg->count] = ptr;
-                fpg->count++;
-            } else {
-                /* 新しいページに追加します。*/
-                result = new_free_page(nio, fpg, size, ptr);
-            }
+        size = lz_comp((const char*)val, valsize, buf + sizeof(int), valsize - sizeof(int) - 1);
+        if (size <= 0) {
+            free(buf);
+            return NULL;
         }
     }
-    if (result == 0) {
-        /* 空き領域管理ページの書き出し */
-        result = write_free_page(nio, fpg);
-    }
-    return result;
+    memcpy(buf, &valsize, sizeof(int));
+    *csize = sizeof(int) + size;
+    *codec = nio->comp_codec;
+    return buf;
 }
 
-static int is_divide_space(int freesize, int size, int filling_rate)
+/*
+ * 圧縮された値の元のサイズを返します。
+ *
+ * cval: 圧縮された値のポインタ
+ *
+ * 戻り値
+ *  元の値のサイズを返します。
+ */
+int nio_value_rawsize(const void* cval)
 {
-    int remain;
-    int rate;
+    int size;
 
-    remain = freesize - size;
-    if (remain <= 64)
-        return 0;  /* 残りが64バイト以下は分割利用しません */
-    rate = (freesize - size) * 100 / size;
-    return (rate > filling_rate);
+    memcpy(&size, cval, sizeof(int));
+    return size;
 }
 
-static int unlink_free_list(struct nio_t* nio, int64 del_ptr, int64 next_ptr)
+/*
+ * 圧縮された値を展開します。
+ *
+ * codec: 圧縮方式(NIO_COMP_*)
+ * cval: 圧縮された値のポインタ
+ * csize: 圧縮された値のサイズ
+ * val: 展開した値を設定する領域のポインタ
+ * valsize: 値の領域サイズ
+ *
+ * 戻り値
+ *  展開した値のサイズを返します。
+ *  値の領域が不足している場合は -2 を返します。
+ *  エラーの場合は -1 を返します。
+ */
+int nio_value_uncompress(int codec, const void* cval, int csize, void* val, int valsize)
 {
-    int64 fptr;
+    const char* src;
+    int size, n;
 
-    fptr = nio->free_ptr;
-    while (fptr != 0) {
-        int64 nxptr;
-        int64 offset;
+    if (csize < (int)sizeof(int)) {
+        err_write("nio_value_uncompress: invalid compressed value.");
+        return -1;
+    }
+    size = nio_value_rawsize(cval);
+    if (size > valsize)
+        return -2;
 
-        offset = fptr + NIO_FREEPAGE_NEXT_OFFSET;
-        mmap_seek(nio->mmap, offset);
-        if (mmap_read(nio->mmap, &nxptr, sizeof(int64)) != sizeof(int64)) {
-            err_write("unlink_free_list: can't mmap_read.");
+    src = (const char*)cval + sizeof(int);
+    if (codec == NIO_COMP_ZLIB) {
+        char* buf;
+
+        buf = gz_decomp(src, csize - sizeof(int), &n);
+        if (buf == NULL)
             return -1;
-        }
-        if (nxptr == del_ptr) {
-            mmap_seek(nio->mmap, offset);
-            if (mmap_write(nio->mmap, &next_ptr, sizeof(int64)) != sizeof(int64)) {
-                err_write("unlink_free_list: can't mmap_write.");
-                return -1;
-            }
-            break;
-        }
-        fptr = nxptr;
+        if (n == size)
+            memcpy(val, buf, n);
+        gz_free(buf);
+    } else if (codec == NIO_COMP_LZ) {
+        n = lz_decomp(src, csize - sizeof(int), (char*)val, size);
+    } else {
+        err_write("nio_value_uncompress: unknown codec=%d", codec);
+        return -1;
     }
-    return 0;
+    if (n != size) {
+        err_write("nio_value_uncompress: broken compressed value.");
+        return -1;
+    }
+    return size;
 }
 
-static int64 reuse_space(struct nio_t* nio, int size, int* areasize, int filling_rate)
+#define DEFAULT_IO_POOL_SIZE    64  /* MB */
+
+/*
+ * データベースファイルのメモリマップ構造体を作成します。
+ * NIO_IO_BACKEND が MMAP_IO_FILE の場合はファイルをマップせずに
+ * バッファプールを介して読み書きします。
+ * 指定されていない場合は NIO_WAL が指定されているとページの書き出しを
+ * ログの同期の後に行うためにバッファプールを使用し、
+ * そうでない場合はファイルをマップします。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * fd: オープン済みのファイルディスクリプタ
+ * view_size: マップするサイズ(MMAP_IO_MAP の場合)
+ *
+ * 戻り値
+ *  メモリマップ構造体のポインタを返します。
+ *  エラーの場合は NULL を返します。
+ */
+struct mmap_t* nio_mmap_open(struct nio_t* nio, int fd, int64 view_size)
 {
-    int64 fptr;
-    struct nio_free_t* fpg;
-    int result = 0;
+    int backend;
 
-    fpg = nio->free_page;
+    backend = nio->io_backend;
+    if (backend < 0)
+        backend = (nio->wal_flag)? MMAP_IO_FILE : MMAP_IO_MAP;
+    if (backend == MMAP_IO_FILE) {
+        int64 pool_size;
 
-    /* 空き領域管理ページの読み込み */
-    fptr = nio->free_ptr;
-    while (fptr != 0 && result == 0) {
-        result = read_free_page(nio, fptr, fpg);
-        if (result == 0) {
-            int i;
-
-            for (i = 0; i < fpg->count; i++) {
-                if (fpg->page_size[i] >= size) {
-                    int64 ptr;
-
-                    /* 格納可能な空き領域が見つかった */
-                    /* 空き領域を分割するか判定します。*/
-                    if (is_divide_space(fpg->page_size[i], size, filling_rate)) {
-                        int rest_size;
-
-                        /* 空き領域を分割する場合は後半を再利用します。*/
-                        rest_size = fpg->page_size[i] - size;
-                        ptr = fpg->data_ptr[i] + rest_size;
-                        if (areasize != NULL)
-                            *areasize = size;
-                        /* 空き管理データを更新します。*/
-                        fpg->page_size[i] = rest_size;
-                        /* 空きデータの領域サイズを更新します。*/
-                        mmap_seek(nio->mmap, fpg->data_ptr[i]+sizeof(int));
-                        if (mmap_write(nio->mmap, &rest_size, sizeof(int)) != sizeof(int)) {
-                            err_write("reuse_space: can't mmap write.");
-                            return -1;
-                        }
-                    } else {
-                        ptr = fpg->data_ptr[i];
-                        if (areasize != NULL)
-                            *areasize = fpg->page_size[i];
-                        fpg->count--;
-
-                        /* fpg->countがゼロになった場合はファイルの最後の時のみ
-                           ファイルサイズを調整します。
-                           それ以外は空き管理ページを解放する。*/
-                        if (fpg->count == 0) {
-                            if (nio->free_ptr == fptr) {
-                                /* 空き領域管理ポインタを更新します。*/
-                                if (put_free_ptr(nio, fpg->next_ptr) < 0)
-                                    return -1;
-                            }
-                            if (nio->mmap->real_size == fptr+NIO_FREEPAGE_SIZE) {
-                                /* ファイルサイズを調整します。*/
-                                nio->mmap->real_size = fptr;
-                            } else {
-                                /* フリーリストのリンクをつなぎ変えます。*/
-                                if (unlink_free_list(nio, fpg->offset, fpg->next_ptr) < 0)
-                                    return -1;
-                                /* 領域を開放します。*/
-                                if (nio_add_free_list(nio, fpg->offset, NIO_FREEPAGE_SIZE) < 0)
-                                    return -1;
-                            }
-                            return ptr;
-                        }
-                        if (i < fpg->count) {
-                            /* 空き領域を左シフトします。*/
-                            int shift_n;
-
-                            shift_n = fpg->count - i;
-                            memmove(&fpg->page_size[i], &fpg->page_size[i+1], shift_n * sizeof(int));
-                            memmove(&fpg->data_ptr[i], &fpg->data_ptr[i+1], shift_n * sizeof(int64));
-                            fpg->page_size[fpg->count] = 0;
-                            fpg->data_ptr[fpg->count] = 0;
-                        }
-                    }
-                    if (write_free_page(nio, fpg) < 0)
-                        return -1;
-
-                    return ptr; /* found space */
-                }
-            }
-            fptr = fpg->next_ptr;
-        }
+        pool_size = (nio->io_pool_size > 0)? nio->io_pool_size : DEFAULT_IO_POOL_SIZE;
+        return mmap_open_pool(fd, MMAP_READWRITE, pool_size * 1024 * 1024);
     }
-    return -1;  /* not found */
+    return mmap_open(fd, MMAP_READWRITE, view_size);
 }
 
-int64 nio_avail_space(struct nio_t* nio, int size, int* areasize, int filling_rate)
+/* 期限切れのキーの回収スレッド */
+#define DEFAULT_REAP_BUCKETS    1024
+#define REAP_WAIT_MSEC          100
+
+static int reap_batch(struct nio_t* nio, int nbuckets)
 {
-    int64 offset = -1;
+    int result;
 
-    if (nio->free_ptr != 0) {
-        /* 空き領域管理ページから再利用できる領域を検索します。*/
-        offset = reuse_space(nio, size, areasize, filling_rate);
-        if (offset > 0)
-            mmap_seek(nio->mmap, offset);
+    wal_begin(nio);
+    result = (*nio->reap_func)(nio->db, nbuckets);
+    wal_commit(nio);
+    return result;
+}
+
+#ifdef _WIN32
+static unsigned __stdcall reap_thread(void* argv)
+#else
+static void* reap_thread(void* argv)
+#endif
+{
+    struct nio_t* nio;
+    int slice, elapsed = 0;
+
+    nio = (struct nio_t*)argv;
+    /* クローズ要求を確認できるように短い間隔で眠ります。*/
+    slice = (nio->reap_interval < REAP_WAIT_MSEC)? nio->reap_interval : REAP_WAIT_MSEC;
+    while (! nio->reap_end_flag) {
+        wait_usec(slice * 1000);
+        elapsed += slice;
+        if (elapsed < nio->reap_interval)
+            continue;
+        elapsed = 0;
+        if (! nio->reap_end_flag)
+            reap_batch(nio, nio->reap_buckets);
     }
+    return 0;
+}
 
-    if (offset < 0) {
-        /* 空き領域はないため、ファイルの最後に追加します。*/
-        offset = mmap_seek(nio->mmap, nio->mmap->real_size);
-        if (areasize != NULL)
-            *areasize = size;
+static int reap_start(struct nio_t* nio)
+{
+    if (nio->reap_interval <= 0 || nio->reap_func == NULL)
+        return 0;
+    if (nio->reap_buckets <= 0)
+        nio->reap_buckets = DEFAULT_REAP_BUCKETS;
+
+    nio->reap_end_flag = 0;
+#ifdef _WIN32
+    nio->reap_thread = (HANDLE)_beginthreadex(NULL, 0, reap_thread, nio, 0, NULL);
+    if (nio->reap_thread == 0) {
+#else
+    if (pthread_create(&nio->reap_thread, NULL, reap_thread, nio) != 0) {
+#endif
+        err_write("nio: can't create reaper thread.");
+        return -1;
     }
-    return offset;
+    nio->reap_running = 1;
+    return 0;
+}
+
+static void reap_stop(struct nio_t* nio)
+{
+    if (! nio->reap_running)
+        return;
+
+    /* スレッドの終了を待ちます。*/
+    nio->reap_end_flag = 1;
+#ifdef _WIN32
+    WaitForSingleObject(nio->reap_thread, INFINITE);
+    CloseHandle(nio->reap_thread);
+#else
+    pthread_join(nio->reap_thread, NULL);
+#endif
+    nio->reap_running = 0;
+}
+
+static void compact_close(struct nio_t* nio)
+{
+    struct nio_wal_tx_t* tx;
+
+    if (nio->compact == NULL)
+        return;
+
+    /* 途中の圧縮を終了して空き領域を書き戻します。*/
+    wal_begin(nio);
+    tx = free_lock(nio);
+    if (nio->compact)
+        compact_end(nio, NULL);
+    free_unlock(nio, tx);
+    if (nio->sync_func)
+        (*nio->sync_func)(nio->db);
+    wal_commit(nio);
 }
 
 /*
@@ -455,6 +2617,8 @@ struct nio_t* nio_initialize(int dbtype)
         return NULL;
     }
     nio->dbtype = dbtype;
+    nio->comp_threshold = NIO_COMP_THRESHOLD;
+    nio->io_backend = -1;   /* 指定されていない */
 
     nio->free_page = (struct nio_free_t*)calloc(1, sizeof(struct nio_free_t));
     if (nio->free_page == NULL) {
@@ -462,10 +2626,12 @@ struct nio_t* nio_initialize(int dbtype)
         free(nio);
         return NULL;
     }
+    CS_INIT(&nio->free_critical_section);
 
     /* 関数の設定 */
     if (dbtype == NIO_HASH) {
         nio->db = hdb_initialize(nio);
+        nio->wal_scoped = 1;    /* トランザクションはバケットのロック単位 */
 
         nio->finalize_func = (FINALIZE_FUNCPTR)hdb_finalize;
         nio->property_func = (PROPERTY_FUNCPTR)hdb_property;
@@ -478,16 +2644,24 @@ struct nio_t* nio_initialize(int dbtype)
         nio->gets_func = (GETS_FUNCPTR)hdb_gets;
         nio->aget_func = (AGET_FUNCPTR)hdb_aget;
         nio->agets_func = (AGETS_FUNCPTR)hdb_agets;
+        nio->get_view_func = (GET_VIEW_FUNCPTR)hdb_get_view;
         nio->put_func = (PUT_FUNCPTR)hdb_put;
         nio->puts_func = (PUTS_FUNCPTR)hdb_puts;
         nio->bset_func = (BSET_FUNCPTR)hdb_bset;
+        nio->put_ttl_func = (PUT_TTL_FUNCPTR)hdb_put_ttl;
+        nio->reap_func = (REAP_FUNCPTR)hdb_reap;
+        nio->compact_func = (COMPACT_FUNCPTR)hdb_compact;
         nio->delete_func = (DELETE_FUNCPTR)hdb_delete;
         nio->free_func = (FREE_FUNCPTR)hdb_free;
+        nio->mget_func = (BATCH_FUNCPTR)hdb_mget;
+        nio->mput_func = (BATCH_FUNCPTR)hdb_mput;
+        nio->mdelete_func = (BATCH_FUNCPTR)hdb_mdelete;
 
         nio->cursor_open_func = (CURSOR_OPEN_FUNCPTR)hdb_cursor_open;
         nio->cursor_close_func = (CURSOR_CLOSE_FUNCPTR)hdb_cursor_close;
         nio->cursor_next_func = (CURSOR_NEXT_FUNCPTR)hdb_cursor_next;
         nio->cursor_key_func = (CURSOR_KEY_FUNCPTR)hdb_cursor_key;
+        nio->cursor_partition_func = (CURSOR_PARTITION_FUNCPTR)hdb_cursor_partition;
     } else if (dbtype == NIO_BTREE) {
         nio->db = bdb_initialize(nio);
 
@@ -500,9 +2674,15 @@ struct nio_t* nio_initialize(int dbtype)
         nio->find_func = (FIND_FUNCPTR)bdb_find;
         nio->get_func = (GET_FUNCPTR)bdb_get;
         nio->aget_func = (AGET_FUNCPTR)bdb_aget;
+        nio->get_view_func = (GET_VIEW_FUNCPTR)bdb_get_view;
         nio->put_func = (PUT_FUNCPTR)bdb_put;
         nio->delete_func = (DELETE_FUNCPTR)bdb_delete;
+        nio->compact_func = (COMPACT_FUNCPTR)bdb_compact;
         nio->free_func = (FREE_FUNCPTR)bdb_free;
+        nio->mget_func = (BATCH_FUNCPTR)bdb_mget;
+        nio->mput_func = (BATCH_FUNCPTR)bdb_mput;
+        nio->mdelete_func = (BATCH_FUNCPTR)bdb_mdelete;
+        nio->sync_func = (SYNC_FUNCPTR)bdb_sync;
 
         nio->cursor_open_func = (CURSOR_OPEN_FUNCPTR)bdb_cursor_open;
         nio->cursor_close_func = (CURSOR_CLOSE_FUNCPTR)bdb_cursor_close;
@@ -517,8 +2697,10 @@ struct nio_t* nio_initialize(int dbtype)
         nio->cursor_value_func = (CURSOR_VALUE_FUNCPTR)bdb_cursor_value;
         nio->cursor_update_func = (CURSOR_UPDATE_FUNCPTR)bdb_cursor_update;
         nio->cursor_delete_func = (CURSOR_DELETE_FUNCPTR)bdb_cursor_delete;
+        nio->cursor_partition_func = (CURSOR_PARTITION_FUNCPTR)bdb_cursor_partition;
     } else {
         err_write("nio_initialize: dbtype error=%d.", dbtype);
+        CS_DELETE(&nio->free_critical_section);
         free(nio->free_page);
         free(nio);
         return NULL;
@@ -526,6 +2708,7 @@ struct nio_t* nio_initialize(int dbtype)
 
     if (nio->db == NULL) {
         err_write("nio_initialize: error.");
+        CS_DELETE(&nio->free_critical_section);
         free(nio->free_page);
         free(nio);
         return NULL;
@@ -549,6 +2732,8 @@ void nio_finalize(struct nio_t* nio)
     (*nio->finalize_func)(nio->db);
     if (nio->free_page)
         free(nio->free_page);
+    free_index_close(nio);
+    CS_DELETE(&nio->free_critical_section);
     free(nio);
 }
 
@@ -616,6 +2801,10 @@ void nio_hashfunc(struct nio_t* nio, HASH_FUNCPTR func)
  *     NIO_MAP_VIEWSIZE      マップサイズ
  *     NIO_ALIGN_BYTES       キーデータ境界サイズ
  *     NIO_FILLING_RATE      データ充填率
+ *     NIO_LOCK_STRIPES      ロックストライプ数
+ *     NIO_LINEAR_HASH       リニアハッシュの負荷率(バケット当たりのキー数)
+ *     NIO_REAP_INTERVAL     期限切れのキーを回収する間隔(ミリ秒)、ゼロは回収しない
+ *     NIO_REAP_BUCKETS      一回の回収で調べるバケット数
  *   [B+Tree]
  *     NIO_PAGESIZE          ノードページサイズ
  *     NIO_MAP_VIEWSIZE      マップサイズ
@@ -624,6 +2813,46 @@ void nio_hashfunc(struct nio_t* nio, HASH_FUNCPTR func)
  *     NIO_DUPLICATE_KEY     キー重複を許可(1 or 0)
  *     NIO_DATAPACK          データパック(1 or 0)
  *     NIO_PREFIX_COMPRESS   プレフィックス圧縮(1 or 0)
+ *     NIO_LEAF_CACHE        キャッシュするリーフ数
+ *     NIO_CONCURRENT_READ   参照と分割しない更新をリーフ単位で並行に処理(1 or 0)
+ *     NIO_ORDER_STAT        ブランチノードに部分木のキー数を持つ(1 or 0)
+ *     NIO_KEY_COMPARE       組み込みのキー比較(NIO_CMP_*)
+ *   [共通]
+ *     NIO_WAL               先行書き込みログ(1 or 0)
+ *     NIO_WAL_COMMIT_WAIT   グループコミットの待ち時間(マイクロ秒)
+ *     NIO_WAL_SYNC_INTERVAL ログの同期間隔(ミリ秒)、ゼロはコミット毎に同期
+ *     NIO_COMPRESS          値の圧縮方式(NIO_COMP_*)
+ *     NIO_COMPRESS_THRESHOLD 圧縮する値の最小サイズ(バイト)
+ *     NIO_MMAP_ADVICE       ファイルのアクセスパターン(MMAP_ADVISE_*)
+ *     NIO_MMAP_LOCK         頻繁に参照する管理領域をメモリに固定(1 or 0)
+ *     NIO_IO_BACKEND        ファイルの読み書き方式(MMAP_IO_*)
+ *     NIO_IO_POOL_SIZE      MMAP_IO_FILE のバッファプールサイズ(MB)
+ *
+ * 圧縮した値はレコード毎に圧縮方式を記録するため、圧縮方式を変更しても
+ * 既存の値はそのまま読み込めます。
+ * B+木のデータパックではリーフに格納される値は圧縮されません。
+ *
+ * ハッシュでは NIO_MMAP_LOCK でバケット配列を固定し、
+ * B+木ではルートから上位のブランチノードを固定します。
+ * 固定できるサイズはシステムの制限(RLIMIT_MEMLOCK)を受けます。
+ *
+ * NIO_IO_BACKEND に MMAP_IO_FILE を指定するとファイルをマップせずに
+ * バッファプールを介して pread/pwrite (Linux では io_uring) で読み書きします。
+ * 変更されたページはバックグラウンドで書き出されます。
+ * この場合 NIO_MMAP_ADVICE と NIO_MMAP_LOCK は無視されます。
+ * NIO_IO_BACKEND を指定しない場合は NIO_WAL の指定によって方式が決まります。
+ * NIO_WAL を指定するとバッファプールを使用し、ページはログを同期してから
+ * 書き出されます。NIO_WAL と MMAP_IO_MAP を明示的に指定した場合は
+ * ファイルをマップしたまま参照のビュー、NIO_MMAP_ADVICE、NIO_MMAP_LOCK、
+ * 領域の予約による拡張が使用できますが、ページの書き出しは OS が行うため
+ * ログより先に書き出されることがあります。この場合プロセスの異常終了からは
+ * 回復できますが、OS の異常終了や電源断からの回復は保証されません。
+ * ハッシュDBの更新はバケットのロック単位でコミットされるため、
+ * 異なるロックストライプの更新は並行して実行されます。
+ * B+木DBの更新関数は開始からコミットまで直列に実行されます。
+ *
+ * WAL と回収と並行参照とマップのプロパティはデータベースを
+ * オープンする前に設定します。
  *
  * nio: データベースオブジェクトのポインタ
  * kind: プロパティ種類
@@ -636,6 +2865,65 @@ int nio_property(struct nio_t* nio, int kind, int value)
 {
     if (nio == NULL)
         return -1;
+
+    if (kind == NIO_WAL) {
+        nio->wal_flag = (value)? 1 : 0;
+        return 0;
+    } else if (kind == NIO_WAL_COMMIT_WAIT) {
+        if (value < 0)
+            return -1;
+        nio->wal_commit_wait = value;
+        return 0;
+    } else if (kind == NIO_WAL_SYNC_INTERVAL) {
+        if (value < 0)
+            return -1;
+        nio->wal_sync_interval = value;
+        return 0;
+    } else if (kind == NIO_REAP_INTERVAL) {
+        if (value < 0 || nio->dbtype != NIO_HASH)
+            return -1;
+        nio->reap_interval = value;
+        return 0;
+    } else if (kind == NIO_REAP_BUCKETS) {
+        if (value < 1 || nio->dbtype != NIO_HASH)
+            return -1;
+        nio->reap_buckets = value;
+        return 0;
+    } else if (kind == NIO_COMPRESS) {
+        if (value < NIO_COMP_NONE || value > NIO_COMP_MAX)
+            return -1;
+#ifndef HAVE_ZLIB
+        if (value == NIO_COMP_ZLIB) {
+            err_write("nio_property: unsupported zlib library.");
+            return -1;
+        }
+#endif
+        nio->comp_codec = value;
+        return 0;
+    } else if (kind == NIO_COMPRESS_THRESHOLD) {
+        if (value < 0)
+            return -1;
+        nio->comp_threshold = value;
+        return 0;
+    } else if (kind == NIO_MMAP_ADVICE) {
+        if (value < MMAP_ADVISE_NORMAL || value > MMAP_ADVISE_HUGEPAGE)
+            return -1;
+        nio->mmap_advice = value;
+        return 0;
+    } else if (kind == NIO_MMAP_LOCK) {
+        nio->mmap_lock_flag = (value)? 1 : 0;
+        return 0;
+    } else if (kind == NIO_IO_BACKEND) {
+        if (value != MMAP_IO_MAP && value != MMAP_IO_FILE)
+            return -1;
+        nio->io_backend = value;
+        return 0;
+    } else if (kind == NIO_IO_POOL_SIZE) {
+        if (value < 0)
+            return -1;
+        nio->io_pool_size = value;
+        return 0;
+    }
     return (*nio->property_func)(nio->db, kind, value);
 }
 
@@ -651,9 +2939,24 @@ int nio_property(struct nio_t* nio, int kind, int value)
  */
 int nio_open(struct nio_t* nio, const char* fname)
 {
+    int result;
+
     if (nio == NULL)
         return -1;
-    return (*nio->open_func)(nio->db, fname);
+    if (nio->wal_flag) {
+        if (wal_open(nio, fname, 0) < 0)
+            return -1;
+    }
+    result = (*nio->open_func)(nio->db, fname);
+    if (result == 0) {
+        if (nio->mmap_advice != MMAP_ADVISE_NORMAL)
+            mmap_advise(nio->mmap, 0, 0, nio->mmap_advice);
+        wal_start(nio);
+        reap_start(nio);
+    } else {
+        wal_close(nio);
+    }
+    return result;
 }
 
 /*
@@ -673,9 +2976,24 @@ int nio_create(struct nio_t* nio, const char* fname)
 
     if (nio == NULL)
         return -1;
+    if (nio->wal_flag) {
+        if (wal_open(nio, fname, 1) < 0)
+            return -1;
+    }
     result = (*nio->create_func)(nio->db, fname);
-    if (result == 0)
+    if (result == 0) {
         nio->free_ptr = 0;    // 2012.8.21
+        if (nio->mmap_advice != MMAP_ADVISE_NORMAL)
+            mmap_advise(nio->mmap, 0, 0, nio->mmap_advice);
+        if (nio->wal) {
+            /* 作成したファイルを同期してからログを開始します。*/
+            wal_checkpoint(nio);
+            wal_start(nio);
+        }
+        reap_start(nio);
+    } else {
+        wal_close(nio);
+    }
     return result;
 }
 
@@ -690,8 +3008,13 @@ int nio_create(struct nio_t* nio, const char* fname)
  */
 void nio_close(struct nio_t* nio)
 {
-    if (nio)
+    if (nio) {
+        reap_stop(nio);
+        compact_close(nio);
         (*nio->close_func)(nio->db);
+        free_index_close(nio);
+        wal_close(nio);
+    }
 }
 
 /*
@@ -824,6 +3147,49 @@ void* nio_agets(struct nio_t* nio, const void* key, int keysize, int* valsize, i
     return (*nio->agets_func)(nio->db, key, keysize, valsize, cas);
 }
 
+/*
+ * データベースからキーを検索して値をコピーせずに参照するビューを設定します。
+ * 値がメモリマップ上にある場合はマップ上の領域が固定されて
+ * そのポインタが設定されます。メモリマップ外の場合は関数内で
+ * 確保された領域に値がコピーされます。
+ * ビューは使用後に nio_release_view() で解放する必要があります。
+ *
+ * 固定された領域はマップが再作成されても解放されるまで有効ですが、
+ * 同じキーが他のスレッドで更新または削除された場合の内容は保証されません。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * key: キーのポインタ
+ * keysize: キーのサイズ
+ * view: ビュー構造体のポインタ
+ *
+ * キー値を取得できた場合は値のサイズを返します。
+ * キーが存在しない場合は -1 を返します。
+ * その他のエラーの場合は -2 を返します。
+ */
+int nio_get_view(struct nio_t* nio, const void* key, int keysize, struct nio_view_t* view)
+{
+    if (nio == NULL)
+        return -2;
+    return (*nio->get_view_func)(nio->db, key, keysize, view);
+}
+
+/*
+ * nio_get_view() で取得したビューを解放します。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * view: ビュー構造体のポインタ
+ */
+void nio_release_view(struct nio_t* nio, struct nio_view_t* view)
+{
+    if (nio == NULL || view->val == NULL)
+        return;
+    if (view->pinned)
+        mmap_unpin(nio->mmap);
+    else
+        (*nio->free_func)(view->val);
+    view->val = NULL;
+}
+
 /*
  * データベースにキーと値を設定します。
  *
@@ -841,9 +3207,14 @@ void* nio_agets(struct nio_t* nio, const void* key, int keysize, int* valsize, i
  */
 int nio_put(struct nio_t* nio, const void* key, int keysize, const void* val, int valsize)
 {
+    int result;
+
     if (nio == NULL)
         return -1;
-    return (*nio->put_func)(nio->db, key, keysize, val, valsize);
+    wal_begin(nio);
+    result = (*nio->put_func)(nio->db, key, keysize, val, valsize);
+    wal_commit(nio);
+    return result;
 }
 
 /*
@@ -866,11 +3237,50 @@ int nio_put(struct nio_t* nio, const void* key, int keysize, const void* val, in
  */
 int nio_puts(struct nio_t* nio, const void* key, int keysize, const void* val, int valsize, int64 cas)
 {
+    int result;
+
+    if (nio == NULL)
+        return -1;
+    if (nio->dbtype != NIO_HASH)
+        return -1;
+    wal_begin(nio);
+    result = (*nio->puts_func)(nio->db, key, keysize, val, valsize, cas);
+    wal_commit(nio);
+    return result;
+}
+
+/*
+ * データベースに有効期間を指定してキーと値を設定します。
+ * キーがすでに存在している場合は置換されます。
+ * ハッシュDBの場合のみ有効です。
+ *
+ * 有効期間を過ぎたキーは取得できなくなります。
+ * 期限切れの領域は nio_reap() で回収されます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * key: キーのポインタ
+ * keysize: キーのサイズ
+ * val: 値のポインタ
+ * valsize: 値のサイズ
+ * cas: 楽観的排他制御のための値(ゼロはチェックしない)
+ * ttl: 有効期間(秒)、ゼロ以下は無期限
+ *
+ * 成功した場合はゼロを返します。
+ * エラーの場合は -1 を返します。
+ * 他のユーザーがすでに更新していた場合は -2 を返します。
+ */
+int nio_put_ttl(struct nio_t* nio, const void* key, int keysize, const void* val, int valsize, int64 cas, int ttl)
+{
+    int result;
+
     if (nio == NULL)
         return -1;
     if (nio->dbtype != NIO_HASH)
         return -1;
-    return (*nio->puts_func)(nio->db, key, keysize, val, valsize, cas);
+    wal_begin(nio);
+    result = (*nio->put_ttl_func)(nio->db, key, keysize, val, valsize, cas, ttl);
+    wal_commit(nio);
+    return result;
 }
 
 /*
@@ -893,11 +3303,16 @@ int nio_puts(struct nio_t* nio, const void* key, int keysize, const void* val, i
  */
 int nio_bset(struct nio_t* nio, const void* key, int keysize, const void* val, int valsize, int64 cas)
 {
+    int result;
+
     if (nio == NULL)
         return -1;
     if (nio->dbtype != NIO_HASH)
         return -1;
-    return (*nio->bset_func)(nio->db, key, keysize, val, valsize, cas);
+    wal_begin(nio);
+    result = (*nio->bset_func)(nio->db, key, keysize, val, valsize, cas);
+    wal_commit(nio);
+    return result;
 }
 
 /*
@@ -914,12 +3329,273 @@ int nio_bset(struct nio_t* nio, const void* key, int keysize, const void* val, i
  * エラーの場合は -1 を返します。
  */
 int nio_delete(struct nio_t* nio, const void* key, int keysize)
+{
+    int result;
+
+    if (nio == NULL)
+        return -1;
+    wal_begin(nio);
+    result = (*nio->delete_func)(nio->db, key, keysize);
+    wal_commit(nio);
+    return result;
+}
+
+/*
+ * データベースから複数のキーを検索して値を設定します。
+ * キーはバケット順(ハッシュ)またはキー順(B+tree)に並べられて
+ * まとめてロックを取得して処理されます。
+ *
+ * 各要素の key と keysize にキーを、val と valsize に値の領域と
+ * そのサイズを設定しておきます。
+ * 各要素の result には nio_get() と同じ値が設定されます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * items: バッチ要素の配列
+ * count: 要素数
+ *
+ * 値を取得できたキーの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int nio_mget(struct nio_t* nio, struct nio_batch_t* items, int count)
+{
+    if (nio == NULL)
+        return -1;
+    return (*nio->mget_func)(nio->db, items, count);
+}
+
+/*
+ * データベースに複数のキーと値を設定します。
+ *
+ * 各要素の key と keysize にキーを、val と valsize に値を設定しておきます。
+ * 各要素の result には nio_put() と同じ値が設定されます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * items: バッチ要素の配列
+ * count: 要素数
+ *
+ * 設定できたキーの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int nio_mput(struct nio_t* nio, struct nio_batch_t* items, int count)
+{
+    int result;
+
+    if (nio == NULL)
+        return -1;
+    wal_begin(nio);
+    result = (*nio->mput_func)(nio->db, items, count);
+    wal_commit(nio);
+    return result;
+}
+
+/*
+ * データベースから複数のキーを削除します。
+ *
+ * 各要素の key と keysize にキーを設定しておきます。
+ * 各要素の result には nio_delete() と同じ値が設定されます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * items: バッチ要素の配列
+ * count: 要素数
+ *
+ * 削除できたキーの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int nio_mdelete(struct nio_t* nio, struct nio_batch_t* items, int count)
+{
+    int result;
+
+    if (nio == NULL)
+        return -1;
+    wal_begin(nio);
+    result = (*nio->mdelete_func)(nio->db, items, count);
+    wal_commit(nio);
+    return result;
+}
+
+/*
+ * キー順に並んだキーと値から空のデータベースを一括で作成します。
+ * B+木DBの場合のみ有効です。
+ *
+ * func は item の key, keysize, val, valsize を設定して 1 を、
+ * 終わりの場合はゼロを、エラーの場合は -1 を返します。
+ * キーは昇順に並んでいる必要があります。
+ * 大量のデータを作成する場合は WAL を無効にして作成した方が効率的です。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * func: キーと値を取得する関数のポインタ
+ * arg: 関数に渡される引数
+ *
+ * 格納したキーと値の数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int nio_bulk_load(struct nio_t* nio, BULK_READ_FUNCPTR func, void* arg)
+{
+    int result;
+
+    if (nio == NULL)
+        return -1;
+    if (nio->dbtype != NIO_BTREE)
+        return -1;
+    wal_begin(nio);
+    result = bdb_bulk_load((struct bdb_t*)nio->db, func, arg);
+    wal_commit(nio);
+    return result;
+}
+
+/*
+ * キーの範囲 [start, end) のキーと値をキー順にまとめて関数に渡します。
+ * B+木DBの場合のみ有効です。
+ *
+ * start が NULL の場合は先頭から、end が NULL の場合は最後までになります。
+ * flags には BDB_SCAN_END_INCLUDE(end を含む)と
+ * BDB_SCAN_KEYONLY(値を読み込まない)を指定できます。
+ * func は items の各要素の key, keysize, val, valsize を参照して、
+ * 続ける場合はゼロを返します。items の領域は func から戻るまで有効です。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * start: 範囲の先頭のキー
+ * startsize: 範囲の先頭のキーサイズ
+ * end: 範囲の終わりのキー
+ * endsize: 範囲の終わりのキーサイズ
+ * flags: フラグ
+ * func: レコードを受け取る関数のポインタ
+ * arg: 関数に渡される引数
+ *
+ * 関数に渡したレコードの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int nio_scan(struct nio_t* nio,
+             const void* start,
+             int startsize,
+             const void* end,
+             int endsize,
+             int flags,
+             SCAN_FUNCPTR func,
+             void* arg)
+{
+    if (nio == NULL)
+        return -1;
+    if (nio->dbtype != NIO_BTREE)
+        return -1;
+    return bdb_scan((struct bdb_t*)nio->db, start, startsize, end, endsize, flags, func, arg);
+}
+
+/*
+ * キーの範囲 [start, end) にあるキーの数を返します。
+ * B+木DBを NIO_ORDER_STAT を指定して作成した場合のみ有効です。
+ * NIO_DUPLICATE_KEY の場合もキーの数を返します(値の数ではありません)。
+ *
+ * start が NULL の場合は先頭から、end が NULL の場合は最後までになります。
+ * flags には BDB_SCAN_END_INCLUDE(end を含む)を指定できます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * start: 範囲の先頭のキー
+ * startsize: 範囲の先頭のキーサイズ
+ * end: 範囲の終わりのキー
+ * endsize: 範囲の終わりのキーサイズ
+ * flags: フラグ
+ *
+ * キーの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int64 nio_count_range(struct nio_t* nio,
+                      const void* start,
+                      int startsize,
+                      const void* end,
+                      int endsize,
+                      int flags)
+{
+    if (nio == NULL)
+        return -1;
+    if (nio->dbtype != NIO_BTREE)
+        return -1;
+    return bdb_count_range((struct bdb_t*)nio->db, start, startsize, end, endsize, flags);
+}
+
+/*
+ * 期限切れのキーの領域を回収します。
+ * 前回の続きから nbuckets 個のバケットを調べます。
+ * ハッシュDBの場合のみ有効です。
+ *
+ * NIO_REAP_INTERVAL プロパティを設定した場合はバックグラウンドの
+ * スレッドで定期的に呼び出されます。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * nbuckets: 調べるバケット数
+ *
+ * 回収したキーの数を返します。
+ * エラーの場合は -1 を返します。
+ */
+int nio_reap(struct nio_t* nio, int nbuckets)
 {
     if (nio == NULL)
         return -1;
-    return (*nio->delete_func)(nio->db, key, keysize);
+    if (nio->dbtype != NIO_HASH)
+        return -1;
+    return reap_batch(nio, nbuckets);
 }
 
+/*
+ * データベースファイルを圧縮します。
+ * 有効なデータをファイルの先頭に近い空き領域に移動して、
+ * ファイルの最後の空き領域を切り詰めます。
+ *
+ * 一回の呼び出しでは nitems 個の単位(ハッシュDBはバケット、
+ * B+木DBはリーフ)だけ処理されます。他のスレッドの更新と並行して
+ * 実行できるため、戻り値が 1 の間は繰り返し呼び出します。
+ * すべてのデータを処理すると圧縮が終了して reclaimed に
+ * 削減されたファイルサイズ(バイト)が設定されます。
+ * 圧縮中の追加でファイルが開始時より大きくなった場合はゼロになります。
+ * 途中でクローズした場合はその時点で圧縮が終了します。
+ *
+ * B+木DBは削除で充填率の低くなったリーフを次のリーフと連結します。
+ * カーソルがオープンされている間は何も処理されません。
+ * また、ブランチノードは移動されません。
+ * ハッシュDBのカーソルは削除と同様に移動したキーを読み飛ばす場合があります。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * nitems: 処理する単位数
+ * reclaimed: 削減されたバイト数が設定されるポインタ(NULL可)
+ *
+ * 戻り値
+ *  圧縮中の場合は 1 を返します。
+ *  圧縮が終了した場合はゼロを返します。
+ *  エラーの場合は -1 を返します。
+ */
+int nio_compact(struct nio_t* nio, int nitems, int64* reclaimed)
+{
+    int result = 0;
+    struct nio_wal_tx_t* tx;
+
+    if (nio == NULL)
+        return -1;
+    if (reclaimed)
+        *reclaimed = 0;
+
+    wal_begin(nio);
+    tx = free_lock(nio);
+    if (nio->compact == NULL)
+        result = compact_begin(nio);
+    else
+        result = compact_move_pages(nio);
+    free_unlock(nio, tx);
+
+    if (result == 0) {
+        result = (*nio->compact_func)(nio->db, nitems);
+        if (result == 0) {
+            tx = free_lock(nio);
+            if (nio->compact)
+                result = compact_end(nio, reclaimed);
+            free_unlock(nio, tx);
+            /* ファイルサイズの変更を書き出します。*/
+            if (nio->sync_func)
+                (*nio->sync_func)(nio->db);
+        }
+    }
+    wal_commit(nio);
+    return result;
+}
 
 /*
  * 関数内で確保したメモリ領域を開放します。
@@ -961,6 +3637,101 @@ struct nio_cursor_t* nio_cursor_open(struct nio_t* nio)
     return cur;
 }
 
+/*
+ * オープンされているデータベースファイルの現時点の内容を参照する
+ * スナップショットのカーソルを作成します。
+ * カーソルをクローズするまで他のスレッドの更新は参照されません。
+ * キー位置は先頭に位置づけられます。
+ * カーソルは参照専用です。B+木データベースの場合のみ有効です。
+ *
+ * nio: データベースオブジェクトのポインタ
+ *
+ * 成功した場合はカーソル構造体のポインタを返します。
+ * エラーの場合は NULL を返します。
+ */
+struct nio_cursor_t* nio_cursor_snapshot(struct nio_t* nio)
+{
+    struct nio_cursor_t* cur;
+
+    if (nio == NULL)
+        return NULL;
+    if (nio->dbtype != NIO_BTREE)
+        return NULL;
+
+    cur = malloc(sizeof(struct nio_cursor_t));
+    if (cur == NULL) {
+        err_write("nio_cursor_snapshot: no memory.");
+        return NULL;
+    }
+    cur->dbtype = nio->dbtype;
+    cur->nio = nio;
+    /* ヘッダーのスナップショットのフラグはログに記録します。*/
+    wal_begin(nio);
+    cur->cursor = bdb_cursor_snapshot((struct bdb_t*)nio->db);
+    wal_commit(nio);
+    if (cur->cursor == NULL) {
+        free(cur);
+        return NULL;
+    }
+    return cur;
+}
+
+/*
+ * データベースを n 個の重ならない範囲に分割してカーソルを作成します。
+ * 作成されたカーソルは curs に設定されます。
+ *
+ * ハッシュデータベースはバケットの範囲、B+木データベースは
+ * ブランチノードのキーから求めたキーの範囲で分割されます。
+ * 各カーソルは担当する範囲だけを nio_cursor_next() で返すため、
+ * 複数のスレッドで全体を分担して読み込むことができます。
+ * 各カーソルは nio_cursor_close() でクローズします。
+ *
+ * nio: データベースオブジェクトのポインタ
+ * n: 分割数
+ * curs: カーソルのポインタが設定される配列(n 個以上)
+ *
+ * 作成したカーソルの数(n 以下)を返します。
+ * エラーの場合は -1 を返します。
+ */
+int nio_cursor_partition(struct nio_t* nio, int n, struct nio_cursor_t** curs)
+{
+    void** dbcurs;
+    int count;
+    int i;
+
+    if (nio == NULL || n < 1)
+        return -1;
+
+    dbcurs = (void**)malloc(n * sizeof(void*));
+    if (dbcurs == NULL) {
+        err_write("nio_cursor_partition: no memory.");
+        return -1;
+    }
+    count = (*nio->cursor_partition_func)(nio->db, n, dbcurs);
+    if (count < 0) {
+        free(dbcurs);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        curs[i] = malloc(sizeof(struct nio_cursor_t));
+        if (curs[i] == NULL) {
+            err_write("nio_cursor_partition: no memory.");
+            while (i-- > 0)
+                free(curs[i]);
+            for (i = 0; i < count; i++)
+                (*nio->cursor_close_func)(dbcurs[i]);
+            free(dbcurs);
+            return -1;
+        }
+        curs[i]->dbtype = nio->dbtype;
+        curs[i]->nio = nio;
+        curs[i]->cursor = dbcurs[i];
+    }
+    free(dbcurs);
+    return count;
+}
+
 /*
  * カーソルをクローズします。
  * カーソル領域は解放されます。
@@ -974,7 +3745,14 @@ void nio_cursor_close(struct nio_cursor_t * cur)
     if (cur == NULL)
         return;
 
-    (*cur->nio->cursor_close_func)(cur->cursor);
+    if (cur->dbtype == NIO_BTREE && ((struct dbcursor_t*)cur->cursor)->snap != NULL) {
+        /* スナップショットの複写領域の解放はログに記録します。*/
+        wal_begin(cur->nio);
+        (*cur->nio->cursor_close_func)(cur->cursor);
+        wal_commit(cur->nio);
+    } else {
+        (*cur->nio->cursor_close_func)(cur->cursor);
+    }
     free(cur);
 }
 
@@ -1123,6 +3901,27 @@ int nio_cursor_seek(struct nio_cursor_t* cur, int pos)
     return (*cur->nio->cursor_seek_func)(cur->cursor, pos);
 }
 
+/*
+ * カーソルの現在位置を rank 番目(ゼロ起点)のキーに移動します。
+ * B+木DBを NIO_ORDER_STAT を指定して作成した場合のみ有効です。
+ * 順位はキー単位で、重複キーの場合は最初の値に位置づけられます。
+ *
+ * cur: カーソル構造体のポインタ
+ * rank: キーの順位
+ *
+ * 正常に処理された場合はゼロを返します。
+ * rank が範囲外かエラーの場合は -1 を返します。
+ */
+int nio_cursor_seek_rank(struct nio_cursor_t* cur, int64 rank)
+{
+    if (cur == NULL)
+        return -1;
+    if (cur->dbtype != NIO_BTREE)
+        return -1;
+
+    return bdb_cursor_seek_rank((struct dbcursor_t*)cur->cursor, rank);
+}
+
 /*
  * カーソルの現在位置からキーを取得します。
  * keysizeにはキーが設定される領域の大きさを指定します。
@@ -1174,12 +3973,17 @@ int nio_cursor_value(struct nio_cursor_t* cur, void* val, int valsize)
  */
 int nio_cursor_update(struct nio_cursor_t* cur, const void* val, int valsize)
 {
+    int result;
+
     if (cur == NULL)
         return -1;
     if (cur->dbtype != NIO_BTREE)
         return -1;
 
-    return (*cur->nio->cursor_update_func)(cur->cursor, val, valsize);
+    wal_begin(cur->nio);
+    result = (*cur->nio->cursor_update_func)(cur->cursor, val, valsize);
+    wal_commit(cur->nio);
+    return result;
 }
 
 /*
@@ -1195,10 +3999,15 @@ int nio_cursor_update(struct nio_cursor_t* cur, const void* val, int valsize)
  */
 int nio_cursor_delete(struct nio_cursor_t* cur)
 {
+    int result;
+
     if (cur == NULL)
         return -1;
     if (cur->dbtype != NIO_BTREE)
         return -1;
 
-    return (*cur->nio->cursor_delete_func)(cur->cursor);
+    wal_begin(cur->nio);
+    result = (*cur->nio->cursor_delete_func)(cur->cursor);
+    wal_commit(cur->nio);
+    return result;
 }
@@ -293,3 +293,170 @@ APIEXPORT void gz_free(const char* ptr)
     if (ptr != NULL)
         free((void*)ptr);
 }
+
+/*
+ * LZ 圧縮の辞書はハッシュ表で管理します。
+ * 一致の長さは 3 から LZ_MAX_REF バイト、距離は LZ_MAX_OFF バイトまでです。
+ *
+ * 圧縮データは制御バイトから始まる次の形式の並びです。
+ *   000LLLLL                 リテラル(L+1 バイトのデータが続く)
+ *   LLLooooo oooooooo        後方参照(長さ L+2、距離 o+1)
+ *   111ooooo LLLLLLLL oooooooo 後方参照(長さ L+9、距離 o+1)
+ */
+#define LZ_HASH_BITS    12
+#define LZ_MAX_LIT      32
+#define LZ_MAX_OFF      8192
+#define LZ_MAX_REF      264
+
+#define LZ_HASH(p) ((((unsigned int)(p)[0] << 16 | (unsigned int)(p)[1] << 8 | (p)[2]) * 2654435761U) >> (32 - LZ_HASH_BITS))
+
+/*
+ * データを LZ 形式で圧縮します。
+ * zlib より圧縮率は低くなりますが高速に圧縮と展開を行ないます。
+ * zlib が利用できない環境でも使用できます。
+ *
+ * src_buf: 圧縮するバッファ
+ * src_size: 圧縮するバッファのサイズ
+ * comp_buf: 圧縮したデータを設定するバッファ
+ * comp_bufsize: 圧縮したデータを設定するバッファのサイズ
+ *
+ * 戻り値
+ *   圧縮されたサイズを返します。
+ *   圧縮したデータがバッファに収まらない場合はゼロを返します。
+ */
+APIEXPORT int lz_comp(const char* src_buf,
+                      int src_size,
+                      char* comp_buf,
+                      int comp_bufsize)
+{
+    const unsigned char* src = (const unsigned char*)src_buf;
+    unsigned char* op = (unsigned char*)comp_buf;
+    unsigned char* oend = op + comp_bufsize;
+    int htab[1 << LZ_HASH_BITS];
+    int ip = 0;
+    int lit = 0;
+
+    if (src_size <= 0 || comp_bufsize <= 0)
+        return 0;
+    memset(htab, 0xff, sizeof(htab));
+
+    /* リテラルの制御バイトを確保しておきます。*/
+    op++;
+    while (ip < src_size) {
+        if (ip + 2 < src_size) {
+            unsigned int h;
+            int ref;
+
+            h = LZ_HASH(&src[ip]);
+            ref = htab[h];
+            htab[h] = ip;
+            if (ref >= 0 && ip - ref <= LZ_MAX_OFF &&
+                src[ref] == src[ip] && src[ref+1] == src[ip+1] && src[ref+2] == src[ip+2]) {
+                int off, len, maxlen;
+
+                off = ip - ref - 1;
+                maxlen = src_size - ip;
+                if (maxlen > LZ_MAX_REF)
+                    maxlen = LZ_MAX_REF;
+                len = 3;
+                while (len < maxlen && src[ref+len] == src[ip+len])
+                    len++;
+
+                /* 直前のリテラルを確定します。*/
+                if (lit > 0)
+                    op[-lit-1] = (unsigned char)(lit - 1);
+                else
+                    op--;
+                if (op + 4 > oend)
+                    return 0;
+                len -= 2;
+                if (len < 7) {
+                    *op++ = (unsigned char)((len << 5) | (off >> 8));
+                } else {
+                    *op++ = (unsigned char)((7 << 5) | (off >> 8));
+                    *op++ = (unsigned char)(len - 7);
+                }
+                *op++ = (unsigned char)(off & 0xff);
+                ip += len + 2;
+                lit = 0;
+                op++;
+                continue;
+            }
+        }
+
+        /* リテラルとして出力します。*/
+        if (op >= oend)
+            return 0;
+        *op++ = src[ip++];
+        if (++lit == LZ_MAX_LIT) {
+            op[-lit-1] = (unsigned char)(lit - 1);
+            lit = 0;
+            if (op >= oend)
+                return 0;
+            op++;
+        }
+    }
+    if (lit > 0)
+        op[-lit-1] = (unsigned char)(lit - 1);
+    else
+        op--;
+    return (int)(op - (unsigned char*)comp_buf);
+}
+
+/*
+ * LZ 形式で圧縮されたバッファを展開します。
+ *
+ * comp_buf: 圧縮されたバッファ
+ * comp_size: 圧縮されたバッファのサイズ
+ * buf: 展開したデータを設定するバッファ
+ * bufsize: 展開したデータを設定するバッファのサイズ
+ *
+ * 戻り値
+ *   展開されたサイズを返します。
+ *   圧縮データが不正な場合やバッファに収まらない場合は -1 を返します。
+ */
+APIEXPORT int lz_decomp(const char* comp_buf,
+                        int comp_size,
+                        char* buf,
+                        int bufsize)
+{
+    const unsigned char* ip = (const unsigned char*)comp_buf;
+    const unsigned char* iend = ip + comp_size;
+    unsigned char* op = (unsigned char*)buf;
+    unsigned char* oend = op + bufsize;
+
+    while (ip < iend) {
+        unsigned int ctrl;
+
+        ctrl = *ip++;
+        if (ctrl < LZ_MAX_LIT) {
+            int n = ctrl + 1;
+
+            if (ip + n > iend || op + n > oend)
+                return -1;
+            memcpy(op, ip, n);
+            ip += n;
+            op += n;
+        } else {
+            const unsigned char* ref;
+            int len;
+
+            len = ctrl >> 5;
+            if (len == 7) {
+                if (ip >= iend)
+                    return -1;
+                len += *ip++;
+            }
+            if (ip >= iend)
+                return -1;
+            ref = op - ((ctrl & 0x1f) << 8) - *ip++ - 1;
+            len += 2;
+            if (ref < (unsigned char*)buf || op + len > oend)
+                return -1;
+            /* 参照元と重なる場合があるので 1 バイトずつ複写します。*/
+            while (len-- > 0)
+                *op++ = *ref++;
+        }
+    }
+    return (int)(op - (unsigned char*)buf);
+}
@@ -0,0 +1,203 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* リーフのキーと値を格納するアリーナを確認します。
+   長さの異なるキーの挿入、値のサイズが増減する更新、削除を
+   ばらばらに繰り返し、アリーナの再確保と再利用の後も
+   内容が正しいことを確認します。小さいリーフキャッシュで
+   大きさの異なるリーフを読み込み直す場合も確認します。
+   ページの 1/4 程度の長いキーでノードの分割と再配分も確認します。*/
+
+#define NUM_KEYS        3000
+#define NUM_OPS         60000
+#define MAX_KEYLEN      500
+#define LONG_KEYLEN     1000
+
+struct tkey_t {
+    int gen;        /* 値の世代、格納されていない場合は -1 */
+};
+
+static struct tkey_t model[NUM_KEYS];
+static int max_keylen;
+
+static uint rand_next(uint* seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7fff;
+}
+
+/* i 番目のキーを設定してサイズを返します。長さは 8 から max_keylen バイトです。*/
+static int make_key(char* key, int i)
+{
+    int size, j;
+
+    size = 8 + (i * 97) % (max_keylen - 8);
+    sprintf(key, "%08d", i);
+    for (j = 8; j < size; j++)
+        key[j] = (char)('a' + (i + j) % 26);
+    return size;
+}
+
+/* 世代 gen の値を設定してサイズを返します。サイズは 0 から 200 バイトです。*/
+static int make_val(char* val, int i, int gen)
+{
+    int size, j;
+
+    size = (i * 31 + gen * 57) % 201;
+    for (j = 0; j < size; j++)
+        val[j] = (char)('A' + (i + j + gen) % 26);
+    return size;
+}
+
+static void check_all(struct nio_t* nio)
+{
+    struct nio_cursor_t* cur;
+    char key[NIO_MAX_KEYSIZE], val[2048], buf[2048];
+    int i, n = 0, prev = -1;
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize = make_key(key, i);
+        int vsize = nio_get(nio, key, ksize, buf, sizeof(buf));
+
+        if (model[i].gen < 0) {
+            TEST_CHECK(vsize < 0);
+        } else {
+            int esize = make_val(val, i, model[i].gen);
+
+            TEST_CHECK(vsize == esize && memcmp(buf, val, esize) == 0);
+            n++;
+        }
+    }
+
+    /* カーソルはキー順に格納されたキーと値を返します。*/
+    cur = nio_cursor_open(nio);
+    TEST_CHECK(cur != NULL);
+    do {
+        int ksize = nio_cursor_key(cur, key, sizeof(key));
+
+        if (ksize < 0)
+            break;
+        key[8] = '\0';
+        i = atoi(key);
+        TEST_CHECK(i > prev && i < NUM_KEYS && model[i].gen >= 0);
+        if (i > prev && i < NUM_KEYS && model[i].gen >= 0) {
+            int esize = make_val(val, i, model[i].gen);
+
+            TEST_CHECK(ksize == make_key(buf, i));
+            TEST_CHECK(nio_cursor_value(cur, buf, sizeof(buf)) == esize);
+            TEST_CHECK(memcmp(buf, val, esize) == 0);
+        }
+        prev = i;
+        n--;
+    } while (nio_cursor_next(cur) == 0);
+    nio_cursor_close(cur);
+    TEST_CHECK(n == 0);
+}
+
+static void run(const char* fname, int datapack, int compress, int keylen)
+{
+    struct nio_t* nio;
+    char key[NIO_MAX_KEYSIZE], val[2048];
+    uint seed = 3;
+    int n, i;
+    int props[] = {
+        NIO_DATAPACK, datapack, NIO_PREFIX_COMPRESS, compress, NIO_LEAF_CACHE, 2, 0
+    };
+
+    test_remove_db(fname);
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+    max_keylen = keylen;
+    for (i = 0; i < NUM_KEYS; i++)
+        model[i].gen = -1;
+
+    for (n = 1; n <= NUM_OPS; n++) {
+        int ksize;
+
+        i = rand_next(&seed) % NUM_KEYS;
+        ksize = make_key(key, i);
+        if (model[i].gen >= 0 && rand_next(&seed) % 4 == 0) {
+            TEST_CHECK(nio_delete(nio, key, ksize) == 0);
+            model[i].gen = -1;
+        } else {
+            int gen = (model[i].gen < 0)? 0 : model[i].gen + 1;
+            int vsize = make_val(val, i, gen);
+
+            TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+            model[i].gen = gen;
+        }
+        if (n % (NUM_OPS / 4) == 0)
+            check_all(nio);
+    }
+    nio = test_reopen_db(nio, fname, props);
+    check_all(nio);
+    test_close_db(nio);
+}
+
+/* 長いキーを昇順に挿入してから前から順に半分を削除します。*/
+static void run_seq(const char* fname, int datapack)
+{
+    struct nio_t* nio;
+    char key[NIO_MAX_KEYSIZE], val[2048];
+    int i;
+    int props[] = { NIO_DATAPACK, datapack, 0 };
+
+    test_remove_db(fname);
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+    max_keylen = LONG_KEYLEN;
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize = make_key(key, i);
+        int vsize = make_val(val, i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+        model[i].gen = 0;
+    }
+    check_all(nio);
+    for (i = 0; i < NUM_KEYS; i += 2) {
+        int ksize = make_key(key, i);
+
+        TEST_CHECK(nio_delete(nio, key, ksize) == 0);
+        model[i].gen = -1;
+    }
+    nio = test_reopen_db(nio, fname, props);
+    check_all(nio);
+    test_close_db(nio);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("bdb_arena");
+    run(fname, 1, 0, MAX_KEYLEN);
+    run(fname, 1, 1, MAX_KEYLEN);
+    run(fname, 0, 0, MAX_KEYLEN);
+    run(fname, 0, 1, MAX_KEYLEN);
+    run(fname, 1, 0, LONG_KEYLEN);
+    run(fname, 0, 1, LONG_KEYLEN);
+    run_seq(fname, 1);
+    run_seq(fname, 0);
+    return test_end();
+}
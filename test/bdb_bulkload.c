@@ -0,0 +1,154 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* nio_bulk_load() と bdbload コマンドで一括作成したデータベースを確認します。
+   作成後は通常のデータベースとして更新できることを確認します。*/
+
+#define NUM_KEYS        20000
+
+static int load_next;
+
+static int load_item(void* arg, struct nio_batch_t* item)
+{
+    static char key[32], val[2048];
+
+    if (load_next >= NUM_KEYS)
+        return 0;
+    item->keysize = test_key(key, load_next);
+    item->valsize = test_val(val, load_next, 0);
+    item->key = key;
+    item->val = val;
+    load_next++;
+    return 1;
+}
+
+static void verify_db(struct nio_t* nio, int num, int gen)
+{
+    int i;
+
+    for (i = 0; i < num; i++)
+        TEST_CHECK(test_verify(nio, i, (i % 3 == 0)? gen : 0));
+}
+
+/* 一括作成の後に更新してから再オープンします。*/
+static void check_update(const char* fname, int datapack)
+{
+    struct nio_t* nio;
+    char key[32], val[2048];
+    int i;
+    int props[] = { NIO_DATAPACK, datapack, 0 };
+
+    nio = test_open_db(fname, NIO_BTREE, props, 0);
+    verify_db(nio, NUM_KEYS, 0);
+    for (i = 0; i < NUM_KEYS; i += 3) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 1);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    for (i = NUM_KEYS; i < NUM_KEYS + 1000; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    test_close_db(nio);
+
+    nio = test_open_db(fname, NIO_BTREE, props, 0);
+    verify_db(nio, NUM_KEYS, 1);
+    for (i = NUM_KEYS; i < NUM_KEYS + 1000; i++)
+        TEST_CHECK(test_verify(nio, i, 0));
+    test_close_db(nio);
+}
+
+static void test_api(const char* fname, int datapack)
+{
+    struct nio_t* nio;
+    int props[] = { NIO_DATAPACK, datapack, 0 };
+
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+    load_next = 0;
+    TEST_CHECK(nio_bulk_load(nio, load_item, NULL) == NUM_KEYS);
+
+    /* 空でないデータベースには作成できません。*/
+    load_next = 0;
+    TEST_CHECK(nio_bulk_load(nio, load_item, NULL) < 0);
+    test_close_db(nio);
+
+    check_update(fname, datapack);
+    test_remove_db(fname);
+}
+
+/* 入力ファイルを作成します。reverse の場合は降順に並べます。*/
+static void write_input(const char* path, int reverse)
+{
+    FILE* fp;
+    char key[32], val[2048];
+    int n;
+
+    fp = fopen(path, "w");
+    TEST_CHECK(fp != NULL);
+    if (fp == NULL)
+        return;
+    for (n = 0; n < NUM_KEYS; n++) {
+        int i = reverse? NUM_KEYS - n - 1 : n;
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        fprintf(fp, "%.*s\t%.*s\n", ksize, key, vsize, val);
+    }
+    fclose(fp);
+}
+
+static void test_command(const char* fname)
+{
+    char input[300], cmd[1024];
+
+    snprintf(input, sizeof(input), "%s.txt", fname);
+    write_input(input, 0);
+    snprintf(cmd, sizeof(cmd), "tools/bdbload -d %s %s 2>/dev/null", fname, input);
+    TEST_CHECK(system(cmd) == 0);
+    check_update(fname, 1);
+    test_remove_db(fname);
+
+    /* キー順に並んでいない入力はエラーになります。*/
+    write_input(input, 1);
+    snprintf(cmd, sizeof(cmd), "tools/bdbload %s < %s 2>/dev/null", fname, input);
+    TEST_CHECK(system(cmd) != 0);
+    test_remove_db(fname);
+    remove(input);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("bdb_bulkload");
+    test_api(fname, 1);
+    test_api(fname, 0);
+    test_command(fname);
+    return test_end();
+}
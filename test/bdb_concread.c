@@ -0,0 +1,127 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* NIO_CONCURRENT_READ を指定した B+木で参照のスレッドと
+   更新のスレッドを同時に実行します。
+   更新中のキーは更新前か更新後のどちらかの値が参照されます。
+   更新のスレッドは異なるキーの置換と追加を並行に行います。*/
+
+#define NUM_READERS     4
+#define NUM_WRITERS     4
+#define NUM_KEYS        5000
+#define NUM_ADDS        2000
+
+static struct nio_t* nio;
+static volatile int writing;
+
+static void* reader(void* arg)
+{
+    int t = (int)(intptr_t)arg;
+    int i, loop = 0;
+
+    while (writing || loop < 2) {
+        for (i = t; i < NUM_KEYS; i += NUM_READERS) {
+            if (i % 2 == 0)
+                TEST_CHECK(test_verify(nio, i, 0));
+            else
+                TEST_CHECK(test_verify(nio, i, 0) || test_verify(nio, i, 1));
+        }
+        loop++;
+    }
+    return NULL;
+}
+
+/* 奇数のキーを置換して、新しいキーを追加します。*/
+static void* writer(void* arg)
+{
+    int t = (int)(intptr_t)arg;
+    char key[32], val[2048];
+    int i;
+
+    for (i = t * 2 + 1; i < NUM_KEYS; i += NUM_WRITERS * 2) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 1);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    for (i = NUM_KEYS + t; i < NUM_KEYS + NUM_ADDS; i += NUM_WRITERS) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    return NULL;
+}
+
+static void run(const char* fname, int datapack)
+{
+    pthread_t th[NUM_READERS+NUM_WRITERS];
+    char key[32], val[2048];
+    int i;
+    int props[] = { NIO_CONCURRENT_READ, 1, NIO_LEAF_CACHE, 8, NIO_DATAPACK, datapack, 0 };
+
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+
+    writing = 1;
+    for (i = 0; i < NUM_READERS; i++)
+        pthread_create(&th[i], NULL, reader, (void*)(intptr_t)i);
+    for (i = 0; i < NUM_WRITERS; i++)
+        pthread_create(&th[NUM_READERS+i], NULL, writer, (void*)(intptr_t)i);
+    for (i = 0; i < NUM_WRITERS; i++)
+        pthread_join(th[NUM_READERS+i], NULL);
+    writing = 0;
+    for (i = 0; i < NUM_READERS; i++)
+        pthread_join(th[i], NULL);
+
+    for (i = 0; i < NUM_KEYS; i++)
+        TEST_CHECK(test_verify(nio, i, i % 2));
+    for (i = NUM_KEYS; i < NUM_KEYS + NUM_ADDS; i++)
+        TEST_CHECK(test_verify(nio, i, 0));
+    test_close_db(nio);
+
+    /* リーフのフレームに遅延書き込みされた更新がファイルに残っているか調べます。*/
+    nio = test_open_db(fname, NIO_BTREE, props, 0);
+    for (i = 0; i < NUM_KEYS + NUM_ADDS; i++)
+        TEST_CHECK(test_verify(nio, i, (i < NUM_KEYS)? i % 2 : 0));
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("bdb_concread");
+    run(fname, 0);
+    run(fname, 1);
+    return test_end();
+}
@@ -0,0 +1,145 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* NIO_KEY_COMPARE の組み込み比較でキーの順序を確認します。
+   NIO_CMP_INT64 では８バイト以外のキーがエラーになることを確認します。*/
+
+#define NUM_KEYS        3000
+
+static void put_int64(struct nio_t* nio, int64 v)
+{
+    TEST_CHECK(nio_put(nio, &v, sizeof(int64), &v, sizeof(int64)) == 0);
+}
+
+/* カーソルで昇順に並んでいることを確認してキー数を返します。*/
+static int check_order(struct nio_t* nio)
+{
+    struct nio_cursor_t* cur;
+    int64 v, prev = 0;
+    int n = 0;
+
+    cur = nio_cursor_open(nio);
+    TEST_CHECK(cur != NULL);
+    if (cur == NULL)
+        return 0;
+    do {
+        if (nio_cursor_key(cur, &v, sizeof(v)) != sizeof(int64))
+            break;
+        if (n > 0)
+            TEST_CHECK(prev < v);
+        prev = v;
+        n++;
+    } while (nio_cursor_next(cur) == 0);
+    nio_cursor_close(cur);
+    return n;
+}
+
+static void test_int64(const char* fname)
+{
+    struct nio_t* nio;
+    struct nio_cursor_t* cur;
+    char val[16];
+    int64 v;
+    int i;
+    int props[] = { NIO_KEY_COMPARE, NIO_CMP_INT64, 0 };
+
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+
+    /* 負の値を含めて交互に挿入します。*/
+    for (i = 0; i < NUM_KEYS; i++)
+        put_int64(nio, (i % 2)? -(int64)i * 1000003 : (int64)i * 999983);
+    TEST_CHECK(check_order(nio) == NUM_KEYS);
+
+    /* ８バイト以外のキーはエラーになり、格納されません。*/
+    TEST_CHECK(nio_put(nio, "abc", 3, "x", 1) < 0);
+    TEST_CHECK(nio_put(nio, "abcdefghij", 10, "x", 1) < 0);
+    TEST_CHECK(nio_get(nio, "abc", 3, val, sizeof(val)) < 0);
+    TEST_CHECK(nio_delete(nio, "abc", 3) < 0);
+    TEST_CHECK(check_order(nio) == NUM_KEYS);
+
+    cur = nio_cursor_open(nio);
+    TEST_CHECK(nio_cursor_find(cur, BDB_COND_GE, "abc", 3) < 0);
+    v = 0;
+    TEST_CHECK(nio_cursor_find(cur, BDB_COND_GE, &v, sizeof(v)) == 0);
+    TEST_CHECK(nio_cursor_key(cur, &v, sizeof(v)) == sizeof(int64) && v == 0);
+    nio_cursor_close(cur);
+
+    /* ８バイトのキーは参照と削除ができます。*/
+    v = -1000003;
+    TEST_CHECK(nio_get(nio, &v, sizeof(v), val, sizeof(val)) == sizeof(int64));
+    TEST_CHECK(nio_delete(nio, &v, sizeof(v)) == 0);
+    TEST_CHECK(nio_get(nio, &v, sizeof(v), val, sizeof(val)) < 0);
+    test_close_db(nio);
+
+    /* 比較方式はファイルに記録されます。*/
+    nio = test_open_db(fname, NIO_BTREE, NULL, 0);
+    TEST_CHECK(check_order(nio) == NUM_KEYS - 1);
+    TEST_CHECK(nio_put(nio, "abc", 3, "x", 1) < 0);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+/* NIO_CMP_UINT64BE は長さの違うキーをバイト列として比較します。*/
+static void test_uint64be(const char* fname)
+{
+    struct nio_t* nio;
+    struct nio_cursor_t* cur;
+    uchar key[8];
+    char buf[16];
+    int i, j, n;
+    int props[] = { NIO_KEY_COMPARE, NIO_CMP_UINT64BE, 0 };
+
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+    for (i = 0; i < NUM_KEYS; i++) {
+        uint64 v = (uint64)i * 0x0100000001ULL;
+
+        for (j = 0; j < 8; j++)
+            key[j] = (uchar)(v >> (56 - j * 8));
+        TEST_CHECK(nio_put(nio, key, sizeof(key), "x", 1) == 0);
+    }
+    TEST_CHECK(nio_put(nio, "\xff", 1, "y", 1) == 0);
+
+    cur = nio_cursor_open(nio);
+    n = 0;
+    do {
+        n++;
+    } while (nio_cursor_next(cur) == 0);
+    TEST_CHECK(n == NUM_KEYS + 1);
+    TEST_CHECK(nio_cursor_key(cur, buf, sizeof(buf)) == 1 && (uchar)buf[0] == 0xff);
+    nio_cursor_close(cur);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("bdb_keycmp");
+    test_int64(fname);
+    test_uint64be(fname);
+    return test_end();
+}
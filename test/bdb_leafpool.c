@@ -0,0 +1,160 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* B+木のリーフキャッシュの大きさを変えて更新と参照を確認します。
+   キーを飛び飛びの順に操作してリーフの入れ替えを発生させます。
+   値のサイズを変えてキーとカーソルで更新し、削除した後も内容が正しく、
+   再オープン後にも書き戻された内容が読めることを確認します。*/
+
+#define NUM_KEYS        10000
+#define KEY_STEP        7919    /* NUM_KEYS と互いに素 */
+
+static int key_order(int n)
+{
+    return (int)(((int64)n * KEY_STEP) % NUM_KEYS);
+}
+
+static void put_all(struct nio_t* nio, int gen)
+{
+    char key[32], val[2048];
+    int n;
+
+    for (n = 0; n < NUM_KEYS; n++) {
+        int i = key_order(n);
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, gen);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+}
+
+/* カーソルで全体を読み込み、キー順と値を確認します。*/
+static void check_cursor(struct nio_t* nio, int gen, int step)
+{
+    struct nio_cursor_t* cur;
+    char key[32], ekey[32], val[2048], buf[2048];
+    int i = 0;
+
+    cur = nio_cursor_open(nio);
+    TEST_CHECK(cur != NULL);
+    if (cur == NULL)
+        return;
+    do {
+        int ksize = nio_cursor_key(cur, key, sizeof(key));
+        int vsize = test_val(val, i, gen);
+
+        if (ksize < 0)
+            break;
+        TEST_CHECK(ksize == test_key(ekey, i) && memcmp(key, ekey, ksize) == 0);
+        TEST_CHECK(nio_cursor_value(cur, buf, sizeof(buf)) == vsize);
+        TEST_CHECK(memcmp(buf, val, vsize) == 0);
+        i += step;
+    } while (nio_cursor_next(cur) == 0);
+    nio_cursor_close(cur);
+    TEST_CHECK(i == NUM_KEYS);
+}
+
+static void run(const char* fname, int cache, int datapack)
+{
+    struct nio_t* nio;
+    struct nio_cursor_t* cur;
+    char key[32];
+    int n, i;
+    int props[] = { NIO_DATAPACK, datapack, NIO_LEAF_CACHE, cache, 0 };
+    int props2[] = { NIO_LEAF_CACHE, cache, 0 };
+
+    test_remove_db(fname);
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+
+    put_all(nio, 0);
+    for (i = 0; i < NUM_KEYS; i++)
+        TEST_CHECK(test_verify(nio, i, 0));
+    check_cursor(nio, 0, 1);
+
+    /* 値のサイズが増減する更新 */
+    put_all(nio, 1);
+    put_all(nio, 2);
+    for (n = 0; n < NUM_KEYS; n++) {
+        i = key_order(n);
+        TEST_CHECK(test_verify(nio, i, 2));
+    }
+    check_cursor(nio, 2, 1);
+
+    /* 奇数のキーを削除します。*/
+    for (n = 0; n < NUM_KEYS; n++) {
+        i = key_order(n);
+        if (i % 2 == 1) {
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(nio_delete(nio, key, ksize) == 0);
+        }
+    }
+    check_cursor(nio, 2, 2);
+
+    /* カーソルで値を更新します。*/
+    cur = nio_cursor_open(nio);
+    TEST_CHECK(cur != NULL);
+    i = 0;
+    do {
+        char val[2048];
+        int vsize = test_val(val, i, 3);
+
+        TEST_CHECK(nio_cursor_update(cur, val, vsize) == 0);
+        i += 2;
+    } while (nio_cursor_next(cur) == 0);
+    nio_cursor_close(cur);
+    TEST_CHECK(i == NUM_KEYS);
+    check_cursor(nio, 3, 2);
+    test_close_db(nio);
+
+    /* 再オープンしてキャッシュから書き戻された内容を確認します。*/
+    nio = test_open_db(fname, NIO_BTREE, props2, 0);
+    for (i = 0; i < NUM_KEYS; i++) {
+        if (i % 2 == 0) {
+            TEST_CHECK(test_verify(nio, i, 3));
+        } else {
+            char buf[2048];
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(nio_get(nio, key, ksize, buf, sizeof(buf)) < 0);
+        }
+    }
+    check_cursor(nio, 3, 2);
+    test_close_db(nio);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("bdb_leafpool");
+    run(fname, 1, 1);
+    run(fname, 2, 0);
+    run(fname, 16, 1);
+    run(fname, 16, 0);
+    run(fname, 256, 0);
+    return test_end();
+}
@@ -0,0 +1,335 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* NIO_ORDER_STAT のキー数と順位による位置づけを確認します。
+   挿入、削除(リーフの併合)、再オープン、一括作成、重複キーとスナップショット
+   カーソルのそれぞれで、格納されているキーの集合と結果を比較します。
+   重複キーは値の数ではなくキーの数で数えます。*/
+
+#define NUM_KEYS        20000
+#define STEP            7919    /* NUM_KEYS と互いに素な挿入順の間隔 */
+
+static char present[NUM_KEYS];  /* 格納されているキー */
+static int prefix[NUM_KEYS+1];  /* prefix[i] は i 未満の格納されているキー数 */
+
+static void make_prefix(void)
+{
+    int i;
+
+    prefix[0] = 0;
+    for (i = 0; i < NUM_KEYS; i++)
+        prefix[i+1] = prefix[i] + present[i];
+}
+
+static int64 count_range(struct nio_t* nio, int from, int to, int flags)
+{
+    char skey[32], ekey[32];
+    int ssize = 0, esize = 0;
+
+    if (from >= 0)
+        ssize = test_key(skey, from);
+    if (to >= 0)
+        esize = test_key(ekey, to);
+    return nio_count_range(nio, (from >= 0)? skey : NULL, ssize,
+                           (to >= 0)? ekey : NULL, esize, flags);
+}
+
+static int expect_range(int from, int to, int flags)
+{
+    int s, e;
+
+    s = (from >= 0)? from : 0;
+    e = (to >= 0)? to : NUM_KEYS;
+    if (to >= 0 && to < NUM_KEYS && (flags & BDB_SCAN_END_INCLUDE))
+        e++;
+    if (e < s)
+        return 0;
+    return prefix[e] - prefix[s];
+}
+
+static void check_count(struct nio_t* nio)
+{
+    int n;
+
+    make_prefix();
+    TEST_CHECK(count_range(nio, -1, -1, 0) == prefix[NUM_KEYS]);
+    TEST_CHECK(count_range(nio, NUM_KEYS, -1, 0) == 0);
+    TEST_CHECK(count_range(nio, 500, 500, 0) == 0);
+    TEST_CHECK(count_range(nio, 600, 500, 0) == 0);
+    for (n = 0; n < 300; n++) {
+        int from = (n * 131) % NUM_KEYS;
+        int to = from + (n * 37) % 3000;
+        int flags = (n % 2)? BDB_SCAN_END_INCLUDE : 0;
+
+        if (n % 10 == 0)
+            from = -1;
+        if (to >= NUM_KEYS)
+            to = -1;
+        TEST_CHECK(count_range(nio, from, to, flags) == expect_range(from, to, flags));
+    }
+}
+
+static void check_rank(struct nio_cursor_t* cur)
+{
+    char key[32], buf[NIO_MAX_KEYSIZE];
+    int i, rank, ksize;
+
+    rank = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+        if (! present[i])
+            continue;
+        if (rank % 97 == 0 || prefix[NUM_KEYS] - rank < 3) {
+            TEST_CHECK(nio_cursor_seek_rank(cur, rank) == 0);
+            ksize = test_key(key, i);
+            TEST_CHECK(nio_cursor_key(cur, buf, sizeof(buf)) == ksize &&
+                       memcmp(buf, key, ksize) == 0);
+        }
+        rank++;
+    }
+    TEST_CHECK(nio_cursor_seek_rank(cur, rank) < 0);
+    TEST_CHECK(nio_cursor_seek_rank(cur, -1) < 0);
+}
+
+static void check_all(struct nio_t* nio)
+{
+    struct nio_cursor_t* cur;
+
+    check_count(nio);
+    cur = nio_cursor_open(nio);
+    TEST_CHECK(cur != NULL);
+    if (cur) {
+        check_rank(cur);
+        nio_cursor_close(cur);
+    }
+}
+
+static void put_key(struct nio_t* nio, int i, int dup)
+{
+    char key[32], val[2048];
+    int g, ksize, vsize;
+
+    ksize = test_key(key, i);
+    for (g = 0; g < dup; g++) {
+        vsize = test_val(val, i, g);
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    present[i] = 1;
+}
+
+static void delete_key(struct nio_t* nio, int i)
+{
+    char key[32];
+    int ksize;
+
+    ksize = test_key(key, i);
+    TEST_CHECK(nio_delete(nio, key, ksize) == 0);
+    present[i] = 0;
+}
+
+static void run(const char* fname, int datapack, int dup)
+{
+    struct nio_t* nio;
+    struct nio_cursor_t* snap;
+    int n, i;
+    int props[] = { NIO_DATAPACK, datapack, NIO_DUPLICATE_KEY, (dup > 1)? 1 : 0, NIO_ORDER_STAT, 1, 0 };
+
+    test_remove_db(fname);
+    memset(present, '\0', sizeof(present));
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+
+    /* 空のデータベース */
+    check_all(nio);
+
+    for (n = 0; n < NUM_KEYS; n++)
+        put_key(nio, (int)(((int64)n * STEP) % NUM_KEYS), dup);
+    check_all(nio);
+
+    /* 既存のキーの更新はキー数を変えません。*/
+    if (dup == 1) {
+        for (i = 0; i < NUM_KEYS; i += 5)
+            put_key(nio, i, 1);
+        check_count(nio);
+    }
+
+    /* 四つのうち三つを削除してリーフを併合させます。*/
+    for (n = 0; n < NUM_KEYS; n++) {
+        i = (int)(((int64)n * STEP) % NUM_KEYS);
+        if (i % 4 != 0)
+            delete_key(nio, i);
+    }
+    check_all(nio);
+
+    /* スナップショットは作成時点のキーで数えます。*/
+    snap = nio_cursor_snapshot(nio);
+    TEST_CHECK(snap != NULL);
+    for (i = 0; i < NUM_KEYS; i += 8)
+        delete_key(nio, i);
+    check_all(nio);
+    if (snap) {
+        for (i = 0; i < NUM_KEYS; i += 8)
+            present[i] = 1;
+        make_prefix();
+        check_rank(snap);
+        nio_cursor_close(snap);
+        for (i = 0; i < NUM_KEYS; i += 8)
+            present[i] = 0;
+    }
+
+    for (i = 1; i < NUM_KEYS; i += 4)
+        put_key(nio, i, dup);
+    test_close_db(nio);
+
+    nio = test_open_db(fname, NIO_BTREE, NULL, 0);
+    check_all(nio);
+    test_close_db(nio);
+}
+
+static int load_next;
+
+static int load_item(void* arg, struct nio_batch_t* item)
+{
+    static char key[32], val[2048];
+
+    while (load_next < NUM_KEYS && load_next % 3 == 0)
+        load_next++;
+    if (load_next >= NUM_KEYS)
+        return 0;
+    item->keysize = test_key(key, load_next);
+    item->valsize = test_val(val, load_next, 0);
+    item->key = key;
+    item->val = val;
+    present[load_next++] = 1;
+    return 1;
+}
+
+static void run_bulk(const char* fname)
+{
+    struct nio_t* nio;
+    int i;
+    int props[] = { NIO_ORDER_STAT, 1, 0 };
+
+    test_remove_db(fname);
+    memset(present, '\0', sizeof(present));
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+    load_next = 0;
+    TEST_CHECK(nio_bulk_load(nio, load_item, NULL) > 0);
+    check_all(nio);
+
+    /* 一括作成したキー数を起点に更新できます。*/
+    for (i = 0; i < NUM_KEYS; i += 3)
+        put_key(nio, i, 1);
+    for (i = 1; i < NUM_KEYS; i += 6)
+        delete_key(nio, i);
+    check_all(nio);
+    test_close_db(nio);
+}
+
+/* 重複キーは値の数にかかわらずひとつのキーとして数えます。
+   キーごとに値の数を変え、値の一部を削除してもキー数が変わらないことと、
+   最後の値を削除するとキー数が減ることを確認します。*/
+static void run_dup(const char* fname)
+{
+    struct nio_t* nio;
+    struct nio_cursor_t* cur;
+    char key[32];
+    int i, ksize;
+    int64 records;
+    int props[] = { NIO_DUPLICATE_KEY, 1, NIO_ORDER_STAT, 1, 0 };
+
+    test_remove_db(fname);
+    memset(present, '\0', sizeof(present));
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+    records = 0;
+    for (i = 0; i < NUM_KEYS; i += 2) {
+        put_key(nio, i, i % 5 + 1);
+        records += i % 5 + 1;
+    }
+    check_all(nio);
+    TEST_CHECK(count_range(nio, -1, -1, 0) == NUM_KEYS / 2);
+    TEST_CHECK(count_range(nio, -1, -1, 0) < records);
+
+    /* 重複キーの値をひとつずつ削除します。*/
+    cur = nio_cursor_open(nio);
+    TEST_CHECK(cur != NULL);
+    if (cur) {
+        for (i = 0; i < NUM_KEYS; i += 2) {
+            if (i % 5 == 0)
+                continue;
+            ksize = test_key(key, i);
+            TEST_CHECK(nio_cursor_find(cur, BDB_COND_EQ, key, ksize) == 0);
+            TEST_CHECK(nio_cursor_delete(cur) >= 0);
+        }
+        check_all(nio);
+
+        /* 値がひとつのキーは最後の値の削除でキーがなくなります。*/
+        for (i = 0; i < NUM_KEYS; i += 10) {
+            ksize = test_key(key, i);
+            TEST_CHECK(nio_cursor_find(cur, BDB_COND_EQ, key, ksize) == 0);
+            TEST_CHECK(nio_cursor_delete(cur) >= 0);
+            present[i] = 0;
+        }
+        check_all(nio);
+        nio_cursor_close(cur);
+    }
+    test_close_db(nio);
+
+    nio = test_open_db(fname, NIO_BTREE, NULL, 0);
+    check_all(nio);
+    test_close_db(nio);
+}
+
+/* NIO_ORDER_STAT なしで作成したデータベースはエラーになります。*/
+static void run_without(const char* fname)
+{
+    struct nio_t* nio;
+    struct nio_cursor_t* cur;
+
+    test_remove_db(fname);
+    nio = test_open_db(fname, NIO_BTREE, NULL, 1);
+    put_key(nio, 0, 1);
+    TEST_CHECK(count_range(nio, -1, -1, 0) < 0);
+    cur = nio_cursor_open(nio);
+    TEST_CHECK(cur != NULL);
+    if (cur) {
+        TEST_CHECK(nio_cursor_seek_rank(cur, 0) < 0);
+        nio_cursor_close(cur);
+    }
+    test_close_db(nio);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("bdb_orderstat");
+    run(fname, 1, 1);
+    run(fname, 0, 1);
+    run(fname, 0, 3);
+    run_dup(fname);
+    run_bulk(fname);
+    run_without(fname);
+    return test_end();
+}
@@ -0,0 +1,167 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* 範囲スキャンが範囲のキーと値をキー順に漏れなく返すことを確認します。
+   キーは偶数番号だけを格納し、存在しないキーを境界に指定した場合も確認します。
+   関数の中でデータベースを更新しながらスキャンを続けられることも確認します。*/
+
+#define NUM_KEYS        20000   /* 格納するキーは偶数の NUM_KEYS/2 個 */
+
+struct scan_arg_t {
+    struct nio_t* nio;
+    int next;       /* 次に期待するキー番号 */
+    int step;       /* キー番号の間隔 */
+    int dup;        /* キーごとの値の数 */
+    int count;      /* 受け取ったレコード数 */
+    int keyonly;
+    int stop;       /* ゼロ以外の場合は最初のバッチで終了します */
+    int delete;     /* ゼロ以外の場合は受け取ったキーを削除します */
+};
+
+static int scan_func(void* arg, struct nio_batch_t* items, int count)
+{
+    struct scan_arg_t* sa = (struct scan_arg_t*)arg;
+    char key[32], val[2048];
+    int n;
+
+    for (n = 0; n < count; n++) {
+        int i = sa->next;
+        int ksize = test_key(key, i);
+
+        TEST_CHECK(items[n].keysize == ksize && memcmp(items[n].key, key, ksize) == 0);
+        if (sa->keyonly) {
+            TEST_CHECK(items[n].valsize == 0);
+        } else if (sa->dup == 1) {
+            int vsize = test_val(val, i, 0);
+
+            TEST_CHECK(items[n].valsize == vsize && memcmp(items[n].val, val, vsize) == 0);
+        }
+        if (sa->delete && (sa->count + 1) % sa->dup == 0)
+            TEST_CHECK(nio_delete(sa->nio, key, ksize) == 0);
+        sa->count++;
+        if (sa->count % sa->dup == 0)
+            sa->next += sa->step;
+    }
+    return sa->stop;
+}
+
+static int scan(struct nio_t* nio, int from, int to, int flags, struct scan_arg_t* sa)
+{
+    char skey[32], ekey[32];
+    int ssize = 0, esize = 0;
+
+    if (from >= 0)
+        ssize = test_key(skey, from);
+    if (to >= 0)
+        esize = test_key(ekey, to);
+    sa->nio = nio;
+    sa->count = 0;
+    sa->keyonly = (flags & BDB_SCAN_KEYONLY)? 1 : 0;
+    return nio_scan(nio, (from >= 0)? skey : NULL, ssize,
+                    (to >= 0)? ekey : NULL, esize, flags, scan_func, sa);
+}
+
+static void check_scan(struct nio_t* nio, int dup, int from, int to, int flags,
+                       int first, int expect)
+{
+    struct scan_arg_t sa;
+
+    memset(&sa, '\0', sizeof(sa));
+    sa.next = first;
+    sa.step = 2;
+    sa.dup = dup;
+    TEST_CHECK(scan(nio, from, to, flags, &sa) == expect * dup);
+    TEST_CHECK(sa.count == expect * dup);
+}
+
+static void run(const char* fname, int datapack, int dup)
+{
+    struct nio_t* nio;
+    struct scan_arg_t sa;
+    char key[32], val[2048];
+    int i, g, n;
+    int props[] = { NIO_DATAPACK, datapack, NIO_DUPLICATE_KEY, (dup > 1)? 1 : 0, 0 };
+
+    test_remove_db(fname);
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+
+    /* 空のデータベース */
+    check_scan(nio, dup, -1, -1, 0, 0, 0);
+
+    for (g = 0; g < dup; g++) {
+        for (i = 0; i < NUM_KEYS; i += 2) {
+            int ksize = test_key(key, i);
+            int vsize = test_val(val, i, g);
+
+            TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+        }
+    }
+
+    /* 全体 */
+    check_scan(nio, dup, -1, -1, 0, 0, NUM_KEYS/2);
+    check_scan(nio, dup, -1, -1, BDB_SCAN_KEYONLY, 0, NUM_KEYS/2);
+    /* [100, 200) と [100, 200] */
+    check_scan(nio, dup, 100, 200, 0, 100, 50);
+    check_scan(nio, dup, 100, 200, BDB_SCAN_END_INCLUDE, 100, 51);
+    /* 存在しないキーが境界の場合 */
+    check_scan(nio, dup, 101, 201, 0, 102, 50);
+    check_scan(nio, dup, 101, 201, BDB_SCAN_END_INCLUDE, 102, 50);
+    check_scan(nio, dup, -1, 1001, 0, 0, 501);
+    check_scan(nio, dup, NUM_KEYS - 11, -1, 0, NUM_KEYS - 10, 5);
+    /* 空の範囲 */
+    check_scan(nio, dup, 200, 200, 0, 200, 0);
+    check_scan(nio, dup, 300, 200, 0, 300, 0);
+    check_scan(nio, dup, NUM_KEYS, -1, 0, NUM_KEYS, 0);
+
+    /* 関数がゼロ以外を返した場合は最初のバッチで終了します。*/
+    memset(&sa, '\0', sizeof(sa));
+    sa.step = 2;
+    sa.dup = dup;
+    sa.stop = 1;
+    n = scan(nio, -1, -1, 0, &sa);
+    TEST_CHECK(n > 0 && n < NUM_KEYS/2 * dup && n == sa.count);
+
+    /* 受け取ったキーを削除しながらスキャンを続けます。*/
+    memset(&sa, '\0', sizeof(sa));
+    sa.step = 2;
+    sa.dup = dup;
+    sa.delete = 1;
+    TEST_CHECK(scan(nio, -1, -1, 0, &sa) == NUM_KEYS/2 * dup);
+    check_scan(nio, dup, -1, -1, 0, 0, 0);
+
+    test_close_db(nio);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("bdb_scan");
+    run(fname, 1, 1);
+    run(fname, 0, 1);
+    run(fname, 0, 3);
+    return test_end();
+}
@@ -0,0 +1,209 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* ブランチノードのスロットディレクトリによる検索を確認します。
+   先頭の数バイトが共通で長さの異なるバイナリキーを小さいページに格納し、
+   既定の比較、降順の比較、利用者の比較関数のそれぞれで
+   検索とカーソルの位置づけがキーの順序と一致することを確認します。*/
+
+#define NUM_KEYS        20000
+#define MAX_KEYLEN      40
+
+struct tkey_t {
+    int size;
+    uchar key[MAX_KEYLEN];
+    int stored;
+};
+
+static struct tkey_t keys[NUM_KEYS];
+static int key_reverse = 0;
+
+static uint rand_next(uint* seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7fff;
+}
+
+/* 先頭が共通になりやすいように少ない種類のバイトからキーを作成します。*/
+static void make_key(struct tkey_t* k, uint* seed)
+{
+    static const uchar chars[] = { 0x00, 0x01, 'a', 'b', 0x7f, 0x80, 0xff };
+    int i;
+
+    k->size = 1 + rand_next(seed) % MAX_KEYLEN;
+    for (i = 0; i < k->size; i++)
+        k->key[i] = chars[rand_next(seed) % sizeof(chars)];
+}
+
+static int reverse_cmp(const void* k1, int k1size, const void* k2, int k2size)
+{
+    return nio_cmpkey(k2, k2size, k1, k1size);
+}
+
+static int tkey_cmp(const void* p1, const void* p2)
+{
+    const struct tkey_t* k1 = (const struct tkey_t*)p1;
+    const struct tkey_t* k2 = (const struct tkey_t*)p2;
+    int c;
+
+    c = nio_cmpkey(k1->key, k1->size, k2->key, k2->size);
+    return (key_reverse)? -c : c;
+}
+
+/* 重複しないキーを比較順に並べて作成します。*/
+static int make_keys(int reverse)
+{
+    uint seed = 1;
+    int i, n;
+
+    for (i = 0; i < NUM_KEYS; i++)
+        make_key(&keys[i], &seed);
+    key_reverse = reverse;
+    qsort(keys, NUM_KEYS, sizeof(struct tkey_t), tkey_cmp);
+    for (i = 1, n = 1; i < NUM_KEYS; i++) {
+        if (tkey_cmp(&keys[i], &keys[n-1]) != 0)
+            keys[n++] = keys[i];
+    }
+    for (i = 0; i < n; i++)
+        keys[i].stored = 0;
+    return n;
+}
+
+static struct nio_t* open_db(const char* fname, int kind, int create)
+{
+    struct nio_t* nio;
+    int props[] = { NIO_PAGESIZE, 1024, NIO_KEY_COMPARE, NIO_CMP_REVERSE, 0 };
+
+    if (kind != NIO_CMP_REVERSE)
+        props[2] = 0;
+    nio = test_init_db(NIO_BTREE, props);
+    if (kind < 0)
+        nio_cmpfunc(nio, reverse_cmp);
+    return test_attach_db(nio, fname, create);
+}
+
+/* 格納されている i 番目以降(dir > 0)または以前(dir < 0)のキーを返します。*/
+static int stored_key(int n, int i, int dir)
+{
+    while (i >= 0 && i < n && ! keys[i].stored)
+        i += dir;
+    return (i >= 0 && i < n)? i : -1;
+}
+
+static void check_keys(struct nio_t* nio, int n)
+{
+    struct nio_cursor_t* cur;
+    uchar buf[NIO_MAX_KEYSIZE];
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        int vsize = nio_find(nio, keys[i].key, keys[i].size);
+
+        TEST_CHECK((keys[i].stored)? vsize == sizeof(int) : vsize < 0);
+    }
+
+    /* カーソルは比較順に格納されたキーを返します。*/
+    cur = nio_cursor_open(nio);
+    TEST_CHECK(cur != NULL);
+    i = stored_key(n, 0, 1);
+    while (i >= 0) {
+        int ksize = nio_cursor_key(cur, buf, sizeof(buf));
+
+        TEST_CHECK(ksize == keys[i].size && memcmp(buf, keys[i].key, ksize) == 0);
+        i = stored_key(n, i + 1, 1);
+        if (nio_cursor_next(cur) != 0)
+            break;
+    }
+    TEST_CHECK(i < 0);
+
+    /* 格納されていないキーで GE と LE に位置づけます。*/
+    for (i = 0; i < n; i += 7) {
+        int ksize;
+
+        if (keys[i].stored)
+            continue;
+        j = stored_key(n, i, 1);
+        if (j >= 0) {
+            TEST_CHECK(nio_cursor_find(cur, BDB_COND_GE, keys[i].key, keys[i].size) == 0);
+            ksize = nio_cursor_key(cur, buf, sizeof(buf));
+            TEST_CHECK(ksize == keys[j].size && memcmp(buf, keys[j].key, ksize) == 0);
+        }
+        j = stored_key(n, i, -1);
+        if (j >= 0) {
+            TEST_CHECK(nio_cursor_find(cur, BDB_COND_LE, keys[i].key, keys[i].size) == 0);
+            ksize = nio_cursor_key(cur, buf, sizeof(buf));
+            TEST_CHECK(ksize == keys[j].size && memcmp(buf, keys[j].key, ksize) == 0);
+        }
+    }
+    nio_cursor_close(cur);
+}
+
+/* kind は NIO_CMP_MEMCMP, NIO_CMP_REVERSE または比較関数を使う場合は -1 */
+static void run(const char* fname, int kind)
+{
+    struct nio_t* nio;
+    uint seed = 7;
+    int n, i, k;
+
+    n = make_keys(kind != NIO_CMP_MEMCMP);
+    test_remove_db(fname);
+    nio = open_db(fname, kind, 1);
+
+    /* 全体の 3/4 をばらばらの順に格納します。*/
+    for (k = 0; k < n * 3; k++) {
+        i = (int)(((int64)rand_next(&seed) << 15 | rand_next(&seed)) % n);
+        if (keys[i].stored)
+            continue;
+        TEST_CHECK(nio_put(nio, keys[i].key, keys[i].size, &i, sizeof(int)) == 0);
+        keys[i].stored = 1;
+    }
+    check_keys(nio, n);
+
+    /* 一部を削除します。*/
+    for (i = 0; i < n; i += 3) {
+        if (keys[i].stored) {
+            TEST_CHECK(nio_delete(nio, keys[i].key, keys[i].size) == 0);
+            keys[i].stored = 0;
+        }
+    }
+    check_keys(nio, n);
+    test_close_db(nio);
+
+    nio = open_db(fname, kind, 0);
+    check_keys(nio, n);
+    test_close_db(nio);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("bdb_slotdir");
+    run(fname, NIO_CMP_MEMCMP);
+    run(fname, NIO_CMP_REVERSE);
+    run(fname, -1);
+    return test_end();
+}
@@ -0,0 +1,210 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <sys/wait.h>
+#include "test.h"
+
+/* B+木のスナップショットカーソルは作成した時点の内容を参照します。
+   クローズして解放された複写領域はファイルを再オープンしても
+   空きリストから使用できる必要があります。
+   スナップショットをクローズせずに異常終了した場合の複写領域は
+   再オープン時に回収されます。*/
+
+#define NUM_KEYS        3000
+
+static void put_all(struct nio_t* nio, int gen, int step)
+{
+    char key[32], val[2048];
+    int i;
+
+    for (i = 0; i < NUM_KEYS; i += step) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, gen);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+}
+
+/* スナップショットが世代 0 の内容をキー順に返すことを確認します。*/
+static void check_snapshot(struct nio_cursor_t* cur)
+{
+    char key[32], ekey[32], val[2048], buf[2048];
+    int i = 0;
+
+    do {
+        int ksize = nio_cursor_key(cur, key, sizeof(key));
+        int vsize = test_val(val, i, 0);
+
+        TEST_CHECK(ksize == test_key(ekey, i) && memcmp(key, ekey, ksize) == 0);
+        TEST_CHECK(nio_cursor_value(cur, buf, sizeof(buf)) == vsize);
+        TEST_CHECK(memcmp(buf, val, vsize) == 0);
+        i++;
+    } while (nio_cursor_next(cur) == 0);
+    TEST_CHECK(i == NUM_KEYS);
+}
+
+static void run(const char* fname, int datapack)
+{
+    struct nio_t* nio;
+    struct nio_cursor_t* cur;
+    char key[32], val[2048];
+    int i;
+    int64 reclaimed;
+    int props[] = { NIO_DATAPACK, datapack, 0 };
+
+    test_remove_db(fname);
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+    put_all(nio, 0, 1);
+
+    cur = nio_cursor_snapshot(nio);
+    TEST_CHECK(cur != NULL);
+    /* スナップショット中の更新は参照されません。*/
+    put_all(nio, 1, 2);
+    for (i = 1; i < NUM_KEYS; i += 4) {
+        int ksize = test_key(key, i);
+
+        TEST_CHECK(nio_delete(nio, key, ksize) == 0);
+    }
+    if (cur) {
+        TEST_CHECK(nio_cursor_update(cur, "x", 1) < 0);
+        check_snapshot(cur);
+        nio_cursor_close(cur);
+    }
+    test_close_db(nio);
+
+    /* 再オープンして更新できることを確認します。*/
+    nio = test_open_db(fname, NIO_BTREE, NULL, 0);
+    for (i = NUM_KEYS; i < NUM_KEYS * 2; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    for (i = 0; i < NUM_KEYS * 2; i++) {
+        if (i < NUM_KEYS && i % 4 == 1) {
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(nio_find(nio, key, ksize) < 0);
+        } else {
+            TEST_CHECK(test_verify(nio, i, (i < NUM_KEYS && i % 2 == 0)? 1 : 0));
+        }
+    }
+    TEST_CHECK(nio_compact(nio, NUM_KEYS, &reclaimed) >= 0);
+    TEST_CHECK(test_verify(nio, 0, 1));
+    test_close_db(nio);
+}
+
+/* 世代 0 のキーを追加したデータベースを子プロセスでオープンして、
+   snapshot が 1 の場合はスナップショットを作成してから全体を更新し、
+   closing が 0 の場合はクローズせずに終了します。
+   再オープン後に圧縮したファイルサイズを返します。*/
+static int64 crash_size(const char* fname, int datapack, int snapshot, int closing)
+{
+    struct nio_t* nio;
+    struct nio_cursor_t* snap = NULL;
+    pid_t pid;
+    int status, i;
+    int64 size = -1;
+    int props[] = { NIO_DATAPACK, datapack, NIO_WAL, 1, 0 };
+
+    test_remove_db(fname);
+    nio = test_open_db(fname, NIO_BTREE, props, 1);
+    put_all(nio, 0, 1);
+    test_close_db(nio);
+
+    pid = fork();
+    if (pid == 0) {
+        nio = test_open_db(fname, NIO_BTREE, props, 0);
+        if (nio == NULL)
+            _exit(1);
+        if (snapshot && (snap = nio_cursor_snapshot(nio)) == NULL)
+            _exit(1);
+        for (i = 0; i < NUM_KEYS; i++) {
+            char key[32], val[2048];
+            int ksize = test_key(key, i);
+            int vsize = test_val(val, i, 1);
+
+            if (nio_put(nio, key, ksize, val, vsize) < 0)
+                _exit(1);
+        }
+        if (closing) {
+            if (snap)
+                nio_cursor_close(snap);
+            test_close_db(nio);
+        }
+        _exit(0);
+    }
+    TEST_CHECK(pid > 0);
+    waitpid(pid, &status, 0);
+    TEST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    nio = test_open_db(fname, NIO_BTREE, props, 0);
+    TEST_CHECK(nio != NULL);
+    if (nio == NULL)
+        return -1;
+    for (i = 0; i < NUM_KEYS; i++)
+        TEST_CHECK(test_verify(nio, i, 1));
+    while ((status = nio_compact(nio, NUM_KEYS, NULL)) == 1)
+        ;
+    TEST_CHECK(status == 0);
+    size = nio_filesize(nio);
+    test_close_db(nio);
+
+    /* 回収後は再オープンしても内容は変わりません。*/
+    nio = test_open_db(fname, NIO_BTREE, props, 0);
+    TEST_CHECK(nio != NULL);
+    if (nio) {
+        for (i = 0; i < NUM_KEYS; i++)
+            TEST_CHECK(test_verify(nio, i, 1));
+        TEST_CHECK(nio_filesize(nio) == size);
+        test_close_db(nio);
+    }
+    test_remove_db(fname);
+    return size;
+}
+
+/* 異常終了した場合も複写表から回収して、スナップショットをクローズした
+   場合と同じサイズに圧縮できます。*/
+static void run_crash(const char* fname, int datapack)
+{
+    int64 size, crashed, released;
+
+    size = crash_size(fname, datapack, 0, 0);
+    crashed = crash_size(fname, datapack, 1, 0);
+    released = crash_size(fname, datapack, 1, 1);
+    TEST_CHECK(size > 0 && crashed <= size + size / 10);
+    TEST_CHECK(released > 0 && crashed == released);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("bdb_snapshot");
+    run(fname, 1);
+    run(fname, 0);
+    run_crash(fname, 1);
+    run_crash(fname, 0);
+    return test_end();
+}
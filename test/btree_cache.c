@@ -0,0 +1,171 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* 旧来の B-Tree(btopen)のページキャッシュを確認します。
+   キャッシュなし、数ページだけのキャッシュ、木全体が収まるキャッシュで
+   同じ更新と検索を行い、スレッドから同時に検索しても結果が変わらないことと
+   再オープン後も同じ内容であることを確認します。*/
+
+#define NUM_KEYS        20000
+#define KEYSIZE         100     /* ページの次数を小さくして木を深くします */
+#define STEP            7919
+#define NUM_THREADS     4
+
+static struct btree_t* bt;
+
+static void remove_bt(const char* fname)
+{
+    char path[300];
+
+    snprintf(path, sizeof(path), "%s%s", fname, KEY_FILE_EXT);
+    remove(path);
+    snprintf(path, sizeof(path), "%s%s", fname, DATA_FILE_EXT);
+    remove(path);
+}
+
+/* i 番目のキーの世代 gen(ゼロは削除済み)です。*/
+static int key_gen(int i, int round)
+{
+    if (round >= 2 && i % 2 == 1)
+        return 0;
+    if (round >= 1 && i % 3 == 0)
+        return 2;
+    return 1;
+}
+
+static int verify_key(int i, int gen)
+{
+    char key[32], val[2048], buf[2048];
+    int ksize, vsize;
+
+    ksize = test_key(key, i);
+    if (gen == 0)
+        return btget(bt, key, ksize, buf, sizeof(buf)) < 0 && btsearch(bt, key, ksize) < 0;
+    vsize = test_val(val, i, gen);
+    if (btsearch(bt, key, ksize) != vsize)
+        return 0;
+    if (btget(bt, key, ksize, buf, sizeof(buf)) != vsize)
+        return 0;
+    return memcmp(buf, val, vsize) == 0;
+}
+
+static void verify_all(int round)
+{
+    int i;
+
+    for (i = 0; i < NUM_KEYS; i++)
+        TEST_CHECK(verify_key(i, key_gen(i, round)));
+}
+
+static int verify_round;
+
+static void* verify_thread(void* arg)
+{
+    int t = (int)(intptr_t)arg;
+    int n;
+
+    for (n = 0; n < NUM_KEYS; n++) {
+        int i = (int)(((int64)n * STEP + t * 1000) % NUM_KEYS);
+
+        TEST_CHECK(verify_key(i, key_gen(i, verify_round)));
+    }
+    return NULL;
+}
+
+static void verify_threads(int round)
+{
+    pthread_t th[NUM_THREADS];
+    int t;
+
+    verify_round = round;
+    for (t = 0; t < NUM_THREADS; t++)
+        pthread_create(&th[t], NULL, verify_thread, (void*)(intptr_t)t);
+    for (t = 0; t < NUM_THREADS; t++)
+        pthread_join(th[t], NULL);
+}
+
+static void run(const char* fname, int cache_size)
+{
+    char key[32], val[2048];
+    int i, n;
+
+    remove_bt(fname);
+    TEST_CHECK(btcreate(fname, KEYSIZE) == 0);
+    bt = btopen(fname, cache_size);
+    TEST_CHECK(bt != NULL);
+    if (bt == NULL)
+        return;
+
+    for (n = 0; n < NUM_KEYS; n++) {
+        int ksize, vsize;
+
+        i = (int)(((int64)n * STEP) % NUM_KEYS);
+        ksize = test_key(key, i);
+        vsize = test_val(val, i, 1);
+        TEST_CHECK(btput(bt, key, ksize, val, vsize) == 0);
+    }
+    verify_all(0);
+
+    for (i = 0; i < NUM_KEYS; i += 3) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 2);
+
+        TEST_CHECK(btput(bt, key, ksize, val, vsize) == 0);
+    }
+    verify_all(1);
+
+    /* 奇数のキーを削除してページを併合させます。*/
+    for (n = 0; n < NUM_KEYS; n++) {
+        i = (int)(((int64)n * STEP) % NUM_KEYS);
+        if (i % 2 == 1) {
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(btdelete(bt, key, ksize) == 0);
+        }
+    }
+    verify_all(2);
+    verify_threads(2);
+    btclose(bt);
+
+    bt = btopen(fname, cache_size);
+    TEST_CHECK(bt != NULL);
+    if (bt == NULL)
+        return;
+    verify_all(2);
+    btclose(bt);
+    remove_bt(fname);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("btree_cache");
+    run(fname, 0);
+    run(fname, 16);
+    run(fname, 4096);
+    return test_end();
+}
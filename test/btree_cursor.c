@@ -0,0 +1,225 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* 旧来の B-Tree(btopen)のカーソルがキー順にすべてのキーを返すことを確認します。
+   存在しないキーへの位置づけ、末尾、複数のカーソルと小さなキャッシュ、
+   カーソルの移動中にキーを追加、削除した場合も確認します。*/
+
+#define NUM_KEYS        20000   /* 格納するキーは偶数の NUM_KEYS/2 個 */
+#define KEYSIZE         100
+#define STEP            7919
+#define NUM_CURSORS     8
+
+static struct btree_t* bt;
+
+static void remove_bt(const char* fname)
+{
+    char path[300];
+
+    snprintf(path, sizeof(path), "%s%s", fname, KEY_FILE_EXT);
+    remove(path);
+    snprintf(path, sizeof(path), "%s%s", fname, DATA_FILE_EXT);
+    remove(path);
+}
+
+/* キーは作成時のキー長までゼロでパディングされます。*/
+static int check_key(struct btcursor_t* cur, int i)
+{
+    char key[KEYSIZE], buf[KEYSIZE];
+
+    memset(key, '\0', sizeof(key));
+    test_key(key, i);
+    if (btcursor_key(cur, buf, sizeof(buf)) != KEYSIZE)
+        return 0;
+    return memcmp(buf, key, KEYSIZE) == 0;
+}
+
+static int check_value(struct btcursor_t* cur, int i)
+{
+    char val[2048], buf[2048];
+    int vsize;
+
+    vsize = test_val(val, i, 0);
+    if (btcursor_value(cur, buf, sizeof(buf)) != vsize)
+        return 0;
+    return memcmp(buf, val, vsize) == 0;
+}
+
+static int seek(struct btcursor_t* cur, int i)
+{
+    char key[32];
+    int ksize;
+
+    if (i < 0)
+        return btcursor_seek(cur, NULL, 0);
+    ksize = test_key(key, i);
+    return btcursor_seek(cur, key, ksize);
+}
+
+static void put_key(int i)
+{
+    char key[32], val[2048];
+    int ksize, vsize;
+
+    ksize = test_key(key, i);
+    vsize = test_val(val, i, 0);
+    TEST_CHECK(btput(bt, key, ksize, val, vsize) == 0);
+}
+
+static void delete_key(int i)
+{
+    char key[32];
+    int ksize;
+
+    ksize = test_key(key, i);
+    TEST_CHECK(btdelete(bt, key, ksize) == 0);
+}
+
+/* from から末尾までのキーを順に確認してキー数を返します。*/
+static int scan(struct btcursor_t* cur, int from, int step)
+{
+    int i, count = 0;
+    int result;
+
+    result = seek(cur, from);
+    for (i = (from < 0)? 0 : from; result == 0; i += step) {
+        TEST_CHECK(check_key(cur, i));
+        TEST_CHECK(check_value(cur, i));
+        count++;
+        result = btcursor_next(cur);
+    }
+    TEST_CHECK(result == BTCURSOR_END);
+    TEST_CHECK(btcursor_next(cur) == BTCURSOR_END);
+    return count;
+}
+
+static void run(const char* fname, int cache_size)
+{
+    struct btcursor_t* cur;
+    struct btcursor_t* curs[NUM_CURSORS];
+    char buf[KEYSIZE];
+    int i, n, result;
+
+    remove_bt(fname);
+    TEST_CHECK(btcreate(fname, KEYSIZE) == 0);
+    bt = btopen(fname, cache_size);
+    TEST_CHECK(bt != NULL);
+    if (bt == NULL)
+        return;
+    cur = btcursor_open(bt);
+    TEST_CHECK(cur != NULL);
+    if (cur == NULL) {
+        btclose(bt);
+        return;
+    }
+
+    /* 空のファイルと位置づけ前のカーソル */
+    TEST_CHECK(btcursor_key(cur, buf, sizeof(buf)) == -1);
+    TEST_CHECK(seek(cur, -1) == BTCURSOR_END);
+
+    for (n = 0; n < NUM_KEYS; n++) {
+        i = (int)(((int64)n * STEP) % NUM_KEYS);
+        if (i % 2 == 0)
+            put_key(i);
+    }
+
+    TEST_CHECK(scan(cur, -1, 2) == NUM_KEYS/2);
+    TEST_CHECK(scan(cur, 1000, 2) == (NUM_KEYS - 1000)/2);
+    /* 存在しないキーは次のキーに位置づけます。*/
+    TEST_CHECK(seek(cur, 1001) == 0 && check_key(cur, 1002));
+    TEST_CHECK(seek(cur, NUM_KEYS - 1) == BTCURSOR_END);
+    TEST_CHECK(seek(cur, 0) == 0);
+    TEST_CHECK(btcursor_key(cur, buf, 10) == -2);
+
+    /* 複数のカーソルがページを固定したまま進みます。*/
+    for (n = 0; n < NUM_CURSORS; n++) {
+        curs[n] = btcursor_open(bt);
+        TEST_CHECK(curs[n] != NULL);
+        TEST_CHECK(seek(curs[n], n * 2000) == 0);
+    }
+    for (i = 0; i < 1000; i++) {
+        for (n = 0; n < NUM_CURSORS; n++) {
+            if (curs[n] == NULL)
+                continue;
+            TEST_CHECK(check_key(curs[n], n * 2000 + i * 2));
+            TEST_CHECK(btcursor_next(curs[n]) == 0);
+        }
+    }
+    for (n = 0; n < NUM_CURSORS; n++) {
+        if (curs[n])
+            btcursor_close(curs[n]);
+    }
+
+    /* 移動中に奇数のキーを追加すると追加したキーも返します。*/
+    result = seek(cur, -1);
+    for (i = 0; result == 0; i++) {
+        TEST_CHECK(check_key(cur, i));
+        if (i % 2 == 0 && i + 1 < NUM_KEYS)
+            put_key(i + 1);
+        result = btcursor_next(cur);
+    }
+    TEST_CHECK(result == BTCURSOR_END && i == NUM_KEYS);
+
+    /* 移動中に現在のキーと次の二つのキーを削除すると 4 で割って 3 余るキーが残ります。*/
+    result = seek(cur, -1);
+    for (i = 0; result == 0; i += (i % 4 == 0)? 3 : 1) {
+        TEST_CHECK(check_key(cur, i));
+        if (i % 4 == 0) {
+            delete_key(i);
+            delete_key(i + 1);
+            delete_key(i + 2);
+        }
+        result = btcursor_next(cur);
+    }
+    TEST_CHECK(result == BTCURSOR_END && i == NUM_KEYS);
+    TEST_CHECK(seek(cur, -1) == 0 && check_key(cur, 3));
+    btcursor_close(cur);
+    btclose(bt);
+
+    bt = btopen(fname, cache_size);
+    TEST_CHECK(bt != NULL);
+    if (bt == NULL)
+        return;
+    cur = btcursor_open(bt);
+    TEST_CHECK(cur != NULL);
+    if (cur) {
+        TEST_CHECK(scan(cur, 3, 4) == NUM_KEYS/4);
+        btcursor_close(cur);
+    }
+    btclose(bt);
+    remove_bt(fname);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("btree_cursor");
+    run(fname, 0);
+    run(fname, 16);
+    run(fname, 4096);
+    return test_end();
+}
@@ -0,0 +1,118 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* ハッシュデータベースの並行処理のベンチマークです。
+ *
+ * 単一ロック(NIO_LOCK_STRIPES=0)とロックストライプで
+ * スレッド数を変えて参照 9 割、更新 1 割の処理を行い、
+ * 1秒あたりの処理数を表示します。
+ *
+ * test/hdb_bench [キー数] [スレッドあたりの処理数]
+ */
+
+#define MAX_THREADS     32
+
+static struct nio_t* nio;
+static int num_keys = 100000;
+static int num_ops = 200000;
+
+static void* worker(void* arg)
+{
+    unsigned int r = (unsigned int)(intptr_t)arg * 2654435761u + 1;
+    char key[32], val[2048], buf[2048];
+    int i;
+
+    for (i = 0; i < num_ops; i++) {
+        int n, ksize;
+
+        r = r * 1103515245 + 12345;
+        n = (int)((r >> 8) % (unsigned int)num_keys);
+        ksize = test_key(key, n);
+        if (i % 10 == 0) {
+            int vsize = test_val(val, n, i) % 100 + 1;
+
+            nio_put(nio, key, ksize, val, vsize);
+        } else {
+            nio_get(nio, key, ksize, buf, sizeof(buf));
+        }
+    }
+    return NULL;
+}
+
+static double run(const char* fname, int stripes, int threads)
+{
+    pthread_t th[MAX_THREADS];
+    char key[32], val[2048];
+    double start, msec;
+    int i;
+
+    test_remove_db(fname);
+    nio = nio_initialize(NIO_HASH);
+    nio_property(nio, NIO_BUCKET_NUM, num_keys);
+    nio_property(nio, NIO_LOCK_STRIPES, stripes);
+    if (nio_create(nio, fname) < 0) {
+        fprintf(stderr, "can't create %s\n", fname);
+        exit(1);
+    }
+    for (i = 0; i < num_keys; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0) % 100 + 1;
+
+        nio_put(nio, key, ksize, val, vsize);
+    }
+
+    start = test_msec();
+    for (i = 0; i < threads; i++)
+        pthread_create(&th[i], NULL, worker, (void*)(intptr_t)i);
+    for (i = 0; i < threads; i++)
+        pthread_join(th[i], NULL);
+    msec = test_msec() - start;
+
+    test_close_db(nio);
+    return (double)num_ops * threads / (msec / 1000.0);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* fname;
+    int threads;
+
+    if (argc > 1)
+        num_keys = atoi(argv[1]);
+    if (argc > 2)
+        num_ops = atoi(argv[2]);
+    fname = test_start("hdb_bench");
+
+    printf("threads  single lock(ops/s)  64 stripes(ops/s)\n");
+    for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double single, striped;
+
+        single = run(fname, 0, threads);
+        striped = run(fname, 64, threads);
+        printf("%7d  %18.0f  %17.0f\n", threads, single, striped);
+    }
+    return test_end();
+}
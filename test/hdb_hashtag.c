@@ -0,0 +1,121 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* ハッシュ値をキーと一緒に格納したチェインの検索を確認します。
+   すべてのキーが同じバケットに入り、ハッシュ値も重複するハッシュ関数で
+   ハッシュ値が異なるキーの読み飛ばしと同じハッシュ値のキーの比較を行います。
+   ハッシュ値がゼロのキーは以前のバージョンと同様に比較されます。*/
+
+#define NUM_KEYS        2000
+#define NUM_BUCKETS     64
+
+static int key_number(const void* key, int len)
+{
+    char buf[32];
+
+    memcpy(buf, key, len);
+    buf[len] = '\0';
+    return atoi(buf + 3);
+}
+
+/* バケットは常に先頭になり、ハッシュ値は 16 種類になります。*/
+static unsigned int collide_hash(const void* key, int len, unsigned int seed)
+{
+    return (unsigned int)(key_number(key, len) % 16) * NUM_BUCKETS;
+}
+
+/* リニアハッシュの分割用に分散するハッシュ値を返します。*/
+static unsigned int spread_hash(const void* key, int len, unsigned int seed)
+{
+    return (unsigned int)key_number(key, len) * 2654435761U;
+}
+
+static struct nio_t* open_db(const char* fname, HASH_FUNCPTR func, const int* props, int create)
+{
+    struct nio_t* nio;
+
+    nio = test_init_db(NIO_HASH, props);
+    nio_hashfunc(nio, func);
+    return test_attach_db(nio, fname, create);
+}
+
+static void verify_all(struct nio_t* nio)
+{
+    char key[32];
+    int i;
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        if (i % 5 == 0) {
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(nio_find(nio, key, ksize) < 0);
+        } else {
+            TEST_CHECK(test_verify(nio, i, (i % 2)? 1 : 0));
+        }
+    }
+}
+
+static void run(const char* fname, HASH_FUNCPTR func, int linear)
+{
+    struct nio_t* nio;
+    char key[32], val[2048];
+    int i, gen;
+    int props[] = { NIO_BUCKET_NUM, NUM_BUCKETS, NIO_LINEAR_HASH, 2, 0 };
+
+    if (! linear)
+        props[2] = 0;
+    nio = open_db(fname, func, props, 1);
+    for (gen = 0; gen < 2; gen++) {
+        for (i = gen; i < NUM_KEYS; i += gen + 1) {
+            int ksize = test_key(key, i);
+            int vsize = test_val(val, i, gen);
+
+            TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+        }
+    }
+    for (i = 0; i < NUM_KEYS; i += 5) {
+        int ksize = test_key(key, i);
+
+        TEST_CHECK(nio_delete(nio, key, ksize) == 0);
+    }
+    verify_all(nio);
+    test_close_db(nio);
+
+    nio = open_db(fname, func, props, 0);
+    verify_all(nio);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("hdb_hashtag");
+    run(fname, collide_hash, 0);
+    run(fname, spread_hash, 1);
+    return test_end();
+}
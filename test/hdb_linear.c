@@ -0,0 +1,153 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* NIO_LINEAR_HASH を指定したハッシュデータベースに複数のスレッドから
+   キーを追加してバケットを分割しながら参照できることを確認します。*/
+
+#define NUM_THREADS     4
+#define NUM_KEYS        20000
+
+static struct nio_t* nio;
+
+static void* worker(void* arg)
+{
+    int t = (int)(intptr_t)arg;
+    char key[32], val[2048];
+    int i;
+
+    for (i = t; i < NUM_KEYS; i += NUM_THREADS) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+        /* 分割中のバケットのキーも参照できます。*/
+        TEST_CHECK(test_verify(nio, i, 0));
+        if (i >= NUM_THREADS)
+            TEST_CHECK(test_verify(nio, i - NUM_THREADS, 0));
+    }
+    return NULL;
+}
+
+static void verify_all(int num)
+{
+    char key[32];
+    int i;
+
+    for (i = 0; i < num; i++) {
+        if (i % 3 == 0) {
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(nio_find(nio, key, ksize) < 0);
+        } else {
+            TEST_CHECK(test_verify(nio, i, 0));
+        }
+    }
+}
+
+static const int props[] = {
+    NIO_LOCK_STRIPES, 8, NIO_BUCKET_NUM, 16, NIO_LINEAR_HASH, 4, 0
+};
+
+/* ストライプごとの件数の合計です。*/
+static int64 stripe_records(struct hdb_t* hdb)
+{
+    int64 n = 0;
+    int i;
+
+    for (i = 0; i < hdb->lock_stripes; i++)
+        n += hdb->stripe[i].record_num;
+    return n;
+}
+
+/* ストライプ数で割り切れない件数のファイルを再オープンしても
+   記録されている件数は変わりません。*/
+static void run_reopen(const char* fname)
+{
+    char key[32], val[2048];
+    int i, n = 1003;
+
+    test_remove_db(fname);
+    nio = test_open_db(fname, NIO_HASH, props, 1);
+    for (i = 0; i < n; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    TEST_CHECK(stripe_records((struct hdb_t*)nio->db) == n);
+    for (i = 0; i < 5; i++) {
+        nio = test_reopen_db(nio, fname, props);
+        TEST_CHECK(((struct hdb_t*)nio->db)->record_num == n);
+        TEST_CHECK(stripe_records((struct hdb_t*)nio->db) == n);
+    }
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+int main()
+{
+    const char* fname;
+    pthread_t th[NUM_THREADS];
+    char key[32], val[2048];
+    int64 state;
+    int i;
+
+    fname = test_start("hdb_linear");
+
+    nio = test_open_db(fname, NIO_HASH, props, 1);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_create(&th[i], NULL, worker, (void*)(intptr_t)i);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(th[i], NULL);
+
+    /* 16 バケットから分割されていることを確認します。*/
+    state = ((struct hdb_t*)nio->db)->lh_state;
+    TEST_CHECK(state != 0);
+
+    for (i = 0; i < NUM_KEYS; i += 3) {
+        int ksize = test_key(key, i);
+
+        TEST_CHECK(nio_delete(nio, key, ksize) == 0);
+    }
+    verify_all(NUM_KEYS);
+
+    /* 分割の状態はファイルに記録されます。*/
+    nio = test_reopen_db(nio, fname, props);
+    TEST_CHECK(((struct hdb_t*)nio->db)->lh_state == state);
+    verify_all(NUM_KEYS);
+    for (i = NUM_KEYS; i < NUM_KEYS * 2; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        if (i % 3 != 0)
+            TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    verify_all(NUM_KEYS * 2);
+    test_close_db(nio);
+
+    run_reopen(fname);
+    return test_end();
+}
@@ -0,0 +1,100 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* ロックストライプを指定したハッシュデータベースに
+   複数のスレッドから同時に更新と参照を行います。*/
+
+#define NUM_THREADS     8
+#define NUM_KEYS        4000
+
+static struct nio_t* nio;
+
+static void* worker(void* arg)
+{
+    int t = (int)(intptr_t)arg;
+    char key[32], val[2048];
+    int i, gen;
+
+    for (gen = 0; gen < 3; gen++) {
+        for (i = t; i < NUM_KEYS; i += NUM_THREADS) {
+            int ksize = test_key(key, i);
+            int vsize = test_val(val, i, gen);
+
+            TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+            TEST_CHECK(test_verify(nio, i, gen));
+            /* 他のスレッドのキーも参照します。*/
+            TEST_CHECK(nio_find(nio, key, ksize) == vsize);
+        }
+    }
+    for (i = t; i < NUM_KEYS; i += NUM_THREADS * 2) {
+        int ksize = test_key(key, i);
+
+        TEST_CHECK(nio_delete(nio, key, ksize) == 0);
+    }
+    return NULL;
+}
+
+static void verify_all(void)
+{
+    char key[32];
+    int i;
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        if (i % (NUM_THREADS * 2) < NUM_THREADS) {
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(nio_find(nio, key, ksize) < 0);
+        } else {
+            TEST_CHECK(test_verify(nio, i, 2));
+        }
+    }
+}
+
+int main()
+{
+    const char* fname;
+    pthread_t th[NUM_THREADS];
+    int i;
+    int props[] = { NIO_BUCKET_NUM, 1000, NIO_LOCK_STRIPES, 16, 0 };
+    int props2[] = { NIO_LOCK_STRIPES, 16, 0 };
+
+    fname = test_start("hdb_stripe");
+
+    nio = test_open_db(fname, NIO_HASH, props, 1);
+
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_create(&th[i], NULL, worker, (void*)(intptr_t)i);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(th[i], NULL);
+    verify_all();
+    test_close_db(nio);
+
+    /* 再オープンして内容を確認します。*/
+    nio = test_open_db(fname, NIO_HASH, props2, 0);
+    verify_all();
+    test_close_db(nio);
+    return test_end();
+}
@@ -0,0 +1,130 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* nio_put_ttl() で有効期間を指定したキーが期限切れで参照できなくなり、
+   nio_reap() またはバックグラウンドのスレッドで回収されることを確認します。*/
+
+#define NUM_KEYS        2000
+#define NUM_BUCKETS     500
+
+/* interval がゼロの場合は回収スレッドを起動しません。*/
+static struct nio_t* create_db(const char* fname, int interval)
+{
+    int props[] = {
+        NIO_BUCKET_NUM, NUM_BUCKETS,
+        NIO_REAP_INTERVAL, interval,
+        NIO_REAP_BUCKETS, NUM_BUCKETS, 0
+    };
+
+    return test_open_db(fname, NIO_HASH, props, 1);
+}
+
+/* 偶数のキーは 2 秒の有効期間、奇数のキーは無期限で追加します。
+   期限は秒単位なので 1 秒では追加した直後に切れることがあります。*/
+static void put_keys(struct nio_t* nio)
+{
+    char key[32], val[2048];
+    int i;
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        TEST_CHECK(nio_put_ttl(nio, key, ksize, val, vsize, 0, (i % 2)? 0 : 2) == 0);
+    }
+    for (i = 0; i < NUM_KEYS; i++)
+        TEST_CHECK(test_verify(nio, i, 0));
+}
+
+static void verify_expired(struct nio_t* nio)
+{
+    char key[32], val[2048];
+    int i;
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize = test_key(key, i);
+
+        if (i % 2 == 0 && i != 0) {
+            TEST_CHECK(nio_find(nio, key, ksize) < 0);
+            TEST_CHECK(nio_get(nio, key, ksize, val, sizeof(val)) < 0);
+        } else {
+            TEST_CHECK(test_verify(nio, i, 0));
+        }
+    }
+}
+
+static void test_reap(const char* fname)
+{
+    struct nio_t* nio;
+    char key[32], val[2048];
+    int64 size;
+    int ksize, vsize;
+
+    nio = create_db(fname, 0);
+    put_keys(nio);
+
+    /* 有効期間なしで更新したキーは期限切れになりません。*/
+    ksize = test_key(key, 0);
+    vsize = test_val(val, 0, 0);
+    TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+
+    sleep(3);
+    verify_expired(nio);
+    TEST_CHECK(nio_reap(nio, NUM_BUCKETS) == NUM_KEYS / 2 - 1);
+    TEST_CHECK(nio_reap(nio, NUM_BUCKETS) == 0);
+    verify_expired(nio);
+
+    /* 回収した領域は再利用されるためファイルはほとんど大きくなりません。*/
+    size = nio_filesize(nio);
+    put_keys(nio);
+    TEST_CHECK(nio_filesize(nio) < size + size / 10);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+static void test_reaper_thread(const char* fname)
+{
+    struct nio_t* nio;
+
+    nio = create_db(fname, 100);
+    put_keys(nio);
+    sleep(3);
+    usleep(500 * 1000);
+    /* バックグラウンドで回収済みのため残っていません。*/
+    TEST_CHECK(nio_reap(nio, NUM_BUCKETS) == 0);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("hdb_ttl");
+    test_reap(fname);
+    test_reaper_thread(fname);
+    return test_end();
+}
@@ -0,0 +1,235 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* mmap_advise() と mmap_lock() の結果を /proc/self/smaps の VmFlags と
+   /proc/self/status の VmLck で確認します。ビュー全体のアクセスパターンは
+   ビューの拡張と再作成の後も維持されることと、NIO_MMAP_ADVICE と
+   NIO_MMAP_LOCK でオープンしたデータベースに適用されることも確認します。
+   /proc がない環境ではカーネルの状態は確認しません。*/
+
+#define PAGESIZE        4096
+#define NUM_PAGES       (8 * 256)   /* 8MB */
+#define GROW_PAGES      (64 * 256)  /* 64MB */
+#define NUM_KEYS        20000
+
+/* addr を含むマッピングの VmFlags に flag があれば 1 を返します。
+   確認できない場合は -1 を返します。*/
+static int vm_flag(const void* addr, const char* flag)
+{
+    FILE* fp;
+    char line[1024];
+    unsigned long start, end, a = (unsigned long)addr;
+    int found = 0;
+    int result = -1;
+
+    fp = fopen("/proc/self/smaps", "r");
+    if (fp == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2 && strchr(line, '-') < strchr(line, ' ')) {
+            found = (a >= start && a < end);
+        } else if (found && strncmp(line, "VmFlags:", 8) == 0) {
+            char* p;
+
+            result = 0;
+            for (p = strtok(line + 8, " \n"); p; p = strtok(NULL, " \n")) {
+                if (strcmp(p, flag) == 0)
+                    result = 1;
+            }
+            break;
+        }
+    }
+    fclose(fp);
+    return result;
+}
+
+/* 固定されているメモリのサイズ(KB)を返します。
+   確認できない場合は -1 を返します。*/
+static int64 vm_locked(void)
+{
+    FILE* fp;
+    char line[256];
+    long long kb = -1;
+
+    fp = fopen("/proc/self/status", "r");
+    if (fp == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmLck: %lld", &kb) == 1)
+            break;
+    }
+    fclose(fp);
+    return kb;
+}
+
+#define CHECK_FLAG(addr, flag)  TEST_CHECK(vm_flag(addr, flag) != 0)
+
+static void write_pages(struct mmap_t* map, int64 from, int64 to)
+{
+    char page[PAGESIZE];
+    int64 n;
+
+    for (n = from; n < to; n++) {
+        memset(page, (int)(n % 251), sizeof(page));
+        TEST_CHECK(mmap_pwrite(map, page, PAGESIZE, n * PAGESIZE) == PAGESIZE);
+    }
+}
+
+static void test_mmap(const char* fname)
+{
+    int fd;
+    struct mmap_t* map;
+    int64 base, far;
+
+    fd = FILE_OPEN(fname, O_RDWR|O_CREAT|O_BINARY, CREATE_MODE);
+    TEST_CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    map = mmap_open(fd, MMAP_READWRITE, MMAP_AUTO_SIZE);
+    TEST_CHECK(map != NULL);
+    if (map == NULL) {
+        FILE_CLOSE(fd);
+        return;
+    }
+    write_pages(map, 0, NUM_PAGES);
+
+    TEST_CHECK(mmap_advise(map, 0, 0, MMAP_ADVISE_HUGEPAGE + 1) < 0);
+    TEST_CHECK(mmap_advise(map, 0, 0, MMAP_ADVISE_RANDOM) == 0);
+    TEST_CHECK(map->advice == MMAP_ADVISE_RANDOM);
+    CHECK_FLAG(map->ptr, "rr");
+
+    /* 範囲を指定したアクセスパターンはビュー全体の設定を変えません。*/
+    TEST_CHECK(mmap_advise(map, PAGESIZE * 2, PAGESIZE, MMAP_ADVISE_SEQUENTIAL) == 0);
+    TEST_CHECK(map->advice == MMAP_ADVISE_RANDOM);
+    CHECK_FLAG(map->ptr + PAGESIZE * 2, "sr");
+    CHECK_FLAG(map->ptr + PAGESIZE * 3, "rr");
+    TEST_CHECK(mmap_advise(map, 0, PAGESIZE * 16, MMAP_ADVISE_WILLNEED) == 0);
+    mmap_advise(map, 0, PAGESIZE * 512, MMAP_ADVISE_HUGEPAGE);
+    TEST_CHECK(map->advice == MMAP_ADVISE_RANDOM);
+    /* ビューの外は何もしません。*/
+    TEST_CHECK(mmap_advise(map, map->size, PAGESIZE, MMAP_ADVISE_SEQUENTIAL) == 0);
+
+    /* 拡張した範囲にも適用されます。*/
+    write_pages(map, NUM_PAGES, GROW_PAGES);
+    CHECK_FLAG(map->ptr + (int64)(GROW_PAGES - 1) * PAGESIZE, "rr");
+
+    base = vm_locked();
+    TEST_CHECK(mmap_lock(map, PAGESIZE, PAGESIZE * 16) == 0);
+    if (base >= 0)
+        TEST_CHECK(vm_locked() >= base + 64);
+    TEST_CHECK(mmap_unlock(map, PAGESIZE, PAGESIZE * 16) == 0);
+    if (base >= 0)
+        TEST_CHECK(vm_locked() == base);
+    TEST_CHECK(mmap_lock(map, map->size - PAGESIZE, PAGESIZE * 2) < 0);
+    TEST_CHECK(mmap_lock(map, -1, PAGESIZE) < 0);
+
+    /* ビューを作り直しても適用されます。*/
+    far = ((map->reserve_size > map->size)? map->reserve_size : map->size) + PAGESIZE;
+    write_pages(map, far / PAGESIZE, far / PAGESIZE + 1);
+    TEST_CHECK(map->advice == MMAP_ADVISE_RANDOM);
+    CHECK_FLAG(map->ptr, "rr");
+    CHECK_FLAG(map->ptr + far, "rr");
+
+    mmap_close(map);
+    FILE_CLOSE(fd);
+    test_remove_db(fname);
+}
+
+static void put_keys(struct nio_t* nio)
+{
+    char key[32], val[2048];
+    int i;
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+}
+
+static void verify_keys(struct nio_t* nio)
+{
+    int i;
+
+    for (i = 0; i < NUM_KEYS; i++)
+        TEST_CHECK(test_verify(nio, i, 0));
+}
+
+static const int lock_props[] = {
+    NIO_MMAP_ADVICE, MMAP_ADVISE_RANDOM, NIO_MMAP_LOCK, 1, 0
+};
+
+static struct nio_t* open_db(const char* fname, int dbtype, int create)
+{
+    struct nio_t* nio;
+
+    nio = test_open_db(fname, dbtype, lock_props, create);
+    TEST_CHECK(nio->mmap->advice == MMAP_ADVISE_RANDOM);
+    CHECK_FLAG(nio->mmap->ptr, "rr");
+    return nio;
+}
+
+/* ヘッダーなどのメタデータが固定され、クローズで解除されます。*/
+static void test_nio(const char* fname, int dbtype)
+{
+    struct nio_t* nio;
+    int64 base;
+
+    test_remove_db(fname);
+    base = vm_locked();
+    nio = open_db(fname, dbtype, 1);
+    if (base >= 0)
+        TEST_CHECK(vm_locked() > base);
+    put_keys(nio);
+    verify_keys(nio);
+    test_close_db(nio);
+    if (base >= 0)
+        TEST_CHECK(vm_locked() == base);
+
+    nio = open_db(fname, dbtype, 0);
+    if (base >= 0)
+        TEST_CHECK(vm_locked() > base);
+    verify_keys(nio);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+int main()
+{
+    const char* fname;
+    struct nio_t* nio;
+
+    fname = test_start("mmap_advise");
+    test_mmap(fname);
+
+    nio = nio_initialize(NIO_HASH);
+    TEST_CHECK(nio_property(nio, NIO_MMAP_ADVICE, MMAP_ADVISE_HUGEPAGE + 1) < 0);
+    nio_finalize(nio);
+    test_nio(fname, NIO_HASH);
+    test_nio(fname, NIO_BTREE);
+    return test_end();
+}
@@ -0,0 +1,197 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* MMAP_AUTO_SIZE のメモリマップが予約したアドレス空間の中で
+   ビューを移動せずに拡張されることを確認します。
+   予約を超えて拡張した場合も固定中のポインタが有効であることと、
+   複数のスレッドから拡張した領域が重ならないことも確認します。*/
+
+#define PAGESIZE        4096
+#define NUM_PAGES       (64 * 256)  /* 64MB */
+#define NUM_THREADS     4
+#define NUM_EXTENDS     1000
+
+static void make_page(char* page, int64 n)
+{
+    int j;
+
+    for (j = 0; j < PAGESIZE; j++)
+        page[j] = (char)(n * 31 + j);
+    memcpy(page, &n, sizeof(n));
+}
+
+static int check_page(const char* page, int64 n)
+{
+    char buf[PAGESIZE];
+
+    make_page(buf, n);
+    return memcmp(page, buf, PAGESIZE) == 0;
+}
+
+static int check_map_page(struct mmap_t* map, int64 offset, int64 n)
+{
+    char buf[PAGESIZE];
+
+    if (mmap_pread(map, buf, PAGESIZE, offset) != PAGESIZE)
+        return 0;
+    return check_page(buf, n);
+}
+
+static int check_file_page(int fd, int64 offset, int64 n)
+{
+    char buf[PAGESIZE];
+
+    if (pread(fd, buf, PAGESIZE, (off_t)offset) != PAGESIZE)
+        return 0;
+    return check_page(buf, n);
+}
+
+static struct mmap_t* ext_map;
+static int64 ext_offset[NUM_THREADS][NUM_EXTENDS];
+
+static void* extend_thread(void* arg)
+{
+    int t = (int)(intptr_t)arg;
+    char page[PAGESIZE];
+    int i;
+
+    for (i = 0; i < NUM_EXTENDS; i++) {
+        int64 offset = mmap_extend(ext_map, PAGESIZE);
+
+        ext_offset[t][i] = offset;
+        make_page(page, (int64)(t + 1) * 1000000 + i);
+        TEST_CHECK(mmap_pwrite(ext_map, page, PAGESIZE, offset) == PAGESIZE);
+    }
+    return NULL;
+}
+
+static void check_extend(struct mmap_t* map)
+{
+    pthread_t th[NUM_THREADS];
+    int t, i;
+
+    ext_map = map;
+    for (t = 0; t < NUM_THREADS; t++)
+        pthread_create(&th[t], NULL, extend_thread, (void*)(intptr_t)t);
+    for (t = 0; t < NUM_THREADS; t++)
+        pthread_join(th[t], NULL);
+
+    for (t = 0; t < NUM_THREADS; t++) {
+        for (i = 0; i < NUM_EXTENDS; i++)
+            TEST_CHECK(check_map_page(map, ext_offset[t][i], (int64)(t + 1) * 1000000 + i));
+    }
+}
+
+int main()
+{
+    const char* fname;
+    int fd;
+    struct mmap_t* map;
+    char page[PAGESIZE];
+    char* pin;
+    void* ptr;
+    int64 n, size, far, reserve_size;
+    int reserved, moved = 0;
+
+    fname = test_start("mmap_reserve");
+    fd = FILE_OPEN(fname, O_RDWR|O_CREAT|O_BINARY, CREATE_MODE);
+    TEST_CHECK(fd >= 0);
+    if (fd < 0)
+        return test_end();
+    map = mmap_open(fd, MMAP_READWRITE, MMAP_AUTO_SIZE);
+    TEST_CHECK(map != NULL);
+    if (map == NULL)
+        return test_end();
+    mmap_mtsafe(map, 1);
+    /* 64ビット環境では 1GB 以上のアドレス空間を予約します。*/
+    reserved = (sizeof(void*) >= 8 && map->reserve_size > 0);
+#ifndef _WIN32
+    if (sizeof(void*) >= 8)
+        TEST_CHECK(map->reserve_size >= (int64)1024*1024*1024);
+#endif
+
+    make_page(page, 0);
+    TEST_CHECK(mmap_pwrite(map, page, PAGESIZE, 0) == PAGESIZE);
+    pin = mmap_pin(map, 0, PAGESIZE);
+    TEST_CHECK(pin != NULL);
+    ptr = map->ptr;
+
+    /* 予約の範囲内ではビューを移動せずに拡張します。*/
+    for (n = 1; n < NUM_PAGES; n++) {
+        make_page(page, n);
+        TEST_CHECK(mmap_pwrite(map, page, PAGESIZE, n * PAGESIZE) == PAGESIZE);
+        if (map->ptr != ptr) {
+            moved++;
+            ptr = map->ptr;
+        }
+    }
+    if (reserved)
+        TEST_CHECK(moved == 0);
+    TEST_CHECK(map->real_size == (int64)NUM_PAGES * PAGESIZE);
+    if (pin)
+        TEST_CHECK(check_page(pin, 0));
+    for (n = 0; n < NUM_PAGES; n += 97)
+        TEST_CHECK(check_map_page(map, n * PAGESIZE, n));
+
+    check_extend(map);
+    size = map->real_size;
+    TEST_CHECK(size == (int64)(NUM_PAGES + NUM_THREADS * NUM_EXTENDS) * PAGESIZE);
+
+    /* 予約を超えるとビューを作り直しますが固定中のポインタは有効です。*/
+    reserve_size = map->reserve_size;
+    far = ((reserve_size > size)? reserve_size : size) + PAGESIZE;
+    make_page(page, far / PAGESIZE);
+    TEST_CHECK(mmap_pwrite(map, page, PAGESIZE, far) == PAGESIZE);
+    TEST_CHECK(map->real_size == far + PAGESIZE);
+    if (reserved)
+        TEST_CHECK(map->reserve_size > reserve_size);
+    if (pin) {
+        TEST_CHECK(check_page(pin, 0));
+        mmap_unpin(map);
+    }
+    TEST_CHECK(check_map_page(map, far, far / PAGESIZE));
+    for (n = 0; n < NUM_PAGES; n += 97)
+        TEST_CHECK(check_map_page(map, n * PAGESIZE, n));
+
+    TEST_CHECK(mmap_sync(map) == 0);
+    for (n = 0; n < NUM_PAGES; n += 97)
+        TEST_CHECK(check_file_page(fd, n * PAGESIZE, n));
+    TEST_CHECK(check_file_page(fd, far, far / PAGESIZE));
+    mmap_close(map);
+
+    /* 再オープンしても同じ内容を参照できます。*/
+    map = mmap_open(fd, MMAP_READWRITE, MMAP_AUTO_SIZE);
+    TEST_CHECK(map != NULL);
+    if (map) {
+        TEST_CHECK(map->real_size >= far + PAGESIZE);
+        for (n = 0; n < NUM_PAGES; n += 97)
+            TEST_CHECK(check_map_page(map, n * PAGESIZE, n));
+        TEST_CHECK(check_map_page(map, far, far / PAGESIZE));
+        mmap_close(map);
+    }
+    FILE_CLOSE(fd);
+    return test_end();
+}
@@ -0,0 +1,159 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* nio_mput(), nio_mget(), nio_mdelete() でキー順ではない複数のキーを
+   まとめて処理します。バッチ内の同じキーは指定された順序で処理されます。*/
+
+#define NUM_KEYS        4000
+#define BATCH_SIZE      100
+
+struct item_buf_t {
+    char key[32];
+    char val[2048];
+};
+
+static struct nio_batch_t items[BATCH_SIZE];
+static struct item_buf_t bufs[BATCH_SIZE];
+
+/* バッチの n 番目の要素にキー i を設定します。*/
+static void set_item(int n, int i, int gen)
+{
+    items[n].key = bufs[n].key;
+    items[n].keysize = test_key(bufs[n].key, i);
+    items[n].val = bufs[n].val;
+    items[n].valsize = (gen >= 0)? test_val(bufs[n].val, i, gen) : (int)sizeof(bufs[n].val);
+    items[n].result = 0;
+}
+
+/* キーは間隔を空けてバッチに振り分けます。*/
+static int batch_key(int b, int n)
+{
+    return n * (NUM_KEYS / BATCH_SIZE) + b;
+}
+
+static void run(const char* fname, int dbtype, int datapack)
+{
+    struct nio_t* nio;
+    char val[2048];
+    int b, n, i, vsize;
+    int props[] = { NIO_DATAPACK, datapack, 0 };
+
+    if (dbtype != NIO_BTREE) {
+        props[0] = NIO_LOCK_STRIPES;
+        props[1] = 8;
+    }
+    nio = test_open_db(fname, dbtype, props, 1);
+
+    for (b = 0; b < NUM_KEYS / BATCH_SIZE; b++) {
+        for (n = 0; n < BATCH_SIZE; n++)
+            set_item(n, batch_key(b, BATCH_SIZE - n - 1), 0);
+        TEST_CHECK(nio_mput(nio, items, BATCH_SIZE) == BATCH_SIZE);
+        for (n = 0; n < BATCH_SIZE; n++)
+            TEST_CHECK(items[n].result == 0);
+    }
+    for (i = 0; i < NUM_KEYS; i++)
+        TEST_CHECK(test_verify(nio, i, 0));
+
+    /* 同じキーを二回指定した場合は後の値になります。*/
+    set_item(0, 10, 1);
+    set_item(1, 20, 1);
+    set_item(2, 10, 2);
+    TEST_CHECK(nio_mput(nio, items, 3) == 3);
+    TEST_CHECK(test_verify(nio, 10, 2));
+    TEST_CHECK(test_verify(nio, 20, 1));
+
+    /* 存在しないキーは -1、領域が足りない場合は -2 になります。*/
+    set_item(0, 30, -1);
+    set_item(1, NUM_KEYS + 1, -1);
+    set_item(2, 20, -1);
+    set_item(3, 40, -1);
+    items[3].valsize = 0;
+    TEST_CHECK(nio_mget(nio, items, 4) == 2);
+    vsize = test_val(val, 30, 0);
+    TEST_CHECK(items[0].result == vsize && memcmp(items[0].val, val, vsize) == 0);
+    TEST_CHECK(items[1].result == -1);
+    vsize = test_val(val, 20, 1);
+    TEST_CHECK(items[2].result == vsize && memcmp(items[2].val, val, vsize) == 0);
+    TEST_CHECK(items[3].result == -2);
+
+    /* 偶数のキーを削除します。*/
+    for (b = 0; b < NUM_KEYS / BATCH_SIZE; b += 2) {
+        for (n = 0; n < BATCH_SIZE; n++)
+            set_item(n, batch_key(b, n), -1);
+        TEST_CHECK(nio_mdelete(nio, items, BATCH_SIZE) == BATCH_SIZE);
+    }
+    set_item(0, 0, -1);
+    TEST_CHECK(nio_mdelete(nio, items, 1) == 0);
+    TEST_CHECK(items[0].result < 0);
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        if (i % 2 == 0) {
+            char key[32];
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(nio_find(nio, key, ksize) < 0);
+        } else if (i != 10 && i != 20) {
+            TEST_CHECK(test_verify(nio, i, 0));
+        }
+    }
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+/* 線形ハッシュでは一回の nio_mput() で追加した件数分だけ分割されます。*/
+static void run_linear(const char* fname)
+{
+    struct nio_t* nio;
+    struct hdb_t* hdb;
+    int b, n;
+    int props[] = { NIO_LOCK_STRIPES, 8, NIO_BUCKET_NUM, 16, NIO_LINEAR_HASH, 4, 0 };
+
+    nio = test_open_db(fname, NIO_HASH, props, 1);
+    for (b = 0; b < NUM_KEYS / BATCH_SIZE; b++) {
+        for (n = 0; n < BATCH_SIZE; n++)
+            set_item(n, batch_key(b, n), 0);
+        TEST_CHECK(nio_mput(nio, items, BATCH_SIZE) == BATCH_SIZE);
+    }
+    hdb = (struct hdb_t*)nio->db;
+    n = (hdb->bucket_num << (int)(hdb->lh_state >> 32)) + (int)(hdb->lh_state & 0xFFFFFFFF);
+    TEST_CHECK(n >= NUM_KEYS / 4 / 2);
+    for (b = 0; b < NUM_KEYS; b++)
+        TEST_CHECK(test_verify(nio, b, 0));
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("nio_batch");
+    run(fname, NIO_HASH, 0);
+    run(fname, NIO_BTREE, 1);
+    run(fname, NIO_BTREE, 0);
+    run_linear(fname);
+    return test_end();
+}
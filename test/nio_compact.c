@@ -0,0 +1,314 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <sys/wait.h>
+#include "test.h"
+
+/* nio_compact() でデータベースファイルを圧縮します。
+   キーの大半を削除した後に圧縮してファイルが小さくなること、
+   圧縮中に別のスレッドから参照できること、
+   圧縮中にファイルが大きくなっても削減サイズが負にならないこと、
+   カーソルがオープンされている間はキーを移動しないこと、
+   圧縮の途中で終了しても空き領域が失われないことを確認します。*/
+
+#define NUM_KEYS        20000
+#define NUM_READERS     2
+
+static struct nio_t* nio;
+static volatile int compacting;
+
+/* prop はゼロ以外の場合に 1 を設定する B+木のプロパティです。*/
+static struct nio_t* open_db(const char* fname, int dbtype, int datapack, int prop, int create)
+{
+    int props[] = { NIO_DATAPACK, datapack, prop, 1, 0 };
+
+    if (dbtype == NIO_HASH) {
+        props[0] = NIO_BUCKET_NUM;
+        props[1] = 10000;
+        props[2] = 0;
+    }
+    return test_open_db(fname, dbtype, props, create);
+}
+
+static void put_keys(int from, int to, int gen)
+{
+    char key[32], val[2048];
+    int i;
+
+    for (i = from; i < to; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, gen);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+}
+
+/* 10 個に 9 個のキーを削除します。*/
+static void delete_keys(void)
+{
+    char key[32];
+    int i;
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        if (i % 10 != 0) {
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(nio_delete(nio, key, ksize) == 0);
+        }
+    }
+}
+
+static void verify_keys(int to)
+{
+    char key[32];
+    int i;
+
+    for (i = 0; i < to; i++) {
+        if (i % 10 == 0 || i >= NUM_KEYS) {
+            TEST_CHECK(test_verify(nio, i, 0));
+        } else {
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(nio_get(nio, key, ksize, NULL, 0) < 0);
+        }
+    }
+}
+
+static void* reader(void* arg)
+{
+    int t = (int)(intptr_t)arg;
+    int i;
+
+    while (compacting) {
+        for (i = t * 10; i < NUM_KEYS; i += NUM_READERS * 10)
+            TEST_CHECK(test_verify(nio, i, 0));
+    }
+    return NULL;
+}
+
+/* 削除したキーの領域が回収されることを確認します。*/
+static void test_reclaim(const char* fname, int dbtype, int datapack, int prop)
+{
+    pthread_t th[NUM_READERS];
+    int64 reclaimed = 0;
+    int64 size;
+    int i, result;
+
+    nio = open_db(fname, dbtype, datapack, prop, 1);
+    put_keys(0, NUM_KEYS, 0);
+    delete_keys();
+    size = nio_filesize(nio);
+
+    compacting = 1;
+    for (i = 0; i < NUM_READERS; i++)
+        pthread_create(&th[i], NULL, reader, (void*)(intptr_t)i);
+    while ((result = nio_compact(nio, 1, &reclaimed)) == 1)
+        ;
+    compacting = 0;
+    for (i = 0; i < NUM_READERS; i++)
+        pthread_join(th[i], NULL);
+
+    TEST_CHECK(result == 0);
+    TEST_CHECK(reclaimed > size / 4);
+    TEST_CHECK(nio_filesize(nio) == size - reclaimed);
+    verify_keys(NUM_KEYS);
+    if (prop == NIO_ORDER_STAT) {
+        char key[32];
+        int ksize;
+
+        /* 連結したリーフのキー数がブランチに反映されていることを確認します。*/
+        ksize = test_key(key, NUM_KEYS / 2);
+        TEST_CHECK(nio_count_range(nio, NULL, 0, NULL, 0, 0) == NUM_KEYS / 10);
+        TEST_CHECK(nio_count_range(nio, NULL, 0, key, ksize, 0) == NUM_KEYS / 20);
+    }
+    test_close_db(nio);
+
+    nio = open_db(fname, dbtype, datapack, prop, 0);
+    verify_keys(NUM_KEYS);
+    put_keys(NUM_KEYS, NUM_KEYS + 1000, 0);
+    verify_keys(NUM_KEYS + 1000);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+/* 圧縮中にファイルが大きくなった場合を確認します。*/
+static void test_grow(const char* fname, int dbtype, int datapack)
+{
+    int64 reclaimed = -1;
+    int i, n, result;
+
+    nio = open_db(fname, dbtype, datapack, 0, 1);
+    put_keys(0, NUM_KEYS, 0);
+    delete_keys();
+
+    /* 圧縮の途中でファイルの最後にキーを追加します。*/
+    n = NUM_KEYS;
+    for (i = 0; (result = nio_compact(nio, 1, &reclaimed)) == 1; i++) {
+        if (i % 50 == 0) {
+            put_keys(n, n + 100, 0);
+            n += 100;
+        }
+    }
+    TEST_CHECK(result == 0);
+    TEST_CHECK(reclaimed >= 0);
+    verify_keys(n);
+    test_close_db(nio);
+
+    nio = open_db(fname, dbtype, datapack, 0, 0);
+    verify_keys(n);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+static char seen[NUM_KEYS * 2];
+
+/* カーソルで読み込みながら圧縮とキーの追加を行います。
+   カーソルは残っているキーを一度ずつ返す必要があります。*/
+static void test_cursor(const char* fname, int dbtype)
+{
+    struct nio_cursor_t* cur;
+    char key[32];
+    int i, n, ksize, result;
+
+    nio = open_db(fname, dbtype, 0, 0, 1);
+    put_keys(0, NUM_KEYS, 0);
+    delete_keys();
+
+    memset(seen, 0, sizeof(seen));
+    n = NUM_KEYS;
+    cur = nio_cursor_open(nio);
+    TEST_CHECK(cur != NULL);
+    /* 他のキーの連結をたどって繰り返さないように回数を制限します。*/
+    for (i = 0; i < NUM_KEYS * 2 && (ksize = nio_cursor_key(cur, key, sizeof(key) - 1)) > 0; i++) {
+        int k;
+
+        key[ksize] = '\0';
+        k = atoi(key + 3);
+        TEST_CHECK(k >= 0 && k < NUM_KEYS * 2);
+        if (k < 0 || k >= NUM_KEYS * 2)
+            break;
+        seen[k]++;
+        if (i % 20 == 0) {
+            /* 移動した領域が追加したキーで再利用されないことを確認します。*/
+            TEST_CHECK(nio_compact(nio, 10, NULL) == 1);
+            put_keys(n, n + 10, 0);
+            n += 10;
+        }
+        if (nio_cursor_next(cur) != 0)
+            break;
+    }
+    nio_cursor_close(cur);
+
+    for (i = 0; i < NUM_KEYS; i++)
+        TEST_CHECK(seen[i] == ((i % 10 == 0)? 1 : 0));
+    for (i = NUM_KEYS; i < n; i++)
+        TEST_CHECK(seen[i] <= 1);
+
+    /* クローズした後は最後まで圧縮できます。*/
+    while ((result = nio_compact(nio, 10, NULL)) == 1)
+        ;
+    TEST_CHECK(result == 0);
+    verify_keys(n);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+/* B+木はリーフのキャッシュを書き出すためにログを使用します。*/
+static const int crash_hash_props[] = { NIO_BUCKET_NUM, 10000, 0 };
+static const int crash_btree_props[] = { NIO_WAL, 1, 0 };
+
+/* 圧縮の途中でクローズせずに終了します。*/
+static void child_compact(const char* fname, int dbtype, const int* props)
+{
+    int i;
+
+    nio = test_open_db(fname, dbtype, props, 1);
+    if (nio == NULL)
+        _exit(1);
+    put_keys(0, NUM_KEYS, 0);
+    delete_keys();
+    for (i = 0; i < 20; i++) {
+        if (nio_compact(nio, 1, NULL) != 1)
+            _exit(1);
+    }
+    _exit(0);
+}
+
+/* 圧縮の途中で終了したデータベースを再オープンします。
+   空き領域管理ページが残っているため削除したキーの領域に
+   ファイルを拡張せずにキーを追加できます。*/
+static void test_crash(const char* fname, int dbtype, const int* props)
+{
+    int64 size;
+    pid_t pid;
+    int status, result;
+
+    test_remove_db(fname);
+    pid = fork();
+    if (pid == 0)
+        child_compact(fname, dbtype, props);
+    waitpid(pid, &status, 0);
+    TEST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    nio = test_open_db(fname, dbtype, props, 0);
+    verify_keys(NUM_KEYS);
+    size = nio_filesize(nio);
+    put_keys(NUM_KEYS, NUM_KEYS + NUM_KEYS / 4, 0);
+    TEST_CHECK(nio_filesize(nio) == size);
+    while ((result = nio_compact(nio, 10, NULL)) == 1)
+        ;
+    TEST_CHECK(result == 0);
+    verify_keys(NUM_KEYS + NUM_KEYS / 4);
+    test_close_db(nio);
+
+    nio = test_open_db(fname, dbtype, props, 0);
+    verify_keys(NUM_KEYS + NUM_KEYS / 4);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("nio_compact");
+
+    test_reclaim(fname, NIO_HASH, 0, 0);
+    test_reclaim(fname, NIO_BTREE, 1, 0);
+    test_reclaim(fname, NIO_BTREE, 0, 0);
+    test_reclaim(fname, NIO_BTREE, 0, NIO_CONCURRENT_READ);
+    test_reclaim(fname, NIO_BTREE, 1, NIO_ORDER_STAT);
+    test_reclaim(fname, NIO_BTREE, 0, NIO_PREFIX_COMPRESS);
+
+    test_grow(fname, NIO_HASH, 0);
+    test_grow(fname, NIO_BTREE, 1);
+    test_grow(fname, NIO_BTREE, 0);
+
+    test_cursor(fname, NIO_HASH);
+    test_cursor(fname, NIO_BTREE);
+
+    test_crash(fname, NIO_HASH, crash_hash_props);
+    test_crash(fname, NIO_BTREE, crash_btree_props);
+    return test_end();
+}
@@ -0,0 +1,324 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* NIO_COMPRESS で圧縮した値を各取得関数で元の値として読めることを確認します。
+   圧縮方式を変えて再オープンし、圧縮方式の異なるレコードが混在した
+   ファイルを読めることと、圧縮しやすい値でファイルが小さくなることも確認します。*/
+
+#define NUM_KEYS        3000
+#define MAX_VALSIZE     4000
+
+/* i 番目の世代 gen の値を設定して値のサイズを返します。
+   3 つにひとつは圧縮できない擬似乱数の値になります。*/
+static int make_val(char* val, int i, int gen)
+{
+    int size, j;
+    unsigned int x;
+
+    size = 1 + (i * 131 + gen * 977) % MAX_VALSIZE;
+    if (i % 3 == 0) {
+        x = (unsigned int)(i * 2654435761U + gen + 1);
+        for (j = 0; j < size; j++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            val[j] = (char)x;
+        }
+    } else {
+        for (j = 0; j < size; j++)
+            val[j] = "compress value "[(j + i + gen) % 15];
+    }
+    return size;
+}
+
+static int gen_of(int i, int round)
+{
+    return (i % 4 < round)? round : 0;
+}
+
+/* 2 回目の更新は nio_mput() でまとめて設定します。*/
+static void mput_keys(struct nio_t* nio, int round)
+{
+    struct nio_batch_t items[16];
+    char keys[16][32];
+    static char vals[16][MAX_VALSIZE];
+    int i, n = 0;
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        if (i % 4 < round) {
+            items[n].key = keys[n];
+            items[n].keysize = test_key(keys[n], i);
+            items[n].val = vals[n];
+            items[n].valsize = make_val(vals[n], i, round);
+            n++;
+        }
+        if (n == 16 || (i == NUM_KEYS - 1 && n > 0)) {
+            TEST_CHECK(nio_mput(nio, items, n) == n);
+            n = 0;
+        }
+    }
+}
+
+static void put_keys(struct nio_t* nio, int round)
+{
+    char key[32], val[MAX_VALSIZE];
+    int i;
+
+    if (round == 2) {
+        mput_keys(nio, round);
+        return;
+    }
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize, vsize;
+
+        if (i % 4 >= round && round > 0)
+            continue;
+        ksize = test_key(key, i);
+        vsize = make_val(val, i, round);
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+}
+
+static void verify_key(struct nio_t* nio, int i, int gen)
+{
+    char key[32], val[MAX_VALSIZE], buf[MAX_VALSIZE];
+    int ksize, vsize, size;
+    void* p;
+    struct nio_view_t view;
+
+    ksize = test_key(key, i);
+    vsize = make_val(val, i, gen);
+    TEST_CHECK(nio_get(nio, key, ksize, buf, sizeof(buf)) == vsize &&
+               memcmp(buf, val, vsize) == 0);
+    TEST_CHECK(nio_find(nio, key, ksize) == vsize);
+    p = nio_aget(nio, key, ksize, &size);
+    TEST_CHECK(p != NULL && size == vsize && memcmp(p, val, vsize) == 0);
+    if (p)
+        nio_free(nio, p);
+    if (i % 7 == 0) {
+        TEST_CHECK(nio_get_view(nio, key, ksize, &view) == vsize);
+        TEST_CHECK(view.valsize == vsize && memcmp(view.val, val, vsize) == 0);
+        nio_release_view(nio, &view);
+    }
+}
+
+static void verify_mget(struct nio_t* nio, int round)
+{
+    struct nio_batch_t items[16];
+    char keys[16][32];
+    static char vals[16][MAX_VALSIZE];
+    char val[MAX_VALSIZE];
+    int i, n;
+
+    for (i = 0; i < NUM_KEYS; i += 16) {
+        for (n = 0; n < 16 && i + n < NUM_KEYS; n++) {
+            items[n].key = keys[n];
+            items[n].keysize = test_key(keys[n], i + n);
+            items[n].val = vals[n];
+            items[n].valsize = MAX_VALSIZE;
+        }
+        TEST_CHECK(nio_mget(nio, items, n) == n);
+        while (n-- > 0) {
+            int vsize = make_val(val, i + n, gen_of(i + n, round));
+
+            TEST_CHECK(items[n].result == vsize && memcmp(items[n].val, val, vsize) == 0);
+        }
+    }
+}
+
+static void verify_cursor(struct nio_t* nio, int round)
+{
+    struct nio_cursor_t* cur;
+    char val[MAX_VALSIZE], buf[MAX_VALSIZE];
+    int i;
+
+    cur = nio_cursor_open(nio);
+    TEST_CHECK(cur != NULL);
+    if (cur == NULL)
+        return;
+    for (i = 0; i < NUM_KEYS; i++) {
+        int vsize = make_val(val, i, gen_of(i, round));
+
+        TEST_CHECK(nio_cursor_value(cur, buf, sizeof(buf)) == vsize &&
+                   memcmp(buf, val, vsize) == 0);
+        if (nio_cursor_next(cur) != 0)
+            break;
+    }
+    TEST_CHECK(i == NUM_KEYS - 1);
+    nio_cursor_close(cur);
+}
+
+struct scan_arg_t {
+    int next;
+    int round;
+};
+
+static int scan_func(void* arg, struct nio_batch_t* items, int count)
+{
+    struct scan_arg_t* sa = (struct scan_arg_t*)arg;
+    char val[MAX_VALSIZE];
+    int n;
+
+    for (n = 0; n < count; n++) {
+        int i = sa->next++;
+        int vsize = make_val(val, i, gen_of(i, sa->round));
+
+        TEST_CHECK(items[n].valsize == vsize && memcmp(items[n].val, val, vsize) == 0);
+    }
+    return 0;
+}
+
+static void verify_all(struct nio_t* nio, int dbtype, int round)
+{
+    struct scan_arg_t sa;
+    int i;
+
+    for (i = 0; i < NUM_KEYS; i++)
+        verify_key(nio, i, gen_of(i, round));
+    verify_mget(nio, round);
+    if (dbtype == NIO_BTREE) {
+        verify_cursor(nio, round);
+        sa.next = 0;
+        sa.round = round;
+        TEST_CHECK(nio_scan(nio, NULL, 0, NULL, 0, 0, scan_func, &sa) == NUM_KEYS);
+        TEST_CHECK(sa.next == NUM_KEYS);
+    }
+}
+
+static struct nio_t* open_db(const char* fname, int dbtype,
+                             int codec, int threshold, int create)
+{
+    int props[] = {
+        NIO_BUCKET_NUM, 1000,
+        NIO_COMPRESS, codec,
+        NIO_COMPRESS_THRESHOLD, threshold, 0
+    };
+
+    if (dbtype == NIO_BTREE) {
+        /* データパックの値は圧縮されません。*/
+        props[0] = NIO_DATAPACK;
+        props[1] = 0;
+    }
+    if (threshold < 0)
+        props[4] = 0;
+    return test_open_db(fname, dbtype, props, create);
+}
+
+/* 圧縮方式を codec, codec2, NIO_COMP_NONE と変えて更新します。*/
+static void run(const char* fname, int dbtype, int codec, int codec2, int threshold)
+{
+    struct nio_t* nio;
+
+    test_remove_db(fname);
+    nio = open_db(fname, dbtype, codec, threshold, 1);
+    put_keys(nio, 0);
+    verify_all(nio, dbtype, 0);
+    put_keys(nio, 1);
+    verify_all(nio, dbtype, 1);
+    test_close_db(nio);
+
+    nio = open_db(fname, dbtype, codec2, threshold, 0);
+    verify_all(nio, dbtype, 1);
+    put_keys(nio, 2);
+    verify_all(nio, dbtype, 2);
+    test_close_db(nio);
+
+    nio = open_db(fname, dbtype, NIO_COMP_NONE, -1, 0);
+    verify_all(nio, dbtype, 2);
+    put_keys(nio, 3);
+    verify_all(nio, dbtype, 3);
+    test_close_db(nio);
+}
+
+/* 圧縮しやすい値だけを格納したファイルのサイズを返します。*/
+static int64 filesize(const char* fname, int dbtype, int codec)
+{
+    struct nio_t* nio;
+    char key[32], val[MAX_VALSIZE];
+    int i;
+    int64 size;
+
+    test_remove_db(fname);
+    nio = open_db(fname, dbtype, codec, -1, 1);
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize = test_key(key, i);
+        int vsize = make_val(val, (i % 3 == 0)? i + 1 : i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    size = nio_filesize(nio);
+    test_close_db(nio);
+    test_remove_db(fname);
+    return size;
+}
+
+static void check_size(const char* fname, int dbtype, int codec)
+{
+    int64 plain, comp;
+
+    plain = filesize(fname, dbtype, NIO_COMP_NONE);
+    comp = filesize(fname, dbtype, codec);
+    TEST_CHECK(comp < plain / 2);
+}
+
+/* zlib なしでビルドされたライブラリは NIO_COMP_ZLIB を指定できません。*/
+static int has_zlib(void)
+{
+    struct nio_t* nio;
+    int result;
+
+    nio = nio_initialize(NIO_HASH);
+    result = (nio_property(nio, NIO_COMPRESS, NIO_COMP_ZLIB) == 0);
+    nio_finalize(nio);
+    return result;
+}
+
+int main()
+{
+    const char* fname;
+    struct nio_t* nio;
+    int zlib;
+
+    fname = test_start("nio_compress");
+    zlib = has_zlib();
+
+    nio = nio_initialize(NIO_HASH);
+    TEST_CHECK(nio_property(nio, NIO_COMPRESS, NIO_COMP_MAX + 1) < 0);
+    TEST_CHECK(nio_property(nio, NIO_COMPRESS_THRESHOLD, -1) < 0);
+    nio_finalize(nio);
+
+    run(fname, NIO_HASH, NIO_COMP_LZ, zlib? NIO_COMP_ZLIB : NIO_COMP_NONE, -1);
+    run(fname, NIO_BTREE, NIO_COMP_LZ, zlib? NIO_COMP_ZLIB : NIO_COMP_NONE, -1);
+    check_size(fname, NIO_HASH, NIO_COMP_LZ);
+    check_size(fname, NIO_BTREE, NIO_COMP_LZ);
+    if (zlib) {
+        run(fname, NIO_HASH, NIO_COMP_ZLIB, NIO_COMP_LZ, 1);
+        run(fname, NIO_BTREE, NIO_COMP_ZLIB, NIO_COMP_LZ, 1);
+        check_size(fname, NIO_HASH, NIO_COMP_ZLIB);
+        check_size(fname, NIO_BTREE, NIO_COMP_ZLIB);
+    }
+    return test_end();
+}
@@ -0,0 +1,126 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* 空き領域のサイズクラス索引を確認します。
+   サイズの異なる値の削除と追加を繰り返して空き領域が再利用され、
+   ファイルが大きくなり続けないことを確認します。
+   途中で再オープンして空き領域管理ページから索引を作り直します。*/
+
+#define NUM_KEYS        6000
+#define NUM_ROUNDS      6
+
+/* 世代 gen の値を設定して値のサイズを返します。サイズは 1 から 1500 バイトです。*/
+static int make_val(char* val, int i, int gen)
+{
+    int size, j;
+
+    size = 1 + (i * 37 + gen * 101) % 1500;
+    for (j = 0; j < size; j++)
+        val[j] = (char)('A' + (i + j + gen) % 26);
+    return size;
+}
+
+static int check_val(struct nio_t* nio, int i, int gen)
+{
+    char key[32], val[2048], buf[2048];
+    int ksize, vsize;
+
+    ksize = test_key(key, i);
+    vsize = make_val(val, i, gen);
+    if (nio_get(nio, key, ksize, buf, sizeof(buf)) != vsize)
+        return 0;
+    return memcmp(buf, val, vsize) == 0;
+}
+
+static struct nio_t* open_db(const char* fname, int dbtype, int create)
+{
+    static const int hash_props[] = { NIO_BUCKET_NUM, 4000, 0 };
+    static const int btree_props[] = { NIO_DATAPACK, 0, 0 };
+
+    return test_open_db(fname, dbtype, (dbtype == NIO_HASH)? hash_props : btree_props, create);
+}
+
+static void run(const char* fname, int dbtype)
+{
+    struct nio_t* nio;
+    char key[32], val[2048];
+    int64 size = 0;
+    int i, r;
+    int gen[NUM_KEYS];
+
+    nio = open_db(fname, dbtype, 1);
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize = test_key(key, i);
+        int vsize = make_val(val, i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+        gen[i] = 0;
+    }
+
+    for (r = 1; r <= NUM_ROUNDS; r++) {
+        /* 半分のキーを削除してから別のサイズで追加します。*/
+        for (i = r % 2; i < NUM_KEYS; i += 2) {
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(nio_delete(nio, key, ksize) == 0);
+        }
+        if (r == NUM_ROUNDS / 2) {
+            test_close_db(nio);
+            nio = open_db(fname, dbtype, 0);
+        }
+        for (i = r % 2; i < NUM_KEYS; i += 2) {
+            int ksize = test_key(key, i);
+            int vsize = make_val(val, i, r);
+
+            TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+            gen[i] = r;
+        }
+        /* 2 回目以降はファイルがほとんど大きくなりません。*/
+        if (r == 2)
+            size = nio_filesize(nio);
+        else if (r > 2)
+            TEST_CHECK(nio_filesize(nio) < size + size / 5);
+    }
+    for (i = 0; i < NUM_KEYS; i++)
+        TEST_CHECK(check_val(nio, i, gen[i]));
+    test_close_db(nio);
+
+    nio = open_db(fname, dbtype, 0);
+    for (i = 0; i < NUM_KEYS; i++)
+        TEST_CHECK(check_val(nio, i, gen[i]));
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("nio_freeidx");
+    run(fname, NIO_HASH);
+    run(fname, NIO_BTREE);
+    return test_end();
+}
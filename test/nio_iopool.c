@@ -0,0 +1,301 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* バッファプールを介して読み書きする MMAP_IO_FILE を確認します。
+   プールより大きなファイルをページにまたがる位置で読み書きし、
+   バックグラウンドの書き出し、先読み、縮小と複数のスレッドからの
+   読み書きを確認します。NIO_IO_BACKEND で作成したデータベースは
+   メモリマップでオープンしても同じ内容であることを確認します。
+   NIO_WAL は NIO_IO_BACKEND を指定しない場合だけバッファプールを使用します。*/
+
+#define POOL_SIZE       (256 * 1024)    /* 64 ページ */
+#define BLOCK_SIZE      5000            /* ページにまたがる書き込み単位 */
+#define NUM_BLOCKS      2000            /* 約 10MB */
+#define NUM_THREADS     4
+#define RANGE_BLOCKS    8               /* 一回で読み込むブロック数 */
+#define NUM_KEYS        20000
+
+static void make_block(char* buf, int n)
+{
+    int j;
+
+    for (j = 0; j < BLOCK_SIZE; j++)
+        buf[j] = (char)(n * 7 + j);
+}
+
+static int check_block(const char* data, int n)
+{
+    char buf[BLOCK_SIZE];
+
+    make_block(buf, n);
+    return memcmp(data, buf, BLOCK_SIZE) == 0;
+}
+
+static int check_map_block(struct mmap_t* map, int n)
+{
+    char buf[BLOCK_SIZE];
+
+    if (mmap_pread(map, buf, BLOCK_SIZE, (int64)n * BLOCK_SIZE) != BLOCK_SIZE)
+        return 0;
+    return check_block(buf, n);
+}
+
+static int check_file_block(int fd, int n)
+{
+    char buf[BLOCK_SIZE];
+
+    if (pread(fd, buf, BLOCK_SIZE, (off_t)n * BLOCK_SIZE) != BLOCK_SIZE)
+        return 0;
+    return check_block(buf, n);
+}
+
+static struct mmap_t* thread_map;
+
+/* スレッドごとに別のブロックを書き換えながら全体を読み込みます。*/
+static void* io_thread(void* arg)
+{
+    int t = (int)(intptr_t)arg;
+    char buf[BLOCK_SIZE];
+    int n;
+
+    for (n = t; n < NUM_BLOCKS; n += NUM_THREADS) {
+        make_block(buf, n);
+        TEST_CHECK(mmap_pwrite(thread_map, buf, BLOCK_SIZE, (int64)n * BLOCK_SIZE) == BLOCK_SIZE);
+        TEST_CHECK(check_map_block(thread_map, (n * 13) % NUM_BLOCKS));
+    }
+    return NULL;
+}
+
+/* 複数のページにまたがる範囲をまとめて読み込みます。*/
+static void* range_thread(void* arg)
+{
+    int t = (int)(intptr_t)arg;
+    char* buf;
+    int n, i;
+
+    buf = (char*)malloc(BLOCK_SIZE * RANGE_BLOCKS);
+    for (n = t * RANGE_BLOCKS; n + RANGE_BLOCKS <= NUM_BLOCKS; n += NUM_THREADS * RANGE_BLOCKS * 3) {
+        TEST_CHECK(mmap_pread(thread_map, buf, BLOCK_SIZE * RANGE_BLOCKS,
+                              (int64)n * BLOCK_SIZE) == BLOCK_SIZE * RANGE_BLOCKS);
+        for (i = 0; i < RANGE_BLOCKS; i++)
+            TEST_CHECK(check_block(buf + i * BLOCK_SIZE, n + i));
+    }
+    free(buf);
+    return NULL;
+}
+
+static void test_pool(const char* fname)
+{
+    int fd;
+    struct mmap_t* map;
+    pthread_t th[NUM_THREADS * 2];
+    char buf[BLOCK_SIZE * 2];
+    int n, t, flushed;
+    int64 size;
+    double start;
+
+    fd = FILE_OPEN(fname, O_RDWR|O_CREAT|O_BINARY, CREATE_MODE);
+    TEST_CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    map = mmap_open_pool(fd, MMAP_READWRITE, POOL_SIZE);
+    TEST_CHECK(map != NULL && map->pool != NULL);
+    if (map == NULL) {
+        FILE_CLOSE(fd);
+        return;
+    }
+    mmap_mtsafe(map, 1);
+
+    for (n = 0; n < NUM_BLOCKS; n++) {
+        make_block(buf, n);
+        TEST_CHECK(mmap_pwrite(map, buf, BLOCK_SIZE, (int64)n * BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    TEST_CHECK(map->real_size == (int64)NUM_BLOCKS * BLOCK_SIZE);
+    /* マップしないためポインタは返しません。*/
+    TEST_CHECK(mmap_pin(map, 0, BLOCK_SIZE) == NULL);
+    for (n = 0; n < NUM_BLOCKS; n++)
+        TEST_CHECK(check_map_block(map, n));
+    TEST_CHECK(mmap_pread(map, buf, BLOCK_SIZE, map->real_size - 10) == (size_t)-1);
+
+    /* 変更されたページはバックグラウンドで書き出されます。*/
+    start = test_msec();
+    do {
+        usleep(100 * 1000);
+        flushed = check_file_block(fd, NUM_BLOCKS - 1) && check_file_block(fd, 0);
+    } while (! flushed && test_msec() - start < 5000);
+    TEST_CHECK(flushed);
+
+    mmap_prefetch(map, 0, POOL_SIZE);
+    for (n = 0; n < POOL_SIZE / BLOCK_SIZE; n++)
+        TEST_CHECK(check_map_block(map, n));
+
+    /* 読み込みと書き出しが並行するようにプールより広い範囲を読み書きします。*/
+    thread_map = map;
+    for (t = 0; t < NUM_THREADS; t++) {
+        pthread_create(&th[t], NULL, io_thread, (void*)(intptr_t)t);
+        pthread_create(&th[NUM_THREADS + t], NULL, range_thread, (void*)(intptr_t)t);
+    }
+    for (t = 0; t < NUM_THREADS * 2; t++)
+        pthread_join(th[t], NULL);
+
+    /* ページの途中まで縮小すると残りはゼロで拡張されます。*/
+    size = (int64)(NUM_BLOCKS / 2) * BLOCK_SIZE + 100;
+    TEST_CHECK(mmap_resize(map, size) == 0);
+    TEST_CHECK(map->real_size == size);
+    memset(buf, 'x', 10);
+    TEST_CHECK(mmap_pwrite(map, buf, 10, size + 20) == 10);
+    TEST_CHECK(mmap_pread(map, buf, 20, size) == 20);
+    for (n = 0; n < 20; n++)
+        TEST_CHECK(buf[n] == '\0');
+    TEST_CHECK(mmap_pread(map, buf, 100, size - 100) == 100);
+    make_block(buf + 100, NUM_BLOCKS / 2);
+    TEST_CHECK(memcmp(buf, buf + 100, 100) == 0);
+
+    TEST_CHECK(mmap_sync(map) == 0);
+    for (n = 0; n < NUM_BLOCKS / 2; n++)
+        TEST_CHECK(check_file_block(fd, n));
+    mmap_close(map);
+
+    /* メモリマップで同じ内容を参照できます。*/
+    map = mmap_open(fd, MMAP_READWRITE, MMAP_AUTO_SIZE);
+    TEST_CHECK(map != NULL);
+    if (map) {
+        TEST_CHECK(map->real_size == size + 30);
+        for (n = 0; n < NUM_BLOCKS / 2; n++)
+            TEST_CHECK(check_map_block(map, n));
+        mmap_close(map);
+    }
+    FILE_CLOSE(fd);
+    test_remove_db(fname);
+}
+
+static void put_keys(struct nio_t* nio, int from, int to, int step, int gen)
+{
+    char key[32], val[2048];
+    int i;
+
+    for (i = from; i < to; i++) {
+        int ksize, vsize;
+
+        if (i % step != 0)
+            continue;
+        ksize = test_key(key, i);
+        vsize = test_val(val, i, gen);
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+}
+
+static void verify_keys(struct nio_t* nio, int num)
+{
+    int i;
+
+    for (i = 0; i < num; i++)
+        TEST_CHECK(test_verify(nio, i, (i % 3 == 0)? 1 : 0));
+}
+
+static struct nio_t* open_db(const char* fname, int dbtype, int backend, int create)
+{
+    struct nio_t* nio;
+    int props[] = {
+        NIO_IO_BACKEND, backend, NIO_IO_POOL_SIZE, 1, NIO_BUCKET_NUM, 4000, 0
+    };
+
+    if (dbtype == NIO_BTREE)
+        props[4] = 0;
+    nio = test_open_db(fname, dbtype, props, create);
+    TEST_CHECK((nio->mmap->pool != NULL) == (backend == MMAP_IO_FILE));
+    return nio;
+}
+
+static void test_nio(const char* fname, int dbtype)
+{
+    struct nio_t* nio;
+
+    test_remove_db(fname);
+    nio = open_db(fname, dbtype, MMAP_IO_FILE, 1);
+    put_keys(nio, 0, NUM_KEYS, 1, 0);
+    put_keys(nio, 0, NUM_KEYS, 3, 1);
+    verify_keys(nio, NUM_KEYS);
+    test_close_db(nio);
+
+    nio = open_db(fname, dbtype, MMAP_IO_MAP, 0);
+    verify_keys(nio, NUM_KEYS);
+    put_keys(nio, NUM_KEYS, NUM_KEYS * 2, 1, 0);
+    put_keys(nio, NUM_KEYS, NUM_KEYS * 2, 3, 1);
+    test_close_db(nio);
+
+    nio = open_db(fname, dbtype, MMAP_IO_FILE, 0);
+    verify_keys(nio, NUM_KEYS * 2);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+/* NIO_WAL は NIO_IO_BACKEND を指定しない場合はバッファプールを使用し、
+   MMAP_IO_MAP を指定した場合はマップしたまま使用します。*/
+static void test_wal_backend(const char* fname)
+{
+    struct nio_t* nio;
+    int props[] = { NIO_WAL, 1, NIO_IO_POOL_SIZE, 1, NIO_BUCKET_NUM, 4000, 0, 0, 0 };
+
+    test_remove_db(fname);
+    nio = test_open_db(fname, NIO_HASH, props, 1);
+    TEST_CHECK(nio->mmap->pool != NULL);
+    put_keys(nio, 0, NUM_KEYS, 1, 0);
+    test_close_db(nio);
+
+    props[6] = NIO_IO_BACKEND;
+    props[7] = MMAP_IO_MAP;
+    nio = test_open_db(fname, NIO_HASH, props, 0);
+    TEST_CHECK(nio->mmap->pool == NULL);
+    put_keys(nio, 0, NUM_KEYS, 3, 1);
+    verify_keys(nio, NUM_KEYS);
+    test_close_db(nio);
+
+    props[6] = 0;
+    nio = test_open_db(fname, NIO_HASH, props, 0);
+    TEST_CHECK(nio->mmap->pool != NULL);
+    verify_keys(nio, NUM_KEYS);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+int main()
+{
+    const char* fname;
+    struct nio_t* nio;
+
+    fname = test_start("nio_iopool");
+    test_pool(fname);
+
+    nio = nio_initialize(NIO_HASH);
+    TEST_CHECK(nio_property(nio, NIO_IO_BACKEND, MMAP_IO_FILE + 1) < 0);
+    TEST_CHECK(nio_property(nio, NIO_IO_POOL_SIZE, -1) < 0);
+    nio_finalize(nio);
+    test_nio(fname, NIO_HASH);
+    test_nio(fname, NIO_BTREE);
+    test_wal_backend(fname);
+    return test_end();
+}
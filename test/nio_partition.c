@@ -0,0 +1,237 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* 分割したカーソルがすべてのキーを重複なく返すことを確認します。
+   各カーソルは別のスレッドで読み込みます。
+   B+木の場合は各範囲がキー順で、範囲どうしが重ならないことも確認します。
+   NIO_CONCURRENT_READ の B+木では各カーソルが共有ロックで並行に進むため、
+   読み込み中に別のスレッドで値を更新しても正しい値が返ることを確認します。*/
+
+#define NUM_KEYS        20000
+#define MAX_PARTS       64
+
+struct part_t {
+    struct nio_t* nio;
+    struct nio_cursor_t* cur;
+    int dbtype;
+    int gen;        /* 値の世代(負の場合は更新中で 0 か 1) */
+    int first;      /* 最初のキー番号 */
+    int last;       /* 最後のキー番号 */
+};
+
+static int seen[NUM_KEYS];
+
+static void* scan_thread(void* arg)
+{
+    struct part_t* p = (struct part_t*)arg;
+    char key[32], val[2048], buf[2048];
+    int ksize, prev = -1;
+
+    p->first = p->last = -1;
+    while ((ksize = nio_cursor_key(p->cur, key, sizeof(key))) > 0) {
+        int i, vsize;
+
+        key[ksize] = '\0';
+        i = atoi(key + 3);
+        TEST_CHECK(i >= 0 && i < NUM_KEYS);
+        if (i < 0 || i >= NUM_KEYS)
+            break;
+        __sync_fetch_and_add(&seen[i], 1);
+        if (p->gen < 0) {
+            int n;
+
+            /* 更新中の値はどちらかの世代と一致します。*/
+            n = nio_cursor_value(p->cur, buf, sizeof(buf));
+            vsize = test_val(val, i, 0);
+            if (n != vsize || memcmp(buf, val, vsize) != 0) {
+                vsize = test_val(val, i, 1);
+                TEST_CHECK(n == vsize && memcmp(buf, val, vsize) == 0);
+            }
+        } else if (p->dbtype == NIO_BTREE) {
+            vsize = test_val(val, i, p->gen);
+            TEST_CHECK(nio_cursor_value(p->cur, buf, sizeof(buf)) == vsize);
+            TEST_CHECK(memcmp(buf, val, vsize) == 0);
+            TEST_CHECK(i > prev);
+        } else {
+            /* ハッシュのカーソルは値を返さないためキーで取得します。*/
+            TEST_CHECK(test_verify(p->nio, i, p->gen));
+        }
+        if (p->first < 0)
+            p->first = i;
+        p->last = prev = i;
+        if (nio_cursor_next(p->cur) != 0)
+            break;
+    }
+    return NULL;
+}
+
+static void check_partition(struct nio_t* nio, int dbtype, int n, int nkeys, int step, int gen)
+{
+    struct nio_cursor_t* curs[MAX_PARTS];
+    struct part_t parts[MAX_PARTS];
+    pthread_t tid[MAX_PARTS];
+    int count, i, prev_last = -1;
+
+    memset(seen, 0, sizeof(seen));
+    count = nio_cursor_partition(nio, n, curs);
+    TEST_CHECK(count >= 1 && count <= n);
+    if (count < 1)
+        return;
+
+    for (i = 0; i < count; i++) {
+        parts[i].nio = nio;
+        parts[i].cur = curs[i];
+        parts[i].dbtype = dbtype;
+        parts[i].gen = gen;
+        pthread_create(&tid[i], NULL, scan_thread, &parts[i]);
+    }
+    for (i = 0; i < count; i++) {
+        pthread_join(tid[i], NULL);
+        nio_cursor_close(curs[i]);
+    }
+
+    for (i = 0; i < NUM_KEYS; i++)
+        TEST_CHECK(seen[i] == ((i < nkeys && i % step == 0)? 1 : 0));
+
+    if (dbtype == NIO_BTREE) {
+        /* 範囲はキー順に並んで重なりません。*/
+        for (i = 0; i < count; i++) {
+            if (parts[i].first < 0)
+                continue;
+            TEST_CHECK(parts[i].first > prev_last);
+            prev_last = parts[i].last;
+        }
+    }
+}
+
+static void* update_thread(void* arg)
+{
+    struct nio_t* nio = (struct nio_t*)arg;
+    char key[32], val[2048];
+    int i;
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 1);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    return NULL;
+}
+
+/* 分割したカーソルで読み込みながら別のスレッドですべての値を
+   次の世代に更新します。リーフの分割でキーが移動するため
+   読み込み中は値だけを確認します。
+   データ部の位置はカーソルに保持されるため、値の更新と並行に
+   読み込むのはリーフに値を持つデータパックの場合に限ります。*/
+static void check_update(struct nio_t* nio, int n)
+{
+    struct nio_cursor_t* curs[MAX_PARTS];
+    struct part_t parts[MAX_PARTS];
+    pthread_t tid[MAX_PARTS], writer;
+    int count, i;
+
+    memset(seen, 0, sizeof(seen));
+    count = nio_cursor_partition(nio, n, curs);
+    TEST_CHECK(count > 1);
+    if (count < 1)
+        return;
+
+    pthread_create(&writer, NULL, update_thread, nio);
+    for (i = 0; i < count; i++) {
+        parts[i].nio = nio;
+        parts[i].cur = curs[i];
+        parts[i].dbtype = NIO_BTREE;
+        parts[i].gen = -1;
+        pthread_create(&tid[i], NULL, scan_thread, &parts[i]);
+    }
+    for (i = 0; i < count; i++) {
+        pthread_join(tid[i], NULL);
+        nio_cursor_close(curs[i]);
+    }
+    pthread_join(writer, NULL);
+}
+
+static void run(const char* fname, int dbtype, int datapack, int concurrent)
+{
+    struct nio_t* nio;
+    char key[32], val[2048];
+    int i, gen = 0;
+    int props[] = { NIO_DATAPACK, datapack, NIO_CONCURRENT_READ, concurrent,
+                    NIO_LEAF_CACHE, 8, 0 };
+
+    if (dbtype == NIO_HASH) {
+        props[0] = NIO_BUCKET_NUM;
+        props[1] = 1000;
+        props[2] = 0;
+    } else if (! concurrent) {
+        props[2] = 0;
+    }
+    test_remove_db(fname);
+    nio = test_open_db(fname, dbtype, props, 1);
+
+    /* 空のデータベース */
+    check_partition(nio, dbtype, 4, 0, 1, gen);
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    check_partition(nio, dbtype, 1, NUM_KEYS, 1, gen);
+    check_partition(nio, dbtype, 3, NUM_KEYS, 1, gen);
+    check_partition(nio, dbtype, 8, NUM_KEYS, 1, gen);
+    check_partition(nio, dbtype, MAX_PARTS, NUM_KEYS, 1, gen);
+
+    if (concurrent && datapack) {
+        check_update(nio, 8);
+        gen = 1;
+        check_partition(nio, dbtype, 8, NUM_KEYS, 1, gen);
+    }
+
+    /* 奇数のキーを削除した後も重複や漏れがありません。*/
+    for (i = 1; i < NUM_KEYS; i += 2) {
+        int ksize = test_key(key, i);
+
+        TEST_CHECK(nio_delete(nio, key, ksize) == 0);
+    }
+    check_partition(nio, dbtype, 5, NUM_KEYS, 2, gen);
+    test_close_db(nio);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("nio_partition");
+    run(fname, NIO_HASH, 0, 0);
+    run(fname, NIO_BTREE, 1, 0);
+    run(fname, NIO_BTREE, 0, 0);
+    run(fname, NIO_BTREE, 1, 1);
+    run(fname, NIO_BTREE, 0, 1);
+    return test_end();
+}
@@ -0,0 +1,117 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "test.h"
+
+/* nio_get_view() で値をコピーせずに参照します。
+   保持したビューはキーを追加してマップが作り直されても参照できることを
+   確認します。マップサイズを小さくした場合はコピーされたビューになります。*/
+
+#define NUM_KEYS        5000
+
+static int check_view(struct nio_t* nio, int i, struct nio_view_t* view)
+{
+    char key[32], val[2048];
+    int ksize, vsize;
+
+    ksize = test_key(key, i);
+    vsize = test_val(val, i, 0);
+    if (nio_get_view(nio, key, ksize, view) != vsize)
+        return 0;
+    return view->valsize == vsize && memcmp(view->val, val, vsize) == 0;
+}
+
+static void put_keys(struct nio_t* nio, int from, int to)
+{
+    char key[32], val[2048];
+    int i;
+
+    for (i = from; i < to; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+}
+
+static void run(const char* fname, int dbtype, int datapack, int viewsize)
+{
+    struct nio_t* nio;
+    struct nio_view_t view, held;
+    char val[2048];
+    int i, vsize, pinned = 0;
+    int props[5], n = 0;
+
+    if (dbtype == NIO_BTREE) {
+        props[n++] = NIO_DATAPACK;
+        props[n++] = datapack;
+    }
+    if (viewsize > 0) {
+        props[n++] = NIO_MAP_VIEWSIZE;
+        props[n++] = viewsize;
+    }
+    props[n] = 0;
+    nio = test_open_db(fname, dbtype, props, 1);
+    put_keys(nio, 0, NUM_KEYS);
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        TEST_CHECK(check_view(nio, i, &view));
+        pinned += view.pinned;
+        nio_release_view(nio, &view);
+    }
+    /* データパックの値はリーフのキャッシュからコピーされます。*/
+    if (viewsize == 0 && ! datapack)
+        TEST_CHECK(pinned == NUM_KEYS);
+
+    TEST_CHECK(nio_get_view(nio, "nokey", 5, &view) == -1);
+    TEST_CHECK(view.val == NULL);
+    nio_release_view(nio, &view);
+
+    /* ビューを保持したままファイルを大きくします。*/
+    TEST_CHECK(check_view(nio, 1, &held));
+    put_keys(nio, NUM_KEYS, NUM_KEYS * 8);
+    vsize = test_val(val, 1, 0);
+    TEST_CHECK(held.valsize == vsize && memcmp(held.val, val, vsize) == 0);
+    nio_release_view(nio, &held);
+
+    for (i = 0; i < NUM_KEYS * 8; i += 7) {
+        TEST_CHECK(check_view(nio, i, &view));
+        nio_release_view(nio, &view);
+    }
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("nio_view");
+    run(fname, NIO_HASH, 0, 0);
+    run(fname, NIO_BTREE, 1, 0);
+    run(fname, NIO_BTREE, 0, 0);
+    run(fname, NIO_HASH, 0, 1);
+    run(fname, NIO_BTREE, 0, 1);
+    return test_end();
+}
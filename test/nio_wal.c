@@ -0,0 +1,383 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <signal.h>
+#include <sys/wait.h>
+#include "test.h"
+
+/* NIO_WAL を指定したデータベースを更新中のプロセスを終了させて、
+   再オープンしたときにコミットされた更新だけが残ることを確認します。*/
+
+#define NUM_KEYS        2000
+#define NUM_THREADS     4
+#define FLUSH_VALSIZE   1000
+
+static const int wal_props[] = { NIO_WAL, 1, NIO_WAL_SYNC_INTERVAL, 50, 0 };
+
+/* 子プロセスでキーを追加します。count が負の場合は終了させられるまで続けます。*/
+static void child_put(const char* fname, int dbtype, int count)
+{
+    struct nio_t* nio;
+    char key[32], val[2048];
+    int i;
+
+    nio = test_open_db(fname, dbtype, wal_props, 1);
+    if (nio == NULL)
+        _exit(1);
+    for (i = 0; count < 0 || i < count; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        if (nio_put(nio, key, ksize, val, vsize) < 0)
+            _exit(1);
+    }
+    /* クローズせずに終了します。*/
+    _exit(0);
+}
+
+/* 先頭から連続して格納されているキーの数を返します。
+   それより後ろのキーは格納されていないことを確認します。*/
+static int verify_prefix(struct nio_t* nio, int limit)
+{
+    char key[32];
+    int i, n;
+
+    for (n = 0; n < limit; n++) {
+        if (! test_verify(nio, n, 0))
+            break;
+    }
+    for (i = n; i < limit; i++) {
+        int ksize = test_key(key, i);
+
+        TEST_CHECK(nio_find(nio, key, ksize) < 0);
+    }
+    return n;
+}
+
+static void run(const char* fname, int dbtype, int kill_child)
+{
+    struct nio_t* nio;
+    char key[32], val[2048];
+    pid_t pid;
+    int status, n, i;
+
+    pid = fork();
+    if (pid == 0)
+        child_put(fname, dbtype, kill_child? -1 : NUM_KEYS);
+    TEST_CHECK(pid > 0);
+    if (kill_child) {
+        usleep(300 * 1000);
+        kill(pid, SIGKILL);
+    }
+    waitpid(pid, &status, 0);
+    if (! kill_child)
+        TEST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    /* ログから復旧します。*/
+    nio = test_open_db(fname, dbtype, wal_props, 0);
+    TEST_CHECK(nio != NULL);
+    if (nio == NULL)
+        return;
+    n = verify_prefix(nio, kill_child? NUM_KEYS * 100 : NUM_KEYS);
+    if (kill_child)
+        TEST_CHECK(n > 0);
+    else
+        TEST_CHECK(n == NUM_KEYS);
+
+    /* 復旧したデータベースは続けて更新できます。*/
+    for (i = n; i < n + NUM_KEYS; i++) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    test_close_db(nio);
+
+    nio = test_open_db(fname, dbtype, wal_props, 0);
+    TEST_CHECK(nio != NULL);
+    if (nio) {
+        TEST_CHECK(verify_prefix(nio, n + NUM_KEYS * 2) == n + NUM_KEYS);
+        test_close_db(nio);
+    }
+    test_remove_db(fname);
+}
+
+/* 子プロセスの複数のスレッドでキーを追加します。
+   スレッド t はキー t, t+NUM_THREADS, t+NUM_THREADS*2, ... を順に追加します。*/
+static struct nio_t* thread_nio;
+
+static void* thread_put(void* arg)
+{
+    char key[32], val[2048];
+    int t = (int)(intptr_t)arg;
+    int i;
+
+    for (i = t; ; i += NUM_THREADS) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        if (nio_put(thread_nio, key, ksize, val, vsize) < 0)
+            _exit(1);
+    }
+    return NULL;
+}
+
+static void child_threads(const char* fname, int dbtype)
+{
+    pthread_t th[NUM_THREADS];
+    int i;
+
+    thread_nio = test_open_db(fname, dbtype, wal_props, 1);
+    if (thread_nio == NULL)
+        _exit(1);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_create(&th[i], NULL, thread_put, (void*)(intptr_t)i);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(th[i], NULL);
+    _exit(0);
+}
+
+/* 並行して更新中のプロセスを終了させても、スレッド毎にコミットされた
+   キーは先頭から連続していて、他のスレッドの更新と混ざらないことを確認します。*/
+static void run_threads(const char* fname, int dbtype)
+{
+    struct nio_t* nio;
+    char key[32];
+    pid_t pid;
+    int status, t, i, n, total = 0;
+
+    pid = fork();
+    if (pid == 0)
+        child_threads(fname, dbtype);
+    TEST_CHECK(pid > 0);
+    usleep(300 * 1000);
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+
+    nio = test_open_db(fname, dbtype, wal_props, 0);
+    TEST_CHECK(nio != NULL);
+    if (nio == NULL)
+        return;
+    for (t = 0; t < NUM_THREADS; t++) {
+        for (n = t; test_verify(nio, n, 0); n += NUM_THREADS)
+            ;
+        for (i = n; i < n + NUM_KEYS * 100; i += NUM_THREADS) {
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(nio_find(nio, key, ksize) < 0);
+        }
+        total += (n - t) / NUM_THREADS;
+    }
+    TEST_CHECK(total > 0);
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+/* ロックストライプと線形ハッシュのハッシュDBでは、スレッド毎に
+   キーを追加して 3 の倍数のキーは削除し、それ以外は値を置き換えます。*/
+static const int stripe_props[] = { NIO_WAL, 1, NIO_WAL_SYNC_INTERVAL, 50,
+                                    NIO_LOCK_STRIPES, 8, NIO_BUCKET_NUM, 64,
+                                    NIO_LINEAR_HASH, 4, 0 };
+
+static void* thread_update(void* arg)
+{
+    char key[32], val[2048];
+    int t = (int)(intptr_t)arg;
+    int i;
+
+    for (i = t; ; i += NUM_THREADS) {
+        int ksize = test_key(key, i);
+        int vsize = test_val(val, i, 0);
+
+        if (nio_put(thread_nio, key, ksize, val, vsize) < 0)
+            _exit(1);
+        if (i % 3 == 0) {
+            if (nio_delete(thread_nio, key, ksize) < 0)
+                _exit(1);
+        } else {
+            vsize = test_val(val, i, 1);
+            if (nio_put(thread_nio, key, ksize, val, vsize) < 0)
+                _exit(1);
+        }
+    }
+    return NULL;
+}
+
+static void child_stripes(const char* fname)
+{
+    pthread_t th[NUM_THREADS];
+    int i;
+
+    thread_nio = test_open_db(fname, NIO_HASH, stripe_props, 1);
+    if (thread_nio == NULL)
+        _exit(1);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_create(&th[i], NULL, thread_update, (void*)(intptr_t)i);
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(th[i], NULL);
+    _exit(0);
+}
+
+/* スレッド t のキーが先頭からどこまでコミットされているかを確認します。
+   途中のキーは削除されているか置き換えられていて、
+   最後のキーだけが追加した直後の値の場合があります。*/
+static int verify_thread(struct nio_t* nio, int t)
+{
+    char key[32];
+    int n, i, last = t;
+
+    for (n = t; ; n += NUM_THREADS) {
+        int ksize = test_key(key, n);
+
+        if (test_verify(nio, n, 1)) {
+            TEST_CHECK(n % 3 != 0);
+        } else if (test_verify(nio, n, 0)) {
+            last = n + NUM_THREADS;
+            break;
+        } else if (nio_find(nio, key, ksize) >= 0 || n % 3 != 0) {
+            break;
+        }
+        last = n + NUM_THREADS;
+    }
+    for (i = last; i < last + NUM_KEYS * 100; i += NUM_THREADS) {
+        int ksize = test_key(key, i);
+
+        TEST_CHECK(nio_find(nio, key, ksize) < 0);
+    }
+    return (last - t) / NUM_THREADS;
+}
+
+/* バケットのロック単位で並行してコミットされる更新を終了させても、
+   回復後のデータベースに矛盾がなく、続けて更新できることを確認します。*/
+static void run_stripes(const char* fname)
+{
+    struct nio_t* nio;
+    char key[32], val[2048];
+    pid_t pid;
+    int status, t, i, total = 0;
+
+    pid = fork();
+    if (pid == 0)
+        child_stripes(fname);
+    TEST_CHECK(pid > 0);
+    usleep(300 * 1000);
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+
+    nio = test_open_db(fname, NIO_HASH, stripe_props, 0);
+    TEST_CHECK(nio != NULL);
+    if (nio == NULL)
+        return;
+    for (t = 0; t < NUM_THREADS; t++)
+        total += verify_thread(nio, t);
+    TEST_CHECK(total > 0);
+
+    /* 回収された領域が再利用されても既存のキーは壊れません。*/
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize = test_key(key, NUM_KEYS * 1000 + i);
+        int vsize = test_val(val, i, 2);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, vsize) == 0);
+    }
+    nio = test_reopen_db(nio, fname, stripe_props);
+    TEST_CHECK(nio != NULL);
+    if (nio == NULL)
+        return;
+    for (t = 0; t < NUM_THREADS; t++)
+        verify_thread(nio, t);
+    for (i = 0; i < NUM_KEYS; i++) {
+        char buf[2048];
+        int ksize = test_key(key, NUM_KEYS * 1000 + i);
+        int vsize = test_val(val, i, 2);
+
+        TEST_CHECK(nio_get(nio, key, ksize, buf, sizeof(buf)) == vsize);
+    }
+    test_close_db(nio);
+    test_remove_db(fname);
+}
+
+/* コミットで同期しない設定でも、バッファプールのページは
+   ログを同期してから書き出されることを確認します。*/
+static void run_flush(const char* fname, int dbtype)
+{
+    static const int hash_props[] = { NIO_WAL, 1, NIO_WAL_SYNC_INTERVAL, 600000,
+                                      NIO_IO_POOL_SIZE, 1, 0 };
+    static const int btree_props[] = { NIO_WAL, 1, NIO_WAL_SYNC_INTERVAL, 600000,
+                                       NIO_IO_POOL_SIZE, 1, NIO_DATAPACK, 0, 0 };
+    const int* props = (dbtype == NIO_BTREE)? btree_props : hash_props;
+    struct nio_t* nio;
+    char key[32], val[2048];
+    int i;
+
+    nio = test_open_db(fname, dbtype, props, 1);
+    TEST_CHECK(nio != NULL);
+    if (nio == NULL)
+        return;
+    TEST_CHECK(nio->mmap->pool != NULL);
+    TEST_CHECK(nio->wal->sync_pos == 0);
+
+    /* プールより大きくなるように値のサイズを固定します。*/
+    memset(val, 'v', FLUSH_VALSIZE);
+    for (i = 0; i < NUM_KEYS; i++) {
+        int ksize = test_key(key, i);
+
+        TEST_CHECK(nio_put(nio, key, ksize, val, FLUSH_VALSIZE) == 0);
+    }
+    /* 置き換えでページが書き出されているためログは同期されています。*/
+    TEST_CHECK(nio->mmap->real_size > 1024 * 1024);
+    TEST_CHECK(nio->wal->sync_pos > 0);
+    test_close_db(nio);
+
+    nio = test_open_db(fname, dbtype, props, 0);
+    TEST_CHECK(nio != NULL);
+    if (nio) {
+        char buf[2048];
+
+        for (i = 0; i < NUM_KEYS; i++) {
+            int ksize = test_key(key, i);
+
+            TEST_CHECK(nio_get(nio, key, ksize, buf, sizeof(buf)) == FLUSH_VALSIZE);
+            TEST_CHECK(memcmp(buf, val, FLUSH_VALSIZE) == 0);
+        }
+        test_close_db(nio);
+    }
+    test_remove_db(fname);
+}
+
+int main()
+{
+    const char* fname;
+
+    fname = test_start("nio_wal");
+    run(fname, NIO_HASH, 0);
+    run(fname, NIO_BTREE, 0);
+    run(fname, NIO_HASH, 1);
+    run(fname, NIO_BTREE, 1);
+    run_threads(fname, NIO_HASH);
+    run_threads(fname, NIO_BTREE);
+    run_stripes(fname);
+    run_flush(fname, NIO_HASH);
+    run_flush(fname, NIO_BTREE);
+    return test_end();
+}
@@ -0,0 +1,192 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <pthread.h>
+#include "nestalib.h"
+
+/* make check で実行される回帰テストの共通処理です。
+ *
+ * テストはビルドディレクトリで実行され、データベースファイルは
+ * test/<name>_db として作成されます。失敗した確認の数を終了コードで返します。
+ */
+
+/* テストで使わない関数の警告を抑止します。*/
+#define TEST_FUNC static __attribute__((unused))
+
+static int test_failures = 0;
+static char test_dbname[256];
+
+#define TEST_CHECK(cond) \
+    do { \
+        if (! (cond)) { \
+            __sync_fetch_and_add(&test_failures, 1); \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+/* データベースファイルと WAL を削除します。
+   B-Tree(btopen)のキーファイルとデータファイルも削除します。*/
+TEST_FUNC void test_remove_db(const char* fname)
+{
+    static const char* exts[] = {
+        ".hdb", ".bdb", ".wal", ".hdb.wal", ".bdb.wal", ".nky", ".ndt", NULL
+    };
+    char path[300];
+    int i;
+
+    remove(fname);
+    for (i = 0; exts[i]; i++) {
+        snprintf(path, sizeof(path), "%s%s", fname, exts[i]);
+        remove(path);
+    }
+}
+
+/* データベースオブジェクトを作成してプロパティを設定します。
+   props には nio_property() の種類と値を交互に並べて最後をゼロにします。
+   NULL の場合はプロパティを設定しません。*/
+TEST_FUNC struct nio_t* test_init_db(int dbtype, const int* props)
+{
+    struct nio_t* nio;
+
+    nio = nio_initialize(dbtype);
+    for (; props && props[0] != 0; props += 2)
+        TEST_CHECK(nio_property(nio, props[0], props[1]) == 0);
+    return nio;
+}
+
+/* test_init_db() で作成したオブジェクトでデータベースを作成(create が 1)
+   またはオープンします。失敗した場合はオブジェクトを解放して NULL を返します。*/
+TEST_FUNC struct nio_t* test_attach_db(struct nio_t* nio, const char* fname, int create)
+{
+    int result;
+
+    result = create? nio_create(nio, fname) : nio_open(nio, fname);
+    TEST_CHECK(result == 0);
+    if (result < 0) {
+        nio_finalize(nio);
+        return NULL;
+    }
+    return nio;
+}
+
+/* プロパティを設定してデータベースを作成(create が 1)またはオープンします。*/
+TEST_FUNC struct nio_t* test_open_db(const char* fname, int dbtype, const int* props, int create)
+{
+    return test_attach_db(test_init_db(dbtype, props), fname, create);
+}
+
+/* データベースをクローズしてオブジェクトを解放します。*/
+TEST_FUNC void test_close_db(struct nio_t* nio)
+{
+    if (nio == NULL)
+        return;
+    nio_close(nio);
+    nio_finalize(nio);
+}
+
+/* データベースをクローズして同じプロパティでオープンし直します。*/
+TEST_FUNC struct nio_t* test_reopen_db(struct nio_t* nio, const char* fname, const int* props)
+{
+    int dbtype;
+
+    if (nio == NULL)
+        return NULL;
+    dbtype = nio->dbtype;
+    test_close_db(nio);
+    return test_open_db(fname, dbtype, props, 0);
+}
+
+/* テストを開始します。name はデータベースファイルの名前になります。
+   エラーとログの出力は test/<name>_db.log に書き出されます。*/
+TEST_FUNC const char* test_start(const char* name)
+{
+    char path[300];
+
+    snprintf(test_dbname, sizeof(test_dbname), "test/%s_db", name);
+    snprintf(path, sizeof(path), "%s.log", test_dbname);
+    remove(path);
+    err_initialize(path);
+    logout_initialize(path);
+    test_remove_db(test_dbname);
+    return test_dbname;
+}
+
+/* テストを終了します。成功した場合はファイルを削除します。*/
+TEST_FUNC int test_end(void)
+{
+    char path[300];
+
+    logout_finalize();
+    err_finalize();
+    if (test_failures == 0) {
+        test_remove_db(test_dbname);
+        snprintf(path, sizeof(path), "%s.log", test_dbname);
+        remove(path);
+    } else {
+        fprintf(stderr, "%d checks failed, see %s.log\n", test_failures, test_dbname);
+    }
+    return (test_failures == 0)? 0 : 1;
+}
+
+/* i 番目のキーを設定してキーのサイズを返します。*/
+TEST_FUNC int test_key(char* key, int i)
+{
+    return sprintf(key, "key%08d", i);
+}
+
+/* i 番目の世代 gen の値を設定して値のサイズを返します。
+   サイズは B+木のデータパックに格納できる 1 から 200 バイトまで変化します。*/
+TEST_FUNC int test_val(char* val, int i, int gen)
+{
+    int size, j;
+
+    size = 1 + (i * 7 + gen * 13) % 200;
+    for (j = 0; j < size; j++)
+        val[j] = (char)('a' + (i + j + gen) % 26);
+    return size;
+}
+
+/* キーの値が世代 gen と一致するか調べます。*/
+TEST_FUNC int test_verify(struct nio_t* nio, int i, int gen)
+{
+    char key[32], val[2048], buf[2048];
+    int ksize, vsize;
+
+    ksize = test_key(key, i);
+    vsize = test_val(val, i, gen);
+    if (nio_get(nio, key, ksize, buf, sizeof(buf)) != vsize)
+        return 0;
+    return memcmp(buf, val, vsize) == 0;
+}
+
+/* 時刻をミリ秒で返します。*/
+TEST_FUNC double test_msec(void)
+{
+    return system_time() / 1000.0;
+}
+
+#endif /* _TEST_H_ */
@@ -0,0 +1,228 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2008-2013 YAMAMOTO Naoki
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <unistd.h>
+#include "nestalib.h"
+
+/*
+ * キー順に並んだテキストから B+木データベースを一括で作成します。
+ *
+ * 使い方:
+ *   bdbload [-d] [-u] [-x] [-s] [-p pagesize] [-r filling_rate] dbfile [input]
+ *
+ *   -d  キーとデータをパックして格納(NIO_DATAPACK)
+ *   -u  キーの重複を許可(NIO_DUPLICATE_KEY)
+ *   -x  キーをプレフィックス圧縮(NIO_PREFIX_COMPRESS)
+ *   -s  部分木のキー数を持つ(NIO_ORDER_STAT)
+ *   -p  ノードページサイズ(NIO_PAGESIZE)
+ *   -r  空き領域の充填率(NIO_FILLING_RATE)
+ *
+ * 入力は一行に一件の「キー<TAB>値」です。タブがない行は値が空になります。
+ * input を省略した場合は標準入力から読み込みます。
+ * キーはバイト列の昇順に並んでいる必要があります(sort コマンドは
+ * LC_ALL=C で実行します)。dbfile は新しく作成されます。
+ */
+
+struct load_input_t {
+    FILE* fp;
+    char* buf;
+    int bufsize;
+    int64 lineno;
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: bdbload [-d] [-u] [-x] [-s] [-p pagesize] [-r filling_rate] dbfile [input]\n");
+}
+
+/* 一行を読み込んで行の長さを返します。改行は含みません。
+   ファイルの終わりの場合は -1 を返します。*/
+static int read_line(struct load_input_t* in)
+{
+    int len = 0;
+
+    for (;;) {
+        if (len + 1 >= in->bufsize) {
+            char* p;
+
+            p = (char*)realloc(in->buf, in->bufsize * 2);
+            if (p == NULL) {
+                fprintf(stderr, "bdbload: no memory.\n");
+                return -1;
+            }
+            in->buf = p;
+            in->bufsize *= 2;
+        }
+        if (fgets(in->buf + len, in->bufsize - len, in->fp) == NULL)
+            return (len > 0)? len : -1;
+        len += (int)strlen(in->buf + len);
+        if (len > 0 && in->buf[len-1] == '\n') {
+            in->buf[--len] = '\0';
+            if (len > 0 && in->buf[len-1] == '\r')
+                in->buf[--len] = '\0';
+            return len;
+        }
+    }
+}
+
+/* nio_bulk_load() から呼び出されて次のキーと値を設定します。*/
+static int read_item(void* arg, struct nio_batch_t* item)
+{
+    struct load_input_t* in = (struct load_input_t*)arg;
+    char* tab;
+    int len;
+
+    len = read_line(in);
+    if (len < 0)
+        return ferror(in->fp)? -1 : 0;
+    in->lineno++;
+
+    tab = (char*)memchr(in->buf, '\t', len);
+    item->key = in->buf;
+    if (tab != NULL) {
+        item->keysize = (int)(tab - in->buf);
+        item->val = tab + 1;
+        item->valsize = len - item->keysize - 1;
+    } else {
+        item->keysize = len;
+        item->val = "";
+        item->valsize = 0;
+    }
+    if (item->keysize < 1) {
+        fprintf(stderr, "bdbload: empty key at line %lld.\n", in->lineno);
+        return -1;
+    }
+    return 1;
+}
+
+int main(int argc, char* argv[])
+{
+    struct nio_t* nio;
+    struct load_input_t in;
+    const char* fname;
+    int64 start;
+    int pagesize = 0;
+    int filling_rate = -1;
+    int datapack = 0;
+    int dupkey = 0;
+    int prefix = 0;
+    int order_stat = 0;
+    int count;
+    int c;
+
+    while ((c = getopt(argc, argv, "duxsp:r:")) != -1) {
+        switch (c) {
+            case 'd':
+                datapack = 1;
+                break;
+            case 'u':
+                dupkey = 1;
+                break;
+            case 'x':
+                prefix = 1;
+                break;
+            case 's':
+                order_stat = 1;
+                break;
+            case 'p':
+                pagesize = atoi(optarg);
+                break;
+            case 'r':
+                filling_rate = atoi(optarg);
+                break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+    if (optind >= argc || argc - optind > 2) {
+        usage();
+        return 2;
+    }
+    fname = argv[optind];
+
+    memset(&in, '\0', sizeof(in));
+    if (optind + 1 < argc) {
+        in.fp = fopen(argv[optind+1], "r");
+        if (in.fp == NULL) {
+            perror(argv[optind+1]);
+            return 1;
+        }
+    } else {
+        in.fp = stdin;
+    }
+    in.bufsize = 4096;
+    in.buf = (char*)malloc(in.bufsize);
+    if (in.buf == NULL) {
+        fprintf(stderr, "bdbload: no memory.\n");
+        return 1;
+    }
+
+    nio = nio_initialize(NIO_BTREE);
+    if (nio == NULL) {
+        fprintf(stderr, "bdbload: nio_initialize() failed.\n");
+        return 1;
+    }
+    if (pagesize > 0 && nio_property(nio, NIO_PAGESIZE, pagesize) < 0)
+        goto error;
+    if (filling_rate >= 0 && nio_property(nio, NIO_FILLING_RATE, filling_rate) < 0)
+        goto error;
+    if (nio_property(nio, NIO_DUPLICATE_KEY, dupkey) < 0)
+        goto error;
+    if (nio_property(nio, NIO_DATAPACK, datapack) < 0)
+        goto error;
+    if (nio_property(nio, NIO_PREFIX_COMPRESS, prefix) < 0)
+        goto error;
+    if (nio_property(nio, NIO_ORDER_STAT, order_stat) < 0)
+        goto error;
+
+    if (nio_create(nio, fname) < 0) {
+        fprintf(stderr, "bdbload: can't create %s.\n", fname);
+        nio_finalize(nio);
+        return 1;
+    }
+
+    start = system_time();
+    count = nio_bulk_load(nio, read_item, &in);
+    if (count < 0) {
+        fprintf(stderr, "bdbload: load failed near line %lld.\n", in.lineno);
+        nio_close(nio);
+        nio_finalize(nio);
+        return 1;
+    }
+    nio_close(nio);
+    nio_finalize(nio);
+
+    fprintf(stderr, "bdbload: %d keys loaded in %.3f sec.\n",
+            count, (system_time() - start) / 1000000.0);
+    if (in.fp != stdin)
+        fclose(in.fp);
+    free(in.buf);
+    return 0;
+
+error:
+    fprintf(stderr, "bdbload: illegal property.\n");
+    nio_finalize(nio);
+    return 2;
+}